@@ -55,6 +55,7 @@ int main(int argc, const char *argv[])
 	switch(ntohl(signature))
 	{
 	case OBJECTMAGIC_FILE_MAGIC_VALUE_V1:
+	case OBJECTMAGIC_FILE_MAGIC_VALUE_V2:
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 	case OBJECTMAGIC_FILE_MAGIC_VALUE_V0:
 #endif
@@ -0,0 +1,345 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    bbstoreload.cpp
+//		Purpose: Load generator for bbstored, simulating many clients
+//			 reading from the store at the same time
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <sstream>
+#include <vector>
+
+#include "autogen_BackupProtocol.h"
+#include "BackupDaemonConfigVerify.h"
+#include "BackupStoreConstants.h"
+#include "BackupStoreDirectory.h"
+#include "BackupStoreException.h"
+#include "BannerText.h"
+#include "BoxPortsAndFiles.h"
+#include "BoxTime.h"
+#include "Configuration.h"
+#include "Logging.h"
+#include "MainHelper.h"
+#include "SSLLib.h"
+#include "SocketStreamTLS.h"
+#include "Thread.h"
+#include "TLSContext.h"
+
+#include "MemLeakFindOn.h"
+
+void PrintUsageAndExit()
+{
+	std::ostringstream out;
+	out <<
+		"Usage: bbstoreload [options]\n"
+		"\n"
+		"Connects to the store named in a bbackupd configuration file\n"
+		"from several simulated clients at once. Each client repeatedly\n"
+		"logs in read-only, lists directories starting from the root,\n"
+		"and logs out.\n"
+		"\n"
+		"Options:\n"
+		"  -c <file>  Use the specified configuration file, instead of\n"
+		"             [" << BOX_GET_DEFAULT_BBACKUPD_CONFIG_FILE << "]\n"
+		"  -n <num>   Number of concurrent clients (default 10)\n"
+		"  -s <num>   Number of sessions per client (default 10)\n"
+		"  -d <num>   Number of directories to list per session (default 10)\n"
+		<<
+		Logging::OptionParser::GetUsageString();
+	printf("%s", out.str().c_str());
+	exit(2);
+}
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    LoadStats
+//		Purpose: Session timings collected from all the clients
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class LoadStats
+{
+public:
+	LoadStats()
+	: mSessions(0),
+	  mFailures(0),
+	  mDirectories(0),
+	  mTotalLatency(0),
+	  mMaxLatency(0)
+	{ }
+
+	void AddSession(box_time_t Latency, int Directories)
+	{
+		MutexLock lock(mMutex);
+		mSessions++;
+		mDirectories += Directories;
+		mTotalLatency += Latency;
+		if(Latency > mMaxLatency)
+		{
+			mMaxLatency = Latency;
+		}
+	}
+
+	void AddFailure()
+	{
+		MutexLock lock(mMutex);
+		mFailures++;
+	}
+
+	Mutex mMutex;
+	int64_t mSessions;
+	int64_t mFailures;
+	int64_t mDirectories;
+	box_time_t mTotalLatency;
+	box_time_t mMaxLatency;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    LoadClient
+//		Purpose: One simulated client, which runs its sessions one
+//			 after another
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class LoadClient : public Thread
+{
+public:
+	LoadClient(const Configuration &rConfig, TLSContext &rTLSContext,
+		LoadStats &rStats, int Sessions, int Directories)
+	: mrConfig(rConfig),
+	  mrTLSContext(rTLSContext),
+	  mrStats(rStats),
+	  mSessions(Sessions),
+	  mDirectories(Directories)
+	{ }
+
+	void RunSessions()
+	{
+		for(int i = 0; i < mSessions; i++)
+		{
+			box_time_t start = GetCurrentBoxTime();
+			try
+			{
+				int listed = RunSession();
+				mrStats.AddSession(GetCurrentBoxTime() - start,
+					listed);
+			}
+			catch(std::exception &e)
+			{
+				BOX_ERROR("Session failed: " << e.what());
+				mrStats.AddFailure();
+			}
+		}
+	}
+
+protected:
+	virtual void Run()
+	{
+		RunSessions();
+	}
+
+private:
+	int RunSession()
+	{
+		SocketStreamTLS *pSocket = new SocketStreamTLS;
+		std::auto_ptr<SocketStream> apSocket(pSocket);
+		pSocket->Open(mrTLSContext, Socket::TypeINET,
+			mrConfig.GetKeyValue("StoreHostname"),
+			mrConfig.GetKeyValueInt("StorePort"));
+
+		BackupProtocolClient connection(apSocket);
+		connection.Handshake();
+
+		std::auto_ptr<BackupProtocolVersion> serverVersion(
+			connection.QueryVersion(BACKUP_STORE_SERVER_VERSION));
+		if(serverVersion->GetVersion() != BACKUP_STORE_SERVER_VERSION)
+		{
+			THROW_EXCEPTION(BackupStoreException, WrongServerVersion)
+		}
+
+		connection.QueryLogin(mrConfig.GetKeyValueUint32("AccountNumber"),
+			BackupProtocolLogin::Flags_ReadOnly);
+
+		// List directories breadth first from the root, which is
+		// what a restore or compare does
+		std::deque<int64_t> toList;
+		toList.push_back(BACKUPSTORE_ROOT_DIRECTORY_ID);
+		int listed = 0;
+
+		while(!toList.empty() && listed < mDirectories)
+		{
+			int64_t dirID = toList.front();
+			toList.pop_front();
+
+			connection.QueryListDirectory(dirID,
+				BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+				BackupProtocolListDirectory::Flags_EXCLUDE_NOTHING,
+				true /* want attributes */);
+			BackupStoreDirectory dir;
+			std::auto_ptr<IOStream> dirstream(
+				connection.ReceiveStream());
+			dir.ReadFromStream(*dirstream, connection.GetTimeout());
+			listed++;
+
+			BackupStoreDirectory::Iterator i(dir);
+			BackupStoreDirectory::Entry *en;
+			while((en = i.Next(BackupStoreDirectory::Entry::Flags_Dir))
+				!= 0)
+			{
+				toList.push_back(en->GetObjectID());
+			}
+		}
+
+		connection.QueryFinished();
+		return listed;
+	}
+
+	const Configuration &mrConfig;
+	TLSContext &mrTLSContext;
+	LoadStats &mrStats;
+	int mSessions;
+	int mDirectories;
+};
+
+int main(int argc, const char *argv[])
+{
+	MAINHELPER_SETUP_MEMORY_LEAK_EXIT_REPORT("bbstoreload.memleaks",
+		"bbstoreload")
+
+	MAINHELPER_START
+
+	std::string configFilename(BOX_GET_DEFAULT_BBACKUPD_CONFIG_FILE);
+	int clients = 10, sessions = 10, directories = 10;
+
+	std::string options("c:n:s:d:");
+	options += Logging::OptionParser::GetOptionString();
+	Logging::OptionParser LogLevel;
+
+	int c;
+	while((c = getopt(argc, (char * const *)argv, options.c_str())) != -1)
+	{
+		switch(c)
+		{
+		case 'c':
+			configFilename = optarg;
+			break;
+
+		case 'n':
+			clients = atoi(optarg);
+			break;
+
+		case 's':
+			sessions = atoi(optarg);
+			break;
+
+		case 'd':
+			directories = atoi(optarg);
+			break;
+
+		default:
+			int ret = LogLevel.ProcessOption(c);
+			if (ret != 0)
+			{
+				PrintUsageAndExit();
+			}
+		}
+	}
+
+	if(optind != argc || clients < 1 || sessions < 1 || directories < 1)
+	{
+		PrintUsageAndExit();
+	}
+
+	Logging::GetConsole().Filter(LogLevel.GetCurrentLevel());
+	BOX_NOTICE(BANNER_TEXT("Backup Store Load Generator"));
+
+	std::string errs;
+	std::auto_ptr<Configuration> config(
+		Configuration::LoadAndVerify
+			(configFilename, &BackupDaemonConfigVerify, errs));
+
+	if(config.get() == 0 || !errs.empty())
+	{
+		BOX_FATAL("Invalid configuration file: " << errs);
+		return 1;
+	}
+	const Configuration &conf(*config);
+
+	SSLLib::Initialise();
+	TLSContext tlsContext;
+	tlsContext.Initialise(false /* as client */,
+		conf.GetKeyValue("CertificateFile").c_str(),
+		conf.GetKeyValue("PrivateKeyFile").c_str(),
+		conf.GetKeyValue("TrustedCAsFile").c_str(),
+		conf.GetKeyValueInt("SSLSecurityLevel"));
+
+	LoadStats stats;
+	std::vector<LoadClient *> loadClients;
+	for(int i = 0; i < clients; i++)
+	{
+		loadClients.push_back(new LoadClient(conf, tlsContext, stats,
+			sessions, directories));
+	}
+
+	box_time_t start = GetCurrentBoxTime();
+
+	if(Thread::IsSupported())
+	{
+		for(int i = 0; i < clients; i++)
+		{
+			loadClients[i]->Start();
+		}
+		for(int i = 0; i < clients; i++)
+		{
+			loadClients[i]->Join();
+		}
+	}
+	else
+	{
+		BOX_WARNING("Threads are not supported on this platform, "
+			"running clients one at a time");
+		for(int i = 0; i < clients; i++)
+		{
+			loadClients[i]->RunSessions();
+		}
+	}
+
+	box_time_t elapsed = GetCurrentBoxTime() - start;
+
+	for(int i = 0; i < clients; i++)
+	{
+		delete loadClients[i];
+	}
+
+	double seconds = BoxTimeToMilliSeconds(elapsed) / 1000.0;
+	printf("%d clients, %lld sessions in %.3f seconds (%.1f sessions/s), "
+		"%lld directories listed, %lld failed\n", clients,
+		(long long)stats.mSessions, seconds,
+		(seconds > 0) ? stats.mSessions / seconds : 0.0,
+		(long long)stats.mDirectories, (long long)stats.mFailures);
+	if(stats.mSessions > 0)
+	{
+		printf("Session latency: mean %lld ms, max %lld ms\n",
+			(long long)BoxTimeToMilliSeconds(stats.mTotalLatency /
+				stats.mSessions),
+			(long long)BoxTimeToMilliSeconds(stats.mMaxLatency));
+	}
+
+	return (stats.mFailures == 0) ? 0 : 1;
+
+	MAINHELPER_END
+}
@@ -103,6 +103,11 @@ esac
 
 AC_CHECK_HEADER([zlib.h],, [AC_MSG_ERROR([[cannot find zlib.h]])])
 AC_CHECK_LIB([z], [zlibVersion],, [AC_MSG_ERROR([[cannot find zlib]])])
+
+## zstd and LZ4 are optional, and give faster compression of file data
+AC_CHECK_HEADER([zstd.h], [AC_CHECK_LIB([zstd], [ZSTD_compressCCtx])])
+AC_CHECK_HEADER([lz4.h], [AC_CHECK_LIB([lz4], [LZ4_compress_fast_extState])])
+
 VL_LIB_READLINE([have_libreadline=yes], [have_libreadline=no])
 AC_CHECK_FUNCS([rl_filename_completion_function])
 
@@ -146,6 +151,13 @@ Upgrade or read the documentation for alternatives]])
 AC_CHECK_FUNCS([SSL_CTX_set_security_level], [HAVE_SSL_CTX_SET_SECURITY_LEVEL=1])
 AC_SUBST([HAVE_SSL_CTX_SET_SECURITY_LEVEL])
 
+## Check for POSIX threads, used to encode file data on several processors
+AC_CHECK_HEADERS([pthread.h], [have_pthread_h=yes])
+if test "x$have_pthread_h" = "xyes"; then
+  AC_SEARCH_LIBS([pthread_create], [pthread],
+    [AC_DEFINE([HAVE_PTHREAD], 1, [Define to 1 if POSIX threads are available])])
+fi
+
 ### Checks for header files.
 
 AC_HEADER_STDC
@@ -153,7 +165,7 @@ AC_HEADER_SYS_WAIT
 AC_CHECK_HEADERS([cxxabi.h dirent.h dlfcn.h fcntl.h getopt.h netdb.h process.h pwd.h signal.h])
 AC_CHECK_HEADERS([syslog.h time.h unistd.h])
 AC_CHECK_HEADERS([netinet/in.h netinet/tcp.h])
-AC_CHECK_HEADERS([sys/file.h sys/param.h sys/poll.h sys/socket.h sys/stat.h sys/time.h])
+AC_CHECK_HEADERS([sys/file.h sys/mman.h sys/param.h sys/poll.h sys/socket.h sys/stat.h sys/time.h])
 AC_CHECK_HEADERS([sys/types.h sys/uio.h sys/un.h sys/wait.h sys/xattr.h])
 AC_CHECK_HEADERS([sys/ucred.h],,, [
 	#ifdef HAVE_SYS_PARAM_H
@@ -298,8 +310,9 @@ AC_FUNC_CLOSEDIR_VOID
 AC_FUNC_ERROR_AT_LINE
 AC_TYPE_SIGNAL
 AC_FUNC_STAT
-AC_CHECK_FUNCS([ftruncate getpeereid getpeername getpid gettimeofday lchown])
-AC_CHECK_FUNCS([setproctitle utimensat])
+AC_CHECK_FUNCS([ftruncate getpeereid getpeername getpid gettimeofday lchown mmap])
+AC_CHECK_FUNCS([setproctitle utimensat copy_file_range epoll_create1 inotify_init1])
+AC_CHECK_FUNCS([dirfd fstatat])
 AC_SEARCH_LIBS([setproctitle], [bsd])
 
 # NetBSD implements kqueue too differently for us to get it fixed by 0.10
@@ -68,11 +68,19 @@ void BackupClientCryptoKeys_Setup(const std::string& rKeyMaterialFilename)
 		KeyMaterial + BACKUPCRYPTOKEYS_FILE_BLOCK_ENTRY_KEY_START,
 		BACKUPCRYPTOKEYS_FILE_BLOCK_ENTRY_KEY_LENGTH);
 
+	// Setup secret for block hashing
+	BackupStoreFile::SetBlockHashSecret(
+		KeyMaterial + BACKUPCRYPTOKEYS_BLOCK_HASH_SECRET_START,
+		BACKUPCRYPTOKEYS_BLOCK_HASH_SECRET_LENGTH);
+
 #ifndef HAVE_OLD_SSL
 	// Use AES where available
 	BackupStoreFile::SetAESKey(
 		KeyMaterial + BACKUPCRYPTOKEYS_FILE_AES_KEY_START,
 		BACKUPCRYPTOKEYS_FILE_AES_KEY_LENGTH);
+	BackupStoreFile::SetAESGCMKey(
+		KeyMaterial + BACKUPCRYPTOKEYS_FILE_AES_GCM_KEY_START,
+		BACKUPCRYPTOKEYS_FILE_AES_GCM_KEY_LENGTH);
 #endif
 
 	// Wipe the key material from memory
@@ -48,6 +48,15 @@
 #define BACKUPCRYPTOKEYS_FILE_AES_KEY_START				(BACKUPCRYPTOKEYS_ATTRIBUTE_HASH_SECRET_START+128)
 #define BACKUPCRYPTOKEYS_FILE_AES_KEY_LENGTH			32
 
+// AES key for authenticated encryption of file data with AES-GCM, in the
+// gap after the AES key above, so that the two modes don't share a key
+#define BACKUPCRYPTOKEYS_FILE_AES_GCM_KEY_START			(BACKUPCRYPTOKEYS_FILE_AES_KEY_START+32)
+#define BACKUPCRYPTOKEYS_FILE_AES_GCM_KEY_LENGTH		32
+
+// Secret for hashing blocks of file data, to find them in the store
+#define BACKUPCRYPTOKEYS_BLOCK_HASH_SECRET_START		(BACKUPCRYPTOKEYS_FILE_AES_KEY_START+64)
+#define BACKUPCRYPTOKEYS_BLOCK_HASH_SECRET_LENGTH		128
+
 
 void BackupClientCryptoKeys_Setup(const std::string& rKeyMaterialFilename);
 
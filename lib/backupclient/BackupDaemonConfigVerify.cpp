@@ -138,6 +138,43 @@ static const ConfigurationVerifyKey verifyrootkeys[] =
 	ConfigurationVerifyKey("TcpNice", ConfigTest_IsBool, false),
 	// optional enable of tcp nice/background mode
 
+	ConfigurationVerifyKey("AdaptiveCompression", ConfigTest_IsBool, true),
+	// don't compress file data which doesn't look compressible
+
+	ConfigurationVerifyKey("CompressionCodec", 0, "zlib"),
+	// codec to compress file data with: zlib, zstd or lz4
+	ConfigurationVerifyKey("CompressionLevel", ConfigTest_IsInt),
+	// optional level for the codec, which zstd and zlib use
+	ConfigurationVerifyKey("AuthenticatedEncryption", ConfigTest_IsBool, false),
+	// encrypt file data with AES-GCM, which also detects any changes
+
+	ConfigurationVerifyKey("EncodingThreads", ConfigTest_IsInt),
+	// optional number of threads to compress and encrypt file data
+
+	ConfigurationVerifyKey("ContentDefinedChunking", ConfigTest_IsBool, false),
+	// cut files into chunks at content-defined boundaries when uploading
+
+	ConfigurationVerifyKey("DeduplicateBlocks", ConfigTest_IsBool, false),
+	// diff new files against others in the store with the same blocks
+
+	ConfigurationVerifyKey("ScannerThreads", ConfigTest_IsInt),
+	// optional number of threads to read directories ahead of the sync
+
+	ConfigurationVerifyKey("UploadConnections", ConfigTest_IsInt),
+	// optional number of connections to the store to upload files with
+
+	ConfigurationVerifyKey("CompactIDMaps", ConfigTest_IsBool, false),
+	// optional, write inode maps in the compact format instead of qdbm
+
+	ConfigurationVerifyKey("BlockIndexCacheSize", ConfigTest_IsInt),
+	// optional size in MB of the cache of block indexes of uploaded files
+
+	ConfigurationVerifyKey("ChangeJournal", ConfigTest_IsBool, false),
+	// optional, only scan directories which inotify saw change
+
+	ConfigurationVerifyKey("ChangeJournalFullScanInterval", ConfigTest_IsInt),
+	// optional seconds between full scans with the change journal
+
 	ConfigurationVerifyKey("KeysFile", ConfigTest_Exists),
 	ConfigurationVerifyKey("DataDirectory", ConfigTest_Exists),
 
@@ -158,7 +158,7 @@ void BackupStoreFile::DumpFile(void *clibFileHandle, bool ToTrace, IOStream &rFi
 	}
 
 	// Check and output header info
-	if(hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 		&& hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_MAGIC_VALUE_V0))
 	{
 		OutputLine(file, ToTrace, "File header doesn't have the correct magic, aborting dump\n");
@@ -187,7 +187,7 @@ void BackupStoreFile::DumpFile(void *clibFileHandle, bool ToTrace, IOStream &rFi
 	// Read in header
 	file_BlockIndexHeader bhdr;
 	rFile.ReadFullBuffer(&bhdr, sizeof(bhdr), 0);
-	if(bhdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(bhdr.mMagicValue))
 		&& bhdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0))
 	{
 		OutputLine(file, ToTrace, "WARNING: Block header doesn't have the correct magic\n");
@@ -20,11 +20,11 @@
 #include "BackupStoreDirectory.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileWire.h"
 #include "BackupStoreInfo.h"
 #include "BufferedStream.h"
 #include "CollectInBufferStream.h"
 #include "FileStream.h"
-#include "InvisibleTempFileStream.h"
 #include "RaidFileController.h"
 #include "StreamableMemBlock.h"
 
@@ -75,6 +75,10 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolReplyable::HandleException(Bo
 		{
 			return PROTOCOL_ERROR(Err_FileDoesNotVerify);
 		}
+		else if(e.GetSubType() == BackupStoreException::BlockHashesDoNotMatchFile)
+		{
+			return PROTOCOL_ERROR(Err_FileDoesNotVerify);
+		}
 		else if(e.GetSubType() == BackupStoreException::AddedFileExceedsStorageLimit)
 		{
 			return PROTOCOL_ERROR(Err_StorageLimitExceeded);
@@ -119,8 +123,13 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolVersion::DoCommand(BackupProt
 {
 	CHECK_PHASE(Phase_Version)
 
-	// Correct version?
-	if(mVersion != BACKUP_STORE_SERVER_VERSION)
+	// Correct version? We run commands in order whether or not the
+	// client pipelines them, and accept data channel logins and block
+	// searches whichever version was asked for, so any of them is fine.
+	if(mVersion != BACKUP_STORE_SERVER_VERSION &&
+		mVersion != BACKUP_STORE_SERVER_VERSION_PIPELINED &&
+		mVersion != BACKUP_STORE_SERVER_VERSION_DATA_CHANNELS &&
+		mVersion != BACKUP_STORE_SERVER_VERSION_BLOCK_DEDUP)
 	{
 		return PROTOCOL_ERROR(Err_WrongVersion);
 	}
@@ -128,8 +137,8 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolVersion::DoCommand(BackupProt
 	// Mark the next phase
 	rContext.SetPhase(BackupStoreContext::Phase_Login);
 
-	// Return our version
-	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolVersion(BACKUP_STORE_SERVER_VERSION));
+	// Return the version agreed
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolVersion(mVersion));
 }
 
 // --------------------------------------------------------------------------
@@ -162,8 +171,15 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolLogin::DoCommand(BackupProtoc
 		return PROTOCOL_ERROR(Err_BadLogin);
 	}
 
+	// Data channels only stage files for the read/write session to
+	// store, so they don't need the lock
+	bool dataChannel = (mFlags & Flags_DataChannel) == Flags_DataChannel;
+	if(dataChannel)
+	{
+		rContext.SetDataChannel();
+	}
 	// If we need to write, check that nothing else has got a write lock
-	if((mFlags & Flags_ReadOnly) != Flags_ReadOnly)
+	else if((mFlags & Flags_ReadOnly) != Flags_ReadOnly)
 	{
 		// See if the context will get the lock
 		if(!rContext.AttemptToGetWriteLock())
@@ -175,6 +191,10 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolLogin::DoCommand(BackupProtoc
 
 		// Debug: check we got the lock
 		ASSERT(!rContext.SessionIsReadOnly());
+
+		// Nothing else is using files staged by data channels now,
+		// because the client opens them after this session
+		rContext.DeleteStagedFiles();
 	}
 
 	// Load the store info
@@ -197,7 +217,8 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolLogin::DoCommand(BackupProtoc
 	BOX_NOTICE("Login from Client ID " <<
 		BOX_FORMAT_ACCOUNT(mClientID) << " "
 		"(name=" << rContext.GetAccountName() << "): " <<
-		(((mFlags & Flags_ReadOnly) != Flags_ReadOnly)
+		(dataChannel ? "Data channel" :
+			((mFlags & Flags_ReadOnly) != Flags_ReadOnly)
 			?"Read/Write":"Read-only") << " from " <<
 		rContext.GetConnectionDetails());
 
@@ -305,6 +326,161 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolStoreFile::DoCommand(
 	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolSuccess(id));
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupProtocolStageFile::DoCommand(Protocol &, BackupStoreContext &)
+//		Purpose: Command to upload a file on a data channel, for
+//			 the read/write session to store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolMessage> BackupProtocolStageFile::DoCommand(
+	BackupProtocolReplyable &rProtocol, BackupStoreContext &rContext,
+	IOStream& rDataStream) const
+{
+	CHECK_PHASE(Phase_Commands)
+
+	if(!rContext.SessionIsDataChannel())
+	{
+		BOX_ERROR("Received command " << ToString() << " "
+			"in a session which is not a data channel");
+		return PROTOCOL_ERROR(Err_NotDataChannel);
+	}
+
+	std::auto_ptr<BackupProtocolMessage> hookResult =
+		rContext.StartCommandHook(*this);
+	if(hookResult.get())
+	{
+		return hookResult;
+	}
+
+	int64_t id = rContext.StageFile(rDataStream);
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolSuccess(id));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupProtocolStoreStagedFile::DoCommand(Protocol &, BackupStoreContext &)
+//		Purpose: Command to store a file uploaded on a data channel
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolMessage> BackupProtocolStoreStagedFile::DoCommand(
+	BackupProtocolReplyable &rProtocol, BackupStoreContext &rContext) const
+{
+	CHECK_PHASE(Phase_Commands)
+	CHECK_WRITEABLE_SESSION
+
+	std::auto_ptr<BackupProtocolMessage> hookResult =
+		rContext.StartCommandHook(*this);
+	if(hookResult.get())
+	{
+		return hookResult;
+	}
+
+	int64_t id = rContext.AddStagedFile(mStagedFileID, mDirectoryObjectID,
+		mModificationTime, mAttributesHash, mFilename);
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolSuccess(id));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static ReadBlockHashes(IOStream &, std::vector<file_BlockHash> &)
+//		Purpose: Read block hashes until the end of the stream.
+//			 Returns false if it ends part way through one.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool ReadBlockHashes(IOStream &rStream,
+	std::vector<file_BlockHash> &rHashesOut)
+{
+	file_BlockHash hash;
+	int bytesRead = 0;
+	while(rStream.ReadFullBuffer(&hash, sizeof(hash), &bytesRead))
+	{
+		rHashesOut.push_back(hash);
+		bytesRead = 0;
+	}
+	return bytesRead == 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupProtocolFindBlocks::DoCommand(Protocol &, BackupStoreContext &)
+//		Purpose: Command to find blocks already in the store, by
+//			 their hashes
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolMessage> BackupProtocolFindBlocks::DoCommand(
+	BackupProtocolReplyable &rProtocol, BackupStoreContext &rContext,
+	IOStream& rDataStream) const
+{
+	CHECK_PHASE(Phase_Commands)
+	CHECK_WRITEABLE_SESSION
+
+	std::vector<file_BlockHash> hashes;
+	if(!ReadBlockHashes(rDataStream, hashes))
+	{
+		return PROTOCOL_ERROR(Err_FileDoesNotVerify);
+	}
+
+	std::vector<file_BlockLocation> locations;
+	rContext.FindBlocks(hashes, locations);
+
+	std::auto_ptr<CollectInBufferStream> stream(new CollectInBufferStream);
+	int found = 0;
+	for(std::vector<file_BlockLocation>::iterator i = locations.begin();
+		i != locations.end(); ++i)
+	{
+		if(i->mObjectID != 0)
+		{
+			found++;
+		}
+		file_BlockLocation location;
+		location.mObjectID = box_hton64(i->mObjectID);
+		location.mBlockNumber = box_hton64(i->mBlockNumber);
+		stream->Write(&location, sizeof(location));
+	}
+	stream->SetForReading();
+	rProtocol.SendStreamAfterCommand(
+		static_cast< std::auto_ptr<IOStream> > (stream));
+
+	return std::auto_ptr<BackupProtocolMessage>(
+		new BackupProtocolSuccess(found));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupProtocolAddBlockHashes::DoCommand(Protocol &, BackupStoreContext &)
+//		Purpose: Command to add the hashes of the blocks of a file
+//			 to the index which FindBlocks searches
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolMessage> BackupProtocolAddBlockHashes::DoCommand(
+	BackupProtocolReplyable &rProtocol, BackupStoreContext &rContext,
+	IOStream& rDataStream) const
+{
+	CHECK_PHASE(Phase_Commands)
+	CHECK_WRITEABLE_SESSION
+
+	std::vector<file_BlockHash> hashes;
+	if(!ReadBlockHashes(rDataStream, hashes))
+	{
+		return PROTOCOL_ERROR(Err_FileDoesNotVerify);
+	}
+
+	rContext.AddBlockHashes(mObjectID, hashes);
+	return std::auto_ptr<BackupProtocolMessage>(
+		new BackupProtocolSuccess(mObjectID));
+}
+
 
 
 
@@ -397,54 +573,32 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolGetFile::DoCommand(BackupProt
 		}
 		while(en != 0 && id != 0);
 
-		// OK! The last entry in the chain is the full file, the others are patches back from it.
-		// Open the last one, which is the current from file
-		std::auto_ptr<IOStream> from(rContext.OpenObject(patchChain[patchChain.size() - 1]));
-
-		// Then, for each patch in the chain, do a combine
-		for(int p = ((int)patchChain.size()) - 2; p >= 0; --p)
+		// OK! The last entry in the chain is the full file, the others
+		// are patches back from it. Open them all, and work out which
+		// blocks of which objects make up the version wanted.
+		std::vector<IOStream *> chain;
+		chain.reserve(patchChain.size());
+		try
 		{
-			// ID of patch
-			int64_t patchID = patchChain[p];
-
-			// Open it a couple of times
-			std::auto_ptr<IOStream> diff(rContext.OpenObject(patchID));
-			std::auto_ptr<IOStream> diff2(rContext.OpenObject(patchID));
-
-			// Choose a temporary filename for the result of the combination
-			std::ostringstream fs;
-			fs << rContext.GetAccountRoot() << ".recombinetemp." << p;
-			std::string tempFn =
-				RaidFileController::DiscSetPathToFileSystemPath(
-					rContext.GetStoreDiscSet(), fs.str(),
-					p + 16);
-
-			// Open the temporary file
-			std::auto_ptr<IOStream> combined(
-				new InvisibleTempFileStream(
-					tempFn, O_RDWR | O_CREAT | O_EXCL |
-					O_BINARY | O_TRUNC));
-
-			// Do the combining
-			BackupStoreFile::CombineFile(*diff, *diff2, *from, *combined);
-
-			// Move to the beginning of the combined file
-			combined->Seek(0, IOStream::SeekType_Absolute);
-
-			// Then shuffle round for the next go
-			if (from.get()) from->Close();
-			from = combined;
+			for(size_t p = 0; p < patchChain.size(); ++p)
+			{
+				std::auto_ptr<IOStream> object(
+					rContext.OpenObject(patchChain[p]));
+				chain.push_back(object.release());
+			}
 		}
-
-		// Now, from contains a nice file to send to the client. Reorder it
+		catch(...)
 		{
-			// Write nastily to allow this to work with gcc 2.x
-			std::auto_ptr<IOStream> t(BackupStoreFile::ReorderFileToStreamOrder(from.get(), true /* take ownership */));
-			stream = t;
+			for(size_t p = 0; p < chain.size(); ++p)
+			{
+				delete chain[p];
+			}
+			throw;
 		}
 
-		// Release from file to avoid double deletion
-		from.release();
+		// Write nastily to allow this to work with gcc 2.x
+		std::auto_ptr<IOStream> t(BackupStoreFile::ResolvePatchChain(chain));
+		stream = t;
 	}
 	else
 	{
@@ -907,17 +1061,16 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolGetBlockIndexByName::DoComman
 
 	// Find the latest object ID within it which has the same name
 	int64_t objectID = 0;
-	BackupStoreDirectory::Iterator i(dir);
-	BackupStoreDirectory::Entry *en = 0;
-	while((en = i.Next(BackupStoreDirectory::Entry::Flags_File)) != 0)
+	std::vector<BackupStoreDirectory::Entry *> sameName;
+	dir.FindEntriesByName(mFilename, sameName,
+		BackupStoreDirectory::Entry::Flags_File);
+	for(std::vector<BackupStoreDirectory::Entry *>::iterator
+		i(sameName.begin()); i != sameName.end(); ++i)
 	{
-		if(en->GetName() == mFilename)
+		// Store the ID, if it's a newer ID than the last one
+		if((*i)->GetObjectID() > objectID)
 		{
-			// Store the ID, if it's a newer ID than the last one
-			if(en->GetObjectID() > objectID)
-			{
-				objectID = en->GetObjectID();
-			}
+			objectID = (*i)->GetObjectID();
 		}
 	}
 
@@ -46,7 +46,8 @@ public:
 	  mReadOnly(ReadOnly)
 	{
 		mContext.SetClientHasAccount(AccountRootDir, DiscSetNumber);
-		QueryVersion(BACKUP_STORE_SERVER_VERSION);
+		QueryVersion(BACKUP_STORE_SERVER_VERSION_PIPELINED);
+		SetMaxQueuedQueries(BACKUP_STORE_MAX_PIPELINED_COMMANDS);
 		QueryLogin(AccountNumber,
 			ReadOnly ? BackupProtocolLogin::Flags_ReadOnly : 0);
 	}
@@ -62,7 +63,7 @@ public:
 
 	void Reopen()
 	{
-		QueryVersion(BACKUP_STORE_SERVER_VERSION);
+		QueryVersion(BACKUP_STORE_SERVER_VERSION_PIPELINED);
 		QueryLogin(mAccountNumber,
 			mReadOnly ? BackupProtocolLogin::Flags_ReadOnly : 0);
 	}
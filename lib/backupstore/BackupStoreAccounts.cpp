@@ -514,6 +514,7 @@ int BackupStoreAccountsControl::CheckAccount(int32_t ID, bool FixErrors, bool Qu
 
 	// Check it
 	BackupStoreCheck check(rootDir, discSetNum, ID, FixErrors, Quiet);
+	check.SetNumberOfThreads(mConfig.GetKeyValueInt("CheckThreads"));
 	check.Check();
 
 	if(ReturnNumErrorsFound)
@@ -576,6 +577,8 @@ int BackupStoreAccountsControl::HousekeepAccountNow(int32_t ID)
 	}
 
 	HousekeepStoreAccount housekeeping(ID, rootDir, discSetNum, NULL);
+	housekeeping.SetPackObjectsSmallerThan(
+		(int64_t)mConfig.GetKeyValueInt("PackObjectsSmallerThan") * 1024);
 	bool success = housekeeping.DoHousekeeping();
 
 	if(!success)
@@ -22,7 +22,9 @@
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreJournal.h"
 #include "BackupStoreObjectMagic.h"
+#include "BackupStorePackFile.h"
 #include "BackupStoreRefCountDatabase.h"
 #include "RaidFileController.h"
 #include "RaidFileException.h"
@@ -49,10 +51,15 @@ BackupStoreCheck::BackupStoreCheck(const std::string &rStoreRoot, int DiscSetNum
 	  mAccountID(AccountID),
 	  mFixErrors(FixErrors),
 	  mQuiet(Quiet),
+	  mNumberOfThreads(1),
 	  mNumberErrorsFound(0),
 	  mLastIDInInfo(0),
 	  mpInfoLastBlock(0),
 	  mInfoLastBlockEntries(0),
+	  mNextObjectsDir(0),
+	  mMaxObjectsDir(0),
+	  mObjectsDirsAddedUpTo(0),
+	  mStopCheckingObjects(false),
 	  mLostDirNameSerial(0),
 	  mLostAndFoundDirectoryID(0),
 	  mBlocksUsed(0),
@@ -136,6 +143,9 @@ void BackupStoreCheck::Check()
 	}
 	CheckObjects();
 
+	// Every object which can be referenced has now been found
+	mapNewRefs->Reserve(mLastIDInInfo);
+
 	// Phase 2, check directories
 	if(!mQuiet)
 	{
@@ -197,6 +207,10 @@ void BackupStoreCheck::Check()
 	if(mFixErrors)
 	{
 		mapNewRefs->Commit();
+
+		// Fixing errors may have changed any directory, so
+		// housekeeping must scan all of them next time
+		BackupStoreJournal::Remove(account);
 	}
 	else
 	{
@@ -318,10 +332,224 @@ void BackupStoreCheck::CheckObjects()
 			BOX_FORMAT_OBJECTID(maxDir));
 	}
 
+	int numberOfThreads = mNumberOfThreads;
+	if(numberOfThreads <= 0)
+	{
+		numberOfThreads = Thread::GetNumberOfProcessors();
+	}
+	int64_t numberOfDirs = (maxDir >> STORE_ID_SEGMENT_LENGTH) + 1;
+	if(numberOfThreads > numberOfDirs)
+	{
+		numberOfThreads = numberOfDirs;
+	}
+
+	if(numberOfThreads > 1 && Thread::IsSupported())
+	{
+		CheckObjectsOnThreads(maxDir, numberOfThreads);
+		return;
+	}
+
 	// Then go through and scan all the objects within those directories
 	for(int64_t d = 0; d <= maxDir; d += (1<<STORE_ID_SEGMENT_LENGTH))
 	{
-		CheckObjectsDir(d);
+		CheckedObjectsDir result;
+		CheckObjectsDir(d, result);
+		AddCheckedObjects(result);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreCheck::CheckObjectsThread
+//		Purpose: Checks directories of objects for CheckObjects()
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreCheck::CheckObjectsThread : public Thread
+{
+public:
+	CheckObjectsThread(BackupStoreCheck &rCheck)
+	: mrCheck(rCheck)
+	{
+	}
+
+protected:
+	virtual void Run()
+	{
+		mrCheck.CheckObjectsThreadMain();
+	}
+
+private:
+	BackupStoreCheck &mrCheck;
+};
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::CheckObjectsOnThreads(int64_t, int)
+//		Purpose: Check the objects in all the directories up to the
+//			 one with the given starting ID, on a number of
+//			 threads, so that reading the objects from the discs
+//			 overlaps with verifying them. The results are added
+//			 to the list of IDs here, in order of object ID, and
+//			 the threads are held back if they get too far ahead.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::CheckObjectsOnThreads(int64_t MaxDir,
+	int NumberOfThreads)
+{
+	mNextObjectsDir = 0;
+	mMaxObjectsDir = MaxDir;
+	mObjectsDirsAddedUpTo = 0;
+	mStopCheckingObjects = false;
+
+	std::vector<CheckObjectsThread *> threads;
+	try
+	{
+		for(int t = 0; t < NumberOfThreads; ++t)
+		{
+			std::auto_ptr<CheckObjectsThread> apThread(
+				new CheckObjectsThread(*this));
+			apThread->Start();
+			threads.push_back(apThread.release());
+		}
+	}
+	catch(BoxException &e)
+	{
+		// Carry on with the threads already running, if any
+		BOX_WARNING("Failed to start thread to check objects: " <<
+			e.what());
+	}
+
+	BOX_TRACE("Checking objects on " << threads.size() << " threads");
+
+	try
+	{
+		for(int64_t d = 0; d <= MaxDir;
+			d += (1<<STORE_ID_SEGMENT_LENGTH))
+		{
+			std::auto_ptr<CheckedObjectsDir> apResult;
+			{
+				MutexLock lock(mObjectsMutex);
+				std::map<int64_t, CheckedObjectsDir *>::iterator
+					i(mCheckedObjectsDirs.find(d));
+				while(i == mCheckedObjectsDirs.end() &&
+					!threads.empty())
+				{
+					mObjectsDirChecked.Wait(mObjectsMutex);
+					i = mCheckedObjectsDirs.find(d);
+				}
+
+				if(i != mCheckedObjectsDirs.end())
+				{
+					apResult.reset(i->second);
+					mCheckedObjectsDirs.erase(i);
+				}
+				mObjectsDirsAddedUpTo =
+					d + (1<<STORE_ID_SEGMENT_LENGTH);
+				mObjectsDirAdded.Broadcast();
+			}
+
+			if(apResult.get() == 0 || apResult->mFailed)
+			{
+				// No thread was started, or it threw an
+				// exception, which should be thrown from here
+				apResult.reset(new CheckedObjectsDir);
+				CheckObjectsDir(d, *apResult);
+			}
+
+			AddCheckedObjects(*apResult);
+		}
+	}
+	catch(...)
+	{
+		{
+			MutexLock lock(mObjectsMutex);
+			mStopCheckingObjects = true;
+			mObjectsDirAdded.Broadcast();
+		}
+		for(std::vector<CheckObjectsThread *>::iterator
+			i = threads.begin(); i != threads.end(); ++i)
+		{
+			(*i)->Join();
+			delete *i;
+		}
+		for(std::map<int64_t, CheckedObjectsDir *>::iterator
+			i = mCheckedObjectsDirs.begin();
+			i != mCheckedObjectsDirs.end(); ++i)
+		{
+			delete i->second;
+		}
+		mCheckedObjectsDirs.clear();
+		throw;
+	}
+
+	// All directories have been taken, so the threads have finished
+	for(std::vector<CheckObjectsThread *>::iterator i = threads.begin();
+		i != threads.end(); ++i)
+	{
+		(*i)->Join();
+		delete *i;
+	}
+	ASSERT(mCheckedObjectsDirs.empty());
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::CheckObjectsThreadMain()
+//		Purpose: Run by each thread started by
+//			 CheckObjectsOnThreads(). Takes the next directory to
+//			 check, until there are none left.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::CheckObjectsThreadMain()
+{
+	while(true)
+	{
+		std::auto_ptr<CheckedObjectsDir> apResult(
+			new CheckedObjectsDir);
+		int64_t startID;
+		{
+			MutexLock lock(mObjectsMutex);
+			while(!mStopCheckingObjects &&
+				mNextObjectsDir <= mMaxObjectsDir &&
+				mNextObjectsDir >= mObjectsDirsAddedUpTo +
+				((int64_t)BACKUPSTORECHECK_MAX_DIRS_AHEAD <<
+					STORE_ID_SEGMENT_LENGTH))
+			{
+				mObjectsDirAdded.Wait(mObjectsMutex);
+			}
+
+			if(mStopCheckingObjects ||
+				mNextObjectsDir > mMaxObjectsDir)
+			{
+				return;
+			}
+
+			startID = mNextObjectsDir;
+			mNextObjectsDir += (1<<STORE_ID_SEGMENT_LENGTH);
+		}
+
+		try
+		{
+			CheckObjectsDir(startID, *apResult);
+		}
+		catch(...)
+		{
+			// It will be checked again by the main thread
+			apResult->mFailed = true;
+		}
+
+		MutexLock lock(mObjectsMutex);
+		mCheckedObjectsDirs[startID] = apResult.release();
+		mObjectsDirChecked.Signal();
 	}
 }
 
@@ -408,13 +636,17 @@ int64_t BackupStoreCheck::CheckObjectsScanDir(int64_t StartID, int Level, const
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreCheck::CheckObjectsDir(int64_t)
+//		Name:    BackupStoreCheck::CheckObjectsDir(int64_t,
+//			 CheckedObjectsDir &)
 //		Purpose: Check all the files within this directory which has
-//			 the given starting ID.
+//			 the given starting ID, and return the good ones in
+//			 rResult. May be called on any thread, so must not
+//			 change any members.
 //		Created: 22/4/04
 //
 // --------------------------------------------------------------------------
-void BackupStoreCheck::CheckObjectsDir(int64_t StartID)
+void BackupStoreCheck::CheckObjectsDir(int64_t StartID,
+	CheckedObjectsDir &rResult)
 {
 	// Make directory name -- first generate the filename of an entry in it
 	std::string dirName;
@@ -444,6 +676,8 @@ void BackupStoreCheck::CheckObjectsDir(int64_t StartID)
 		idsPresent[l] = false;
 	}
 
+	bool packPresent = false;
+
 	// Parse each entry, building up a list of object IDs which are present in the dir.
 	// This is done so that whatever order is retured from the directory, objects are scanned
 	// in order.
@@ -458,14 +692,23 @@ void BackupStoreCheck::CheckObjectsDir(int64_t StartID)
 			// Filename is valid, mark as existing
 			idsPresent[n] = true;
 		}
+		// Any directory may have a pack of small objects
+		else if(*i == STORE_PACK_FILENAME)
+		{
+			packPresent = true;
+		}
 		// No other files should be present in subdirectories
 		else if(StartID != 0)
 		{
 			fileOK = false;
 		}
-		// info and refcount databases are OK in the root directory
+		// info and refcount databases, the block index and the
+		// housekeeping journal are OK
+		// in the root directory
 		else if(*i == "info" || *i == "refcount.db" ||
-			*i == "refcount.rdb" || *i == "refcount.rdbX")
+			*i == "refcount.rdb" || *i == "refcount.rdbX" ||
+			*i == "dedup.idx" || *i == "dedup.idxX" ||
+			*i == "journal.log" || *i == "journal.logX")
 		{
 			fileOK = true;
 		}
@@ -480,7 +723,7 @@ void BackupStoreCheck::CheckObjectsDir(int64_t StartID)
 			BOX_ERROR("Spurious file " << dirName <<
 				DIRECTORY_SEPARATOR << (*i) << " found" <<
 				(mFixErrors?", deleting":""));
-			++mNumberErrorsFound;
+			++rResult.mNumberErrorsFound;
 			if(mFixErrors)
 			{
 				RaidFileWrite del(mDiscSetNumber, dirName + DIRECTORY_SEPARATOR + *i);
@@ -489,84 +732,240 @@ void BackupStoreCheck::CheckObjectsDir(int64_t StartID)
 		}
 	}
 
-	// Check all the objects found in this directory
+	// Read the index of the pack, if there is one
+	std::string packFilename(dirName + DIRECTORY_SEPARATOR
+		STORE_PACK_FILENAME);
+	std::auto_ptr<RaidFileRead> pack;
+	std::vector<pack_Entry> packIndex;
+	if(packPresent)
+	{
+		try
+		{
+			pack = RaidFileRead::Open(mDiscSetNumber, packFilename);
+			BackupStorePackFile::ReadIndex(*pack, packIndex);
+		}
+		catch(BoxException &e)
+		{
+			BOX_ERROR("Corrupted pack " << packFilename <<
+				" found" << (mFixErrors?", deleting":"") <<
+				": " << e.what());
+			++rResult.mNumberErrorsFound;
+			pack.reset();
+			packIndex.clear();
+			packPresent = false;
+			if(mFixErrors)
+			{
+				RaidFileWrite del(mDiscSetNumber, packFilename);
+				del.Delete();
+			}
+		}
+	}
+
+	// Packed objects by position in this directory, and the ones which
+	// must be removed from the pack
+	const pack_Entry *packed[(1<<STORE_ID_SEGMENT_LENGTH)];
+	for(int l = 0; l < (1<<STORE_ID_SEGMENT_LENGTH); ++l)
+	{
+		packed[l] = 0;
+	}
+	std::set<int64_t> badPacked;
+	for(std::vector<pack_Entry>::const_iterator i(packIndex.begin());
+		i != packIndex.end(); ++i)
+	{
+		if((i->mObjectID & ~(int64_t)STORE_ID_SEGMENT_MASK) != StartID)
+		{
+			BOX_ERROR("Pack " << packFilename << " contains "
+				"object " << BOX_FORMAT_OBJECTID(i->mObjectID) <<
+				" from another directory" <<
+				(mFixErrors?", removing":""));
+			++rResult.mNumberErrorsFound;
+			badPacked.insert(i->mObjectID);
+			continue;
+		}
+		packed[i->mObjectID & STORE_ID_SEGMENT_MASK] = &(*i);
+	}
+
+	// Check all the objects found in this directory. An object stored
+	// on its own supersedes any copy in the pack.
 	for(int i = 0; i < (1<<STORE_ID_SEGMENT_LENGTH); ++i)
 	{
-		if(idsPresent[i])
+		if(!idsPresent[i] && packed[i] != 0)
+		{
+			// Check the packed object is OK, and add entry
+			CheckedObject object;
+			bool objectOK = false;
+			try
+			{
+				std::auto_ptr<IOStream> data(
+					BackupStorePackFile::ReadObject(*pack,
+						*packed[i]));
+				objectOK = CheckObjectStream(StartID | i, *data,
+					packed[i]->mSizeInBlocks, object);
+			}
+			catch(...)
+			{
+				objectOK = false;
+			}
+
+			if(objectOK)
+			{
+				rResult.mObjects.push_back(object);
+			}
+			else
+			{
+				BOX_ERROR("Corrupted object " <<
+					BOX_FORMAT_OBJECTID(StartID | i) <<
+					" found in pack " << packFilename <<
+					(mFixErrors?", removing":""));
+				++rResult.mNumberErrorsFound;
+				badPacked.insert(StartID | i);
+			}
+		}
+		else if(idsPresent[i])
 		{
 			// Check the object is OK, and add entry
 			char leaf[8];
 			::snprintf(leaf, sizeof(leaf),
 				DIRECTORY_SEPARATOR "o%02x", i);
-			if(!CheckAndAddObject(StartID | i, dirName + leaf))
+			CheckedObject object;
+			if(CheckObject(StartID | i, dirName + leaf, object))
+			{
+				rResult.mObjects.push_back(object);
+			}
+			else
 			{
 				// File was bad, delete it
 				BOX_ERROR("Corrupted file " << dirName <<
 					leaf << " found" <<
 					(mFixErrors?", deleting":""));
-				++mNumberErrorsFound;
+				++rResult.mNumberErrorsFound;
 				if(mFixErrors)
 				{
 					RaidFileWrite del(mDiscSetNumber, dirName + leaf);
 					del.Delete();
 				}
+
+				// Don't let a stale copy in the pack take its
+				// place
+				if(packed[i] != 0)
+				{
+					badPacked.insert(StartID | i);
+				}
 			}
 		}
 	}
+
+	if(!packPresent)
+	{
+		return;
+	}
+	pack.reset();
+
+	if(badPacked.empty())
+	{
+		CheckRaidFile(packFilename);
+	}
+	else if(mFixErrors)
+	{
+		// Rewrite the pack without them
+		BackupStorePackFile::UpdatePack(mDiscSetNumber, mStoreRoot,
+			StartID, std::set<int64_t>(), badPacked);
+	}
 }
 
 
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreCheck::CheckAndAddObject(int64_t,
-//			 const std::string &)
-//		Purpose: Check a specific object and add it to the list
-//			 if it's OK. If there are any errors with the
-//			 reading, return false and it'll be deleted.
+//		Name:    BackupStoreCheck::CheckObject(int64_t,
+//			 const std::string &, CheckedObject &)
+//		Purpose: Check a specific object and return its details in
+//			 rObjectOut if it's OK. If there are any errors with
+//			 the reading, return false and it'll be deleted. May
+//			 be called on any thread.
 //		Created: 21/4/04
 //
 // --------------------------------------------------------------------------
-bool BackupStoreCheck::CheckAndAddObject(int64_t ObjectID,
-	const std::string &rFilename)
+bool BackupStoreCheck::CheckObject(int64_t ObjectID,
+	const std::string &rFilename, CheckedObject &rObjectOut)
+{
+	// BLOCK
+	{
+		std::auto_ptr<RaidFileRead> file;
+		int64_t size = -1;
+		try
+		{
+			// Open file
+			file = RaidFileRead::Open(mDiscSetNumber, rFilename);
+			size = file->GetDiscUsageInBlocks();
+		}
+		catch(...)
+		{
+			// Error caught, not a good file then, let it be deleted
+			return false;
+		}
+
+		if(!CheckObjectStream(ObjectID, *file, size, rObjectOut))
+		{
+			return false;
+		}
+	}
+
+	// If it looks like a good object, and it's non-RAID, and
+	// this is a RAID set, then convert it to RAID.
+	CheckRaidFile(rFilename);
+
+	// Report success
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::CheckObjectStream(int64_t,
+//			 IOStream &, int64_t, CheckedObject &)
+//		Purpose: Check the contents of an object, stored on its own
+//			 or in a pack, and return its details in rObjectOut
+//			 if it's OK. May be called on any thread.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreCheck::CheckObjectStream(int64_t ObjectID, IOStream &rObject,
+	int64_t SizeInBlocks, CheckedObject &rObjectOut)
 {
 	// Info on object...
 	bool isFile = true;
 	int64_t containerID = -1;
-	int64_t size = -1;
 
 	try
 	{
-		// Open file
-		std::auto_ptr<RaidFileRead> file(
-			RaidFileRead::Open(mDiscSetNumber, rFilename));
-		size = file->GetDiscUsageInBlocks();
-
 		// Read in first four bytes -- don't have to worry about
 		// retrying if not all bytes read as is RaidFile
 		uint32_t signature;
-		if(file->Read(&signature, sizeof(signature)) != sizeof(signature))
+		if(rObject.Read(&signature, sizeof(signature)) != sizeof(signature))
 		{
 			// Too short, can't read signature from it
 			return false;
 		}
 		// Seek back to beginning
-		file->Seek(0, IOStream::SeekType_Absolute);
+		rObject.Seek(0, IOStream::SeekType_Absolute);
 
 		// Then... check depending on the type
 		switch(ntohl(signature))
 		{
 		case OBJECTMAGIC_FILE_MAGIC_VALUE_V1:
+		case OBJECTMAGIC_FILE_MAGIC_VALUE_V2:
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		case OBJECTMAGIC_FILE_MAGIC_VALUE_V0:
 #endif
 			// File... check
-			containerID = CheckFile(ObjectID, *file);
+			containerID = CheckFile(ObjectID, rObject);
 			break;
 
 		case OBJECTMAGIC_DIR_MAGIC_VALUE:
 			isFile = false;
-			containerID = CheckDirInitial(ObjectID, *file);
+			containerID = CheckDirInitial(ObjectID, rObject);
 			break;
 
 		default:
@@ -587,19 +986,27 @@ bool BackupStoreCheck::CheckAndAddObject(int64_t ObjectID,
 		return false;
 	}
 
-	// Add to list of IDs known about
-	AddID(ObjectID, containerID, size, isFile);
-
-	// Add to usage counts
-	mBlocksUsed += size;
-	if(!isFile)
-	{
-		mBlocksInDirectories += size;
-	}
+	// To be added to the list of IDs known about
+	rObjectOut.mID = ObjectID;
+	rObjectOut.mContainer = containerID;
+	rObjectOut.mObjectSizeInBlocks = SizeInBlocks;
+	rObjectOut.mIsFile = isFile;
+	return true;
+}
 
-	// If it looks like a good object, and it's non-RAID, and
-	// this is a RAID set, then convert it to RAID.
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::CheckRaidFile(const std::string &)
+//		Purpose: If a good object or pack is non-RAID, and this is
+//			 a RAID set, convert it to RAID, and repair it if
+//			 it's damaged. May be called on any thread.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::CheckRaidFile(const std::string &rFilename)
+{
 	RaidFileController &rcontroller(RaidFileController::GetController());
 	RaidFileDiscSet rdiscSet(rcontroller.GetDiscSet(mDiscSetNumber));
 	if(!rdiscSet.IsNonRaidSet())
@@ -636,9 +1043,6 @@ bool BackupStoreCheck::CheckAndAddObject(int64_t ObjectID,
 			}
 		}
 	}
-
-	// Report success
-	return true;
 }
 
 
@@ -872,6 +1276,7 @@ void BackupStoreCheck::CountDirectoryEntries(BackupStoreDirectory& dir)
 {
 	BackupStoreDirectory::Iterator i(dir);
 	BackupStoreDirectory::Entry *en = 0;
+	std::vector<int64_t> referenced;
 	while((en = i.Next()) != 0)
 	{
 		int32_t iIndex;
@@ -941,8 +1346,10 @@ void BackupStoreCheck::CountDirectoryEntries(BackupStoreDirectory& dir)
 			}
 		}
 
-		mapNewRefs->AddReference(en->GetObjectID());
+		referenced.push_back(en->GetObjectID());
 	}
+
+	mapNewRefs->AddReferences(referenced);
 }
 
 bool BackupStoreCheck::CheckDirectoryEntry(BackupStoreDirectory::Entry& rEntry,
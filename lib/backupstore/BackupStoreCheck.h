@@ -17,6 +17,7 @@
 
 #include "NamedLock.h"
 #include "BackupStoreDirectory.h"
+#include "Thread.h"
 
 class IOStream;
 class BackupStoreFilename;
@@ -58,6 +59,10 @@ The following problems can be fixed:
 	#define BACKUPSTORECHECK_BLOCK_SIZE		8
 #endif
 
+// How many directories of objects the check threads can get ahead of the
+// one whose results are being added to the list of IDs
+#define BACKUPSTORECHECK_MAX_DIRS_AHEAD		256
+
 // The object ID type -- can redefine to uint32_t to produce a lower memory version for smaller stores
 typedef int64_t BackupStoreCheck_ID_t;
 // Can redefine the size type for lower memory usage too
@@ -84,6 +89,12 @@ public:
 
 	// Do the exciting things
 	void Check();
+
+	// Threads to check objects on, or 0 for one per processor
+	void SetNumberOfThreads(int NumberOfThreads)
+	{
+		mNumberOfThreads = NumberOfThreads;
+	}
 	
 	bool ErrorsFound() {return mNumberErrorsFound > 0;}
 	inline int64_t GetNumErrorsFound()
@@ -114,6 +125,30 @@ private:
 		BackupStoreCheck_ID_t mContainer[BACKUPSTORECHECK_BLOCK_SIZE];
 		BackupStoreCheck_Size_t mObjectSizeInBlocks[BACKUPSTORECHECK_BLOCK_SIZE];
 	} IDBlock;
+
+	// An object which was checked and found OK, to be added to the
+	// list of IDs
+	typedef struct
+	{
+		BackupStoreCheck_ID_t mID;
+		BackupStoreCheck_ID_t mContainer;
+		BackupStoreCheck_Size_t mObjectSizeInBlocks;
+		bool mIsFile;
+	} CheckedObject;
+
+	// The results of checking all the objects in one directory
+	class CheckedObjectsDir
+	{
+	public:
+		CheckedObjectsDir() : mNumberErrorsFound(0), mFailed(false) { }
+		std::vector<CheckedObject> mObjects;
+		int64_t mNumberErrorsFound;
+		// an exception was thrown while checking it
+		bool mFailed;
+	};
+
+	class CheckObjectsThread;
+	friend class CheckObjectsThread;
 	
 	// Phases of the check
 	void CheckObjects();
@@ -126,8 +161,15 @@ private:
 
 	// Checking functions
 	int64_t CheckObjectsScanDir(int64_t StartID, int Level, const std::string &rDirName);
-	void CheckObjectsDir(int64_t StartID);
-	bool CheckAndAddObject(int64_t ObjectID, const std::string &rFilename);
+	void CheckObjectsOnThreads(int64_t MaxDir, int NumberOfThreads);
+	void CheckObjectsThreadMain();
+	void CheckObjectsDir(int64_t StartID, CheckedObjectsDir &rResult);
+	bool CheckObject(int64_t ObjectID, const std::string &rFilename,
+		CheckedObject &rObjectOut);
+	bool CheckObjectStream(int64_t ObjectID, IOStream &rObject,
+		int64_t SizeInBlocks, CheckedObject &rObjectOut);
+	void CheckRaidFile(const std::string &rFilename);
+	void AddCheckedObjects(const CheckedObjectsDir &rResult);
 	bool CheckDirectory(BackupStoreDirectory& dir);
 	bool CheckDirectoryEntry(BackupStoreDirectory::Entry& rEntry,
 		int64_t DirectoryID, bool& rIsModified);
@@ -176,6 +218,7 @@ private:
 	std::string mAccountName;
 	bool mFixErrors;
 	bool mQuiet;
+	int mNumberOfThreads;
 	
 	int64_t mNumberErrorsFound;
 	
@@ -189,6 +232,16 @@ private:
 	IDBlock *mpInfoLastBlock;
 	int32_t mInfoLastBlockEntries;
 	
+	// Shared with the threads which check objects. Each thread takes
+	// the next directory from mNextObjectsDir and puts the results in
+	// mCheckedObjectsDirs, and the results are added to the list of IDs
+	// in order of directory by CheckObjectsOnThreads().
+	Mutex mObjectsMutex;
+	ConditionVariable mObjectsDirChecked, mObjectsDirAdded;
+	int64_t mNextObjectsDir, mMaxObjectsDir, mObjectsDirsAddedUpTo;
+	std::map<int64_t, CheckedObjectsDir *> mCheckedObjectsDirs;
+	bool mStopCheckingObjects;
+
 	// List of stuff to fix
 	std::vector<BackupStoreCheck_ID_t> mDirsWithWrongContainerID;
 	// This is a map of lost dir ID -> existing dir ID
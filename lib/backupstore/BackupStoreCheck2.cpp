@@ -20,6 +20,7 @@
 #include "BackupStoreFileWire.h"
 #include "BackupStoreInfo.h"
 #include "BackupStoreObjectMagic.h"
+#include "BackupStorePackFile.h"
 #include "BackupStoreRefCountDatabase.h"
 #include "MemBlockStream.h"
 #include "RaidFileRead.h"
@@ -160,15 +161,14 @@ void BackupStoreCheck::CheckUnattachedObjects()
 					// File. Only attempt to attach it somewhere if it isn't a patch
 					{
 						int64_t diffFromObjectID = 0;
-						std::string filename;
-						StoreStructure::MakeObjectFilename(ObjectID,
-							mStoreRoot, mDiscSetNumber, filename,
-							false /* don't attempt to make sure the dir exists */);
 
 						// The easiest way to do this is to verify it again. Not such a bad penalty, because
 						// this really shouldn't be done very often.
 						{
-							std::auto_ptr<RaidFileRead> file(RaidFileRead::Open(mDiscSetNumber, filename));
+							std::auto_ptr<IOStream> file(
+								BackupStorePackFile::OpenObject(
+									mDiscSetNumber, mStoreRoot,
+									ObjectID));
 							BackupStoreFile::VerifyEncodedFileFormat(*file, &diffFromObjectID);
 						}
 
@@ -178,11 +178,13 @@ void BackupStoreCheck::CheckUnattachedObjects()
 						{
 							BOX_WARNING("Object " << BOX_FORMAT_OBJECTID(ObjectID) << " is unattached, and is a patch. Deleting, cannot reliably recover.");
 
-							// Delete this object instead
+							// Delete this object instead, which
+							// might be in a pack
 							if(mFixErrors)
 							{
-								RaidFileWrite del(mDiscSetNumber, filename);
-								del.Delete();
+								BackupStorePackFile::DeleteObject(
+									mDiscSetNumber, mStoreRoot,
+									ObjectID);
 							}
 
 							mBlocksUsed -= pblock->mObjectSizeInBlocks[e];
@@ -362,21 +364,17 @@ void BackupStoreDirectoryFixer::InsertObject(int64_t ObjectID, bool IsDirectory,
 	else
 	{
 		// Files require a little more work...
-		// Open file
-		std::string fileFilename;
-		StoreStructure::MakeObjectFilename(ObjectID, mStoreRoot,
-			mDiscSetNumber, fileFilename,
-			false /* don't make sure the dir exists */);
-		std::auto_ptr<RaidFileRead> file(
-			RaidFileRead::Open(mDiscSetNumber, fileFilename));
-
-		// Fill in size information
-		sizeInBlocks = file->GetDiscUsageInBlocks();
+		// Open file, and fill in size information
+		int64_t fileSizeInBlocks = 0;
+		std::auto_ptr<IOStream> file(
+			BackupStorePackFile::OpenObject(mDiscSetNumber,
+				mStoreRoot, ObjectID, &fileSizeInBlocks));
+		sizeInBlocks = fileSizeInBlocks;
 
 		// Read in header
 		file_StreamFormat hdr;
 		if(file->Read(&hdr, sizeof(hdr)) != sizeof(hdr) ||
-			(ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1
+			(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 			&& ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V0
 #endif
@@ -737,6 +735,7 @@ bool BackupStoreDirectory::CheckAndFix()
 					// Remove
 					delete *i;
 					mEntries.erase(i);
+					InvalidateIndexes();
 
 					// Mark as changed
 					changed = true;
@@ -888,6 +887,7 @@ bool BackupStoreDirectory::CheckAndFix()
 				// erase the thing from the list
 				Entry *pentry = (*i);
 				mEntries.erase(i);
+				InvalidateIndexes();
 
 				// And delete the entry object
 				delete pentry;
@@ -943,6 +943,9 @@ void BackupStoreDirectory::AddUnattachedObject(const BackupStoreFilename &rName,
 		delete pnew;
 		throw;
 	}
+
+	pnew->mpDirectory = this;
+	InvalidateIndexes();
 }
 
 
@@ -956,15 +959,7 @@ void BackupStoreDirectory::AddUnattachedObject(const BackupStoreFilename &rName,
 // --------------------------------------------------------------------------
 bool BackupStoreDirectory::NameInUse(const BackupStoreFilename &rName)
 {
-	for(std::vector<Entry*>::iterator i(mEntries.begin()); i != mEntries.end(); ++i)
-	{
-		if((*i)->GetName() == rName)
-		{
-			return true;
-		}
-	}
-
-	return false;
+	return FindEntryByName(rName) != 0;
 }
 
 
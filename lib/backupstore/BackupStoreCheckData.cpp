@@ -92,6 +92,36 @@ void BackupStoreCheck::AddID(BackupStoreCheck_ID_t ID,
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::AddCheckedObjects(const CheckedObjectsDir &)
+//		Purpose: Add the objects found in one directory to the list
+//			 of IDs and the usage counts. Directories must be
+//			 added in order of starting ID.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::AddCheckedObjects(const CheckedObjectsDir &rResult)
+{
+	for(std::vector<CheckedObject>::const_iterator
+		i(rResult.mObjects.begin()); i != rResult.mObjects.end(); ++i)
+	{
+		AddID(i->mID, i->mContainer, i->mObjectSizeInBlocks,
+			i->mIsFile);
+
+		// Add to usage counts
+		mBlocksUsed += i->mObjectSizeInBlocks;
+		if(!i->mIsFile)
+		{
+			mBlocksInDirectories += i->mObjectSizeInBlocks;
+		}
+	}
+
+	mNumberErrorsFound += rResult.mNumberErrorsFound;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -16,6 +16,8 @@
 
 static const ConfigurationVerifyKey verifyserverkeys[] = 
 {
+	ConfigurationVerifyKey("WorkerThreads", ConfigTest_IsInt, 0),
+	// handle connections in this many threads instead of forking
 	SERVERTLS_VERIFY_SERVER_KEYS(ConfigurationVerifyKey::NoDefaultValue)
 	// no default listen addresses
 };
@@ -36,8 +38,24 @@ static const ConfigurationVerifyKey verifyrootkeys[] =
 	ConfigurationVerifyKey("AccountDatabase", ConfigTest_Exists),
 	ConfigurationVerifyKey("TimeBetweenHousekeeping",
 		ConfigTest_Exists | ConfigTest_IsInt),
+	ConfigurationVerifyKey("TimeBetweenFullHousekeeping", ConfigTest_IsInt,
+		0),
+	// in seconds; in between, only changed directories are scanned
+	ConfigurationVerifyKey("HousekeepingWorkers", ConfigTest_IsInt, 1),
+	// housekeep this many accounts at once
+	ConfigurationVerifyKey("PackObjectsSmallerThan", ConfigTest_IsInt, 0),
+	// in kilobytes; housekeeping packs files smaller than this, 0 to disable
 	ConfigurationVerifyKey("ExtendedLogging", ConfigTest_IsBool, false),
 	// make value "yes" to enable in config file
+	ConfigurationVerifyKey("DirectoryCacheSize", ConfigTest_IsInt),
+	// in kilobytes, per connection
+	ConfigurationVerifyKey("DeferRaidConversion", ConfigTest_IsBool, false),
+	// make value "yes" to convert uploads to RAID in the background
+	ConfigurationVerifyKey("SharedDirectoryCacheSize", ConfigTest_IsInt,
+		65536),
+	// in kilobytes, for all connections, when WorkerThreads is set
+	ConfigurationVerifyKey("CheckThreads", ConfigTest_IsInt, 0),
+	// for bbstoreaccounts check, 0 for one per processor
 	ConfigurationVerifyKey("RaidFileConf", ConfigTest_LastEntry)
 };
 
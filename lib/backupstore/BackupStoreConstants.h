@@ -14,9 +14,54 @@
 
 #define BACKUP_STORE_SERVER_VERSION		1
 
+// Clients ask for this version to find out whether the server accepts
+// pipelined commands: commands sent before the replies to earlier ones
+// have been received, which it runs and answers strictly in order. The
+// protocol is otherwise the same. Older servers refuse it without ending
+// the conversation, so the client can then ask for the base version.
+#define BACKUP_STORE_SERVER_VERSION_PIPELINED	2
+
+// And this version to find out whether it also accepts data channels:
+// extra sessions, logged in with Flags_DataChannel, which upload whole
+// files in parallel for the read/write session of the same account to
+// store. Pipelining is accepted too.
+#define BACKUP_STORE_SERVER_VERSION_DATA_CHANNELS	3
+
+// And this version to find out whether it also keeps an index of the
+// blocks in its files, which the client can search with FindBlocks, and
+// accepts diffs from files in other directories. Everything above is
+// accepted too.
+#define BACKUP_STORE_SERVER_VERSION_BLOCK_DEDUP	4
+
+// How many commands a client keeps in flight when the server accepts
+// pipelining. The commands are small, so this many always fit in the
+// socket buffers, and the client can't block sending one while the
+// server is blocked sending it a reply.
+#define BACKUP_STORE_MAX_PIPELINED_COMMANDS	64
+
 // Minimum size for a chunk to be compressed
 #define BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE	256
 
+// With adaptive compression, chunks at least this big have this many bytes
+// sampled, and aren't compressed if the sample's entropy (in bits per byte)
+// is at least BACKUP_FILE_INCOMPRESSIBLE_ENTROPY. Random data scores
+// about 7.95 on a sample this size, text about 5.
+#define BACKUP_FILE_ENTROPY_SAMPLE_SIZE			4096
+#define BACKUP_FILE_ENTROPY_SAMPLE_RUN			64
+#define BACKUP_FILE_INCOMPRESSIBLE_ENTROPY		7.8
+
+// With adaptive compression, after this many chunks of a file in a row
+// fail to shrink by at least 1/BACKUP_FILE_MIN_COMPRESSION_GAIN of their
+// size, only one chunk in BACKUP_FILE_COMPRESSION_RETRY_INTERVAL is tried.
+#define BACKUP_FILE_MIN_COMPRESSION_GAIN		32
+#define BACKUP_FILE_COMPRESSION_FAILURES_BEFORE_SKIPPING	4
+#define BACKUP_FILE_COMPRESSION_RETRY_INTERVAL	16
+
+// When encoding with worker threads, blocks are read ahead into this many
+// buffers per thread (plus one for the block being sent), so that there's
+// always a block waiting for each worker while the others are finishing.
+#define BACKUP_FILE_ENCODE_JOBS_PER_THREAD		2
+
 // min and max sizes for blocks
 #define BACKUP_FILE_MIN_BLOCK_SIZE				4096
 #define BACKUP_FILE_MAX_BLOCK_SIZE				(512*1024)
@@ -24,6 +69,18 @@
 // Increase the block size if there are more than this number of blocks
 #define BACKUP_FILE_INCREASE_BLOCK_SIZE_AFTER 	4096
 
+// With content-defined chunking, the average chunk size is doubled from
+// BACKUP_FILE_MIN_BLOCK_SIZE in the same way, up to this. Chunks are at
+// least the average divided by BACKUP_FILE_CHUNK_SIZE_RANGE, and at most
+// the average times it, so the biggest is BACKUP_FILE_MAX_BLOCK_SIZE.
+#define BACKUP_FILE_MAX_AVERAGE_CHUNK_SIZE		(128*1024)
+#define BACKUP_FILE_CHUNK_SIZE_RANGE			4
+
+// Chunk boundaries are 2^this times less likely to be found before the
+// average size, and more likely after it, which narrows the spread of
+// chunk sizes (FastCDC's normalised chunking)
+#define BACKUP_FILE_CHUNK_NORMALISATION_BITS	2
+
 // Avoid creating blocks smaller than this
 #define	BACKUP_FILE_AVOID_BLOCKS_LESS_THAN		128
 
@@ -33,6 +90,17 @@
 // When doing rsync scans, do not scan for blocks smaller than
 #define BACKUP_FILE_DIFF_MIN_BLOCK_SIZE			128
 
+// Amount of the file read in at a time during an rsync scan, if bigger than
+// the largest block size being scanned for
+#define BACKUP_FILE_DIFF_SCAN_READ_SIZE			(256*1024)
+
+// Number of file positions for which rolling checksums are calculated at a
+// time during an rsync scan
+#define BACKUP_FILE_DIFF_SCAN_BATCH_SIZE		256
+
+// Size of the bitmap of weak checksum hash values present in the block index
+#define BACKUP_FILE_DIFF_FILTER_BYTES			((64*1024) / 8)
+
 // A limit to stop diffing running out of control: If more than this
 // times the number of blocks in the original index are found, stop
 // looking. This stops really bad cases of diffing files containing
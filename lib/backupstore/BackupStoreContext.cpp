@@ -9,7 +9,14 @@
 
 #include "Box.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
 
 #include "BackupConstants.h"
 #include "BackupStoreContext.h"
@@ -18,26 +25,31 @@
 #include "BackupStoreFile.h"
 #include "BackupStoreInfo.h"
 #include "BackupStoreObjectMagic.h"
+#include "BackupStorePackFile.h"
+#include "BackupStoreSharedDirectoryCache.h"
 #include "BufferedStream.h"
 #include "BufferedWriteStream.h"
+#include "CollectInBufferStream.h"
 #include "FileStream.h"
-#include "InvisibleTempFileStream.h"
+#include "MemBlockStream.h"
 #include "RaidFileController.h"
 #include "RaidFileRead.h"
 #include "RaidFileWrite.h"
+#include "Random.h"
 #include "StoreStructure.h"
 
 #include "MemLeakFindOn.h"
 
 
-// Maximum number of directories to keep in the cache When the cache is bigger
-// than this, everything gets deleted. In tests, we set the cache size to zero
-// to ensure that it's always flushed, which is very inefficient but helps to
-// catch programming errors (use of freed data).
+// Default maximum estimated size, in bytes, of the directories kept in the
+// cache. When the cache is bigger than this, the least recently used
+// directories are evicted until it fits again. In tests, we set the cache
+// size to zero to ensure that it's always flushed, which is very inefficient
+// but helps to catch programming errors (use of freed data).
 #ifdef BOX_RELEASE_BUILD
-	#define	MAX_CACHE_SIZE	32
+	#define	DEFAULT_DIRECTORY_CACHE_MAX_SIZE	(16*1024*1024)
 #else
-	#define	MAX_CACHE_SIZE	0
+	#define	DEFAULT_DIRECTORY_CACHE_MAX_SIZE	0
 #endif
 
 // Allow the housekeeping process 4 seconds to release an account
@@ -46,6 +58,9 @@
 // Maximum amount of store info updates before it's actually saved to disc.
 #define STORE_INFO_SAVE_DELAY	96
 
+Mutex BackupStoreContext::sWriteLockedStoresMutex;
+std::set<std::string> BackupStoreContext::sWriteLockedStores;
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -63,7 +78,16 @@ BackupStoreContext::BackupStoreContext(int32_t ClientID,
   mClientHasAccount(false),
   mStoreDiscSet(-1),
   mReadOnly(true),
+  mDataChannel(false),
   mSaveStoreInfoDelay(STORE_INFO_SAVE_DELAY),
+  mDirectoryCacheSize(0),
+  mDirectoryCacheMaxSize(DEFAULT_DIRECTORY_CACHE_MAX_SIZE),
+  mDirectoryCacheHits(0),
+  mDirectoryCacheMisses(0),
+  mDirectoryCacheEvictions(0),
+  mpSharedDirectoryCache(NULL),
+  mVerifyReadBytesSaved(0),
+  mDeferRaidConversion(false),
   mpTestHook(NULL)
 // If you change the initialisers, be sure to update
 // BackupStoreContext::ReceivedFinishCommand as well!
@@ -81,19 +105,32 @@ BackupStoreContext::BackupStoreContext(int32_t ClientID,
 // --------------------------------------------------------------------------
 BackupStoreContext::~BackupStoreContext()
 {
+	ReleaseWriteLock();
 	ClearDirectoryCache();
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::ClearDirectoryCache()
+//		Purpose: Delete all the directories in the cache. The
+//			 statistics are kept, as they cover the whole
+//			 connection.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
 void BackupStoreContext::ClearDirectoryCache()
 {
 	// Delete the objects in the cache
-	for(std::map<int64_t, BackupStoreDirectory*>::iterator i(mDirectoryCache.begin());
+	for(DirectoryCache_t::iterator i(mDirectoryCache.begin());
 		i != mDirectoryCache.end(); ++i)
 	{
-		delete (i->second);
+		delete (i->second.mpDirectory);
 	}
 	mDirectoryCache.clear();
+	mDirectoryCacheLRU.clear();
+	mDirectoryCacheSize = 0;
 }
 
 
@@ -139,11 +176,16 @@ void BackupStoreContext::ReceivedFinishCommand()
 	// Avoid the need to check version again, by not resetting
 	// mClientHasAccount, mAccountRootDir or mStoreDiscSet
 
+	FinishRaidConversion();
+
 	mReadOnly = true;
+	mDataChannel = false;
 	mSaveStoreInfoDelay = STORE_INFO_SAVE_DELAY;
 	mpTestHook = NULL;
 	mapStoreInfo.reset();
 	mapRefCount.reset();
+	mapDedupIndex.reset();
+	mapJournal.reset();
 	ClearDirectoryCache();
 }
 
@@ -162,6 +204,18 @@ bool BackupStoreContext::AttemptToGetWriteLock()
 	std::string writeLockFile;
 	StoreStructure::MakeWriteLockFilename(mAccountRootDir, mStoreDiscSet, writeLockFile);
 
+	// Another connection handled by this process might have it. There's
+	// no point asking housekeeping to release it then.
+	if(mWriteLockFile.empty())
+	{
+		MutexLock lock(sWriteLockedStoresMutex);
+		if(!sWriteLockedStores.insert(writeLockFile).second)
+		{
+			return false;
+		}
+		mWriteLockFile = writeLockFile;
+	}
+
 	// Request the lock
 	bool gotLock = mWriteLock.TryAndGetLock(writeLockFile.c_str(), 0600 /* restrictive file permissions */);
 
@@ -189,11 +243,43 @@ bool BackupStoreContext::AttemptToGetWriteLock()
 		// Got the lock, mark as not read only
 		mReadOnly = false;
 	}
+	else
+	{
+		ReleaseWriteLock();
+	}
 
 	return gotLock;
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::ReleaseWriteLock()
+//		Purpose: Release the write lock for the store, if held,
+//			 once any uploaded files have been converted to RAID
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::ReleaseWriteLock()
+{
+	// Nobody else may write the files until they're converted
+	FinishRaidConversion();
+
+	if(mWriteLock.GotLock())
+	{
+		mWriteLock.ReleaseLock();
+	}
+
+	if(!mWriteLockFile.empty())
+	{
+		MutexLock lock(sWriteLockedStoresMutex);
+		sWriteLockedStores.erase(mWriteLockFile);
+		mWriteLockFile.clear();
+	}
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -236,6 +322,11 @@ void BackupStoreContext::LoadStoreInfo()
 			"account. Housekeeping will fix this automatically "
 			"when it next runs.");
 	}
+
+	if(!mReadOnly)
+	{
+		mapJournal = BackupStoreJournal::OpenForAppend(account);
+	}
 }
 
 
@@ -319,16 +410,14 @@ BackupStoreDirectory &BackupStoreContext::GetDirectoryInternal(int64_t ObjectID,
 	int64_t oldRevID = 0, newRevID = 0;
 
 	// Already in cache?
-	std::map<int64_t, BackupStoreDirectory*>::iterator item(mDirectoryCache.find(ObjectID));
+	DirectoryCache_t::iterator item(mDirectoryCache.find(ObjectID));
 	if(item != mDirectoryCache.end()) {
-#ifndef BOX_RELEASE_BUILD // it might be in the cache, but invalidated
-		// in which case, delete it instead of returning it.
-		if(!item->second->IsInvalidated())
-#else
-		if(true)
-#endif
+		// It might be in the cache, but evicted and invalidated (only
+		// in debug builds) in which case, delete it instead of
+		// returning it.
+		if(!item->second.mEvicted)
 		{
-			oldRevID = item->second->GetRevisionID();
+			oldRevID = item->second.mpDirectory->GetRevisionID();
 
 			// Check the revision ID of the file -- does it need refreshing?
 			if(!RaidFileRead::FileExists(mStoreDiscSet, filename, &newRevID))
@@ -338,85 +427,160 @@ BackupStoreDirectory &BackupStoreContext::GetDirectoryInternal(int64_t ObjectID,
 
 			if(newRevID == oldRevID)
 			{
-				// Looks good... return the cached object
+				// Looks good... make it the most recently used,
+				// and return the cached object
 				BOX_TRACE("Returning object " <<
 					BOX_FORMAT_OBJECTID(ObjectID) <<
 					" from cache, modtime = " << newRevID)
-				return *(item->second);
+				mDirectoryCacheLRU.splice(mDirectoryCacheLRU.begin(),
+					mDirectoryCacheLRU,
+					item->second.mLRUPosition);
+				mDirectoryCacheHits++;
+				return *(item->second.mpDirectory);
 			}
 		}
 
 		// Delete this cached object
-		delete item->second;
-		mDirectoryCache.erase(item);
+		RemoveDirectoryFromCache(ObjectID);
 	}
 
 	// Need to load it up
+	mDirectoryCacheMisses++;
 
-	// First check to see if the cache is too big
-	if(mDirectoryCache.size() > MAX_CACHE_SIZE && AllowFlushCache)
-	{
-		// Very simple. Just delete everything! But in debug builds,
-		// leave the entries in the cache and invalidate them instead,
-		// so that any attempt to access them will cause an assertion
-		// failure that helps to track down the error.
-#ifdef BOX_RELEASE_BUILD
-		ClearDirectoryCache();
-#else
-		for(std::map<int64_t, BackupStoreDirectory*>::iterator
-			i = mDirectoryCache.begin();
-			i != mDirectoryCache.end(); i++)
-		{
-			i->second->Invalidate();
-		}
-#endif
-	}
-
-	// Get a RaidFileRead to read it
-	std::auto_ptr<RaidFileRead> objectFile(RaidFileRead::Open(mStoreDiscSet,
-		filename, &newRevID));
-
-	ASSERT(newRevID != 0);
+	std::auto_ptr<BackupStoreDirectory> dir;
+	int64_t dirSize = 0;
 
-	if (oldRevID == 0)
+	// Has another connection read this version already?
+	std::string data;
+	if(mpSharedDirectoryCache &&
+		RaidFileRead::FileExists(mStoreDiscSet, filename, &newRevID) &&
+		mpSharedDirectoryCache->Get(mStoreDiscSet, filename, newRevID,
+			data, dirSize))
 	{
 		BOX_TRACE("Loading object " << BOX_FORMAT_OBJECTID(ObjectID) <<
-			" with modtime " << newRevID);
+			" with modtime " << newRevID << " from shared cache");
+		MemBlockStream stream(data);
+		dir.reset(new BackupStoreDirectory(stream));
 	}
 	else
 	{
-		BOX_TRACE("Refreshing object " << BOX_FORMAT_OBJECTID(ObjectID) <<
-			" in cache, modtime changed from " << oldRevID <<
-			" to " << newRevID);
+		// Get a RaidFileRead to read it
+		std::auto_ptr<RaidFileRead> objectFile(RaidFileRead::Open(
+			mStoreDiscSet, filename, &newRevID));
+
+		ASSERT(newRevID != 0);
+
+		if (oldRevID == 0)
+		{
+			BOX_TRACE("Loading object " << BOX_FORMAT_OBJECTID(ObjectID) <<
+				" with modtime " << newRevID);
+		}
+		else
+		{
+			BOX_TRACE("Refreshing object " << BOX_FORMAT_OBJECTID(ObjectID) <<
+				" in cache, modtime changed from " << oldRevID <<
+				" to " << newRevID);
+		}
+
+		dirSize = objectFile->GetDiscUsageInBlocks();
+
+		if(mpSharedDirectoryCache)
+		{
+			// Keep a copy of the stored form for other connections
+			CollectInBufferStream collect;
+			objectFile->CopyStreamTo(collect);
+			data.assign((const char *)collect.GetBuffer(),
+				collect.GetSize());
+			MemBlockStream stream(data);
+			dir.reset(new BackupStoreDirectory(stream));
+			mpSharedDirectoryCache->Put(mStoreDiscSet, filename,
+				newRevID, data, dirSize);
+		}
+		else
+		{
+			// Read it from the stream
+			BufferedStream buf(*objectFile);
+			dir.reset(new BackupStoreDirectory(buf));
+		}
 	}
 
-	// Read it from the stream, then set it's revision ID
-	BufferedStream buf(*objectFile);
-	std::auto_ptr<BackupStoreDirectory> dir(new BackupStoreDirectory(buf));
+	// Set its revision ID
 	dir->SetRevisionID(newRevID);
 
 	// Make sure the size of the directory is available for writing the dir back
-	int64_t dirSize = objectFile->GetDiscUsageInBlocks();
 	ASSERT(dirSize > 0);
 	dir->SetUserInfo1_SizeInBlocks(dirSize);
 
-	// Store in cache
-	BackupStoreDirectory *pdir = dir.release();
+	// Store in cache, as the most recently used
+	DirectoryCacheEntry entry;
+	entry.mpDirectory = dir.get();
+	entry.mSize = dir->GetApproximateMemoryUsage();
+	entry.mEvicted = false;
+	mDirectoryCacheLRU.push_front(ObjectID);
+	entry.mLRUPosition = mDirectoryCacheLRU.begin();
 	try
 	{
-		mDirectoryCache[ObjectID] = pdir;
+		mDirectoryCache[ObjectID] = entry;
 	}
 	catch(...)
 	{
-		delete pdir;
+		mDirectoryCacheLRU.pop_front();
 		throw;
 	}
+	mDirectoryCacheSize += entry.mSize;
+	BackupStoreDirectory *pdir = dir.release();
+
+	// Make room for it, if we're allowed to invalidate references to
+	// other cached directories
+	if(AllowFlushCache)
+	{
+		EvictFromDirectoryCache();
+	}
 
 	// Return it
 	return *pdir;
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::EvictFromDirectoryCache()
+//		Purpose: Evict the least recently used directories from the
+//			 cache until its size is within the limit, or only
+//			 the most recently used one is left. In debug
+//			 builds, evicted directories are invalidated and
+//			 left in the cache instead of being deleted, so that
+//			 any use of a stale reference to them causes an
+//			 assertion failure that helps to track down the
+//			 error. They're deleted when next looked up.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::EvictFromDirectoryCache()
+{
+	while(mDirectoryCacheSize > mDirectoryCacheMaxSize &&
+		mDirectoryCacheLRU.size() > 1)
+	{
+		int64_t ObjectID = mDirectoryCacheLRU.back();
+		mDirectoryCacheEvictions++;
+		BOX_TRACE("Evicting object " << BOX_FORMAT_OBJECTID(ObjectID) <<
+			" from cache, cache size = " << mDirectoryCacheSize);
+
+#ifdef BOX_RELEASE_BUILD
+		RemoveDirectoryFromCache(ObjectID);
+#else
+		DirectoryCacheEntry &rEntry(mDirectoryCache[ObjectID]);
+		mDirectoryCacheLRU.pop_back();
+		mDirectoryCacheSize -= rEntry.mSize;
+		rEntry.mSize = 0;
+		rEntry.mEvicted = true;
+		rEntry.mpDirectory->Invalidate();
+#endif
+	}
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -511,9 +675,11 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 	// Stream the file to disc
 	std::string fn;
 	MakeObjectFilename(id, fn, true /* make sure the directory it's in exists */);
+	std::string oldVersionFilename;
 	int64_t newObjectBlocksUsed = 0;
 	RaidFileWrite *ppreviousVerStoreFile = 0;
 	bool reversedDiffIsCompletelyDifferent = false;
+	bool diffFromOtherDirectory = false;
 	int64_t oldVersionNewBlocksUsed = 0;
 	BackupStoreInfo::Adjustment adjustment = {};
 
@@ -527,84 +693,68 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 		// Diff or full file?
 		if(DiffFromFileID == 0)
 		{
-			// A full file, just store to disc
-			if(!rFile.CopyStreamTo(storeFile, BACKUP_STORE_TIMEOUT))
-			{
-				THROW_EXCEPTION(BackupStoreException, ReadFileFromStreamTimedOut)
-			}
+			// A full file, just store to disc, verifying it on
+			// the way
+			ReceiveAndVerifyFile(rFile, storeFile);
 		}
 		else
 		{
-			// Check that the diffed from ID actually exists in the directory
+			// Check that the diffed from ID actually exists in the
+			// directory, or is a complete file somewhere else
 			if(dir.FindEntryByID(DiffFromFileID) == 0)
 			{
-				THROW_EXCEPTION(BackupStoreException, DiffFromIDNotFoundInDirectory)
-			}
-
-			// Diff file, needs to be recreated.
-			// Choose a temporary filename.
-			std::string tempFn(RaidFileController::DiscSetPathToFileSystemPath(mStoreDiscSet, fn + ".difftemp",
-				1 /* NOT the same disc as the write file, to avoid using lots of space on the same disc unnecessarily */));
-
-			try
-			{
-				// Open it twice
-#ifdef WIN32
-				InvisibleTempFileStream diff(tempFn.c_str(), 
-					O_RDWR | O_CREAT | O_BINARY);
-				InvisibleTempFileStream diff2(tempFn.c_str(), 
-					O_RDWR | O_BINARY);
-#else
-				FileStream diff(tempFn.c_str(), O_RDWR | O_CREAT | O_EXCL);
-				FileStream diff2(tempFn.c_str(), O_RDONLY);
-
-				// Unlink it immediately, so it definitely goes away
-				if(::unlink(tempFn.c_str()) != 0)
-				{
-					THROW_EXCEPTION(CommonException, OSFileError);
-				}
-#endif
-
-				// Stream the incoming diff to this temporary file
-				if(!rFile.CopyStreamTo(diff, BACKUP_STORE_TIMEOUT))
-				{
-					THROW_EXCEPTION(BackupStoreException, ReadFileFromStreamTimedOut)
-				}
-
-				// Verify the diff
-				diff.Seek(0, IOStream::SeekType_Absolute);
-				if(!BackupStoreFile::VerifyEncodedFileFormat(diff))
+				if(GetBlocksInCompleteFile(DiffFromFileID) == -1)
 				{
-					THROW_EXCEPTION(BackupStoreException, AddedFileDoesNotVerify)
+					THROW_EXCEPTION(BackupStoreException, DiffFromIDNotFoundInDirectory)
 				}
+				diffFromOtherDirectory = true;
+			}
 
-				// Seek to beginning of diff file
-				diff.Seek(0, IOStream::SeekType_Absolute);
-
-				// Filename of the old version
-				std::string oldVersionFilename;
-				MakeObjectFilename(DiffFromFileID, oldVersionFilename, false /* no need to make sure the directory it's in exists */);
-
-				// Reassemble that diff -- open previous file, and combine the patch and file
-				std::auto_ptr<RaidFileRead> from(RaidFileRead::Open(mStoreDiscSet, oldVersionFilename));
-				BackupStoreFile::CombineFile(diff, diff2, *from, storeFile);
-
-				// Then... reverse the patch back (open the from file again, and create a write file to overwrite it)
-				std::auto_ptr<RaidFileRead> from2(RaidFileRead::Open(mStoreDiscSet, oldVersionFilename));
+			// Diff file, needs to be recreated. Stream the incoming
+			// diff straight into the new object's file, verifying it
+			// on the way, and then fill in the blocks it shares with
+			// the old version around the blocks which were sent,
+			// without spooling the diff anywhere else first.
+			ReceiveAndVerifyFile(rFile, storeFile);
+
+			// Filename of the old version
+			MakeObjectFilename(DiffFromFileID, oldVersionFilename, false /* no need to make sure the directory it's in exists */);
+
+			// It might be in a pack, but the reversed diff is
+			// always stored on its own, superseding that copy
+			int64_t fromBlocksUsed = 0;
+			std::auto_ptr<IOStream> from(
+				BackupStorePackFile::OpenObject(mStoreDiscSet,
+					mAccountRootDir, DiffFromFileID,
+					&fromBlocksUsed));
+			if(diffFromOtherDirectory)
+			{
+				// It's not an old version of this file, but one
+				// found to share blocks with it, so it's left as
+				// it is. The blocks are copied into the new
+				// file, which may share them with it on disc,
+				// if the filesystem can do that.
+				BackupStoreFile::CombineDiffInPlace(storeFile,
+					*from);
+			}
+			else
+			{
+				// Combine the patch with the old version, and reverse
+				// the patch at the same time to replace the old version
+				// (open the from file, and create a write file to
+				// overwrite it)
 				ppreviousVerStoreFile = new RaidFileWrite(mStoreDiscSet, oldVersionFilename);
 				ppreviousVerStoreFile->Open(true /* allow overwriting */);
-				from->Seek(0, IOStream::SeekType_Absolute);
-				diff.Seek(0, IOStream::SeekType_Absolute);
-				BackupStoreFile::ReverseDiffFile(diff, *from, *from2, *ppreviousVerStoreFile,
-						DiffFromFileID, &reversedDiffIsCompletelyDifferent);
+				BackupStoreFile::CombineDiffInPlace(storeFile, *from,
+					*ppreviousVerStoreFile, DiffFromFileID,
+					&reversedDiffIsCompletelyDifferent);
 
 				// Store disc space used
 				oldVersionNewBlocksUsed = ppreviousVerStoreFile->GetDiscUsageInBlocks();
 
 				// And make a space adjustment for the size calculation
 				spaceSavedByConversionToPatch =
-					from->GetDiscUsageInBlocks() - 
-					oldVersionNewBlocksUsed;
+					fromBlocksUsed - oldVersionNewBlocksUsed;
 
 				adjustment.mBlocksUsed -= spaceSavedByConversionToPatch;
 				// The code below will change the patch from a
@@ -613,17 +763,10 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 				adjustment.mBlocksInCurrentFiles -=
 					spaceSavedByConversionToPatch;
 
-				// Don't adjust anything else here. We'll do it
-				// when we update the directory just below,
-				// which also accounts for non-diff replacements.
-
-				// Everything cleans up here...
-			}
-			catch(...)
-			{
-				// Be very paranoid about deleting this temp file -- we could only leave a zero byte file anyway
-				::unlink(tempFn.c_str());
-				throw;
+				// Don't adjust anything else here. We'll do
+				// it when we update the directory just below,
+				// which also accounts for non-diff
+				// replacements.
 			}
 		}
 
@@ -643,7 +786,7 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 		}
 
 		// Commit the file
-		storeFile.Commit(BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY);
+		CommitStoreFile(storeFile, fn);
 	}
 	catch(...)
 	{
@@ -657,23 +800,6 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 		throw;
 	}
 
-	// Verify the file -- only necessary for non-diffed versions
-	// NOTE: No need to catch exceptions and delete ppreviousVerStoreFile, because
-	// in the non-diffed code path it's never allocated.
-	if(DiffFromFileID == 0)
-	{
-		std::auto_ptr<RaidFileRead> checkFile(RaidFileRead::Open(mStoreDiscSet, fn));
-		if(!BackupStoreFile::VerifyEncodedFileFormat(*checkFile))
-		{
-			// Error! Delete the file
-			RaidFileWrite del(mStoreDiscSet, fn);
-			del.Delete();
-
-			// Exception
-			THROW_EXCEPTION(BackupStoreException, AddedFileDoesNotVerify)
-		}
-	}
-
 	// Modify the directory -- first make all files with the same name
 	// marked as an old version
 	try
@@ -682,7 +808,7 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 		// patch, above.
 		BackupStoreDirectory::Entry *poldEntry = NULL;
 
-		if(DiffFromFileID != 0)
+		if(DiffFromFileID != 0 && !diffFromOtherDirectory)
 		{
 			// Get old version entry
 			poldEntry = dir.FindEntryByID(DiffFromFileID);
@@ -695,28 +821,28 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 
 		if(MarkFileWithSameNameAsOldVersions)
 		{
-			BackupStoreDirectory::Iterator i(dir);
-			BackupStoreDirectory::Entry *e = 0;
-			while((e = i.Next()) != 0)
+			// Find all the versions with this name which aren't
+			// already old versions
+			std::vector<BackupStoreDirectory::Entry *> sameName;
+			dir.FindEntriesByName(rFilename, sameName,
+				BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
+				BackupStoreDirectory::Entry::Flags_OldVersion);
+			for(std::vector<BackupStoreDirectory::Entry *>::iterator
+				i(sameName.begin()); i != sameName.end(); ++i)
 			{
-				// First, check it's not an old version (cheaper comparison)
-				if(! e->IsOld())
-				{
-					// Compare name
-					if(e->GetName() == rFilename)
-					{
-						// Check that it's definately not an old version
-						ASSERT((e->GetFlags() & BackupStoreDirectory::Entry::Flags_OldVersion) == 0);
-						// Set old version flag
-						e->AddFlags(BackupStoreDirectory::Entry::Flags_OldVersion);
-						// Can safely do this, because we know we won't be here if it's already 
-						// an old version
-						adjustment.mBlocksInOldFiles += e->GetSizeInBlocks();
-						adjustment.mBlocksInCurrentFiles -= e->GetSizeInBlocks();
-						adjustment.mNumOldFiles++;
-						adjustment.mNumCurrentFiles--;
-					}
-				}
+				BackupStoreDirectory::Entry *e = *i;
+				// Check that it's definately not an old version
+				ASSERT((e->GetFlags() & BackupStoreDirectory::Entry::Flags_OldVersion) == 0);
+				// Set old version flag
+				e->AddFlags(BackupStoreDirectory::Entry::Flags_OldVersion);
+				// Can safely do this, because we know we won't be here if it's already 
+				// an old version
+				adjustment.mBlocksInOldFiles += e->GetSizeInBlocks();
+				adjustment.mBlocksInCurrentFiles -= e->GetSizeInBlocks();
+				adjustment.mNumOldFiles++;
+				adjustment.mNumCurrentFiles--;
+				AddToJournal(JOURNAL_ENTRY_OLD_VERSION,
+					e->GetObjectID(), InDirectory);
 			}
 		}
 
@@ -740,7 +866,7 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 		// the state of the files on disc.
 		if(ppreviousVerStoreFile != 0)
 		{
-			ppreviousVerStoreFile->Commit(BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY);
+			CommitStoreFile(*ppreviousVerStoreFile, oldVersionFilename);
 			delete ppreviousVerStoreFile;
 			ppreviousVerStoreFile = 0;
 		}
@@ -778,6 +904,8 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 	mapStoreInfo->ChangeBlocksInOldFiles(adjustment.mBlocksInOldFiles);
 	mapStoreInfo->ChangeBlocksInDeletedFiles(adjustment.mBlocksInDeletedFiles);
 	mapStoreInfo->ChangeBlocksInDirectories(adjustment.mBlocksInDirectories);
+	AddToJournal(JOURNAL_ENTRY_ADDED, id, InDirectory,
+		adjustment.mBlocksUsed);
 
 	// Increment reference count on the new directory to one
 	mapRefCount->AddReference(id);
@@ -791,6 +919,466 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::StageFile(IOStream &)
+//		Purpose: Receive a file uploaded by a data channel session,
+//			 verifying it on the way, and keep it until the
+//			 read/write session stores it with AddStagedFile().
+//			 Returns the ID of the staged file.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreContext::StageFile(IOStream &rFile)
+{
+	if(mapStoreInfo.get() == 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, StoreInfoNotLoaded)
+	}
+
+	// Pick an unused ID. They're random, so that other sessions can't
+	// guess them, and don't need any state shared between sessions.
+	int64_t id = 0;
+	std::string fn;
+	while(id == 0 || FileExists(fn))
+	{
+		Random::Generate(&id, sizeof(id));
+		id &= 0x7fffffffffffffffLL;
+		StoreStructure::MakeStagedFilename(id, mAccountRootDir,
+			mStoreDiscSet, fn);
+	}
+
+	std::auto_ptr<FileStream> apStaged(new FileStream(fn,
+		O_WRONLY | O_CREAT | O_EXCL | O_BINARY));
+
+	try
+	{
+		ReceiveAndVerifyFile(rFile, *apStaged);
+
+		// Would it fit? The store info may be out of date by the time
+		// that it's stored, so AddFile() checks again.
+		int64_t blockSize = RaidFileController::GetController()
+			.GetDiscSet(mStoreDiscSet).GetBlockSize();
+		int64_t blocks = (apStaged->GetPosition() + blockSize - 1) /
+			blockSize;
+		if(mapStoreInfo->GetBlocksUsed() + blocks >
+			mapStoreInfo->GetBlocksHardLimit())
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				AddedFileExceedsStorageLimit)
+		}
+
+		apStaged->Close();
+	}
+	catch(...)
+	{
+		apStaged.reset();
+		::unlink(fn.c_str());
+		throw;
+	}
+
+	return id;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::AddStagedFile(int64_t, int64_t,
+//			 int64_t, int64_t, const BackupStoreFilename &)
+//		Purpose: Add a file staged by a data channel session to
+//			 the store, like AddFile() with a whole file. The
+//			 staged file is deleted, whether or not this works.
+//			 Returns the object ID of the new file.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreContext::AddStagedFile(int64_t StagedFileID,
+	int64_t InDirectory, int64_t ModificationTime, int64_t AttributesHash,
+	const BackupStoreFilename &rFilename)
+{
+	if(mReadOnly)
+	{
+		THROW_EXCEPTION(BackupStoreException, ContextIsReadOnly)
+	}
+
+	std::string fn;
+	StoreStructure::MakeStagedFilename(StagedFileID, mAccountRootDir,
+		mStoreDiscSet, fn);
+	if(StagedFileID <= 0 || !FileExists(fn))
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException, ObjectDoesNotExist,
+			"Staged file " << BOX_FORMAT_OBJECTID(StagedFileID) <<
+			" does not exist");
+	}
+
+	int64_t id;
+	try
+	{
+		FileStream staged(fn);
+		id = AddFile(staged, InDirectory, ModificationTime,
+			AttributesHash, 0 /* not a diff */, rFilename,
+			true /* mark files with same name as old versions */);
+	}
+	catch(...)
+	{
+		::unlink(fn.c_str());
+		throw;
+	}
+
+	if(::unlink(fn.c_str()) != 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to delete staged file " << fn);
+	}
+
+	return id;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::DeleteStagedFiles()
+//		Purpose: Delete any files left staged by data channel
+//			 sessions which ended without them being stored.
+//			 Called when the write lock is taken, before the
+//			 client opens any new data channels.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::DeleteStagedFiles()
+{
+	std::string example;
+	StoreStructure::MakeStagedFilename(0, mAccountRootDir, mStoreDiscSet,
+		example);
+	std::string dirName(example, 0,
+		example.rfind(DIRECTORY_SEPARATOR_ASCHAR) + 1);
+	std::string prefix(STORE_STAGED_FILE_PREFIX);
+
+	DIR *dirHandle = ::opendir(dirName.c_str());
+	if(dirHandle == NULL)
+	{
+		BOX_LOG_SYS_WARNING("Failed to open account directory to "
+			"delete staged files: " << dirName);
+		return;
+	}
+
+	struct dirent *en;
+	while((en = ::readdir(dirHandle)) != NULL)
+	{
+		if(::strncmp(en->d_name, prefix.c_str(), prefix.size()) != 0)
+		{
+			continue;
+		}
+
+		std::string fn(dirName + en->d_name);
+		BOX_INFO("Deleting abandoned staged file " << fn);
+		if(::unlink(fn.c_str()) != 0)
+		{
+			BOX_LOG_SYS_WARNING("Failed to delete staged file " << fn);
+		}
+	}
+
+	::closedir(dirHandle);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::GetDedupIndex()
+//		Purpose: Private. Return the index of blocks by their
+//			 hashes, opening it if necessary.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreDedupIndex &BackupStoreContext::GetDedupIndex()
+{
+	if(!mapDedupIndex.get())
+	{
+		BackupStoreAccountDatabase::Entry account(mClientID,
+			mStoreDiscSet);
+		mapDedupIndex = BackupStoreDedupIndex::Load(account);
+	}
+	return *mapDedupIndex;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::AddToJournal(int, int64_t, int64_t, int64_t)
+//		Purpose: Private. Record a change for housekeeping, if the
+//			 account has a journal. If it can't be written, it's
+//			 removed, so that housekeeping scans everything.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::AddToJournal(int Type, int64_t ObjectID,
+	int64_t DirectoryID, int64_t BlocksUsedDelta)
+{
+	if(!mapJournal.get())
+	{
+		return;
+	}
+
+	try
+	{
+		mapJournal->Append(Type, ObjectID, DirectoryID,
+			BlocksUsedDelta);
+	}
+	catch(BoxException &e)
+	{
+		BOX_WARNING("Failed to add to the journal of account " <<
+			BOX_FORMAT_ACCOUNT(mClientID) << ", housekeeping "
+			"will scan the whole account: " << e.what());
+		mapJournal.reset();
+		BackupStoreAccountDatabase::Entry account(mClientID,
+			mStoreDiscSet);
+		BackupStoreJournal::Remove(account);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::GetBlocksInCompleteFile(int64_t)
+//		Purpose: Private. Return the number of blocks in an object,
+//			 if it's a file which still has references and isn't
+//			 a patch, so that it can be diffed from wherever it
+//			 is. Otherwise, returns -1.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreContext::GetBlocksInCompleteFile(int64_t ObjectID)
+{
+	if(ObjectID < BACKUPSTORE_ROOT_DIRECTORY_ID ||
+		ObjectID > mapRefCount->GetLastObjectIDUsed() ||
+		mapRefCount->GetRefCount(ObjectID) == 0)
+	{
+		return -1;
+	}
+
+	if(!BackupStorePackFile::ObjectExists(mStoreDiscSet, mAccountRootDir,
+		ObjectID))
+	{
+		return -1;
+	}
+
+	std::auto_ptr<IOStream> file(BackupStorePackFile::OpenObject(
+		mStoreDiscSet, mAccountRootDir, ObjectID));
+	file_StreamFormat hdr;
+	if(!file->ReadFullBuffer(&hdr, sizeof(hdr), 0) ||
+		!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue)))
+	{
+		return -1;
+	}
+
+	file->Seek(0, IOStream::SeekType_Absolute);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(*file);
+	file_BlockIndexHeader indexHdr;
+	if(!file->ReadFullBuffer(&indexHdr, sizeof(indexHdr), 0) ||
+		!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(
+			ntohl(indexHdr.mMagicValue)) ||
+		box_ntoh64(indexHdr.mOtherFileID) != 0)
+	{
+		return -1;
+	}
+
+	return box_ntoh64(indexHdr.mNumBlocks);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::FindBlocks(const std::vector<file_BlockHash> &, std::vector<file_BlockLocation> &)
+//		Purpose: Look up the hash of each block in the index, and
+//			 return where the block is, if it's in a file which
+//			 can be diffed from, or an object ID of 0 if not.
+//			 Entries which are out of date are removed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::FindBlocks(const std::vector<file_BlockHash> &rHashes,
+	std::vector<file_BlockLocation> &rLocationsOut)
+{
+	if(mapStoreInfo.get() == 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, StoreInfoNotLoaded)
+	}
+
+	if(mReadOnly)
+	{
+		THROW_EXCEPTION(BackupStoreException, ContextIsReadOnly)
+	}
+
+	BackupStoreDedupIndex &index(GetDedupIndex());
+
+	// Many of the blocks found are usually in the same few files, so
+	// each file is only checked once
+	std::map<int64_t, int64_t> blocksInFile;
+
+	rLocationsOut.resize(rHashes.size());
+	for(size_t h = 0; h < rHashes.size(); ++h)
+	{
+		file_BlockLocation &rLocation(rLocationsOut[h]);
+		rLocation.mObjectID = 0;
+		rLocation.mBlockNumber = 0;
+
+		int64_t objectID, blockNumber;
+		if(!index.Find(rHashes[h], objectID, blockNumber))
+		{
+			continue;
+		}
+
+		std::map<int64_t, int64_t>::iterator i(
+			blocksInFile.find(objectID));
+		if(i == blocksInFile.end())
+		{
+			i = blocksInFile.insert(std::make_pair(objectID,
+				GetBlocksInCompleteFile(objectID))).first;
+		}
+
+		if(blockNumber < 0 || blockNumber >= i->second)
+		{
+			// Deleted, or turned into a patch by a newer version
+			index.Remove(rHashes[h], objectID);
+			continue;
+		}
+
+		rLocation.mObjectID = objectID;
+		rLocation.mBlockNumber = blockNumber;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::AddBlockHashes(int64_t, const std::vector<file_BlockHash> &)
+//		Purpose: Add the hashes of every block of a file to the
+//			 index, as calculated by the client. The file must
+//			 not be a patch.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::AddBlockHashes(int64_t ObjectID,
+	const std::vector<file_BlockHash> &rHashes)
+{
+	if(mapStoreInfo.get() == 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, StoreInfoNotLoaded)
+	}
+
+	if(mReadOnly)
+	{
+		THROW_EXCEPTION(BackupStoreException, ContextIsReadOnly)
+	}
+
+	int64_t numBlocks = GetBlocksInCompleteFile(ObjectID);
+	if(numBlocks != (int64_t)rHashes.size())
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			BlockHashesDoNotMatchFile, "Received " <<
+			rHashes.size() << " block hashes for object " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << ", which has " <<
+			numBlocks << " blocks");
+	}
+
+	BackupStoreDedupIndex &index(GetDedupIndex());
+	for(size_t b = 0; b < rHashes.size(); ++b)
+	{
+		index.Add(rHashes[b], ObjectID, b, mapRefCount.get());
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::ReceiveAndVerifyFile(IOStream &,
+//			 IOStream &)
+//		Purpose: Copy an uploaded file from the client to
+//			 rDestination, checking that it's a valid encoded
+//			 file as it goes past, so that it doesn't have to be
+//			 read back to verify it. Throws AddedFileDoesNotVerify
+//			 if it isn't valid. rDestination is left open.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::ReceiveAndVerifyFile(IOStream &rFile,
+	IOStream &rDestination)
+{
+	BackupStoreFile::VerifyStream verifier(&rDestination);
+
+	try
+	{
+		if(!rFile.CopyStreamTo(verifier, BACKUP_STORE_TIMEOUT))
+		{
+			THROW_EXCEPTION(BackupStoreException, ReadFileFromStreamTimedOut)
+		}
+
+		// The block index can only be checked at the end
+		verifier.Close(false /* leave rDestination open */);
+	}
+	catch(BackupStoreException &e)
+	{
+		if(e.GetSubType() == BackupStoreException::BadBackupStoreFile ||
+			e.GetSubType() == BackupStoreException::InvalidBackupStoreFilename ||
+			e.GetSubType() == BackupStoreException::CouldntReadEntireStructureFromStream)
+		{
+			BOX_WARNING("Uploaded file does not verify: " <<
+				e.GetMessage());
+			THROW_EXCEPTION(BackupStoreException, AddedFileDoesNotVerify)
+		}
+		throw;
+	}
+
+	// This used to be read back from disc to verify it
+	mVerifyReadBytesSaved += verifier.GetPosition();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::CommitStoreFile(RaidFileWrite &, const std::string &)
+//		Purpose: Commit a file object written to the store, and
+//			 convert it to RAID storage, now or in the
+//			 background if conversion is deferred
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::CommitStoreFile(RaidFileWrite &rFile,
+	const std::string &rFilename)
+{
+	if(!mDeferRaidConversion)
+	{
+		rFile.Commit(BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY);
+		return;
+	}
+
+	rFile.Commit(false /* convert later */);
+	if(!mapRaidFileConverter.get())
+	{
+		mapRaidFileConverter.reset(new RaidFileConverter);
+	}
+	mapRaidFileConverter->Add(mStoreDiscSet, rFilename);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::FinishRaidConversion()
+//		Purpose: Convert any files still waiting to be converted to
+//			 RAID storage, and stop the background thread
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::FinishRaidConversion()
+{
+	if(mapRaidFileConverter.get())
+	{
+		mapRaidFileConverter->Finish();
+		mapRaidFileConverter.reset();
+	}
+}
+
 
 // --------------------------------------------------------------------------
 //
@@ -826,45 +1414,47 @@ bool BackupStoreContext::DeleteFile(const BackupStoreFilename &rFilename, int64_
 
 	try
 	{
-		// Iterate through directory, only looking at files which haven't been deleted
-		BackupStoreDirectory::Iterator i(dir);
-		BackupStoreDirectory::Entry *e = 0;
-		while((e = i.Next(BackupStoreDirectory::Entry::Flags_File,
-			BackupStoreDirectory::Entry::Flags_Deleted)) != 0)
+		// Find all the files with this name which haven't been deleted
+		std::vector<BackupStoreDirectory::Entry *> sameName;
+		dir.FindEntriesByName(rFilename, sameName,
+			BackupStoreDirectory::Entry::Flags_File,
+			BackupStoreDirectory::Entry::Flags_Deleted);
+		for(std::vector<BackupStoreDirectory::Entry *>::iterator
+			i(sameName.begin()); i != sameName.end(); ++i)
 		{
-			// Compare name
-			if(e->GetName() == rFilename)
+			BackupStoreDirectory::Entry *e = *i;
+
+			// Check that it's definately not already deleted
+			ASSERT(!e->IsDeleted());
+			// Set deleted flag
+			e->AddFlags(BackupStoreDirectory::Entry::Flags_Deleted);
+			// Mark as made a change
+			madeChanges = true;
+
+			int64_t blocks = e->GetSizeInBlocks();
+			mapStoreInfo->AdjustNumDeletedFiles(1);
+			mapStoreInfo->ChangeBlocksInDeletedFiles(blocks);
+			AddToJournal(JOURNAL_ENTRY_DELETED, e->GetObjectID(),
+				InDirectory);
+
+			// We're marking all old versions as deleted.
+			// This is how a file can be old and deleted
+			// at the same time. So we don't subtract from
+			// number or size of old files. But if it was
+			// a current file, then it's not any more, so
+			// we do need to adjust the current counts.
+			if(!e->IsOld())
 			{
-				// Check that it's definately not already deleted
-				ASSERT(!e->IsDeleted());
-				// Set deleted flag
-				e->AddFlags(BackupStoreDirectory::Entry::Flags_Deleted);
-				// Mark as made a change
-				madeChanges = true;
-
-				int64_t blocks = e->GetSizeInBlocks();
-				mapStoreInfo->AdjustNumDeletedFiles(1);
-				mapStoreInfo->ChangeBlocksInDeletedFiles(blocks);
-
-				// We're marking all old versions as deleted.
-				// This is how a file can be old and deleted
-				// at the same time. So we don't subtract from
-				// number or size of old files. But if it was
-				// a current file, then it's not any more, so
-				// we do need to adjust the current counts.
-				if(!e->IsOld())
-				{
-					mapStoreInfo->AdjustNumCurrentFiles(-1);
-					mapStoreInfo->ChangeBlocksInCurrentFiles(-blocks);
-				}
+				mapStoreInfo->AdjustNumCurrentFiles(-1);
+				mapStoreInfo->ChangeBlocksInCurrentFiles(-blocks);
+			}
 
-				// Is this the last version?
-				if((e->GetFlags() & BackupStoreDirectory::Entry::Flags_OldVersion) == 0)
-				{
-					// Yes. It's been found.
-					rObjectIDOut = e->GetObjectID();
-					fileExisted = true;
-				}
+			// Is this the last version?
+			if((e->GetFlags() & BackupStoreDirectory::Entry::Flags_OldVersion) == 0)
+			{
+				// Yes. It's been found.
+				rObjectIDOut = e->GetObjectID();
+				fileExisted = true;
 			}
 		}
 
@@ -979,11 +1569,18 @@ bool BackupStoreContext::UndeleteFile(int64_t ObjectID, int64_t InDirectory)
 // --------------------------------------------------------------------------
 void BackupStoreContext::RemoveDirectoryFromCache(int64_t ObjectID)
 {
-	std::map<int64_t, BackupStoreDirectory*>::iterator item(mDirectoryCache.find(ObjectID));
+	DirectoryCache_t::iterator item(mDirectoryCache.find(ObjectID));
 	if(item != mDirectoryCache.end())
 	{
+		// Evicted directories have already been taken off the LRU
+		// list, and don't count towards the size of the cache.
+		if(!item->second.mEvicted)
+		{
+			mDirectoryCacheLRU.erase(item->second.mLRUPosition);
+			mDirectoryCacheSize -= item->second.mSize;
+		}
 		// Delete this cached object
-		delete item->second;
+		delete item->second.mpDirectory;
 		// Erase the entry form the map
 		mDirectoryCache.erase(item);
 	}
@@ -1033,6 +1630,8 @@ void BackupStoreContext::SaveDirectory(BackupStoreDirectory &rDir)
 			int64_t sizeAdjustment = dirSize - rDir.GetUserInfo1_SizeInBlocks();
 			mapStoreInfo->ChangeBlocksUsed(sizeAdjustment);
 			mapStoreInfo->ChangeBlocksInDirectories(sizeAdjustment);
+			AddToJournal(JOURNAL_ENTRY_DIRECTORY, ObjectID, ObjectID,
+				sizeAdjustment);
 			// Update size stored in directory
 			rDir.SetUserInfo1_SizeInBlocks(dirSize);
 		}
@@ -1052,6 +1651,22 @@ void BackupStoreContext::SaveDirectory(BackupStoreDirectory &rDir)
 			rDir.SetRevisionID(revid);
 		}
 
+		// The directory has probably changed size since it was
+		// cached, so take account of that the next time the cache
+		// is trimmed.
+		{
+			DirectoryCache_t::iterator item(
+				mDirectoryCache.find(ObjectID));
+			if(item != mDirectoryCache.end() &&
+				item->second.mpDirectory == &rDir &&
+				!item->second.mEvicted)
+			{
+				int64_t newSize = rDir.GetApproximateMemoryUsage();
+				mDirectoryCacheSize += newSize - item->second.mSize;
+				item->second.mSize = newSize;
+			}
+		}
+
 		// Update the directory entry in the grandparent, to ensure
 		// that it reflects the current size of the parent directory.
 		int64_t new_dir_size = rDir.GetUserInfo1_SizeInBlocks();
@@ -1122,19 +1737,16 @@ int64_t BackupStoreContext::AddDirectory(int64_t InDirectory,
 	// Get the directory we want to modify
 	BackupStoreDirectory &dir(GetDirectoryInternal(InDirectory));
 
-	// Scan the directory for the name (only looking for directories which already exist)
+	// Look up the name (only looking for directories which already exist)
 	{
-		BackupStoreDirectory::Iterator i(dir);
-		BackupStoreDirectory::Entry *en = 0;
-		while((en = i.Next(BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
-			BackupStoreDirectory::Entry::Flags_Deleted | BackupStoreDirectory::Entry::Flags_OldVersion)) != 0)	// Ignore deleted and old directories
+		BackupStoreDirectory::Entry *en = dir.FindEntryByName(rFilename,
+			BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
+			BackupStoreDirectory::Entry::Flags_Deleted | BackupStoreDirectory::Entry::Flags_OldVersion);	// Ignore deleted and old directories
+		if(en != 0)
 		{
-			if(en->GetName() == rFilename)
-			{
-				// Already exists
-				rAlreadyExists = true;
-				return en->GetObjectID();
-			}
+			// Already exists
+			rAlreadyExists = true;
+			return en->GetObjectID();
 		}
 	}
 
@@ -1174,6 +1786,7 @@ int64_t BackupStoreContext::AddDirectory(int64_t InDirectory,
 		ASSERT(dirSize > 0);
 		mapStoreInfo->ChangeBlocksUsed(dirSize);
 		mapStoreInfo->ChangeBlocksInDirectories(dirSize);
+		AddToJournal(JOURNAL_ENTRY_ADDED, id, InDirectory, dirSize);
 		// Not added to cache, so don't set the size in the directory
 	}
 
@@ -1267,6 +1880,8 @@ void BackupStoreContext::DeleteDirectory(int64_t ObjectID, bool Undelete)
 				else
 				{
 					en->AddFlags(BackupStoreDirectory::Entry::Flags_Deleted);
+					AddToJournal(JOURNAL_ENTRY_DELETED, ObjectID,
+						InDirectory);
 				}
 
 				// Save it
@@ -1378,6 +1993,8 @@ void BackupStoreContext::DeleteDirectoryRecurse(int64_t ObjectID, bool Undelete)
 				else
 				{
 					en->AddFlags(BackupStoreDirectory::Entry::Flags_Deleted);
+					AddToJournal(JOURNAL_ENTRY_DELETED,
+						en->GetObjectID(), ObjectID);
 				}
 
 				// Did something
@@ -1461,33 +2078,22 @@ bool BackupStoreContext::ChangeFileAttributes(const BackupStoreFilename &rFilena
 		// Get the directory we want to modify
 		BackupStoreDirectory &dir(GetDirectoryInternal(InDirectory));
 
-		// Find the file entry
-		BackupStoreDirectory::Entry *en = 0;
-		// Iterate through current versions of files, only
-		BackupStoreDirectory::Iterator i(dir);
-		while((en = i.Next(
+		// Find the file entry, looking at current versions of files only
+		BackupStoreDirectory::Entry *en = dir.FindEntryByName(rFilename,
 			BackupStoreDirectory::Entry::Flags_File,
-			BackupStoreDirectory::Entry::Flags_Deleted | BackupStoreDirectory::Entry::Flags_OldVersion)
-			) != 0)
-		{
-			if(en->GetName() == rFilename)
-			{
-				// Set attributes
-				en->SetAttributes(Attributes, AttributesHash);
-
-				// Tell caller the object ID
-				rObjectIDOut = en->GetObjectID();
-
-				// Done
-				break;
-			}
-		}
+			BackupStoreDirectory::Entry::Flags_Deleted | BackupStoreDirectory::Entry::Flags_OldVersion);
 		if(en == 0)
 		{
 			// Didn't find it
 			return false;
 		}
 
+		// Set attributes
+		en->SetAttributes(Attributes, AttributesHash);
+
+		// Tell caller the object ID
+		rObjectIDOut = en->GetObjectID();
+
 		// Save back
 		SaveDirectory(dir);
 	}
@@ -1526,12 +2132,10 @@ bool BackupStoreContext::ObjectExists(int64_t ObjectID, int MustBe)
 		return false;
 	}
 
-	// Test to see if it exists on the disc
-	std::string filename;
-	MakeObjectFilename(ObjectID, filename);
-	if(!RaidFileRead::FileExists(mStoreDiscSet, filename))
+	// Test to see if it exists on the disc, on its own or in a pack
+	if(!BackupStorePackFile::ObjectExists(mStoreDiscSet, mAccountRootDir,
+		ObjectID))
 	{
-		// RaidFile reports no file there
 		return false;
 	}
 
@@ -1539,7 +2143,9 @@ bool BackupStoreContext::ObjectExists(int64_t ObjectID, int MustBe)
 	if(MustBe != ObjectExists_Anything)
 	{
 		// Open the file
-		std::auto_ptr<RaidFileRead> objectFile(RaidFileRead::Open(mStoreDiscSet, filename));
+		std::auto_ptr<IOStream> objectFile(
+			BackupStorePackFile::OpenObject(mStoreDiscSet,
+				mAccountRootDir, ObjectID));
 
 		// Read the first integer
 		uint32_t magic;
@@ -1558,10 +2164,12 @@ bool BackupStoreContext::ObjectExists(int64_t ObjectID, int MustBe)
 #endif
 
 		// Right one?
-		uint32_t requiredMagic = (MustBe == ObjectExists_File)?OBJECTMAGIC_FILE_MAGIC_VALUE_V1:OBJECTMAGIC_DIR_MAGIC_VALUE;
+		bool rightMagic = (MustBe == ObjectExists_File)
+			? OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(magic))
+			: (ntohl(magic) == OBJECTMAGIC_DIR_MAGIC_VALUE);
 
 		// Check
-		if(ntohl(magic) != requiredMagic)
+		if(!rightMagic)
 		{
 			return false;
 		}
@@ -1588,10 +2196,9 @@ std::auto_ptr<IOStream> BackupStoreContext::OpenObject(int64_t ObjectID)
 		THROW_EXCEPTION(BackupStoreException, StoreInfoNotLoaded)
 	}
 
-	// Attempt to open the file
-	std::string fn;
-	MakeObjectFilename(ObjectID, fn);
-	return std::auto_ptr<IOStream>(RaidFileRead::Open(mStoreDiscSet, fn).release());
+	// Attempt to open the file, which might be in a pack
+	return BackupStorePackFile::OpenObject(mStoreDiscSet, mAccountRootDir,
+		ObjectID);
 }
 
 
@@ -1718,31 +2325,23 @@ void BackupStoreContext::MoveObject(int64_t ObjectID, int64_t MoveFromDirectory,
 			}
 
 			// Check the new name doens't already exist (optionally ignoring deleted files)
+			if(dir.FindEntryByName(rNewFilename,
+				BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
+				targetSearchExcludeFlags) != 0)
 			{
-				BackupStoreDirectory::Iterator i(dir);
-				BackupStoreDirectory::Entry *c = 0;
-				while((c = i.Next(BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING, targetSearchExcludeFlags)) != 0)
-				{
-					if(c->GetName() == rNewFilename)
-					{
-						THROW_EXCEPTION(BackupStoreException, NameAlreadyExistsInDirectory)
-					}
-				}
+				THROW_EXCEPTION(BackupStoreException, NameAlreadyExistsInDirectory)
 			}
 
 			// Need to get all the entries with the same name?
 			if(MoveAllWithSameName)
 			{
-				// Iterate through the directory, copying all with matching names
-				BackupStoreDirectory::Iterator i(dir);
-				BackupStoreDirectory::Entry *c = 0;
-				while((c = i.Next()) != 0)
+				// Rename all the entries with matching names
+				std::vector<BackupStoreDirectory::Entry *> sameName;
+				dir.FindEntriesByName(en->GetName(), sameName);
+				for(std::vector<BackupStoreDirectory::Entry *>::iterator
+					c(sameName.begin()); c != sameName.end(); ++c)
 				{
-					if(c->GetName() == en->GetName())
-					{
-						// Rename this one
-						c->SetName(rNewFilename);
-					}
+					(*c)->SetName(rNewFilename);
 				}
 			}
 			else
@@ -1793,19 +2392,19 @@ void BackupStoreContext::MoveObject(int64_t ObjectID, int64_t MoveFromDirectory,
 			// Need to get all the entries with the same name?
 			if(MoveAllWithSameName)
 			{
-				// Iterate through the directory, copying all with matching names
-				BackupStoreDirectory::Iterator i(from);
-				BackupStoreDirectory::Entry *c = 0;
-				while((c = i.Next()) != 0)
+				// Copy all the entries with matching names
+				std::vector<BackupStoreDirectory::Entry *> sameName;
+				from.FindEntriesByName(en->GetName(), sameName);
+				for(std::vector<BackupStoreDirectory::Entry *>::iterator
+					i(sameName.begin()); i != sameName.end(); ++i)
 				{
-					if(c->GetName() == en->GetName())
-					{
-						// Copy
-						moving.push_back(new BackupStoreDirectory::Entry(*c));
+					BackupStoreDirectory::Entry *c = *i;
 
-						// Check for containing directory correction
-						if(c->GetFlags() & BackupStoreDirectory::Entry::Flags_Dir) dirsToChangeContainingID.push_back(c->GetObjectID());
-					}
+					// Copy
+					moving.push_back(new BackupStoreDirectory::Entry(*c));
+
+					// Check for containing directory correction
+					if(c->GetFlags() & BackupStoreDirectory::Entry::Flags_Dir) dirsToChangeContainingID.push_back(c->GetObjectID());
 				}
 				ASSERT(!moving.empty());
 			}
@@ -1826,16 +2425,11 @@ void BackupStoreContext::MoveObject(int64_t ObjectID, int64_t MoveFromDirectory,
 			BackupStoreDirectory &to(GetDirectoryInternal(MoveToDirectory));
 
 			// Check the new name doens't already exist
+			if(to.FindEntryByName(rNewFilename,
+				BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
+				targetSearchExcludeFlags) != 0)
 			{
-				BackupStoreDirectory::Iterator i(to);
-				BackupStoreDirectory::Entry *c = 0;
-				while((c = i.Next(BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING, targetSearchExcludeFlags)) != 0)
-				{
-					if(c->GetName() == rNewFilename)
-					{
-						THROW_EXCEPTION(BackupStoreException, NameAlreadyExistsInDirectory)
-					}
-				}
+				THROW_EXCEPTION(BackupStoreException, NameAlreadyExistsInDirectory)
 			}
 
 			// Copy the entries into it, changing the name as we go
@@ -1844,6 +2438,8 @@ void BackupStoreContext::MoveObject(int64_t ObjectID, int64_t MoveFromDirectory,
 				BackupStoreDirectory::Entry *en = (*i);
 				en->SetName(rNewFilename);
 				to.AddEntry(*en);	// adds copy
+				AddToJournal(JOURNAL_ENTRY_MOVED, en->GetObjectID(),
+					MoveToDirectory);
 			}
 
 			// Save back
@@ -10,21 +10,31 @@
 #ifndef BACKUPCONTEXT__H
 #define BACKUPCONTEXT__H
 
+#include <list>
+#include <set>
 #include <string>
 #include <map>
 #include <memory>
+#include <vector>
 
 #include "autogen_BackupProtocol.h"
+#include "BackupStoreDedupIndex.h"
+#include "BackupStoreFileWire.h"
 #include "BackupStoreInfo.h"
+#include "BackupStoreJournal.h"
 #include "BackupStoreRefCountDatabase.h"
 #include "NamedLock.h"
 #include "Message.h"
+#include "RaidFileConverter.h"
+#include "Thread.h"
 #include "Utils.h"
 
 class BackupStoreDirectory;
+class BackupStoreSharedDirectoryCache;
 class BackupStoreFilename;
 class IOStream;
 class BackupProtocolMessage;
+class RaidFileWrite;
 class StreamableMemBlock;
 
 class HousekeepingInterface
@@ -86,14 +96,12 @@ public:
 	bool SessionIsReadOnly() {return mReadOnly;}
 	bool AttemptToGetWriteLock();
 
+	// Data channel sessions are read only, but can also stage files
+	void SetDataChannel() {mDataChannel = true;}
+	bool SessionIsDataChannel() const {return mDataChannel;}
+
 	// Not really an API, but useful for BackupProtocolLocal2.
-	void ReleaseWriteLock()
-	{
-		if(mWriteLock.GotLock())
-		{
-			mWriteLock.ReleaseLock();
-		}
-	}
+	void ReleaseWriteLock();
 
 	void SetClientHasAccount(const std::string &rStoreRoot, int StoreDiscSet) {mClientHasAccount = true; mAccountRootDir = rStoreRoot; mStoreDiscSet = StoreDiscSet;}
 	bool GetClientHasAccount() const {return mClientHasAccount;}
@@ -160,6 +168,23 @@ public:
 	void DeleteDirectory(int64_t ObjectID, bool Undelete = false);
 	void MoveObject(int64_t ObjectID, int64_t MoveFromDirectory, int64_t MoveToDirectory, const BackupStoreFilename &rNewFilename, bool MoveAllWithSameName, bool AllowMoveOverDeletedObject);
 
+	// Files uploaded by data channel sessions, and stored by the
+	// read/write session
+	int64_t StageFile(IOStream &rFile);
+	int64_t AddStagedFile(int64_t StagedFileID,
+		int64_t InDirectory,
+		int64_t ModificationTime,
+		int64_t AttributesHash,
+		const BackupStoreFilename &rFilename);
+	void DeleteStagedFiles();
+
+	// Blocks already in the store, which new files can be diffed
+	// against wherever they are
+	void FindBlocks(const std::vector<file_BlockHash> &rHashes,
+		std::vector<file_BlockLocation> &rLocationsOut);
+	void AddBlockHashes(int64_t ObjectID,
+		const std::vector<file_BlockHash> &rHashes);
+
 	// Manipulating objects
 	enum
 	{
@@ -174,6 +199,35 @@ public:
 	int32_t GetClientID() const {return mClientID;}
 	const std::string& GetConnectionDetails() { return mConnectionDetails; }
 
+	// Directory cache size limit, in bytes, and statistics
+	void SetDirectoryCacheMaxSize(int64_t MaxSize)
+	{
+		mDirectoryCacheMaxSize = MaxSize;
+	}
+	int64_t GetDirectoryCacheMaxSize() const {return mDirectoryCacheMaxSize;}
+	int64_t GetDirectoryCacheSize() const {return mDirectoryCacheSize;}
+	int64_t GetDirectoryCacheHits() const {return mDirectoryCacheHits;}
+	int64_t GetDirectoryCacheMisses() const {return mDirectoryCacheMisses;}
+	int64_t GetDirectoryCacheEvictions() const
+	{
+		return mDirectoryCacheEvictions;
+	}
+	// Bytes of uploaded files which were verified as they were received,
+	// instead of being read back from disc
+	int64_t GetVerifyReadBytesSaved() const {return mVerifyReadBytesSaved;}
+
+	// Whether uploaded files are converted to RAID storage in a
+	// background thread, instead of before the upload is acknowledged
+	void SetDeferRaidConversion(bool Defer) {mDeferRaidConversion = Defer;}
+	void FinishRaidConversion();
+
+	// Directories read by other connections handled by this process,
+	// which this one can use without reading them from disc again
+	void SetSharedDirectoryCache(BackupStoreSharedDirectoryCache *pCache)
+	{
+		mpSharedDirectoryCache = pCache;
+	}
+
 private:
 	void MakeObjectFilename(int64_t ObjectID, std::string &rOutput, bool EnsureDirectoryExists = false);
 	BackupStoreDirectory &GetDirectoryInternal(int64_t ObjectID,
@@ -181,8 +235,15 @@ private:
 	void SaveDirectory(BackupStoreDirectory &rDir);
 	void RemoveDirectoryFromCache(int64_t ObjectID);
 	void ClearDirectoryCache();
+	void EvictFromDirectoryCache();
 	void DeleteDirectoryRecurse(int64_t ObjectID, bool Undelete);
+	void ReceiveAndVerifyFile(IOStream &rFile, IOStream &rDestination);
+	void CommitStoreFile(RaidFileWrite &rFile, const std::string &rFilename);
 	int64_t AllocateObjectID();
+	int64_t GetBlocksInCompleteFile(int64_t ObjectID);
+	BackupStoreDedupIndex &GetDedupIndex();
+	void AddToJournal(int Type, int64_t ObjectID, int64_t DirectoryID,
+		int64_t BlocksUsedDelta = 0);
 
 	std::string mConnectionDetails;
 	int32_t mClientID;
@@ -193,7 +254,14 @@ private:
 	int mStoreDiscSet;
 
 	bool mReadOnly;
+	bool mDataChannel;
 	NamedLock mWriteLock;
+	// Lock files don't stop other threads in the same process from
+	// taking the same lock on every platform, so the stores locked by
+	// all the contexts in this process are remembered here as well.
+	std::string mWriteLockFile;
+	static Mutex sWriteLockedStoresMutex;
+	static std::set<std::string> sWriteLockedStores;
 	int mSaveStoreInfoDelay; // how many times to delay saving the store info
 
 	// Store info
@@ -202,8 +270,41 @@ private:
 	// Refcount database
 	std::auto_ptr<BackupStoreRefCountDatabase> mapRefCount;
 
-	// Directory cache
-	std::map<int64_t, BackupStoreDirectory*> mDirectoryCache;
+	// Index of blocks by their hashes, opened when it's first used
+	std::auto_ptr<BackupStoreDedupIndex> mapDedupIndex;
+
+	// Changes for housekeeping to look at, if housekeeping has started
+	// a journal for this account
+	std::auto_ptr<BackupStoreJournal> mapJournal;
+
+	// Directory cache. Directories are evicted one at a time, least
+	// recently used first, when the total of their estimated sizes is
+	// more than mDirectoryCacheMaxSize. mDirectoryCacheLRU holds the
+	// IDs of the cached directories, most recently used first.
+	typedef struct
+	{
+		BackupStoreDirectory *mpDirectory;
+		int64_t mSize;
+		std::list<int64_t>::iterator mLRUPosition;
+		// Evicted but left in the cache, invalidated (debug only)
+		bool mEvicted;
+	} DirectoryCacheEntry;
+	typedef std::map<int64_t, DirectoryCacheEntry> DirectoryCache_t;
+	DirectoryCache_t mDirectoryCache;
+	std::list<int64_t> mDirectoryCacheLRU;
+	int64_t mDirectoryCacheSize;
+	int64_t mDirectoryCacheMaxSize;
+	int64_t mDirectoryCacheHits;
+	int64_t mDirectoryCacheMisses;
+	int64_t mDirectoryCacheEvictions;
+	BackupStoreSharedDirectoryCache *mpSharedDirectoryCache;
+
+	int64_t mVerifyReadBytesSaved;
+
+	// Uploaded files waiting to be converted to RAID storage, if
+	// conversion is deferred
+	bool mDeferRaidConversion;
+	std::auto_ptr<RaidFileConverter> mapRaidFileConverter;
 
 public:
 	class TestHook
@@ -0,0 +1,490 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreDedupIndex.cpp
+//		Purpose: Index of the blocks already stored in an account,
+//			 by their hashes
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "BackupStoreAccounts.h"
+#include "BackupStoreDedupIndex.h"
+#include "BackupStoreException.h"
+#include "BackupStoreRefCountDatabase.h"
+#include "RaidFileController.h"
+#include "RaidFileUtil.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+#define DEDUPINDEX_MAGIC_VALUE	0x44647049 // DdpI
+#define DEDUPINDEX_FILENAME	"dedup"
+
+// Number of slots in a new index, which must be a power of two
+#define DEDUPINDEX_INITIAL_SLOTS	4096
+
+// Object IDs in slots which are empty, or whose entries were removed.
+// Probing for a hash stops at an empty slot, but not a removed one.
+#define DEDUPINDEX_SLOT_EMPTY	0
+#define DEDUPINDEX_SLOT_REMOVED	-1
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::BackupStoreDedupIndex(const BackupStoreAccountDatabase::Entry &, std::auto_ptr<FileStream>, const dedupindex_StreamFormat &)
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreDedupIndex::BackupStoreDedupIndex(const
+	BackupStoreAccountDatabase::Entry& rAccount,
+	std::auto_ptr<FileStream> apIndexFile,
+	const dedupindex_StreamFormat &rHeader)
+: mAccount(rAccount),
+  mFilename(GetFilename(rAccount, false)),
+  mapIndexFile(apIndexFile),
+  mHeader(rHeader)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::~BackupStoreDedupIndex()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreDedupIndex::~BackupStoreDedupIndex()
+{
+}
+
+std::string BackupStoreDedupIndex::GetFilename(const
+	BackupStoreAccountDatabase::Entry& rAccount, bool Temporary)
+{
+	std::string RootDir = BackupStoreAccounts::GetAccountRoot(rAccount);
+	ASSERT(RootDir[RootDir.size() - 1] == '/' ||
+		RootDir[RootDir.size() - 1] == DIRECTORY_SEPARATOR_ASCHAR);
+
+	std::string fn(RootDir + DEDUPINDEX_FILENAME ".idx");
+	if(Temporary)
+	{
+		fn += "X";
+	}
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	RaidFileDiscSet rdiscSet(rcontroller.GetDiscSet(rAccount.GetDiscSet()));
+	return RaidFileUtil::MakeWriteFileName(rdiscSet, fn);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::CreateFile(const BackupStoreAccountDatabase::Entry &, const std::string &, int64_t, dedupindex_StreamFormat &)
+//		Purpose: Private. Create an empty index file with NumSlots
+//			 slots, replacing any file with the same name.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<FileStream> BackupStoreDedupIndex::CreateFile(
+	const BackupStoreAccountDatabase::Entry& rAccount,
+	const std::string &rFilename, int64_t NumSlots,
+	dedupindex_StreamFormat &rHeaderOut)
+{
+	if(FileExists(rFilename) && ::unlink(rFilename.c_str()) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to delete old block index",
+			rFilename, CommonException, OSFileError);
+	}
+
+	std::auto_ptr<FileStream> apFile(new FileStream(rFilename,
+		O_CREAT | O_EXCL | O_BINARY | O_RDWR));
+
+	rHeaderOut.mMagicValue = DEDUPINDEX_MAGIC_VALUE;
+	rHeaderOut.mAccountID = rAccount.GetID();
+	rHeaderOut.mNumSlots = NumSlots;
+	rHeaderOut.mNumEntries = 0;
+	rHeaderOut.mNumRemoved = 0;
+
+	dedupindex_StreamFormat hdr;
+	hdr.mMagicValue = htonl(rHeaderOut.mMagicValue);
+	hdr.mAccountID = htonl(rHeaderOut.mAccountID);
+	hdr.mNumSlots = box_hton64(NumSlots);
+	hdr.mNumEntries = 0;
+	hdr.mNumRemoved = 0;
+	apFile->Write(&hdr, sizeof(hdr));
+
+	// Extend it to its full length by writing the last slot. The gap
+	// before it reads back as zeros, which are empty slots.
+	dedupindex_Slot empty;
+	::memset(&empty, 0, sizeof(empty));
+	apFile->Seek(sizeof(hdr) + (NumSlots - 1) * sizeof(empty),
+		IOStream::SeekType_Absolute);
+	apFile->Write(&empty, sizeof(empty));
+
+	return apFile;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::Load(const BackupStoreAccountDatabase::Entry &)
+//		Purpose: Open the index of an account, creating an empty
+//			 one if it doesn't exist or can't be read
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupStoreDedupIndex> BackupStoreDedupIndex::Load(
+	const BackupStoreAccountDatabase::Entry& rAccount)
+{
+	std::string filename = GetFilename(rAccount, false);
+	std::auto_ptr<FileStream> apFile;
+	dedupindex_StreamFormat header;
+
+	if(FileExists(filename))
+	{
+		apFile.reset(new FileStream(filename, O_RDWR | O_BINARY));
+
+		dedupindex_StreamFormat hdr;
+		bool ok = apFile->ReadFullBuffer(&hdr, sizeof(hdr), 0);
+		if(ok)
+		{
+			header.mMagicValue = ntohl(hdr.mMagicValue);
+			header.mAccountID = ntohl(hdr.mAccountID);
+			header.mNumSlots = box_ntoh64(hdr.mNumSlots);
+			header.mNumEntries = box_ntoh64(hdr.mNumEntries);
+			header.mNumRemoved = box_ntoh64(hdr.mNumRemoved);
+
+			ok = header.mMagicValue == DEDUPINDEX_MAGIC_VALUE &&
+				(int32_t)header.mAccountID == rAccount.GetID() &&
+				header.mNumSlots > 0 &&
+				(header.mNumSlots & (header.mNumSlots - 1)) == 0 &&
+				apFile->GetPosition() + apFile->BytesLeftToRead() ==
+				(IOStream::pos_type)(sizeof(hdr) +
+					header.mNumSlots * sizeof(dedupindex_Slot));
+		}
+
+		if(!ok)
+		{
+			// It's only a hint, so start again
+			BOX_WARNING(BOX_FILE_MESSAGE(filename, "Block index "
+				"is corrupt, replacing it with an empty one"));
+			apFile.reset();
+		}
+	}
+
+	if(!apFile.get())
+	{
+		apFile = CreateFile(rAccount, filename,
+			DEDUPINDEX_INITIAL_SLOTS, header);
+	}
+
+	return std::auto_ptr<BackupStoreDedupIndex>(
+		new BackupStoreDedupIndex(rAccount, apFile, header));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::ReadSlot(int64_t, dedupindex_Slot &)
+//		Purpose: Private. Read a slot, converting its numbers to
+//			 host byte order.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDedupIndex::ReadSlot(int64_t Slot, dedupindex_Slot &rSlotOut)
+{
+	mapIndexFile->Seek(sizeof(dedupindex_StreamFormat) +
+		Slot * sizeof(dedupindex_Slot), IOStream::SeekType_Absolute);
+	if(!mapIndexFile->ReadFullBuffer(&rSlotOut, sizeof(rSlotOut), 0))
+	{
+		THROW_FILE_ERROR("Failed to read block index: short read",
+			mFilename, BackupStoreException, CouldNotLoadStoreInfo);
+	}
+	rSlotOut.mObjectID = box_ntoh64(rSlotOut.mObjectID);
+	rSlotOut.mBlockNumber = box_ntoh64(rSlotOut.mBlockNumber);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::WriteSlot(int64_t, const dedupindex_Slot &)
+//		Purpose: Private. Write a slot, whose numbers are in host
+//			 byte order.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDedupIndex::WriteSlot(int64_t Slot,
+	const dedupindex_Slot &rSlot)
+{
+	dedupindex_Slot slot(rSlot);
+	slot.mObjectID = box_hton64(rSlot.mObjectID);
+	slot.mBlockNumber = box_hton64(rSlot.mBlockNumber);
+	mapIndexFile->Seek(sizeof(dedupindex_StreamFormat) +
+		Slot * sizeof(dedupindex_Slot), IOStream::SeekType_Absolute);
+	mapIndexFile->Write(&slot, sizeof(slot));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::WriteHeader()
+//		Purpose: Private. Write the counts of slots in use back to
+//			 the file.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDedupIndex::WriteHeader()
+{
+	dedupindex_StreamFormat hdr;
+	hdr.mMagicValue = htonl(mHeader.mMagicValue);
+	hdr.mAccountID = htonl(mHeader.mAccountID);
+	hdr.mNumSlots = box_hton64(mHeader.mNumSlots);
+	hdr.mNumEntries = box_hton64(mHeader.mNumEntries);
+	hdr.mNumRemoved = box_hton64(mHeader.mNumRemoved);
+	mapIndexFile->Seek(0, IOStream::SeekType_Absolute);
+	mapIndexFile->Write(&hdr, sizeof(hdr));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::FindSlot(const file_BlockHash &, dedupindex_Slot &, int64_t *)
+//		Purpose: Private. Return the slot holding the entry for a
+//			 hash, reading it into rSlotOut, or -1 if there
+//			 isn't one. If pFreeSlotOut isn't null, it's set to
+//			 the first slot the entry could be added in.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDedupIndex::FindSlot(const file_BlockHash &rHash,
+	dedupindex_Slot &rSlotOut, int64_t *pFreeSlotOut)
+{
+	// The hashes are evenly distributed already, so any eight bytes
+	// of one will do to start probing from
+	uint64_t start;
+	::memcpy(&start, rHash.mHash, sizeof(start));
+
+	int64_t mask = mHeader.mNumSlots - 1;
+	int64_t freeSlot = -1;
+
+	// Adding an entry never fills the last empty slot, so this always
+	// stops
+	for(int64_t slot = start & mask; ; slot = (slot + 1) & mask)
+	{
+		ReadSlot(slot, rSlotOut);
+
+		if(rSlotOut.mObjectID == DEDUPINDEX_SLOT_EMPTY)
+		{
+			if(freeSlot == -1)
+			{
+				freeSlot = slot;
+			}
+			break;
+		}
+		else if(rSlotOut.mObjectID == DEDUPINDEX_SLOT_REMOVED)
+		{
+			if(freeSlot == -1)
+			{
+				freeSlot = slot;
+			}
+		}
+		else if(::memcmp(rSlotOut.mHash.mHash, rHash.mHash,
+			sizeof(rHash.mHash)) == 0)
+		{
+			return slot;
+		}
+	}
+
+	if(pFreeSlotOut != 0)
+	{
+		*pFreeSlotOut = freeSlot;
+	}
+	return -1;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::Find(const file_BlockHash &, int64_t &, int64_t &)
+//		Purpose: Look up a hash, returning true and the object and
+//			 block number which it was added with if it's there
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreDedupIndex::Find(const file_BlockHash &rHash,
+	int64_t &rObjectIDOut, int64_t &rBlockNumberOut)
+{
+	dedupindex_Slot slot;
+	if(FindSlot(rHash, slot, 0) == -1)
+	{
+		return false;
+	}
+
+	rObjectIDOut = slot.mObjectID;
+	rBlockNumberOut = slot.mBlockNumber;
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::Add(const file_BlockHash &, int64_t, int64_t, const BackupStoreRefCountDatabase *)
+//		Purpose: Record where the block with a hash is, replacing
+//			 any entry for the same hash
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDedupIndex::Add(const file_BlockHash &rHash,
+	int64_t ObjectID, int64_t BlockNumber,
+	const BackupStoreRefCountDatabase *pRefCount)
+{
+	ASSERT(ObjectID > 0);
+
+	dedupindex_Slot slot;
+	int64_t freeSlot = -1;
+	int64_t found = FindSlot(rHash, slot, &freeSlot);
+
+	if(found == -1)
+	{
+		// Keep at least a quarter of the slots empty, or probing
+		// for hashes which aren't there gets slow
+		if((mHeader.mNumEntries + mHeader.mNumRemoved + 1) * 4 >
+			mHeader.mNumSlots * 3)
+		{
+			Rebuild(pRefCount);
+			FindSlot(rHash, slot, &freeSlot);
+		}
+
+		ASSERT(freeSlot != -1);
+		ReadSlot(freeSlot, slot);
+		if(slot.mObjectID == DEDUPINDEX_SLOT_REMOVED)
+		{
+			mHeader.mNumRemoved--;
+		}
+		mHeader.mNumEntries++;
+		found = freeSlot;
+	}
+
+	::memcpy(&slot.mHash, &rHash, sizeof(slot.mHash));
+	slot.mObjectID = ObjectID;
+	slot.mBlockNumber = BlockNumber;
+	WriteSlot(found, slot);
+	WriteHeader();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::Remove(const file_BlockHash &, int64_t)
+//		Purpose: Remove the entry for a hash if it's in the given
+//			 object, such as one which turned out to be gone
+//			 when it was used. Returns whether it was there.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreDedupIndex::Remove(const file_BlockHash &rHash,
+	int64_t ObjectID)
+{
+	dedupindex_Slot slot;
+	int64_t found = FindSlot(rHash, slot, 0);
+	if(found == -1 || slot.mObjectID != ObjectID)
+	{
+		return false;
+	}
+
+	slot.mObjectID = DEDUPINDEX_SLOT_REMOVED;
+	slot.mBlockNumber = 0;
+	WriteSlot(found, slot);
+	mHeader.mNumEntries--;
+	mHeader.mNumRemoved++;
+	WriteHeader();
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDedupIndex::Rebuild(const BackupStoreRefCountDatabase *)
+//		Purpose: Private. Copy the entries into a new table, leaving
+//			 out removed ones and any for objects which no longer
+//			 have references, with twice as many slots as there
+//			 are entries left, and replace the file with it.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDedupIndex::Rebuild(const BackupStoreRefCountDatabase *pRefCount)
+{
+	int64_t lastObjectID = pRefCount ? pRefCount->GetLastObjectIDUsed() : 0;
+
+	// Count the entries which will be kept, to size the new table
+	std::vector<dedupindex_Slot> kept;
+	kept.reserve(mHeader.mNumEntries);
+	for(int64_t s = 0; s < mHeader.mNumSlots; ++s)
+	{
+		dedupindex_Slot slot;
+		ReadSlot(s, slot);
+		if(slot.mObjectID <= 0)
+		{
+			continue;
+		}
+		if(pRefCount != 0 && (slot.mObjectID > lastObjectID ||
+			pRefCount->GetRefCount(slot.mObjectID) == 0))
+		{
+			continue;
+		}
+		kept.push_back(slot);
+	}
+
+	int64_t numSlots = DEDUPINDEX_INITIAL_SLOTS;
+	while(numSlots < ((int64_t)kept.size() + 1) * 2)
+	{
+		numSlots *= 2;
+	}
+
+	BOX_TRACE("Rebuilding block index with " << numSlots << " slots "
+		"for " << kept.size() << " of " << mHeader.mNumEntries <<
+		" entries");
+
+	std::string tempFilename = GetFilename(mAccount, true);
+	mapIndexFile = CreateFile(mAccount, tempFilename, numSlots, mHeader);
+
+	for(std::vector<dedupindex_Slot>::const_iterator i = kept.begin();
+		i != kept.end(); ++i)
+	{
+		dedupindex_Slot slot;
+		int64_t freeSlot = -1;
+		FindSlot(i->mHash, slot, &freeSlot);
+		ASSERT(freeSlot != -1);
+		WriteSlot(freeSlot, *i);
+		mHeader.mNumEntries++;
+	}
+	WriteHeader();
+
+	#ifdef WIN32
+	mapIndexFile.reset();
+	if(FileExists(mFilename) && ::unlink(mFilename.c_str()) != 0)
+	{
+		THROW_EMU_FILE_ERROR("Failed to delete old block index",
+			mFilename, CommonException, OSFileError);
+	}
+	#endif
+
+	if(::rename(tempFilename.c_str(), mFilename.c_str()) != 0)
+	{
+		THROW_EMU_ERROR("Failed to rename temporary block index from " <<
+			tempFilename << " to " << mFilename, CommonException,
+			OSFileError);
+	}
+
+	#ifdef WIN32
+	mapIndexFile.reset(new FileStream(mFilename, O_RDWR | O_BINARY));
+	#endif
+}
@@ -0,0 +1,120 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreDedupIndex.h
+//		Purpose: Index of the blocks already stored in an account,
+//			 by their hashes
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREDEDUPINDEX__H
+#define BACKUPSTOREDEDUPINDEX__H
+
+#include <memory>
+#include <string>
+
+#include "BackupStoreAccountDatabase.h"
+#include "BackupStoreFileWire.h"
+#include "FileStream.h"
+
+class BackupStoreRefCountDatabase;
+
+// set packing to one byte
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "BeginStructPackForWire.h"
+#else
+BEGIN_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+typedef struct
+{
+	uint32_t mMagicValue;	// also the version number
+	uint32_t mAccountID;
+	int64_t mNumSlots;	// always a power of two
+	int64_t mNumEntries;	// slots in use
+	int64_t mNumRemoved;	// slots left behind by removed entries
+} dedupindex_StreamFormat;
+
+typedef struct
+{
+	file_BlockHash mHash;
+	int64_t mObjectID;	// 0 if the slot is empty, -1 if removed
+	int64_t mBlockNumber;
+} dedupindex_Slot;
+
+// Use default packing
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "EndStructPackForWire.h"
+#else
+END_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreDedupIndex
+//		Purpose: A hash table on disc, with open addressing, which
+//			 maps the hash of a block to an object in the store
+//			 and the number of the block in it. It's only a
+//			 hint: entries for objects which have been deleted
+//			 or turned into patches are left behind, and must
+//			 be checked before they are used. The file can be
+//			 deleted at any time, and will be recreated empty.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreDedupIndex
+{
+public:
+	~BackupStoreDedupIndex();
+private:
+	// Creation through static functions only
+	BackupStoreDedupIndex(const BackupStoreAccountDatabase::Entry&
+		rAccount, std::auto_ptr<FileStream> apIndexFile,
+		const dedupindex_StreamFormat &rHeader);
+	// No copying allowed
+	BackupStoreDedupIndex(const BackupStoreDedupIndex &);
+
+public:
+	// Open the index of an account, creating an empty one if it
+	// doesn't exist or can't be read
+	static std::auto_ptr<BackupStoreDedupIndex> Load(const
+		BackupStoreAccountDatabase::Entry& rAccount);
+
+	bool Find(const file_BlockHash &rHash, int64_t &rObjectIDOut,
+		int64_t &rBlockNumberOut);
+	// Replaces any entry with the same hash. The table is rebuilt when
+	// it's three quarters full, without the entries for objects which
+	// have no references in pRefCount, if it's not null.
+	void Add(const file_BlockHash &rHash, int64_t ObjectID,
+		int64_t BlockNumber,
+		const BackupStoreRefCountDatabase *pRefCount = 0);
+	// Remove the entry for a hash, if it's for this object
+	bool Remove(const file_BlockHash &rHash, int64_t ObjectID);
+
+	int64_t GetNumEntries() const {return mHeader.mNumEntries;}
+	int64_t GetNumSlots() const {return mHeader.mNumSlots;}
+
+private:
+	static std::string GetFilename(const BackupStoreAccountDatabase::Entry&
+		rAccount, bool Temporary);
+	static std::auto_ptr<FileStream> CreateFile(
+		const BackupStoreAccountDatabase::Entry& rAccount,
+		const std::string &rFilename, int64_t NumSlots,
+		dedupindex_StreamFormat &rHeaderOut);
+	int64_t FindSlot(const file_BlockHash &rHash, dedupindex_Slot &rSlotOut,
+		int64_t *pFreeSlotOut);
+	void ReadSlot(int64_t Slot, dedupindex_Slot &rSlotOut);
+	void WriteSlot(int64_t Slot, const dedupindex_Slot &rSlot);
+	void WriteHeader();
+	void Rebuild(const BackupStoreRefCountDatabase *pRefCount);
+
+	BackupStoreAccountDatabase::Entry mAccount;
+	std::string mFilename;
+	std::auto_ptr<FileStream> mapIndexFile;
+	// In host byte order
+	dedupindex_StreamFormat mHeader;
+};
+
+#endif // BACKUPSTOREDEDUPINDEX__H
@@ -11,6 +11,8 @@
 
 #include <sys/types.h>
 
+#include <algorithm>
+
 #include "BackupStoreDirectory.h"
 #include "IOStream.h"
 #include "BackupStoreException.h"
@@ -78,7 +80,8 @@ BackupStoreDirectory::BackupStoreDirectory()
   mObjectID(0),
   mContainerID(0),
   mAttributesModTime(0),
-  mUserInfo1(0)
+  mUserInfo1(0),
+  mIndexesValid(false)
 {
 	ASSERT(sizeof(uint64_t) == sizeof(box_time_t));
 }
@@ -101,7 +104,8 @@ BackupStoreDirectory::BackupStoreDirectory(int64_t ObjectID, int64_t ContainerID
   mObjectID(ObjectID),
   mContainerID(ContainerID),
   mAttributesModTime(0),
-  mUserInfo1(0)
+  mUserInfo1(0),
+  mIndexesValid(false)
 {
 }
 
@@ -167,6 +171,7 @@ void BackupStoreDirectory::ReadFromStream(IOStream &rStream, int Timeout)
 	int count = ntohl(hdr.mNumEntries);
 
 	// Clear existing list
+	InvalidateIndexes();
 	for(std::vector<Entry*>::iterator i = mEntries.begin();
 		i != mEntries.end(); i++)
 	{
@@ -185,6 +190,7 @@ void BackupStoreDirectory::ReadFromStream(IOStream &rStream, int Timeout)
 
 			// Add to list
 			mEntries.push_back(pen);
+			pen->mpDirectory = this;
 		}
 		catch(...)
 		{
@@ -316,6 +322,8 @@ BackupStoreDirectory::Entry *BackupStoreDirectory::AddEntry(const Entry &rEntryT
 		throw;
 	}
 
+	pnew->mpDirectory = this;
+	AddToIndexes(pnew);
 	return pnew;
 }
 
@@ -345,6 +353,8 @@ BackupStoreDirectory::AddEntry(const BackupStoreFilename &rName,
 		throw;
 	}
 
+	pnew->mpDirectory = this;
+	AddToIndexes(pnew);
 	return pnew;
 }
 
@@ -352,31 +362,56 @@ BackupStoreDirectory::AddEntry(const BackupStoreFilename &rName,
 //
 // Function
 //		Name:    BackupStoreDirectory::DeleteEntry(int64_t)
-//		Purpose: Deletes entry with given object ID (uses linear search, maybe a little inefficient)
+//		Purpose: Deletes entry with given object ID
 //		Created: 2003/08/27
 //
 // --------------------------------------------------------------------------
 void BackupStoreDirectory::DeleteEntry(int64_t ObjectID)
 {
 	ASSERT(!mInvalidated); // Compiled out of release builds
-	for(std::vector<Entry*>::iterator i(mEntries.begin());
-		i != mEntries.end(); ++i)
+	Entry *pentry = FindEntryByID(ObjectID);
+
+	if(pentry == 0)
 	{
-		if((*i)->mObjectID == ObjectID)
+		// Not found
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			CouldNotFindEntryInDirectory,
+			"Failed to find entry " << BOX_FORMAT_OBJECTID(ObjectID) <<
+			" in directory " << BOX_FORMAT_OBJECTID(mObjectID));
+	}
+
+	if(mIndexesValid)
+	{
+		std::pair<IDIndex_t::iterator, IDIndex_t::iterator> ids(
+			mIDIndex.equal_range(ObjectID));
+		for(IDIndex_t::iterator i(ids.first); i != ids.second; ++i)
+		{
+			if(i->second == pentry)
+			{
+				mIDIndex.erase(i);
+				break;
+			}
+		}
+
+		std::pair<NameIndex_t::iterator, NameIndex_t::iterator> names(
+			mNameIndex.equal_range(pentry->mName.GetEncodedFilename()));
+		for(NameIndex_t::iterator i(names.first); i != names.second; ++i)
 		{
-			// Delete
-			delete (*i);
-			// Remove from list
-			mEntries.erase(i);
-			// Done
-			return;
+			if(i->second == pentry)
+			{
+				mNameIndex.erase(i);
+				break;
+			}
 		}
 	}
 
-	// Not found
-	THROW_EXCEPTION_MESSAGE(BackupStoreException, CouldNotFindEntryInDirectory,
-		"Failed to find entry " << BOX_FORMAT_OBJECTID(ObjectID) <<
-		" in directory " << BOX_FORMAT_OBJECTID(mObjectID));
+	// Comparing pointers is much quicker than looking at the ID in
+	// each entry, which means touching every one of them.
+	std::vector<Entry*>::iterator i(std::find(mEntries.begin(),
+		mEntries.end(), pentry));
+	ASSERT(i != mEntries.end());
+	mEntries.erase(i);
+	delete pentry;
 }
 
 
@@ -391,6 +426,18 @@ void BackupStoreDirectory::DeleteEntry(int64_t ObjectID)
 BackupStoreDirectory::Entry *BackupStoreDirectory::FindEntryByID(int64_t ObjectID) const
 {
 	ASSERT(!mInvalidated); // Compiled out of release builds
+
+	if(mEntries.size() >= BACKUPSTOREDIRECTORY_INDEX_MIN_ENTRIES)
+	{
+		BuildIndexes();
+		IDIndex_t::const_iterator i(mIDIndex.lower_bound(ObjectID));
+		if(i != mIDIndex.end() && i->first == ObjectID)
+		{
+			return i->second;
+		}
+		return 0;
+	}
+
 	for(std::vector<Entry*>::const_iterator i(mEntries.begin());
 		i != mEntries.end(); ++i)
 	{
@@ -406,6 +453,230 @@ BackupStoreDirectory::Entry *BackupStoreDirectory::FindEntryByID(int64_t ObjectI
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::FindEntryByName(
+//			 const BackupStoreFilename &, int16_t, int16_t)
+//		Purpose: Finds the first entry with the given name and
+//			 flags. Returns 0 if there isn't one.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreDirectory::Entry *BackupStoreDirectory::FindEntryByName(
+	const BackupStoreFilename &rName, int16_t FlagsMustBeSet,
+	int16_t FlagsNotToBeSet) const
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+
+	if(mEntries.size() >= BACKUPSTOREDIRECTORY_INDEX_MIN_ENTRIES)
+	{
+		BuildIndexes();
+		std::pair<NameIndex_t::const_iterator, NameIndex_t::const_iterator>
+			names(mNameIndex.equal_range(rName.GetEncodedFilename()));
+		for(NameIndex_t::const_iterator i(names.first);
+			i != names.second; ++i)
+		{
+			if(i->second->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet))
+			{
+				return i->second;
+			}
+		}
+		return 0;
+	}
+
+	for(std::vector<Entry*>::const_iterator i(mEntries.begin());
+		i != mEntries.end(); ++i)
+	{
+		if((*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet) &&
+			(*i)->mName == rName)
+		{
+			return (*i);
+		}
+	}
+
+	return 0;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::FindEntriesByName(
+//			 const BackupStoreFilename &, std::vector<Entry *> &,
+//			 int16_t, int16_t)
+//		Purpose: Finds all the entries with the given name and
+//			 flags, such as every version of a file, in the order
+//			 in which they're stored in the directory.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::FindEntriesByName(const BackupStoreFilename &rName,
+	std::vector<Entry *> &rEntriesOut, int16_t FlagsMustBeSet,
+	int16_t FlagsNotToBeSet) const
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+	rEntriesOut.clear();
+
+	if(mEntries.size() >= BACKUPSTOREDIRECTORY_INDEX_MIN_ENTRIES)
+	{
+		BuildIndexes();
+		std::pair<NameIndex_t::const_iterator, NameIndex_t::const_iterator>
+			names(mNameIndex.equal_range(rName.GetEncodedFilename()));
+		for(NameIndex_t::const_iterator i(names.first);
+			i != names.second; ++i)
+		{
+			if(i->second->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet))
+			{
+				rEntriesOut.push_back(i->second);
+			}
+		}
+		return;
+	}
+
+	for(std::vector<Entry*>::const_iterator i(mEntries.begin());
+		i != mEntries.end(); ++i)
+	{
+		if((*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet) &&
+			(*i)->mName == rName)
+		{
+			rEntriesOut.push_back(*i);
+		}
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::BuildIndexes()
+//		Purpose: Index the entries by ID and by name, unless
+//			 that's already been done.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::BuildIndexes() const
+{
+	if(mIndexesValid)
+	{
+		return;
+	}
+
+	mIDIndex.clear();
+	mNameIndex.clear();
+
+	// Entries with equal keys are inserted after each other, so they
+	// stay in the same order as in mEntries.
+	for(std::vector<Entry*>::const_iterator i(mEntries.begin());
+		i != mEntries.end(); ++i)
+	{
+		mIDIndex.insert(mIDIndex.end(),
+			IDIndex_t::value_type((*i)->mObjectID, *i));
+		mNameIndex.insert(NameIndex_t::value_type(
+			(*i)->mName.GetEncodedFilename(), *i));
+	}
+
+	mIndexesValid = true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::InvalidateIndexes()
+//		Purpose: Throw away the indexes, after something has
+//			 changed the entries in a way which they can't
+//			 follow. They'll be rebuilt when next needed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::InvalidateIndexes()
+{
+	mIndexesValid = false;
+	mIDIndex.clear();
+	mNameIndex.clear();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::AddToIndexes(Entry *)
+//		Purpose: Add a new entry, at the end of mEntries, to the
+//			 indexes if they've been built.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::AddToIndexes(Entry *pEntry)
+{
+	if(!mIndexesValid)
+	{
+		return;
+	}
+
+	try
+	{
+		mIDIndex.insert(IDIndex_t::value_type(pEntry->mObjectID,
+			pEntry));
+		mNameIndex.insert(NameIndex_t::value_type(
+			pEntry->mName.GetEncodedFilename(), pEntry));
+	}
+	catch(...)
+	{
+		// The entry was added, and the indexes can be rebuilt later
+		InvalidateIndexes();
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::GetApproximateMemoryUsage()
+//		Purpose: Returns an estimate of the number of bytes of
+//			 memory used by this directory, its entries and
+//			 their indexes. Doesn't need to be exact, but
+//			 should grow in proportion to the real figure.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDirectory::GetApproximateMemoryUsage() const
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+
+	// Allow for the allocator's overhead, and for the nodes of the
+	// indexes (three pointers and a colour), as well as the objects.
+	const int64_t allocationOverhead = 2 * sizeof(void *);
+	const int64_t indexNodeSize = 4 * sizeof(void *) + allocationOverhead;
+
+	// Count the indexes if the directory is big enough to use them,
+	// whether or not they've been built yet, so that the estimate
+	// doesn't change just because the directory has been searched.
+	bool indexed = (mEntries.size() >=
+		BACKUPSTOREDIRECTORY_INDEX_MIN_ENTRIES);
+
+	int64_t usage = sizeof(BackupStoreDirectory) + mAttributes.GetSize() +
+		mEntries.capacity() * sizeof(Entry *);
+
+	for(std::vector<Entry*>::const_iterator i(mEntries.begin());
+		i != mEntries.end(); ++i)
+	{
+		int64_t nameSize = (*i)->mName.GetEncodedFilename().size();
+		usage += sizeof(Entry) + allocationOverhead + nameSize +
+			(*i)->mAttributes.GetSize();
+
+		if(indexed)
+		{
+			usage += 2 * (indexNodeSize + sizeof(Entry *)) +
+				sizeof(int64_t) + sizeof(std::string) +
+				nameSize;
+		}
+	}
+
+	return usage;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -427,7 +698,8 @@ BackupStoreDirectory::Entry::Entry()
   mMinMarkNumber(0),
   mMarkNumber(0),
   mDependsNewer(0),
-  mDependsOlder(0)
+  mDependsOlder(0),
+  mpDirectory(0)
 {
 }
 
@@ -466,7 +738,8 @@ BackupStoreDirectory::Entry::Entry(const Entry &rToCopy)
   mMinMarkNumber(rToCopy.mMinMarkNumber),
   mMarkNumber(rToCopy.mMarkNumber),
   mDependsNewer(rToCopy.mDependsNewer),
-  mDependsOlder(rToCopy.mDependsOlder)
+  mDependsOlder(rToCopy.mDependsOlder),
+  mpDirectory(0)
 {
 }
 
@@ -493,7 +766,8 @@ BackupStoreDirectory::Entry::Entry(const BackupStoreFilename &rName, box_time_t
   mMinMarkNumber(0),
   mMarkNumber(0),
   mDependsNewer(0),
-  mDependsOlder(0)
+  mDependsOlder(0),
+  mpDirectory(0)
 {
 }
 
@@ -10,6 +10,7 @@
 #ifndef BACKUPSTOREDIRECTORY__H
 #define BACKUPSTOREDIRECTORY__H
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -19,6 +20,10 @@
 
 class IOStream;
 
+// Directories with at least this many entries are indexed by object ID and
+// by name, the first time they're searched. Smaller ones are just scanned.
+#define BACKUPSTOREDIRECTORY_INDEX_MIN_ENTRIES	32
+
 // --------------------------------------------------------------------------
 //
 // Class
@@ -94,6 +99,10 @@ public:
 		Entry();
 		~Entry();
 		Entry(const Entry &rToCopy);
+	private:
+		// Assignment not allowed, as it would copy mpDirectory
+		Entry &operator=(const Entry &);
+	public:
 		Entry(const BackupStoreFilename &rName, box_time_t ModificationTime, int64_t ObjectID, int64_t SizeInBlocks, int16_t Flags, uint64_t AttributesHash);
 
 		void ReadFromStream(IOStream &rStream, int Timeout);
@@ -120,6 +129,10 @@ public:
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mObjectID = NewObjectID;
+			if(mpDirectory != 0)
+			{
+				mpDirectory->InvalidateIndexes();
+			}
 		}
 		int64_t GetSizeInBlocks() const
 		{
@@ -147,6 +160,10 @@ public:
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mName = rNewName;
+			if(mpDirectory != 0)
+			{
+				mpDirectory->InvalidateIndexes();
+			}
 		}
 		void SetSizeInBlocks(int64_t SizeInBlocks)
 		{
@@ -281,6 +298,10 @@ public:
 
 		uint64_t mDependsNewer;	// new version this depends on
 		uint64_t mDependsOlder;	// older version which depends on this
+
+		// The directory which owns this entry, if any, whose indexes
+		// must be updated if the name or ID changes. Not copied.
+		BackupStoreDirectory *mpDirectory;
 	};
 
 #ifndef BOX_RELEASE_BUILD
@@ -303,6 +324,17 @@ public:
 		uint64_t AttributesHash);
 	void DeleteEntry(int64_t ObjectID);
 	Entry *FindEntryByID(int64_t ObjectID) const;
+	// Find entries by name, in the order in which they're stored
+	Entry *FindEntryByName(const BackupStoreFilename &rName,
+		int16_t FlagsMustBeSet = Entry::Flags_INCLUDE_EVERYTHING,
+		int16_t FlagsNotToBeSet = Entry::Flags_EXCLUDE_NOTHING) const;
+	void FindEntriesByName(const BackupStoreFilename &rName,
+		std::vector<Entry *> &rEntriesOut,
+		int16_t FlagsMustBeSet = Entry::Flags_INCLUDE_EVERYTHING,
+		int16_t FlagsNotToBeSet = Entry::Flags_EXCLUDE_NOTHING) const;
+
+	// Roughly how much memory this object is using, for caches
+	int64_t GetApproximateMemoryUsage() const;
 
 	int64_t GetObjectID() const
 	{
@@ -479,6 +511,10 @@ public:
 	void Dump(void *clibFileHandle, bool ToTrace); // first arg is FILE *, but avoid including stdio.h everywhere
 
 private:
+	void BuildIndexes() const;
+	void InvalidateIndexes();
+	void AddToIndexes(Entry *pEntry);
+
 	int64_t mRevisionID;
 	int64_t mObjectID;
 	int64_t mContainerID;
@@ -486,6 +522,17 @@ private:
 	box_time_t mAttributesModTime;
 	StreamableMemBlock mAttributes;
 	int64_t mUserInfo1;
+
+	// Indexes of mEntries by object ID and by encoded name. Entries with
+	// equal keys are in the same order as in mEntries. They're built when
+	// a large directory is first searched, kept up to date by AddEntry()
+	// and DeleteEntry(), and thrown away by anything else which changes
+	// mEntries or the names or IDs of the entries in it.
+	typedef std::multimap<int64_t, Entry *> IDIndex_t;
+	typedef std::multimap<std::string, Entry *> NameIndex_t;
+	mutable IDIndex_t mIDIndex;
+	mutable NameIndex_t mNameIndex;
+	mutable bool mIndexesValid;
 };
 
 #endif // BACKUPSTOREDIRECTORY__H
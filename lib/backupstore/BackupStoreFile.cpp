@@ -14,6 +14,7 @@
 #endif
 
 #include <sys/stat.h>
+#include <math.h>
 #include <string.h>
 #include <new>
 #include <string.h>
@@ -26,6 +27,7 @@
 #include "BackupStoreConstants.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileChunker.h"
 #include "BackupStoreFileCryptVar.h"
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreFileWire.h"
@@ -36,7 +38,8 @@
 #include "CipherBlowfish.h"
 #include "CipherContext.h"
 #include "CollectInBufferStream.h"
-#include "Compress.h"
+#include "CompressCodec.h"
+#include "autogen_CompressException.h"
 #include "FileModificationTime.h"
 #include "FileStream.h"
 #include "Guards.h"
@@ -55,7 +58,12 @@ using namespace BackupStoreFileCryptVar;
 #define COPY_BUFFER_SIZE	(8*1024)
 
 // Statistics
-BackupStoreFileStats BackupStoreFile::msStats = {0,0,0};
+BackupStoreFileStats BackupStoreFile::msStats = {0,0,0,0};
+bool BackupStoreFile::msAdaptiveCompression = true;
+int BackupStoreFile::msEncodingThreads = 0;
+bool BackupStoreFile::msContentDefinedChunking = false;
+int BackupStoreFile::msCompressionCodec = COMPRESS_CODEC_ZLIB;
+int BackupStoreFile::msCompressionLevel = COMPRESS_CODEC_DEFAULT_LEVEL;
 
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 	bool sWarnedAboutBackwardsCompatiblity = false;
@@ -133,7 +141,7 @@ bool BackupStoreFile::VerifyEncodedFileFormat(IOStream &rFile, int64_t *pDiffFro
 	}
 
 	// Check magic number
-	if(ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V0
 #endif
@@ -196,7 +204,7 @@ bool BackupStoreFile::VerifyEncodedFileFormat(IOStream &rFile, int64_t *pDiffFro
 	}
 
 	// Check header
-	if((ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if((!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -378,7 +386,7 @@ void BackupStoreFile::VerifyStream::Write(const void *pBuffer, int NBytes, int T
 		memcpy(&hdr, finished.GetBuffer(), sizeof(hdr));
 
 		// Check magic number
-		if(ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1
+		if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 			&& ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V0
 #endif
@@ -387,6 +395,8 @@ void BackupStoreFile::VerifyStream::Write(const void *pBuffer, int NBytes, int T
 			THROW_EXCEPTION_MESSAGE(BackupStoreException, BadBackupStoreFile,
 				"Invalid header magic in stream: expected " <<
 				BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_MAGIC_VALUE_V1) <<
+				", " <<
+				BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_MAGIC_VALUE_V2) <<
 				" or " <<
 				BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_MAGIC_VALUE_V0) <<
 				" but found " <<
@@ -394,6 +404,11 @@ void BackupStoreFile::VerifyStream::Write(const void *pBuffer, int NBytes, int T
 		}
 
 		mNumBlocks = box_ntoh64(hdr.mNumBlocks);
+		if(mNumBlocks < 0)
+		{
+			THROW_EXCEPTION_MESSAGE(BackupStoreException, BadBackupStoreFile,
+				"Invalid number of blocks in stream: " << mNumBlocks);
+		}
 		mBlockIndexSize = (mNumBlocks * sizeof(file_BlockIndexEntry)) +
 			sizeof(file_BlockIndexHeader);
 		mContainerID = box_ntoh64(hdr.mContainerID);
@@ -431,7 +446,20 @@ void BackupStoreFile::VerifyStream::Write(const void *pBuffer, int NBytes, int T
 	else if(oldState == State_AttributesSize)
 	{
 		ASSERT(mState == State_Attributes);
-		mCurrentUnitSize = ntohl(*(int32_t *)finished.GetBuffer());
+		int32_t size = ntohl(*(int32_t *)finished.GetBuffer());
+		if(size < 0)
+		{
+			THROW_EXCEPTION_MESSAGE(BackupStoreException, BadBackupStoreFile,
+				"Invalid attributes size in stream: " << size);
+		}
+		mCurrentUnitSize = size;
+
+		if(mCurrentUnitSize == 0)
+		{
+			// No attributes to skip, so the blocks start here
+			mState = State_Blocks;
+			mBlockDataPosition = mCurrentPosition;
+		}
 	}
 	else if(oldState == State_Attributes)
 	{
@@ -530,7 +558,7 @@ void BackupStoreFile::VerifyStream::Close(bool CloseCopyStream)
 	// Load the block index header
 	memcpy(&blkhdr, finished.GetBuffer(), sizeof(blkhdr));
 
-	if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -539,6 +567,8 @@ void BackupStoreFile::VerifyStream::Close(bool CloseCopyStream)
 		THROW_EXCEPTION_MESSAGE(BackupStoreException, BadBackupStoreFile,
 			"Invalid block index magic in stream: expected " <<
 			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1) <<
+			", " <<
+			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2) <<
 			" or " <<
 			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0) <<
 			" but found " <<
@@ -792,6 +822,7 @@ void BackupStoreFile::DecodedStream::Setup(const BackupClientFileAttributes *pAl
 		// control flows on
 #endif
 	case OBJECTMAGIC_FILE_MAGIC_VALUE_V1:
+	case OBJECTMAGIC_FILE_MAGIC_VALUE_V2:
 		inFileOrder = true;
 		break;
 
@@ -801,6 +832,7 @@ void BackupStoreFile::DecodedStream::Setup(const BackupClientFileAttributes *pAl
 		// control flows on
 #endif
 	case OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1:
+	case OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2:
 		inFileOrder = false;
 		break;
 
@@ -839,7 +871,7 @@ void BackupStoreFile::DecodedStream::Setup(const BackupClientFileAttributes *pAl
 	}
 
 	// Check magic number
-	if(ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V0
 #endif
@@ -963,7 +995,7 @@ void BackupStoreFile::DecodedStream::ReadBlockIndex(bool MagicAlreadyRead)
 		}
 
 		// Check magic value
-		if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+		if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 			&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -1274,9 +1306,191 @@ void BackupStoreFile::SetAESKey(const void *pKey, int KeyLength)
 	spEncrypt = &sAESEncrypt;
 	sEncryptCipherType = HEADER_AES_ENCODING;
 }
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetAESGCMKey(const void *, int)
+//		Purpose: Sets the key for authenticated encryption of file
+//				 data with AES-GCM. Chunks encrypted with it can always
+//				 be decrypted, but it's only used to encrypt them
+//				 after SetAuthenticatedEncryption(true).
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetAESGCMKey(const void *pKey, int KeyLength)
+{
+	sAESGCMEncrypt.Reset();
+	sAESGCMEncrypt.Init(CipherContext::Encrypt, CipherAES(CipherDescription::Mode_GCM, pKey, KeyLength));
+	sAESGCMDecrypt.Reset();
+	sAESGCMDecrypt.Init(CipherContext::Decrypt, CipherAES(CipherDescription::Mode_GCM, pKey, KeyLength));
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetAuthenticatedEncryption(bool)
+//		Purpose: Choose whether to encrypt file data with AES-GCM,
+//				 which authenticates each chunk in the same pass as
+//				 encrypting it, or AES-CBC. Older versions can't
+//				 decrypt AES-GCM chunks.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetAuthenticatedEncryption(bool Authenticated)
+{
+	if(Authenticated)
+	{
+		if(!sAESGCMEncrypt.IsInitialised())
+		{
+			THROW_EXCEPTION_MESSAGE(BackupStoreException, Internal,
+				"No key set for authenticated encryption");
+		}
+		spEncrypt = &sAESGCMEncrypt;
+		sEncryptCipherType = HEADER_AES_GCM_ENCODING;
+	}
+	else if(sAESEncrypt.IsInitialised())
+	{
+		spEncrypt = &sAESEncrypt;
+		sEncryptCipherType = HEADER_AES_ENCODING;
+	}
+	else
+	{
+		spEncrypt = &sBlowfishEncrypt;
+		sEncryptCipherType = HEADER_BLOWFISH_ENCODING;
+	}
+}
 #endif
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetBlockHashSecret(const void *, int)
+//		Purpose: Sets the secret which block hashes are keyed with
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetBlockHashSecret(const void *pSecret, int SecretLength)
+{
+	if(SecretLength > (int)sizeof(sBlockHashSecret))
+	{
+		SecretLength = sizeof(sBlockHashSecret);
+	}
+	if(SecretLength < 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+
+	::memcpy(sBlockHashSecret, pSecret, SecretLength);
+	sBlockHashSecretLength = SecretLength;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::MakeBlockHash(int32_t, const uint8_t *, file_BlockHash &)
+//		Purpose: Make the hash which identifies a block to the
+//			 store, from its size and strong checksum, keyed with
+//			 the secret
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::MakeBlockHash(int32_t ClearSize,
+	const uint8_t *pStrongChecksum, file_BlockHash &rHashOut)
+{
+	if(sBlockHashSecretLength == 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, BlockHashSecretNotSet)
+	}
+
+	int32_t size = htonl(ClearSize);
+	MD5Digest digest;
+	digest.Add(pStrongChecksum, MD5Digest::DigestLength);
+	digest.Add(&size, sizeof(size));
+	digest.Add(sBlockHashSecret, sBlockHashSecretLength);
+	digest.Finish();
+
+	ASSERT(sizeof(rHashOut.mHash) == MD5Digest::DigestLength);
+	::memcpy(rHashOut.mHash, digest.DigestAsData(), sizeof(rHashOut.mHash));
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CalculateBlockHashes(const std::string &, std::vector<file_BlockHash> &)
+//		Purpose: Cut a local file into blocks in the way that it
+//			 would be if it was uploaded in full, and make the
+//			 hash of each one, to find them in the store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::CalculateBlockHashes(const std::string &rFilename,
+	std::vector<file_BlockHash> &rHashesOut)
+{
+	FileStream file(rFilename);
+	int64_t fileSize = file.BytesLeftToRead();
+
+	std::vector<int32_t> blockSizes;
+	if(msContentDefinedChunking)
+	{
+		BackupStoreFileChunker chunker(
+			BackupStoreFileChunker::AverageChunkSizeForFile(fileSize));
+		chunker.ChunkStream(file, fileSize, blockSizes);
+		file.Seek(0, IOStream::SeekType_Absolute);
+	}
+	else if(fileSize > 0)
+	{
+		int64_t numBlocks;
+		int32_t blockSize, lastBlockSize;
+		BackupStoreFileEncodeStream::CalculateBlockSizes(fileSize,
+			numBlocks, blockSize, lastBlockSize);
+		blockSizes.resize(numBlocks, blockSize);
+		blockSizes.back() = lastBlockSize;
+	}
+
+	if(blockSizes.empty())
+	{
+		return;
+	}
+
+	int32_t maxBlockSize = 0;
+	for(std::vector<int32_t>::const_iterator i = blockSizes.begin();
+		i != blockSizes.end(); ++i)
+	{
+		if(*i > maxBlockSize)
+		{
+			maxBlockSize = *i;
+		}
+	}
+
+	MemoryBlockGuard<uint8_t *> buffer(maxBlockSize);
+	rHashesOut.reserve(rHashesOut.size() + blockSizes.size());
+	for(std::vector<int32_t>::const_iterator i = blockSizes.begin();
+		i != blockSizes.end(); ++i)
+	{
+		if(!file.ReadFullBuffer(buffer, *i, 0))
+		{
+			// The file has changed since its size was read
+			THROW_EXCEPTION(BackupStoreException,
+				Temp_FileEncodeStreamDidntReadBuffer)
+		}
+
+		MD5Digest strongChecksum;
+		strongChecksum.Add(buffer, *i);
+		strongChecksum.Finish();
+
+		file_BlockHash hash;
+		MakeBlockHash(*i, strongChecksum.DigestAsData(), hash);
+		rHashesOut.push_back(hash);
+	}
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1291,8 +1505,8 @@ int BackupStoreFile::MaxBlockSizeForChunkSize(int ChunkSize)
 	// which is encrypted, and has a 1 bytes header and the IV added, plus 1 byte for luck
 	// And then on top, add 128 bytes just to make sure. (Belts and braces approach to fixing
 	// an problem where a rather non-compressable file didn't fit in a block buffer.)
-	return sBlowfishEncrypt.MaxOutSizeForInBufferSize(Compress_MaxSizeForCompressedData(ChunkSize)) + 1 + 1
-		+ sBlowfishEncrypt.GetIVLength() + 128;
+	return sBlowfishEncrypt.MaxOutSizeForInBufferSize(CompressCodec::MaxCompressedSize(ChunkSize)) + 1 + 1
+		+ sBlowfishEncrypt.GetIVLength() + CIPHERCONTEXT_AEAD_TAG_LENGTH + 128;
 }
 
 
@@ -1300,14 +1514,210 @@ int BackupStoreFile::MaxBlockSizeForChunkSize(int ChunkSize)
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::EncodeChunk(const void *, int, BackupStoreFile::EncodingBuffer &)
-//		Purpose: Encodes a chunk (encryption, possible compressed beforehand)
+//		Name:    BackupStoreFile::CompressionContext::CompressionContext(bool)
+//		Purpose: Constructor. If Adaptive is false, every chunk big
+//				 enough to be worth compressing is compressed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFile::CompressionContext::CompressionContext(bool Adaptive)
+	: mCodec(msCompressionCodec),
+	  mLevel(msCompressionLevel),
+	  mpCompressor(0),
+	  mpBuffer(0),
+	  mBufferSize(0),
+	  mAdaptive(Adaptive),
+	  mFailedAttempts(0),
+	  mChunksSinceAttempt(0),
+	  mBytesNotCompressed(0)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CompressionContext::~CompressionContext()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFile::CompressionContext::~CompressionContext()
+{
+	if(mpCompressor != 0)
+	{
+		delete mpCompressor;
+		mpCompressor = 0;
+	}
+	if(mpBuffer != 0)
+	{
+		::free(mpBuffer);
+		mpBuffer = 0;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CompressionContext::Allocate(int)
+//		Purpose: Set up the compressor and its buffer for chunks of up
+//				 to MaxChunkSize bytes now, rather than when the first
+//				 chunk is compressed, so that a context used by a
+//				 worker thread never needs to allocate memory.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::CompressionContext::Allocate(int MaxChunkSize)
+{
+	int maxSize = CompressCodec::MaxCompressedSize(MaxChunkSize);
+	if(mBufferSize < maxSize)
+	{
+		uint8_t *buffer = (uint8_t *)::realloc(mpBuffer, maxSize);
+		if(buffer == 0)
+		{
+			throw std::bad_alloc();
+		}
+		mpBuffer = buffer;
+		mBufferSize = maxSize;
+	}
+
+	if(mpCompressor == 0)
+	{
+		mpCompressor = new CompressCodec(mCodec, mLevel);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CompressionContext::ShouldTryCompressing(const void *, int)
+//		Purpose: Decide whether a chunk is worth compressing. Chunks
+//				 whose bytes look random are not, and neither are
+//				 most chunks of a file whose recent chunks didn't
+//				 compress, although one is tried every so often in
+//				 case the contents of the file change.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFile::CompressionContext::ShouldTryCompressing(const void *Chunk, int ChunkSize)
+{
+	if(ChunkSize < BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE)
+	{
+		return false;
+	}
+
+	if(!mAdaptive)
+	{
+		return true;
+	}
+
+	if(mFailedAttempts >= BACKUP_FILE_COMPRESSION_FAILURES_BEFORE_SKIPPING)
+	{
+		if(++mChunksSinceAttempt < BACKUP_FILE_COMPRESSION_RETRY_INTERVAL)
+		{
+			return false;
+		}
+		mChunksSinceAttempt = 0;
+	}
+
+	if(ChunkSize < BACKUP_FILE_ENTROPY_SAMPLE_SIZE)
+	{
+		// Too small for a useful sample, just try it
+		return true;
+	}
+
+	// Count the bytes in short runs spread evenly through the chunk,
+	// so that both the headers and the body of the data are seen
+	uint32_t counts[256] = {0};
+	const uint8_t *chunk = (const uint8_t *)Chunk;
+	const int runs = BACKUP_FILE_ENTROPY_SAMPLE_SIZE / BACKUP_FILE_ENTROPY_SAMPLE_RUN;
+	const int64_t spacing = (ChunkSize - BACKUP_FILE_ENTROPY_SAMPLE_RUN) / (runs - 1);
+	for(int r = 0; r < runs; ++r)
+	{
+		const uint8_t *run = chunk + (r * spacing);
+		for(int b = 0; b < BACKUP_FILE_ENTROPY_SAMPLE_RUN; ++b)
+		{
+			++counts[run[b]];
+		}
+	}
+
+	// Shannon entropy in bits per byte, as log2(N) - sum(c log2 c) / N
+	double sum = 0;
+	for(int c = 0; c < 256; ++c)
+	{
+		if(counts[c] > 1)
+		{
+			sum += counts[c] * ::log((double)counts[c]);
+		}
+	}
+	const double n = BACKUP_FILE_ENTROPY_SAMPLE_SIZE;
+	double entropy = (::log(n) - (sum / n)) / ::log(2.0);
+
+	return entropy < BACKUP_FILE_INCOMPRESSIBLE_ENTROPY;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CompressionContext::CompressChunk(const void *, int)
+//		Purpose: Compress a chunk into the context's buffer, returning
+//				 the compressed size. Use GetCompressedData() to get
+//				 the result.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::CompressionContext::CompressChunk(const void *Chunk, int ChunkSize)
+{
+	// Does nothing unless this chunk is bigger than any before
+	Allocate(ChunkSize);
+	return mpCompressor->Compress(Chunk, ChunkSize, mpBuffer, mBufferSize);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CompressionContext::RecordResult(int, int)
+//		Purpose: Note how well a chunk compressed, for deciding
+//				 whether to try compressing the following chunks.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::CompressionContext::RecordResult(int ChunkSize, int CompressedSize)
+{
+	if(CompressedSize > (ChunkSize - (ChunkSize / BACKUP_FILE_MIN_COMPRESSION_GAIN)))
+	{
+		++mFailedAttempts;
+	}
+	else
+	{
+		mFailedAttempts = 0;
+	}
+	mChunksSinceAttempt = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::EncodeChunk(const void *, int, BackupStoreFile::EncodingBuffer &, BackupStoreFile::CompressionContext *, CipherContext *)
+//		Purpose: Encodes a chunk (encryption, possible compressed beforehand).
+//				 Pass a CompressionContext when encoding many chunks,
+//				 to reuse the compressor and, if it's adaptive, to
+//				 store incompressible chunks without compressing them.
+//				 Threads other than the main one must pass their own
+//				 copy of the file data encryption context, otherwise
+//				 the shared one is used.
 //		Created: 8/12/03
 //
 // --------------------------------------------------------------------------
-int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput)
+int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize,
+	BackupStoreFile::EncodingBuffer &rOutput,
+	BackupStoreFile::CompressionContext *pCompression,
+	CipherContext *pEncrypt)
 {
 	ASSERT(spEncrypt != 0);
+	if(pEncrypt == 0)
+	{
+		pEncrypt = spEncrypt;
+	}
 
 	// Check there's some space in the output block
 	if(rOutput.mBufferSize < 256)
@@ -1318,12 +1728,52 @@ int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFi
 	// Check alignment of the block
 	ASSERT((((uint64_t)rOutput.mpBuffer) % BACKUPSTOREFILE_CODING_BLOCKSIZE) == BACKUPSTOREFILE_CODING_OFFSET);
 
+	// Without a context, compress every chunk that's big enough
+	CompressionContext temporaryContext(false);
+	if(pCompression == 0)
+	{
+		pCompression = &temporaryContext;
+	}
+
 	// Want to compress it?
-	bool compressChunk = (ChunkSize >= BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE);
+	bool compressChunk = pCompression->ShouldTryCompressing(Chunk, ChunkSize);
+	const void *toEncrypt = Chunk;
+	int toEncryptSize = ChunkSize;
+	if(compressChunk)
+	{
+		int compressedSize = pCompression->CompressChunk(Chunk, ChunkSize);
+		pCompression->RecordResult(ChunkSize, compressedSize);
+
+		if(compressedSize >= ChunkSize && pCompression->IsAdaptive())
+		{
+			// Compressing made it bigger, store it as it was
+			compressChunk = false;
+		}
+		else
+		{
+			toEncrypt = pCompression->GetCompressedData();
+			toEncryptSize = compressedSize;
+		}
+	}
+
+	if(!compressChunk && ChunkSize >= BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE)
+	{
+		// A caller's own context keeps count for the caller to add
+		// to the stats, as this might not be the main thread
+		pCompression->AddBytesNotCompressed(ChunkSize);
+		if(pCompression == &temporaryContext)
+		{
+			msStats.mBytesNotCompressed += ChunkSize;
+		}
+	}
 
 	// Build header
 	uint8_t header = sEncryptCipherType << HEADER_ENCODING_SHIFT;
-	if(compressChunk) header |= HEADER_CHUNK_IS_COMPRESSED;
+	if(compressChunk)
+	{
+		header |= HEADER_CHUNK_IS_COMPRESSED |
+			(pCompression->GetCodec() << HEADER_COMPRESSION_SHIFT);
+	}
 
 	// Store header
 	rOutput.mpBuffer[0] = header;
@@ -1331,12 +1781,19 @@ int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFi
 
 	// Setup cipher, and store the IV
 	int ivLen = 0;
-	const void *iv = spEncrypt->SetRandomIV(ivLen);
+	const void *iv = pEncrypt->SetRandomIV(ivLen);
 	::memcpy(rOutput.mpBuffer + outOffset, iv, ivLen);
 	outOffset += ivLen;
 
 	// Start encryption process
-	spEncrypt->Begin();
+	pEncrypt->Begin();
+
+	// Authenticated encryption covers the header as well, so that the
+	// flags in it can't be changed either
+	if(pEncrypt->IsAuthenticated())
+	{
+		pEncrypt->AddAuthenticatedData(rOutput.mpBuffer, 1);
+	}
 
 	#define ENCODECHUNK_CHECK_SPACE(ToEncryptSize)									\
 		{																			\
@@ -1346,43 +1803,18 @@ int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFi
 			}																		\
 		}
 
-	// Encode the chunk
-	if(compressChunk)
-	{
-		// buffer to compress into
-		uint8_t buffer[2048];
-
-		// Set compressor with all the chunk as an input
-		Compress<true> compress;
-		compress.Input(Chunk, ChunkSize);
-		compress.FinishInput();
+	// Encrypt the chunk, or its compressed form
+	ENCODECHUNK_CHECK_SPACE(toEncryptSize)
+	outOffset += pEncrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset, toEncrypt, toEncryptSize);
+	ENCODECHUNK_CHECK_SPACE(16)
+	outOffset += pEncrypt->Final(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset);
 
-		// Get and encrypt output
-		while(!compress.OutputHasFinished())
-		{
-			int s = compress.Output(buffer, sizeof(buffer));
-			if(s > 0)
-			{
-				ENCODECHUNK_CHECK_SPACE(s)
-				outOffset += spEncrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset, buffer, s);
-			}
-			else
-			{
-				// Should never happen, as we put all the input in in one go.
-				// So if this happens, it means there's a logical problem somewhere
-				THROW_EXCEPTION(BackupStoreException, Internal)
-			}
-		}
-		ENCODECHUNK_CHECK_SPACE(16)
-		outOffset += spEncrypt->Final(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset);
-	}
-	else
+	// Followed by the tag, for authenticated encryption
+	if(pEncrypt->IsAuthenticated())
 	{
-		// Straight encryption
-		ENCODECHUNK_CHECK_SPACE(ChunkSize)
-		outOffset += spEncrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset, Chunk, ChunkSize);
-		ENCODECHUNK_CHECK_SPACE(16)
-		outOffset += spEncrypt->Final(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset);
+		ENCODECHUNK_CHECK_SPACE(pEncrypt->GetTagLength())
+		pEncrypt->GetTag(rOutput.mpBuffer + outOffset);
+		outOffset += pEncrypt->GetTagLength();
 	}
 
 	ASSERT(outOffset < rOutput.mBufferSize);		// first check should have sorted this -- merely logic check
@@ -1417,27 +1849,40 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 	// Get header, make checks, etc
 	uint8_t header = input[0];
 	bool chunkCompressed = (header & HEADER_CHUNK_IS_COMPRESSED) == HEADER_CHUNK_IS_COMPRESSED;
-	uint8_t encodingType = (header >> HEADER_ENCODING_SHIFT);
-	if(encodingType != HEADER_BLOWFISH_ENCODING && encodingType != HEADER_AES_ENCODING)
+	uint8_t encodingType = (header >> HEADER_ENCODING_SHIFT) & HEADER_ENCODING_MASK;
+	if(encodingType != HEADER_BLOWFISH_ENCODING && encodingType != HEADER_AES_ENCODING &&
+		encodingType != HEADER_AES_GCM_ENCODING)
 	{
 		THROW_EXCEPTION(BackupStoreException, ChunkHasUnknownEncoding)
 	}
+	int codec = header >> HEADER_COMPRESSION_SHIFT;
+	if(codec != COMPRESS_CODEC_ZLIB && (!chunkCompressed ||
+		!CompressCodec::IsAvailable(codec)))
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			ChunkHasUnknownCompression, "Chunk is compressed with " <<
+			CompressCodec::GetName(codec) << ", which is not "
+			"supported by this build");
+	}
 
 #ifndef HAVE_OLD_SSL
 	// Choose cipher
-	CipherContext &cipher((encodingType == HEADER_AES_ENCODING)?sAESDecrypt:sBlowfishDecrypt);
+	CipherContext &cipher((encodingType == HEADER_AES_GCM_ENCODING)?sAESGCMDecrypt:
+		(encodingType == HEADER_AES_ENCODING)?sAESDecrypt:sBlowfishDecrypt);
 #else
 	// AES not supported with this version of OpenSSL
-	if(encodingType == HEADER_AES_ENCODING)
+	if(encodingType == HEADER_AES_ENCODING || encodingType == HEADER_AES_GCM_ENCODING)
 	{
 		THROW_EXCEPTION(BackupStoreException, AEScipherNotSupportedByInstalledOpenSSL)
 	}
 	CipherContext &cipher(sBlowfishDecrypt);
 #endif
 
-	// Check enough space for header, an IV and one byte of input
+	// Check enough space for header, an IV, one byte of input and the
+	// tag, if there is one
 	int ivLen = cipher.GetIVLength();
-	if(EncodedSize < (1 + ivLen + 1))
+	int tagLen = cipher.IsAuthenticated() ? cipher.GetTagLength() : 0;
+	if(EncodedSize < (1 + ivLen + 1 + tagLen))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadEncodedChunk)
 	}
@@ -1446,13 +1891,46 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 	cipher.SetIV(input + 1);
 	cipher.Begin();
 
+	// Final() checks the data and header against the tag at the end
+	if(cipher.IsAuthenticated())
+	{
+		EncodedSize -= tagLen;
+		cipher.SetTag(input + EncodedSize);
+		cipher.AddAuthenticatedData(input, 1);
+	}
+
 	// Setup vars for code
 	int inOffset = 1 + ivLen;
 	uint8_t *output = (uint8_t*)Output;
 	int outOffset = 0;
 
 	// Do action
-	if(chunkCompressed)
+	if(chunkCompressed && (codec != COMPRESS_CODEC_ZLIB ||
+		cipher.IsAuthenticated()))
+	{
+		// zstd and LZ4 only decompress whole buffers, so decrypt
+		// it all first. Authenticated chunks are also checked before
+		// anything is done with the decrypted data.
+		int decryptedSize = EncodedSize - inOffset +
+			cipher.GetIVLength() + 16;
+		MemoryBlockGuard<uint8_t *> decrypted(decryptedSize);
+
+		int s = cipher.Transform(decrypted, decryptedSize,
+			input + inOffset, EncodedSize - inOffset);
+		s += cipher.Final(decrypted + s, decryptedSize - s);
+
+		try
+		{
+			outOffset = CompressCodec::Decompress(codec, decrypted,
+				s, output, OutputSize);
+		}
+		catch(CompressException &e)
+		{
+			THROW_EXCEPTION_MESSAGE(BackupStoreException,
+				ChunkContainsBadCompressedData, e.what());
+		}
+	}
+	else if(chunkCompressed)
 	{
 		// Do things in chunks
 		uint8_t buffer[2048];
@@ -1554,7 +2032,7 @@ std::auto_ptr<IOStream> BackupStoreFile::ReorderFileToStreamOrder(IOStream *pStr
 	}
 
 	// Check magic number
-	if(ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V0
 #endif
@@ -1604,6 +2082,7 @@ void BackupStoreFile::ResetStats()
 	msStats.mBytesInEncodedFiles = 0;
 	msStats.mBytesAlreadyOnServer = 0;
 	msStats.mTotalFileStreamSize = 0;
+	msStats.mBytesNotCompressed = 0;
 }
 
 
@@ -1650,7 +2129,7 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 	}
 
 	// Check magic
-	if(hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0)
 #endif
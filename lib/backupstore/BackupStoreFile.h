@@ -12,6 +12,7 @@
 
 #include <cstdlib>
 #include <memory>
+#include <vector>
 #include <cstdlib>
 
 #include "autogen_BackupProtocol.h"
@@ -27,10 +28,13 @@ typedef struct
 	int64_t mBytesInEncodedFiles;
 	int64_t mBytesAlreadyOnServer;
 	int64_t mTotalFileStreamSize;
+	int64_t mBytesNotCompressed;
 } BackupStoreFileStats;
 
 class BackgroundTask;
+class CipherContext;
 class RunStatusProvider;
+class CompressCodec;
 
 // Uncomment to disable backwards compatibility
 //#define BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
@@ -173,6 +177,8 @@ public:
 		virtual void Write(const void *pBuffer, int NBytes,
 			int Timeout = IOStream::TimeOutInfinite);
 		virtual void Close(bool CloseCopyStream = true);
+		// The number of bytes written so far
+		virtual pos_type GetPosition() const {return mCurrentPosition;}
 		virtual bool StreamDataLeft()
 		{
 			THROW_EXCEPTION(CommonException, NotSupported);
@@ -218,6 +224,11 @@ public:
 	static void CombineFile(IOStream &rDiff, IOStream &rDiff2, IOStream &rFrom, IOStream &rOut);
 	static void CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream &rDiff2b, IOStream &rOut);
 	static void ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream &rFrom2, IOStream &rOut, int64_t ObjectIDOfFrom, bool *pIsCompletelyDifferent = 0);
+	static void CombineDiffInPlace(IOStream &rDiffAndOut, IOStream &rFrom, IOStream &rReversedDiffOut, int64_t ObjectIDOfFrom, bool *pIsCompletelyDifferent = 0);
+	static void CombineDiffInPlace(IOStream &rDiffAndOut, IOStream &rFrom);
+	static void CopyStreamRange(IOStream &rFrom, IOStream::pos_type FromOffset, IOStream &rTo, IOStream::pos_type Length);
+	// Takes ownership of the streams in rChain, wanted version first
+	static std::auto_ptr<IOStream> ResolvePatchChain(const std::vector<IOStream *> &rChain);
 	static void DecodeFile(IOStream &rEncodedFile, const char *DecodedFilename, int Timeout, const BackupClientFileAttributes *pAlterativeAttr = 0);
 	static std::auto_ptr<BackupStoreFile::DecodedStream> DecodeFileStream(IOStream &rEncodedFile, int Timeout, const BackupClientFileAttributes *pAlterativeAttr = 0);
 	static bool CompareFileContentsAgainstBlockIndex(const char *Filename, IOStream &rBlockIndex, int Timeout);
@@ -231,8 +242,18 @@ public:
 	static void SetBlowfishKeys(const void *pKey, int KeyLength, const void *pBlockEntryKey, int BlockEntryKeyLength);
 #ifndef HAVE_OLD_SSL
 	static void SetAESKey(const void *pKey, int KeyLength);
+	static void SetAESGCMKey(const void *pKey, int KeyLength);
+	// Encrypt file data with AES-GCM rather than AES-CBC
+	static void SetAuthenticatedEncryption(bool Authenticated);
 #endif
 
+	// Hashes of blocks, by which the store indexes the blocks it has
+	static void SetBlockHashSecret(const void *pSecret, int SecretLength);
+	static void MakeBlockHash(int32_t ClearSize,
+		const uint8_t *pStrongChecksum, file_BlockHash &rHashOut);
+	static void CalculateBlockHashes(const std::string &rFilename,
+		std::vector<file_BlockHash> &rHashesOut);
+
 	// Allocation of properly aligning chunks for decoding and encoding chunks
 	inline static void *CodingChunkAlloc(int Size)
 	{
@@ -279,8 +300,85 @@ public:
 		uint8_t *mpBuffer;
 		int mBufferSize;
 	};
+	// Compression state kept from one chunk of a file to the next, so
+	// that the codec isn't set up from scratch for every chunk. In
+	// adaptive mode it also decides which chunks are worth compressing,
+	// as data which is already compressed (JPEG, video, archives) won't
+	// shrink. It uses the codec set by SetCompressionCodec() when it
+	// was created.
+	class CompressionContext
+	{
+	public:
+		CompressionContext(bool Adaptive);
+		~CompressionContext();
+	private:
+		// No copying
+		CompressionContext(const CompressionContext &);
+		CompressionContext &operator=(const CompressionContext &);
+	public:
+		void Allocate(int MaxChunkSize);
+		bool ShouldTryCompressing(const void *Chunk, int ChunkSize);
+		int CompressChunk(const void *Chunk, int ChunkSize);
+		const uint8_t *GetCompressedData() const {return mpBuffer;}
+		void RecordResult(int ChunkSize, int CompressedSize);
+		bool IsAdaptive() const {return mAdaptive;}
+		void AddBytesNotCompressed(int Bytes) {mBytesNotCompressed += Bytes;}
+		int64_t GetBytesNotCompressed() const {return mBytesNotCompressed;}
+		int GetCodec() const {return mCodec;}
+
+	private:
+		int mCodec;
+		int mLevel;
+		CompressCodec *mpCompressor;
+		uint8_t *mpBuffer;
+		int mBufferSize;
+		bool mAdaptive;
+		int mFailedAttempts;
+		int mChunksSinceAttempt;
+		int64_t mBytesNotCompressed;
+	};
+
 	static int MaxBlockSizeForChunkSize(int ChunkSize);
-	static int EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput);
+	static int EncodeChunk(const void *Chunk, int ChunkSize,
+		BackupStoreFile::EncodingBuffer &rOutput,
+		CompressionContext *pCompression = 0,
+		CipherContext *pEncrypt = 0);
+
+	// Whether new encoding streams use adaptive compression
+	static void SetAdaptiveCompression(bool Adaptive)
+	{
+		msAdaptiveCompression = Adaptive;
+	}
+	static bool msAdaptiveCompression;
+
+	// Which codec, one of the COMPRESS_CODEC_* values, and level new
+	// encoding streams compress chunks with. Chunks compressed with any
+	// codec available in this build can be decoded.
+	static void SetCompressionCodec(int Codec, int Level)
+	{
+		msCompressionCodec = Codec;
+		msCompressionLevel = Level;
+	}
+	static int msCompressionCodec;
+	static int msCompressionLevel;
+
+	// How many threads new encoding streams use to compress and
+	// encrypt blocks, or 0 to do it all in the thread reading the
+	// stream
+	static void SetEncodingThreads(int Threads)
+	{
+		msEncodingThreads = Threads;
+	}
+	static int msEncodingThreads;
+
+	// Whether files uploaded in full are cut into chunks at
+	// content-defined boundaries, rather than into blocks of the same
+	// size. Files already stored that way are always diffed that way.
+	static void SetContentDefinedChunking(bool ContentDefined)
+	{
+		msContentDefinedChunking = ContentDefined;
+	}
+	static bool msContentDefinedChunking;
 
 	// Caller should know how big the output size is, but also allocate a bit more memory to cover various
 	// overheads allowed for in checks
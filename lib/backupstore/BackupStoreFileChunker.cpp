@@ -0,0 +1,283 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileChunker.cpp
+//		Purpose: Cut file data into chunks at content-defined boundaries
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "BackupStoreConstants.h"
+#include "BackupStoreException.h"
+#include "BackupStoreFileChunker.h"
+#include "IOStream.h"
+
+#include "MemLeakFindOn.h"
+
+// The number of chunks in an old file's index needed to work out the
+// average size it was cut with from their mean size
+#define CHUNKER_MIN_CHUNKS_TO_MEASURE	64
+
+// Random values for each byte, added into the gear hash. They are part of
+// the file format: if they changed, files would be cut in different places
+// and couldn't be diffed against the old versions.
+static uint64_t sGearTable[256];
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    GearTableInitialiser
+//		Purpose: Fills in the gear table at startup, with a fixed
+//			 sequence from the splitmix64 generator
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static class GearTableInitialiser
+{
+public:
+	GearTableInitialiser()
+	{
+		uint64_t state = 0x626f786261636b75ULL;
+		for(int b = 0; b < 256; ++b)
+		{
+			state += 0x9e3779b97f4a7c15ULL;
+			uint64_t z = state;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			sGearTable[b] = z ^ (z >> 31);
+		}
+	}
+} sGearTableInitialiser;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static MaskWithBits(int)
+//		Purpose: A mask of the top Bits bits of the hash, which
+//			 depend on the most recent 64 bytes, where the
+//			 bottom bits only depend on the last few
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static uint64_t MaskWithBits(int Bits)
+{
+	return ~(uint64_t)0 << (64 - Bits);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::BackupStoreFileChunker(int32_t)
+//		Purpose: Constructor. The average chunk size must be a
+//			 power of two.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileChunker::BackupStoreFileChunker(int32_t AverageChunkSize)
+: mAverageSize(AverageChunkSize),
+  mMinSize(AverageChunkSize / BACKUP_FILE_CHUNK_SIZE_RANGE),
+  mMaxSize(AverageChunkSize * BACKUP_FILE_CHUNK_SIZE_RANGE)
+{
+	int bits = 0;
+	while(((int32_t)1 << bits) < AverageChunkSize)
+	{
+		++bits;
+	}
+
+	if(AverageChunkSize < BACKUP_FILE_MIN_BLOCK_SIZE ||
+		AverageChunkSize > BACKUP_FILE_MAX_AVERAGE_CHUNK_SIZE ||
+		((int32_t)1 << bits) != AverageChunkSize)
+	{
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+
+	// Boundaries are 2^bits bytes apart on average where there's no
+	// minimum size. Skipping the minimum, and making boundaries harder
+	// to find before the average and easier after it, gives nearly the
+	// same average with a much narrower spread.
+	mMaskBeforeAverage = MaskWithBits(bits +
+		BACKUP_FILE_CHUNK_NORMALISATION_BITS);
+	mMaskAfterAverage = MaskWithBits(bits -
+		BACKUP_FILE_CHUNK_NORMALISATION_BITS);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::FindChunkEnd(const uint8_t *, int32_t)
+//		Purpose: Returns the size of the chunk at the start of the
+//			 data. Unless the data ends first, Size must be at
+//			 least the maximum chunk size.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int32_t BackupStoreFileChunker::FindChunkEnd(const uint8_t *pData,
+	int32_t Size) const
+{
+	if(Size <= mMinSize)
+	{
+		return Size;
+	}
+
+	int32_t normalEnd = (Size < mAverageSize) ? Size : mAverageSize;
+	int32_t end = (Size < mMaxSize) ? Size : mMaxSize;
+	uint64_t hash = 0;
+	int32_t i = mMinSize;
+
+	for(; i < normalEnd; ++i)
+	{
+		hash = (hash << 1) + sGearTable[pData[i]];
+		if((hash & mMaskBeforeAverage) == 0)
+		{
+			return i + 1;
+		}
+	}
+
+	for(; i < end; ++i)
+	{
+		hash = (hash << 1) + sGearTable[pData[i]];
+		if((hash & mMaskAfterAverage) == 0)
+		{
+			return i + 1;
+		}
+	}
+
+	return end;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::ChunkStream(IOStream &, int64_t, std::vector<int32_t> &)
+//		Purpose: Reads Size bytes from the stream, and appends the
+//			 sizes of the chunks they are cut into to the vector.
+//			 Throws an exception if the stream ends first.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileChunker::ChunkStream(IOStream &rStream, int64_t Size,
+	std::vector<int32_t> &rChunkSizesOut) const
+{
+	// Read a few chunks at a time, so that most of the time is spent
+	// hashing rather than moving the leftovers to the front
+	int32_t bufferSize = mMaxSize * 4;
+	uint8_t *pbuffer = (uint8_t *)::malloc(bufferSize);
+	if(pbuffer == 0)
+	{
+		throw std::bad_alloc();
+	}
+
+	try
+	{
+		int32_t bytesInBuffer = 0;
+		int32_t pos = 0;
+		int64_t bytesToRead = Size;
+
+		while(bytesToRead > 0 || pos < bytesInBuffer)
+		{
+			if(bytesToRead > 0 && bytesInBuffer - pos < mMaxSize)
+			{
+				::memmove(pbuffer, pbuffer + pos,
+					bytesInBuffer - pos);
+				bytesInBuffer -= pos;
+				pos = 0;
+
+				int32_t toRead = bufferSize - bytesInBuffer;
+				if(toRead > bytesToRead)
+				{
+					toRead = bytesToRead;
+				}
+				if(!rStream.ReadFullBuffer(pbuffer + bytesInBuffer,
+					toRead, 0))
+				{
+					// The file has changed since its size
+					// was read
+					THROW_EXCEPTION(BackupStoreException,
+						Temp_FileEncodeStreamDidntReadBuffer)
+				}
+				bytesInBuffer += toRead;
+				bytesToRead -= toRead;
+			}
+
+			int32_t chunkSize = FindChunkEnd(pbuffer + pos,
+				bytesInBuffer - pos);
+			rChunkSizesOut.push_back(chunkSize);
+			pos += chunkSize;
+		}
+	}
+	catch(...)
+	{
+		::free(pbuffer);
+		throw;
+	}
+
+	::free(pbuffer);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::AverageChunkSizeForFile(int64_t)
+//		Purpose: The average chunk size to cut a new file of this
+//			 size with, which is doubled until there aren't too
+//			 many chunks, like the size of fixed blocks
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int32_t BackupStoreFileChunker::AverageChunkSizeForFile(int64_t FileSize)
+{
+	int32_t average = BACKUP_FILE_MIN_BLOCK_SIZE;
+	while(average < BACKUP_FILE_MAX_AVERAGE_CHUNK_SIZE &&
+		FileSize / average > BACKUP_FILE_INCREASE_BLOCK_SIZE_AFTER)
+	{
+		average *= 2;
+	}
+	return average;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::AverageChunkSizeForDiff(int64_t, int64_t, int64_t)
+//		Purpose: The average chunk size to cut a new version of a
+//			 file with, to diff it against the chunks of the old
+//			 one. That's the size the old one was cut with,
+//			 which is the power of two nearest to the mean size
+//			 of its chunks, unless the file is so much bigger now
+//			 that it would have far too many chunks.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int32_t BackupStoreFileChunker::AverageChunkSizeForDiff(int64_t OldFileSize,
+	int64_t OldNumChunks, int64_t NewFileSize)
+{
+	int32_t average = AverageChunkSizeForFile(OldFileSize);
+	if(OldNumChunks >= CHUNKER_MIN_CHUNKS_TO_MEASURE)
+	{
+		// Compare the squares, to round to the nearest power
+		// of two on a logarithmic scale
+		int64_t mean = OldFileSize / OldNumChunks;
+		average = BACKUP_FILE_MIN_BLOCK_SIZE;
+		while(average < BACKUP_FILE_MAX_AVERAGE_CHUNK_SIZE &&
+			mean * mean > (int64_t)average * average * 2)
+		{
+			average *= 2;
+		}
+	}
+
+	int32_t forNewFile = AverageChunkSizeForFile(NewFileSize);
+	if(forNewFile >= average * BACKUP_FILE_CHUNK_SIZE_RANGE)
+	{
+		// Start again with bigger chunks
+		average = forNewFile;
+	}
+
+	return average;
+}
@@ -0,0 +1,63 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileChunker.h
+//		Purpose: Cut file data into chunks at content-defined boundaries
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREFILECHUNKER__H
+#define BACKUPSTOREFILECHUNKER__H
+
+#include <vector>
+
+class IOStream;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreFileChunker
+//		Purpose: Finds chunk boundaries with a gear hash, in the way
+//			 FastCDC does: nothing is hashed until the chunk is
+//			 the minimum size, and a boundary is less likely to
+//			 be found before the average size than after it.
+//			 Each boundary depends only on the data since the
+//			 previous one, so inserting or removing data only
+//			 changes the chunks around it, and the rest of a
+//			 modified file is cut in the same places as before.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreFileChunker
+{
+public:
+	BackupStoreFileChunker(int32_t AverageChunkSize);
+
+	int32_t GetAverageChunkSize() const {return mAverageSize;}
+	int32_t GetMinChunkSize() const {return mMinSize;}
+	int32_t GetMaxChunkSize() const {return mMaxSize;}
+
+	// Returns the size of the chunk at the start of the data. There
+	// must be at least GetMaxChunkSize() bytes, unless the data ends
+	// before then.
+	int32_t FindChunkEnd(const uint8_t *pData, int32_t Size) const;
+
+	// Reads Size bytes from the stream, and appends the sizes of the
+	// chunks they are cut into to the vector
+	void ChunkStream(IOStream &rStream, int64_t Size,
+		std::vector<int32_t> &rChunkSizesOut) const;
+
+	static int32_t AverageChunkSizeForFile(int64_t FileSize);
+	static int32_t AverageChunkSizeForDiff(int64_t OldFileSize,
+		int64_t OldNumChunks, int64_t NewFileSize);
+
+private:
+	int32_t mAverageSize;
+	int32_t mMinSize;
+	int32_t mMaxSize;
+	uint64_t mMaskBeforeAverage;
+	uint64_t mMaskAfterAverage;
+};
+
+#endif // BACKUPSTOREFILECHUNKER__H
@@ -42,7 +42,7 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 		{
 			THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 		}
-		if(ntohl(diff1Hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1)
+		if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(diff1Hdr.mMagicValue)))
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 		}
@@ -73,7 +73,7 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 	{
 		THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 	}
-	if(ntohl(diff1IdxHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diff1IdxHdr.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -129,7 +129,7 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 		{
 			THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 		}
-		if(ntohl(diff2Hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1)
+		if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(diff2Hdr.mMagicValue)))
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 		}
@@ -153,7 +153,7 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 		{
 			THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 		}
-		if(ntohl(diff2IdxHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+		if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diff2IdxHdr.mMagicValue)))
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 		}
@@ -151,7 +151,7 @@ void BSFCombinedIndexStream::Initialise(IOStream &rFrom)
 	{
 		THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 	}
-	if(ntohl(mHeader.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(mHeader.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -168,7 +168,7 @@ void BSFCombinedIndexStream::Initialise(IOStream &rFrom)
 	{
 		THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 	}
-	if(ntohl(fromHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(fromHdr.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
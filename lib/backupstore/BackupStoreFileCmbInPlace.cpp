@@ -0,0 +1,505 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileCmbInPlace.cpp
+//		Purpose: Combine a diff with the file it was made from, in the
+//			 same file which the diff was received into, and
+//			 reverse the diff at the same time
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <new>
+#include <vector>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#include "BackupStoreFile.h"
+#include "BackupStoreFileWire.h"
+#include "BackupStoreObjectMagic.h"
+#include "BackupStoreException.h"
+#include "BackupStoreFilename.h"
+#include "CommonException.h"
+#include "FileStream.h"
+#include "RaidFileRead.h"
+#include "RaidFileWrite.h"
+
+#include "MemLeakFindOn.h"
+
+// Size of the buffer used for copying data which can't be copied by the
+// kernel, and for moving blocks within a file
+#define RANGE_COPY_BUFFER_SIZE		(64*1024)
+
+// Number of index entries read or written at once
+#define INDEX_ENTRIES_PER_READ		1024
+
+#ifdef HAVE_COPY_FILE_RANGE
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static GetRangeCopyHandle(IOStream &)
+//		Purpose: Static. The OS file handle behind a stream, if it
+//			 is a plain file which the kernel can copy data
+//			 to or from directly, or -1 otherwise.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int GetRangeCopyHandle(IOStream &rStream)
+{
+	FileStream *pFileStream = dynamic_cast<FileStream *>(&rStream);
+	if(pFileStream != 0)
+	{
+		return pFileStream->GetOSFileHandle();
+	}
+
+	RaidFileRead *pRaidFileRead = dynamic_cast<RaidFileRead *>(&rStream);
+	if(pRaidFileRead != 0)
+	{
+		return pRaidFileRead->GetOSFileHandle();
+	}
+
+	RaidFileWrite *pRaidFileWrite = dynamic_cast<RaidFileWrite *>(&rStream);
+	if(pRaidFileWrite != 0)
+	{
+		return pRaidFileWrite->GetOSFileHandle();
+	}
+
+	return -1;
+}
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CopyStreamRange(IOStream &, pos_type, IOStream &, pos_type)
+//		Purpose: Copy Length bytes starting at FromOffset in rFrom
+//			 to the current position of rTo. Where both are
+//			 plain files, the kernel copies the data without it
+//			 passing through this process, and filesystems which
+//			 support it share the data between the files instead
+//			 of copying it. The position of rFrom afterwards is
+//			 undefined.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::CopyStreamRange(IOStream &rFrom,
+	IOStream::pos_type FromOffset, IOStream &rTo, IOStream::pos_type Length)
+{
+	ASSERT(FromOffset >= 0);
+	ASSERT(Length >= 0);
+
+#ifdef HAVE_COPY_FILE_RANGE
+	int fromHandle = GetRangeCopyHandle(rFrom);
+	int toHandle = GetRangeCopyHandle(rTo);
+
+	if(fromHandle != -1 && toHandle != -1)
+	{
+		loff_t fromOffset = FromOffset;
+		while(Length > 0)
+		{
+			ssize_t copied = ::copy_file_range(fromHandle,
+				&fromOffset, toHandle, NULL, Length, 0);
+			if(copied > 0)
+			{
+				Length -= copied;
+			}
+			else if(copied == 0)
+			{
+				// The From file is shorter than it should be
+				THROW_EXCEPTION(BackupStoreException,
+					FailedToReadBlockOnCombine)
+			}
+			else if(errno == EINTR)
+			{
+				continue;
+			}
+			else if(errno == EXDEV || errno == ENOSYS ||
+				errno == EINVAL || errno == EOPNOTSUPP)
+			{
+				// Not possible between these files, copy
+				// the rest by hand
+				break;
+			}
+			else
+			{
+				THROW_SYS_ERROR("Failed to copy data between "
+					"files", BackupStoreException,
+					FailedToReadBlockOnCombine);
+			}
+		}
+
+		if(Length == 0)
+		{
+			return;
+		}
+
+		FromOffset = fromOffset;
+	}
+#endif
+
+	char buffer[RANGE_COPY_BUFFER_SIZE];
+	rFrom.Seek(FromOffset, IOStream::SeekType_Absolute);
+	while(Length > 0)
+	{
+		int toCopy = (Length > (IOStream::pos_type)sizeof(buffer))
+			? sizeof(buffer) : (int)Length;
+		if(!rFrom.ReadFullBuffer(buffer, toCopy, 0))
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				FailedToReadBlockOnCombine)
+		}
+		rTo.Write(buffer, toCopy);
+		Length -= toCopy;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static ReadFileHeader(IOStream &, file_StreamFormat &)
+//		Purpose: Static. Read the header of a store file from the
+//			 start, skipping the filename and attributes, and
+//			 return the position of the first block.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int64_t ReadFileHeader(IOStream &rFile, file_StreamFormat &rHeaderOut)
+{
+	rFile.Seek(0, IOStream::SeekType_Absolute);
+	if(!rFile.ReadFullBuffer(&rHeaderOut, sizeof(rHeaderOut), 0))
+	{
+		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
+	}
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(rHeaderOut.mMagicValue))
+		|| (int64_t)box_ntoh64(rHeaderOut.mNumBlocks) < 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+	}
+
+	BackupStoreFilename filename;
+	filename.ReadFromStream(rFile, IOStream::TimeOutInfinite);
+	int32_t size_s;
+	if(!rFile.ReadFullBuffer(&size_s, sizeof(size_s), 0))
+	{
+		THROW_EXCEPTION(CommonException, StreamableMemBlockIncompleteRead)
+	}
+	int size = ntohl(size_s);
+	if(size < 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+	}
+	rFile.Seek(size, IOStream::SeekType_Relative);
+
+	return rFile.GetPosition();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static ReadBlockIndex(IOStream &, int64_t, file_BlockIndexHeader &, std::vector<file_BlockIndexEntry> &)
+//		Purpose: Static. Read the whole block index from the end of
+//			 a store file, and return the position at which it
+//			 starts, which is the end of the block data.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int64_t ReadBlockIndex(IOStream &rFile, int64_t NumBlocks,
+	file_BlockIndexHeader &rHeaderOut,
+	std::vector<file_BlockIndexEntry> &rEntriesOut)
+{
+	rFile.Seek(0 - ((NumBlocks * sizeof(file_BlockIndexEntry)) +
+		sizeof(file_BlockIndexHeader)), IOStream::SeekType_End);
+	int64_t indexStart = rFile.GetPosition();
+
+	if(!rFile.ReadFullBuffer(&rHeaderOut, sizeof(rHeaderOut), 0))
+	{
+		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
+	}
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(rHeaderOut.mMagicValue))
+		|| (int64_t)box_ntoh64(rHeaderOut.mNumBlocks) != NumBlocks)
+	{
+		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+	}
+
+	rEntriesOut.resize(NumBlocks);
+	for(int64_t b = 0; b < NumBlocks; b += INDEX_ENTRIES_PER_READ)
+	{
+		int64_t count = NumBlocks - b;
+		if(count > INDEX_ENTRIES_PER_READ) count = INDEX_ENTRIES_PER_READ;
+		if(!rFile.ReadFullBuffer(&rEntriesOut[b],
+			count * sizeof(file_BlockIndexEntry), 0))
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				FailedToReadBlockOnCombine)
+		}
+	}
+
+	return indexStart;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static WriteBlockIndex(IOStream &, const file_BlockIndexHeader &, const std::vector<file_BlockIndexEntry> &)
+//		Purpose: Static. Write a block index at the current position.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void WriteBlockIndex(IOStream &rOut,
+	const file_BlockIndexHeader &rHeader,
+	const std::vector<file_BlockIndexEntry> &rEntries)
+{
+	rOut.Write(&rHeader, sizeof(rHeader));
+	for(size_t b = 0; b < rEntries.size(); b += INDEX_ENTRIES_PER_READ)
+	{
+		size_t count = rEntries.size() - b;
+		if(count > INDEX_ENTRIES_PER_READ) count = INDEX_ENTRIES_PER_READ;
+		rOut.Write(&rEntries[b], count * sizeof(file_BlockIndexEntry));
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static MoveBlockForwards(IOStream &, int64_t, int64_t, int64_t)
+//		Purpose: Static. Move Size bytes at From to To, later in the
+//			 same file, where the two ranges may overlap. The
+//			 end is moved first, so nothing is overwritten
+//			 before it has been moved.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void MoveBlockForwards(IOStream &rFile, int64_t From, int64_t To,
+	int64_t Size)
+{
+	ASSERT(To > From);
+	char buffer[RANGE_COPY_BUFFER_SIZE];
+	while(Size > 0)
+	{
+		int toMove = (Size > (int64_t)sizeof(buffer))
+			? sizeof(buffer) : (int)Size;
+		Size -= toMove;
+		rFile.Seek(From + Size, IOStream::SeekType_Absolute);
+		if(!rFile.ReadFullBuffer(buffer, toMove, 0))
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				FailedToReadBlockOnCombine)
+		}
+		rFile.Seek(To + Size, IOStream::SeekType_Absolute);
+		rFile.Write(buffer, toMove);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static CombineDiffInPlaceInternal(IOStream &, IOStream &, IOStream *, int64_t, bool *)
+//		Purpose: Static. Turn rDiffAndOut into the complete new file,
+//			 and write the reversed diff to pReversedDiffOut, if
+//			 it's not null. See CombineDiffInPlace().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void CombineDiffInPlaceInternal(IOStream &rDiffAndOut, IOStream &rFrom,
+	IOStream *pReversedDiffOut, int64_t ObjectIDOfFrom,
+	bool *pIsCompletelyDifferent)
+{
+	file_StreamFormat diffHdr, fromHdr;
+	int64_t diffDataStart = ReadFileHeader(rDiffAndOut, diffHdr);
+	int64_t fromDataStart = ReadFileHeader(rFrom, fromHdr);
+	int64_t diffNumBlocks = box_ntoh64(diffHdr.mNumBlocks);
+	int64_t fromNumBlocks = box_ntoh64(fromHdr.mNumBlocks);
+
+	file_BlockIndexHeader diffIdxHdr, fromIdxHdr;
+	std::vector<file_BlockIndexEntry> diffIndex, fromIndex;
+	int64_t diffDataEnd = ReadBlockIndex(rDiffAndOut, diffNumBlocks,
+		diffIdxHdr, diffIndex);
+	int64_t fromDataEnd = ReadBlockIndex(rFrom, fromNumBlocks,
+		fromIdxHdr, fromIndex);
+	if(box_ntoh64(fromIdxHdr.mOtherFileID) != 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, OnCombineFromFileIsIncomplete)
+	}
+
+	// Where each block of the From file starts, with an extra entry
+	// so that the size of the last block can be calculated
+	std::vector<int64_t> fromPositions(fromNumBlocks + 1);
+	int64_t position = fromDataStart;
+	for(int64_t b = 0; b < fromNumBlocks; ++b)
+	{
+		int64_t size = box_ntoh64(fromIndex[b].mEncodedSize);
+		if(size <= 0)
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				OnCombineFromFileIsIncomplete)
+		}
+		fromPositions[b] = position;
+		position += size;
+	}
+	fromPositions[fromNumBlocks] = position;
+	if(position != fromDataEnd)
+	{
+		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+	}
+
+	// For each block of the new file, its size and where it is now
+	// in the diff, or -1 if it's in the From file. For each block
+	// of the From file, -1 - the index of the block in the new file
+	// which uses it, or 0 if it's not used.
+	std::vector<int64_t> sizes(diffNumBlocks);
+	std::vector<int64_t> diffPositions(diffNumBlocks);
+	std::vector<int64_t> fromUsedBy(fromNumBlocks, 0);
+	position = diffDataStart;
+	int64_t newDataEnd = diffDataStart;
+	for(int64_t b = 0; b < diffNumBlocks; ++b)
+	{
+		int64_t size = box_ntoh64(diffIndex[b].mEncodedSize);
+		if(size > 0)
+		{
+			diffPositions[b] = position;
+			position += size;
+		}
+		else
+		{
+			int64_t fromBlock = 0 - size;
+			if(fromBlock >= fromNumBlocks)
+			{
+				THROW_EXCEPTION(BackupStoreException,
+					IncompatibleFromAndDiffFiles)
+			}
+			size = fromPositions[fromBlock + 1] -
+				fromPositions[fromBlock];
+			diffPositions[b] = -1;
+			fromUsedBy[fromBlock] = -1 - b;
+		}
+		sizes[b] = size;
+		newDataEnd += size;
+	}
+	if(position != diffDataEnd)
+	{
+		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+	}
+
+	// Write the reversed diff: the From file's header, filename and
+	// attributes, the blocks which the new file doesn't use, and an
+	// index pointing at the new file for the rest
+	bool isCompletelyDifferent = true;
+	if(pReversedDiffOut != 0)
+	{
+		BackupStoreFile::CopyStreamRange(rFrom, 0, *pReversedDiffOut,
+			fromDataStart);
+	}
+	for(int64_t b = 0; b < fromNumBlocks; ++b)
+	{
+		if(fromUsedBy[b] == 0)
+		{
+			int64_t size = fromPositions[b + 1] - fromPositions[b];
+			if(pReversedDiffOut != 0)
+			{
+				BackupStoreFile::CopyStreamRange(rFrom,
+					fromPositions[b], *pReversedDiffOut,
+					size);
+			}
+			fromIndex[b].mEncodedSize = box_hton64(size);
+		}
+		else
+		{
+			isCompletelyDifferent = false;
+			fromIndex[b].mEncodedSize =
+				box_hton64(fromUsedBy[b] + 1);
+		}
+	}
+	if(pReversedDiffOut != 0)
+	{
+		fromIdxHdr.mOtherFileID = isCompletelyDifferent ? 0
+			: box_hton64(ObjectIDOfFrom);
+		WriteBlockIndex(*pReversedDiffOut, fromIdxHdr, fromIndex);
+	}
+
+	// Fill in the new file from the end backwards. Each block only
+	// ever moves towards the end of the file, and the blocks in front
+	// of it haven't been touched yet, so nothing is overwritten before
+	// it has been moved.
+	position = newDataEnd;
+	for(int64_t b = diffNumBlocks - 1; b >= 0; --b)
+	{
+		position -= sizes[b];
+		if(diffPositions[b] == -1)
+		{
+			int64_t fromBlock = 0 - (int64_t)box_ntoh64(
+				diffIndex[b].mEncodedSize);
+			rDiffAndOut.Seek(position, IOStream::SeekType_Absolute);
+			BackupStoreFile::CopyStreamRange(rFrom,
+				fromPositions[fromBlock], rDiffAndOut, sizes[b]);
+		}
+		else if(diffPositions[b] != position)
+		{
+			MoveBlockForwards(rDiffAndOut, diffPositions[b],
+				position, sizes[b]);
+		}
+		diffIndex[b].mEncodedSize = box_hton64(sizes[b]);
+	}
+	ASSERT(position == diffDataStart);
+
+	// And the index, which is now complete
+	rDiffAndOut.Seek(newDataEnd, IOStream::SeekType_Absolute);
+	diffIdxHdr.mOtherFileID = box_hton64(0);
+	WriteBlockIndex(rDiffAndOut, diffIdxHdr, diffIndex);
+
+	if(pIsCompletelyDifferent != 0)
+	{
+		*pIsCompletelyDifferent = isCompletelyDifferent;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CombineDiffInPlace(IOStream &, IOStream &, IOStream &, int64_t, bool *)
+//		Purpose: Where rDiffAndOut is a store file which is
+//			 incomplete as a result of a diffing operation, and
+//			 rFrom is the complete file it is diffed from, turn
+//			 rDiffAndOut into the complete new file, and write
+//			 to rReversedDiffOut a patch which rebuilds rFrom
+//			 from the new file. This does the work of
+//			 CombineFile() followed by ReverseDiffFile(), but
+//			 each index is only read once, the blocks sent in
+//			 the diff are left where they are unless the blocks
+//			 in front of them grow, and the blocks taken from
+//			 rFrom are copied with CopyStreamRange(), so no
+//			 temporary copy of the diff is needed. rDiffAndOut
+//			 must be readable, writable and seekable, and only
+//			 ever gets longer.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::CombineDiffInPlace(IOStream &rDiffAndOut,
+	IOStream &rFrom, IOStream &rReversedDiffOut, int64_t ObjectIDOfFrom,
+	bool *pIsCompletelyDifferent)
+{
+	CombineDiffInPlaceInternal(rDiffAndOut, rFrom, &rReversedDiffOut,
+		ObjectIDOfFrom, pIsCompletelyDifferent);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CombineDiffInPlace(IOStream &, IOStream &)
+//		Purpose: As above, but leaving rFrom as it is, for diffs
+//			 from files which aren't older versions of the new
+//			 one
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::CombineDiffInPlace(IOStream &rDiffAndOut,
+	IOStream &rFrom)
+{
+	CombineDiffInPlaceInternal(rDiffAndOut, rFrom, 0, 0, 0);
+}
@@ -51,7 +51,7 @@ void BackupStoreFile::CombineFile(IOStream &rDiff, IOStream &rDiff2, IOStream &r
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -74,7 +74,7 @@ void BackupStoreFile::CombineFile(IOStream &rDiff, IOStream &rDiff2, IOStream &r
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(fromHdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(fromHdr.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -159,7 +159,7 @@ static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEn
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 		|| (int64_t)box_ntoh64(blkhdr.mNumBlocks) != NumEntries)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
@@ -219,15 +219,12 @@ static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumB
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(diffBlkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diffBlkhdr.mMagicValue))
 		|| (int64_t)box_ntoh64(diffBlkhdr.mNumBlocks) != DiffNumBlocks)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
 	
-	// Record where the From file is
-	int64_t fromPos = rFrom.GetPosition();
-	
 	// Buffer data
 	void *buffer = 0;
 	int bufferSize = 0;
@@ -268,6 +265,17 @@ static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumB
 			}
 			ASSERT(blockSize > 0);
 			
+			if(encodedSize <= 0)
+			{
+				// Copy the data from the from file, letting the
+				// kernel do so if it can
+				int64_t blockIdx = (0 - encodedSize);
+				BackupStoreFile::CopyStreamRange(rFrom,
+					pFromIndex[blockIdx].mFilePosition, rOut,
+					blockSize);
+				continue;
+			}
+			
 			// Make sure there's memory available to copy this
 			if(bufferSize < blockSize || buffer == 0)
 			{
@@ -288,33 +296,10 @@ static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumB
 			}
 			ASSERT(bufferSize >= blockSize);
 			
-			// Load in data from one of the files
-			if(encodedSize > 0)
-			{
-				// Load from diff file
-				if(!rDiffData.ReadFullBuffer(buffer, blockSize, 0))
-				{
-					THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
-				}				
-			}
-			else
+			// Load from diff file
+			if(!rDiffData.ReadFullBuffer(buffer, blockSize, 0))
 			{
-				// Locate and read the data from the from file
-				int64_t blockIdx = (0 - encodedSize);
-				// Seek if necessary
-				if(fromPos != pFromIndex[blockIdx].mFilePosition)
-				{
-					rFrom.Seek(pFromIndex[blockIdx].mFilePosition, IOStream::SeekType_Absolute);
-					fromPos = pFromIndex[blockIdx].mFilePosition;
-				}
-				// Read
-				if(!rFrom.ReadFullBuffer(buffer, blockSize, 0))
-				{
-					THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
-				}
-				
-				// Update fromPos to current position
-				fromPos += blockSize;
+				THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 			}
 			
 			// Write data to out file
@@ -361,7 +346,7 @@ static void WriteNewIndex(IOStream &rDiff, int64_t DiffNumBlocks, FromIndexEntry
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(diffBlkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diffBlkhdr.mMagicValue))
 		|| (int64_t)box_ntoh64(diffBlkhdr.mNumBlocks) != DiffNumBlocks)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
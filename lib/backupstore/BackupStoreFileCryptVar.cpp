@@ -20,6 +20,8 @@ CipherContext BackupStoreFileCryptVar::sBlowfishDecrypt;
 #ifndef HAVE_OLD_SSL
 	CipherContext BackupStoreFileCryptVar::sAESEncrypt;
 	CipherContext BackupStoreFileCryptVar::sAESDecrypt;
+	CipherContext BackupStoreFileCryptVar::sAESGCMEncrypt;
+	CipherContext BackupStoreFileCryptVar::sAESGCMDecrypt;
 #endif
 
 // Default to blowfish
@@ -29,3 +31,6 @@ uint8_t BackupStoreFileCryptVar::sEncryptCipherType = HEADER_BLOWFISH_ENCODING;
 CipherContext BackupStoreFileCryptVar::sBlowfishEncryptBlockEntry;
 CipherContext BackupStoreFileCryptVar::sBlowfishDecryptBlockEntry;
 
+uint8_t BackupStoreFileCryptVar::sBlockHashSecret[BACKUPSTOREFILE_MAX_BLOCK_HASH_SECRET_LENGTH];
+int BackupStoreFileCryptVar::sBlockHashSecretLength = 0;
+
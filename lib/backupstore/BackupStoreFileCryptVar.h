@@ -12,6 +12,8 @@
 
 #include "CipherContext.h"
 
+#define BACKUPSTOREFILE_MAX_BLOCK_HASH_SECRET_LENGTH	128
+
 // Hide private static variables from the rest of the world by putting them
 // as static variables in a namespace.
 // -- don't put them as static class variables to avoid openssl/evp.h being
@@ -25,6 +27,9 @@ namespace BackupStoreFileCryptVar
 #ifndef HAVE_OLD_SSL
 	extern CipherContext sAESEncrypt;
 	extern CipherContext sAESDecrypt;
+	// Authenticated encryption, if configured
+	extern CipherContext sAESGCMEncrypt;
+	extern CipherContext sAESGCMDecrypt;
 #endif
 	// How encoding will be done
 	extern CipherContext *spEncrypt;
@@ -33,6 +38,11 @@ namespace BackupStoreFileCryptVar
 	// Keys for the block indicies
 	extern CipherContext sBlowfishEncryptBlockEntry;
 	extern CipherContext sBlowfishDecryptBlockEntry;
+
+	// Secret for hashing blocks, so that the store can't match them
+	// against the hashes of known data
+	extern uint8_t sBlockHashSecret[BACKUPSTOREFILE_MAX_BLOCK_HASH_SECRET_LENGTH];
+	extern int sBlockHashSecretLength;
 }
 
 #endif // BACKUPSTOREFILECRYPTVAR__H
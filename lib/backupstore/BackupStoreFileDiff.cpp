@@ -11,8 +11,11 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <functional>
 #include <new>
 #include <map>
+#include <vector>
 
 #ifdef HAVE_TIME_H
 	#include <time.h>
@@ -23,6 +26,7 @@
 #include "BackupStoreConstants.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileChunker.h"
 #include "BackupStoreFileCryptVar.h"
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreFileWire.h"
@@ -30,6 +34,7 @@
 #include "CommonException.h"
 #include "FileStream.h"
 #include "MD5Digest.h"
+#include "MultiRollingChecksum.h"
 #include "RollingChecksum.h"
 #include "Timer.h"
 
@@ -37,6 +42,10 @@
 
 #include <cstring>
 
+#if BACKUP_FILE_DIFF_MAX_BLOCK_SIZES > MULTIROLLINGCHECKSUM_MAX_LENGTHS
+	#error MultiRollingChecksum cannot scan for enough block sizes
+#endif
+
 using namespace BackupStoreFileCryptVar;
 using namespace BackupStoreFileCreation;
 
@@ -46,14 +55,26 @@ using namespace BackupStoreFileCreation;
 	bool BackupStoreFile::TraceDetailsOfDiffProcess = false;
 #endif
 
-static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis);
+static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis, bool &rContentDefinedOut);
 static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES]);
+static int FillScanBuffer(IOStream &rFile, uint8_t *pBuffer, int BytesInBuffer, int BufferSize, bool &rEndOfFile);
+static bool CheckPositionsForMatches(const uint32_t *pChecksums, int ChecksumStride, int Count, const uint8_t *pBlocks,
+	int64_t FileOffset, const int32_t *pSizes, int FirstActive, int NumSizes, int64_t *pNextCheckOffset, const uint8_t *pFilter,
+	BlocksAvailableEntry **pHashTable, BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks, int64_t MaxBlocksFound);
+static void PollKeepAlives(DiffTimer *pDiffTimer, int64_t PositionsChecked,
+	const int32_t *pSizes, int FirstActive, int NumSizes, int64_t *pBlocksPolled);
 static void SearchForMatchingBlocks(IOStream &rFile, 
 	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex, 
 	int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES],
 	DiffTimer *pDiffTimer);
-static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockSize, BlocksAvailableEntry **pHashTable);
-static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, uint8_t *pBeginnings, uint8_t *pEndings, int Offset, int32_t BlockSize, int64_t FileBlockNumber,
+static void MatchChunks(IOStream &rFile, int32_t AverageChunkSize,
+	std::map<int64_t, int64_t> &rFoundBlocks,
+	std::vector<int32_t> &rNewChunkSizes, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, DiffTimer *pDiffTimer);
+static int64_t CountReusedBytes(BlocksAvailableEntry *pIndex,
+	const std::map<int64_t, int64_t> &rFoundBlocks);
+static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, const int32_t *pSizes, int NumSizes, BlocksAvailableEntry **pHashTable, uint8_t *pFilter);
+static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, uint32_t Checksum, const uint8_t *pBlock, int32_t BlockSize, int64_t FileOffset,
 BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks);
 static void GenerateRecipe(BackupStoreFileEncodeStream::Recipe &rRecipe, BlocksAvailableEntry *pIndex, int64_t NumBlocks, std::map<int64_t, int64_t> &rFoundBlocks, int64_t SizeOfInputFile);
 
@@ -83,7 +104,7 @@ void BackupStoreFile::MoveStreamPositionToBlockIndex(IOStream &rStream)
 	}
 
 	// Check magic number
-	if(ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue))
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V0
 #endif
@@ -119,6 +140,11 @@ void BackupStoreFile::MoveStreamPositionToBlockIndex(IOStream &rStream)
 //			 The timeout is the timeout value for reading the diff block index.
 //			 If pIsCompletelyDifferent != 0, it will be set to true if the
 //			 the two files are completely different (do not share any block), false otherwise.
+//
+//			 If the old file was cut into content-defined chunks,
+//			 the new one is cut in the same way, and each chunk
+//			 is looked up in the old index in one pass. Otherwise
+//			 the old blocks are searched for at every offset.
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
@@ -156,7 +182,8 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 	BlocksAvailableEntry *pindex = 0;
 	int64_t blocksInIndex = 0;
 	bool canDiffFromThis = false;
-	LoadIndex(rDiffFromBlockIndex, DiffFromObjectID, &pindex, blocksInIndex, Timeout, canDiffFromThis);
+	bool contentDefined = false;
+	LoadIndex(rDiffFromBlockIndex, DiffFromObjectID, &pindex, blocksInIndex, Timeout, canDiffFromThis, contentDefined);
 	// BOX_TRACE("Diff: Blocks in index: " << blocksInIndex);
 	
 	if(!canDiffFromThis)
@@ -178,10 +205,6 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 	
 	try
 	{
-		// Find which sizes should be scanned
-		int32_t sizesToScan[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
-		FindMostUsedSizes(pindex, blocksInIndex, sizesToScan);
-		
 		// Flag for reporting to the user
 		bool completelyDifferent;
 			
@@ -190,14 +213,55 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 			// Search the file to find matching blocks
 			std::map<int64_t, int64_t> foundBlocks; // map of offset in file to index in block index
 			int64_t sizeOfInputFile = 0;
+			// Content-defined chunks of new data, if any
+			int32_t averageChunkSize = 0;
+			std::vector<int32_t> newChunkSizes;
 			// BLOCK
 			{
 				FileStream file(Filename);
 				// Get size of file
 				sizeOfInputFile = file.BytesLeftToRead();
-				// Find all those lovely matching blocks
-				SearchForMatchingBlocks(file, foundBlocks, pindex, 
-					blocksInIndex, sizesToScan, pDiffTimer);
+
+				if(contentDefined)
+				{
+					// Cut it up in the same way as the old one,
+					// and look up the chunks
+					int64_t oldFileSize = 0;
+					for(int64_t b = 0; b < blocksInIndex; ++b)
+					{
+						oldFileSize += pindex[b].mSize;
+					}
+					averageChunkSize = BackupStoreFileChunker::
+						AverageChunkSizeForDiff(oldFileSize,
+							blocksInIndex, sizeOfInputFile);
+					MatchChunks(file, averageChunkSize, foundBlocks,
+						newChunkSizes, pindex, blocksInIndex,
+						pDiffTimer);
+				}
+				else
+				{
+					// Find which sizes should be scanned
+					int32_t sizesToScan[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
+					FindMostUsedSizes(pindex, blocksInIndex, sizesToScan);
+
+					// Find all those lovely matching blocks
+					SearchForMatchingBlocks(file, foundBlocks, pindex, 
+						blocksInIndex, sizesToScan, pDiffTimer);
+
+					// Convert the file to content-defined
+					// chunks if that's enabled, and most of
+					// the file has to be uploaded anyway
+					if(BackupStoreFile::msContentDefinedChunking &&
+						CountReusedBytes(pindex, foundBlocks) * 2 <
+						sizeOfInputFile)
+					{
+						BOX_TRACE("Diff: uploading the whole file "
+							"in content-defined chunks");
+						foundBlocks.clear();
+						averageChunkSize = BackupStoreFileChunker::
+							AverageChunkSizeForFile(sizeOfInputFile);
+					}
+				}
 				
 				// Is it completely different?
 				completelyDifferent = (foundBlocks.size() == 0);
@@ -210,6 +274,13 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 			
 			// Fill it in
 			GenerateRecipe(*precipe, pindexKeptRef, blocksInIndex, foundBlocks, sizeOfInputFile);
+			if(averageChunkSize != 0)
+			{
+				// The encoder cuts up the new data itself if
+				// there are no chunks already
+				precipe->SetContentDefined(averageChunkSize);
+				precipe->GetChunkSizes().swap(newChunkSizes);
+			}
 		}
 		// foundBlocks no longer required
 		
@@ -257,14 +328,17 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 //		Name:    static LoadIndex(IOStream &, int64_t, BlocksAvailableEntry **, int64_t, bool &)
 //		Purpose: Read in an index, and decrypt, and store in the in memory block format.
 //				 rCanDiffFromThis is set to false if the version of the from file is too old.
+//				 rContentDefinedOut is set to true if its blocks
+//				 are content-defined chunks.
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
-static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis)
+static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis, bool &rContentDefinedOut)
 {
 	// Reset
 	rNumBlocksOut = 0;
 	rCanDiffFromThis = false;
+	rContentDefinedOut = false;
 	
 	// Read header
 	file_BlockIndexHeader hdr;
@@ -294,7 +368,7 @@ static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntr
 #endif
 
 	// Check magic
-	if(hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1))
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(hdr.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -307,6 +381,8 @@ static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntr
 
 	// Mark as an acceptable diff.
 	rCanDiffFromThis = true;
+	rContentDefinedOut = (ntohl(hdr.mMagicValue) ==
+		OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2);
 
 	// Get basic information
 	int64_t numBlocks = box_ntoh64(hdr.mNumBlocks);
@@ -434,7 +510,7 @@ static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, i
 			if(i->second * i->first > sizeCounts[t] * Sizes[t])
 			{
 				// Then this size belong before this entry -- shuffle them up
-				for(int s = (BACKUP_FILE_DIFF_MAX_BLOCK_SIZES - 1); s >= t; --s)
+				for(int s = (BACKUP_FILE_DIFF_MAX_BLOCK_SIZES - 1); s > t; --s)
 				{
 					Sizes[s] = Sizes[s-1];
 					sizeCounts[s] = sizeCounts[s-1];
@@ -466,11 +542,80 @@ static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, i
 
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static FillScanBuffer(IOStream &, uint8_t *, int, int, bool &)
+//		Purpose: Read from the file until the buffer holds BufferSize
+//			 bytes, or the file ends. Returns the number of bytes
+//			 now in the buffer, and sets rEndOfFile if it ended.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int FillScanBuffer(IOStream &rFile, uint8_t *pBuffer, int BytesInBuffer,
+	int BufferSize, bool &rEndOfFile)
+{
+	while(BytesInBuffer < BufferSize)
+	{
+		int bytes = rFile.Read(pBuffer + BytesInBuffer,
+			BufferSize - BytesInBuffer);
+		BytesInBuffer += bytes;
+
+		if(bytes == 0 && !rFile.StreamDataLeft())
+		{
+			rEndOfFile = true;
+			break;
+		}
+	}
+
+	return BytesInBuffer;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static PollKeepAlives(DiffTimer *, int64_t, const int32_t *, int, int, int64_t *)
+//		Purpose: Poll the diff timer for keep-alives as often as
+//			 the scan for one block size at a time used to: once
+//			 for every block of each active size which has been
+//			 scanned past. PositionsChecked is the number of file
+//			 offsets checked so far.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void PollKeepAlives(DiffTimer *pDiffTimer, int64_t PositionsChecked,
+	const int32_t *pSizes, int FirstActive, int NumSizes,
+	int64_t *pBlocksPolled)
+{
+	if(pDiffTimer == NULL || PositionsChecked == 0)
+	{
+		return;
+	}
+
+	for(int s = FirstActive; s < NumSizes; ++s)
+	{
+		int64_t blocks = (PositionsChecked - 1 + pSizes[s]) / pSizes[s];
+		for(; pBlocksPolled[s] < blocks; ++pBlocksPolled[s])
+		{
+			pDiffTimer->DoKeepAlive();
+		}
+	}
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
 //		Name:    static SearchForMatchingBlocks(IOStream &, std::map<int64_t, int64_t> &, BlocksAvailableEntry *, int64_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES])
 //		Purpose: Find the matching blocks within the file.
+//
+//			 The file is read once, and the rolling checksums for
+//			 every block size are carried along together in a
+//			 MultiRollingChecksum. At each offset the sizes are
+//			 checked largest first, so a bigger block is preferred
+//			 to a smaller one starting at the same place, and once
+//			 a block has matched, sizes no bigger than it don't
+//			 look for matches inside it.
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
@@ -485,261 +630,209 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 		maximumDiffingTime = Timer(pDiffTimer->GetMaximumDiffingTime() *
 			MILLI_SEC_IN_SEC, "MaximumDiffingTime");
 	}
-	
-	std::map<int64_t, int32_t> goodnessOfFit;
 
-	// Allocate the hash lookup table
-	BlocksAvailableEntry **phashTable = (BlocksAvailableEntry **)::malloc(sizeof(BlocksAvailableEntry *) * (64*1024));
+	// Sizes to scan for, largest first, without the unused entries
+	int32_t scanSizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
+	int numSizes = 0;
+	for(int s = 0; s < BACKUP_FILE_DIFF_MAX_BLOCK_SIZES; ++s)
+	{
+		if(Sizes[s] != 0)
+		{
+			scanSizes[numSizes++] = Sizes[s];
+		}
+	}
+	std::sort(scanSizes, scanSizes + numSizes, std::greater<int32_t>());
 
-	// Choose a size for the buffer, just a little bit more than the maximum block size
-	int32_t bufSize = Sizes[0];
-	for(int z = 1; z < BACKUP_FILE_DIFF_MAX_BLOCK_SIZES; ++z)
+	if(numSizes == 0)
 	{
-		if(Sizes[z] > bufSize) bufSize = Sizes[z];
+		// Nothing big enough to be worth looking for
+		return;
 	}
-	bufSize += 4;
-	ASSERT(bufSize > Sizes[0]);
-	ASSERT(bufSize > 0);
-	if(bufSize > (BACKUP_FILE_MAX_BLOCK_SIZE + 1024))
+
+	int32_t maxSize = scanSizes[0];
+	if(maxSize > (BACKUP_FILE_MAX_BLOCK_SIZE + 1024))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
-	
-	// TODO: Because we read in the file a scanned block size at a time,
-	// it is likely to be inefficient. Probably will be much better to
-	// calculate checksums for all block sizes in a single pass.
 
-	// Allocate the buffers.
-	uint8_t *pbuffer0 = (uint8_t *)::malloc(bufSize);
-	uint8_t *pbuffer1 = (uint8_t *)::malloc(bufSize);
+	// The buffer holds the largest block being scanned, plus enough
+	// read-ahead to make each refill worthwhile.
+	int32_t readSize = (maxSize > BACKUP_FILE_DIFF_SCAN_READ_SIZE)
+		? maxSize : BACKUP_FILE_DIFF_SCAN_READ_SIZE;
+	int32_t bufSize = maxSize + readSize;
+
+	BOX_TRACE("Diff: scanning for " << numSizes << " block sizes in "
+		"a single pass");
+
+	// Rolling checksums for all the sizes, and space for the checksums
+	// it calculates for a batch of positions at a time
+	MultiRollingChecksum rolling(scanSizes, numSizes);
+	int checksumStride = rolling.GetChecksumStride();
+
+	// Allocate the hash lookup table, its filter and the buffers
+	BlocksAvailableEntry **phashTable = (BlocksAvailableEntry **)::malloc(sizeof(BlocksAvailableEntry *) * (64*1024));
+	uint8_t *pfilter = (uint8_t *)::malloc(BACKUP_FILE_DIFF_FILTER_BYTES);
+	uint8_t *pbuffer = (uint8_t *)::malloc(bufSize);
+	uint32_t *pchecksums = (uint32_t *)::malloc(sizeof(uint32_t) *
+		checksumStride * BACKUP_FILE_DIFF_SCAN_BATCH_SIZE);
+
 	try
 	{
 		// Check buffer allocation
-		if(pbuffer0 == 0 || pbuffer1 == 0 || phashTable == 0)
+		if(pbuffer == 0 || pfilter == 0 || phashTable == 0 ||
+			pchecksums == 0)
 		{
 			// If a buffer got allocated, it will be cleaned up in the catch block
 			throw std::bad_alloc();
 		}
-		
+
+		SetupHashTable(pIndex, NumBlocks, scanSizes, numSizes,
+			phashTable, pfilter);
+
+		// Offset in the file at which each size may next match, and
+		// the number of keep-alive polls made for each
+		int64_t nextCheckOffset[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
+		int64_t blocksPolled[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
+		for(int s = 0; s < numSizes; ++s)
+		{
+			nextCheckOffset[s] = 0;
+			blocksPolled[s] = 0;
+		}
+
+		// Read the start of the file, and set up checksums for
+		// all the sizes which fit in it. Any which don't are
+		// bigger than the whole file, and are never scanned.
+		rFile.Seek(0, IOStream::SeekType_Absolute);
+		bool endOfFile = false;
+		int bytesInBuffer = FillScanBuffer(rFile, pbuffer, 0, bufSize,
+			endOfFile);
+
+		int firstActive = 0;
+		while(firstActive < numSizes &&
+			scanSizes[firstActive] > bytesInBuffer)
+		{
+			++firstActive;
+		}
+		for(int s = firstActive; s < numSizes; ++s)
+		{
+			rolling.Initialise(s, pbuffer);
+		}
+
+		// Offset in the file of the start of the buffer, and the
+		// start of the current blocks within the buffer
+		int64_t bufferFileOffset = 0;
+		int pos = 0;
+
 		// Flag to abort the run, if too many blocks are found -- avoid using
 		// huge amounts of processor time when files contain many similar blocks.
 		bool abortSearch = false;
-		
-		// Search for each block size in turn
-		// NOTE: Do the smallest size first, so that the scheme for adding
-		// entries in the found list works as expected and replaces smaller blocks
-		// with larger blocks when it finds matches at the same offset in the file.
-		for(int s = BACKUP_FILE_DIFF_MAX_BLOCK_SIZES - 1; s >= 0; --s)
+		int64_t maxBlocksFound = NumBlocks *
+			BACKUP_FILE_DIFF_MAX_BLOCK_FIND_MULTIPLE;
+
+		while(firstActive < numSizes && !abortSearch)
 		{
-			ASSERT(Sizes[s] <= bufSize);
-			BOX_TRACE("Diff pass " << s << ", for block size " <<
-				Sizes[s]);
-			
-			// Check we haven't finished
-			if(Sizes[s] == 0)
-			{
-				// empty entry, try next size
-				continue;
-			}
-			
-			// Set up the hash table entries
-			SetupHashTable(pIndex, NumBlocks, Sizes[s], phashTable);
-		
-			// Shift file position to beginning
-			rFile.Seek(0, IOStream::SeekType_Absolute);
-			
-			// Read first block
-			if(rFile.Read(pbuffer0, Sizes[s]) != Sizes[s])
-			{
-				// Size of file too short to match -- do next size
-				continue;
-			}
-			
-			// Setup block pointers
-			uint8_t *beginnings = pbuffer0;
-			uint8_t *endings = pbuffer1;
-			int offset = 0;
-			
-			// Calculate the first checksum, ready for rolling
-			RollingChecksum rolling(beginnings, Sizes[s]);
-			
-			// Then roll, until the file is exhausted
-			int64_t fileBlockNumber = 0;
-			int64_t fileOffset = 0;
-			int rollOverInitialBytes = 0;
-			while(true)
+			// Every active size can be checked at, and rolled
+			// forward from, each position before this one.
+			int end = bytesInBuffer - scanSizes[firstActive];
+
+			while(pos < end && !abortSearch)
 			{
-				if(maximumDiffingTime.HasExpired())
+				int batch = end - pos;
+				if(batch > BACKUP_FILE_DIFF_SCAN_BATCH_SIZE)
 				{
-					ASSERT(pDiffTimer != NULL);
-					BOX_INFO("MaximumDiffingTime reached - "
-						"suspending file diff");
-					abortSearch = true;
-					break;
+					batch = BACKUP_FILE_DIFF_SCAN_BATCH_SIZE;
 				}
-				
-				if(pDiffTimer)
-				{
-					pDiffTimer->DoKeepAlive();
-				}
-				
-				// Load in another block of data, and record how big it is
-				int bytesInEndings = rFile.Read(endings, Sizes[s]);
-				int tmp;
-
-				// Skip any bytes from a previous matched block
-				if(rollOverInitialBytes > 0 && offset < bytesInEndings)
-				{
-					int spaceLeft = bytesInEndings - offset;
-					int thisRoll = (rollOverInitialBytes > spaceLeft) ? spaceLeft : rollOverInitialBytes;
-
-					rolling.RollForwardSeveral(beginnings+offset, endings+offset, Sizes[s], thisRoll);
 
-					offset += thisRoll;
-					fileOffset += thisRoll;
-					rollOverInitialBytes -= thisRoll;
+				rolling.RollForward(pbuffer + pos, batch, pchecksums);
 
-					if(rollOverInitialBytes)
-					{
-						goto refresh;
-					}
-				}
-
-				if(goodnessOfFit.count(fileOffset))
+				if(!CheckPositionsForMatches(pchecksums,
+					checksumStride, batch, pbuffer + pos,
+					bufferFileOffset + pos, scanSizes,
+					firstActive, numSizes, nextCheckOffset,
+					pfilter, phashTable, pIndex,
+					rFoundBlocks, maxBlocksFound))
 				{
-					tmp = goodnessOfFit[fileOffset];
-				}
-				else
-				{
-					tmp = 0;
+					abortSearch = true;
 				}
 
-				if(tmp >= Sizes[s])
-				{
-					// Skip over bigger ready-matched blocks completely
-					rollOverInitialBytes = tmp;
-					int spaceLeft = bytesInEndings - offset;
-					int thisRoll = (rollOverInitialBytes > spaceLeft) ? spaceLeft : rollOverInitialBytes;
-
-					rolling.RollForwardSeveral(beginnings+offset, endings+offset, Sizes[s], thisRoll);
-
-					offset += thisRoll;
-					fileOffset += thisRoll;
-					rollOverInitialBytes -= thisRoll;
+				pos += batch;
+				PollKeepAlives(pDiffTimer, bufferFileOffset + pos,
+					scanSizes, firstActive, numSizes,
+					blocksPolled);
+			}
 
-					if(rollOverInitialBytes)
-					{
-						goto refresh;
-					}
-				}
+			if(abortSearch)
+			{
+				break;
+			}
 
-				while(offset < bytesInEndings)
+			if(endOfFile)
+			{
+				// The biggest active size has reached the end of
+				// the file. Check its final block along with all
+				// the others, then roll the rest on past it.
+				ASSERT(pos == end);
+				for(int s = firstActive; s < numSizes; ++s)
 				{
-					// Is current checksum in hash list?
-					uint16_t hash = rolling.GetComponentForHashing();
-					if(phashTable[hash] != 0 && (goodnessOfFit.count(fileOffset) == 0 || goodnessOfFit[fileOffset] < Sizes[s]))
-					{
-						if(SecondStageMatch(phashTable[hash], rolling, beginnings, endings, offset, Sizes[s], fileBlockNumber, pIndex, rFoundBlocks))
-						{
-							BOX_TRACE("Found block match of " << Sizes[s] << " bytes with hash " << hash << " at offset " << fileOffset);
-							goodnessOfFit[fileOffset] = Sizes[s];
-
-							// Block matched, roll the checksum forward to the next block without doing
-							// any more comparisons, because these are pointless (as any more matches will be ignored when
-							// the recipe is generated) and just take up valuable processor time. Edge cases are
-							// especially nasty, using huge amounts of time and memory.
-							int skip = Sizes[s];
-							if(offset < bytesInEndings && skip > 0)
-							{
-								int spaceLeft = bytesInEndings - offset;
-								int thisRoll = (skip > spaceLeft) ? spaceLeft : skip;
-
-								rolling.RollForwardSeveral(beginnings+offset, endings+offset, Sizes[s], thisRoll);
-
-								offset += thisRoll;
-								fileOffset += thisRoll;
-								skip -= thisRoll;
-							}
-							// Not all the bytes necessary will have been skipped, so get them
-							// skipped after the next block is loaded.
-							rollOverInitialBytes = skip;
-							
-							// End this loop, so the final byte isn't used again
-							break;
-						}
-						else
-						{
-							// Too many to log
-							// BOX_TRACE("False alarm match of " << Sizes[s] << " bytes with hash " << hash << " at offset " << fileOffset);
-						}
-
-						int64_t NumBlocksFound = static_cast<int64_t>(
-							rFoundBlocks.size());
-						int64_t MaxBlocksFound = NumBlocks * 
-							BACKUP_FILE_DIFF_MAX_BLOCK_FIND_MULTIPLE;
-						
-						if(NumBlocksFound > MaxBlocksFound)
-						{
-							abortSearch = true;
-							break;
-						}
-					}
-					
-					// Roll checksum forward
-					rolling.RollForward(beginnings[offset], endings[offset], Sizes[s]);
-				
-					// Increment offsets
-					++offset;
-					++fileOffset;
+					pchecksums[s] = rolling.GetChecksum(s);
 				}
-				
-				if(abortSearch) break;
-				
-			refresh:
-				// Finished?
-				if(bytesInEndings != Sizes[s])
+				if(!CheckPositionsForMatches(pchecksums,
+					checksumStride, 1, pbuffer + pos,
+					bufferFileOffset + pos, scanSizes,
+					firstActive, numSizes, nextCheckOffset,
+					pfilter, phashTable, pIndex,
+					rFoundBlocks, maxBlocksFound))
 				{
-					// No more data in file -- check the final block
-					// (Do a copy and paste of 5 lines of code instead of introducing a comparison for
-					// each byte of the file)
-					uint16_t hash = rolling.GetComponentForHashing();
-					if(phashTable[hash] != 0 && (goodnessOfFit.count(fileOffset) == 0 || goodnessOfFit[fileOffset] < Sizes[s]))
-					{
-						if(SecondStageMatch(phashTable[hash], rolling, beginnings, endings, offset, Sizes[s], fileBlockNumber, pIndex, rFoundBlocks))
-						{
-							goodnessOfFit[fileOffset] = Sizes[s];
-						}
-					}
-
-					// finish
 					break;
 				}
-				
-				// Switch buffers, reset offset
-				beginnings = endings;
-				endings = (beginnings == pbuffer0)?(pbuffer1):(pbuffer0);	// ie the other buffer
-				offset = 0;
 
-				// And count the blocks which have been done
-				++fileBlockNumber;
+				PollKeepAlives(pDiffTimer, bufferFileOffset + pos + 1,
+					scanSizes, firstActive, numSizes,
+					blocksPolled);
+				rolling.Deactivate(firstActive);
+				++firstActive;
+				if(firstActive < numSizes)
+				{
+					rolling.RollForward(pbuffer + pos, 1,
+						pchecksums);
+					++pos;
+				}
+				continue;
 			}
 
-			if(abortSearch) break;
+			if(maximumDiffingTime.HasExpired())
+			{
+				ASSERT(pDiffTimer != NULL);
+				BOX_INFO("MaximumDiffingTime reached - "
+					"suspending file diff");
+				break;
+			}
+
+			// Keep the unchecked data, and read some more
+			int keep = bytesInBuffer - pos;
+			::memmove(pbuffer, pbuffer + pos, keep);
+			bufferFileOffset += pos;
+			pos = 0;
+			bytesInBuffer = FillScanBuffer(rFile, pbuffer, keep,
+				bufSize, endOfFile);
 		}
-		
+
 		// Free buffers and hash table
-		::free(pbuffer1);
-		pbuffer1 = 0;
-		::free(pbuffer0);
-		pbuffer0 = 0;
+		::free(pchecksums);
+		pchecksums = 0;
+		::free(pbuffer);
+		pbuffer = 0;
+		::free(pfilter);
+		pfilter = 0;
 		::free(phashTable);
 		phashTable = 0;
 	}
 	catch(...)
 	{
 		// Cleanup and throw
-		if(pbuffer1 != 0) ::free(pbuffer1);
-		if(pbuffer0 != 0) ::free(pbuffer0);
+		if(pchecksums != 0) ::free(pchecksums);
+		if(pbuffer != 0) ::free(pbuffer);
+		if(pfilter != 0) ::free(pfilter);
 		if(phashTable != 0) ::free(phashTable);
 		throw;
 	}
@@ -773,36 +866,381 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static SetupHashTable(BlocksAvailableEntry *, int64_t, in32_t, BlocksAvailableEntry **)
-//		Purpose: Set up the hash table ready for a scan
+//		Name:    static CheckPositionsForMatches(const uint32_t *, int, int, const uint8_t *, int64_t, const int32_t *, int, int, int64_t *, const uint8_t *, BlocksAvailableEntry **, BlocksAvailableEntry *, std::map<int64_t, int64_t> &, int64_t)
+//		Purpose: Look for blocks of each active size starting at
+//			 Count consecutive positions in the file, given the
+//			 rolling checksums calculated for each position.
+//			 Sizes are checked largest first at each position,
+//			 and a match stops that size and all smaller ones
+//			 being checked again until the end of the matched
+//			 block. Returns false if so many blocks have been
+//			 found that the search should stop.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool CheckPositionsForMatches(const uint32_t *pChecksums,
+	int ChecksumStride, int Count, const uint8_t *pBlocks,
+	int64_t FileOffset, const int32_t *pSizes, int FirstActive,
+	int NumSizes, int64_t *pNextCheckOffset, const uint8_t *pFilter,
+	BlocksAvailableEntry **pHashTable, BlocksAvailableEntry *pIndex,
+	std::map<int64_t, int64_t> &rFoundBlocks, int64_t MaxBlocksFound)
+{
+	// Each size is checked across all the positions in one go, which
+	// keeps the loop that rejects almost every position very short.
+	// To give the same results as checking every size at each
+	// position in turn, blocks matched at larger sizes are only
+	// applied to smaller sizes from the position where they start.
+	std::vector<std::pair<int64_t, int64_t> > largerMatches;
+
+	for(int s = FirstActive; s < NumSizes; ++s)
+	{
+		const uint32_t *pchecksum = pChecksums + s;
+		std::vector<std::pair<int64_t, int64_t> >::size_type
+			numLargerMatches = largerMatches.size();
+
+		for(int p = 0; p < Count; ++p, pchecksum += ChecksumStride)
+		{
+			uint16_t hash = RollingChecksum::ExtractHashingComponent(*pchecksum);
+			if((pFilter[hash >> 3] & (1 << (hash & 7))) == 0)
+			{
+				continue;
+			}
+
+			int64_t fileOffset = FileOffset + p;
+			if(fileOffset < pNextCheckOffset[s])
+			{
+				continue;
+			}
+
+			bool insideLargerMatch = false;
+			for(std::vector<std::pair<int64_t, int64_t> >::size_type
+				m = 0; m < numLargerMatches; ++m)
+			{
+				if(fileOffset >= largerMatches[m].first &&
+					fileOffset < largerMatches[m].second)
+				{
+					insideLargerMatch = true;
+					break;
+				}
+			}
+			if(insideLargerMatch)
+			{
+				continue;
+			}
+
+			if(SecondStageMatch(pHashTable[hash], *pchecksum,
+				pBlocks + p, pSizes[s], fileOffset, pIndex,
+				rFoundBlocks))
+			{
+				BOX_TRACE("Found block match of " << pSizes[s] << " bytes with hash " << hash << " at offset " << fileOffset);
+
+				// Matches inside this block would be ignored
+				// when the recipe is generated, so don't waste
+				// time looking for them with this size or any
+				// smaller one.
+				int64_t blockEnd = fileOffset + pSizes[s];
+				pNextCheckOffset[s] = blockEnd;
+				largerMatches.push_back(std::make_pair(fileOffset, blockEnd));
+
+				if(static_cast<int64_t>(rFoundBlocks.size()) > MaxBlocksFound)
+				{
+					return false;
+				}
+			}
+		}
+	}
+
+	// Now every position in the batch has been checked, the blocks
+	// found apply to all later positions for the smaller sizes
+	for(int s = FirstActive; s < NumSizes; ++s)
+	{
+		for(std::vector<std::pair<int64_t, int64_t> >::size_type
+			m = 0; m < largerMatches.size(); ++m)
+		{
+			if(pSizes[s] <= largerMatches[m].second - largerMatches[m].first
+				&& pNextCheckOffset[s] < largerMatches[m].second)
+			{
+				pNextCheckOffset[s] = largerMatches[m].second;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Struct
+//		Name:    ChunkLookupEntry
+//		Purpose: An entry in the old index, sorted by size and weak
+//			 checksum, so that chunks of the new file can be
+//			 looked up without a rolling search
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+typedef struct
+{
+	int32_t mSize;
+	uint32_t mWeakChecksum;
+	int64_t mBlockIndex;
+} ChunkLookupEntry;
+
+static bool ChunkLookupEntryLess(const ChunkLookupEntry &rA,
+	const ChunkLookupEntry &rB)
+{
+	if(rA.mSize != rB.mSize) return rA.mSize < rB.mSize;
+	if(rA.mWeakChecksum != rB.mWeakChecksum)
+	{
+		return rA.mWeakChecksum < rB.mWeakChecksum;
+	}
+	return rA.mBlockIndex < rB.mBlockIndex;
+}
+
+static bool ChunkLookupEntryLessIgnoringIndex(const ChunkLookupEntry &rA,
+	const ChunkLookupEntry &rB)
+{
+	if(rA.mSize != rB.mSize) return rA.mSize < rB.mSize;
+	return rA.mWeakChecksum < rB.mWeakChecksum;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static MatchChunks(IOStream &, int32_t, std::map<int64_t, int64_t> &, std::vector<int32_t> &, BlocksAvailableEntry *, int64_t, DiffTimer *)
+//		Purpose: Cut the file into content-defined chunks, with the
+//			 same average size as the old file, and look each one
+//			 up in the old index by its size and checksums. The
+//			 chunks which are found go in rFoundBlocks, as for
+//			 SearchForMatchingBlocks(), and the sizes of the rest
+//			 are added to rNewChunkSizes in order, for the
+//			 encoder to upload them in the same chunks.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void MatchChunks(IOStream &rFile, int32_t AverageChunkSize,
+	std::map<int64_t, int64_t> &rFoundBlocks,
+	std::vector<int32_t> &rNewChunkSizes, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, DiffTimer *pDiffTimer)
+{
+	Timer maximumDiffingTime(0, "MaximumDiffingTime");
+
+	if(pDiffTimer && pDiffTimer->IsManaged())
+	{
+		maximumDiffingTime = Timer(pDiffTimer->GetMaximumDiffingTime() *
+			MILLI_SEC_IN_SEC, "MaximumDiffingTime");
+	}
+
+	std::vector<ChunkLookupEntry> lookup(NumBlocks);
+	for(int64_t b = 0; b < NumBlocks; ++b)
+	{
+		lookup[b].mSize = pIndex[b].mSize;
+		lookup[b].mWeakChecksum = pIndex[b].mWeakChecksum;
+		lookup[b].mBlockIndex = b;
+	}
+	std::sort(lookup.begin(), lookup.end(), ChunkLookupEntryLess);
+
+	BackupStoreFileChunker chunker(AverageChunkSize);
+	int32_t bufSize = chunker.GetMaxChunkSize() * 4;
+	uint8_t *pbuffer = (uint8_t *)::malloc(bufSize);
+	if(pbuffer == 0)
+	{
+		throw std::bad_alloc();
+	}
+
+	try
+	{
+		rFile.Seek(0, IOStream::SeekType_Absolute);
+		bool endOfFile = false;
+		int bytesInBuffer = 0;
+		int pos = 0;
+		int64_t fileOffset = 0;
+		int64_t lastFound = -1;
+		bool searching = true;
+
+		while(true)
+		{
+			if(!endOfFile && bytesInBuffer - pos <
+				chunker.GetMaxChunkSize())
+			{
+				// Keep the unchunked data, and read some more
+				int keep = bytesInBuffer - pos;
+				::memmove(pbuffer, pbuffer + pos, keep);
+				pos = 0;
+				bytesInBuffer = FillScanBuffer(rFile, pbuffer, keep,
+					bufSize, endOfFile);
+			}
+			if(pos >= bytesInBuffer)
+			{
+				break;
+			}
+
+			const uint8_t *pchunk = pbuffer + pos;
+			int32_t size = chunker.FindChunkEnd(pchunk,
+				bytesInBuffer - pos);
+			int64_t found = -1;
+
+			if(searching)
+			{
+				ChunkLookupEntry key;
+				key.mSize = size;
+				key.mWeakChecksum = RollingChecksum(pchunk, size)
+					.GetChecksum();
+				key.mBlockIndex = 0;
+				std::pair<std::vector<ChunkLookupEntry>::const_iterator,
+					std::vector<ChunkLookupEntry>::const_iterator>
+					range(std::equal_range(lookup.begin(),
+						lookup.end(), key,
+						ChunkLookupEntryLessIgnoringIndex));
+
+				if(range.first != range.second)
+				{
+					MD5Digest strong;
+					strong.Add(pchunk, size);
+					strong.Finish();
+
+					// Prefer the block after the last one
+					// found, so that runs of identical
+					// chunks are reused in order
+					int64_t next = lastFound + 1;
+					if(next < NumBlocks &&
+						pIndex[next].mSize == size &&
+						pIndex[next].mWeakChecksum ==
+							key.mWeakChecksum &&
+						strong.DigestMatches(
+							pIndex[next].mStrongChecksum))
+					{
+						found = next;
+					}
+
+					for(std::vector<ChunkLookupEntry>::const_iterator
+						i(range.first); found == -1 &&
+						i != range.second; ++i)
+					{
+						if(strong.DigestMatches(pIndex[
+							i->mBlockIndex].mStrongChecksum))
+						{
+							found = i->mBlockIndex;
+						}
+					}
+				}
+
+				if(pDiffTimer)
+				{
+					pDiffTimer->DoKeepAlive();
+				}
+
+				if(maximumDiffingTime.HasExpired())
+				{
+					// The rest is uploaded as new data
+					ASSERT(pDiffTimer != NULL);
+					BOX_INFO("MaximumDiffingTime reached - "
+						"suspending file diff");
+					searching = false;
+				}
+			}
+
+			if(found == -1)
+			{
+				rNewChunkSizes.push_back(size);
+			}
+			else
+			{
+				rFoundBlocks[fileOffset] = found;
+				lastFound = found;
+			}
+
+			pos += size;
+			fileOffset += size;
+		}
+	}
+	catch(...)
+	{
+		::free(pbuffer);
+		throw;
+	}
+
+	::free(pbuffer);
+
+	BOX_TRACE("Diff: " << rFoundBlocks.size() << " chunks found, " <<
+		rNewChunkSizes.size() << " new chunks");
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static CountReusedBytes(BlocksAvailableEntry *, const std::map<int64_t, int64_t> &)
+//		Purpose: How much of the file the found blocks cover,
+//			 skipping overlapping blocks as GenerateRecipe() does
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int64_t CountReusedBytes(BlocksAvailableEntry *pIndex,
+	const std::map<int64_t, int64_t> &rFoundBlocks)
+{
+	int64_t loc = 0;
+	int64_t reused = 0;
+	for(std::map<int64_t, int64_t>::const_iterator i(rFoundBlocks.begin());
+		i != rFoundBlocks.end(); ++i)
+	{
+		if(i->first >= loc)
+		{
+			reused += pIndex[i->second].mSize;
+			loc = i->first + pIndex[i->second].mSize;
+		}
+	}
+	return reused;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SetupHashTable(BlocksAvailableEntry *, int64_t, const int32_t *, int, BlocksAvailableEntry **, uint8_t *)
+//		Purpose: Set up the hash table ready for a scan. One table
+//			 holds the blocks of every size being scanned for, and
+//			 a bitmap of the hash values in use lets most positions
+//			 be rejected without touching the table itself.
 //		Created: 14/1/04
 //
 // --------------------------------------------------------------------------
-static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockSize, BlocksAvailableEntry **pHashTable)
+static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks,
+	const int32_t *pSizes, int NumSizes, BlocksAvailableEntry **pHashTable,
+	uint8_t *pFilter)
 {
-	// Set all entries in the hash table to zero
+	// Set all entries in the hash table and filter to zero
 	::memset(pHashTable, 0, (sizeof(BlocksAvailableEntry *) * (64*1024)));
+	::memset(pFilter, 0, BACKUP_FILE_DIFF_FILTER_BYTES);
 
 	// Scan through the blocks, building the hash table
 	for(int64_t b = 0; b < NumBlocks; ++b)
 	{
-		// Only look at the required block size
-		if(pIndex[b].mSize == BlockSize)
+		// Only look at the sizes being scanned for
+		int s;
+		for(s = 0; s < NumSizes; ++s)
 		{
-			// Get the value under which to hash this entry
-			uint16_t hash = RollingChecksum::ExtractHashingComponent(pIndex[b].mWeakChecksum);
-			
-			// Already present in table?
-			if(pHashTable[hash] != 0)
-			{
-				//BOX_TRACE("Another hash entry for " << hash << " found");
-				// Yes -- need to set the pointer in this entry to the current entry to build the linked list
-				pIndex[b].mpNextInHashList = pHashTable[hash];
-			}
+			if(pIndex[b].mSize == pSizes[s]) break;
+		}
+		if(s == NumSizes)
+		{
+			continue;
+		}
 
-			// Put a pointer to this entry in the hash table
-			pHashTable[hash] = pIndex + b;
+		// Get the value under which to hash this entry
+		uint16_t hash = RollingChecksum::ExtractHashingComponent(pIndex[b].mWeakChecksum);
+
+		// Already present in table?
+		if(pHashTable[hash] != 0)
+		{
+			// Yes -- need to set the pointer in this entry to the current entry to build the linked list
+			pIndex[b].mpNextInHashList = pHashTable[hash];
 		}
+
+		// Put a pointer to this entry in the hash table
+		pHashTable[hash] = pIndex + b;
+
+		// And mark the hash as worth checking
+		pFilter[hash >> 3] |= (1 << (hash & 7));
 	}
 }
 
@@ -815,28 +1253,23 @@ static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int3
 //		Created: 14/1/04
 //
 // --------------------------------------------------------------------------
-static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, uint8_t *pBeginnings, uint8_t *pEndings,
-	int Offset, int32_t BlockSize, int64_t FileBlockNumber, BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks)
+static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, uint32_t Checksum,
+	const uint8_t *pBlock, int32_t BlockSize, int64_t FileOffset,
+	BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks)
 {
 	// Check parameters
-	ASSERT(pBeginnings != 0);
-	ASSERT(pEndings != 0);
-	ASSERT(Offset >= 0);
+	ASSERT(pBlock != 0);
 	ASSERT(BlockSize > 0);
 	ASSERT(pFirstInHashList != 0);
 	ASSERT(pIndex != 0);
 
-#ifndef BOX_RELEASE_BUILD
-	uint16_t DEBUG_Hash = fastSum.GetComponentForHashing();
-#endif
-	uint32_t Checksum = fastSum.GetChecksum();
-
 	// Before we go to the expense of the MD5, make sure it's a darn good match on the checksum we already know.
+	// The hash list holds blocks of all the sizes being scanned for.
 	BlocksAvailableEntry *scan = pFirstInHashList;
 	bool found=false;
 	while(scan != 0)
 	{
-		if(scan->mWeakChecksum == Checksum)
+		if(scan->mWeakChecksum == Checksum && scan->mSize == BlockSize)
 		{
 			found = true;
 			break;
@@ -850,39 +1283,24 @@ static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChec
 
 	// Calculate the strong MD5 digest for this block
 	MD5Digest strong;
-	// Add the data from the beginnings
-	strong.Add(pBeginnings + Offset, BlockSize - Offset);
-	// Add any data from the endings
-	if(Offset > 0)
-	{
-		strong.Add(pEndings, Offset);
-	}
+	strong.Add(pBlock, BlockSize);
 	strong.Finish();
 	
 	// Then go through the entries in the hash list, comparing with the strong digest calculated
-	scan = pFirstInHashList;
-	//BOX_TRACE("second stage match");
 	while(scan != 0)
 	{
-		//BOX_TRACE("scan size " << scan->mSize <<
-		//	", block size " << BlockSize <<
-		//	", hash " << Hash);
-		ASSERT(scan->mSize == BlockSize);
-		ASSERT(RollingChecksum::ExtractHashingComponent(scan->mWeakChecksum) == DEBUG_Hash);
+		ASSERT(RollingChecksum::ExtractHashingComponent(scan->mWeakChecksum) == RollingChecksum::ExtractHashingComponent(Checksum));
 	
 		// Compare?
-		if(strong.DigestMatches(scan->mStrongChecksum))
+		if(scan->mSize == BlockSize && strong.DigestMatches(scan->mStrongChecksum))
 		{
-			//BOX_TRACE("Match!\n");
 			// Found! Add to list of found blocks...
-			int64_t fileOffset = (FileBlockNumber * BlockSize) + Offset;
 			int64_t blockIndex = (scan - pIndex);	// pointer arthmitic is frowned upon. But most efficient way of doing it here -- alternative is to use more memory
 			
-			// We do NOT search for smallest blocks first, as this code originally assumed.
-			// To prevent this from potentially overwriting a better match, the caller must determine
-			// the relative "goodness" of any existing match and this one, and avoid the call if it
-			// could be detrimental.
-			rFoundBlocks[fileOffset] = blockIndex;
+			// The caller checks larger sizes first at each offset,
+			// and only calls this if no better match already
+			// covers this offset.
+			rFoundBlocks[FileOffset] = blockIndex;
 			
 			// No point in searching further, report success
 			return true;
@@ -16,6 +16,7 @@
 #include "BackupStoreConstants.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileChunker.h"
 #include "BackupStoreFileCryptVar.h"
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreFileWire.h"
@@ -31,6 +32,71 @@
 
 using namespace BackupStoreFileCryptVar;
 
+// Worker threads each need their own copy of the encryption context, and
+// the crypto library must be safe to call from several threads at once
+#if defined(BOX_HAVE_THREADS) && defined(BOX_OPENSSL_THREAD_SAFE)
+	#define BACKUPSTOREFILEENCODESTREAM_USE_THREADS
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreFileEncodeStream::EncodeWorker
+//		Purpose: Compresses, encrypts and checksums blocks. Either
+//				 called directly by the thread reading the stream, or
+//				 run as a thread taking jobs from the stream's queue.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreFileEncodeStream::EncodeWorker : public Thread
+{
+public:
+	EncodeWorker(BackupStoreFileEncodeStream &rStream, int MaxChunkSize,
+		bool OwnCipherContext)
+	: mrStream(rStream),
+	  mCompression(BackupStoreFile::msAdaptiveCompression),
+	  mpEncrypt(spEncrypt)
+	{
+		// Allocate everything now, so that Encode() doesn't have to
+		mCompression.Allocate(MaxChunkSize);
+		if(OwnCipherContext)
+		{
+			mEncrypt.Init(*spEncrypt);
+			mpEncrypt = &mEncrypt;
+		}
+	}
+
+	void Encode(EncodeJob &rJob)
+	{
+		int64_t notCompressed = mCompression.GetBytesNotCompressed();
+		rJob.mEncodedSize = BackupStoreFile::EncodeChunk(rJob.mpRawBuffer,
+			rJob.mRawSize, rJob.mEncoded, &mCompression, mpEncrypt);
+		rJob.mBytesNotCompressed = mCompression.GetBytesNotCompressed() -
+			notCompressed;
+
+		// Create block listing data -- generate checksums
+		RollingChecksum weakChecksum(rJob.mpRawBuffer, rJob.mRawSize);
+		rJob.mWeakChecksum = weakChecksum.GetChecksum();
+		MD5Digest strongChecksum;
+		strongChecksum.Add(rJob.mpRawBuffer, rJob.mRawSize);
+		strongChecksum.Finish();
+		::memcpy(rJob.mStrongChecksum, strongChecksum.DigestAsData(),
+			sizeof(rJob.mStrongChecksum));
+	}
+
+protected:
+	virtual void Run()
+	{
+		mrStream.RunWorker(*this);
+	}
+
+private:
+	BackupStoreFileEncodeStream &mrStream;
+	BackupStoreFile::CompressionContext mCompression;
+	CipherContext mEncrypt;
+	CipherContext *mpEncrypt;
+};
+
 
 // --------------------------------------------------------------------------
 //
@@ -48,6 +114,7 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
   mpBackgroundTask(NULL),
   mStatus(Status_Header),
   mSendData(true),
+  mContentDefined(false),
   mTotalBlocks(0),
   mBytesToUpload(0),
   mBytesUploaded(0),
@@ -60,9 +127,21 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
   mBlockSize(BACKUP_FILE_MIN_BLOCK_SIZE),
   mLastBlockSize(0),
   mTotalBytesSent(0),
-  mpRawBuffer(0),
   mAllocatedBufferSize(0),
-  mEntryIVBase(0)
+  mEntryIVBase(0),
+  mOwnCipherContexts(false),
+  mCollectBlockHashes(false),
+  mReadInstruction(-1),
+  mReadBlock(0),
+  mReadNumBlocks(0),
+  mReadBlockSize(0),
+  mReadLastBlockSize(0),
+  mNumThreads(0),
+  mpCurrentJob(0),
+  mJobsSubmitted(0),
+  mJobsClaimed(0),
+  mJobsReleased(0),
+  mStopWorkers(false)
 {
 }
 
@@ -76,12 +155,20 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
 // --------------------------------------------------------------------------
 BackupStoreFileEncodeStream::~BackupStoreFileEncodeStream()
 {
+	// Workers must finish with the jobs before they're freed
+	StopWorkers();
+	for(size_t w = 0; w < mWorkers.size(); ++w)
+	{
+		delete mWorkers[w];
+	}
+	mWorkers.clear();
+
 	// Free buffers
-	if(mpRawBuffer)
+	for(size_t j = 0; j < mJobs.size(); ++j)
 	{
-		::free(mpRawBuffer);
-		mpRawBuffer = 0;
+		delete mJobs[j];
 	}
+	mJobs.clear();
 
 	// Close the file, which we might have open
 	if(mpFile)
@@ -145,9 +232,27 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 			instruction.mpStartBlock = 0; // no block
 			pblankRecipe->push_back(instruction);
 
+			if(BackupStoreFile::msContentDefinedChunking)
+			{
+				pblankRecipe->SetContentDefined(
+					BackupStoreFileChunker::AverageChunkSizeForFile(
+						fileSize));
+			}
+
 			pRecipe = pblankRecipe;
 		}
 
+		// Send data? (symlinks don't have any data in them)
+		mSendData = !attr.IsSymLink();
+
+		// Cut the new data into content-defined chunks, unless
+		// the diff has done it already
+		mContentDefined = mSendData && pRecipe->IsContentDefined();
+		if(mContentDefined)
+		{
+			FindChunksInInstructions(Filename, *pRecipe);
+		}
+
 		// Tell caller?
 		if(pModificationTime != 0)
 		{
@@ -157,20 +262,38 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 		// Go through each instruction in the recipe and work out how many blocks
 		// it will add, and the max clear size of these blocks
 		int maxBlockClearSize = 0;
+		int64_t newBlocks = 0;
 		for(uint64_t inst = 0; inst < pRecipe->size(); ++inst)
 		{
 			if((*pRecipe)[inst].mSpaceBefore > 0)
 			{
 				// Calculate the number of blocks the space before requires
 				int64_t numBlocks;
-				int32_t blockSize, lastBlockSize;
-				CalculateBlockSizes((*pRecipe)[inst].mSpaceBefore, numBlocks, blockSize, lastBlockSize);
+				if(mContentDefined)
+				{
+					numBlocks = mFirstChunkInInstruction[inst + 1] -
+						mFirstChunkInInstruction[inst];
+					for(int64_t c = mFirstChunkInInstruction[inst];
+						c < mFirstChunkInInstruction[inst + 1]; ++c)
+					{
+						if(pRecipe->GetChunkSizes()[c] > maxBlockClearSize)
+						{
+							maxBlockClearSize = pRecipe->GetChunkSizes()[c];
+						}
+					}
+				}
+				else
+				{
+					int32_t blockSize, lastBlockSize;
+					CalculateBlockSizes((*pRecipe)[inst].mSpaceBefore, numBlocks, blockSize, lastBlockSize);
+					// Update maximum clear size
+					if(blockSize > maxBlockClearSize) maxBlockClearSize = blockSize;
+					if(lastBlockSize > maxBlockClearSize) maxBlockClearSize = lastBlockSize;
+				}
 				// Add to accumlated total
 				mTotalBlocks += numBlocks;
+				newBlocks += numBlocks;
 				mBytesToUpload += (*pRecipe)[inst].mSpaceBefore;
-				// Update maximum clear size
-				if(blockSize > maxBlockClearSize) maxBlockClearSize = blockSize;
-				if(lastBlockSize > maxBlockClearSize) maxBlockClearSize = lastBlockSize;
 			}
 
 			// Add number of blocks copied from the previous file
@@ -189,9 +312,6 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 			}
 		}
 
-		// Send data? (symlinks don't have any data in them)
-		mSendData = !attr.IsSymLink();
-
 		// If not data is being sent, then the max clear block size is zero
 		if(!mSendData)
 		{
@@ -200,7 +320,9 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 
 		// Header
 		file_StreamFormat hdr;
-		hdr.mMagicValue = htonl(OBJECTMAGIC_FILE_MAGIC_VALUE_V1);
+		hdr.mMagicValue = htonl(mContentDefined
+			? OBJECTMAGIC_FILE_MAGIC_VALUE_V2
+			: OBJECTMAGIC_FILE_MAGIC_VALUE_V1);
 		hdr.mNumBlocks = (mSendData)?(box_hton64(mTotalBlocks)):(0);
 		hdr.mContainerID = box_hton64(ContainerID);
 		hdr.mModificationTime = box_hton64(modTime);
@@ -239,18 +361,42 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 			// Work out the largest possible block required for the encoded data
 			mAllocatedBufferSize = BackupStoreFile::MaxBlockSizeForChunkSize(maxBlockClearSize);
 
-			// Then allocate two blocks of this size
-			mpRawBuffer = (uint8_t*)::malloc(mAllocatedBufferSize);
-			if(mpRawBuffer == 0)
+			// Encode in worker threads? Only worth it if there's
+			// more than one block of new data.
+#ifdef BACKUPSTOREFILEENCODESTREAM_USE_THREADS
+			mNumThreads = BackupStoreFile::msEncodingThreads;
+#endif
+			if(mNumThreads < 0 || newBlocks < 2)
 			{
-				throw std::bad_alloc();
+				mNumThreads = 0;
+			}
+			else if(mNumThreads > newBlocks)
+			{
+				mNumThreads = newBlocks;
+			}
+
+			// Then allocate buffers for the raw and encoded data of
+			// each block which can be in the pipeline at once
+			int numJobs = 1;
+			int encodedBufferSize = mAllocatedBufferSize;
+			if(mNumThreads > 0)
+			{
+				numJobs += mNumThreads * BACKUP_FILE_ENCODE_JOBS_PER_THREAD;
 			}
 #ifndef BOX_RELEASE_BUILD
-			// In debug builds, make sure that the reallocation code is exercised.
-			mEncodedBuffer.Allocate(mAllocatedBufferSize / 4);
-#else
-			mEncodedBuffer.Allocate(mAllocatedBufferSize);
+			else
+			{
+				// In debug builds, make sure that the reallocation
+				// code is exercised. Not with threads, as the memory
+				// leak finder isn't safe to use from them.
+				encodedBufferSize = mAllocatedBufferSize / 4;
+			}
 #endif
+			for(int j = 0; j < numJobs; ++j)
+			{
+				mJobs.push_back(new EncodeJob(mAllocatedBufferSize,
+					encodedBufferSize));
+			}
 		}
 		else
 		{
@@ -327,6 +473,74 @@ void BackupStoreFileEncodeStream::CalculateBlockSizes(int64_t DataSize, int64_t
 
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::FindChunksInInstructions(const std::string &, Recipe &)
+//		Purpose: Private. Cuts the new data in each instruction of
+//				 the recipe into content-defined chunks, if the
+//				 diff hasn't already, and records which chunks
+//				 belong to which instruction.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::FindChunksInInstructions(
+	const std::string &rFilename, Recipe &rRecipe)
+{
+	std::vector<int32_t> &rChunkSizes(rRecipe.GetChunkSizes());
+
+	if(rChunkSizes.empty())
+	{
+		BackupStoreFileChunker chunker(rRecipe.GetAverageChunkSize());
+		FileStream file(rFilename);
+		for(size_t inst = 0; inst < rRecipe.size(); ++inst)
+		{
+			if(rRecipe[inst].mSpaceBefore > 0)
+			{
+				chunker.ChunkStream(file, rRecipe[inst].mSpaceBefore,
+					rChunkSizes);
+			}
+
+			// Skip the blocks which are already on the server
+			int64_t sizeToSkip = 0;
+			for(int32_t b = 0; rRecipe[inst].mpStartBlock != 0 &&
+				b < rRecipe[inst].mBlocks; ++b)
+			{
+				sizeToSkip += rRecipe[inst].mpStartBlock[b].mSize;
+			}
+			if(sizeToSkip > 0)
+			{
+				file.Seek(sizeToSkip, IOStream::SeekType_Relative);
+			}
+		}
+	}
+
+	// The chunks must add up to the new data in each instruction
+	mFirstChunkInInstruction.clear();
+	size_t chunk = 0;
+	for(size_t inst = 0; inst < rRecipe.size(); ++inst)
+	{
+		mFirstChunkInInstruction.push_back(chunk);
+		int64_t size = 0;
+		while(size < rRecipe[inst].mSpaceBefore &&
+			chunk < rChunkSizes.size())
+		{
+			size += rChunkSizes[chunk++];
+		}
+		if(size != rRecipe[inst].mSpaceBefore)
+		{
+			THROW_EXCEPTION(BackupStoreException, Internal)
+		}
+	}
+	mFirstChunkInInstruction.push_back(chunk);
+	if(chunk != rChunkSizes.size())
+	{
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+}
+
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -385,15 +599,19 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 				}
 				else
 				{
-					// Reset the buffer so it can be used for the next phase
-					mData.Reset();
-
 					// Get buffer ready for index?
 					if(mStatus == Status_Header)
 					{
+						// Reset the buffer so it can be used
+						// for the index, which is kept at the
+						// end for GetBlockIndex()
+						mData.Reset();
+
 						// Just finished doing the stream header, create the block index header
 						file_BlockIndexHeader blkhdr;
-						blkhdr.mMagicValue = htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
+						blkhdr.mMagicValue = htonl(mContentDefined
+							? OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2
+							: OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
 						ASSERT(mpRecipe != 0);
 						blkhdr.mOtherFileID = box_hton64(mpRecipe->GetOtherFileID());
 						blkhdr.mNumBlocks = box_hton64(mTotalBlocks);
@@ -442,6 +660,9 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 						// End of blocks, go to next phase
 						++mStatus;
 
+						// No more use for any worker threads
+						StopWorkers();
+
 						// Set the data to reading so the index can be written
 						mData.SetForReading();
 					}
@@ -467,7 +688,7 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 				if(s > bytesToRead) s = bytesToRead;
 
 				// Copy it in
-				::memcpy(buffer, mEncodedBuffer.mpBuffer + mPositionInCurrentBlock, s);
+				::memcpy(buffer, mpCurrentJob->mEncoded.mpBuffer + mPositionInCurrentBlock, s);
 
 				// Update variables
 				bytesToRead -= s;
@@ -496,7 +717,8 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 // Function
 //		Name:    BackupStoreFileEncodeStream::StorePreviousBlocksInInstruction()
 //		Purpose: Private. Stores the blocks of the old file referenced in the current
-//				 instruction into the index and skips over the data in the file
+//				 instruction into the index. ReadNextBlock() skips over
+//				 their data in the file.
 //		Created: 16/1/04
 //
 // --------------------------------------------------------------------------
@@ -511,8 +733,6 @@ void BackupStoreFileEncodeStream::SkipPreviousBlocksInInstruction()
 	// Index of the first block in old file (being diffed from)
 	int firstIndex = mpRecipe->BlockPtrToIndex((*mpRecipe)[mInstructionNumber].mpStartBlock);
 
-	int64_t sizeToSkip = 0;
-
 	for(int32_t b = 0; b < (*mpRecipe)[mInstructionNumber].mBlocks; ++b)
 	{
 		// Update stats
@@ -526,13 +746,7 @@ void BackupStoreFileEncodeStream::SkipPreviousBlocksInInstruction()
 
 		// Increment the absolute block number -- kept encryption IV in sync
 		++mAbsoluteBlockNumber;
-
-		// Add the size of this block to the size to skip
-		sizeToSkip += (*mpRecipe)[mInstructionNumber].mpStartBlock[b].mSize;
 	}
-
-	// Move forward in the stream
-	mpLogging->Seek(sizeToSkip, IOStream::SeekType_Relative);
 }
 
 
@@ -547,7 +761,15 @@ void BackupStoreFileEncodeStream::SkipPreviousBlocksInInstruction()
 void BackupStoreFileEncodeStream::SetForInstruction()
 {
 	// Calculate block sizes
-	CalculateBlockSizes((*mpRecipe)[mInstructionNumber].mSpaceBefore, mNumBlocks, mBlockSize, mLastBlockSize);
+	if(mContentDefined)
+	{
+		mNumBlocks = mFirstChunkInInstruction[mInstructionNumber + 1] -
+			mFirstChunkInInstruction[mInstructionNumber];
+	}
+	else
+	{
+		CalculateBlockSizes((*mpRecipe)[mInstructionNumber].mSpaceBefore, mNumBlocks, mBlockSize, mLastBlockSize);
+	}
 
 	// Set variables
 	mCurrentBlock = 0;
@@ -561,7 +783,8 @@ void BackupStoreFileEncodeStream::SetForInstruction()
 //
 // Function
 //		Name:    BackupStoreFileEncodeStream::EncodeCurrentBlock()
-//		Purpose: Private. Encodes the current block, and writes the block data to the index
+//		Purpose: Private. Gets the current block from the encoding
+//				 pipeline, and writes the block data to the index
 //		Created: 8/12/03
 //
 // --------------------------------------------------------------------------
@@ -569,7 +792,11 @@ void BackupStoreFileEncodeStream::EncodeCurrentBlock()
 {
 	// How big is the block, raw?
 	int blockRawSize = mBlockSize;
-	if(mCurrentBlock == (mNumBlocks - 1))
+	if(mContentDefined)
+	{
+		blockRawSize = GetChunkSize(mInstructionNumber, mCurrentBlock);
+	}
+	else if(mCurrentBlock == (mNumBlocks - 1))
 	{
 		blockRawSize = mLastBlockSize;
 	}
@@ -582,8 +809,97 @@ void BackupStoreFileEncodeStream::EncodeCurrentBlock()
 		THROW_EXCEPTION(BackupStoreException, Internal)
 	}
 
+	// Read and encode it, if that hasn't happened already
+	EncodeJob &rJob(GetNextEncodedBlock());
+	if(rJob.mRawSize != blockRawSize)
+	{
+		// The pipeline has read a different block to this one
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+	mCurrentBlockEncodedSize = rJob.mEncodedSize;
+
+	mBytesUploaded += blockRawSize;
+
+	//TRACE2("Encode: Encoded size of block %d is %d\n", (int32_t)mCurrentBlock, (int32_t)mCurrentBlockEncodedSize);
+
+	// Add entry to the index
+	StoreBlockIndexEntry(mCurrentBlockEncodedSize, blockRawSize,
+		rJob.mWeakChecksum, rJob.mStrongChecksum);
+
+	// Set vars to reading this block
+	mPositionInCurrentBlock = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::ReadNextBlock(EncodeJob &)
+//		Purpose: Private. Reads the next block of new data from the
+//				 file into the job, following the recipe
+//				 independently of the block being sent, and skipping
+//				 the data of blocks from the old file. Returns false
+//				 if there are no more blocks to read.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFileEncodeStream::ReadNextBlock(EncodeJob &rJob)
+{
+	while(mReadBlock >= mReadNumBlocks)
+	{
+		if(mReadInstruction >= static_cast<int64_t>(mpRecipe->size()))
+		{
+			return false;
+		}
+
+		if(mReadInstruction >= 0)
+		{
+			// Move past the blocks which are already on the server
+			const RecipeInstruction &rInstruction((*mpRecipe)[mReadInstruction]);
+			int64_t sizeToSkip = 0;
+			for(int32_t b = 0; rInstruction.mpStartBlock != 0 && b < rInstruction.mBlocks; ++b)
+			{
+				sizeToSkip += rInstruction.mpStartBlock[b].mSize;
+			}
+			if(sizeToSkip > 0)
+			{
+				mpLogging->Seek(sizeToSkip, IOStream::SeekType_Relative);
+			}
+		}
+
+		// Then on to the new data in front of the next instruction's blocks
+		++mReadInstruction;
+		mReadBlock = 0;
+		mReadNumBlocks = 0;
+		if(mReadInstruction < static_cast<int64_t>(mpRecipe->size())
+			&& (*mpRecipe)[mReadInstruction].mSpaceBefore > 0)
+		{
+			if(mContentDefined)
+			{
+				mReadNumBlocks =
+					mFirstChunkInInstruction[mReadInstruction + 1] -
+					mFirstChunkInInstruction[mReadInstruction];
+			}
+			else
+			{
+				CalculateBlockSizes((*mpRecipe)[mReadInstruction].mSpaceBefore,
+					mReadNumBlocks, mReadBlockSize, mReadLastBlockSize);
+			}
+		}
+	}
+
+	if(mContentDefined)
+	{
+		rJob.mRawSize = GetChunkSize(mReadInstruction, mReadBlock);
+	}
+	else
+	{
+		rJob.mRawSize = (mReadBlock == (mReadNumBlocks - 1))
+			? mReadLastBlockSize : mReadBlockSize;
+	}
+	ASSERT(rJob.mRawSize < mAllocatedBufferSize);
+
 	// Read the data in
-	if(!mpLogging->ReadFullBuffer(mpRawBuffer, blockRawSize,
+	if(!mpLogging->ReadFullBuffer(rJob.mpRawBuffer, rJob.mRawSize,
 		0 /* not interested in size if failure */))
 	{
 		// TODO: Do something more intelligent, and abort
@@ -592,26 +908,265 @@ void BackupStoreFileEncodeStream::EncodeCurrentBlock()
 			Temp_FileEncodeStreamDidntReadBuffer)
 	}
 
-	// Encode it
-	mCurrentBlockEncodedSize = BackupStoreFile::EncodeChunk(mpRawBuffer,
-		blockRawSize, mEncodedBuffer);
+	++mReadBlock;
+	return true;
+}
 
-	mBytesUploaded += blockRawSize;
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::GetNextEncodedBlock()
+//		Purpose: Private. Releases the job of the block which has
+//				 just been sent, reads more blocks into any free
+//				 jobs to keep the workers busy, then waits for the
+//				 next block in the file to be encoded and returns
+//				 its job.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileEncodeStream::EncodeJob &BackupStoreFileEncodeStream::GetNextEncodedBlock()
+{
+	if(mWorkers.empty())
+	{
+		StartWorkers();
+	}
 
-	//TRACE2("Encode: Encoded size of block %d is %d\n", (int32_t)mCurrentBlock, (int32_t)mCurrentBlockEncodedSize);
+	// The last block has been sent, so its job can be reused
+	if(mpCurrentJob != 0)
+	{
+		MutexLock lock(mJobsMutex);
+		mpCurrentJob = 0;
+		++mJobsReleased;
+	}
 
-	// Create block listing data -- generate checksums
-	RollingChecksum weakChecksum(mpRawBuffer, blockRawSize);
-	MD5Digest strongChecksum;
-	strongChecksum.Add(mpRawBuffer, blockRawSize);
-	strongChecksum.Finish();
+	// Read ahead into all the free jobs. Only this thread reads
+	// from the file, as loggers and the file itself aren't thread
+	// safe, but it can do so while the workers are encoding.
+	const int64_t numJobs = mJobs.size();
+	while(mJobsSubmitted - mJobsReleased < numJobs)
+	{
+		EncodeJob &rJob(*mJobs[mJobsSubmitted % numJobs]);
+		if(!ReadNextBlock(rJob))
+		{
+			break;
+		}
 
-	// Add entry to the index
-	StoreBlockIndexEntry(mCurrentBlockEncodedSize, blockRawSize,
-		weakChecksum.GetChecksum(), strongChecksum.DigestAsData());
+		if(mNumThreads == 0)
+		{
+			// Nothing to hand it to, encode it now
+			mWorkers[0]->Encode(rJob);
+			rJob.mDone = true;
+			++mJobsSubmitted;
+			++mJobsClaimed;
+		}
+		else
+		{
+			{
+				MutexLock lock(mJobsMutex);
+				rJob.mDone = false;
+				rJob.mFailed = false;
+				++mJobsSubmitted;
+			}
+			mJobSubmitted.Signal();
+		}
+	}
 
-	// Set vars to reading this block
-	mPositionInCurrentBlock = 0;
+	if(mJobsSubmitted == mJobsReleased)
+	{
+		// Asked for more blocks than the recipe contains
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+
+	EncodeJob &rJob(*mJobs[mJobsReleased % numJobs]);
+	if(mNumThreads > 0)
+	{
+		MutexLock lock(mJobsMutex);
+		while(!rJob.mDone)
+		{
+			mJobFinished.Wait(mJobsMutex);
+		}
+	}
+
+	if(rJob.mFailed)
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException, BlockEncodingFailed,
+			rJob.mFailure);
+	}
+
+	BackupStoreFile::msStats.mBytesNotCompressed += rJob.mBytesNotCompressed;
+	mpCurrentJob = &rJob;
+	return rJob;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::StartWorkers()
+//		Purpose: Private. Creates the workers which encode blocks,
+//				 starting a thread for each if threads are in use.
+//				 If no threads can be started, blocks are encoded in
+//				 this thread instead.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::StartWorkers()
+{
+	ASSERT(mWorkers.empty());
+
+	for(int t = 0; t < mNumThreads; ++t)
+	{
+		EncodeWorker *pWorker = new EncodeWorker(*this,
+			mAllocatedBufferSize, true /* own cipher context */);
+		mWorkers.push_back(pWorker);
+
+		try
+		{
+			pWorker->Start();
+		}
+		catch(BoxException &e)
+		{
+			// Carry on with the threads which did start
+			BOX_WARNING("Failed to start file encoding thread, "
+				"using " << t << " instead of " << mNumThreads <<
+				": " << e.what());
+			mWorkers.pop_back();
+			delete pWorker;
+			mNumThreads = t;
+		}
+	}
+
+	if(mNumThreads == 0)
+	{
+		mWorkers.push_back(new EncodeWorker(*this,
+			mAllocatedBufferSize, mOwnCipherContexts));
+	}
+
+	BOX_TRACE("Encoding file with " << mNumThreads << " worker threads");
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::StopWorkers()
+//		Purpose: Private. Asks any worker threads to finish, and waits
+//				 for them to do so.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::StopWorkers()
+{
+	if(mNumThreads == 0)
+	{
+		return;
+	}
+
+	{
+		MutexLock lock(mJobsMutex);
+		mStopWorkers = true;
+	}
+	mJobSubmitted.Broadcast();
+
+	for(size_t w = 0; w < mWorkers.size(); ++w)
+	{
+		mWorkers[w]->Join();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::RunWorker(EncodeWorker &)
+//		Purpose: Private. Main loop of each worker thread: encode
+//				 submitted blocks in turn until asked to stop.
+//				 Failures are stored in the job, to be reported in
+//				 the thread which reads the stream.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::RunWorker(EncodeWorker &rWorker)
+{
+	const int64_t numJobs = mJobs.size();
+
+	while(true)
+	{
+		EncodeJob *pJob;
+		{
+			MutexLock lock(mJobsMutex);
+			while(!mStopWorkers && mJobsClaimed == mJobsSubmitted)
+			{
+				mJobSubmitted.Wait(mJobsMutex);
+			}
+			if(mStopWorkers)
+			{
+				return;
+			}
+			pJob = mJobs[mJobsClaimed % numJobs];
+			++mJobsClaimed;
+		}
+
+		bool failed = false;
+		std::string failure;
+		try
+		{
+			rWorker.Encode(*pJob);
+		}
+		catch(BoxException &e)
+		{
+			failed = true;
+			failure = std::string(e.what()) + ": " + e.GetMessage();
+		}
+		catch(std::exception &e)
+		{
+			failed = true;
+			failure = e.what();
+		}
+
+		{
+			MutexLock lock(mJobsMutex);
+			pJob->mFailed = failed;
+			pJob->mFailure = failure;
+			pJob->mDone = true;
+		}
+		mJobFinished.Signal();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::OwnCipherContextsSupported()
+//		Purpose: Static. Whether streams can be encrypted in
+//				 another thread, after UseOwnCipherContexts().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFileEncodeStream::OwnCipherContextsSupported()
+{
+#ifdef BACKUPSTOREFILEENCODESTREAM_USE_THREADS
+	return true;
+#else
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::UseOwnCipherContexts()
+//		Purpose: Encrypt the blocks and the block index with copies
+//				 of the shared cipher contexts, so that the stream can
+//				 be read by another thread while this one carries on
+//				 encoding other files. Must be called after Setup(),
+//				 before the stream is read.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::UseOwnCipherContexts()
+{
+	ASSERT(mWorkers.empty());
+	mOwnCipherContexts = true;
+	mapBlockEntryEncrypt.reset(new CipherContext);
+	mapBlockEntryEncrypt->Init(sBlowfishEncryptBlockEntry);
 }
 
 // --------------------------------------------------------------------------
@@ -636,7 +1191,9 @@ void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex
 
 	// Then encrypt the encryted section
 	// Generate the IV from the block number
-	if(sBlowfishEncryptBlockEntry.GetIVLength() != sizeof(mEntryIVBase))
+	CipherContext &rBlockEntryEncrypt(mapBlockEntryEncrypt.get() ?
+		*mapBlockEntryEncrypt : sBlowfishEncryptBlockEntry);
+	if(rBlockEntryEncrypt.GetIVLength() != sizeof(mEntryIVBase))
 	{
 		THROW_EXCEPTION(BackupStoreException, IVLengthForEncodedBlockSizeDoesntMeetLengthRequirements)
 	}
@@ -645,10 +1202,10 @@ void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex
 	// Convert to network byte order before encrypting with it, so that restores work on
 	// platforms with different endiannesses.
 	iv = box_hton64(iv);
-	sBlowfishEncryptBlockEntry.SetIV(&iv);
+	rBlockEntryEncrypt.SetIV(&iv);
 
 	// Encode the data
-	int encodedSize = sBlowfishEncryptBlockEntry.TransformBlock(entry.mEnEnc, sizeof(entry.mEnEnc), &entryEnc, sizeof(entryEnc));
+	int encodedSize = rBlockEntryEncrypt.TransformBlock(entry.mEnEnc, sizeof(entry.mEnEnc), &entryEnc, sizeof(entryEnc));
 	if(encodedSize != sizeof(entry.mEnEnc))
 	{
 		THROW_EXCEPTION(BackupStoreException, BlockEntryEncodingDidntGiveExpectedLength)
@@ -656,6 +1213,13 @@ void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex
 
 	// Save to data block for sending at the end of the stream
 	mData.Write(&entry, sizeof(entry));
+
+	if(mCollectBlockHashes)
+	{
+		file_BlockHash hash;
+		BackupStoreFile::MakeBlockHash(ClearSize, pStrongChecksum, hash);
+		mBlockHashes.push_back(hash);
+	}
 }
 
 
@@ -701,6 +1265,50 @@ bool BackupStoreFileEncodeStream::StreamClosed()
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::EncodeJob::EncodeJob(int, int)
+//		Purpose: Constructor, allocates the buffers
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileEncodeStream::EncodeJob::EncodeJob(int RawBufferSize,
+	int EncodedBufferSize)
+: mpRawBuffer(0),
+  mRawSize(0),
+  mEncodedSize(0),
+  mWeakChecksum(0),
+  mBytesNotCompressed(0),
+  mDone(false),
+  mFailed(false)
+{
+	// The encoded buffer frees itself if the second allocation fails
+	mEncoded.Allocate(EncodedBufferSize);
+	mpRawBuffer = (uint8_t*)::malloc(RawBufferSize);
+	if(mpRawBuffer == 0)
+	{
+		throw std::bad_alloc();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::EncodeJob::~EncodeJob()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileEncodeStream::EncodeJob::~EncodeJob()
+{
+	if(mpRawBuffer != 0)
+	{
+		::free(mpRawBuffer);
+		mpRawBuffer = 0;
+	}
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -714,7 +1322,8 @@ BackupStoreFileEncodeStream::Recipe::Recipe(
 	int64_t NumBlocksInIndex, int64_t OtherFileID)
 : mpBlockIndex(pBlockIndex),
   mNumBlocksInIndex(NumBlocksInIndex),
-  mOtherFileID(OtherFileID)
+  mOtherFileID(OtherFileID),
+  mAverageChunkSize(0)
 {
 	ASSERT((mpBlockIndex == 0) || (NumBlocksInIndex != 0))
 }
@@ -10,6 +10,7 @@
 #ifndef BACKUPSTOREFILEENCODESTREAM__H
 #define BACKUPSTOREFILEENCODESTREAM__H
 
+#include <memory>
 #include <vector>
 
 #include "IOStream.h"
@@ -17,8 +18,10 @@
 #include "CollectInBufferStream.h"
 #include "MD5Digest.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileWire.h"
 #include "ReadLoggingStream.h"
 #include "RunStatusProvider.h"
+#include "Thread.h"
 
 namespace BackupStoreFileCreation
 {
@@ -33,6 +36,7 @@ namespace BackupStoreFileCreation
 
 }
 
+class CipherContext;
 
 // --------------------------------------------------------------------------
 //
@@ -68,11 +72,25 @@ public:
 		{
 			return pBlock - mpBlockIndex;
 		}
+
+		// With content-defined chunking, the new data is cut into
+		// chunks of these sizes, in the order they appear in the
+		// file, instead of blocks of the same size. Setup() works
+		// them out if they aren't filled in already.
+		void SetContentDefined(int32_t AverageChunkSize)
+		{
+			mAverageChunkSize = AverageChunkSize;
+		}
+		bool IsContentDefined() const {return mAverageChunkSize != 0;}
+		int32_t GetAverageChunkSize() const {return mAverageChunkSize;}
+		std::vector<int32_t> &GetChunkSizes() {return mChunkSizes;}
 	
 	private:
 		BackupStoreFileCreation::BlocksAvailableEntry *mpBlockIndex;
 		int64_t mNumBlocksInIndex;
 		int64_t mOtherFileID;
+		int32_t mAverageChunkSize;
+		std::vector<int32_t> mChunkSizes;
 	};
 	
 	void Setup(const std::string& Filename, Recipe *pRecipe, int64_t ContainerID,
@@ -89,6 +107,21 @@ public:
 	virtual bool StreamClosed();
 	int64_t GetBytesToUpload() { return mBytesToUpload; }
 	int64_t GetTotalBytesSent() { return mTotalBytesSent; }
+	// The block index sent at the end of the stream, once it has all
+	// been read, or NULL if the stream had no blocks
+	const CollectInBufferStream *GetBlockIndex() const
+	{
+		return (mStatus == Status_Finished && mSendData) ? &mData : NULL;
+	}
+	void UseOwnCipherContexts();
+	static bool OwnCipherContextsSupported();
+	// Make the hash of each block as it's added to the index, for
+	// GetBlockHashes() once the stream has all been read
+	void CollectBlockHashes() {mCollectBlockHashes = true;}
+	const std::vector<file_BlockHash> &GetBlockHashes() const
+	{
+		return mBlockHashes;
+	}
 
 	static void CalculateBlockSizes(int64_t DataSize, int64_t &rNumBlocksOut,
 		int32_t &rBlockSizeOut, int32_t &rLastBlockSizeOut);
@@ -102,10 +135,53 @@ private:
 		Status_Finished = 3
 	};
 
+	// One block of new file data on its way through the encoding
+	// pipeline. Blocks are read in order by the thread reading the
+	// stream, compressed and encrypted by the workers in any order,
+	// and sent in order again.
+	class EncodeJob
+	{
+	public:
+		EncodeJob(int RawBufferSize, int EncodedBufferSize);
+		~EncodeJob();
+	private:
+		// no copying
+		EncodeJob(const EncodeJob &);
+		EncodeJob &operator=(const EncodeJob &);
+	public:
+		uint8_t *mpRawBuffer;
+		int32_t mRawSize;
+		BackupStoreFile::EncodingBuffer mEncoded;
+		int32_t mEncodedSize;
+		uint32_t mWeakChecksum;
+		uint8_t mStrongChecksum[MD5Digest::DigestLength];
+		int64_t mBytesNotCompressed;
+		bool mDone;
+		bool mFailed;
+		std::string mFailure;
+	};
+
+	// Compression and encryption state for encoding blocks, which
+	// runs in its own thread if there's more than one
+	class EncodeWorker;
+	friend class EncodeWorker;
+
 	void EncodeCurrentBlock();
 	void SkipPreviousBlocksInInstruction();
 	void SetForInstruction();
+	void FindChunksInInstructions(const std::string &rFilename,
+		Recipe &rRecipe);
+	int32_t GetChunkSize(int64_t Instruction, int64_t Block)
+	{
+		return mpRecipe->GetChunkSizes()[
+			mFirstChunkInInstruction[Instruction] + Block];
+	}
 	void StoreBlockIndexEntry(int64_t WncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, uint8_t *pStrongChecksum);
+	bool ReadNextBlock(EncodeJob &rJob);
+	EncodeJob &GetNextEncodedBlock();
+	void StartWorkers();
+	void StopWorkers();
+	void RunWorker(EncodeWorker &rWorker);
 
 	Recipe *mpRecipe;
 	IOStream *mpFile;					// source file
@@ -115,6 +191,10 @@ private:
 	BackgroundTask* mpBackgroundTask;
 	int mStatus;
 	bool mSendData;						// true if there's file data to send (ie not a symlink)
+	bool mContentDefined;				// true if the new data is cut into content-defined chunks
+	// Index in the recipe's chunk sizes of the first chunk of each
+	// instruction, and the end of the last
+	std::vector<int64_t> mFirstChunkInInstruction;
 	int64_t mTotalBlocks;				// Total number of blocks in the file
 	int64_t mBytesToUpload; // Total number of clear bytes to encode and upload
 	int64_t mBytesUploaded; // Total number of clear bytes already encoded
@@ -130,12 +210,34 @@ private:
 	int32_t mBlockSize;					// Basic block size of most of the blocks in the file
 	int32_t mLastBlockSize;				// the size (unencoded) of the last block in the file
 	int64_t mTotalBytesSent;
-	// Buffers
-	uint8_t *mpRawBuffer;				// buffer for raw data
-	BackupStoreFile::EncodingBuffer mEncodedBuffer;
-										// buffer for encoded data
-	int32_t mAllocatedBufferSize;		// size of above two allocated blocks
+	int32_t mAllocatedBufferSize;		// size of the buffers for each block
 	uint64_t mEntryIVBase;				// base for block entry IV
+	// Encrypt with copies of the shared cipher contexts, if set
+	bool mOwnCipherContexts;
+	std::auto_ptr<CipherContext> mapBlockEntryEncrypt;
+	bool mCollectBlockHashes;
+	std::vector<file_BlockHash> mBlockHashes;
+	// Position of the next block to read, which runs ahead of the
+	// block being sent
+	int64_t mReadInstruction;
+	int64_t mReadBlock;
+	int64_t mReadNumBlocks;
+	int32_t mReadBlockSize;
+	int32_t mReadLastBlockSize;
+	// The encoding pipeline. Jobs are used in turn, as a ring. Each
+	// counter only increases, and the job for a block is the counter
+	// modulo the number of jobs.
+	int mNumThreads;					// 0 to encode in this thread
+	std::vector<EncodeJob *> mJobs;
+	std::vector<EncodeWorker *> mWorkers;
+	EncodeJob *mpCurrentJob;			// job being sent, if any
+	int64_t mJobsSubmitted;				// blocks read and ready to encode
+	int64_t mJobsClaimed;				// blocks taken by a worker
+	int64_t mJobsReleased;				// blocks completely sent
+	bool mStopWorkers;
+	Mutex mJobsMutex;					// protects the counters and jobs
+	ConditionVariable mJobSubmitted;	// signalled to wake workers
+	ConditionVariable mJobFinished;		// signalled to wake the reader
 };
 
 
@@ -0,0 +1,258 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileResolve.cpp
+//		Purpose: Build an old version of a file from a chain of patches
+//			 without writing out the versions in between
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <vector>
+
+#include "BackupStoreFile.h"
+#include "BackupStoreFileWire.h"
+#include "BackupStoreObjectMagic.h"
+#include "BackupStoreException.h"
+#include "BackupStoreFilename.h"
+#include "CollectInBufferStream.h"
+#include "ReadGatherStream.h"
+
+#include "MemLeakFindOn.h"
+
+// Number of block index entries to read at once
+#define RESOLVE_INDEX_ENTRIES_PER_READ	256
+
+typedef struct
+{
+	int mComponent;		// in the ReadGatherStream
+	int64_t mPosition;	// of the encoded block in that component
+	int64_t mEncodedSize;
+} ResolvedBlock;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SkipToData(IOStream &, file_StreamFormat &)
+//		Purpose: Static. Read the header of a file in the store, and
+//			 skip over its filename and attributes, returning the
+//			 position of the first block of data.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int64_t SkipToData(IOStream &rFile, file_StreamFormat &rHeaderOut)
+{
+	rFile.Seek(0, IOStream::SeekType_Absolute);
+	if(!rFile.ReadFullBuffer(&rHeaderOut, sizeof(rHeaderOut), 0))
+	{
+		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
+	}
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(rHeaderOut.mMagicValue)))
+	{
+		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+	}
+
+	BackupStoreFilename filename;
+	filename.ReadFromStream(rFile, IOStream::TimeOutInfinite);
+	int32_t size_s;
+	if(!rFile.ReadFullBuffer(&size_s, sizeof(size_s), 0))
+	{
+		THROW_EXCEPTION(CommonException, StreamableMemBlockIncompleteRead)
+	}
+	rFile.Seek(ntohl(size_s), IOStream::SeekType_Relative);
+
+	return rFile.GetPosition();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::ResolvePatchChain(const std::vector<IOStream *> &)
+//		Purpose: Where rChain is a chain of objects from the store,
+//			 starting with the version wanted, each one a patch
+//			 from the next, and ending with a complete file,
+//			 return a stream of the wanted version as a complete
+//			 file in stream order, ready to send to the client.
+//
+//			 The block indexes are read once each, from the
+//			 complete file back to the wanted version, to work
+//			 out which object each block of the wanted version
+//			 is stored in. The returned stream then reads the
+//			 blocks directly from those objects, so nothing is
+//			 written to disc, however long the chain is.
+//
+//			 The streams must be seekable. They are deleted when
+//			 the returned stream is deleted, or before this
+//			 function returns if it throws an exception.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<IOStream> BackupStoreFile::ResolvePatchChain(
+	const std::vector<IOStream *> &rChain)
+{
+	// Take ownership of the streams straight away, so that they are
+	// cleaned up whatever happens
+	std::auto_ptr<IOStream> resolved(new ReadGatherStream(true));
+	ReadGatherStream &rresolved(*((ReadGatherStream*)resolved.get()));
+	for(size_t c = 0; c < rChain.size(); ++c)
+	{
+		rresolved.AddComponent(rChain[c]);
+	}
+
+	if(rChain.empty())
+	{
+		THROW_EXCEPTION(BackupStoreException, Internal)
+	}
+
+	// Where each block of the version after the one being looked at is,
+	// and the same for the version being looked at
+	std::vector<ResolvedBlock> newer, current;
+	file_BlockIndexEntry entries[RESOLVE_INDEX_ENTRIES_PER_READ];
+	file_BlockIndexHeader wantedIndexHeader;
+	int64_t wantedDataStart = 0;
+
+	for(int c = ((int)rChain.size()) - 1; c >= 0; --c)
+	{
+		IOStream &rfile(*rChain[c]);
+		file_StreamFormat hdr;
+		int64_t position = SkipToData(rfile, hdr);
+		if(c == 0)
+		{
+			wantedDataStart = position;
+		}
+
+		int64_t numBlocks = box_ntoh64(hdr.mNumBlocks);
+		rfile.Seek(0 - ((numBlocks * sizeof(file_BlockIndexEntry))
+			+ sizeof(file_BlockIndexHeader)), IOStream::SeekType_End);
+		int64_t indexStart = rfile.GetPosition();
+
+		file_BlockIndexHeader blkhdr;
+		if(!rfile.ReadFullBuffer(&blkhdr, sizeof(blkhdr), 0))
+		{
+			THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
+		}
+		if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
+			|| (int64_t)box_ntoh64(blkhdr.mNumBlocks) != numBlocks)
+		{
+			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+		}
+		if(c == 0)
+		{
+			wantedIndexHeader = blkhdr;
+		}
+
+		current.clear();
+		current.reserve(numBlocks);
+		for(int64_t b = 0; b < numBlocks;)
+		{
+			int n = RESOLVE_INDEX_ENTRIES_PER_READ;
+			if(numBlocks - b < n)
+			{
+				n = numBlocks - b;
+			}
+			if(!rfile.ReadFullBuffer(entries, n * sizeof(entries[0]), 0))
+			{
+				THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
+			}
+
+			for(int e = 0; e < n; ++e, ++b)
+			{
+				int64_t encodedSize = box_ntoh64(entries[e].mEncodedSize);
+				ResolvedBlock block;
+				if(encodedSize > 0)
+				{
+					// In this object
+					block.mComponent = c;
+					block.mPosition = position;
+					block.mEncodedSize = encodedSize;
+					position += encodedSize;
+				}
+				else
+				{
+					// A block of the next version, which
+					// has already been resolved. The last
+					// object in the chain must be complete.
+					int64_t blockIdx = 0 - encodedSize;
+					if(c == ((int)rChain.size()) - 1)
+					{
+						THROW_EXCEPTION(BackupStoreException,
+							OnCombineFromFileIsIncomplete)
+					}
+					if(blockIdx >= (int64_t)newer.size())
+					{
+						THROW_EXCEPTION(BackupStoreException,
+							BadBackupStoreFile)
+					}
+					block = newer[blockIdx];
+				}
+				current.push_back(block);
+			}
+		}
+
+		// The data must fill the space before the index exactly
+		if(position != indexStart)
+		{
+			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+		}
+
+		newer.swap(current);
+	}
+
+	// newer is now the wanted version. Write its block index with the
+	// sizes of all the blocks filled in, as CombineFile would.
+	std::auto_ptr<CollectInBufferStream> index(new CollectInBufferStream);
+	wantedIndexHeader.mOtherFileID = box_hton64(0);
+	index->Write(&wantedIndexHeader, sizeof(wantedIndexHeader));
+	{
+		IOStream &rwanted(*rChain[0]);
+		rwanted.Seek(0 - ((newer.size() * sizeof(file_BlockIndexEntry))),
+			IOStream::SeekType_End);
+		for(size_t b = 0; b < newer.size();)
+		{
+			int n = RESOLVE_INDEX_ENTRIES_PER_READ;
+			if(newer.size() - b < (size_t)n)
+			{
+				n = newer.size() - b;
+			}
+			if(!rwanted.ReadFullBuffer(entries, n * sizeof(entries[0]), 0))
+			{
+				THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
+			}
+			for(int e = 0; e < n; ++e, ++b)
+			{
+				entries[e].mEncodedSize =
+					box_hton64(newer[b].mEncodedSize);
+			}
+			index->Write(entries, n * sizeof(entries[0]));
+		}
+	}
+	index->SetForReading();
+	int64_t indexSize = index->GetSize();
+	int indexComponent = rresolved.AddComponent(index.get());
+	index.release();
+
+	// In stream order: the block index, then the header, filename and
+	// attributes of the wanted version, then the data
+	rresolved.AddBlock(indexComponent, indexSize);
+	rresolved.AddBlock(0, wantedDataStart, true, 0);
+
+	// Blocks next to each other in the same object are read in one go
+	size_t b = 0;
+	while(b < newer.size())
+	{
+		const ResolvedBlock &rfirst(newer[b]);
+		int64_t length = rfirst.mEncodedSize;
+		for(++b; b < newer.size()
+			&& newer[b].mComponent == rfirst.mComponent
+			&& newer[b].mPosition == rfirst.mPosition + length; ++b)
+		{
+			length += newer[b].mEncodedSize;
+		}
+		rresolved.AddBlock(rfirst.mComponent, length, true,
+			rfirst.mPosition);
+	}
+
+	return resolved;
+}
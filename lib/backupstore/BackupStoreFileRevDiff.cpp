@@ -39,7 +39,7 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(hdr.mMagicValue) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_MAGIC_VALUE(ntohl(hdr.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -66,10 +66,6 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 		throw std::bad_alloc();
 	}
 
-	// Buffer data
-	void *buffer = 0;
-	int bufferSize = 0;	
-	
 	// flag
 	bool isCompletelyDifferent = true;
 	
@@ -90,7 +86,7 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 		{
 			THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 		}
-		if(ntohl(diffIdxHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+		if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diffIdxHdr.mMagicValue)))
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 		}
@@ -135,7 +131,7 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 		{
 			THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 		}
-		if(ntohl(fromIdxHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+		if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(fromIdxHdr.mMagicValue))
 			|| box_ntoh64(fromIdxHdr.mOtherFileID) != 0)
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
@@ -162,35 +158,8 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 			// Copy this block?
 			if(pfromIndexInfo[b] == 0)
 			{
-				// Copy it, first move to file location
-				rFrom.Seek(filePosition, IOStream::SeekType_Absolute);
-				
-				// Make sure there's memory available to copy this
-				if(bufferSize < blockSize || buffer == 0)
-				{
-					// Free old block
-					if(buffer != 0)
-					{
-						::free(buffer);
-						buffer = 0;
-						bufferSize = 0;
-					}
-					// Allocate new block
-					buffer = ::malloc(blockSize);
-					if(buffer == 0)
-					{
-						throw std::bad_alloc();
-					}
-					bufferSize = blockSize;
-				}
-				ASSERT(bufferSize >= blockSize);
-				
-				// Copy the block
-				if(!rFrom.ReadFullBuffer(buffer, blockSize, 0))
-				{
-					THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
-				}
-				rOut.Write(buffer, blockSize);
+				// Copy it, letting the kernel do so if it can
+				CopyStreamRange(rFrom, filePosition, rOut, blockSize);
 
 				// Store the size
 				pfromIndexInfo[b] = blockSize;
@@ -233,19 +202,11 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 	catch(...)
 	{
 		::free(pfromIndexInfo);
-		if(buffer != 0)
-		{
-			::free(buffer);
-		}
 		throw;
 	}
 
 	// Free memory used (oh for finally {} blocks)
 	::free(pfromIndexInfo);
-	if(buffer != 0)
-	{
-		::free(buffer);
-	}
 	
 	// return completely different flag
 	if(pIsCompletelyDifferent != 0)
@@ -56,6 +56,21 @@ typedef struct
 	uint8_t mEnEnc[sizeof(file_BlockIndexEntryEnc)];	// Encoded section
 } file_BlockIndexEntry;
 
+// Identifies the contents of a block to the store, without telling it
+// what they are. Keyed with a secret from the client's keys file, so it
+// can't be matched against the hashes of known data.
+typedef struct
+{
+	uint8_t mHash[MD5Digest::DigestLength];
+} file_BlockHash;
+
+// Where the store already has a block with a given hash
+typedef struct
+{
+	int64_t mObjectID;		// 0 if it doesn't have one
+	int64_t mBlockNumber;
+} file_BlockLocation;
+
 // Use default packing
 #ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
 #include "EndStructPackForWire.h"
@@ -66,8 +81,16 @@ END_STRUCTURE_PACKING_FOR_WIRE
 // header for blocks of compressed data in files
 #define HEADER_CHUNK_IS_COMPRESSED		1	// bit
 #define HEADER_ENCODING_SHIFT			1	// shift value
-#define HEADER_BLOWFISH_ENCODING		1	// value stored in bits 1 -- 7
-#define HEADER_AES_ENCODING				2	// value stored in bits 1 -- 7
+#define HEADER_ENCODING_MASK			0x0f	// after shifting
+#define HEADER_BLOWFISH_ENCODING		1	// value stored in bits 1 -- 4
+#define HEADER_AES_ENCODING				2	// value stored in bits 1 -- 4
+// AES-256-GCM. The encrypted data is followed by the tag, which also
+// covers the header byte, so the chunk can't be changed without detection.
+#define HEADER_AES_GCM_ENCODING			3	// value stored in bits 1 -- 4
+// The compression codec is stored in bits 5 -- 7 of compressed chunks, as
+// one of the COMPRESS_CODEC_* values. zlib is 0, so chunks compressed
+// with it have the same header as before there was a choice.
+#define HEADER_COMPRESSION_SHIFT		5	// shift value
 
 
 #endif // BACKUPSTOREFILEWIRE__H
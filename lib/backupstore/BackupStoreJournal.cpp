@@ -0,0 +1,312 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreJournal.cpp
+//		Purpose: Journal of the changes made to an account since it
+//			 was last housekept
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdio.h>
+
+#include "BackupStoreAccounts.h"
+#include "BackupStoreException.h"
+#include "BackupStoreJournal.h"
+#include "RaidFileController.h"
+#include "RaidFileUtil.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+#define JOURNAL_MAGIC_VALUE	0x4a726e6c // Jrnl
+#define JOURNAL_FILENAME	"journal"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreJournal::BackupStoreJournal(const BackupStoreAccountDatabase::Entry &, std::auto_ptr<FileStream>, const journal_StreamFormat &)
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreJournal::BackupStoreJournal(const
+	BackupStoreAccountDatabase::Entry& rAccount,
+	std::auto_ptr<FileStream> apJournalFile,
+	const journal_StreamFormat &rHeader)
+: mAccount(rAccount),
+  mFilename(GetFilename(rAccount, false)),
+  mapJournalFile(apJournalFile),
+  mHeader(rHeader)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreJournal::~BackupStoreJournal()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreJournal::~BackupStoreJournal()
+{
+}
+
+std::string BackupStoreJournal::GetFilename(const
+	BackupStoreAccountDatabase::Entry& rAccount, bool Temporary)
+{
+	std::string RootDir = BackupStoreAccounts::GetAccountRoot(rAccount);
+	ASSERT(RootDir[RootDir.size() - 1] == '/' ||
+		RootDir[RootDir.size() - 1] == DIRECTORY_SEPARATOR_ASCHAR);
+
+	std::string fn(RootDir + JOURNAL_FILENAME ".log");
+	if(Temporary)
+	{
+		fn += "X";
+	}
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	RaidFileDiscSet rdiscSet(rcontroller.GetDiscSet(rAccount.GetDiscSet()));
+	return RaidFileUtil::MakeWriteFileName(rdiscSet, fn);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static ReadHeader(FileStream &, const BackupStoreAccountDatabase::Entry &, journal_StreamFormat &)
+//		Purpose: Static. Read and check the header of a journal,
+//			 returning false if it's not valid.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool ReadHeader(FileStream &rFile,
+	const BackupStoreAccountDatabase::Entry& rAccount,
+	journal_StreamFormat &rHeaderOut)
+{
+	journal_StreamFormat hdr;
+	if(!rFile.ReadFullBuffer(&hdr, sizeof(hdr), 0))
+	{
+		return false;
+	}
+
+	rHeaderOut.mMagicValue = ntohl(hdr.mMagicValue);
+	rHeaderOut.mAccountID = ntohl(hdr.mAccountID);
+	rHeaderOut.mLastFullScan = box_ntoh64(hdr.mLastFullScan);
+	rHeaderOut.mBlocksUsed = box_ntoh64(hdr.mBlocksUsed);
+
+	return rHeaderOut.mMagicValue == JOURNAL_MAGIC_VALUE &&
+		(int32_t)rHeaderOut.mAccountID == rAccount.GetID();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreJournal::OpenForAppend(const BackupStoreAccountDatabase::Entry &)
+//		Purpose: Open the journal of an account to add entries to
+//			 it, returning a null pointer if it doesn't exist.
+//			 The account must be locked for writing.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupStoreJournal> BackupStoreJournal::OpenForAppend(
+	const BackupStoreAccountDatabase::Entry& rAccount)
+{
+	std::string filename = GetFilename(rAccount, false);
+	if(!FileExists(filename))
+	{
+		return std::auto_ptr<BackupStoreJournal>();
+	}
+
+	std::auto_ptr<FileStream> apFile(new FileStream(filename,
+		O_WRONLY | O_BINARY));
+	apFile->Seek(0, IOStream::SeekType_End);
+	journal_StreamFormat header;
+	header.mMagicValue = JOURNAL_MAGIC_VALUE;
+	header.mAccountID = rAccount.GetID();
+	header.mLastFullScan = 0;
+	header.mBlocksUsed = 0;
+
+	return std::auto_ptr<BackupStoreJournal>(
+		new BackupStoreJournal(rAccount, apFile, header));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreJournal::Load(const BackupStoreAccountDatabase::Entry &)
+//		Purpose: Read the whole journal of an account, returning a
+//			 null pointer if it doesn't exist or is corrupt
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupStoreJournal> BackupStoreJournal::Load(
+	const BackupStoreAccountDatabase::Entry& rAccount)
+{
+	std::string filename = GetFilename(rAccount, false);
+	if(!FileExists(filename))
+	{
+		return std::auto_ptr<BackupStoreJournal>();
+	}
+
+	std::auto_ptr<FileStream> apFile(new FileStream(filename,
+		O_RDONLY | O_BINARY));
+	journal_StreamFormat header;
+	IOStream::pos_type size = apFile->BytesLeftToRead();
+	if(!ReadHeader(*apFile, rAccount, header) ||
+		(size - sizeof(header)) % sizeof(journal_Entry) != 0)
+	{
+		BOX_WARNING(BOX_FILE_MESSAGE(filename, "Journal is corrupt, "
+			"ignoring it"));
+		return std::auto_ptr<BackupStoreJournal>();
+	}
+
+	std::auto_ptr<BackupStoreJournal> journal(
+		new BackupStoreJournal(rAccount, apFile, header));
+	std::vector<journal_Entry> &rentries(journal->mEntries);
+	rentries.resize((size - sizeof(header)) / sizeof(journal_Entry));
+	if(!rentries.empty() && !journal->mapJournalFile->ReadFullBuffer(
+		&rentries[0], rentries.size() * sizeof(journal_Entry), 0))
+	{
+		BOX_WARNING(BOX_FILE_MESSAGE(filename, "Failed to read "
+			"journal, ignoring it"));
+		return std::auto_ptr<BackupStoreJournal>();
+	}
+	journal->mapJournalFile.reset();
+
+	for(std::vector<journal_Entry>::iterator i = rentries.begin();
+		i != rentries.end(); ++i)
+	{
+		i->mType = ntohl(i->mType);
+		i->mObjectID = box_ntoh64(i->mObjectID);
+		i->mDirectoryID = box_ntoh64(i->mDirectoryID);
+		i->mBlocksUsedDelta = box_ntoh64(i->mBlocksUsedDelta);
+	}
+
+	return journal;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreJournal::Create(const BackupStoreAccountDatabase::Entry &, box_time_t, int64_t, const std::vector<journal_Entry> &)
+//		Purpose: Start a new journal, replacing any old one, with
+//			 the entries given (in host byte order). It's written
+//			 to a temporary file first, so that it's never seen
+//			 half written.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreJournal::Create(
+	const BackupStoreAccountDatabase::Entry& rAccount,
+	box_time_t LastFullScan, int64_t BlocksUsed,
+	const std::vector<journal_Entry> &rEntries)
+{
+	std::string filename = GetFilename(rAccount, false);
+	std::string tempFilename = GetFilename(rAccount, true);
+
+	// BLOCK
+	{
+		FileStream file(tempFilename,
+			O_CREAT | O_TRUNC | O_BINARY | O_WRONLY);
+
+		journal_StreamFormat hdr;
+		hdr.mMagicValue = htonl(JOURNAL_MAGIC_VALUE);
+		hdr.mAccountID = htonl(rAccount.GetID());
+		hdr.mLastFullScan = box_hton64(LastFullScan);
+		hdr.mBlocksUsed = box_hton64(BlocksUsed);
+		file.Write(&hdr, sizeof(hdr));
+
+		std::vector<journal_Entry> entries(rEntries);
+		for(std::vector<journal_Entry>::iterator i = entries.begin();
+			i != entries.end(); ++i)
+		{
+			i->mType = htonl(i->mType);
+			i->mObjectID = box_hton64(i->mObjectID);
+			i->mDirectoryID = box_hton64(i->mDirectoryID);
+			i->mBlocksUsedDelta = box_hton64(i->mBlocksUsedDelta);
+		}
+		if(!entries.empty())
+		{
+			file.Write(&entries[0],
+				entries.size() * sizeof(journal_Entry));
+		}
+	}
+
+	#ifdef WIN32
+	if(FileExists(filename) && ::unlink(filename.c_str()) != 0)
+	{
+		THROW_EMU_FILE_ERROR("Failed to delete old journal",
+			filename, CommonException, OSFileError);
+	}
+	#endif
+
+	if(::rename(tempFilename.c_str(), filename.c_str()) != 0)
+	{
+		THROW_EMU_ERROR("Failed to rename temporary journal from " <<
+			tempFilename << " to " << filename, CommonException,
+			OSFileError);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreJournal::Remove(const BackupStoreAccountDatabase::Entry &)
+//		Purpose: Remove the journal of an account, if it has one,
+//			 so that the next housekeeping run scans all of it
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreJournal::Remove(const BackupStoreAccountDatabase::Entry& rAccount)
+{
+	std::string filename = GetFilename(rAccount, false);
+	if(FileExists(filename) && ::unlink(filename.c_str()) != 0)
+	{
+		THROW_EMU_FILE_ERROR("Failed to delete journal", filename,
+			CommonException, OSFileError);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreJournal::Append(int, int64_t, int64_t, int64_t)
+//		Purpose: Add an entry to the end of the journal, which must
+//			 have been opened with OpenForAppend()
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreJournal::Append(int Type, int64_t ObjectID,
+	int64_t DirectoryID, int64_t BlocksUsedDelta)
+{
+	ASSERT(mapJournalFile.get() != 0);
+
+	journal_Entry entry;
+	entry.mType = htonl(Type);
+	entry.mObjectID = box_hton64(ObjectID);
+	entry.mDirectoryID = box_hton64(DirectoryID);
+	entry.mBlocksUsedDelta = box_hton64(BlocksUsedDelta);
+	mapJournalFile->Write(&entry, sizeof(entry));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreJournal::GetBlocksUsedDelta()
+//		Purpose: The total change in the space used by the account
+//			 recorded in the journal
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreJournal::GetBlocksUsedDelta() const
+{
+	int64_t delta = 0;
+	for(std::vector<journal_Entry>::const_iterator i = mEntries.begin();
+		i != mEntries.end(); ++i)
+	{
+		delta += i->mBlocksUsedDelta;
+	}
+	return delta;
+}
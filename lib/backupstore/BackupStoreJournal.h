@@ -0,0 +1,129 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreJournal.h
+//		Purpose: Journal of the changes made to an account since it
+//			 was last housekept
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREJOURNAL__H
+#define BACKUPSTOREJOURNAL__H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BackupStoreAccountDatabase.h"
+#include "BoxTime.h"
+#include "FileStream.h"
+
+// set packing to one byte
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "BeginStructPackForWire.h"
+#else
+BEGIN_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+typedef struct
+{
+	uint32_t mMagicValue;	// also the version number
+	uint32_t mAccountID;
+	int64_t mLastFullScan;	// when housekeeping last scanned everything
+	int64_t mBlocksUsed;	// in the store info, when the journal was started
+} journal_StreamFormat;
+
+typedef struct
+{
+	int32_t mType;
+	int64_t mObjectID;
+	int64_t mDirectoryID;
+	int64_t mBlocksUsedDelta;
+} journal_Entry;
+
+// Use default packing
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "EndStructPackForWire.h"
+#else
+END_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+// Types of journal entries
+#define JOURNAL_ENTRY_ADDED		1	// object added to directory
+#define JOURNAL_ENTRY_DELETED		2	// object marked as deleted
+#define JOURNAL_ENTRY_OLD_VERSION	3	// object marked as an old version
+#define JOURNAL_ENTRY_MOVED		4	// object moved into directory
+#define JOURNAL_ENTRY_DIRECTORY		5	// directory rewritten
+// Written by housekeeping: the directory has old versions or deleted
+// files in it, which might be removed later
+#define JOURNAL_ENTRY_CANDIDATE		6
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreJournal
+//		Purpose: A log of the objects and directories in an account
+//			 which have changed since housekeeping last ran, and
+//			 of the changes in the space used, so that
+//			 housekeeping only needs to look at those directories.
+//			 It's only started by housekeeping after a full scan
+//			 of the account, and only appended to while the
+//			 account is locked for writing. If it's missing, or
+//			 the space used doesn't add up, housekeeping must scan
+//			 the whole account again.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreJournal
+{
+public:
+	~BackupStoreJournal();
+private:
+	// Creation through static functions only
+	BackupStoreJournal(const BackupStoreAccountDatabase::Entry& rAccount,
+		std::auto_ptr<FileStream> apJournalFile,
+		const journal_StreamFormat &rHeader);
+	// No copying allowed
+	BackupStoreJournal(const BackupStoreJournal &);
+
+public:
+	// Open the journal to add entries to it, returning a null pointer
+	// if there isn't one
+	static std::auto_ptr<BackupStoreJournal> OpenForAppend(const
+		BackupStoreAccountDatabase::Entry& rAccount);
+	// Read the whole journal, returning a null pointer if there isn't one
+	// or it's corrupt
+	static std::auto_ptr<BackupStoreJournal> Load(const
+		BackupStoreAccountDatabase::Entry& rAccount);
+	// Start a new journal, replacing any old one, containing the entries
+	// given
+	static void Create(const BackupStoreAccountDatabase::Entry& rAccount,
+		box_time_t LastFullScan, int64_t BlocksUsed,
+		const std::vector<journal_Entry> &rEntries);
+	// Remove the journal, so that the next housekeeping run scans the
+	// whole account
+	static void Remove(const BackupStoreAccountDatabase::Entry& rAccount);
+
+	void Append(int Type, int64_t ObjectID, int64_t DirectoryID,
+		int64_t BlocksUsedDelta);
+
+	box_time_t GetLastFullScan() const {return mHeader.mLastFullScan;}
+	int64_t GetBlocksUsed() const {return mHeader.mBlocksUsed;}
+	// Entries in host byte order, only after Load()
+	const std::vector<journal_Entry> &GetEntries() const {return mEntries;}
+	int64_t GetBlocksUsedDelta() const;
+
+private:
+	static std::string GetFilename(const BackupStoreAccountDatabase::Entry&
+		rAccount, bool Temporary);
+
+	BackupStoreAccountDatabase::Entry mAccount;
+	std::string mFilename;
+	std::auto_ptr<FileStream> mapJournalFile;
+	// In host byte order
+	journal_StreamFormat mHeader;
+	std::vector<journal_Entry> mEntries;
+};
+
+#endif // BACKUPSTOREJOURNAL__H
@@ -24,6 +24,23 @@
 // Do not use v0 in any new code!
 #define OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0 0x46426C6B
 
+// Files whose new blocks were cut at content-defined boundaries, rather
+// than into blocks of the same size, have these magic values instead.
+// The format is otherwise the same as V1, so anything which can read one
+// can read the other, but these files can be diffed by chunking the new
+// version in the same way and looking up the chunks in the old index.
+#define OBJECTMAGIC_FILE_MAGIC_VALUE_V2		0x66696C43
+#define OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2 0x62696443
+
+// Whether a magic value (in host byte order) is that of a current file
+// stream or block index, of either format
+#define OBJECTMAGIC_IS_FILE_MAGIC_VALUE(m) \
+	((m) == OBJECTMAGIC_FILE_MAGIC_VALUE_V1 || \
+	 (m) == OBJECTMAGIC_FILE_MAGIC_VALUE_V2)
+#define OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(m) \
+	((m) == OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1 || \
+	 (m) == OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2)
+
 // Magic value for directory streams
 #define OBJECTMAGIC_DIR_MAGIC_VALUE 		0x4449525F
 
@@ -0,0 +1,484 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStorePackFile.cpp
+//		Purpose: Small objects stored together in one RaidFile for
+//			 each directory of objects
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <algorithm>
+
+#include "BackupConstants.h"
+#include "BackupStoreException.h"
+#include "BackupStorePackFile.h"
+#include "CollectInBufferStream.h"
+#include "RaidFileRead.h"
+#include "RaidFileWrite.h"
+#include "StoreStructure.h"
+
+#include "MemLeakFindOn.h"
+
+#define PACK_MAGIC_VALUE	0x7061636b // pack
+
+// An entry in a pack being written, and where its data comes from
+typedef struct
+{
+	pack_Entry mEntry;
+	int64_t mOldOffset;	// in the old pack, or -1 if stored on its own
+} NewPackEntry;
+
+static bool CompareNewPackEntries(const NewPackEntry &rA,
+	const NewPackEntry &rB)
+{
+	return rA.mEntry.mObjectID < rB.mEntry.mObjectID;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static CopyBytes(IOStream &, IOStream &, int64_t)
+//		Purpose: Static. Copy exactly Length bytes from one stream to
+//			 another, throwing PackFileCorrupt if there aren't
+//			 enough.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void CopyBytes(IOStream &rFrom, IOStream &rTo, int64_t Length)
+{
+	char buffer[4096];
+	while(Length > 0)
+	{
+		int bytes = (Length > (int64_t)sizeof(buffer))
+			? (int)sizeof(buffer) : (int)Length;
+		if(!rFrom.ReadFullBuffer(buffer, bytes, 0))
+		{
+			THROW_EXCEPTION(BackupStoreException, PackFileCorrupt)
+		}
+		rTo.Write(buffer, bytes);
+		Length -= bytes;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStorePackFile::ReadIndex(RaidFileRead &, std::vector<pack_Entry> &)
+//		Purpose: Read and check the index of an open pack, in host
+//			 byte order. Throws PackFileCorrupt if it's not valid.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStorePackFile::ReadIndex(RaidFileRead &rPack,
+	std::vector<pack_Entry> &rIndexOut)
+{
+	rIndexOut.clear();
+	rPack.Seek(0, IOStream::SeekType_Absolute);
+
+	pack_StreamFormat hdr;
+	if(!rPack.ReadFullBuffer(&hdr, sizeof(hdr), 0) ||
+		ntohl(hdr.mMagicValue) != PACK_MAGIC_VALUE)
+	{
+		THROW_EXCEPTION(BackupStoreException, PackFileCorrupt)
+	}
+
+	// There can't be more objects than a directory holds
+	int32_t numEntries = ntohl(hdr.mNumEntries);
+	if(numEntries < 0 || numEntries > (1<<STORE_ID_SEGMENT_LENGTH))
+	{
+		THROW_EXCEPTION(BackupStoreException, PackFileCorrupt)
+	}
+
+	int64_t fileSize = rPack.GetFileSize();
+	int64_t dataStart = sizeof(hdr) +
+		((int64_t)numEntries * sizeof(pack_Entry));
+	rIndexOut.resize(numEntries);
+
+	for(int32_t e = 0; e < numEntries; ++e)
+	{
+		pack_Entry en;
+		if(!rPack.ReadFullBuffer(&en, sizeof(en), 0))
+		{
+			THROW_EXCEPTION(BackupStoreException, PackFileCorrupt)
+		}
+
+		pack_Entry &rEntry(rIndexOut[e]);
+		rEntry.mObjectID = box_ntoh64(en.mObjectID);
+		rEntry.mOffset = box_ntoh64(en.mOffset);
+		rEntry.mLength = box_ntoh64(en.mLength);
+		rEntry.mSizeInBlocks = box_ntoh64(en.mSizeInBlocks);
+
+		if(rEntry.mOffset < dataStart || rEntry.mLength < 0 ||
+			rEntry.mOffset + rEntry.mLength > fileSize ||
+			(e > 0 && rEntry.mObjectID <= rIndexOut[e - 1].mObjectID))
+		{
+			THROW_EXCEPTION(BackupStoreException, PackFileCorrupt)
+		}
+	}
+
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStorePackFile::ReadIndex(int, const std::string &, std::vector<pack_Entry> &)
+//		Purpose: Read the index of a pack, returning false if it
+//			 doesn't exist.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStorePackFile::ReadIndex(int DiscSet,
+	const std::string &rPackFilename, std::vector<pack_Entry> &rIndexOut)
+{
+	rIndexOut.clear();
+	if(!RaidFileRead::FileExists(DiscSet, rPackFilename))
+	{
+		return false;
+	}
+
+	std::auto_ptr<RaidFileRead> pack(RaidFileRead::Open(DiscSet,
+		rPackFilename));
+	return ReadIndex(*pack, rIndexOut);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStorePackFile::FindEntry(const std::vector<pack_Entry> &, int64_t)
+//		Purpose: Find an object in the index of a pack, returning a
+//			 null pointer if it isn't there.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+const pack_Entry *BackupStorePackFile::FindEntry(
+	const std::vector<pack_Entry> &rIndex, int64_t ObjectID)
+{
+	// The index is sorted by object ID
+	int lower = 0, upper = (int)rIndex.size() - 1;
+	while(lower <= upper)
+	{
+		int middle = (lower + upper) / 2;
+		if(rIndex[middle].mObjectID == ObjectID)
+		{
+			return &(rIndex[middle]);
+		}
+		else if(rIndex[middle].mObjectID < ObjectID)
+		{
+			lower = middle + 1;
+		}
+		else
+		{
+			upper = middle - 1;
+		}
+	}
+
+	return 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStorePackFile::ReadObject(RaidFileRead &, const pack_Entry &)
+//		Purpose: Read an object out of an open pack into memory.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<IOStream> BackupStorePackFile::ReadObject(RaidFileRead &rPack,
+	const pack_Entry &rEntry)
+{
+	std::auto_ptr<CollectInBufferStream> object(new CollectInBufferStream);
+	rPack.Seek(rEntry.mOffset, IOStream::SeekType_Absolute);
+	CopyBytes(rPack, *object, rEntry.mLength);
+	object->SetForReading();
+	return std::auto_ptr<IOStream>(object.release());
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStorePackFile::OpenObject(int, const std::string &, int64_t, int64_t *)
+//		Purpose: Open an object, either stored on its own or in the
+//			 pack for its directory, and optionally return the
+//			 space which it uses, as counted in the store info.
+//			 Throws ObjectDoesNotExist if it's in neither.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<IOStream> BackupStorePackFile::OpenObject(int DiscSet,
+	const std::string &rStoreRoot, int64_t ObjectID,
+	int64_t *pSizeInBlocksOut)
+{
+	std::string filename;
+	StoreStructure::MakeObjectFilename(ObjectID, rStoreRoot, DiscSet,
+		filename, false /* don't make sure the dir exists */);
+	if(RaidFileRead::FileExists(DiscSet, filename))
+	{
+		std::auto_ptr<RaidFileRead> file(RaidFileRead::Open(DiscSet,
+			filename));
+		if(pSizeInBlocksOut)
+		{
+			*pSizeInBlocksOut = file->GetDiscUsageInBlocks();
+		}
+		return std::auto_ptr<IOStream>(file.release());
+	}
+
+	std::string packFilename;
+	StoreStructure::MakePackFilename(ObjectID, rStoreRoot, DiscSet,
+		packFilename);
+	if(RaidFileRead::FileExists(DiscSet, packFilename))
+	{
+		std::auto_ptr<RaidFileRead> pack(RaidFileRead::Open(DiscSet,
+			packFilename));
+		std::vector<pack_Entry> index;
+		ReadIndex(*pack, index);
+
+		const pack_Entry *pEntry = FindEntry(index, ObjectID);
+		if(pEntry != 0)
+		{
+			if(pSizeInBlocksOut)
+			{
+				*pSizeInBlocksOut = pEntry->mSizeInBlocks;
+			}
+			return ReadObject(*pack, *pEntry);
+		}
+	}
+
+	THROW_EXCEPTION_MESSAGE(BackupStoreException, ObjectDoesNotExist,
+		BOX_FORMAT_OBJECTID(ObjectID));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStorePackFile::ObjectExists(int, const std::string &, int64_t)
+//		Purpose: Whether an object is stored, either on its own or
+//			 in a pack.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStorePackFile::ObjectExists(int DiscSet,
+	const std::string &rStoreRoot, int64_t ObjectID)
+{
+	std::string filename;
+	StoreStructure::MakeObjectFilename(ObjectID, rStoreRoot, DiscSet,
+		filename, false /* don't make sure the dir exists */);
+	if(RaidFileRead::FileExists(DiscSet, filename))
+	{
+		return true;
+	}
+
+	std::string packFilename;
+	StoreStructure::MakePackFilename(ObjectID, rStoreRoot, DiscSet,
+		packFilename);
+	std::vector<pack_Entry> index;
+	return ReadIndex(DiscSet, packFilename, index) &&
+		FindEntry(index, ObjectID) != 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStorePackFile::DeleteObject(int, const std::string &, int64_t)
+//		Purpose: Delete an object, and any copy of it in a pack. The
+//			 account must be locked. To delete many objects, it's
+//			 better to call UpdatePack() once for each directory.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStorePackFile::DeleteObject(int DiscSet,
+	const std::string &rStoreRoot, int64_t ObjectID)
+{
+	std::string filename;
+	StoreStructure::MakeObjectFilename(ObjectID, rStoreRoot, DiscSet,
+		filename, false /* don't make sure the dir exists */);
+	if(RaidFileRead::FileExists(DiscSet, filename))
+	{
+		RaidFileWrite del(DiscSet, filename);
+		del.Delete();
+	}
+
+	std::set<int64_t> remove;
+	remove.insert(ObjectID);
+	UpdatePack(DiscSet, rStoreRoot, ObjectID, std::set<int64_t>(), remove);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStorePackFile::UpdatePack(int, const std::string &, int64_t, const std::set<int64_t> &, const std::set<int64_t> &)
+//		Purpose: Rewrite the pack of the directory of objects which
+//			 contains DirectoryStartID, adding the objects in rAdd
+//			 to it and deleting them, and dropping the objects in
+//			 rRemove and any stale copies from it. Objects in rAdd
+//			 which aren't stored on their own are ignored. The
+//			 account must be locked. Returns the number of objects
+//			 added.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStorePackFile::UpdatePack(int DiscSet, const std::string &rStoreRoot,
+	int64_t DirectoryStartID, const std::set<int64_t> &rAdd,
+	const std::set<int64_t> &rRemove)
+{
+	std::string packFilename;
+	StoreStructure::MakePackFilename(DirectoryStartID, rStoreRoot, DiscSet,
+		packFilename);
+
+	std::auto_ptr<RaidFileRead> oldPack;
+	std::vector<pack_Entry> oldIndex;
+	if(RaidFileRead::FileExists(DiscSet, packFilename))
+	{
+		oldPack = RaidFileRead::Open(DiscSet, packFilename);
+		ReadIndex(*oldPack, oldIndex);
+	}
+
+	// Anything to do?
+	bool changed = !rAdd.empty();
+	for(std::set<int64_t>::const_iterator i(rRemove.begin());
+		!changed && i != rRemove.end(); ++i)
+	{
+		changed = (FindEntry(oldIndex, *i) != 0);
+	}
+	if(!changed)
+	{
+		return 0;
+	}
+
+	std::vector<NewPackEntry> entries;
+
+	// Keep the objects in the old pack which are still current
+	for(std::vector<pack_Entry>::const_iterator i(oldIndex.begin());
+		i != oldIndex.end(); ++i)
+	{
+		if(rRemove.find(i->mObjectID) != rRemove.end())
+		{
+			continue;
+		}
+
+		std::string filename;
+		StoreStructure::MakeObjectFilename(i->mObjectID, rStoreRoot,
+			DiscSet, filename, false /* don't make sure the dir exists */);
+		if(RaidFileRead::FileExists(DiscSet, filename))
+		{
+			// Superseded by the copy stored on its own, which
+			// might be about to replace it
+			BOX_TRACE("Dropping stale copy of object " <<
+				BOX_FORMAT_OBJECTID(i->mObjectID) << " from " <<
+				packFilename);
+			continue;
+		}
+
+		NewPackEntry en;
+		en.mEntry = *i;
+		en.mOldOffset = i->mOffset;
+		entries.push_back(en);
+	}
+
+	// Find the sizes of the new objects, without keeping them all open
+	std::vector<std::string> added;
+	for(std::set<int64_t>::const_iterator i(rAdd.begin());
+		i != rAdd.end(); ++i)
+	{
+		ASSERT((*i & ~(int64_t)STORE_ID_SEGMENT_MASK) ==
+			(DirectoryStartID & ~(int64_t)STORE_ID_SEGMENT_MASK));
+
+		std::string filename;
+		StoreStructure::MakeObjectFilename(*i, rStoreRoot, DiscSet,
+			filename, false /* don't make sure the dir exists */);
+		if(!RaidFileRead::FileExists(DiscSet, filename))
+		{
+			continue;
+		}
+
+		std::auto_ptr<RaidFileRead> object(RaidFileRead::Open(DiscSet,
+			filename));
+		NewPackEntry en;
+		en.mEntry.mObjectID = *i;
+		en.mEntry.mOffset = 0;
+		en.mEntry.mLength = object->GetFileSize();
+		en.mEntry.mSizeInBlocks = object->GetDiscUsageInBlocks();
+		en.mOldOffset = -1;
+		entries.push_back(en);
+		added.push_back(filename);
+	}
+
+	std::sort(entries.begin(), entries.end(), CompareNewPackEntries);
+
+	if(entries.empty())
+	{
+		// Nothing left in it
+		oldPack.reset();
+		if(!oldIndex.empty() || RaidFileRead::FileExists(DiscSet,
+			packFilename))
+		{
+			RaidFileWrite del(DiscSet, packFilename);
+			del.Delete();
+		}
+		return 0;
+	}
+
+	// Write the header and index, with the objects in ID order after them
+	RaidFileWrite newPack(DiscSet, packFilename);
+	newPack.Open(true /* allow overwriting */);
+
+	pack_StreamFormat hdr;
+	hdr.mMagicValue = htonl(PACK_MAGIC_VALUE);
+	hdr.mNumEntries = htonl((int32_t)entries.size());
+	newPack.Write(&hdr, sizeof(hdr));
+
+	int64_t offset = sizeof(hdr) +
+		((int64_t)entries.size() * sizeof(pack_Entry));
+	for(std::vector<NewPackEntry>::iterator i(entries.begin());
+		i != entries.end(); ++i)
+	{
+		i->mEntry.mOffset = offset;
+		offset += i->mEntry.mLength;
+
+		pack_Entry en;
+		en.mObjectID = box_hton64(i->mEntry.mObjectID);
+		en.mOffset = box_hton64(i->mEntry.mOffset);
+		en.mLength = box_hton64(i->mEntry.mLength);
+		en.mSizeInBlocks = box_hton64(i->mEntry.mSizeInBlocks);
+		newPack.Write(&en, sizeof(en));
+	}
+
+	for(std::vector<NewPackEntry>::const_iterator i(entries.begin());
+		i != entries.end(); ++i)
+	{
+		if(i->mOldOffset >= 0)
+		{
+			oldPack->Seek(i->mOldOffset, IOStream::SeekType_Absolute);
+			CopyBytes(*oldPack, newPack, i->mEntry.mLength);
+		}
+		else
+		{
+			std::string filename;
+			StoreStructure::MakeObjectFilename(i->mEntry.mObjectID,
+				rStoreRoot, DiscSet, filename,
+				false /* don't make sure the dir exists */);
+			std::auto_ptr<RaidFileRead> object(
+				RaidFileRead::Open(DiscSet, filename));
+			CopyBytes(*object, newPack, i->mEntry.mLength);
+		}
+	}
+
+	oldPack.reset();
+	newPack.Commit(BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY);
+
+	// Only now that the pack is safely on disc can the objects stored on
+	// their own be deleted.
+	for(std::vector<std::string>::const_iterator i(added.begin());
+		i != added.end(); ++i)
+	{
+		RaidFileWrite del(DiscSet, *i);
+		del.Delete();
+	}
+
+	BOX_TRACE("Rewrote " << packFilename << " with " << entries.size() <<
+		" objects, " << added.size() << " of them new");
+	return (int)added.size();
+}
@@ -0,0 +1,111 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStorePackFile.h
+//		Purpose: Small objects stored together in one RaidFile for
+//			 each directory of objects
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREPACKFILE__H
+#define BACKUPSTOREPACKFILE__H
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "IOStream.h"
+
+class RaidFileRead;
+
+// set packing to one byte
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "BeginStructPackForWire.h"
+#else
+BEGIN_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+typedef struct
+{
+	uint32_t mMagicValue;	// also the version number
+	int32_t mNumEntries;
+} pack_StreamFormat;
+
+// Follows the header, sorted by object ID
+typedef struct
+{
+	int64_t mObjectID;
+	int64_t mOffset;	// of the object, from the start of the pack
+	int64_t mLength;	// in bytes
+	int64_t mSizeInBlocks;	// used by the object when stored on its own
+} pack_Entry;
+
+// Use default packing
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "EndStructPackForWire.h"
+#else
+END_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStorePackFile
+//		Purpose: Each directory of objects in the store may contain a
+//			 pack, which holds small objects in a single RaidFile
+//			 instead of one each, to save inodes and opens. The
+//			 pack starts with an index giving the position of each
+//			 object in it.
+//
+//			 An object stored on its own always takes precedence
+//			 over a copy in the pack, so objects can be rewritten
+//			 without touching the pack, and the pack can be
+//			 committed before the packed objects are deleted. Any
+//			 copies made stale this way are dropped the next time
+//			 the pack is rewritten. Objects are only packed and
+//			 removed from packs by housekeeping and the checker,
+//			 with the account locked.
+//
+//			 The sizes of objects in the store info and in
+//			 directories are always the sizes which the objects
+//			 would use if they were stored on their own.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStorePackFile
+{
+public:
+	// Open an object, wherever it's stored. Packed objects are read
+	// into memory, as they're small.
+	static std::auto_ptr<IOStream> OpenObject(int DiscSet,
+		const std::string &rStoreRoot, int64_t ObjectID,
+		int64_t *pSizeInBlocksOut = 0);
+	static bool ObjectExists(int DiscSet, const std::string &rStoreRoot,
+		int64_t ObjectID);
+	// Delete an object, wherever it's stored
+	static void DeleteObject(int DiscSet, const std::string &rStoreRoot,
+		int64_t ObjectID);
+
+	// Read the index of a pack, in host byte order, returning false if
+	// there is no pack. Throws PackFileCorrupt if it can't be read.
+	static bool ReadIndex(int DiscSet, const std::string &rPackFilename,
+		std::vector<pack_Entry> &rIndexOut);
+	static bool ReadIndex(RaidFileRead &rPack,
+		std::vector<pack_Entry> &rIndexOut);
+	static const pack_Entry *FindEntry(const std::vector<pack_Entry>
+		&rIndex, int64_t ObjectID);
+	static std::auto_ptr<IOStream> ReadObject(RaidFileRead &rPack,
+		const pack_Entry &rEntry);
+
+	// Rewrite the pack of one directory of objects, moving the objects
+	// in rAdd, which are stored on their own, into it, and dropping the
+	// objects in rRemove from it. Returns the number of objects moved
+	// into the pack.
+	static int UpdatePack(int DiscSet, const std::string &rStoreRoot,
+		int64_t DirectoryStartID, const std::set<int64_t> &rAdd,
+		const std::set<int64_t> &rRemove);
+};
+
+#endif // BACKUPSTOREPACKFILE__H
@@ -10,6 +10,11 @@
 #include "Box.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_MMAN_H
+	#include <sys/mman.h>
+#endif
 
 #include <algorithm>
 
@@ -27,6 +32,18 @@
 #define REFCOUNT_MAGIC_VALUE	0x52656643 // RefC
 #define REFCOUNT_FILENAME	"refcount"
 
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+	#define REFCOUNT_USE_MMAP
+#endif
+
+// Temporary databases grow by at least this many entries at a time, and
+// mappings are made in multiples of this many bytes.
+#define REFCOUNT_MIN_GROWTH_ENTRIES	16384
+#define REFCOUNT_MAPPING_GRANULARITY	(1024*1024)
+
+// ReportChangesTo() skips over runs of this many identical entries at once
+#define REFCOUNT_COMPARE_BATCH		4096
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -43,9 +60,14 @@ BackupStoreRefCountDatabase::BackupStoreRefCountDatabase(const
   mReadOnly(ReadOnly),
   mIsModified(false),
   mIsTemporaryFile(Temporary),
-  mapDatabaseFile(apDatabaseFile)
+  mapDatabaseFile(apDatabaseFile),
+  mLastObjectID(0),
+  mEntriesInFile(0),
+  mpMapping(0),
+  mMappingSize(0)
 {
 	ASSERT(!(ReadOnly && Temporary)); // being both doesn't make sense
+	RefreshSize();
 }
 
 void BackupStoreRefCountDatabase::Commit()
@@ -62,8 +84,19 @@ void BackupStoreRefCountDatabase::Commit()
 			"Reference count database is already closed");
 	}
 
-	mapDatabaseFile->Close();
-	mapDatabaseFile.reset();
+	// Cut off any space reserved beyond the last entry, and make sure
+	// that everything written through the mapping is on disc before the
+	// new database replaces the old one.
+	ResizeFile(mLastObjectID);
+#ifdef REFCOUNT_USE_MMAP
+	if(mpMapping != 0 && ::msync(mpMapping, GetOffset(mLastObjectID + 1),
+		MS_SYNC) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to flush reference count database",
+			mFilename, CommonException, OSFileError);
+	}
+#endif
+	Close();
 
 	std::string Final_Filename = GetFilename(mAccount, false);
 
@@ -102,8 +135,7 @@ void BackupStoreRefCountDatabase::Discard()
 	// closed, and we don't want to blow up here in that case.
 	if (mapDatabaseFile.get())
 	{
-		mapDatabaseFile->Close();
-		mapDatabaseFile.reset();
+		Close();
 	}
 
 	if(unlink(mFilename.c_str()) != 0)
@@ -142,6 +174,23 @@ BackupStoreRefCountDatabase::~BackupStoreRefCountDatabase()
 				"in destructor: " << e.what());
 		}
 	}
+
+	Unmap();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::Close()
+//		Purpose: Unmap and close the database file
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::Close()
+{
+	Unmap();
+	mapDatabaseFile->Close();
+	mapDatabaseFile.reset();
 }
 
 std::string BackupStoreRefCountDatabase::GetFilename(const
@@ -278,9 +327,13 @@ std::auto_ptr<BackupStoreRefCountDatabase> BackupStoreRefCountDatabase::Load(
 BackupStoreRefCountDatabase::refcount_t
 BackupStoreRefCountDatabase::GetRefCount(int64_t ObjectID) const
 {
-	IOStream::pos_type offset = GetOffset(ObjectID);
+	if (ObjectID > mLastObjectID && !mIsTemporaryFile)
+	{
+		// Another process may have added objects since we last looked
+		RefreshSize();
+	}
 
-	if (GetSize() < offset + GetEntrySize())
+	if (ObjectID < BACKUPSTORE_ROOT_DIRECTORY_ID || ObjectID > mLastObjectID)
 	{
 		THROW_FILE_ERROR("Failed to read refcount database: "
 			"attempted read of unknown refcount for object " <<
@@ -288,31 +341,29 @@ BackupStoreRefCountDatabase::GetRefCount(int64_t ObjectID) const
 			BackupStoreException, UnknownObjectRefCountRequested);
 	}
 
-	mapDatabaseFile->Seek(offset, SEEK_SET);
-
-	refcount_t refcount;
-	if (mapDatabaseFile->Read(&refcount, sizeof(refcount)) !=
-		sizeof(refcount))
-	{
-		THROW_FILE_ERROR("Failed to read refcount database: "
-			"short read at offset " << offset, mFilename,
-			BackupStoreException, CouldNotLoadStoreInfo);
-	}
-
-	return ntohl(refcount);
+	return ReadEntry(ObjectID);
 }
 
 int64_t BackupStoreRefCountDatabase::GetLastObjectIDUsed() const
 {
-	return (GetSize() - sizeof(refcount_StreamFormat)) /
-		sizeof(refcount_t);
+	if (!mIsTemporaryFile)
+	{
+		RefreshSize();
+	}
+
+	return mLastObjectID;
 }
 
 void BackupStoreRefCountDatabase::AddReference(int64_t ObjectID)
 {
 	refcount_t refcount;
 
-	if (ObjectID > GetLastObjectIDUsed())
+	if (ObjectID > mLastObjectID && !mIsTemporaryFile)
+	{
+		RefreshSize();
+	}
+
+	if (ObjectID > mLastObjectID)
 	{
 		// new object, assume no previous references
 		refcount = 0;
@@ -320,7 +371,7 @@ void BackupStoreRefCountDatabase::AddReference(int64_t ObjectID)
 	else
 	{
 		// read previous value from database
-		refcount = GetRefCount(ObjectID);
+		refcount = ReadEntry(ObjectID);
 	}
 
 	refcount++;
@@ -331,10 +382,12 @@ void BackupStoreRefCountDatabase::AddReference(int64_t ObjectID)
 void BackupStoreRefCountDatabase::SetRefCount(int64_t ObjectID,
 	refcount_t NewRefCount)
 {
-	IOStream::pos_type offset = GetOffset(ObjectID);
-	mapDatabaseFile->Seek(offset, SEEK_SET);
-	refcount_t RefCountNetOrder = htonl(NewRefCount);
-	mapDatabaseFile->Write(&RefCountNetOrder, sizeof(RefCountNetOrder));
+	if (ObjectID > mLastObjectID)
+	{
+		Extend(ObjectID);
+	}
+
+	WriteEntry(ObjectID, NewRefCount);
 	mIsModified = true;
 }
 
@@ -353,30 +406,348 @@ int BackupStoreRefCountDatabase::ReportChangesTo(BackupStoreRefCountDatabase& rO
 	int ErrorCount = 0;
 	int64_t MaxOldObjectId = rOldRefs.GetLastObjectIDUsed();
 	int64_t MaxNewObjectId = GetLastObjectIDUsed();
+	int64_t MaxObjectId = std::max(MaxOldObjectId, MaxNewObjectId);
 
-	for (int64_t ObjectID = BACKUPSTORE_ROOT_DIRECTORY_ID;
-		ObjectID <= std::max(MaxOldObjectId, MaxNewObjectId);
-		ObjectID++)
+	for (int64_t BatchStart = BACKUPSTORE_ROOT_DIRECTORY_ID;
+		BatchStart <= MaxObjectId;
+		BatchStart += REFCOUNT_COMPARE_BATCH)
 	{
-		if(ObjectID == ignore_object_id)
+		int64_t BatchEnd = std::min(BatchStart + REFCOUNT_COMPARE_BATCH - 1,
+			MaxObjectId);
+
+#ifdef REFCOUNT_USE_MMAP
+		// Normally almost nothing has changed, so compare the raw
+		// entries a batch at a time, and only look at each object in
+		// batches which differ.
+		if (BatchEnd <= MaxOldObjectId && BatchEnd <= MaxNewObjectId &&
+			::memcmp(mpMapping + GetOffset(BatchStart),
+				rOldRefs.mpMapping + GetOffset(BatchStart),
+				(BatchEnd - BatchStart + 1) * GetEntrySize()) == 0)
 		{
 			continue;
 		}
+#endif
 
-		refcount_t OldRefs = (ObjectID <= MaxOldObjectId) ?
-			rOldRefs.GetRefCount(ObjectID) : 0;
-		refcount_t NewRefs = (ObjectID <= MaxNewObjectId) ?
-			this->GetRefCount(ObjectID) : 0;
-
-		if (OldRefs != NewRefs)
+		for (int64_t ObjectID = BatchStart; ObjectID <= BatchEnd;
+			ObjectID++)
 		{
-			BOX_WARNING("Reference count of object " <<
-				BOX_FORMAT_OBJECTID(ObjectID) <<
-				" changed from " << OldRefs <<
-				" to " << NewRefs);
-			ErrorCount++;
+			if(ObjectID == ignore_object_id)
+			{
+				continue;
+			}
+
+			refcount_t OldRefs = (ObjectID <= MaxOldObjectId) ?
+				rOldRefs.GetRefCount(ObjectID) : 0;
+			refcount_t NewRefs = (ObjectID <= MaxNewObjectId) ?
+				this->GetRefCount(ObjectID) : 0;
+
+			if (OldRefs != NewRefs)
+			{
+				BOX_WARNING("Reference count of object " <<
+					BOX_FORMAT_OBJECTID(ObjectID) <<
+					" changed from " << OldRefs <<
+					" to " << NewRefs);
+				ErrorCount++;
+			}
 		}
 	}
 
 	return ErrorCount;
 }
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::Reserve(int64_t)
+//		Purpose: Make room in a temporary database for objects up to
+//			 LastObjectID, without adding them to it, so that it
+//			 doesn't have to be grown repeatedly while it's
+//			 rebuilt. Does nothing to permanent databases, whose
+//			 files must always be exactly the right length.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::Reserve(int64_t LastObjectID)
+{
+#ifdef REFCOUNT_USE_MMAP
+	if (mIsTemporaryFile && LastObjectID > mEntriesInFile)
+	{
+		ResizeFile(LastObjectID);
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::AddReferences(
+//			 const std::vector<int64_t> &)
+//		Purpose: Add one reference to each object in the list, such
+//			 as all the entries in a directory. Objects which
+//			 appear more than once get one reference for each
+//			 time.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::AddReferences(
+	const std::vector<int64_t>& rObjectIDs)
+{
+	if (rObjectIDs.empty())
+	{
+		return;
+	}
+
+	// Extend the database once for the whole list, rather than once
+	// for each new object. New objects start with no references.
+	int64_t LastObjectID = *std::max_element(rObjectIDs.begin(),
+		rObjectIDs.end());
+
+	if (LastObjectID > mLastObjectID && !mIsTemporaryFile)
+	{
+		RefreshSize();
+	}
+
+	if (LastObjectID > mLastObjectID)
+	{
+		Extend(LastObjectID);
+	}
+
+	for (std::vector<int64_t>::const_iterator i = rObjectIDs.begin();
+		i != rObjectIDs.end(); i++)
+	{
+		ASSERT(*i >= BACKUPSTORE_ROOT_DIRECTORY_ID);
+		WriteEntry(*i, ReadEntry(*i) + 1);
+	}
+
+	mIsModified = true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::ReadEntry(int64_t)
+//		Purpose: Read the entry for an object which is known to be
+//			 in the database
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreRefCountDatabase::refcount_t
+BackupStoreRefCountDatabase::ReadEntry(int64_t ObjectID) const
+{
+	ASSERT(ObjectID >= BACKUPSTORE_ROOT_DIRECTORY_ID);
+	ASSERT(ObjectID <= mLastObjectID);
+
+	IOStream::pos_type offset = GetOffset(ObjectID);
+	refcount_t refcount;
+
+#ifdef REFCOUNT_USE_MMAP
+	::memcpy(&refcount, mpMapping + offset, sizeof(refcount));
+#else
+	mapDatabaseFile->Seek(offset, SEEK_SET);
+
+	if (mapDatabaseFile->Read(&refcount, sizeof(refcount)) !=
+		sizeof(refcount))
+	{
+		THROW_FILE_ERROR("Failed to read refcount database: "
+			"short read at offset " << offset, mFilename,
+			BackupStoreException, CouldNotLoadStoreInfo);
+	}
+#endif
+
+	return ntohl(refcount);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::WriteEntry(int64_t,
+//			 refcount_t)
+//		Purpose: Write the entry for an object which is known to be
+//			 in the database
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::WriteEntry(int64_t ObjectID,
+	refcount_t NewRefCount)
+{
+	ASSERT(ObjectID >= BACKUPSTORE_ROOT_DIRECTORY_ID);
+	ASSERT(ObjectID <= mLastObjectID);
+
+	if (mReadOnly)
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, Internal,
+			"Cannot modify a read-only reference count database");
+	}
+
+	IOStream::pos_type offset = GetOffset(ObjectID);
+	refcount_t RefCountNetOrder = htonl(NewRefCount);
+
+#ifdef REFCOUNT_USE_MMAP
+	::memcpy(mpMapping + offset, &RefCountNetOrder,
+		sizeof(RefCountNetOrder));
+#else
+	mapDatabaseFile->Seek(offset, SEEK_SET);
+	mapDatabaseFile->Write(&RefCountNetOrder, sizeof(RefCountNetOrder));
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::Extend(int64_t)
+//		Purpose: Add objects up to LastObjectID to the database,
+//			 with no references.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::Extend(int64_t LastObjectID)
+{
+	ASSERT(LastObjectID > mLastObjectID);
+
+	if (mReadOnly)
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, Internal,
+			"Cannot modify a read-only reference count database");
+	}
+
+	if (LastObjectID > mEntriesInFile)
+	{
+		int64_t NewEntriesInFile = LastObjectID;
+
+#ifdef REFCOUNT_USE_MMAP
+		// Other processes find the number of objects in a permanent
+		// database from the length of its file, so that must be exact,
+		// but a temporary one can be grown in large steps to avoid
+		// resizing and remapping it for every new object.
+		if (mIsTemporaryFile)
+		{
+			NewEntriesInFile = std::max(LastObjectID, mEntriesInFile +
+				std::max(mEntriesInFile,
+					(int64_t)REFCOUNT_MIN_GROWTH_ENTRIES));
+		}
+#endif
+
+		ResizeFile(NewEntriesInFile);
+	}
+
+	mLastObjectID = LastObjectID;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::ResizeFile(int64_t)
+//		Purpose: Set the length of the file to hold NumEntries
+//			 entries. Any new entries read as zero.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::ResizeFile(int64_t NumEntries)
+{
+	if (NumEntries == mEntriesInFile)
+	{
+		return;
+	}
+
+#ifdef REFCOUNT_USE_MMAP
+	if (::ftruncate(mapDatabaseFile->GetOSFileHandle(),
+		GetOffset(NumEntries + 1)) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to resize reference count database",
+			mFilename, CommonException, OSFileError);
+	}
+
+	mEntriesInFile = NumEntries;
+	Map(NumEntries);
+#else
+	// The file is never longer than the database here, so it only
+	// grows. Writing the last entry extends it, and the gap before
+	// that reads back as zeros.
+	ASSERT(NumEntries > mEntriesInFile);
+	refcount_t zero = 0;
+	mapDatabaseFile->Seek(GetOffset(NumEntries), SEEK_SET);
+	mapDatabaseFile->Write(&zero, sizeof(zero));
+	mEntriesInFile = NumEntries;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::RefreshSize()
+//		Purpose: Find the number of objects in a permanent database
+//			 from the length of its file, which another process
+//			 may have extended.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::RefreshSize() const
+{
+	mLastObjectID = (GetSize() - sizeof(refcount_StreamFormat)) /
+		sizeof(refcount_t);
+	mEntriesInFile = mLastObjectID;
+	Map(mLastObjectID);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::Map(int64_t)
+//		Purpose: Make sure that the first NumEntries entries are
+//			 mapped into memory. Does nothing on platforms
+//			 without mmap().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::Map(int64_t NumEntries) const
+{
+#ifdef REFCOUNT_USE_MMAP
+	size_t needed = GetOffset(NumEntries + 1);
+	if (mpMapping != 0 && mMappingSize >= needed)
+	{
+		return;
+	}
+
+	// Map more than is needed, so that a growing database doesn't have
+	// to be remapped every time. It's fine for the mapping to extend
+	// beyond the end of the file, so long as nothing touches the pages
+	// there.
+	size_t size = std::max(needed, mMappingSize * 2);
+	size = ((size + REFCOUNT_MAPPING_GRANULARITY - 1) /
+		REFCOUNT_MAPPING_GRANULARITY) * REFCOUNT_MAPPING_GRANULARITY;
+
+	Unmap();
+
+	void *pMapping = ::mmap(NULL, size,
+		mReadOnly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED,
+		mapDatabaseFile->GetOSFileHandle(), 0);
+	if (pMapping == MAP_FAILED)
+	{
+		THROW_SYS_FILE_ERROR("Failed to map reference count database "
+			"into memory", mFilename, CommonException, OSFileError);
+	}
+
+	mpMapping = (uint8_t *)pMapping;
+	mMappingSize = size;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::Unmap()
+//		Purpose: Remove the mapping of the file, if any
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::Unmap() const
+{
+#ifdef REFCOUNT_USE_MMAP
+	if (mpMapping != 0)
+	{
+		::munmap(mpMapping, mMappingSize);
+		mpMapping = 0;
+		mMappingSize = 0;
+	}
+#endif
+}
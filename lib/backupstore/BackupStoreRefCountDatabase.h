@@ -90,6 +90,10 @@ public:
 	int ReportChangesTo(BackupStoreRefCountDatabase& rOldRefs,
 		int64_t ignore_object_id = 0);
 
+	// Bulk functions, for rebuilding a whole database at once
+	void Reserve(int64_t LastObjectID);
+	void AddReferences(const std::vector<int64_t>& rObjectIDs);
+
 private:
 	static std::string GetFilename(const BackupStoreAccountDatabase::Entry&
 		rAccount, bool Temporary);
@@ -109,6 +113,18 @@ private:
 			sizeof(refcount_StreamFormat);
 	}
 	void SetRefCount(int64_t ObjectID, refcount_t NewRefCount);
+
+	// Where the platform supports it, the entries are accessed through
+	// a shared memory mapping of the file instead of a seek and a
+	// system call each.
+	refcount_t ReadEntry(int64_t ObjectID) const;
+	void WriteEntry(int64_t ObjectID, refcount_t NewRefCount);
+	void Extend(int64_t LastObjectID);
+	void ResizeFile(int64_t NumEntries);
+	void RefreshSize() const;
+	void Map(int64_t NumEntries) const;
+	void Unmap() const;
+	void Close();
 	
 	// Location information
 	BackupStoreAccountDatabase::Entry mAccount;
@@ -118,6 +134,14 @@ private:
 	bool mIsTemporaryFile;
 	std::auto_ptr<FileStream> mapDatabaseFile;
 
+	// The last object ID in the database. A temporary database file may
+	// be longer than this, as it's grown in large steps while it's
+	// rebuilt, and truncated to this length on Commit().
+	mutable int64_t mLastObjectID;
+	mutable int64_t mEntriesInFile;
+	mutable uint8_t *mpMapping;
+	mutable size_t mMappingSize;
+
 	bool NeedsCommitOrDiscard()
 	{
 		return mapDatabaseFile.get() && mIsModified && mIsTemporaryFile;
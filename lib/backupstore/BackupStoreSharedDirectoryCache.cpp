@@ -0,0 +1,153 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreSharedDirectoryCache.cpp
+//		Purpose: Cache of directory objects read from the store,
+//			 shared by all the connections handled by a process
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include "BackupStoreSharedDirectoryCache.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreSharedDirectoryCache::BackupStoreSharedDirectoryCache(int64_t)
+//		Purpose: Constructor, taking the maximum total size of the
+//			 directories to keep, in bytes
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreSharedDirectoryCache::BackupStoreSharedDirectoryCache(int64_t MaxSize)
+: mSize(0),
+  mMaxSize(MaxSize),
+  mHits(0),
+  mMisses(0)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreSharedDirectoryCache::Get(int, const std::string &, int64_t, std::string &, int64_t &)
+//		Purpose: Copy out the stored form of a directory, and its
+//			 disc usage in blocks, if it's in the cache with the
+//			 given revision ID. Returns false otherwise.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreSharedDirectoryCache::Get(int DiscSet,
+	const std::string &rFilename, int64_t RevisionID,
+	std::string &rDataOut, int64_t &rSizeInBlocksOut)
+{
+	MutexLock lock(mMutex);
+
+	Cache_t::iterator i(mCache.find(Key_t(DiscSet, rFilename)));
+	if(i == mCache.end())
+	{
+		mMisses++;
+		return false;
+	}
+
+	if(i->second.mRevisionID != RevisionID)
+	{
+		// Changed on disc since it was cached
+		Remove(i);
+		mMisses++;
+		return false;
+	}
+
+	mLRU.splice(mLRU.begin(), mLRU, i->second.mLRUPosition);
+	rDataOut = i->second.mData;
+	rSizeInBlocksOut = i->second.mSizeInBlocks;
+	mHits++;
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreSharedDirectoryCache::Put(int, const std::string &, int64_t, const std::string &, int64_t)
+//		Purpose: Cache the stored form of a directory just read
+//			 from disc, replacing any older version
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreSharedDirectoryCache::Put(int DiscSet,
+	const std::string &rFilename, int64_t RevisionID,
+	const std::string &rData, int64_t SizeInBlocks)
+{
+	if((int64_t)rData.size() > mMaxSize)
+	{
+		return;
+	}
+
+	MutexLock lock(mMutex);
+	Key_t key(DiscSet, rFilename);
+
+	Cache_t::iterator i(mCache.find(key));
+	if(i != mCache.end())
+	{
+		Remove(i);
+	}
+
+	mLRU.push_front(key);
+	try
+	{
+		Entry &rEntry(mCache[key]);
+		rEntry.mRevisionID = RevisionID;
+		rEntry.mData = rData;
+		rEntry.mSizeInBlocks = SizeInBlocks;
+		rEntry.mLRUPosition = mLRU.begin();
+	}
+	catch(...)
+	{
+		mCache.erase(key);
+		mLRU.pop_front();
+		throw;
+	}
+	mSize += rData.size();
+
+	while(mSize > mMaxSize)
+	{
+		Remove(mCache.find(mLRU.back()));
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreSharedDirectoryCache::Remove(Cache_t::iterator)
+//		Purpose: Drop an entry. The mutex must be held.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreSharedDirectoryCache::Remove(Cache_t::iterator i)
+{
+	mSize -= i->second.mData.size();
+	mLRU.erase(i->second.mLRUPosition);
+	mCache.erase(i);
+}
+
+int64_t BackupStoreSharedDirectoryCache::GetSize()
+{
+	MutexLock lock(mMutex);
+	return mSize;
+}
+
+int64_t BackupStoreSharedDirectoryCache::GetHits()
+{
+	MutexLock lock(mMutex);
+	return mHits;
+}
+
+int64_t BackupStoreSharedDirectoryCache::GetMisses()
+{
+	MutexLock lock(mMutex);
+	return mMisses;
+}
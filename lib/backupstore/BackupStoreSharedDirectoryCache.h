@@ -0,0 +1,77 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreSharedDirectoryCache.h
+//		Purpose: Cache of directory objects read from the store,
+//			 shared by all the connections handled by a process
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTORESHAREDDIRECTORYCACHE__H
+#define BACKUPSTORESHAREDDIRECTORYCACHE__H
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "Thread.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreSharedDirectoryCache
+//		Purpose: Keeps the stored form of recently read directories,
+//			 so that another connection which needs the same
+//			 directory can parse it from memory instead of reading
+//			 it from every disc in the RAID set. Entries are only
+//			 returned for the revision ID they were stored with,
+//			 so any change to the file on disc makes them stale.
+//			 The least recently used are dropped first. Safe to
+//			 use from several threads.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreSharedDirectoryCache
+{
+public:
+	BackupStoreSharedDirectoryCache(int64_t MaxSize);
+	~BackupStoreSharedDirectoryCache() { }
+private:
+	// no copying
+	BackupStoreSharedDirectoryCache(const BackupStoreSharedDirectoryCache &);
+	BackupStoreSharedDirectoryCache &operator=(
+		const BackupStoreSharedDirectoryCache &);
+public:
+	bool Get(int DiscSet, const std::string &rFilename, int64_t RevisionID,
+		std::string &rDataOut, int64_t &rSizeInBlocksOut);
+	void Put(int DiscSet, const std::string &rFilename, int64_t RevisionID,
+		const std::string &rData, int64_t SizeInBlocks);
+
+	int64_t GetSize();
+	int64_t GetHits();
+	int64_t GetMisses();
+
+private:
+	typedef std::pair<int, std::string> Key_t;
+	typedef struct
+	{
+		int64_t mRevisionID;
+		std::string mData;
+		int64_t mSizeInBlocks;
+		std::list<Key_t>::iterator mLRUPosition;
+	} Entry;
+	typedef std::map<Key_t, Entry> Cache_t;
+
+	void Remove(Cache_t::iterator i);
+
+	Mutex mMutex;
+	Cache_t mCache;
+	std::list<Key_t> mLRU; // most recently used first
+	int64_t mSize;
+	int64_t mMaxSize;
+	int64_t mHits;
+	int64_t mMisses;
+};
+
+#endif // BACKUPSTORESHAREDDIRECTORYCACHE__H
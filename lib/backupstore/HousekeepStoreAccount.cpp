@@ -20,10 +20,13 @@
 #include "BackupStoreDirectory.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreInfo.h"
+#include "BackupStoreJournal.h"
+#include "BackupStorePackFile.h"
 #include "BackupStoreRefCountDatabase.h"
 #include "BufferedStream.h"
 #include "HousekeepStoreAccount.h"
 #include "NamedLock.h"
+#include "RaidFileController.h"
 #include "RaidFileRead.h"
 #include "RaidFileWrite.h"
 #include "StoreStructure.h"
@@ -33,6 +36,10 @@
 // check every 32 directories scanned/files deleted
 #define POLL_INTERPROCESS_MSG_CHECK_FREQUENCY	32
 
+// pack the small objects found so far when there are this many, to save
+// memory
+#define PACK_OBJECTS_BATCH_SIZE			65536
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -60,8 +67,13 @@ HousekeepStoreAccount::HousekeepStoreAccount(int AccountID,
 	  mBlocksInOldFilesDelta(0),
 	  mBlocksInDeletedFilesDelta(0),
 	  mBlocksInDirectoriesDelta(0),
+	  mBlocksReclaimed(0),
 	  mFilesDeleted(0),
 	  mEmptyDirectoriesDeleted(0),
+	  mPackObjectsSmallerThan(0),
+	  mObjectsPacked(0),
+	  mTimeBetweenFullScans(0),
+	  mIncremental(false),
 	  mCountUntilNextInterprocessMsgCheck(POLL_INTERPROCESS_MSG_CHECK_FREQUENCY)
 {
 	std::ostringstream tag;
@@ -79,7 +91,7 @@ HousekeepStoreAccount::HousekeepStoreAccount(int AccountID,
 // --------------------------------------------------------------------------
 HousekeepStoreAccount::~HousekeepStoreAccount()
 {
-	if(mapNewRefs.get())
+	if(mapNewRefs.get() && mapNewRefs->mIsTemporaryFile)
 	{
 		// Discard() can throw exception, but destructors aren't supposed to do that, so
 		// just catch and log them.
@@ -157,12 +169,57 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 	}
 
 	BackupStoreAccountDatabase::Entry account(mAccountID, mStoreDiscSet);
-	mapNewRefs = BackupStoreRefCountDatabase::Create(account);
+
+	// Only the directories in the journal need to be scanned, if it
+	// accounts for all the changes in the space used since the last full
+	// scan, and that wasn't too long ago.
+	mIncremental = false;
+	if(mTimeBetweenFullScans > 0)
+	{
+		mapJournal = BackupStoreJournal::Load(account);
+		box_time_t now = GetCurrentBoxTime();
+		if(mapJournal.get() == 0)
+		{
+			BOX_INFO("Account " << BOX_FORMAT_ACCOUNT(mAccountID) <<
+				" has no journal, scanning all directories");
+		}
+		else if(mapJournal->GetBlocksUsed() +
+			mapJournal->GetBlocksUsedDelta() != info->GetBlocksUsed())
+		{
+			BOX_NOTICE("Journal of account " <<
+				BOX_FORMAT_ACCOUNT(mAccountID) << " doesn't "
+				"match the space used, scanning all directories");
+			mapJournal.reset();
+		}
+		else if(now >= mapJournal->GetLastFullScan() &&
+			now - mapJournal->GetLastFullScan() < mTimeBetweenFullScans)
+		{
+			mIncremental = true;
+		}
+	}
+	else
+	{
+		// Nothing would use it
+		BackupStoreJournal::Remove(account);
+	}
+
+	if(mIncremental)
+	{
+		// The reference counts are only rebuilt by a full scan, and
+		// are kept up to date by the store in between.
+		mapNewRefs = BackupStoreRefCountDatabase::Load(account, false);
+	}
+	else
+	{
+		mapNewRefs = BackupStoreRefCountDatabase::Create(account);
+		mapNewRefs->Reserve(info->GetLastObjectIDUsed());
+	}
 
 	// Scan the directory for potential things to delete
 	// This will also remove eligible items marked with RemoveASAP
-	bool continueHousekeeping = ScanDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID,
-		*info);
+	bool continueHousekeeping = mIncremental
+		? ScanJournalDirectories(*info)
+		: ScanDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID, *info);
 
 	if(!continueHousekeeping)
 	{
@@ -191,6 +248,7 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 	// RemoveASAP flagged files deleted during the initial scan.
 	// keep removeASAPBlocksUsedDelta for reporting
 	int64_t removeASAPBlocksUsedDelta = mBlocksUsedDelta;
+	mBlocksReclaimed = 0 - removeASAPBlocksUsedDelta;
 	mBlocksUsedDelta = 0;
 	mBlocksInOldFilesDelta = 0;
 	mBlocksInDeletedFilesDelta = 0;
@@ -205,8 +263,15 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 
 	if(!continueHousekeeping)
 	{
-		mapNewRefs->Discard();
+		// Objects removed during the scan must still be dropped
+		// from their packs
+		UpdatePacks(false /* don't add objects */);
+		if(!mIncremental)
+		{
+			mapNewRefs->Discard();
+		}
 		info->Save();
+		SaveJournal(account, *info, false);
 		return false;
 	}
 
@@ -220,18 +285,21 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 	// apOldRefs before we delete any files, because that will also change
 	// the reference count in a way that's not an error.
 
-	try
+	if(!mIncremental)
 	{
-		std::auto_ptr<BackupStoreRefCountDatabase> apOldRefs =
-			BackupStoreRefCountDatabase::Load(account, false);
-		mErrorCount += mapNewRefs->ReportChangesTo(*apOldRefs);
-	}
-	catch(BoxException &e)
-	{
-		BOX_WARNING("Reference count database was missing or "
-			"corrupted during housekeeping, cannot check it for "
-			"errors.");
-		mErrorCount++;
+		try
+		{
+			std::auto_ptr<BackupStoreRefCountDatabase> apOldRefs =
+				BackupStoreRefCountDatabase::Load(account, false);
+			mErrorCount += mapNewRefs->ReportChangesTo(*apOldRefs);
+		}
+		catch(BoxException &e)
+		{
+			BOX_WARNING("Reference count database was missing or "
+				"corrupted during housekeeping, cannot check it for "
+				"errors.");
+			mErrorCount++;
+		}
 	}
 
 	// Go and delete items from the accounts
@@ -244,6 +312,19 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 		deleteInterrupted = DeleteEmptyDirectories(*info);
 	}
 
+	// Pack the small objects found by the scan, unless interrupted, and
+	// drop the deleted ones from their packs
+	if(UpdatePacks(!deleteInterrupted))
+	{
+		deleteInterrupted = true;
+	}
+	if(mObjectsPacked > 0)
+	{
+		BOX_INFO("Housekeeping on account " <<
+			BOX_FORMAT_ACCOUNT(mAccountID) << " packed " <<
+			mObjectsPacked << " small objects");
+	}
+
 	// Log deletion if anything was deleted
 	if(mFilesDeleted > 0 || mEmptyDirectoriesDeleted > 0)
 	{
@@ -277,6 +358,7 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 	}
 
 	// Update the usage counts in the store
+	mBlocksReclaimed = 0 - (mBlocksUsedDelta + removeASAPBlocksUsedDelta);
 	info->ChangeBlocksUsed(mBlocksUsedDelta);
 	info->ChangeBlocksInOldFiles(mBlocksInOldFilesDelta);
 	info->ChangeBlocksInDeletedFiles(mBlocksInDeletedFilesDelta);
@@ -286,19 +368,163 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 	info->Save();
 
 	// force file to be saved and closed before releasing the lock below
-	mapNewRefs->Commit();
+	if(!mIncremental)
+	{
+		mapNewRefs->Commit();
+	}
 	mapNewRefs.reset();
 
+	// Start a new journal for the store to add to
+	SaveJournal(account, *info, true);
+
 	// Explicity release the lock (would happen automatically on
 	// going out of scope, included for code clarity)
 	writeLock.ReleaseLock();
 
-	BOX_TRACE("Finished housekeeping on account " <<
-		BOX_FORMAT_ACCOUNT(mAccountID));
+	BOX_TRACE("Finished " << (mIncremental ? "incremental " : "") <<
+		"housekeeping on account " << BOX_FORMAT_ACCOUNT(mAccountID));
 	return true;
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepStoreAccount::ScanJournalDirectories(BackupStoreInfo &)
+//		Purpose: Private. Scan only the directories which the
+//			 journal says have changed since the last run, and
+//			 if over the soft limit, those which had old or
+//			 deleted files in them. Returns true if housekeeping
+//			 should continue.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool HousekeepStoreAccount::ScanJournalDirectories(
+	BackupStoreInfo& rBackupStoreInfo)
+{
+	const std::vector<journal_Entry> &rentries(mapJournal->GetEntries());
+	for(std::vector<journal_Entry>::const_iterator i = rentries.begin();
+		i != rentries.end(); ++i)
+	{
+		mJournalObjects.insert(i->mObjectID);
+		if(i->mType != JOURNAL_ENTRY_CANDIDATE || mDeletionSizeTarget > 0)
+		{
+			mDirectoriesToScan.insert(i->mDirectoryID);
+		}
+	}
+
+	BOX_TRACE("Journal has " << rentries.size() << " entries, scanning " <<
+		mDirectoriesToScan.size() << " directories");
+
+	while(!mDirectoriesToScan.empty())
+	{
+		int64_t dirID = *(mDirectoriesToScan.begin());
+		mDirectoriesToScan.erase(mDirectoriesToScan.begin());
+		if(!mDirectoriesScanned.insert(dirID).second)
+		{
+			continue;
+		}
+
+		// It might have been removed since it was added to the
+		// journal
+		std::string dirFilename;
+		MakeObjectFilename(dirID, dirFilename);
+		if(!RaidFileRead::FileExists(mStoreDiscSet, dirFilename))
+		{
+			continue;
+		}
+
+		if(!ScanDirectory(dirID, rBackupStoreInfo))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepStoreAccount::SaveJournal(const BackupStoreAccountDatabase::Entry &, const BackupStoreInfo &, bool)
+//		Purpose: Private. Replace the journal with one listing the
+//			 directories which the next run will need to look at,
+//			 starting from the space used now. If the scan wasn't
+//			 complete, the entries in the old journal are kept, or
+//			 if it was a full scan, the journal is removed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void HousekeepStoreAccount::SaveJournal(
+	const BackupStoreAccountDatabase::Entry& rAccount,
+	const BackupStoreInfo& rBackupStoreInfo, bool ScanComplete)
+{
+	if(mTimeBetweenFullScans <= 0)
+	{
+		return;
+	}
+
+	if(!ScanComplete && !mIncremental)
+	{
+		BackupStoreJournal::Remove(rAccount);
+		return;
+	}
+
+	std::vector<journal_Entry> entries;
+	journal_Entry entry;
+	entry.mBlocksUsedDelta = 0;
+
+	if(mIncremental)
+	{
+		const std::vector<journal_Entry> &rold(mapJournal->GetEntries());
+		for(std::vector<journal_Entry>::const_iterator
+			i = rold.begin(); i != rold.end(); ++i)
+		{
+			if(!ScanComplete)
+			{
+				// Still to do, but the change in space used
+				// has been accounted for now
+				entry = *i;
+				entry.mBlocksUsedDelta = 0;
+				entries.push_back(entry);
+			}
+			else if(i->mType == JOURNAL_ENTRY_CANDIDATE &&
+				mDirectoriesScanned.find(i->mDirectoryID) ==
+				mDirectoriesScanned.end())
+			{
+				// Not looked at this time, so still a candidate
+				mCandidateDirectories.insert(i->mDirectoryID);
+			}
+		}
+	}
+
+	entry.mType = JOURNAL_ENTRY_CANDIDATE;
+	for(std::set<int64_t>::const_iterator i = mCandidateDirectories.begin();
+		i != mCandidateDirectories.end(); ++i)
+	{
+		entry.mObjectID = *i;
+		entry.mDirectoryID = *i;
+		entries.push_back(entry);
+	}
+
+	// Empty directories which weren't removed because deleting was
+	// interrupted need to be looked at again
+	entry.mType = JOURNAL_ENTRY_DIRECTORY;
+	for(std::vector<int64_t>::const_iterator i = mEmptyDirectories.begin();
+		i != mEmptyDirectories.end(); ++i)
+	{
+		entry.mObjectID = *i;
+		entry.mDirectoryID = *i;
+		entries.push_back(entry);
+	}
+
+	BackupStoreJournal::Create(rAccount,
+		mIncremental ? mapJournal->GetLastFullScan() : GetCurrentBoxTime(),
+		rBackupStoreInfo.GetBlocksUsed(), entries);
+}
+
+
 
 // --------------------------------------------------------------------------
 //
@@ -377,11 +603,19 @@ bool HousekeepStoreAccount::ScanDirectory(int64_t ObjectID,
 	{
 		BackupStoreDirectory::Iterator i(dir);
 		BackupStoreDirectory::Entry *en = 0;
+		std::vector<int64_t> referenced;
 
 		while((en = i.Next()) != 0)
 		{
 			// This directory references this object
-			mapNewRefs->AddReference(en->GetObjectID());
+			referenced.push_back(en->GetObjectID());
+		}
+
+		// Unchanged by an incremental scan, which doesn't see
+		// all the references
+		if(!mIncremental)
+		{
+			mapNewRefs->AddReferences(referenced);
 		}
 	}
 
@@ -417,6 +651,16 @@ bool HousekeepStoreAccount::ScanDirectory(int64_t ObjectID,
 		} while(deletedSomething);
 	}
 
+	// Objects smaller than this many blocks are packed
+	int64_t packBlocks = 0;
+	if(mPackObjectsSmallerThan > 0)
+	{
+		RaidFileController &rcontroller(
+			RaidFileController::GetController());
+		int blockSize = rcontroller.GetDiscSet(mStoreDiscSet).GetBlockSize();
+		packBlocks = (mPackObjectsSmallerThan + blockSize - 1) / blockSize;
+	}
+
 	// BLOCK
 	{
 		// Add files to the list of potential deletions
@@ -439,6 +683,15 @@ bool HousekeepStoreAccount::ScanDirectory(int64_t ObjectID,
 			if(en->IsOld()) mBlocksInOldFiles += enSizeInBlocks;
 			if(en->IsDeleted()) mBlocksInDeletedFiles += enSizeInBlocks;
 
+			// Small files which aren't part of a patch chain can be
+			// packed. Patches are rewritten when they're combined.
+			if(enSizeInBlocks < packBlocks &&
+				en->GetDependsNewer() == 0 &&
+				en->GetDependsOlder() == 0)
+			{
+				mObjectsToPack.insert(en->GetObjectID());
+			}
+
 			// Work out ages of this version from the last mark
 			int32_t enVersionAge = 0;
 			std::map<version_t, int32_t>::iterator enVersionAgeI(
@@ -459,6 +712,8 @@ bool HousekeepStoreAccount::ScanDirectory(int64_t ObjectID,
 			// Potentially add it to the list if it's deleted, if it's an old version or deleted
 			if(en->IsOld() || en->IsDeleted())
 			{
+				mCandidateDirectories.insert(ObjectID);
+
 				// Is deleted / old version.
 				DelEn d;
 				d.mObjectID = en->GetObjectID();
@@ -532,6 +787,13 @@ bool HousekeepStoreAccount::ScanDirectory(int64_t ObjectID,
 		}
 	}
 
+	if(mObjectsToPack.size() >= PACK_OBJECTS_BATCH_SIZE &&
+		UpdatePacks(true /* add objects */))
+	{
+		// Halting operation
+		return false;
+	}
+
 	// Recurse into subdirectories
 	{
 		BackupStoreDirectory::Iterator i(dir);
@@ -540,6 +802,18 @@ bool HousekeepStoreAccount::ScanDirectory(int64_t ObjectID,
 		{
 			ASSERT(en->IsDir());
 
+			if(mIncremental)
+			{
+				// Only subdirectories deleted since the last
+				// run might have anything new to remove
+				if(en->IsDeleted() && mJournalObjects.find(
+					en->GetObjectID()) != mJournalObjects.end())
+				{
+					mDirectoriesToScan.insert(en->GetObjectID());
+				}
+				continue;
+			}
+
 			if(!ScanDirectory(en->GetObjectID(), rBackupStoreInfo))
 			{
 				// Halting operation
@@ -803,12 +1077,14 @@ BackupStoreRefCountDatabase::refcount_t HousekeepStoreAccount::DeleteFile(
 			std::string objFilenameOlder;
 			MakeObjectFilename(pentry->GetDependsOlder(), objFilenameOlder);
 			// Open it twice (it's the diff)
-			std::auto_ptr<RaidFileRead> pdiff(RaidFileRead::Open(mStoreDiscSet, objFilenameOlder));
-			std::auto_ptr<RaidFileRead> pdiff2(RaidFileRead::Open(mStoreDiscSet, objFilenameOlder));
-			// Open this file
-			std::string objFilename;
-			MakeObjectFilename(ObjectID, objFilename);
-			std::auto_ptr<RaidFileRead> pobjectBeingDeleted(RaidFileRead::Open(mStoreDiscSet, objFilename));
+			std::auto_ptr<IOStream> pdiff(BackupStorePackFile::OpenObject(
+				mStoreDiscSet, mStoreRoot, pentry->GetDependsOlder()));
+			std::auto_ptr<IOStream> pdiff2(BackupStorePackFile::OpenObject(
+				mStoreDiscSet, mStoreRoot, pentry->GetDependsOlder()));
+			// Open this file, which might be in a pack
+			std::auto_ptr<IOStream> pobjectBeingDeleted(
+				BackupStorePackFile::OpenObject(mStoreDiscSet,
+					mStoreRoot, ObjectID));
 			// And open a write file to overwrite the other directory entry
 			padjustedEntry.reset(new RaidFileWrite(mStoreDiscSet,
 				objFilenameOlder, mapNewRefs->GetRefCount(ObjectID)));
@@ -886,8 +1162,16 @@ BackupStoreRefCountDatabase::refcount_t HousekeepStoreAccount::DeleteFile(
 		BOX_FORMAT_OBJECTID(ObjectID));
 	std::string objFilename;
 	MakeObjectFilename(ObjectID, objFilename);
-	RaidFileWrite del(mStoreDiscSet, objFilename, mapNewRefs->GetRefCount(ObjectID));
-	del.Delete();
+	if(RaidFileRead::FileExists(mStoreDiscSet, objFilename))
+	{
+		RaidFileWrite del(mStoreDiscSet, objFilename,
+			mapNewRefs->GetRefCount(ObjectID));
+		del.Delete();
+	}
+	// There might be a copy in a pack too. Packs are rewritten once
+	// for all the objects deleted from them, at the end.
+	mObjectsToUnpack.insert(ObjectID);
+	mObjectsToPack.erase(ObjectID);
 
 	// Adjust counts for the file
 	++mFilesDeleted;
@@ -988,6 +1272,119 @@ void HousekeepStoreAccount::UpdateDirectorySize(
 	writeDir.Commit(BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY);
 }
 
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepStoreAccount::UpdatePacks(bool)
+//		Purpose: Rewrite the pack of each directory of objects which
+//			 has had objects deleted from it, or, if AddObjects is
+//			 true, which has small objects found by the scan which
+//			 aren't in it yet. Only adding objects can be
+//			 interrupted, as deleted objects must not be left in
+//			 packs. Returns true if it was interrupted.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool HousekeepStoreAccount::UpdatePacks(bool AddObjects)
+{
+	// Group the objects by the directory of objects which they're in
+	std::map<int64_t, std::set<int64_t> > toAdd, toRemove;
+	for(std::set<int64_t>::const_iterator i(mObjectsToUnpack.begin());
+		i != mObjectsToUnpack.end(); ++i)
+	{
+		toRemove[*i & ~(int64_t)STORE_ID_SEGMENT_MASK].insert(*i);
+	}
+	if(AddObjects)
+	{
+		for(std::set<int64_t>::const_iterator i(mObjectsToPack.begin());
+			i != mObjectsToPack.end(); ++i)
+		{
+			toAdd[*i & ~(int64_t)STORE_ID_SEGMENT_MASK].insert(*i);
+		}
+	}
+	mObjectsToUnpack.clear();
+	mObjectsToPack.clear();
+
+	std::set<int64_t> dirs;
+	for(std::map<int64_t, std::set<int64_t> >::const_iterator
+		i(toAdd.begin()); i != toAdd.end(); ++i)
+	{
+		dirs.insert(i->first);
+	}
+	for(std::map<int64_t, std::set<int64_t> >::const_iterator
+		i(toRemove.begin()); i != toRemove.end(); ++i)
+	{
+		dirs.insert(i->first);
+	}
+
+	bool interrupted = false;
+	for(std::set<int64_t>::const_iterator d(dirs.begin()); d != dirs.end();
+		++d)
+	{
+#ifndef WIN32
+		if(!interrupted && (--mCountUntilNextInterprocessMsgCheck) <= 0)
+		{
+			mCountUntilNextInterprocessMsgCheck = POLL_INTERPROCESS_MSG_CHECK_FREQUENCY;
+			// Check for having to stop
+			if(mpHousekeepingCallback && mpHousekeepingCallback->CheckForInterProcessMsg(mAccountID))	// include account ID here as the specified account is now locked
+			{
+				// Finish removing deleted objects, but
+				// don't pack any more
+				interrupted = true;
+			}
+		}
+#endif
+
+		std::set<int64_t> add, remove;
+		if(!interrupted && toAdd.find(*d) != toAdd.end())
+		{
+			add = toAdd[*d];
+		}
+		if(toRemove.find(*d) != toRemove.end())
+		{
+			remove = toRemove[*d];
+		}
+
+		try
+		{
+			// Objects which are already packed are found by
+			// every full scan, but don't need the pack rewriting
+			if(!add.empty())
+			{
+				std::string packFilename;
+				StoreStructure::MakePackFilename(*d, mStoreRoot,
+					mStoreDiscSet, packFilename);
+				std::vector<pack_Entry> index;
+				BackupStorePackFile::ReadIndex(mStoreDiscSet,
+					packFilename, index);
+				for(std::vector<pack_Entry>::const_iterator
+					i(index.begin()); i != index.end(); ++i)
+				{
+					add.erase(i->mObjectID);
+				}
+			}
+
+			if(!add.empty() || !remove.empty())
+			{
+				mObjectsPacked += BackupStorePackFile::UpdatePack(
+					mStoreDiscSet, mStoreRoot, *d, add, remove);
+			}
+		}
+		catch(BoxException &e)
+		{
+			// Leave it for bbstoreaccounts check to fix
+			BOX_ERROR("Failed to update pack of objects from " <<
+				BOX_FORMAT_OBJECTID(*d) << " in account " <<
+				BOX_FORMAT_ACCOUNT(mAccountID) << ": " <<
+				e.what());
+			++mErrorCount;
+		}
+	}
+
+	return interrupted;
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -14,7 +14,9 @@
 #include <set>
 #include <vector>
 
+#include "BackupStoreJournal.h"
 #include "BackupStoreRefCountDatabase.h"
+#include "BoxTime.h"
 
 class BackupStoreDirectory;
 
@@ -23,6 +25,10 @@ class HousekeepingCallback
 	public:
 	virtual ~HousekeepingCallback() {}
 	virtual bool CheckForInterProcessMsg(int AccountNum = 0, int MaximumWaitTime = 0) = 0;
+	// Wait for a message, returning true if housekeeping should stop
+	// altogether, and otherwise setting rLockWantedOut to the account
+	// which a client wants to lock, or zero
+	virtual bool ReadInterProcessMsg(int MaximumWaitTime, int &rLockWantedOut) = 0;
 };
 
 // --------------------------------------------------------------------------
@@ -42,12 +48,34 @@ public:
 	
 	bool DoHousekeeping(bool KeepTryingForever = false);
 	int GetErrorCount() { return mErrorCount; }
+
+	// How long to go between scans of the whole account. In between,
+	// only the directories in the account's journal are scanned. Zero
+	// (the default) scans the whole account every time.
+	void SetTimeBetweenFullScans(box_time_t Interval)
+	{
+		mTimeBetweenFullScans = Interval;
+	}
+	bool WasFullScan() { return !mIncremental; }
+	// Move files which use less space than this, in bytes, into the
+	// pack for their directory of objects. Zero (the default) leaves
+	// all objects where they are.
+	void SetPackObjectsSmallerThan(int64_t Bytes)
+	{
+		mPackObjectsSmallerThan = Bytes;
+	}
+	int64_t GetObjectsPacked() { return mObjectsPacked; }
+	// Including files removed because they were marked RemoveASAP
+	int64_t GetBlocksReclaimed() { return mBlocksReclaimed; }
 	
 private:
 	// utility functions
 	void MakeObjectFilename(int64_t ObjectID, std::string &rFilenameOut);
 
 	bool ScanDirectory(int64_t ObjectID, BackupStoreInfo& rBackupStoreInfo);
+	bool ScanJournalDirectories(BackupStoreInfo& rBackupStoreInfo);
+	void SaveJournal(const BackupStoreAccountDatabase::Entry& rAccount,
+		const BackupStoreInfo& rBackupStoreInfo, bool ScanComplete);
 	bool DeleteFiles(BackupStoreInfo& rBackupStoreInfo);
 	bool DeleteEmptyDirectories(BackupStoreInfo& rBackupStoreInfo);
 	void DeleteEmptyDirectory(int64_t dirId, std::vector<int64_t>& rToExamine,
@@ -59,6 +87,7 @@ private:
 		BackupStoreInfo& rBackupStoreInfo);
 	void UpdateDirectorySize(BackupStoreDirectory &rDirectory,
 		IOStream::pos_type new_size_in_blocks);
+	bool UpdatePacks(bool AddObjects);
 
 	typedef struct
 	{
@@ -104,12 +133,35 @@ private:
 	int64_t mBlocksInDeletedFilesDelta;
 	int64_t mBlocksInDirectoriesDelta;
 	
+	// Total reduction in blocks used, when finished
+	int64_t mBlocksReclaimed;
+
 	// Deletion count
 	int64_t mFilesDeleted;
 	int64_t mEmptyDirectoriesDeleted;
 
-	// New reference count list
+	// Small objects to move into packs, and objects deleted which might
+	// have to be removed from them
+	int64_t mPackObjectsSmallerThan;
+	std::set<int64_t> mObjectsToPack;
+	std::set<int64_t> mObjectsToUnpack;
+	int64_t mObjectsPacked;
+
+	// New reference count list, or the existing one if only the
+	// directories in the journal are being scanned
 	std::auto_ptr<BackupStoreRefCountDatabase> mapNewRefs;
+
+	// Incremental housekeeping
+	box_time_t mTimeBetweenFullScans;
+	bool mIncremental;
+	std::auto_ptr<BackupStoreJournal> mapJournal;
+	// Objects and directories named in the journal
+	std::set<int64_t> mJournalObjects;
+	std::set<int64_t> mDirectoriesToScan;
+	std::set<int64_t> mDirectoriesScanned;
+	// Directories with old or deleted files in them, which might need
+	// to be scanned again when the account is over its soft limit
+	std::set<int64_t> mCandidateDirectories;
 	
 	// Poll frequency
 	int mCountUntilNextInterprocessMsgCheck;
@@ -0,0 +1,556 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    HousekeepingScheduler.cpp
+//		Purpose: Run housekeeping on many accounts at once, in order
+//			 of need
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <algorithm>
+#include <memory>
+
+#include "BackupStoreInfo.h"
+#include "HousekeepingScheduler.h"
+#include "RaidFileController.h"
+
+#include "MemLeakFindOn.h"
+
+// How long the thread which started the workers waits for a message
+// before checking whether they have finished
+#define HOUSEKEEPING_POLL_INTERVAL_MS	1000
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    HousekeepingScheduler::Worker
+//		Purpose: Housekeeps accounts until there are none left
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class HousekeepingScheduler::Worker : public Thread
+{
+public:
+	Worker(HousekeepingScheduler &rScheduler)
+	: mrScheduler(rScheduler)
+	{
+	}
+
+protected:
+	virtual void Run()
+	{
+		mrScheduler.WorkerMain();
+	}
+
+private:
+	HousekeepingScheduler &mrScheduler;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    HousekeepingScheduler::WorkerCallback
+//		Purpose: Tells HousekeepStoreAccount when to stop, from the
+//			 messages which the scheduler has received
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class HousekeepingScheduler::WorkerCallback : public HousekeepingCallback
+{
+public:
+	WorkerCallback(HousekeepingScheduler &rScheduler)
+	: mrScheduler(rScheduler)
+	{
+	}
+
+	virtual bool CheckForInterProcessMsg(int AccountNum = 0,
+		int MaximumWaitTime = 0)
+	{
+		return mrScheduler.CheckForInterProcessMsg(AccountNum,
+			MaximumWaitTime);
+	}
+
+	virtual bool ReadInterProcessMsg(int MaximumWaitTime,
+		int &rLockWantedOut)
+	{
+		// Only the scheduler reads messages
+		rLockWantedOut = 0;
+		return false;
+	}
+
+private:
+	HousekeepingScheduler &mrScheduler;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::HousekeepingScheduler()
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+HousekeepingScheduler::HousekeepingScheduler()
+	: mNumWorkers(1),
+	  mTimeBetweenFullScans(0),
+	  mPackObjectsSmallerThan(0),
+	  mpCallback(0),
+	  mThreaded(false),
+	  mStopWanted(false),
+	  mWorkersRunning(0),
+	  mBytesReclaimedThisRun(0)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::~HousekeepingScheduler()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+HousekeepingScheduler::~HousekeepingScheduler()
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::AddAccount(int32_t, const std::string &, int)
+//		Purpose: Add an account to be housekept by the next Run(),
+//			 reading its store info to work out how urgent it is
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void HousekeepingScheduler::AddAccount(int32_t AccountID,
+	const std::string &rRootDir, int DiscSet)
+{
+	Account account;
+	account.mAccountID = AccountID;
+	account.mRootDir = rRootDir;
+	account.mDiscSet = DiscSet;
+	account.mBlocksUsed = 0;
+	account.mBlocksSoftLimit = 0;
+	account.mBlockSize = RaidFileController::GetController().
+		GetDiscSet(DiscSet).GetBlockSize();
+
+	std::map<int32_t, AccountStats>::const_iterator i(
+		mStats.find(AccountID));
+	account.mLastRun = (i == mStats.end()) ? 0 : i->second.mLastRun;
+
+	try
+	{
+		std::auto_ptr<BackupStoreInfo> info(BackupStoreInfo::Load(
+			AccountID, rRootDir, DiscSet, true /* ReadOnly */));
+		account.mBlocksUsed = info->GetBlocksUsed();
+		account.mBlocksSoftLimit = info->GetBlocksSoftLimit();
+	}
+	catch(BoxException &e)
+	{
+		// Housekeeping will report the problem when it gets to it
+		BOX_WARNING("Failed to read store info for account " <<
+			BOX_FORMAT_ACCOUNT(AccountID) << " to schedule "
+			"housekeeping: " << e.what());
+	}
+
+	mQueues[DiscSet].push_back(account);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static GetOverSoftLimit(const HousekeepingScheduler::Account &)
+//		Purpose: Static. How far an account is over its soft limit,
+//			 as a fraction of the limit, or zero if it's not over
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static double GetOverSoftLimit(const HousekeepingScheduler::Account &rAccount)
+{
+	if(rAccount.mBlocksUsed <= rAccount.mBlocksSoftLimit)
+	{
+		return 0;
+	}
+
+	int64_t limit = rAccount.mBlocksSoftLimit;
+	if(limit < 1)
+	{
+		limit = 1;
+	}
+	return ((double)(rAccount.mBlocksUsed - rAccount.mBlocksSoftLimit)) /
+		limit;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::IsMoreUrgent(const Account &, const Account &)
+//		Purpose: Whether account A should be housekept before
+//			 account B: the furthest over its soft limit first,
+//			 then the one which was housekept longest ago
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool HousekeepingScheduler::IsMoreUrgent(const Account &rA, const Account &rB)
+{
+	double overA = GetOverSoftLimit(rA);
+	double overB = GetOverSoftLimit(rB);
+	if(overA != overB)
+	{
+		return overA > overB;
+	}
+
+	if(rA.mLastRun != rB.mLastRun)
+	{
+		return rA.mLastRun < rB.mLastRun;
+	}
+
+	return rA.mAccountID < rB.mAccountID;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::Run(HousekeepingCallback *)
+//		Purpose: Housekeep all the accounts added since the last
+//			 run. pCallback is only called from this thread, to
+//			 wait for messages telling housekeeping to stop, or to
+//			 give way to a client. Returns false if it was told
+//			 to stop before all the accounts were done.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool HousekeepingScheduler::Run(HousekeepingCallback *pCallback)
+{
+	int numAccounts = 0;
+	for(std::map<int, std::deque<Account> >::iterator
+		i = mQueues.begin(); i != mQueues.end(); ++i)
+	{
+		std::sort(i->second.begin(), i->second.end(), IsMoreUrgent);
+		numAccounts += i->second.size();
+	}
+
+	mpCallback = pCallback;
+	mStopWanted = false;
+	mGiveWay.clear();
+	mBytesReclaimedThisRun = 0;
+	box_time_t start = GetCurrentBoxTime();
+
+	int numWorkers = mNumWorkers;
+	if(numWorkers > numAccounts)
+	{
+		numWorkers = numAccounts;
+	}
+	mThreaded = (numWorkers > 1 && Thread::IsSupported());
+
+	if(mThreaded)
+	{
+		BOX_TRACE("Housekeeping " << numAccounts << " accounts on " <<
+			numWorkers << " threads");
+		RunWorkers(numWorkers);
+	}
+
+	// Without threads, or if none could be started, do it all here
+	if(!mThreaded)
+	{
+		WorkerCallback callback(*this);
+		Account account;
+		while(NextAccount(account))
+		{
+			Housekeep(account, &callback);
+
+			// Check for messages between accounts
+			PollCallback(0);
+		}
+	}
+
+	bool stopped = mStopWanted;
+	mQueues.clear();
+	mpCallback = 0;
+
+	BOX_INFO("Housekeeping " << (stopped ? "stopped" : "finished") <<
+		" after " << BoxTimeToMilliSeconds(GetCurrentBoxTime() - start) <<
+		" ms, reclaimed " << mBytesReclaimedThisRun << " bytes");
+
+	return !stopped;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::RunWorkers(int)
+//		Purpose: Private. Start the worker threads, and pass on
+//			 messages from the callback until they have all
+//			 finished. If none can be started, clears mThreaded
+//			 and returns.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void HousekeepingScheduler::RunWorkers(int NumWorkers)
+{
+	std::vector<Worker *> workers;
+	try
+	{
+		for(int w = 0; w < NumWorkers; ++w)
+		{
+			std::auto_ptr<Worker> apWorker(new Worker(*this));
+			{
+				MutexLock lock(mMutex);
+				mWorkersRunning++;
+			}
+			try
+			{
+				apWorker->Start();
+			}
+			catch(...)
+			{
+				MutexLock lock(mMutex);
+				mWorkersRunning--;
+				throw;
+			}
+			workers.push_back(apWorker.release());
+		}
+	}
+	catch(BoxException &e)
+	{
+		// Carry on with the workers already running, if any
+		BOX_ERROR("Failed to start housekeeping thread: " << e.what());
+	}
+
+	if(workers.empty())
+	{
+		mThreaded = false;
+		return;
+	}
+
+	while(true)
+	{
+		{
+			MutexLock lock(mMutex);
+			if(mWorkersRunning == 0)
+			{
+				break;
+			}
+			if(mpCallback == 0)
+			{
+				mWorkerFinished.Wait(mMutex);
+				continue;
+			}
+		}
+
+		PollCallback(HOUSEKEEPING_POLL_INTERVAL_MS);
+	}
+
+	for(std::vector<Worker *>::iterator i = workers.begin();
+		i != workers.end(); ++i)
+	{
+		(*i)->Join();
+		delete *i;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::NextAccount(Account &)
+//		Purpose: Private. Take the most urgent account from the disc
+//			 set with the fewest accounts being housekept,
+//			 returning false if there are none left, or
+//			 housekeeping has been told to stop.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool HousekeepingScheduler::NextAccount(Account &rAccountOut)
+{
+	MutexLock lock(mMutex);
+
+	if(mStopWanted)
+	{
+		return false;
+	}
+
+	std::deque<Account> *pbest = 0;
+	int bestRunning = 0;
+	for(std::map<int, std::deque<Account> >::iterator
+		i = mQueues.begin(); i != mQueues.end(); ++i)
+	{
+		if(i->second.empty())
+		{
+			continue;
+		}
+
+		int running = mRunningOnDiscSet[i->first];
+		if(pbest == 0 || running < bestRunning ||
+			(running == bestRunning &&
+			 IsMoreUrgent(i->second.front(), pbest->front())))
+		{
+			pbest = &(i->second);
+			bestRunning = running;
+		}
+	}
+
+	if(pbest == 0)
+	{
+		return false;
+	}
+
+	rAccountOut = pbest->front();
+	pbest->pop_front();
+	mRunningOnDiscSet[rAccountOut.mDiscSet]++;
+	mRunning.insert(rAccountOut.mAccountID);
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::Housekeep(const Account &, HousekeepingCallback *)
+//		Purpose: Private. Housekeep one account, and record how long
+//			 it took and how much space was reclaimed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void HousekeepingScheduler::Housekeep(const Account &rAccount,
+	HousekeepingCallback *pCallback)
+{
+	box_time_t start = GetCurrentBoxTime();
+	bool completed = false;
+	int64_t blocksReclaimed = 0;
+
+	try
+	{
+		HousekeepStoreAccount housekeeping(rAccount.mAccountID,
+			rAccount.mRootDir, rAccount.mDiscSet, pCallback);
+		housekeeping.SetTimeBetweenFullScans(mTimeBetweenFullScans);
+		housekeeping.SetPackObjectsSmallerThan(mPackObjectsSmallerThan);
+		completed = housekeeping.DoHousekeeping();
+		blocksReclaimed = housekeeping.GetBlocksReclaimed();
+	}
+	catch(BoxException &e)
+	{
+		BOX_ERROR("Housekeeping on account " <<
+			BOX_FORMAT_ACCOUNT(rAccount.mAccountID) << " threw "
+			"exception, aborting run for this account: " <<
+			e.what() << " (" <<
+			e.GetType() << "/" << e.GetSubType() << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_ERROR("Housekeeping on account " <<
+			BOX_FORMAT_ACCOUNT(rAccount.mAccountID) << " threw "
+			"exception, aborting run for this account: " <<
+			e.what());
+	}
+	catch(...)
+	{
+		BOX_ERROR("Housekeeping on account " <<
+			BOX_FORMAT_ACCOUNT(rAccount.mAccountID) << " threw "
+			"exception, aborting run for this account: "
+			"unknown exception");
+	}
+
+	box_time_t duration = GetCurrentBoxTime() - start;
+	int64_t bytesReclaimed = blocksReclaimed * rAccount.mBlockSize;
+
+	BOX_INFO("Housekeeping on account " <<
+		BOX_FORMAT_ACCOUNT(rAccount.mAccountID) << " " <<
+		(completed ? "took " : "stopped after ") <<
+		BoxTimeToMilliSeconds(duration) << " ms and reclaimed " <<
+		bytesReclaimed << " bytes");
+
+	MutexLock lock(mMutex);
+	AccountStats &rstats(mStats[rAccount.mAccountID]);
+	rstats.mLastRun = start;
+	rstats.mDuration = duration;
+	rstats.mBytesReclaimed = bytesReclaimed;
+	rstats.mCompleted = completed;
+	mBytesReclaimedThisRun += bytesReclaimed;
+
+	mRunningOnDiscSet[rAccount.mDiscSet]--;
+	mRunning.erase(rAccount.mAccountID);
+	mGiveWay.erase(rAccount.mAccountID);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::WorkerMain()
+//		Purpose: Private. Run by each worker thread.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void HousekeepingScheduler::WorkerMain()
+{
+	WorkerCallback callback(*this);
+	Account account;
+	while(NextAccount(account))
+	{
+		Housekeep(account, &callback);
+	}
+
+	MutexLock lock(mMutex);
+	mWorkersRunning--;
+	mWorkerFinished.Signal();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::PollCallback(int)
+//		Purpose: Private. Wait for a message from the callback, and
+//			 record whether housekeeping should stop, or give way
+//			 to a client on one of the accounts being housekept.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void HousekeepingScheduler::PollCallback(int MaximumWaitTime)
+{
+	if(mpCallback == 0)
+	{
+		return;
+	}
+
+	int lockWanted = 0;
+	bool stop = mpCallback->ReadInterProcessMsg(MaximumWaitTime,
+		lockWanted);
+
+	MutexLock lock(mMutex);
+	if(stop)
+	{
+		mStopWanted = true;
+	}
+	if(lockWanted != 0 && mRunning.find(lockWanted) != mRunning.end())
+	{
+		BOX_INFO("Housekeeping on account " <<
+			BOX_FORMAT_ACCOUNT(lockWanted) << " giving way to "
+			"client connection");
+		mGiveWay.insert(lockWanted);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    HousekeepingScheduler::CheckForInterProcessMsg(int, int)
+//		Purpose: Private. Called by HousekeepStoreAccount through
+//			 WorkerCallback, returns true if it should stop
+//			 housekeeping the account. Messages are only read
+//			 here when there are no worker threads.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool HousekeepingScheduler::CheckForInterProcessMsg(int AccountNum,
+	int MaximumWaitTime)
+{
+	if(!mThreaded)
+	{
+		PollCallback(MaximumWaitTime);
+	}
+
+	MutexLock lock(mMutex);
+	return mStopWanted || mGiveWay.find(AccountNum) != mGiveWay.end();
+}
@@ -0,0 +1,132 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    HousekeepingScheduler.h
+//		Purpose: Run housekeeping on many accounts at once, in order
+//			 of need
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef HOUSEKEEPINGSCHEDULER__H
+#define HOUSEKEEPINGSCHEDULER__H
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "BoxTime.h"
+#include "HousekeepStoreAccount.h"
+#include "Thread.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    HousekeepingScheduler
+//		Purpose: Runs housekeeping on a list of accounts, on a
+//			 number of worker threads. Accounts furthest over
+//			 their soft limits go first, then those which have
+//			 waited longest since they were last housekept. Each
+//			 worker takes the next account from the disc set with
+//			 the fewest accounts being housekept, so that the
+//			 work is spread over all the discs.
+//
+//			 With one worker, or without threads, accounts are
+//			 housekept in the calling thread.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class HousekeepingScheduler
+{
+public:
+	HousekeepingScheduler();
+	~HousekeepingScheduler();
+private:
+	// no copying
+	HousekeepingScheduler(const HousekeepingScheduler &);
+	HousekeepingScheduler &operator=(const HousekeepingScheduler &);
+
+public:
+	typedef struct
+	{
+		int32_t mAccountID;
+		std::string mRootDir;
+		int mDiscSet;
+		// From the store info, to work out the priority
+		int64_t mBlocksUsed;
+		int64_t mBlocksSoftLimit;
+		box_time_t mLastRun;
+		int mBlockSize;
+	} Account;
+
+	typedef struct
+	{
+		box_time_t mLastRun;	// when it was last started
+		box_time_t mDuration;
+		int64_t mBytesReclaimed;
+		bool mCompleted;	// or interrupted, or failed
+	} AccountStats;
+
+	void SetNumWorkers(int NumWorkers) {mNumWorkers = NumWorkers;}
+	void SetTimeBetweenFullScans(box_time_t Interval)
+	{
+		mTimeBetweenFullScans = Interval;
+	}
+	void SetPackObjectsSmallerThan(int64_t Bytes)
+	{
+		mPackObjectsSmallerThan = Bytes;
+	}
+
+	void AddAccount(int32_t AccountID, const std::string &rRootDir,
+		int DiscSet);
+	// Housekeep all the accounts added, returning false if it was
+	// stopped by the callback before they were all done
+	bool Run(HousekeepingCallback *pCallback);
+
+	// Kept from one run to the next
+	const std::map<int32_t, AccountStats> &GetStats() const
+	{
+		return mStats;
+	}
+
+	// Whether account A should be housekept before account B
+	static bool IsMoreUrgent(const Account &rA, const Account &rB);
+
+private:
+	class Worker;
+	friend class Worker;
+	class WorkerCallback;
+	friend class WorkerCallback;
+
+	void RunWorkers(int NumWorkers);
+	bool NextAccount(Account &rAccountOut);
+	void Housekeep(const Account &rAccount,
+		HousekeepingCallback *pCallback);
+	void WorkerMain();
+	void PollCallback(int MaximumWaitTime);
+	bool CheckForInterProcessMsg(int AccountNum, int MaximumWaitTime);
+
+	int mNumWorkers;
+	box_time_t mTimeBetweenFullScans;
+	int64_t mPackObjectsSmallerThan;
+	std::map<int32_t, AccountStats> mStats;
+	HousekeepingCallback *mpCallback;
+	bool mThreaded;
+
+	// Accounts waiting to be housekept, in order of priority, for
+	// each disc set
+	std::map<int, std::deque<Account> > mQueues;
+	std::map<int, int> mRunningOnDiscSet;
+	std::set<int32_t> mRunning;
+	// Accounts which clients want to connect to
+	std::set<int32_t> mGiveWay;
+	bool mStopWanted;
+	int mWorkersRunning;
+	int64_t mBytesReclaimedThisRun;
+	Mutex mMutex;
+	ConditionVariable mWorkerFinished;
+};
+
+#endif // HOUSEKEEPINGSCHEDULER__H
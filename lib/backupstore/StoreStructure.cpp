@@ -9,6 +9,8 @@
 
 #include "Box.h"
 
+#include <stdio.h>
+
 #include "StoreStructure.h"
 #include "RaidFileRead.h"
 #include "RaidFileWrite.h"
@@ -71,6 +73,29 @@ void StoreStructure::MakeObjectFilename(int64_t ObjectID, const std::string &rSt
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    StoreStructure::MakePackFilename(int64_t, const std::string &, int, std::string &)
+//		Purpose: Builds the filename of the pack which would hold the
+//			 given object, if it was packed. There is one in each
+//			 directory of objects.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void StoreStructure::MakePackFilename(int64_t ObjectID, const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut)
+{
+	MakeObjectFilename(ObjectID, rStoreRoot, DiscSet, rFilenameOut,
+		false /* don't make sure the dir exists */);
+
+	// Replace the "oXX" leafname
+	ASSERT(rFilenameOut.size() > 3 &&
+		rFilenameOut[rFilenameOut.size() - 3] == 'o');
+	rFilenameOut.resize(rFilenameOut.size() - 3);
+	rFilenameOut += STORE_PACK_FILENAME;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -93,3 +118,26 @@ void StoreStructure::MakeWriteLockFilename(const std::string &rStoreRoot, int Di
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    StoreStructure::MakeStagedFilename(int64_t, const std::string &, int, std::string &)
+//		Purpose: Generate the on disc filename of a file uploaded by
+//			 a data channel session, waiting to be stored. Like
+//			 the write lock, it's an ordinary file on the first
+//			 disc of the set, so it isn't mistaken for an object.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void StoreStructure::MakeStagedFilename(int64_t StagedFileID, const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut)
+{
+	// Find the disc set
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	RaidFileDiscSet &rdiscSet(rcontroller.GetDiscSet(DiscSet));
+
+	char id[32];
+	::snprintf(id, sizeof(id), "%016llx", (unsigned long long)StagedFileID);
+
+	rFilenameOut = rdiscSet[0] + DIRECTORY_SEPARATOR + rStoreRoot +
+		STORE_STAGED_FILE_PREFIX + id;
+}
@@ -21,11 +21,19 @@
 	#define STORE_ID_SEGMENT_MASK		0x03
 #endif
 
+// Prefix of the names of staged files, in the root of the account
+#define STORE_STAGED_FILE_PREFIX	"staged-"
+
+// Name of the file in each directory of objects which holds the small
+// objects packed together
+#define STORE_PACK_FILENAME		"pack"
 
 namespace StoreStructure
 {
 	void MakeObjectFilename(int64_t ObjectID, const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut, bool EnsureDirectoryExists);
+	void MakePackFilename(int64_t ObjectID, const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut);
 	void MakeWriteLockFilename(const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut);
+	void MakeStagedFilename(int64_t StagedFileID, const std::string &rStoreRoot, int DiscSet, std::string &rFilenameOut);
 };
 
 #endif // STORESTRUCTURE__H
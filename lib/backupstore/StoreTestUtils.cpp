@@ -266,11 +266,12 @@ bool check_reference_counts()
 	return counts_ok;
 }
 
-bool StartServer(const std::string& daemon_args)
+bool StartServer(const std::string& daemon_args,
+	const std::string& bbstored_conf_file)
 {
 	const std::string& daemon_args_final(daemon_args.size() ? daemon_args : bbstored_args);
 	bbstored_pid = StartDaemon(bbstored_pid, BBSTORED " " + daemon_args_final +
-		" testfiles/bbstored.conf", "testfiles/bbstored.pid");
+		" " + bbstored_conf_file, "testfiles/bbstored.pid");
 	return bbstored_pid != 0;
 }
 
@@ -66,7 +66,8 @@ bool run_housekeeping_and_check_account();
 bool check_reference_counts();
 
 //! Starts the bbstored test server running, which must not already be running.
-bool StartServer(const std::string& daemon_args = "");
+bool StartServer(const std::string& daemon_args = "",
+	const std::string& bbstored_conf_file = "testfiles/bbstored.conf");
 
 //! Stops the currently running bbstored test server.
 bool StopServer(bool wait_for_process = false);
@@ -0,0 +1,559 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientBlockIndexCache.cpp
+//		Purpose: Local cache of the block indexes of files which
+//			 were uploaded to the store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+#include "Archive.h"
+#include "BackupClientBlockIndexCache.h"
+#include "BackupStoreConstants.h"
+#include "BackupStoreException.h"
+#include "BackupStoreFileWire.h"
+#include "BackupStoreObjectMagic.h"
+#include "CollectInBufferStream.h"
+#include "CommonException.h"
+#include "FileModificationTime.h"
+#include "FileStream.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+#define BLOCK_INDEX_CACHE_MAGIC		0x42496458 // BIdx
+#define BLOCK_INDEX_CACHE_TEMP_SUFFIX	".tmp"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::BackupClientBlockIndexCache(const std::string &, int64_t, uint32_t)
+//		Purpose: Constructor. Creates the directory if it doesn't
+//			 exist, and finds the indexes which are already in
+//			 it.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientBlockIndexCache::BackupClientBlockIndexCache(
+	const std::string &rDirectory, int64_t MaxSize, uint32_t AccountNumber)
+: mDirectory(rDirectory),
+  mMaxSize(MaxSize),
+  mAccountNumber(AccountNumber),
+  mUseCounter(0),
+  mTotalSize(0),
+  mHits(0),
+  mMisses(0)
+{
+	if(ObjectExists(mDirectory) == ObjectExists_NoObject &&
+		::mkdir(mDirectory.c_str(), S_IRWXU) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to create block index cache "
+			"directory", mDirectory, CommonException, OSFileError);
+	}
+
+	Load();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::~BackupClientBlockIndexCache()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientBlockIndexCache::~BackupClientBlockIndexCache()
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::GetFilename(int64_t)
+//		Purpose: The name of the file which holds the index of an
+//			 object
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::string BackupClientBlockIndexCache::GetFilename(int64_t ObjectID) const
+{
+	char leaf[32];
+	::snprintf(leaf, sizeof(leaf), "%016llx", (unsigned long long)ObjectID);
+	return mDirectory + DIRECTORY_SEPARATOR + leaf;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Load()
+//		Purpose: Find the indexes in the directory, and treat the
+//			 most recently written ones as the most recently
+//			 used. Deletes any temporary files left behind.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Load()
+{
+	DIR *dirHandle = ::opendir(mDirectory.c_str());
+	if(dirHandle == NULL)
+	{
+		THROW_SYS_FILE_ERROR("Failed to open block index cache "
+			"directory", mDirectory, CommonException, OSFileError);
+	}
+
+	// modification time, object ID, size
+	std::vector<std::pair<box_time_t, std::pair<int64_t, int64_t> > > found;
+
+	try
+	{
+		struct dirent *en;
+		while((en = ::readdir(dirHandle)) != NULL)
+		{
+			std::string name(en->d_name);
+			std::string path = mDirectory + DIRECTORY_SEPARATOR + name;
+
+			if(name.size() > strlen(BLOCK_INDEX_CACHE_TEMP_SUFFIX) &&
+				name.substr(name.size() -
+					strlen(BLOCK_INDEX_CACHE_TEMP_SUFFIX)) ==
+				BLOCK_INDEX_CACHE_TEMP_SUFFIX)
+			{
+				::unlink(path.c_str());
+				continue;
+			}
+
+			if(name.size() != 16 || name.find_first_not_of(
+				"0123456789abcdef") != std::string::npos)
+			{
+				continue;
+			}
+
+			EMU_STRUCT_STAT st;
+			if(EMU_STAT(path.c_str(), &st) != 0)
+			{
+				continue;
+			}
+
+			int64_t objectID = (int64_t)::strtoull(name.c_str(),
+				NULL, 16);
+			found.push_back(std::make_pair(
+				FileModificationTime(st),
+				std::make_pair(objectID, (int64_t)st.st_size)));
+		}
+	}
+	catch(...)
+	{
+		::closedir(dirHandle);
+		throw;
+	}
+	::closedir(dirHandle);
+
+	std::sort(found.begin(), found.end());
+	for(size_t i = 0; i < found.size(); i++)
+	{
+		Entry &rEntry(mEntries[found[i].second.first]);
+		rEntry.mSize = found[i].second.second;
+		mTotalSize += rEntry.mSize;
+		Touch(found[i].second.first, rEntry);
+	}
+
+	Trim();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Touch(int64_t, Entry &)
+//		Purpose: Mark an entry as the most recently used
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Touch(int64_t ObjectID, Entry &rEntry)
+{
+	if(rEntry.mLastUsed != 0)
+	{
+		mLeastRecentlyUsed.erase(rEntry.mLastUsed);
+	}
+	rEntry.mLastUsed = ++mUseCounter;
+	mLeastRecentlyUsed[rEntry.mLastUsed] = ObjectID;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::RemoveEntry(std::map<int64_t, Entry>::iterator)
+//		Purpose: Forget an entry, and delete its file
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::RemoveEntry(
+	std::map<int64_t, Entry>::iterator i)
+{
+	std::string filename = GetFilename(i->first);
+	if(::unlink(filename.c_str()) != 0 && errno != ENOENT)
+	{
+		BOX_LOG_SYS_WARNING(BOX_FILE_MESSAGE(filename,
+			"Failed to delete cached block index"));
+	}
+
+	mTotalSize -= i->second.mSize;
+	mLeastRecentlyUsed.erase(i->second.mLastUsed);
+	mEntries.erase(i);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Trim()
+//		Purpose: Delete the least recently used entries until the
+//			 total size is within the limit
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Trim()
+{
+	while(mTotalSize > mMaxSize && !mLeastRecentlyUsed.empty())
+	{
+		std::map<int64_t, Entry>::iterator i =
+			mEntries.find(mLeastRecentlyUsed.begin()->second);
+		ASSERT(i != mEntries.end());
+		RemoveEntry(i);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::ReadIndex(int64_t, int64_t, box_time_t, CollectInBufferStream &)
+//		Purpose: Read the cached index of an object, checking that
+//			 it's the one asked for. Returns a description of
+//			 the problem if not, or an empty string if it is.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::string BackupClientBlockIndexCache::ReadIndex(int64_t ObjectID,
+	int64_t ContainerID, box_time_t ModificationTime,
+	CollectInBufferStream &rIndexOut)
+{
+	std::string filename = GetFilename(ObjectID);
+	if(!FileExists(filename))
+	{
+		return "file is missing";
+	}
+
+	std::string problem;
+	try
+	{
+		FileStream file(filename);
+		Archive archive(file, IOStream::TimeOutInfinite);
+
+		int32_t magic, accountNumber;
+		int64_t objectID, containerID, modificationTime;
+		archive.Read(magic);
+		archive.Read(accountNumber);
+		archive.Read(objectID);
+		archive.Read(containerID);
+		archive.Read(modificationTime);
+
+		if(magic != BLOCK_INDEX_CACHE_MAGIC ||
+			(uint32_t)accountNumber != mAccountNumber ||
+			objectID != ObjectID)
+		{
+			problem = "not an index of this object";
+		}
+		else if(containerID != ContainerID ||
+			(box_time_t)modificationTime != ModificationTime)
+		{
+			problem = "the object on the store is different";
+		}
+		else
+		{
+			rIndexOut.Reset();
+			file.CopyStreamTo(rIndexOut);
+			rIndexOut.SetForReading();
+
+			file_BlockIndexHeader hdr;
+			if(rIndexOut.GetSize() < (int)sizeof(hdr))
+			{
+				problem = "index is incomplete";
+			}
+			else
+			{
+				::memcpy(&hdr, rIndexOut.GetBuffer(),
+					sizeof(hdr));
+				int64_t numBlocks = box_ntoh64(hdr.mNumBlocks);
+				if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(
+					ntohl(hdr.mMagicValue)) ||
+					box_ntoh64(hdr.mOtherFileID) != 0 ||
+					rIndexOut.GetSize() != (int64_t)sizeof(hdr) +
+					numBlocks *
+					(int64_t)sizeof(file_BlockIndexEntry))
+				{
+					problem = "index is incomplete";
+				}
+			}
+		}
+	}
+	catch(BoxException &e)
+	{
+		problem = e.what();
+	}
+
+	return problem;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Get(int64_t, int64_t, box_time_t, CollectInBufferStream &)
+//		Purpose: Get the index of an object, ready to read, if it's
+//			 in the cache and was stored in the same directory
+//			 with the same modification time. Returns false if
+//			 not, and removes it if it doesn't match.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientBlockIndexCache::Get(int64_t ObjectID, int64_t ContainerID,
+	box_time_t ModificationTime, CollectInBufferStream &rIndexOut)
+{
+	std::map<int64_t, Entry>::iterator i = mEntries.find(ObjectID);
+	if(i == mEntries.end())
+	{
+		mMisses++;
+		return false;
+	}
+
+	std::string problem = ReadIndex(ObjectID, ContainerID,
+		ModificationTime, rIndexOut);
+
+	if(!problem.empty())
+	{
+		BOX_TRACE("Not using cached block index of object " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << ": " << problem);
+		RemoveEntry(i);
+		mMisses++;
+		return false;
+	}
+
+	Touch(ObjectID, i->second);
+	mHits++;
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Add(int64_t, int64_t, box_time_t, const CollectInBufferStream &, const CollectInBufferStream *)
+//		Purpose: Keep the index of an object which has just been
+//			 uploaded. rUploadedIndex is the one which was sent
+//			 at the end of the upload, and pDiffFromIndex is the
+//			 index of the object which it was a patch against,
+//			 if it was one (see MakeStoredIndex). Errors are
+//			 logged, not thrown, as the cache isn't essential.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Add(int64_t ObjectID, int64_t ContainerID,
+	box_time_t ModificationTime,
+	const CollectInBufferStream &rUploadedIndex,
+	const CollectInBufferStream *pDiffFromIndex)
+{
+	CollectInBufferStream stored;
+	if(!MakeStoredIndex(rUploadedIndex, pDiffFromIndex, stored))
+	{
+		return;
+	}
+
+	std::string filename = GetFilename(ObjectID);
+	std::string tempFilename = filename + BLOCK_INDEX_CACHE_TEMP_SUFFIX;
+	int64_t size;
+
+	try
+	{
+		FileStream file(tempFilename, O_WRONLY | O_CREAT | O_TRUNC |
+			O_BINARY);
+		Archive archive(file, IOStream::TimeOutInfinite);
+		archive.Write((int32_t)BLOCK_INDEX_CACHE_MAGIC);
+		archive.Write((int32_t)mAccountNumber);
+		archive.Write(ObjectID);
+		archive.Write(ContainerID);
+		archive.Write((int64_t)ModificationTime);
+		file.Write(stored.GetBuffer(), stored.GetSize());
+		size = file.GetPosition();
+		file.Close();
+
+#ifdef WIN32
+		// win32 rename doesn't overwrite existing files
+		::unlink(filename.c_str());
+#endif
+		if(::rename(tempFilename.c_str(), filename.c_str()) != 0)
+		{
+			THROW_SYS_FILE_ERROR("Failed to rename cached block "
+				"index", tempFilename, CommonException,
+				OSFileError);
+		}
+	}
+	catch(BoxException &e)
+	{
+		BOX_WARNING("Failed to cache block index of object " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << ": " << e.what());
+		::unlink(tempFilename.c_str());
+		return;
+	}
+
+	std::map<int64_t, Entry>::iterator i = mEntries.find(ObjectID);
+	if(i == mEntries.end())
+	{
+		Entry newEntry;
+		newEntry.mSize = 0;
+		newEntry.mLastUsed = 0;
+		i = mEntries.insert(std::make_pair(ObjectID, newEntry)).first;
+	}
+	mTotalSize += size - i->second.mSize;
+	i->second.mSize = size;
+	Touch(ObjectID, i->second);
+
+	Trim();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Remove(int64_t)
+//		Purpose: Forget the index of an object, if it's cached,
+//			 because the object has been replaced
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Remove(int64_t ObjectID)
+{
+	std::map<int64_t, Entry>::iterator i = mEntries.find(ObjectID);
+	if(i != mEntries.end())
+	{
+		RemoveEntry(i);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Clear()
+//		Purpose: Forget all the cached indexes, for example because
+//			 the store may have been replaced
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Clear()
+{
+	while(!mEntries.empty())
+	{
+		RemoveEntry(mEntries.begin());
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::MakeStoredIndex(const CollectInBufferStream &, const CollectInBufferStream *, CollectInBufferStream &)
+//		Purpose: Make the block index which the store keeps for a
+//			 file, from the one which was uploaded with it. They
+//			 are the same for a whole file. A patch refers to
+//			 blocks of the file that it was made against, and the
+//			 store replaces those references with the sizes of
+//			 those blocks, from the index of that file, which
+//			 must be given. Returns false if the indexes don't
+//			 make sense, or there are no blocks.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientBlockIndexCache::MakeStoredIndex(
+	const CollectInBufferStream &rUploadedIndex,
+	const CollectInBufferStream *pDiffFromIndex,
+	CollectInBufferStream &rStoredIndexOut)
+{
+	file_BlockIndexHeader hdr;
+	if(rUploadedIndex.GetSize() < (int)sizeof(hdr))
+	{
+		return false;
+	}
+	::memcpy(&hdr, rUploadedIndex.GetBuffer(), sizeof(hdr));
+	int64_t numBlocks = box_ntoh64(hdr.mNumBlocks);
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(hdr.mMagicValue)) ||
+		numBlocks <= 0 ||
+		rUploadedIndex.GetSize() != (int64_t)sizeof(hdr) +
+			numBlocks * (int64_t)sizeof(file_BlockIndexEntry))
+	{
+		return false;
+	}
+
+	const uint8_t *pFromEntries = NULL;
+	int64_t fromNumBlocks = 0;
+	if(box_ntoh64(hdr.mOtherFileID) != 0)
+	{
+		file_BlockIndexHeader fromHdr;
+		if(pDiffFromIndex == NULL ||
+			pDiffFromIndex->GetSize() < (int)sizeof(fromHdr))
+		{
+			return false;
+		}
+		::memcpy(&fromHdr, pDiffFromIndex->GetBuffer(), sizeof(fromHdr));
+		fromNumBlocks = box_ntoh64(fromHdr.mNumBlocks);
+		if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(
+			ntohl(fromHdr.mMagicValue)) ||
+			fromNumBlocks < 0 ||
+			pDiffFromIndex->GetSize() != (int64_t)sizeof(fromHdr) +
+				fromNumBlocks *
+				(int64_t)sizeof(file_BlockIndexEntry))
+		{
+			return false;
+		}
+		pFromEntries = (const uint8_t *)pDiffFromIndex->GetBuffer() +
+			sizeof(fromHdr);
+	}
+
+	rStoredIndexOut.Reset();
+	hdr.mOtherFileID = box_hton64(0);
+	rStoredIndexOut.Write(&hdr, sizeof(hdr));
+
+	const uint8_t *pEntries = (const uint8_t *)rUploadedIndex.GetBuffer() +
+		sizeof(hdr);
+	for(int64_t b = 0; b < numBlocks; b++)
+	{
+		file_BlockIndexEntry en;
+		::memcpy(&en, pEntries + b * sizeof(en), sizeof(en));
+
+		int64_t encodedSize = box_ntoh64(en.mEncodedSize);
+		if(encodedSize <= 0)
+		{
+			// Refers to a block of the other file, which the
+			// store will have copied into this one
+			int64_t otherBlock = 0 - encodedSize;
+			if(pFromEntries == NULL || otherBlock >= fromNumBlocks)
+			{
+				return false;
+			}
+			file_BlockIndexEntry fromEn;
+			::memcpy(&fromEn, pFromEntries + otherBlock *
+				sizeof(fromEn), sizeof(fromEn));
+			en.mEncodedSize = fromEn.mEncodedSize;
+		}
+
+		rStoredIndexOut.Write(&en, sizeof(en));
+	}
+
+	rStoredIndexOut.SetForReading();
+	return true;
+}
@@ -0,0 +1,101 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientBlockIndexCache.h
+//		Purpose: Local cache of the block indexes of files which
+//			 were uploaded to the store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTBLOCKINDEXCACHE__H
+#define BACKUPCLIENTBLOCKINDEXCACHE__H
+
+#include <map>
+#include <string>
+
+#include "BoxTime.h"
+
+class CollectInBufferStream;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientBlockIndexCache
+//		Purpose: Keeps a copy of the block index of each file that
+//			 we upload, in the form that the store will keep it,
+//			 so that a patch can be made against that version of
+//			 the file without asking the store for its index.
+//			 Each one is kept in its own file in a directory,
+//			 named after the object ID, and the least recently
+//			 used ones are deleted to keep the total size under
+//			 the limit. The caller must check that the object is
+//			 still the latest version of the file on the store,
+//			 using the directory listing; the container ID and
+//			 modification time which were stored with it must
+//			 also match.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientBlockIndexCache
+{
+public:
+	BackupClientBlockIndexCache(const std::string &rDirectory,
+		int64_t MaxSize, uint32_t AccountNumber);
+	~BackupClientBlockIndexCache();
+private:
+	// no copying
+	BackupClientBlockIndexCache(const BackupClientBlockIndexCache &);
+	BackupClientBlockIndexCache &operator=(
+		const BackupClientBlockIndexCache &);
+public:
+	bool Get(int64_t ObjectID, int64_t ContainerID,
+		box_time_t ModificationTime, CollectInBufferStream &rIndexOut);
+	void Add(int64_t ObjectID, int64_t ContainerID,
+		box_time_t ModificationTime,
+		const CollectInBufferStream &rUploadedIndex,
+		const CollectInBufferStream *pDiffFromIndex);
+	void Remove(int64_t ObjectID);
+	void Clear();
+
+	static bool MakeStoredIndex(const CollectInBufferStream &rUploadedIndex,
+		const CollectInBufferStream *pDiffFromIndex,
+		CollectInBufferStream &rStoredIndexOut);
+
+	const std::string &GetDirectory() const { return mDirectory; }
+	int64_t GetMaxSize() const { return mMaxSize; }
+	uint32_t GetAccountNumber() const { return mAccountNumber; }
+	int64_t GetNumberOfEntries() const { return mEntries.size(); }
+	int64_t GetSize() const { return mTotalSize; }
+
+	// Statistics since the last ResetStats()
+	void ResetStats() { mHits = 0; mMisses = 0; }
+	int64_t GetHits() const { return mHits; }
+	int64_t GetMisses() const { return mMisses; }
+
+private:
+	typedef struct
+	{
+		int64_t mSize;
+		int64_t mLastUsed;
+	} Entry;
+
+	std::string GetFilename(int64_t ObjectID) const;
+	void Load();
+	std::string ReadIndex(int64_t ObjectID, int64_t ContainerID,
+		box_time_t ModificationTime, CollectInBufferStream &rIndexOut);
+	void Touch(int64_t ObjectID, Entry &rEntry);
+	void RemoveEntry(std::map<int64_t, Entry>::iterator i);
+	void Trim();
+
+	std::string mDirectory;
+	int64_t mMaxSize;
+	uint32_t mAccountNumber;
+	std::map<int64_t, Entry> mEntries; // by object ID
+	std::map<int64_t, int64_t> mLeastRecentlyUsed; // last used -> ID
+	int64_t mUseCounter;
+	int64_t mTotalSize;
+	int64_t mHits, mMisses;
+};
+
+#endif // BACKUPCLIENTBLOCKINDEXCACHE__H
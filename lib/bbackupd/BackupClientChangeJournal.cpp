@@ -0,0 +1,339 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientChangeJournal.cpp
+//		Purpose: Records which local directories have changed between
+//			 syncs, so that bbackupd doesn't have to scan the rest
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#ifdef HAVE_INOTIFY_INIT1
+	#include <sys/inotify.h>
+#endif
+
+#include "BackupClientChangeJournal.h"
+#include "CommonException.h"
+#include "Logging.h"
+
+#include "MemLeakFindOn.h"
+
+#ifdef HAVE_INOTIFY_INIT1
+// Anything that changes the entries of a directory, or what would be
+// backed up from them, but not reading them
+#define CHANGE_JOURNAL_WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+	IN_DELETE | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | \
+	IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | IN_EXCL_UNLINK | \
+	IN_ONLYDIR)
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::BackupClientChangeJournal()
+//		Purpose: Constructor. Throws an exception if changes can't
+//			 be watched on this platform.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientChangeJournal::BackupClientChangeJournal()
+: mNotifyFD(-1),
+  mEventsLost(false),
+  mFullScan(false),
+  mSyncStartTime(0),
+  mLastFullScanTime(0)
+{
+#ifdef HAVE_INOTIFY_INIT1
+	mNotifyFD = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(mNotifyFD == -1)
+	{
+		THROW_SYS_ERROR("Failed to start watching for changes to "
+			"files", CommonException, OSFileError);
+	}
+#else
+	THROW_EXCEPTION_MESSAGE(CommonException, NotSupported,
+		"Watching for changes to files is not supported on this "
+		"platform");
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::~BackupClientChangeJournal()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientChangeJournal::~BackupClientChangeJournal()
+{
+#ifdef HAVE_INOTIFY_INIT1
+	if(mNotifyFD != -1)
+	{
+		::close(mNotifyFD);
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::IsSupported()
+//		Purpose: Whether changes can be watched on this platform
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientChangeJournal::IsSupported()
+{
+#ifdef HAVE_INOTIFY_INIT1
+	return true;
+#else
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::MarkChanged(const std::string &, box_time_t)
+//		Purpose: Private. Record that a directory changed at a
+//			 given time, unless it's known to have changed
+//			 later.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::MarkChanged(const std::string &rPath,
+	box_time_t Time)
+{
+	std::map<std::string, box_time_t>::iterator i(mChanged.find(rPath));
+	if(i == mChanged.end())
+	{
+		mChanged[rPath] = Time;
+	}
+	else if(i->second < Time)
+	{
+		i->second = Time;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::Watch(const std::string &)
+//		Purpose: Start watching a directory for changes, if it's not
+//			 watched already. Call before reading it. If it can't
+//			 be watched because there are too many, everything
+//			 will be scanned next time.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::Watch(const std::string &rPath)
+{
+#ifdef HAVE_INOTIFY_INIT1
+	int wd = ::inotify_add_watch(mNotifyFD, rPath.c_str(),
+		CHANGE_JOURNAL_WATCH_MASK);
+	if(wd == -1)
+	{
+		if(errno == ENOSPC || errno == ENOMEM)
+		{
+			if(!mEventsLost)
+			{
+				BOX_LOG_SYS_WARNING("Failed to watch directory "
+					"for changes, will scan all directories "
+					"next time (try increasing "
+					"fs.inotify.max_user_watches): " << rPath);
+			}
+			mEventsLost = true;
+		}
+		else
+		{
+			// Probably gone already, which the scan will notice
+			BOX_TRACE(BOX_SYS_ERROR_MESSAGE("Failed to watch "
+				"directory for changes: " << rPath));
+		}
+		return;
+	}
+
+	std::map<int, std::string>::iterator i(mWatches.find(wd));
+	if(i != mWatches.end() && i->second == rPath)
+	{
+		// Already watching it
+		return;
+	}
+
+	// A new watch, or the directory has been moved here. It may have
+	// changed since it was read, so it must be scanned again.
+	mWatches[wd] = rPath;
+	MarkChanged(rPath, GetCurrentBoxTime());
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::ReadEvents()
+//		Purpose: Read all the events waiting, without blocking, and
+//			 mark the directories in which they happened as
+//			 changed now, which may be later than they did
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::ReadEvents()
+{
+#ifdef HAVE_INOTIFY_INIT1
+	char buffer[64 * 1024]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while(true)
+	{
+		ssize_t bytes = ::read(mNotifyFD, buffer, sizeof(buffer));
+		if(bytes == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(errno != EAGAIN)
+			{
+				THROW_SYS_ERROR("Failed to read changes to files",
+					CommonException, OSFileError);
+			}
+			break;
+		}
+
+		box_time_t now = GetCurrentBoxTime();
+		for(char *p = buffer; p < buffer + bytes; )
+		{
+			const struct inotify_event *pEvent =
+				(const struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + pEvent->len;
+
+			if(pEvent->mask & IN_Q_OVERFLOW)
+			{
+				if(!mEventsLost)
+				{
+					BOX_WARNING("Too many changes to files "
+						"to keep track of, will scan all "
+						"directories next time");
+				}
+				mEventsLost = true;
+				continue;
+			}
+
+			std::map<int, std::string>::iterator i(
+				mWatches.find(pEvent->wd));
+			if(i == mWatches.end())
+			{
+				// Stopped watching it already
+				continue;
+			}
+
+			MarkChanged(i->second, now);
+
+			if(pEvent->mask & IN_MOVE_SELF)
+			{
+				// We don't know where it's gone, so stop
+				// watching it until it's scanned there
+				::inotify_rm_watch(mNotifyFD, pEvent->wd);
+				mWatches.erase(i);
+			}
+			else if(pEvent->mask & IN_IGNORED)
+			{
+				// Deleted, or the filesystem was unmounted
+				mWatches.erase(i);
+			}
+		}
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::MarkClean(const std::string &, box_time_t)
+//		Purpose: Record that a directory, which was read at
+//			 ReadTime, has been synced completely. It's still
+//			 changed if a change was seen after that.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::MarkClean(const std::string &rPath,
+	box_time_t ReadTime)
+{
+	std::map<std::string, box_time_t>::iterator i(mChanged.find(rPath));
+	if(i != mChanged.end() && i->second < ReadTime)
+	{
+		mChanged.erase(i);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::MarkFailed(const std::string &)
+//		Purpose: Record that a directory wasn't synced completely,
+//			 so that it's scanned again next time even if nothing
+//			 changes
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::MarkFailed(const std::string &rPath)
+{
+	MarkChanged(rPath, 0);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::StartSync(box_time_t, box_time_t)
+//		Purpose: Read the changes seen since the last sync, and
+//			 return whether this one must scan everything:
+//			 because it's the first, or changes were lost, or
+//			 the last full scan was at least FullScanInterval
+//			 ago (if it's not zero).
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientChangeJournal::StartSync(box_time_t SyncStartTime,
+	box_time_t FullScanInterval)
+{
+	ReadEvents();
+
+	mFullScan = mEventsLost || mLastFullScanTime == 0 ||
+		(FullScanInterval != 0 &&
+		 SyncStartTime >= mLastFullScanTime + FullScanInterval);
+
+	// Anything lost from now on must be caught by the next one
+	mEventsLost = false;
+	mSyncStartTime = SyncStartTime;
+	return mFullScan;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientChangeJournal::FinishSync()
+//		Purpose: Record that the sync started by StartSync() has
+//			 finished without errors
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientChangeJournal::FinishSync()
+{
+	ReadEvents();
+
+	if(mFullScan)
+	{
+		mLastFullScanTime = mSyncStartTime;
+		mFullScan = false;
+	}
+}
@@ -0,0 +1,78 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientChangeJournal.h
+//		Purpose: Records which local directories have changed between
+//			 syncs, so that bbackupd doesn't have to scan the rest
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTCHANGEJOURNAL__H
+#define BACKUPCLIENTCHANGEJOURNAL__H
+
+#include <map>
+#include <string>
+
+#include "BoxTime.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientChangeJournal
+//		Purpose: Watches the directories which have been scanned,
+//			 using inotify, and keeps a list of the ones in which
+//			 something has changed, with the time at which the
+//			 change was seen. A directory is clean once it has
+//			 been read after that time, and synced completely,
+//			 with no files left waiting until they're old enough
+//			 to upload. Directories are also marked as changed
+//			 when they are first watched, as they may have
+//			 changed after being read. If any events are lost, or
+//			 the directories can't all be watched, the next sync
+//			 must scan everything again.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientChangeJournal
+{
+public:
+	BackupClientChangeJournal();
+	~BackupClientChangeJournal();
+private:
+	// no copying
+	BackupClientChangeJournal(const BackupClientChangeJournal &);
+	BackupClientChangeJournal &operator=(const BackupClientChangeJournal &);
+public:
+	static bool IsSupported();
+
+	void Watch(const std::string &rPath);
+	void ReadEvents();
+
+	bool IsChanged(const std::string &rPath) const
+	{
+		return mChanged.find(rPath) != mChanged.end();
+	}
+	void MarkClean(const std::string &rPath, box_time_t ReadTime);
+	void MarkFailed(const std::string &rPath);
+
+	bool StartSync(box_time_t SyncStartTime, box_time_t FullScanInterval);
+	void FinishSync();
+
+	int64_t GetNumberOfWatches() const { return mWatches.size(); }
+	int64_t GetNumberOfChangedDirectories() const { return mChanged.size(); }
+	box_time_t GetLastFullScanTime() const { return mLastFullScanTime; }
+
+private:
+	void MarkChanged(const std::string &rPath, box_time_t Time);
+
+	int mNotifyFD;
+	std::map<int, std::string> mWatches; // watch descriptor -> path
+	std::map<std::string, box_time_t> mChanged; // path -> time seen
+	bool mEventsLost;
+	bool mFullScan;
+	box_time_t mSyncStartTime;
+	box_time_t mLastFullScanTime;
+};
+
+#endif // BACKUPCLIENTCHANGEJOURNAL__H
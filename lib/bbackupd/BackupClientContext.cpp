@@ -20,6 +20,7 @@
 #include "BoxPortsAndFiles.h"
 #include "BoxTime.h"
 #include "BackupClientContext.h"
+#include "BackupClientUploadChannels.h"
 #include "SocketStreamTLS.h"
 #include "Socket.h"
 #include "BackupStoreConstants.h"
@@ -74,7 +75,11 @@ BackupClientContext::BackupClientContext
   mbIsManaged(false),
   mrProgressNotifier(rProgressNotifier),
   mTcpNiceMode(TcpNiceMode),
-  mpNice(NULL)
+  mpNice(NULL),
+  mServerVersion(0),
+  mUploadConnections(1),
+  mDeduplicateBlocks(false),
+  mpBlockIndexCache(NULL)
 {
 }
 
@@ -174,14 +179,73 @@ BackupProtocolCallable &BackupClientContext::GetConnection()
 		// Handshake
 		pClient->Handshake();
 
-		// Check the version of the server
+		// Check the version of the server, asking whether it indexes
+		// blocks first, then whether it accepts data channels, then
+		// pipelined commands. Older servers refuse, but carry on
+		// waiting for a version that they do accept.
 		{
-			std::auto_ptr<BackupProtocolVersion> serverVersion(
-				mapConnection->QueryVersion(BACKUP_STORE_SERVER_VERSION));
-			if(serverVersion->GetVersion() != BACKUP_STORE_SERVER_VERSION)
+			static const int versions[] =
+			{
+				BACKUP_STORE_SERVER_VERSION_BLOCK_DEDUP,
+				BACKUP_STORE_SERVER_VERSION_DATA_CHANNELS,
+				BACKUP_STORE_SERVER_VERSION_PIPELINED,
+				BACKUP_STORE_SERVER_VERSION
+			};
+			static const int numVersions =
+				sizeof(versions) / sizeof(versions[0]);
+
+			std::auto_ptr<BackupProtocolVersion> serverVersion;
+			int v;
+			for(v = 0; v < numVersions; v++)
+			{
+				try
+				{
+					serverVersion = mapConnection->QueryVersion(
+						versions[v]);
+					break;
+				}
+				catch(ConnectionException &e)
+				{
+					int type, subType;
+					if(v == numVersions - 1 ||
+						!mapConnection->GetLastError(type, subType) ||
+						type != BackupProtocolError::ErrorType ||
+						subType != BackupProtocolError::Err_WrongVersion)
+					{
+						throw;
+					}
+				}
+
+				if(versions[v + 1] == BACKUP_STORE_SERVER_VERSION_DATA_CHANNELS)
+				{
+					BOX_INFO("Server does not index blocks, "
+						"not looking for them in other "
+						"files");
+				}
+				else if(versions[v + 1] == BACKUP_STORE_SERVER_VERSION_PIPELINED)
+				{
+					BOX_INFO("Server does not accept data "
+						"channels, uploading one file at "
+						"a time");
+				}
+				else
+				{
+					BOX_INFO("Server does not accept pipelined "
+						"commands, sending one at a time");
+				}
+			}
+
+			if(serverVersion->GetVersion() != versions[v])
 			{
 				THROW_EXCEPTION(BackupStoreException, WrongServerVersion)
 			}
+
+			mServerVersion = versions[v];
+			if(mServerVersion != BACKUP_STORE_SERVER_VERSION)
+			{
+				pClient->SetMaxQueuedQueries(
+					BACKUP_STORE_MAX_PIPELINED_COMMANDS);
+			}
 		}
 
 		// Login -- if this fails, the Protocol will exception
@@ -252,6 +316,42 @@ BackupProtocolCallable* BackupClientContext::GetOpenConnection() const
 	return mapConnection.get();
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientContext::GetUploadChannels()
+//		Purpose: Returns the extra connections to upload whole files
+//			 in parallel with, starting them if necessary, or
+//			 NULL if there aren't any. There are none unless
+//			 more than one upload connection was configured, and
+//			 the main connection is open to a server which
+//			 accepts data channels.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientUploadChannels* BackupClientContext::GetUploadChannels()
+{
+	if(mUploadConnections < 2 || !mapConnection.get() ||
+		mServerVersion < BACKUP_STORE_SERVER_VERSION_DATA_CHANNELS)
+	{
+		return NULL;
+	}
+
+	if(!mapUploadChannels.get())
+	{
+		mapUploadChannels.reset(new BackupClientUploadChannels(
+			mrTLSContext, mHostname, mPort, mAccountNumber,
+			mUploadConnections - 1));
+	}
+
+	if(mapUploadChannels->GetNumberOfChannels() == 0)
+	{
+		return NULL;
+	}
+
+	return mapUploadChannels.get();
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -262,6 +362,10 @@ BackupProtocolCallable* BackupClientContext::GetOpenConnection() const
 // --------------------------------------------------------------------------
 void BackupClientContext::CloseAnyOpenConnection()
 {
+	// Close the data channels first, so that the staged files of any
+	// unfinished uploads are cleaned up by the next login
+	mapUploadChannels.reset();
+
 	BackupProtocolCallable* pConnection(GetOpenConnection());
 	if(pConnection)
 	{
@@ -14,6 +14,7 @@
 #include "BackupClientDeleteList.h"
 #include "BackupClientDirectoryRecord.h"
 #include "BackupDaemonInterface.h"
+#include "BackupStoreConstants.h"
 #include "BackupStoreFile.h"
 #include "ExcludeList.h"
 #include "TcpNice.h"
@@ -25,6 +26,8 @@ class SocketStreamTLS;
 class BackupClientInodeToIDMap;
 class BackupDaemon;
 class BackupStoreFilenameClear;
+class BackupClientUploadChannels;
+class BackupClientBlockIndexCache;
 
 #include <string>
 
@@ -65,6 +68,32 @@ public:
 	// no connection already open.
 	virtual BackupProtocolCallable* GetOpenConnection() const;
 	void CloseAnyOpenConnection();
+	BackupClientUploadChannels* GetUploadChannels();
+	void SetUploadConnections(int Connections)
+	{
+		mUploadConnections = Connections;
+	}
+	void SetDeduplicateBlocks(bool Deduplicate)
+	{
+		mDeduplicateBlocks = Deduplicate;
+	}
+	// Whether new files should be diffed against others with the same
+	// blocks. Only valid once connected, as the server must index them.
+	bool DeduplicatingBlocks() const
+	{
+		return mDeduplicateBlocks && mServerVersion >=
+			BACKUP_STORE_SERVER_VERSION_BLOCK_DEDUP;
+	}
+	// The cache of block indexes to diff against, or NULL if
+	// there isn't one. It's owned by the caller.
+	void SetBlockIndexCache(BackupClientBlockIndexCache *pCache)
+	{
+		mpBlockIndexCache = pCache;
+	}
+	BackupClientBlockIndexCache* GetBlockIndexCache()
+	{
+		return mpBlockIndexCache;
+	}
 	int GetTimeout() const;
 	BackupClientDeleteList &GetDeleteList();
 	void PerformDeletions();
@@ -247,6 +276,11 @@ private:
 	ProgressNotifier &mrProgressNotifier;
 	bool mTcpNiceMode;
 	NiceSocketStream *mpNice;
+	int mServerVersion;
+	int mUploadConnections;
+	bool mDeduplicateBlocks;
+	std::auto_ptr<BackupClientUploadChannels> mapUploadChannels;
+	BackupClientBlockIndexCache *mpBlockIndexCache;
 };
 
 #endif // BACKUPCLIENTCONTEXT__H
@@ -14,6 +14,7 @@
 #include "BackupClientDeleteList.h"
 #include "BackupClientContext.h"
 #include "autogen_BackupProtocol.h"
+#include "autogen_ConnectionException.h"
 
 #include "MemLeakFindOn.h"
 
@@ -134,26 +135,81 @@ void BackupClientDeleteList::PerformDeletions(BackupClientContext &rContext)
 	// Get a connection
 	BackupProtocolCallable &connection(rContext.GetConnection());
 	
-	// Do the deletes
-	for(std::vector<DirToDelete>::iterator i(mDirectoryList.begin());
-		i != mDirectoryList.end(); ++i)
+	// Do the deletes, directories first and then files, without waiting
+	// for each reply before sending the next command if the server
+	// accepts that. The tag of each command is its index in the
+	// directory list, followed by the file list.
+	size_t window = connection.GetMaxQueuedQueries();
+	size_t total = mDirectoryList.size() + mFileList.size();
+	size_t sent = 0, received = 0;
+	std::string error;
+
+	while(received < total)
 	{
-		connection.QueryDeleteDirectory(i->mObjectID);
-		rContext.GetProgressNotifier().NotifyDirectoryDeleted(
-			i->mObjectID, i->mLocalPath);
+		// Keep the pipeline full, unless there's been an error
+		while(error.empty() && sent < total &&
+			sent - received < window)
+		{
+			if(sent < mDirectoryList.size())
+			{
+				connection.SendQueued(BackupProtocolDeleteDirectory(
+					mDirectoryList[sent].mObjectID), sent);
+			}
+			else
+			{
+				const FileToDelete &rFile(
+					mFileList[sent - mDirectoryList.size()]);
+				connection.SendQueued(BackupProtocolDeleteFile(
+					rFile.mDirectoryID, rFile.mFilename), sent);
+			}
+			sent++;
+		}
+
+		if(received == sent)
+		{
+			// Stopped sending because of an error, and every
+			// reply has been received
+			break;
+		}
+
+		int64_t tag;
+		std::auto_ptr<BackupProtocolMessage> apReply(
+			connection.ReceiveQueued(tag));
+		ASSERT(tag == (int64_t)received);
+		received++;
+
+		int type, subType;
+		if(apReply->IsError(type, subType))
+		{
+			if(error.empty())
+			{
+				error = ((BackupProtocolError &)*apReply).GetMessage();
+			}
+		}
+		else if(tag < (int64_t)mDirectoryList.size())
+		{
+			rContext.GetProgressNotifier().NotifyDirectoryDeleted(
+				mDirectoryList[tag].mObjectID,
+				mDirectoryList[tag].mLocalPath);
+		}
+		else
+		{
+			const FileToDelete &rFile(
+				mFileList[tag - mDirectoryList.size()]);
+			rContext.GetProgressNotifier().NotifyFileDeleted(
+				rFile.mDirectoryID, rFile.mLocalPath);
+		}
 	}
-	
-	// Clear the directory list
-	mDirectoryList.clear();
-	
-	// Delete the files
-	for(std::vector<FileToDelete>::iterator i(mFileList.begin());
-		i != mFileList.end(); ++i)
+
+	if(!error.empty())
 	{
-		connection.QueryDeleteFile(i->mDirectoryID, i->mFilename);
-		rContext.GetProgressNotifier().NotifyFileDeleted(
-			i->mDirectoryID, i->mLocalPath);
+		THROW_EXCEPTION_MESSAGE(ConnectionException,
+			Protocol_UnexpectedReply, "Delete command failed: "
+			"received error " << error);
 	}
+
+	// Clear the directory list
+	mDirectoryList.clear();
 }
 
 
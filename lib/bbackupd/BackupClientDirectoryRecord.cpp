@@ -20,11 +20,16 @@
 #include "autogen_BackupProtocol.h"
 #include "autogen_CipherException.h"
 #include "autogen_ClientException.h"
+#include "autogen_ConnectionException.h"
 #include "Archive.h"
+#include "BackupClientBlockIndexCache.h"
+#include "BackupClientChangeJournal.h"
 #include "BackupClientContext.h"
 #include "BackupClientDirectoryRecord.h"
 #include "BackupClientInodeToIDMap.h"
+#include "BackupClientUploadChannels.h"
 #include "BackupDaemon.h"
+#include "BackupStoreConstants.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreFileEncodeStream.h"
@@ -56,6 +61,7 @@ BackupClientDirectoryRecord::BackupClientDirectoryRecord(int64_t ObjectID, const
 	  mSubDirName(rSubDirName),
 	  mInitialSyncDone(false),
 	  mSyncDone(false),
+	  mUnchangedSubtree(false),
 	  mpPendingEntries(0)
 {
 	::memset(mStateChecksum, 0, sizeof(mStateChecksum));
@@ -132,26 +138,48 @@ std::string BackupClientDirectoryRecord::ConvertVssPathToRealPath(
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupClientDirectoryRecord::SyncDirectory(i
+//		Name:    BackupClientDirectoryRecord::ScanDirectory(
 //			 BackupClientDirectoryRecord::SyncParams &,
 //			 int64_t, const std::string &,
-//			 const std::string &, bool)
-//		Purpose: Recursively synchronise a local directory
-//			 with the server.
-//		Created: 2003/10/08
+//			 const Location &)
+//		Purpose: First half of SyncDirectory(): read the local
+//			 directory, and work out whether it has changed.
+//			 The results are kept until SyncScannedDirectory()
+//			 is called. Returns false if the directory can't be
+//			 read, and should be ignored for now.
+//		Created: 2026/10/18
 //
 // --------------------------------------------------------------------------
-void BackupClientDirectoryRecord::SyncDirectory(
+bool BackupClientDirectoryRecord::ScanDirectory(
 	BackupClientDirectoryRecord::SyncParams &rParams,
 	int64_t ContainingDirectoryID,
 	const std::string &rLocalPath,
-	const std::string &rRemotePath,
-	const Location& rBackupLocation,
-	bool ThisDirHasJustBeenCreated)
+	const Location& rBackupLocation)
 {
 	BackupClientContext& rContext(rParams.mrContext);
 	ProgressNotifier& rNotifier(rContext.GetProgressNotifier());
 
+	// Nothing has changed in here since it was last synced, so there's
+	// no need to read it, or anything below it
+	if(mUnchangedSubtree)
+	{
+		BOX_TRACE("Skipping unchanged directory " << rLocalPath);
+		if(rParams.mpScanner)
+		{
+			rParams.mpScanner->Discard(rLocalPath);
+		}
+		return false;
+	}
+
+	mapScan.reset(new LocalScan);
+
+	// Take the contents of the directory, if they've been read already
+	std::auto_ptr<BackupClientDirectoryScanner::Listing> apListing;
+	if(rParams.mpScanner)
+	{
+		apListing = rParams.mpScanner->Get(rLocalPath);
+	}
+
 	// Signal received by daemon?
 	if(rParams.mrRunStatusProvider.StopRun())
 	{
@@ -179,7 +207,7 @@ void BackupClientDirectoryRecord::SyncDirectory(
 	// Build the current state checksum to compare against while
 	// getting info from dirs. Note checksum is used locally only,
 	// so byte order isn't considered.
-	MD5Digest currentStateChecksum;
+	MD5Digest &currentStateChecksum(mapScan->mStateChecksum);
 	
 	EMU_STRUCT_STAT dest_st;
 	// Stat the directory, to get attribute info
@@ -195,13 +223,19 @@ void BackupClientDirectoryRecord::SyncDirectory(
 			rNotifier.NotifyDirStatFailed(this,
 				ConvertVssPathToRealPath(rLocalPath, rBackupLocation),
 				strerror(errno));
-			return;
+			return false;
 		}
 
 		BOX_TRACE("Stat dir '" << rLocalPath << "' "
 			"found device/inode " <<
 			dest_st.st_dev << "/" << dest_st.st_ino);
 
+		// Watch it before reading it, so that no changes are missed
+		if(rParams.mpChangeJournal)
+		{
+			rParams.mpChangeJournal->Watch(rLocalPath);
+		}
+
 		// Store inode number in map so directories are tracked
 		// in case they're renamed
 		{
@@ -233,9 +267,10 @@ void BackupClientDirectoryRecord::SyncDirectory(
 	
 	// Read directory entries, building arrays of names
 	// First, need to read the contents of the directory.
-	std::vector<std::string> dirs;
-	std::vector<std::string> files;
-	bool downloadDirectoryRecordBecauseOfFutureFiles = false;
+	std::vector<std::string> &dirs(mapScan->mDirs);
+	std::vector<std::string> &files(mapScan->mFiles);
+	bool &downloadDirectoryRecordBecauseOfFutureFiles(
+		mapScan->mDownloadBecauseOfFutureFiles);
 
 	// BLOCK
 	{
@@ -247,11 +282,26 @@ void BackupClientDirectoryRecord::SyncDirectory(
 					rBackupLocation);
 			rNotifier.NotifyScanDirectory(this, nonVssDirPath);
 
-			dirHandle = ::opendir(rLocalPath.c_str());
-			if(dirHandle == 0)
+			int openErrno = 0;
+			if(apListing.get())
+			{
+				openErrno = apListing->mOpenErrno;
+				mapScan->mReadTime = apListing->mReadTime;
+			}
+			else
+			{
+				mapScan->mReadTime = GetCurrentBoxTime();
+				dirHandle = ::opendir(rLocalPath.c_str());
+				if(dirHandle == 0)
+				{
+					openErrno = errno;
+				}
+			}
+
+			if(openErrno != 0)
 			{
 				// Report the error (logs and eventual email to administrator)
-				if (errno == EACCES)
+				if (openErrno == EACCES)
 				{
 					rNotifier.NotifyDirListFailed(this,
 						nonVssDirPath,
@@ -261,22 +311,50 @@ void BackupClientDirectoryRecord::SyncDirectory(
 				{
 					rNotifier.NotifyDirListFailed(this,
 						nonVssDirPath,
-						strerror(errno));
+						strerror(openErrno));
 				}
 
 				// Report the error (logs and eventual email
 				// to administrator)
 				SetErrorWhenReadingFilesystemObject(rParams,
 					nonVssDirPath);
+				if(rParams.mpChangeJournal)
+				{
+					rParams.mpChangeJournal->MarkFailed(rLocalPath);
+				}
 				// Ignore this directory for now.
-				return;
+				return false;
 			}
 
-			struct dirent *en = 0;
+			// Go through the entries in the order that readdir()
+			// returned them, whether that was just now or earlier
+			BackupClientDirectoryScanner::Entry readEntry;
+			size_t nextListed = 0;
 			int num_entries_found = 0;
 
-			while((en = ::readdir(dirHandle)) != 0)
+			while(true)
 			{
+				const BackupClientDirectoryScanner::Entry *pEntry;
+				if(apListing.get())
+				{
+					if(nextListed == apListing->mEntries.size())
+					{
+						break;
+					}
+					pEntry = &(apListing->mEntries[nextListed++]);
+				}
+				else
+				{
+					struct dirent *en = ::readdir(dirHandle);
+					if(en == 0)
+					{
+						break;
+					}
+					BackupClientDirectoryScanner::EntryFromDirent(en,
+						readEntry);
+					pEntry = &readEntry;
+				}
+
 				num_entries_found++;
 				rParams.mrContext.DoKeepAlive();
 				if(rParams.mpBackgroundTask)
@@ -288,7 +366,7 @@ void BackupClientDirectoryRecord::SyncDirectory(
 
 				if (!SyncDirectoryEntry(rParams, rNotifier,
 					rBackupLocation, rLocalPath,
-					currentStateChecksum, en, dest_st, dirs,
+					currentStateChecksum, *pEntry, dest_st, dirs,
 					files, downloadDirectoryRecordBecauseOfFutureFiles))
 				{
 					// This entry is not to be backed up.
@@ -296,7 +374,7 @@ void BackupClientDirectoryRecord::SyncDirectory(
 				}
 			}
 	
-			if(::closedir(dirHandle) != 0)
+			if(dirHandle != 0 && ::closedir(dirHandle) != 0)
 			{
 				THROW_EXCEPTION(CommonException, OSFileError)
 			}
@@ -313,16 +391,117 @@ void BackupClientDirectoryRecord::SyncDirectory(
 	}
 
 	// Finish off the checksum, and compare with the one currently stored
-	bool checksumDifferent = true;
 	currentStateChecksum.Finish();
 	if(mInitialSyncDone && currentStateChecksum.DigestMatches(mStateChecksum))
 	{
 		// The checksum is the same, and there was one to compare with
-		checksumDifferent = false;
+		mapScan->mChecksumDifferent = false;
+	}
+
+	// The sub directories will be scanned soon, so start reading them
+	if(rParams.mpScanner)
+	{
+		for(std::vector<std::string>::const_iterator d = dirs.begin();
+			d != dirs.end(); d++)
+		{
+			std::map<std::string, BackupClientDirectoryRecord *>::
+				const_iterator e(mSubDirectories.find(*d));
+			if(e != mSubDirectories.end() &&
+				e->second->mUnchangedSubtree)
+			{
+				// Won't be read at all
+				continue;
+			}
+
+			std::string subDirPath(MakeFullPath(rLocalPath, *d));
+			if(rParams.mpChangeJournal)
+			{
+				// Before it's read, not when it's synced
+				rParams.mpChangeJournal->Watch(subDirPath);
+			}
+			rParams.mpScanner->Prefetch(subDirPath);
+		}
+	}
+
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::SyncDirectory(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 int64_t, const std::string &,
+//			 const std::string &, bool)
+//		Purpose: Recursively synchronise a local directory
+//			 with the server.
+//		Created: 2003/10/08
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::SyncDirectory(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	int64_t ContainingDirectoryID,
+	const std::string &rLocalPath,
+	const std::string &rRemotePath,
+	const Location& rBackupLocation,
+	bool ThisDirHasJustBeenCreated)
+{
+	if(ScanDirectory(rParams, ContainingDirectoryID, rLocalPath,
+		rBackupLocation))
+	{
+		SyncScannedDirectory(rParams, ContainingDirectoryID,
+			rLocalPath, rRemotePath, rBackupLocation,
+			ThisDirHasJustBeenCreated);
 	}
+}
 
-	// Pointer to potentially downloaded store directory info
-	std::auto_ptr<BackupStoreDirectory> apDirOnStore;
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::NeedsListing(bool)
+//		Purpose: After ScanDirectory(), whether SyncScannedDirectory()
+//			 will need the listing of the directory on the store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientDirectoryRecord::NeedsListing(bool ThisDirHasJustBeenCreated) const
+{
+	ASSERT(mapScan.get() != NULL);
+	return !ThisDirHasJustBeenCreated &&
+		(!mInitialSyncDone || mapScan->mChecksumDifferent ||
+		 mapScan->mDownloadBecauseOfFutureFiles);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::SyncScannedDirectory(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 int64_t, const std::string &,
+//			 const std::string &, bool)
+//		Purpose: Second half of SyncDirectory(): compare what
+//			 ScanDirectory() found with the store, upload the
+//			 differences and recurse into sub directories.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::SyncScannedDirectory(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	int64_t ContainingDirectoryID,
+	const std::string &rLocalPath,
+	const std::string &rRemotePath,
+	const Location& rBackupLocation,
+	bool ThisDirHasJustBeenCreated)
+{
+	bool needsListing = NeedsListing(ThisDirHasJustBeenCreated);
+	std::auto_ptr<LocalScan> apScan(mapScan);
+	MD5Digest &currentStateChecksum(apScan->mStateChecksum);
+	bool checksumDifferent = apScan->mChecksumDifferent;
+
+	// Pointer to potentially downloaded store directory info, which
+	// might have been fetched already along with those of other
+	// directories (see FetchDirectoryListings)
+	std::auto_ptr<BackupStoreDirectory> apDirOnStore(apScan->mapDirOnStore);
 	
 	try
 	{
@@ -334,8 +513,7 @@ void BackupClientDirectoryRecord::SyncDirectory(
 				ContainingDirectoryID));
 		}
 		// Consider asking the store for it
-		else if(!mInitialSyncDone || checksumDifferent ||
-			downloadDirectoryRecordBecauseOfFutureFiles)
+		else if(needsListing && apDirOnStore.get() == NULL)
 		{
 			apDirOnStore = FetchDirectoryListing(rParams);
 		}
@@ -367,7 +545,7 @@ void BackupClientDirectoryRecord::SyncDirectory(
 		// Do the directory reading
 		bool updateCompleteSuccess = UpdateItems(rParams, rLocalPath,
 			rRemotePath, rBackupLocation, apDirOnStore.get(),
-			entriesLeftOver, files, dirs);
+			entriesLeftOver, apScan->mFiles, apScan->mDirs);
 		
 		// LAST THING! (think exception safety)
 		// Store the new checksum -- don't fetch things unnecessarily
@@ -380,12 +558,34 @@ void BackupClientDirectoryRecord::SyncDirectory(
 		{
 			currentStateChecksum.CopyDigestTo(mStateChecksum);
 		}
+
+		// Only skip it in future if everything in it was uploaded,
+		// and nothing is waiting until it's old enough. Anything
+		// which changed after it was read is still to be synced.
+		if(rParams.mpChangeJournal)
+		{
+			if(!rParams.mrContext.StorageLimitExceeded() &&
+				updateCompleteSuccess && mpPendingEntries == 0 &&
+				!apScan->mDownloadBecauseOfFutureFiles)
+			{
+				rParams.mpChangeJournal->MarkClean(rLocalPath,
+					apScan->mReadTime);
+			}
+			else
+			{
+				rParams.mpChangeJournal->MarkFailed(rLocalPath);
+			}
+		}
 	}
 	catch(...)
 	{
 		// Bad things have happened -- clean up
 		// Set things so that we get a full go at stuff later
 		::memset(mStateChecksum, 0, sizeof(mStateChecksum));
+		if(rParams.mpChangeJournal)
+		{
+			rParams.mpChangeJournal->MarkFailed(rLocalPath);
+		}
 		
 		throw;
 	}
@@ -413,13 +613,13 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 	const Location& rBackupLocation,
 	const std::string &rDirLocalPath,
 	MD5Digest& currentStateChecksum,
-	struct dirent *en,
+	const BackupClientDirectoryScanner::Entry &rEntry,
 	EMU_STRUCT_STAT dir_st,
 	std::vector<std::string>& rDirs,
 	std::vector<std::string>& rFiles,
 	bool& rDownloadDirectoryRecordBecauseOfFutureFiles)
 {
-	std::string entry_name = en->d_name;
+	const std::string &entry_name(rEntry.mName);
 	if(entry_name == "." || entry_name == "..")
 	{
 		// ignore parent directory entries
@@ -436,12 +636,12 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 	// Don't stat the file just yet, to ensure that users can exclude
 	// unreadable files to suppress warnings that they are not accessible.
 	//
-	// Our emulated readdir() abuses en->d_type, which would normally
+	// Our emulated readdir() abuses d_type (mAttributes here), which would normally
 	// contain DT_REG, DT_DIR, etc, but we only use it here and prefer to
 	// have the full file attributes.
 
 	int type;
-	if (en->d_type & FILE_ATTRIBUTE_DIRECTORY)
+	if (rEntry.mAttributes & FILE_ATTRIBUTE_DIRECTORY)
 	{
 		type = S_IFDIR;
 	}
@@ -450,7 +650,20 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 		type = S_IFREG;
 	}
 #else // !WIN32
-	if(EMU_LSTAT(filename.c_str(), &file_st) != 0)
+	int statResult;
+	if(rEntry.mStatDone)
+	{
+		// The scanner did it already
+		file_st = rEntry.mStat;
+		statResult = (rEntry.mStatErrno == 0) ? 0 : -1;
+		errno = rEntry.mStatErrno;
+	}
+	else
+	{
+		statResult = EMU_LSTAT(filename.c_str(), &file_st);
+	}
+
+	if(statResult != 0)
 	{
 		// We don't know whether it's a file or a directory, so check
 		// both. This only affects whether a warning message is
@@ -519,7 +732,7 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 		// parent directory under Vista and later, and causes an
 		// infinite loop:
 		// http://social.msdn.microsoft.com/forums/en-US/windowscompatibility/thread/05d14368-25dd-41c8-bdba-5590bf762a68/
-		if (en->d_type & FILE_ATTRIBUTE_REPARSE_POINT)
+		if (rEntry.mAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
 		{
 			rNotifier.NotifyMountPointSkipped(this, realFileName);
 			return false;
@@ -592,7 +805,7 @@ bool BackupClientDirectoryRecord::SyncDirectoryEntry(
 	checksum_info.mAttributeModificationTime = FileAttrModificationTime(file_st);
 	checksum_info.mSize = file_st.st_size;
 	currentStateChecksum.Add(&checksum_info, sizeof(checksum_info));
-	currentStateChecksum.Add(en->d_name, strlen(en->d_name));
+	currentStateChecksum.Add(entry_name.c_str(), entry_name.size());
 	
 	// If the file has been modified madly into the future, download the 
 	// directory record anyway to ensure that it doesn't get uploaded
@@ -657,6 +870,101 @@ BackupClientDirectoryRecord::FetchDirectoryListing(
 	return apDir;
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::FetchDirectoryListings(
+//			 BackupClientDirectoryRecord::SyncParams &,
+//			 const std::vector<BackupClientDirectoryRecord *> &)
+//		Purpose: Fetch the listings of several directories which
+//			 have been scanned, for SyncScannedDirectory() to
+//			 use. The commands are pipelined, so that there's
+//			 only one round trip to the store if the server
+//			 accepts that.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::FetchDirectoryListings(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	const std::vector<BackupClientDirectoryRecord *> &rRecords)
+{
+	BackupProtocolCallable &connection(rParams.mrContext.GetConnection());
+	size_t window = connection.GetMaxQueuedQueries();
+	size_t sent = 0, received = 0;
+	std::string error;
+
+	try
+	{
+		while(received < rRecords.size())
+		{
+			// Keep the pipeline full, unless there's been an error
+			while(error.empty() && sent < rRecords.size() &&
+				sent - received < window)
+			{
+				connection.SendQueued(BackupProtocolListDirectory(
+					rRecords[sent]->mObjectID,
+					BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+					BackupProtocolListDirectory::Flags_Deleted |
+					BackupProtocolListDirectory::Flags_OldVersion,
+					true /* want attributes */), sent);
+				sent++;
+			}
+
+			if(received == sent)
+			{
+				// Stopped sending because of an error, and
+				// everything that was sent has been received
+				break;
+			}
+
+			int64_t tag;
+			std::auto_ptr<BackupProtocolMessage> apReply(
+				connection.ReceiveQueued(tag));
+			ASSERT(tag == (int64_t)received);
+			received++;
+
+			if(apReply->GetType() != BackupProtocolSuccess::TypeID)
+			{
+				if(error.empty())
+				{
+					error = ((BackupProtocolError &)*apReply).GetMessage();
+				}
+				continue;
+			}
+
+			// Retrieve the directory from the stream following,
+			// even if it won't be used, to keep in step
+			std::auto_ptr<BackupStoreDirectory> apDir(
+				new BackupStoreDirectory(connection.ReceiveStream(),
+					connection.GetTimeout()));
+			ASSERT(rRecords[tag]->mapScan.get() != NULL);
+			rRecords[tag]->mapScan->mapDirOnStore = apDir;
+		}
+	}
+	catch(...)
+	{
+		// Set things so that we get a full go at them later
+		for(size_t i = 0; i < rRecords.size(); i++)
+		{
+			::memset(rRecords[i]->mStateChecksum, 0,
+				sizeof(rRecords[i]->mStateChecksum));
+		}
+		throw;
+	}
+
+	if(!error.empty())
+	{
+		for(size_t i = 0; i < rRecords.size(); i++)
+		{
+			::memset(rRecords[i]->mStateChecksum, 0,
+				sizeof(rRecords[i]->mStateChecksum));
+		}
+		THROW_EXCEPTION_MESSAGE(ConnectionException,
+			Protocol_UnexpectedReply, "ListDirectory command "
+			"failed: received error " << error);
+	}
+}
+
 
 // --------------------------------------------------------------------------
 //
@@ -740,6 +1048,31 @@ std::string BackupClientDirectoryRecord::DecryptFilename(
 	return filenameClear;
 }
 
+// A sub directory waiting to be synchronised by UpdateItems()
+typedef struct
+{
+	BackupClientDirectoryRecord *mpRecord;
+	std::string mName;
+	bool mJustCreated;
+	bool mScanned;
+} SubDirToSync;
+
+// A file being uploaded on a data channel, which UpdateItems() will store
+// in the directory when the upload has finished
+typedef struct
+{
+	BackupClientUploadChannels::Upload *mpUpload;
+	std::string mName;
+	std::string mLocalPath;
+	std::string mNonVssPath;
+	int64_t mFileSize;
+	box_time_t mModTime;
+	uint64_t mAttributesHash;
+	InodeRefType mInodeNum;
+	box_time_t mPendingFirstSeenTime;
+	int64_t mLatestObjectID;
+} FileToCollect;
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -794,6 +1127,9 @@ bool BackupClientDirectoryRecord::UpdateItems(
 		}
 	}
 
+	// Files being uploaded on the data channels, if there are any
+	std::vector<FileToCollect> uploadsToCollect;
+
 	// Do files
 	for(std::vector<std::string>::const_iterator f = rFiles.begin();
 		f != rFiles.end(); ++f)
@@ -1059,6 +1395,7 @@ bool BackupClientDirectoryRecord::UpdateItems(
 			" (" << decisionReason << ")");
 
 		bool fileSynced = true;
+		bool uploadQueued = false;
 
 		if (doUpload)
 		{
@@ -1079,61 +1416,82 @@ bool BackupClientDirectoryRecord::UpdateItems(
 				// object ID it returns
 				bool noPreviousVersionOnServer =
 					((pDirOnStore != 0) && (en == 0));
-				
-				// Surround this in a try/catch block, to
-				// catch errors, but still continue
 				bool uploadSuccess = false;
-				try
+
+				// Whole files can be uploaded on a data channel,
+				// while we carry on with the next one. New files
+				// which might share blocks with others in the
+				// store are diffed against them instead.
+				BackupClientUploadChannels *pChannels =
+					rContext.GetUploadChannels();
+				std::auto_ptr<BackupClientUploadChannels::Upload>
+					apUpload;
+				if(pChannels &&
+					(fileSize < rParams.mDiffingUploadSizeThreshold ||
+					(noPreviousVersionOnServer &&
+					!rContext.DeduplicatingBlocks())))
 				{
-					latestObjectID = UploadFile(rParams,
-						filename,
-						nonVssFilePath,
-						rRemotePath + "/" + *f,
-						storeFilename,
-						fileSize, modTime,
-						attributesHash,
-						noPreviousVersionOnServer);
-
-					if (latestObjectID == 0)
+					apUpload.reset(
+						new BackupClientUploadChannels::Upload);
+					try
 					{
-						// storage limit exceeded
-						rParams.mrContext.SetStorageLimitExceeded();
-						uploadSuccess = false;
-						allUpdatedSuccessfully = false;
+						apUpload->mapEncoded =
+							BackupStoreFile::EncodeFile(
+								filename, mObjectID,
+								storeFilename);
+						apUpload->mapEncoded->UseOwnCipherContexts();
 					}
-					else
+					catch(BoxException &e)
 					{
-						uploadSuccess = true;
+						// Upload it on the main connection
+						// instead, which reports the error
+						apUpload.reset();
 					}
 				}
-				catch(ConnectionException &e)
+
+				if(apUpload.get())
 				{
-					// Connection errors should just be
-					// passed on to the main handler,
-					// retries would probably just cause
-					// more problems.
-					rNotifier.NotifyFileUploadException(
-						this, nonVssFilePath, e);
-					throw;
+					rNotifier.NotifyFileUploading(this,
+						nonVssFilePath);
+
+					BackupClientUploadChannels::Upload *pUpload =
+						apUpload.release();
+					pUpload->mpDirRecord = this;
+					pUpload->mNonVssPath = nonVssFilePath;
+					pUpload->mStoreFilename = storeFilename;
+					pUpload->mMaxUploadRate = rParams.mMaxUploadRate;
+					pUpload->mKeepBlockIndex =
+						rContext.GetBlockIndexCache() &&
+						fileSize >= rParams.mDiffingUploadSizeThreshold;
+					pChannels->Add(pUpload, rContext);
+
+					FileToCollect upload;
+					upload.mpUpload = pUpload;
+					upload.mName = *f;
+					upload.mLocalPath = filename;
+					upload.mNonVssPath = nonVssFilePath;
+					upload.mFileSize = fileSize;
+					upload.mModTime = modTime;
+					upload.mAttributesHash = attributesHash;
+					upload.mInodeNum = inodeNum;
+					upload.mPendingFirstSeenTime = pendingFirstSeenTime;
+					upload.mLatestObjectID = latestObjectID;
+					uploadsToCollect.push_back(upload);
+
+					// Finished off when it's collected, below
+					uploadQueued = true;
 				}
-				catch(BoxException &e)
+				else if(TryUploadFile(rParams, filename,
+					nonVssFilePath, rRemotePath + "/" + *f,
+					storeFilename, fileSize, modTime,
+					attributesHash, noPreviousVersionOnServer,
+					latestObjectID, en))
+				{
+					uploadSuccess = true;
+				}
+				else
 				{
-					if (e.GetType() == BackupStoreException::ExceptionType &&
-						e.GetSubType() == BackupStoreException::SignalReceived)
-					{
-						// abort requested, pass the
-						// exception on up.
-						throw;
-					}
-					
-					// an error occured -- make return
-					// code false, to show error in directory
 					allUpdatedSuccessfully = false;
-					// Log it.
-					SetErrorWhenReadingFilesystemObject(rParams,
-						nonVssFilePath);
-					rNotifier.NotifyFileUploadException(this,
-						nonVssFilePath, e);
 				}
 
 				// Update structures if the file was uploaded
@@ -1220,62 +1578,52 @@ bool BackupClientDirectoryRecord::UpdateItems(
 			}
 		}
 		
-		// Does this file need an entry in the ID map?
-		if(fileSize >= rParams.mFileTrackingSizeThreshold)
+		if(uploadQueued)
 		{
-			// Get the map
-			BackupClientInodeToIDMap &idMap(rContext.GetNewIDMap());
-		
-			// Need to get an ID from somewhere...
-			if(latestObjectID == 0)
-			{
-				// Don't know it -- haven't sent anything to the store, and didn't get a listing.
-				// Look it up in the current map, and if it's there, use that.
-				const BackupClientInodeToIDMap &currentIDMap(rContext.GetCurrentIDMap());
-				int64_t objid = 0, dirid = 0;
-				if(currentIDMap.Lookup(inodeNum, objid, dirid))
-				{
-					// Found
-					if (dirid != mObjectID)
-					{
-						BOX_WARNING("Found conflicting parent ID for "
-							"file ID " << inodeNum << " (" <<
-							nonVssFilePath << "): expected " <<
-							mObjectID << " but found " << dirid <<
-							" (same directory used in two different "
-							"locations?)");
-					}
+			continue;
+		}
 
-					ASSERT(dirid == mObjectID);
+		// Does this file need an entry in the ID map?
+		UpdateIDMap(rParams, fileSize, inodeNum, latestObjectID,
+			nonVssFilePath);
 
-					// NOTE: If the above assert fails, an inode number has been reused by the OS,
-					// or there is a problem somewhere. If this happened on a short test run, look
-					// into it. However, in a long running process this may happen occasionally and
-					// not indicate anything wrong.
-					// Run the release version for real life use, where this check is not made.
+		if (fileSynced)
+		{
+			rNotifier.NotifyFileSynchronised(this, nonVssFilePath,
+				fileSize);
+		}
+	}
 
-					latestObjectID = objid;
-				}
-			}
+	// Store the files uploaded on data channels, in the order that they
+	// were found, falling back to the main connection if an upload failed
+	for(std::vector<FileToCollect>::iterator i = uploadsToCollect.begin();
+		i != uploadsToCollect.end(); ++i)
+	{
+		bool uploadSuccess = CollectUpload(rParams, rRemotePath,
+			i->mpUpload, i->mName, i->mLocalPath, i->mNonVssPath,
+			i->mFileSize, i->mModTime, i->mAttributesHash,
+			i->mLatestObjectID);
 
-			if(latestObjectID != 0)
+		if(uploadSuccess)
+		{
+			// delete from pending entries
+			if(i->mPendingFirstSeenTime != 0 && mpPendingEntries != 0)
 			{
-				BOX_TRACE("Storing uploaded file ID " <<
-					inodeNum << " (" << nonVssFilePath << ") "
-					"in ID map as object " <<
-					latestObjectID << " with parent " <<
-					mObjectID);
-				idMap.AddToMap(inodeNum, latestObjectID,
-					mObjectID /* containing directory */,
-					nonVssFilePath);
+				mpPendingEntries->erase(i->mName);
 			}
-
+		}
+		else
+		{
+			allUpdatedSuccessfully = false;
 		}
 
-		if (fileSynced)
+		UpdateIDMap(rParams, i->mFileSize, i->mInodeNum,
+			i->mLatestObjectID, i->mNonVssPath);
+
+		if(uploadSuccess)
 		{
-			rNotifier.NotifyFileSynchronised(this, nonVssFilePath,
-				fileSize);
+			rNotifier.NotifyFileSynchronised(this, i->mNonVssPath,
+				i->mFileSize);
 		}
 	}
 
@@ -1291,149 +1639,197 @@ bool BackupClientDirectoryRecord::UpdateItems(
 		mpPendingEntries = 0;
 	}
 	
-	// Do directories
-	for(std::vector<std::string>::const_iterator d = rDirs.begin();
-		d != rDirs.end(); ++d)
-	{
-		// Send keep-alive message if needed
-		rContext.DoKeepAlive();
-		
-		// Get the local filename
-		std::string dirname(MakeFullPath(rLocalPath, *d));
-		std::string nonVssDirPath = ConvertVssPathToRealPath(dirname,
-			rBackupLocation);
-	
-		// See if it's in the listing (if we have one)
-		BackupStoreFilenameClear storeFilename(*d);
-		BackupStoreDirectory::Entry *en = 0;
-		if(pDirOnStore != 0)
+	// Do directories, a batch at a time. All the directories in a batch
+	// are scanned first, so that the listings of those which have changed
+	// can be fetched from the store together, before each one is
+	// synchronised in turn.
+	std::vector<std::string>::const_iterator d = rDirs.begin();
+	while(d != rDirs.end())
+	{
+		std::vector<SubDirToSync> batch;
+		for(; d != rDirs.end() &&
+			batch.size() < BACKUP_STORE_MAX_PIPELINED_COMMANDS; ++d)
 		{
-			DecryptedEntriesMap_t::iterator i(decryptedEntries.find(*d));
-			if(i != decryptedEntries.end())
+			// Send keep-alive message if needed
+			rContext.DoKeepAlive();
+			
+			// Get the local filename
+			std::string dirname(MakeFullPath(rLocalPath, *d));
+			std::string nonVssDirPath = ConvertVssPathToRealPath(dirname,
+				rBackupLocation);
+		
+			// See if it's in the listing (if we have one)
+			BackupStoreFilenameClear storeFilename(*d);
+			BackupStoreDirectory::Entry *en = 0;
+			if(pDirOnStore != 0)
 			{
-				en = i->second;
+				DecryptedEntriesMap_t::iterator i(decryptedEntries.find(*d));
+				if(i != decryptedEntries.end())
+				{
+					en = i->second;
+				}
 			}
-		}
-		
-		// Check that the entry which might have been found is in fact a directory
-		if((en != 0) && !(en->IsDir()))
-		{
-			// Entry exists, but is not a directory. Bad.
-			// Get rid of it.
-			BackupProtocolCallable &connection(rContext.GetConnection());
-			connection.QueryDeleteFile(mObjectID /* in directory */, storeFilename);
-
-			std::string filenameClear = DecryptFilename(en,
-				rRemotePath);
-			rNotifier.NotifyFileDeleted(en->GetObjectID(),
-				filenameClear);
 			
-			// Nothing found
-			en = 0;
-		}
+			// Check that the entry which might have been found is in fact a directory
+			if((en != 0) && !(en->IsDir()))
+			{
+				// Entry exists, but is not a directory. Bad.
+				// Get rid of it.
+				BackupProtocolCallable &connection(rContext.GetConnection());
+				connection.QueryDeleteFile(mObjectID /* in directory */, storeFilename);
 
-		// Zero pointer in rEntriesLeftOver, if we have a pointer to zero
-		if(en != 0)
-		{
-			for(unsigned int l = 0; l < rEntriesLeftOver.size(); ++l)
+				std::string filenameClear = DecryptFilename(en,
+					rRemotePath);
+				rNotifier.NotifyFileDeleted(en->GetObjectID(),
+					filenameClear);
+				
+				// Nothing found
+				en = 0;
+			}
+
+			// Zero pointer in rEntriesLeftOver, if we have a pointer to zero
+			if(en != 0)
 			{
-				if(rEntriesLeftOver[l] == en)
+				for(unsigned int l = 0; l < rEntriesLeftOver.size(); ++l)
 				{
-					rEntriesLeftOver[l] = 0;
-					break;
+					if(rEntriesLeftOver[l] == en)
+					{
+						rEntriesLeftOver[l] = 0;
+						break;
+					}
 				}
 			}
-		}
 
-		// Flag for having created directory, so can optimise the
-		// recursive call not to read it again, because we know
-		// it's empty.
-		bool haveJustCreatedDirOnServer = false;
+			// Flag for having created directory, so can optimise the
+			// recursive call not to read it again, because we know
+			// it's empty.
+			bool haveJustCreatedDirOnServer = false;
 
-		// Next, see if it's in the list of sub directories
-		BackupClientDirectoryRecord *psubDirRecord = 0;
-		std::map<std::string, BackupClientDirectoryRecord *>::iterator
-			e(mSubDirectories.find(*d));
+			// Next, see if it's in the list of sub directories
+			BackupClientDirectoryRecord *psubDirRecord = 0;
+			std::map<std::string, BackupClientDirectoryRecord *>::iterator
+				e(mSubDirectories.find(*d));
 
-		if(e != mSubDirectories.end())
-		{
-			// In the list, just use this pointer
-			psubDirRecord = e->second;
-		}
-		else
-		{
-			// Note: if we have exceeded our storage limit, then
-			// we should not upload any more data, nor create any
-			// DirectoryRecord representing data that would have
-			// been uploaded. This step will be repeated when
-			// there is some space available.
-			bool doCreateDirectoryRecord = true;
-			
-			// Need to create the record. But do we need to create the directory on the server?
-			int64_t subDirObjectID = 0;
-			if(en != 0)
-			{
-				// No. Exists on the server, and we know about it from the listing.
-				subDirObjectID = en->GetObjectID();
-			}
-			else if(rContext.StorageLimitExceeded())
-			// know we've got a connection if we get this far,
-			// as dir will have been modified.
+			if(e != mSubDirectories.end())
 			{
-				doCreateDirectoryRecord = false;
+				// In the list, just use this pointer
+				psubDirRecord = e->second;
 			}
 			else
 			{
-				// Yes, creation required!
-				// It is known that it doesn't exist:
-				//
-				// if en == 0 and pDirOnStore == 0, then the
-				//   directory has had an initial sync, and
-				//   hasn't been modified (Really? then why
-				//   are we here? TODO FIXME)
-				//   so it has definitely been created already
-				//   (so why create it again?)
-				//
-				// if en == 0 but pDirOnStore != 0, well... obviously it doesn't exist.
-				//
-				subDirObjectID = CreateRemoteDir(dirname,
-					nonVssDirPath, rRemotePath + "/" + *d,
-					storeFilename, &haveJustCreatedDirOnServer,
-					rParams);
-				doCreateDirectoryRecord = (subDirObjectID != 0);
-			}
-
-			if (doCreateDirectoryRecord)
-			{
-				// New an object for this
-				psubDirRecord = new BackupClientDirectoryRecord(subDirObjectID, *d);
-
-				// Store in list
-				try
+				// Note: if we have exceeded our storage limit, then
+				// we should not upload any more data, nor create any
+				// DirectoryRecord representing data that would have
+				// been uploaded. This step will be repeated when
+				// there is some space available.
+				bool doCreateDirectoryRecord = true;
+				
+				// Need to create the record. But do we need to create the directory on the server?
+				int64_t subDirObjectID = 0;
+				if(en != 0)
 				{
-					mSubDirectories[*d] = psubDirRecord;
+					// No. Exists on the server, and we know about it from the listing.
+					subDirObjectID = en->GetObjectID();
 				}
-				catch(...)
+				else if(rContext.StorageLimitExceeded())
+				// know we've got a connection if we get this far,
+				// as dir will have been modified.
+				{
+					doCreateDirectoryRecord = false;
+				}
+				else
 				{
-					delete psubDirRecord;
-					psubDirRecord = 0;
-					throw;
+					// Yes, creation required!
+					// It is known that it doesn't exist:
+					//
+					// if en == 0 and pDirOnStore == 0, then the
+					//   directory has had an initial sync, and
+					//   hasn't been modified (Really? then why
+					//   are we here? TODO FIXME)
+					//   so it has definitely been created already
+					//   (so why create it again?)
+					//
+					// if en == 0 but pDirOnStore != 0, well... obviously it doesn't exist.
+					//
+					subDirObjectID = CreateRemoteDir(dirname,
+						nonVssDirPath, rRemotePath + "/" + *d,
+						storeFilename, &haveJustCreatedDirOnServer,
+						rParams);
+					doCreateDirectoryRecord = (subDirObjectID != 0);
 				}
+
+				if (doCreateDirectoryRecord)
+				{
+					// New an object for this
+					psubDirRecord = new BackupClientDirectoryRecord(subDirObjectID, *d);
+
+					// Store in list
+					try
+					{
+						mSubDirectories[*d] = psubDirRecord;
+					}
+					catch(...)
+					{
+						delete psubDirRecord;
+						psubDirRecord = 0;
+						throw;
+					}
+				}
+			}
+
+			// ASSERT(psubDirRecord != 0 || rContext.StorageLimitExceeded());
+			// There's another possible reason now: the directory no longer
+			// existed when we finally got around to checking its
+			// attributes. See for example Brendon Baumgartner's reported
+			// error with Wordpress cache directories.
+
+			if(psubDirRecord)
+			{
+				SubDirToSync subDir;
+				subDir.mpRecord = psubDirRecord;
+				subDir.mName = *d;
+				subDir.mJustCreated = haveJustCreatedDirOnServer;
+				subDir.mScanned = false;
+				batch.push_back(subDir);
+			}
+			else if(rParams.mpScanner)
+			{
+				// Won't be scanned, so don't keep it if read ahead
+				rParams.mpScanner->Discard(dirname);
 			}
 		}
 
-		// ASSERT(psubDirRecord != 0 || rContext.StorageLimitExceeded());
-		// There's another possible reason now: the directory no longer
-		// existed when we finally got around to checking its
-		// attributes. See for example Brendon Baumgartner's reported
-		// error with Wordpress cache directories.
+		// Scan the local directories
+		std::vector<BackupClientDirectoryRecord *> needListing;
+		for(std::vector<SubDirToSync>::iterator i = batch.begin();
+			i != batch.end(); ++i)
+		{
+			i->mScanned = i->mpRecord->ScanDirectory(rParams,
+				mObjectID, MakeFullPath(rLocalPath, i->mName),
+				rBackupLocation);
+			if(i->mScanned && i->mpRecord->NeedsListing(i->mJustCreated))
+			{
+				needListing.push_back(i->mpRecord);
+			}
+		}
 
-		if(psubDirRecord)
+		// Fetch all the listings they need at once
+		if(!needListing.empty())
 		{
-			// Sync this sub directory too
-			psubDirRecord->SyncDirectory(rParams, mObjectID, dirname,
-				rRemotePath + "/" + *d, rBackupLocation,
-				haveJustCreatedDirOnServer);
+			FetchDirectoryListings(rParams, needListing);
+		}
+
+		// Sync these sub directories too
+		for(std::vector<SubDirToSync>::iterator i = batch.begin();
+			i != batch.end(); ++i)
+		{
+			if(i->mScanned)
+			{
+				i->mpRecord->SyncScannedDirectory(rParams, mObjectID,
+					MakeFullPath(rLocalPath, i->mName),
+					rRemotePath + "/" + i->mName,
+					rBackupLocation, i->mJustCreated);
+			}
 		}
 	}
 
@@ -1692,9 +2088,12 @@ void BackupClientDirectoryRecord::RemoveDirectoryInPlaceOfFile(
 //			 BackupClientDirectoryRecord::SyncParams &,
 //			 const std::string &,
 //			 const BackupStoreFilename &,
-//			 int64_t, box_time_t, box_time_t, bool)
+//			 int64_t, box_time_t, box_time_t, bool,
+//			 const BackupStoreDirectory::Entry *)
 //		Purpose: Private. Upload a file to the server. May send
-//			 a patch instead of the whole thing
+//			 a patch instead of the whole thing, against the
+//			 block index in the block index cache if it has the
+//			 one for pEntryOnStore, or the store's otherwise
 //		Created: 20/1/04
 //
 // --------------------------------------------------------------------------
@@ -1707,10 +2106,12 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 	int64_t FileSize,
 	box_time_t ModificationTime,
 	box_time_t AttributesHash,
-	bool NoPreviousVersionOnServer)
+	bool NoPreviousVersionOnServer,
+	const BackupStoreDirectory::Entry *pEntryOnStore)
 {
 	BackupClientContext& rContext(rParams.mrContext);
 	ProgressNotifier& rNotifier(rContext.GetProgressNotifier());
+	BackupClientBlockIndexCache *pIndexCache(rContext.GetBlockIndexCache());
 
 	// Get the connection
 	BackupProtocolCallable &connection(rContext.GetConnection());
@@ -1718,12 +2119,18 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 	// Info
 	int64_t objID = 0;
 	int64_t uploadedSize = -1;
+
+	// The index of the old version, if we made a patch and are going
+	// to cache the index of the new one
+	std::auto_ptr<CollectInBufferStream> apDiffFromIndex;
+	bool usedCachedIndex = false;
+	int64_t diffFromID = 0;
+	std::auto_ptr<BackupStoreFileEncodeStream> apStreamToUpload;
 	
 	// Use a try block to catch store full errors
 	try
 	{
-		std::auto_ptr<BackupStoreFileEncodeStream> apStreamToUpload;
-		int64_t diffFromID = 0;
+		std::auto_ptr<IOStream> blockIndexStream;
 
 		// Might an old version be on the server, and is the file
 		// size over the diffing threshold?
@@ -1731,42 +2138,102 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 			FileSize >= rParams.mDiffingUploadSizeThreshold)
 		{
 			// YES -- try to do diff, if possible
-			// First, query the server to see if there's an old version available
-			std::auto_ptr<BackupProtocolSuccess> getBlockIndex(connection.QueryGetBlockIndexByName(mObjectID, rStoreFilename));
-			diffFromID = getBlockIndex->GetObjectID();
-			
-			if(diffFromID != 0)
+			// If we uploaded the latest version ourselves, we
+			// may not need to ask the server for its index
+			if(pIndexCache)
+			{
+				apDiffFromIndex.reset(new CollectInBufferStream);
+			}
+
+			if(pIndexCache && pEntryOnStore)
 			{
-				// Found an old version
+				if(pIndexCache->Get(pEntryOnStore->GetObjectID(),
+					mObjectID,
+					pEntryOnStore->GetModificationTime(),
+					*apDiffFromIndex))
+				{
+					diffFromID = pEntryOnStore->GetObjectID();
+					usedCachedIndex = true;
+				}
+			}
 
-				// Get the index
-				std::auto_ptr<IOStream> blockIndexStream(connection.ReceiveStream());
-			
-				//
-				// Diff the file
-				//
+			if(!usedCachedIndex)
+			{
+				// Query the server to see if there's an old
+				// version available
+				std::auto_ptr<BackupProtocolSuccess> getBlockIndex(connection.QueryGetBlockIndexByName(mObjectID, rStoreFilename));
+				diffFromID = getBlockIndex->GetObjectID();
 
-				rContext.ManageDiffProcess();
+				if(diffFromID != 0)
+				{
+					// Get the index
+					blockIndexStream = connection.ReceiveStream();
 
-				bool isCompletelyDifferent = false;
+					if(pIndexCache)
+					{
+						// Keep it, to work out the
+						// index of the new version
+						blockIndexStream->CopyStreamTo(
+							*apDiffFromIndex,
+							connection.GetTimeout());
+						apDiffFromIndex->SetForReading();
+					}
+				}
+			}
+		}
 
-				apStreamToUpload = BackupStoreFile::EncodeFileDiff(
-					rLocalPath,
-					mObjectID, /* containing directory */
-					rStoreFilename, diffFromID, *blockIndexStream,
-					connection.GetTimeout(),
-					&rContext, // DiffTimer implementation
-					0 /* not interested in the modification time */, 
-					&isCompletelyDifferent,
-					rParams.mpBackgroundTask);
+		// If there's no old version, another file in the store
+		// might have some of the same blocks
+		if(diffFromID == 0 && rContext.DeduplicatingBlocks() &&
+			FileSize >= rParams.mDiffingUploadSizeThreshold)
+		{
+			diffFromID = FindFileWithSameBlocks(connection, rLocalPath);
+			if(diffFromID != 0)
+			{
+				connection.QueryGetBlockIndexByID(diffFromID);
+				blockIndexStream = connection.ReceiveStream();
 
-				if(isCompletelyDifferent)
+				if(pIndexCache)
 				{
-					diffFromID = 0;
+					apDiffFromIndex.reset(new CollectInBufferStream);
+					blockIndexStream->CopyStreamTo(
+						*apDiffFromIndex,
+						connection.GetTimeout());
+					apDiffFromIndex->SetForReading();
 				}
+			}
+		}
+
+		if(diffFromID != 0)
+		{
+			// Found an old version
+			IOStream &rBlockIndex(apDiffFromIndex.get() ?
+				*apDiffFromIndex : *blockIndexStream);
+
+			//
+			// Diff the file
+			//
+
+			rContext.ManageDiffProcess();
+
+			bool isCompletelyDifferent = false;
+
+			apStreamToUpload = BackupStoreFile::EncodeFileDiff(
+				rLocalPath,
+				mObjectID, /* containing directory */
+				rStoreFilename, diffFromID, rBlockIndex,
+				connection.GetTimeout(),
+				&rContext, // DiffTimer implementation
+				0 /* not interested in the modification time */, 
+				&isCompletelyDifferent,
+				rParams.mpBackgroundTask);
 
-				rContext.UnManageDiffProcess();
+			if(isCompletelyDifferent)
+			{
+				diffFromID = 0;
 			}
+
+			rContext.UnManageDiffProcess();
 		}
 
 		if(apStreamToUpload.get())
@@ -1787,6 +2254,13 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 				rParams.mpBackgroundTask);
 		}
 
+		if(rContext.DeduplicatingBlocks() &&
+			FileSize >= rParams.mDiffingUploadSizeThreshold)
+		{
+			// So that other files can be diffed against this one
+			apStreamToUpload->CollectBlockHashes();
+		}
+
 		rContext.SetNiceMode(true);
 		std::auto_ptr<IOStream> apWrappedStream;
 
@@ -1821,6 +2295,12 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 	{
 		rContext.UnManageDiffProcess();
 
+		if(usedCachedIndex)
+		{
+			// In case the cached index was the problem
+			pIndexCache->Remove(diffFromID);
+		}
+
 		if(e.GetType() == ConnectionException::ExceptionType &&
 			e.GetSubType() == ConnectionException::Protocol_UnexpectedReply)
 		{
@@ -1852,11 +2332,413 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 	rNotifier.NotifyFileUploaded(this, rNonVssFilePath, FileSize,
 		uploadedSize, objID);
 
+	if(!apStreamToUpload->GetBlockHashes().empty())
+	{
+		AddBlockHashes(connection, objID,
+			apStreamToUpload->GetBlockHashes());
+	}
+
+	if(pIndexCache)
+	{
+		// Only files big enough to be diffed need their indexes
+		const CollectInBufferStream *pIndex =
+			apStreamToUpload->GetBlockIndex();
+		if(pIndex && FileSize >= rParams.mDiffingUploadSizeThreshold)
+		{
+			pIndexCache->Add(objID, mObjectID, ModificationTime,
+				*pIndex, diffFromID ? apDiffFromIndex.get() : NULL);
+		}
+		if(pEntryOnStore)
+		{
+			// That version isn't the latest any more
+			pIndexCache->Remove(pEntryOnStore->GetObjectID());
+		}
+	}
+
 	// Return the new object ID of this file
 	return objID;
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::FindFileWithSameBlocks(
+//			 BackupProtocolCallable &, const std::string &)
+//		Purpose: Private. Asks the server which of the blocks in a
+//			 local file it already has, and returns the ID of the
+//			 file with the most of them, or 0 if there isn't one.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupClientDirectoryRecord::FindFileWithSameBlocks(
+	BackupProtocolCallable &rConnection, const std::string &rLocalPath)
+{
+	std::vector<file_BlockHash> hashes;
+	BackupStoreFile::CalculateBlockHashes(rLocalPath, hashes);
+	if(hashes.empty())
+	{
+		return 0;
+	}
+
+	std::auto_ptr<CollectInBufferStream> apHashes(
+		new CollectInBufferStream);
+	apHashes->Write(&hashes[0], hashes.size() * sizeof(file_BlockHash));
+	apHashes->SetForReading();
+
+	std::auto_ptr<BackupProtocolSuccess> found(rConnection.QueryFindBlocks(
+		static_cast< std::auto_ptr<IOStream> >(apHashes)));
+	std::auto_ptr<IOStream> locations(rConnection.ReceiveStream());
+
+	// Count the blocks found in each file
+	std::map<int64_t, int64_t> blocksInFile;
+	file_BlockLocation location;
+	for(size_t h = 0; h < hashes.size(); ++h)
+	{
+		if(!locations->ReadFullBuffer(&location, sizeof(location),
+			0 /* not interested in bytes read if this fails */,
+			rConnection.GetTimeout()))
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				BlockLocationsIncomplete)
+		}
+
+		int64_t objectID = box_ntoh64(location.mObjectID);
+		if(objectID != 0)
+		{
+			blocksInFile[objectID]++;
+		}
+	}
+
+	int64_t bestID = 0;
+	int64_t bestBlocks = 0;
+	for(std::map<int64_t, int64_t>::const_iterator
+		i(blocksInFile.begin()); i != blocksInFile.end(); ++i)
+	{
+		if(i->second > bestBlocks)
+		{
+			bestID = i->first;
+			bestBlocks = i->second;
+		}
+	}
+
+	if(bestID != 0)
+	{
+		BOX_TRACE("Diffing " << rLocalPath << " against " <<
+			BOX_FORMAT_OBJECTID(bestID) << ", which has " <<
+			bestBlocks << " of its " << hashes.size() << " blocks");
+	}
+
+	return bestID;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::AddBlockHashes(
+//			 BackupProtocolCallable &, int64_t,
+//			 const std::vector<file_BlockHash> &)
+//		Purpose: Private. Tells the server the hashes of the blocks
+//			 in a file just uploaded. If it doesn't accept them,
+//			 other files just won't be diffed against this one.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::AddBlockHashes(
+	BackupProtocolCallable &rConnection, int64_t ObjectID,
+	const std::vector<file_BlockHash> &rHashes)
+{
+	std::auto_ptr<CollectInBufferStream> apHashes(
+		new CollectInBufferStream);
+	apHashes->Write(&rHashes[0], rHashes.size() * sizeof(file_BlockHash));
+	apHashes->SetForReading();
+
+	try
+	{
+		rConnection.QueryAddBlockHashes(ObjectID,
+			static_cast< std::auto_ptr<IOStream> >(apHashes));
+	}
+	catch(ConnectionException &e)
+	{
+		if(e.GetSubType() != ConnectionException::Protocol_UnexpectedReply)
+		{
+			throw;
+		}
+
+		BOX_WARNING("Failed to index the blocks of " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << " on the server: " <<
+			e.what());
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::TryUploadFile(
+//			 SyncParams &, const std::string &,
+//			 const std::string &, const std::string &,
+//			 const BackupStoreFilenameClear &, int64_t,
+//			 box_time_t, box_time_t, bool, int64_t &,
+//			 const BackupStoreDirectory::Entry *)
+//		Purpose: Private. Upload a file with UploadFile(),
+//			 logging any errors which shouldn't stop the rest of
+//			 the directory being backed up. Returns true, and
+//			 sets rLatestObjectID to the new object ID, if the
+//			 file was uploaded.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientDirectoryRecord::TryUploadFile(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	const std::string &rLocalPath,
+	const std::string &rNonVssFilePath,
+	const std::string &rRemotePath,
+	const BackupStoreFilenameClear &rStoreFilename,
+	int64_t FileSize,
+	box_time_t ModificationTime,
+	box_time_t AttributesHash,
+	bool NoPreviousVersionOnServer,
+	int64_t &rLatestObjectID,
+	const BackupStoreDirectory::Entry *pEntryOnStore)
+{
+	ProgressNotifier& rNotifier(rParams.mrContext.GetProgressNotifier());
+
+	// Surround this in a try/catch block, to
+	// catch errors, but still continue
+	try
+	{
+		rLatestObjectID = UploadFile(rParams, rLocalPath,
+			rNonVssFilePath, rRemotePath, rStoreFilename,
+			FileSize, ModificationTime, AttributesHash,
+			NoPreviousVersionOnServer, pEntryOnStore);
+
+		if (rLatestObjectID == 0)
+		{
+			// storage limit exceeded
+			rParams.mrContext.SetStorageLimitExceeded();
+			return false;
+		}
+	}
+	catch(ConnectionException &e)
+	{
+		// Connection errors should just be
+		// passed on to the main handler,
+		// retries would probably just cause
+		// more problems.
+		rNotifier.NotifyFileUploadException(
+			this, rNonVssFilePath, e);
+		throw;
+	}
+	catch(BoxException &e)
+	{
+		if (e.GetType() == BackupStoreException::ExceptionType &&
+			e.GetSubType() == BackupStoreException::SignalReceived)
+		{
+			// abort requested, pass the
+			// exception on up.
+			throw;
+		}
+
+		// an error occured -- return false,
+		// to show error in directory
+		// Log it.
+		SetErrorWhenReadingFilesystemObject(rParams,
+			rNonVssFilePath);
+		rNotifier.NotifyFileUploadException(this,
+			rNonVssFilePath, e);
+		return false;
+	}
+
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::CollectUpload(
+//			 SyncParams &, const std::string &,
+//			 BackupClientUploadChannels::Upload *,
+//			 const std::string &, const std::string &,
+//			 const std::string &, int64_t, box_time_t,
+//			 box_time_t, int64_t &)
+//		Purpose: Private. Wait for a file being uploaded on a data
+//			 channel, and store it in this directory. If the
+//			 channel failed to upload it, for any reason except
+//			 the store being full, upload it again on the main
+//			 connection instead. Returns true, and sets
+//			 rLatestObjectID to the new object ID, if the file
+//			 was stored.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientDirectoryRecord::CollectUpload(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	const std::string &rRemotePath,
+	BackupClientUploadChannels::Upload *pUpload,
+	const std::string &rName,
+	const std::string &rLocalPath,
+	const std::string &rNonVssFilePath,
+	int64_t FileSize,
+	box_time_t ModificationTime,
+	box_time_t AttributesHash,
+	int64_t &rLatestObjectID)
+{
+	BackupClientContext& rContext(rParams.mrContext);
+	ProgressNotifier& rNotifier(rContext.GetProgressNotifier());
+	BackupProtocolCallable &connection(rContext.GetConnection());
+
+	BackupClientUploadChannels *pChannels = rContext.GetUploadChannels();
+	ASSERT(pChannels != NULL);
+	std::auto_ptr<BackupClientUploadChannels::Upload> apUpload(
+		pChannels->Collect(pUpload, rContext));
+
+	bool storageLimitExceeded = apUpload->mStorageLimitExceeded;
+	if(apUpload->mStagedFileID != 0)
+	{
+		try
+		{
+			std::auto_ptr<BackupProtocolSuccess> stored(
+				connection.QueryStoreStagedFile(mObjectID,
+					ModificationTime, AttributesHash,
+					apUpload->mStagedFileID,
+					apUpload->mStoreFilename));
+
+			rLatestObjectID = stored->GetObjectID();
+			rNotifier.NotifyFileUploaded(this, rNonVssFilePath,
+				FileSize, apUpload->mBytesSent,
+				rLatestObjectID);
+
+			BackupClientBlockIndexCache *pIndexCache =
+				rContext.GetBlockIndexCache();
+			if(pIndexCache && apUpload->mapBlockIndex.get())
+			{
+				pIndexCache->Add(rLatestObjectID, mObjectID,
+					ModificationTime, *apUpload->mapBlockIndex,
+					NULL);
+			}
+			return true;
+		}
+		catch(ConnectionException &e)
+		{
+			int type, subtype;
+			if(e.GetSubType() != ConnectionException::Protocol_UnexpectedReply ||
+				!connection.GetLastError(type, subtype) ||
+				type != BackupProtocolError::ErrorType)
+			{
+				rNotifier.NotifyFileUploadException(this,
+					rNonVssFilePath, e);
+				throw;
+			}
+			else if(subtype == BackupProtocolError::Err_StorageLimitExceeded)
+			{
+				storageLimitExceeded = true;
+			}
+			else
+			{
+				rNotifier.NotifyFileUploadServerError(this,
+					rNonVssFilePath, type, subtype);
+			}
+		}
+	}
+	else if(!storageLimitExceeded)
+	{
+		BOX_WARNING("Failed to upload file on data channel " <<
+			apUpload->mChannel << ", will try again on the main "
+			"connection: " << rNonVssFilePath << ": " <<
+			apUpload->mError);
+	}
+
+	if(storageLimitExceeded)
+	{
+		// The hard limit was exceeded on the server, notify!
+		rParams.mrSysadminNotifier.NotifySysadmin(
+			SysadminNotifier::StoreFull);
+		rContext.SetStorageLimitExceeded();
+		return false;
+	}
+
+	// The main connection won't try to send a patch, as the file
+	// wasn't on the store, or was too small to diff
+	return TryUploadFile(rParams, rLocalPath, rNonVssFilePath,
+		rRemotePath + "/" + rName, BackupStoreFilenameClear(rName),
+		FileSize, ModificationTime, AttributesHash,
+		true /* NoPreviousVersionOnServer */, rLatestObjectID);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::UpdateIDMap(
+//			 SyncParams &, int64_t, InodeRefType, int64_t,
+//			 const std::string &)
+//		Purpose: Private. Record a file in the new ID map, if it's
+//			 big enough to be worth tracking renames of. If the
+//			 object ID isn't known, looks for it in the current
+//			 map instead.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::UpdateIDMap(
+	BackupClientDirectoryRecord::SyncParams &rParams,
+	int64_t FileSize,
+	InodeRefType InodeNum,
+	int64_t LatestObjectID,
+	const std::string &rNonVssFilePath)
+{
+	if(FileSize >= rParams.mFileTrackingSizeThreshold)
+	{
+		// Get the map
+		BackupClientInodeToIDMap &idMap(rParams.mrContext.GetNewIDMap());
+	
+		// Need to get an ID from somewhere...
+		if(LatestObjectID == 0)
+		{
+			// Don't know it -- haven't sent anything to the store, and didn't get a listing.
+			// Look it up in the current map, and if it's there, use that.
+			const BackupClientInodeToIDMap &currentIDMap(rParams.mrContext.GetCurrentIDMap());
+			int64_t objid = 0, dirid = 0;
+			if(currentIDMap.Lookup(InodeNum, objid, dirid))
+			{
+				// Found
+				if (dirid != mObjectID)
+				{
+					BOX_WARNING("Found conflicting parent ID for "
+						"file ID " << InodeNum << " (" <<
+						rNonVssFilePath << "): expected " <<
+						mObjectID << " but found " << dirid <<
+						" (same directory used in two different "
+						"locations?)");
+				}
+
+				ASSERT(dirid == mObjectID);
+
+				// NOTE: If the above assert fails, an inode number has been reused by the OS,
+				// or there is a problem somewhere. If this happened on a short test run, look
+				// into it. However, in a long running process this may happen occasionally and
+				// not indicate anything wrong.
+				// Run the release version for real life use, where this check is not made.
+
+				LatestObjectID = objid;
+			}
+		}
+
+		if(LatestObjectID != 0)
+		{
+			BOX_TRACE("Storing uploaded file ID " <<
+				InodeNum << " (" << rNonVssFilePath << ") "
+				"in ID map as object " <<
+				LatestObjectID << " with parent " <<
+				mObjectID);
+			idMap.AddToMap(InodeNum, LatestObjectID,
+				mObjectID /* containing directory */,
+				rNonVssFilePath);
+		}
+
+	}
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1908,6 +2790,8 @@ BackupClientDirectoryRecord::SyncParams::SyncParams(
   mFileTrackingSizeThreshold(16*1024),
   mDiffingUploadSizeThreshold(16*1024),
   mpBackgroundTask(pBackgroundTask),
+  mpScanner(NULL),
+  mpChangeJournal(NULL),
   mrRunStatusProvider(rRunStatusProvider),
   mrSysadminNotifier(rSysadminNotifier),
   mrProgressNotifier(rProgressNotifier),
@@ -1932,6 +2816,74 @@ BackupClientDirectoryRecord::SyncParams::~SyncParams()
 {
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::FindUnchangedSubtrees(
+//			 const BackupClientChangeJournal *,
+//			 const std::string &)
+//		Purpose: Work out which directories, at this level and
+//			 below, have been synced completely and haven't
+//			 changed since, and nor has anything below them.
+//			 ScanDirectory() will skip those. If pJournal is
+//			 NULL, nothing is skipped. Returns whether this
+//			 directory can be skipped.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientDirectoryRecord::FindUnchangedSubtrees(
+	const BackupClientChangeJournal *pJournal,
+	const std::string &rLocalPath)
+{
+	bool unchanged = (pJournal != NULL && mInitialSyncDone &&
+		mpPendingEntries == 0 && !pJournal->IsChanged(rLocalPath));
+
+	// Visit all of them, to clear the flags left from last time
+	for(std::map<std::string, BackupClientDirectoryRecord *>::iterator
+		i  = mSubDirectories.begin();
+		i != mSubDirectories.end(); ++i)
+	{
+		if(!i->second->FindUnchangedSubtrees(pJournal,
+			MakeFullPath(rLocalPath, i->first)))
+		{
+			unchanged = false;
+		}
+	}
+
+	mUnchangedSubtree = unchanged;
+	return unchanged;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryRecord::GetUnchangedSubtrees(
+//			 const std::string &, std::vector<std::string> &)
+//		Purpose: After FindUnchangedSubtrees(), add the paths of the
+//			 topmost directories which will be skipped to
+//			 rPathsOut
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryRecord::GetUnchangedSubtrees(
+	const std::string &rLocalPath,
+	std::vector<std::string> &rPathsOut) const
+{
+	if(mUnchangedSubtree)
+	{
+		rPathsOut.push_back(rLocalPath);
+		return;
+	}
+
+	for(std::map<std::string, BackupClientDirectoryRecord *>::const_iterator
+		i  = mSubDirectories.begin();
+		i != mSubDirectories.end(); ++i)
+	{
+		i->second->GetUnchangedSubtrees(MakeFullPath(rLocalPath, i->first),
+			rPathsOut);
+	}
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -13,11 +13,15 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <vector>
 
 #include "BackgroundTask.h"
+#include "BackupClientDirectoryScanner.h"
 #include "BackupClientFileAttributes.h"
+#include "BackupClientUploadChannels.h"
 #include "BackupDaemonInterface.h"
 #include "BackupStoreDirectory.h"
+#include "BackupStoreFileWire.h"
 #include "BoxTime.h"
 #include "MD5Digest.h"
 #include "ReadLoggingStream.h"
@@ -31,8 +35,10 @@
 #endif
 
 class Archive;
+class BackupClientChangeJournal;
 class BackupClientContext;
 class BackupDaemon;
+class BackupProtocolCallable;
 class ExcludeList;
 class Location;
 
@@ -94,6 +100,10 @@ public:
 		int32_t mFileTrackingSizeThreshold;
 		int32_t mDiffingUploadSizeThreshold;
 		BackgroundTask *mpBackgroundTask;
+		// Reads directories ahead of the sync, if not NULL
+		BackupClientDirectoryScanner *mpScanner;
+		// Watches the directories scanned for changes, if not NULL
+		BackupClientChangeJournal *mpChangeJournal;
 		RunStatusProvider &mrRunStatusProvider;
 		SysadminNotifier &mrSysadminNotifier;
 		ProgressNotifier &mrProgressNotifier;
@@ -141,12 +151,26 @@ public:
 		const Location& rBackupLocation,
 		bool ThisDirHasJustBeenCreated = false);
 
+	// SyncDirectory() in two halves, so that the listings of several
+	// directories can be fetched from the store at once in between
+	bool ScanDirectory(SyncParams &rParams,
+		int64_t ContainingDirectoryID,
+		const std::string &rLocalPath,
+		const Location& rBackupLocation);
+	bool NeedsListing(bool ThisDirHasJustBeenCreated) const;
+	void SyncScannedDirectory(SyncParams &rParams,
+		int64_t ContainingDirectoryID,
+		const std::string &rLocalPath,
+		const std::string &rRemotePath,
+		const Location& rBackupLocation,
+		bool ThisDirHasJustBeenCreated);
+
 	bool SyncDirectoryEntry(SyncParams &rParams,
 		ProgressNotifier& rNotifier,
 		const Location& rBackupLocation,
 		const std::string &rDirLocalPath,
 		MD5Digest& currentStateChecksum,
-		struct dirent *en,
+		const BackupClientDirectoryScanner::Entry &rEntry,
 		EMU_STRUCT_STAT dir_st,
 		std::vector<std::string>& rDirs,
 		std::vector<std::string>& rFiles,
@@ -157,9 +181,18 @@ public:
 
 	int64_t GetObjectID() const { return mObjectID; }
 
+	// Which directories the next sync can skip, because nothing in them
+	// has changed since they were last synced successfully
+	bool FindUnchangedSubtrees(const BackupClientChangeJournal *pJournal,
+		const std::string &rLocalPath);
+	void GetUnchangedSubtrees(const std::string &rLocalPath,
+		std::vector<std::string> &rPathsOut) const;
+
 private:
 	void DeleteSubDirectories();
 	std::auto_ptr<BackupStoreDirectory> FetchDirectoryListing(SyncParams &rParams);
+	static void FetchDirectoryListings(SyncParams &rParams,
+		const std::vector<BackupClientDirectoryRecord *> &rRecords);
 	void UpdateAttributes(SyncParams &rParams,
 		BackupStoreDirectory *pDirOnStore,
 		const std::string &rLocalPath);
@@ -185,7 +218,32 @@ private:
 		const std::string &rRemotePath,
 		const BackupStoreFilenameClear &rStoreFilename,
 		int64_t FileSize, box_time_t ModificationTime,
-		box_time_t AttributesHash, bool NoPreviousVersionOnServer);
+		box_time_t AttributesHash, bool NoPreviousVersionOnServer,
+		const BackupStoreDirectory::Entry *pEntryOnStore = NULL);
+	int64_t FindFileWithSameBlocks(BackupProtocolCallable &rConnection,
+		const std::string &rLocalPath);
+	void AddBlockHashes(BackupProtocolCallable &rConnection,
+		int64_t ObjectID, const std::vector<file_BlockHash> &rHashes);
+	bool TryUploadFile(SyncParams &rParams,
+		const std::string &rFilename,
+		const std::string &rNonVssFilePath,
+		const std::string &rRemotePath,
+		const BackupStoreFilenameClear &rStoreFilename,
+		int64_t FileSize, box_time_t ModificationTime,
+		box_time_t AttributesHash, bool NoPreviousVersionOnServer,
+		int64_t &rLatestObjectID,
+		const BackupStoreDirectory::Entry *pEntryOnStore = NULL);
+	bool CollectUpload(SyncParams &rParams,
+		const std::string &rRemotePath,
+		BackupClientUploadChannels::Upload *pUpload,
+		const std::string &rName,
+		const std::string &rFilename,
+		const std::string &rNonVssFilePath,
+		int64_t FileSize, box_time_t ModificationTime,
+		box_time_t AttributesHash, int64_t &rLatestObjectID);
+	void UpdateIDMap(SyncParams &rParams, int64_t FileSize,
+		InodeRefType InodeNum, int64_t LatestObjectID,
+		const std::string &rNonVssFilePath);
 	void SetErrorWhenReadingFilesystemObject(SyncParams &rParams,
 		const std::string& rFilename);
 	void RemoveDirectoryInPlaceOfFile(SyncParams &rParams,
@@ -202,10 +260,38 @@ private:
 	std::string 	mSubDirName;
 	bool 		mInitialSyncDone;
 	bool 		mSyncDone;
+	// Set by FindUnchangedSubtrees(), not saved
+	bool		mUnchangedSubtree;
 
 	// Checksum of directory contents and attributes, used to detect changes
 	uint8_t mStateChecksum[MD5Digest::DigestLength];
 
+	// What ScanDirectory() found, kept until SyncScannedDirectory()
+	class LocalScan
+	{
+	public:
+		LocalScan()
+		: mDownloadBecauseOfFutureFiles(false),
+		  mChecksumDifferent(true),
+		  mReadTime(0)
+		{ }
+	private:
+		// no copying
+		LocalScan(const LocalScan &);
+		LocalScan &operator=(const LocalScan &);
+	public:
+		MD5Digest mStateChecksum;
+		std::vector<std::string> mDirs;
+		std::vector<std::string> mFiles;
+		bool mDownloadBecauseOfFutureFiles;
+		bool mChecksumDifferent;
+		// when the directory was read
+		box_time_t mReadTime;
+		// the listing on the store, if it's been fetched already
+		std::auto_ptr<BackupStoreDirectory> mapDirOnStore;
+	};
+	std::auto_ptr<LocalScan> mapScan;
+
 	std::map<std::string, box_time_t> *mpPendingEntries;
 	std::map<std::string, BackupClientDirectoryRecord *> mSubDirectories;
 	// mpPendingEntries is a pointer rather than simple a member
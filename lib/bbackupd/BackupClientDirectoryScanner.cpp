@@ -0,0 +1,444 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientDirectoryScanner.cpp
+//		Purpose: Read local directories, and stat their entries, in
+//			 background threads ahead of the backup
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
+
+#include "BackupClientDirectoryScanner.h"
+#include "PathUtils.h"
+
+#include "MemLeakFindOn.h"
+
+// Stat the entries relative to the open directory, instead of looking up
+// the whole path of each one again
+#if defined HAVE_FSTATAT && defined HAVE_DIRFD && !defined WIN32
+	#define SCANNER_USE_FSTATAT
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::BackupClientDirectoryScanner(int, int64_t)
+//		Purpose: Constructor. Starts the threads. Nothing is read
+//			 ahead if there are none, or the platform doesn't
+//			 support threads.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientDirectoryScanner::BackupClientDirectoryScanner(int NumberOfThreads,
+	int64_t MaxBufferedEntries)
+: mBufferedEntries(0),
+  mMaxBufferedEntries(MaxBufferedEntries),
+  mStopping(false)
+{
+#ifdef WIN32
+	// The entries need more than our readdir() emulation gives us
+	NumberOfThreads = 0;
+#endif
+
+	if(!Thread::IsSupported())
+	{
+		NumberOfThreads = 0;
+	}
+
+	try
+	{
+		for(int i = 0; i < NumberOfThreads; i++)
+		{
+			mThreads.push_back(NULL);
+			mThreads.back() = new ScannerThread(*this);
+			mThreads.back()->Start();
+		}
+	}
+	catch(...)
+	{
+		Stop();
+		throw;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::~BackupClientDirectoryScanner()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientDirectoryScanner::~BackupClientDirectoryScanner()
+{
+	Stop();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Stop()
+//		Purpose: Stop the threads, and throw away anything that
+//			 they've read which hasn't been used
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::Stop()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mWorkAvailable.Broadcast();
+	}
+
+	for(size_t i = 0; i < mThreads.size(); i++)
+	{
+		if(mThreads[i])
+		{
+			mThreads[i]->Join();
+			delete mThreads[i];
+		}
+	}
+	mThreads.clear();
+
+	// No other threads are left. Discarded jobs which were in progress
+	// were deleted by their threads, so all the rest are in the map.
+	mQueue.clear();
+	for(std::map<std::string, Job *>::iterator i = mJobs.begin();
+		i != mJobs.end(); i++)
+	{
+		DeleteJob(i->second);
+	}
+	mJobs.clear();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Prefetch(const std::string &)
+//		Purpose: Ask for a directory to be read in the background,
+//			 because Get() will be called for it soon. Ignored if
+//			 there are no threads, or too much has been read
+//			 ahead already.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::Prefetch(const std::string &rPath)
+{
+	if(mThreads.empty())
+	{
+		return;
+	}
+
+	MutexLock lock(mMutex);
+
+	if(mQueue.size() >= BACKUP_CLIENT_SCANNER_MAX_QUEUED_DIRECTORIES ||
+		mBufferedEntries >= mMaxBufferedEntries ||
+		mJobs.find(rPath) != mJobs.end())
+	{
+		return;
+	}
+
+	Job *pJob = new Job;
+	pJob->mPath = rPath;
+	pJob->mState = Job_Queued;
+	pJob->mDiscarded = false;
+	pJob->mpListing = NULL;
+
+	try
+	{
+		mJobs[rPath] = pJob;
+		mQueue.push_back(pJob);
+	}
+	catch(...)
+	{
+		mJobs.erase(rPath);
+		delete pJob;
+		throw;
+	}
+
+	mWorkAvailable.Signal();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Get(const std::string &)
+//		Purpose: Take the contents of a directory which was passed
+//			 to Prefetch(), waiting for a thread to finish
+//			 reading it if necessary. Returns NULL if it wasn't
+//			 prefetched, or no thread had started on it yet, in
+//			 which case the caller should read the directory
+//			 itself.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupClientDirectoryScanner::Listing>
+BackupClientDirectoryScanner::Get(const std::string &rPath)
+{
+	std::auto_ptr<Listing> apListing;
+
+	if(mThreads.empty())
+	{
+		return apListing;
+	}
+
+	MutexLock lock(mMutex);
+
+	std::map<std::string, Job *>::iterator i(mJobs.find(rPath));
+	if(i == mJobs.end())
+	{
+		return apListing;
+	}
+
+	Job *pJob = i->second;
+	mJobs.erase(i);
+
+	if(pJob->mState == Job_Queued)
+	{
+		// Quicker for the caller to read it than to wait
+		for(std::deque<Job *>::iterator q = mQueue.begin();
+			q != mQueue.end(); q++)
+		{
+			if(*q == pJob)
+			{
+				mQueue.erase(q);
+				break;
+			}
+		}
+		DeleteJob(pJob);
+		return apListing;
+	}
+
+	while(pJob->mState == Job_InProgress)
+	{
+		mJobFinished.Wait(mMutex);
+	}
+
+	if(pJob->mState == Job_Done)
+	{
+		apListing.reset(pJob->mpListing);
+		pJob->mpListing = NULL;
+		mBufferedEntries -= apListing->mEntries.size();
+		mWorkAvailable.Broadcast();
+	}
+
+	DeleteJob(pJob);
+	return apListing;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::Discard(const std::string &)
+//		Purpose: Forget about a directory which was passed to
+//			 Prefetch(), but won't be backed up after all.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::Discard(const std::string &rPath)
+{
+	if(mThreads.empty())
+	{
+		return;
+	}
+
+	MutexLock lock(mMutex);
+
+	std::map<std::string, Job *>::iterator i(mJobs.find(rPath));
+	if(i == mJobs.end())
+	{
+		return;
+	}
+
+	Job *pJob = i->second;
+	mJobs.erase(i);
+
+	if(pJob->mState == Job_InProgress)
+	{
+		// The thread reading it will delete it
+		pJob->mDiscarded = true;
+		return;
+	}
+
+	if(pJob->mState == Job_Queued)
+	{
+		for(std::deque<Job *>::iterator q = mQueue.begin();
+			q != mQueue.end(); q++)
+		{
+			if(*q == pJob)
+			{
+				mQueue.erase(q);
+				break;
+			}
+		}
+	}
+	else if(pJob->mState == Job_Done)
+	{
+		mBufferedEntries -= pJob->mpListing->mEntries.size();
+		mWorkAvailable.Broadcast();
+	}
+
+	DeleteJob(pJob);
+}
+
+void BackupClientDirectoryScanner::DeleteJob(Job *pJob)
+{
+	delete pJob->mpListing;
+	delete pJob;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::ThreadMain()
+//		Purpose: Main loop of the threads: read the oldest queued
+//			 directory, unless too much has been read already.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::ThreadMain()
+{
+	while(true)
+	{
+		Job *pJob;
+
+		{
+			MutexLock lock(mMutex);
+			while(!mStopping && (mQueue.empty() ||
+				mBufferedEntries >= mMaxBufferedEntries))
+			{
+				mWorkAvailable.Wait(mMutex);
+			}
+
+			if(mStopping)
+			{
+				return;
+			}
+
+			pJob = mQueue.front();
+			mQueue.pop_front();
+			pJob->mState = Job_InProgress;
+		}
+
+		std::auto_ptr<Listing> apListing;
+		try
+		{
+			apListing.reset(new Listing);
+			ReadDirectory(pJob->mPath, *apListing);
+		}
+		catch(...)
+		{
+			// Leave it to the sync to read the directory, and to
+			// report any errors
+			apListing.reset();
+		}
+
+		MutexLock lock(mMutex);
+		if(pJob->mDiscarded)
+		{
+			DeleteJob(pJob);
+		}
+		else if(apListing.get() == NULL)
+		{
+			pJob->mState = Job_Failed;
+		}
+		else
+		{
+			mBufferedEntries += apListing->mEntries.size();
+			pJob->mpListing = apListing.release();
+			pJob->mState = Job_Done;
+		}
+		mJobFinished.Broadcast();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::ReadDirectory(const std::string &, Listing &)
+//		Purpose: Read all the entries of a directory, and lstat()
+//			 each one apart from . and .. Errors are recorded in
+//			 the listing, not thrown. Doesn't log anything, so
+//			 that it can be called from any thread.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::ReadDirectory(const std::string &rPath,
+	Listing &rListing)
+{
+	rListing.mReadTime = GetCurrentBoxTime();
+	DIR *dirHandle = ::opendir(rPath.c_str());
+	if(dirHandle == NULL)
+	{
+		rListing.mOpenErrno = errno;
+		return;
+	}
+
+	try
+	{
+#ifdef SCANNER_USE_FSTATAT
+		int dirHandleFd = ::dirfd(dirHandle);
+#endif
+
+		struct dirent *en;
+		while((en = ::readdir(dirHandle)) != NULL)
+		{
+			rListing.mEntries.push_back(Entry());
+			Entry &rEntry(rListing.mEntries.back());
+			EntryFromDirent(en, rEntry);
+
+			if(rEntry.mName == "." || rEntry.mName == "..")
+			{
+				continue;
+			}
+
+#ifdef SCANNER_USE_FSTATAT
+			int result = ::fstatat(dirHandleFd, en->d_name,
+				&rEntry.mStat, AT_SYMLINK_NOFOLLOW);
+#else
+			int result = EMU_LSTAT(MakeFullPath(rPath,
+				rEntry.mName).c_str(), &rEntry.mStat);
+#endif
+			rEntry.mStatDone = true;
+			rEntry.mStatErrno = (result == 0) ? 0 : errno;
+		}
+	}
+	catch(...)
+	{
+		::closedir(dirHandle);
+		throw;
+	}
+
+	::closedir(dirHandle);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientDirectoryScanner::EntryFromDirent(struct dirent *, Entry &)
+//		Purpose: Fill in an entry from what readdir() returned,
+//			 without statting it
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientDirectoryScanner::EntryFromDirent(struct dirent *pDirent,
+	Entry &rEntry)
+{
+	rEntry.mName = pDirent->d_name;
+#ifdef WIN32
+	rEntry.mAttributes = pDirent->d_type;
+#endif
+	rEntry.mStatDone = false;
+	rEntry.mStatErrno = 0;
+}
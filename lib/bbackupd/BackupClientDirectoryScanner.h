@@ -0,0 +1,136 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientDirectoryScanner.h
+//		Purpose: Read local directories, and stat their entries, in
+//			 background threads ahead of the backup
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTDIRECTORYSCANNER__H
+#define BACKUPCLIENTDIRECTORYSCANNER__H
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BoxTime.h"
+#include "Thread.h"
+
+// Stop reading ahead when this many entries have been read, but not used
+#define BACKUP_CLIENT_SCANNER_MAX_BUFFERED_ENTRIES	(256*1024)
+
+// and don't remember more directories than this to read ahead
+#define BACKUP_CLIENT_SCANNER_MAX_QUEUED_DIRECTORIES	(16*1024)
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientDirectoryScanner
+//		Purpose: A pool of threads which read the entries of
+//			 directories that will be backed up soon, and stat
+//			 each entry, so that the (often slow) filesystem
+//			 metadata is ready by the time that the sync needs
+//			 it. The entries are kept in the order that readdir()
+//			 returned them. Directories which are asked for
+//			 before a thread has started on them aren't waited
+//			 for: the caller should read them itself.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientDirectoryScanner
+{
+public:
+	BackupClientDirectoryScanner(int NumberOfThreads,
+		int64_t MaxBufferedEntries =
+			BACKUP_CLIENT_SCANNER_MAX_BUFFERED_ENTRIES);
+	~BackupClientDirectoryScanner();
+private:
+	// no copying
+	BackupClientDirectoryScanner(const BackupClientDirectoryScanner &);
+	BackupClientDirectoryScanner &operator=(
+		const BackupClientDirectoryScanner &);
+public:
+	// One entry in a directory
+	class Entry
+	{
+	public:
+		Entry() : mStatDone(false), mStatErrno(0) { }
+		std::string mName;
+#ifdef WIN32
+		// Our emulated readdir() puts the file attributes in d_type
+		int mAttributes;
+#endif
+		// Whether mStat and mStatErrno have been filled in, with the
+		// result of lstat() and errno if that failed (0 otherwise)
+		bool mStatDone;
+		int mStatErrno;
+		EMU_STRUCT_STAT mStat;
+	};
+
+	// The contents of a directory
+	class Listing
+	{
+	public:
+		Listing() : mOpenErrno(0), mReadTime(0) { }
+		// errno if the directory couldn't be opened, 0 otherwise
+		int mOpenErrno;
+		// when it was opened
+		box_time_t mReadTime;
+		// including . and .., in the order that readdir() found them
+		std::vector<Entry> mEntries;
+	};
+
+	void Prefetch(const std::string &rPath);
+	std::auto_ptr<Listing> Get(const std::string &rPath);
+	void Discard(const std::string &rPath);
+	int GetNumberOfThreads() const { return mThreads.size(); }
+
+	static void ReadDirectory(const std::string &rPath, Listing &rListing);
+	static void EntryFromDirent(struct dirent *pDirent, Entry &rEntry);
+
+private:
+	class ScannerThread : public Thread
+	{
+	public:
+		ScannerThread(BackupClientDirectoryScanner &rScanner)
+		: mrScanner(rScanner) { }
+	protected:
+		virtual void Run() { mrScanner.ThreadMain(); }
+	private:
+		BackupClientDirectoryScanner &mrScanner;
+	};
+
+	typedef enum
+	{
+		Job_Queued,
+		Job_InProgress,
+		Job_Done,
+		Job_Failed
+	} JobState;
+
+	typedef struct
+	{
+		std::string mPath;
+		JobState mState;
+		bool mDiscarded;
+		Listing *mpListing;
+	} Job;
+
+	void ThreadMain();
+	void Stop();
+	void DeleteJob(Job *pJob);
+
+	Mutex mMutex;
+	ConditionVariable mWorkAvailable, mJobFinished;
+	std::vector<ScannerThread *> mThreads;
+	std::map<std::string, Job *> mJobs; // by path, in any state
+	std::deque<Job *> mQueue; // not started yet, oldest first
+	int64_t mBufferedEntries, mMaxBufferedEntries;
+	bool mStopping;
+};
+
+#endif // BACKUPCLIENTDIRECTORYSCANNER__H
@@ -10,8 +10,24 @@
 #include "Box.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <depot.h>
 
+#ifdef HAVE_SYS_MMAN_H
+	#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+// qdbm allocates the records that it returns with the real malloc(), so they
+// must be freed here, before the memory leak finder replaces free()
+static void FreeQdbmRecord(char *pRecord)
+{
+	free(pRecord);
+}
+
 #define BACKIPCLIENTINODETOIDMAP_IMPLEMENTATION
 #include "BackupClientInodeToIDMap.h"
 #undef BACKIPCLIENTINODETOIDMAP_IMPLEMENTATION
@@ -19,6 +35,7 @@
 #include "Archive.h"
 #include "BackupStoreException.h"
 #include "CollectInBufferStream.h"
+#include "FileStream.h"
 #include "MemBlockStream.h"
 #include "autogen_CommonException.h"
 
@@ -27,6 +44,30 @@
 #define BOX_DBM_INODE_DB_VERSION_KEY "BackupClientInodeToIDMap.Version"
 #define BOX_DBM_INODE_DB_VERSION_CURRENT 2
 
+// A compact map starts with the magic number and version, followed by the
+// records in order of inode number, in blocks. The first record in each
+// block has the whole inode number, and the rest have the difference from
+// the one before. The sparse index follows the records, with the first
+// inode number and file offset of each block, and then the trailer: the
+// offset of the index, the number of blocks and records, and the magic
+// number again.
+#define BOX_COMPACT_IDMAP_MAGIC		0x69644d70 // idMp
+#define BOX_COMPACT_IDMAP_VERSION	1
+#define BOX_COMPACT_IDMAP_HEADER_SIZE	8
+#define BOX_COMPACT_IDMAP_INDEX_ENTRY_SIZE	16
+#define BOX_COMPACT_IDMAP_TRAILER_SIZE	28
+
+// Runs of sorted records are kept in this file, next to the new map, until
+// they're merged into it
+#define BOX_COMPACT_IDMAP_RUNS_SUFFIX	".runs"
+
+// Size of the buffers used to write compact maps, and read runs
+#define BOX_COMPACT_IDMAP_BUFFER_SIZE	(64*1024)
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+	#define COMPACT_IDMAP_USE_MMAP
+#endif
+
 #define BOX_DBM_MESSAGE(stuff) stuff << " (qdbm): " << dperrmsg(dpecode)
 
 #define BOX_LOG_DBM_ERROR(stuff) \
@@ -44,14 +85,14 @@
 	}
 
 #define ASSERT_DBM_OPEN() \
-	if(mpDepot == 0) \
+	if(!IsOpen()) \
 	{ \
 		THROW_EXCEPTION_MESSAGE(BackupStoreException, InodeMapNotOpen, \
 			"Inode database not open"); \
 	}
 
 #define ASSERT_DBM_CLOSED() \
-	if(mpDepot != 0) \
+	if(IsOpen()) \
 	{ \
 		THROW_EXCEPTION_MESSAGE(CommonException, Internal, \
 			"Inode database already open: " << mFilename); \
@@ -68,7 +109,13 @@
 BackupClientInodeToIDMap::BackupClientInodeToIDMap()
 	: mReadOnly(true),
 	  mEmpty(false),
-	  mpDepot(0)
+	  mpDepot(0),
+	  mFormat(Format_Qdbm),
+	  mPendingSize(0),
+	  mpCompactData(0),
+	  mCompactDataSize(0),
+	  mCompactIndexOffset(0),
+	  mCompactNumBlocks(0)
 {
 }
 
@@ -82,7 +129,7 @@ BackupClientInodeToIDMap::BackupClientInodeToIDMap()
 // --------------------------------------------------------------------------
 BackupClientInodeToIDMap::~BackupClientInodeToIDMap()
 {
-	if(mpDepot != 0)
+	if(IsOpen())
 	{
 		Close();
 	}
@@ -91,13 +138,50 @@ BackupClientInodeToIDMap::~BackupClientInodeToIDMap()
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupClientInodeToIDMap::Open(const char *, bool, bool)
-//		Purpose: Open the database map, creating a file on disc to store everything
+//		Name:    BackupClientInodeToIDMap::IsOpen()
+//		Purpose: Whether a map file is open, in either format
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientInodeToIDMap::IsOpen() const
+{
+	return mpDepot != 0 || mapCompactFile.get() != 0 || mpCompactData != 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    IsCompactMapFile(const std::string &)
+//		Purpose: Whether an existing map file is in the compact
+//			 format, rather than a qdbm database
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool IsCompactMapFile(const std::string &rFilename)
+{
+	FileStream file(rFilename);
+	uint32_t magic = 0;
+	int bytes_read = 0;
+	if(!file.ReadFullBuffer(&magic, sizeof(magic), &bytes_read))
+	{
+		return false;
+	}
+	return ntohl(magic) == BOX_COMPACT_IDMAP_MAGIC;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::Open(const char *, bool, bool, Format)
+//		Purpose: Open the database map, creating a file on disc to
+//			 store everything. New maps are created in the
+//			 format given, and existing ones are opened in
+//			 whichever format they're in.
 //		Created: 20/11/03
 //
 // --------------------------------------------------------------------------
 void BackupClientInodeToIDMap::Open(const char *Filename, bool ReadOnly,
-	bool CreateNew)
+	bool CreateNew, Format NewFormat)
 {
 	mFilename = Filename;
 
@@ -107,6 +191,23 @@ void BackupClientInodeToIDMap::Open(const char *Filename, bool ReadOnly,
 	// Correct usage?
 	ASSERT_DBM_CLOSED();
 	ASSERT(!mEmpty);
+
+	if(CreateNew)
+	{
+		mFormat = NewFormat;
+	}
+	else
+	{
+		mFormat = IsCompactMapFile(mFilename) ? Format_Compact :
+			Format_Qdbm;
+	}
+
+	if(mFormat == Format_Compact)
+	{
+		OpenCompact(ReadOnly, CreateNew);
+		mReadOnly = ReadOnly;
+		return;
+	}
 	
 	// Open the database file
 	int mode = ReadOnly ? DP_OREADER : DP_OWRITER;
@@ -206,6 +307,13 @@ void BackupClientInodeToIDMap::OpenEmpty()
 void BackupClientInodeToIDMap::Close()
 {
 	ASSERT_DBM_OPEN();
+
+	if(mFormat == Format_Compact)
+	{
+		CloseCompact();
+		return;
+	}
+
 	ASSERT_DBM_OK(dpclose(mpDepot), "Failed to close inode database",
 		mFilename, BackupStoreException, BerkelyDBFailure);
 	mpDepot = 0;
@@ -229,6 +337,12 @@ void BackupClientInodeToIDMap::AddToMap(InodeRefType InodeRef, int64_t ObjectID,
 		THROW_EXCEPTION(BackupStoreException, InodeMapIsReadOnly);
 	}
 
+	if(mFormat == Format_Compact)
+	{
+		AddToCompactMap(InodeRef, ObjectID, InDirectory, LocalPath);
+		return;
+	}
+
 	if(mpDepot == 0)
 	{
 		THROW_EXCEPTION(BackupStoreException, InodeMapNotOpen);
@@ -270,6 +384,12 @@ bool BackupClientInodeToIDMap::Lookup(InodeRefType InodeRef, int64_t &rObjectIDO
 		return false;
 	}
 
+	if(mFormat == Format_Compact)
+	{
+		return LookupCompact(InodeRef, rObjectIDOut, rInDirectoryOut,
+			pLocalPathOut);
+	}
+
 	if(mpDepot == 0)
 	{
 		THROW_EXCEPTION(BackupStoreException, InodeMapNotOpen);
@@ -285,9 +405,9 @@ bool BackupClientInodeToIDMap::Lookup(InodeRefType InodeRef, int64_t &rObjectIDO
 		return false;
 	}
 
-	// Free data automatically when the guard goes out of scope.
-	MemoryBlockGuard<char *> guard(data);
-	MemBlockStream stream(data, size);
+	std::string record(data, size);
+	FreeQdbmRecord(data);
+	MemBlockStream stream(record.c_str(), size);
 	Archive arc(stream, IOStream::TimeOutInfinite);
 
 	// Return data
@@ -318,3 +438,981 @@ bool BackupClientInodeToIDMap::Lookup(InodeRefType InodeRef, int64_t &rObjectIDO
 	// Found
 	return true;
 }
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    IsInDirectories(const std::string &, const std::set<std::string> &)
+//		Purpose: Whether a local path is one of a set of
+//			 directories, or anywhere below one of them
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool IsInDirectories(const std::string &rPath,
+	const std::set<std::string> &rDirectories)
+{
+	std::string path(rPath);
+	while(true)
+	{
+		if(rDirectories.find(path) != rDirectories.end())
+		{
+			return true;
+		}
+
+		std::string::size_type slash = path.rfind(DIRECTORY_SEPARATOR_ASCHAR);
+		if(slash == std::string::npos || slash == 0)
+		{
+			return false;
+		}
+		path.resize(slash);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::CopyRecordsInDirectories(
+//			 BackupClientInodeToIDMap &,
+//			 const std::vector<std::string> &) const
+//		Purpose: Add every record whose local path is in one of the
+//			 given directories, or below it, to another map. Used
+//			 to carry over the records of directories which a
+//			 sync didn't need to scan.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::CopyRecordsInDirectories(
+	BackupClientInodeToIDMap &rDest,
+	const std::vector<std::string> &rDirectories) const
+{
+	if(mEmpty || rDirectories.empty())
+	{
+		return;
+	}
+
+	std::set<std::string> dirs(rDirectories.begin(), rDirectories.end());
+
+	if(mFormat == Format_Compact)
+	{
+		CopyCompactRecordsInDirectories(rDest, dirs);
+		return;
+	}
+
+	ASSERT_DBM_OPEN();
+	ASSERT_DBM_OK(dpiterinit(mpDepot), "Failed to iterate over inode "
+		"database", mFilename, BackupStoreException, BerkelyDBFailure);
+
+	while(true)
+	{
+		int keySize;
+		char *key = dpiternext(mpDepot, &keySize);
+		if(key == NULL)
+		{
+			break;
+		}
+
+		// Skip the version record
+		if(keySize != sizeof(InodeRefType))
+		{
+			FreeQdbmRecord(key);
+			continue;
+		}
+
+		InodeRefType inodeRef;
+		memcpy(&inodeRef, key, sizeof(inodeRef));
+		FreeQdbmRecord(key);
+
+		int64_t objectID, inDirectory;
+		std::string localPath;
+		if(Lookup(inodeRef, objectID, inDirectory, &localPath) &&
+			IsInDirectories(localPath, dirs))
+		{
+			rDest.AddToMap(inodeRef, objectID, inDirectory, localPath);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    AppendVarint(std::string &, uint64_t)
+//		Purpose: Append a number to a buffer, 7 bits per byte,
+//			 least significant first, with the top bit set on
+//			 all bytes except the last
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void AppendVarint(std::string &rBuffer, uint64_t Value)
+{
+	while(Value >= 0x80)
+	{
+		rBuffer += (char)((Value & 0x7f) | 0x80);
+		Value >>= 7;
+	}
+	rBuffer += (char)Value;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    DecodeVarint(const uint8_t *&, const uint8_t *, uint64_t &)
+//		Purpose: Decode a number written by AppendVarint(),
+//			 advancing the pointer past it. Returns false if
+//			 it runs past the end, or is too long.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool DecodeVarint(const uint8_t *&rpPos, const uint8_t *pEnd,
+	uint64_t &rValueOut)
+{
+	uint64_t value = 0;
+	for(int shift = 0; shift < 64; shift += 7)
+	{
+		if(rpPos == pEnd)
+		{
+			return false;
+		}
+		uint8_t byte = *(rpPos++);
+		value |= ((uint64_t)(byte & 0x7f)) << shift;
+		if(!(byte & 0x80))
+		{
+			rValueOut = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    AppendCompactRecord(std::string &, uint64_t, int64_t, int64_t, const std::string &)
+//		Purpose: Append one record of a compact map, or a run, to
+//			 a buffer. InodeValue is either the inode number or
+//			 the difference from the previous one.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void AppendCompactRecord(std::string &rBuffer, uint64_t InodeValue,
+	int64_t ObjectID, int64_t InDirectory, const std::string &rLocalPath)
+{
+	AppendVarint(rBuffer, InodeValue);
+	AppendVarint(rBuffer, (uint64_t)ObjectID);
+	AppendVarint(rBuffer, (uint64_t)InDirectory);
+	AppendVarint(rBuffer, rLocalPath.size());
+	rBuffer += rLocalPath;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    DecodeCompactRecord(const uint8_t *&, const uint8_t *, uint64_t &, int64_t &, int64_t &, const uint8_t *&, size_t &)
+//		Purpose: Decode a record written by AppendCompactRecord(),
+//			 advancing the pointer past it. The local path is
+//			 returned as a pointer into the buffer. Returns false
+//			 if the record runs past the end.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool DecodeCompactRecord(const uint8_t *&rpPos, const uint8_t *pEnd,
+	uint64_t &rInodeValueOut, int64_t &rObjectIDOut,
+	int64_t &rInDirectoryOut, const uint8_t *&rpLocalPathOut,
+	size_t &rLocalPathSizeOut)
+{
+	uint64_t objectID, inDirectory, pathSize;
+	if(!DecodeVarint(rpPos, pEnd, rInodeValueOut) ||
+		!DecodeVarint(rpPos, pEnd, objectID) ||
+		!DecodeVarint(rpPos, pEnd, inDirectory) ||
+		!DecodeVarint(rpPos, pEnd, pathSize) ||
+		pathSize > (uint64_t)(pEnd - rpPos))
+	{
+		return false;
+	}
+
+	rObjectIDOut = (int64_t)objectID;
+	rInDirectoryOut = (int64_t)inDirectory;
+	rpLocalPathOut = rpPos;
+	rLocalPathSizeOut = pathSize;
+	rpPos += pathSize;
+	return true;
+}
+
+static uint64_t ReadCompactUint64(const uint8_t *pData)
+{
+	uint64_t value;
+	memcpy(&value, pData, sizeof(value));
+	return box_ntoh64(value);
+}
+
+static void AppendCompactUint64(std::string &rBuffer, uint64_t Value)
+{
+	Value = box_hton64(Value);
+	rBuffer.append((const char *)&Value, sizeof(Value));
+}
+
+static void AppendCompactUint32(std::string &rBuffer, uint32_t Value)
+{
+	Value = htonl(Value);
+	rBuffer.append((const char *)&Value, sizeof(Value));
+}
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientInodeToIDMap::CompactMapWriter
+//		Purpose: Writes the records of a compact map, which must be
+//			 added in order of inode number, followed by the
+//			 index and trailer. The header is written when the
+//			 file is created.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientInodeToIDMap::CompactMapWriter
+{
+public:
+	CompactMapWriter(FileStream &rFile)
+	: mrFile(rFile),
+	  mOffset(BOX_COMPACT_IDMAP_HEADER_SIZE),
+	  mNumRecords(0),
+	  mPreviousInodeRef(0)
+	{ }
+
+	void Add(InodeRefType InodeRef, int64_t ObjectID, int64_t InDirectory,
+		const std::string &rLocalPath)
+	{
+		uint64_t inodeValue;
+		if(mNumRecords % BACKUP_CLIENT_COMPACT_IDMAP_BLOCK_RECORDS == 0)
+		{
+			mIndex.push_back(std::make_pair((uint64_t)InodeRef,
+				mOffset + (int64_t)mBuffer.size()));
+			inodeValue = InodeRef;
+		}
+		else
+		{
+			ASSERT(InodeRef > mPreviousInodeRef);
+			inodeValue = InodeRef - mPreviousInodeRef;
+		}
+
+		AppendCompactRecord(mBuffer, inodeValue, ObjectID, InDirectory,
+			rLocalPath);
+		mPreviousInodeRef = InodeRef;
+		mNumRecords++;
+
+		if(mBuffer.size() >= BOX_COMPACT_IDMAP_BUFFER_SIZE)
+		{
+			Flush();
+		}
+	}
+
+	void Finish()
+	{
+		Flush();
+		int64_t indexOffset = mOffset;
+		for(std::vector<std::pair<uint64_t, int64_t> >::const_iterator
+			i = mIndex.begin(); i != mIndex.end(); i++)
+		{
+			AppendCompactUint64(mBuffer, i->first);
+			AppendCompactUint64(mBuffer, i->second);
+			if(mBuffer.size() >= BOX_COMPACT_IDMAP_BUFFER_SIZE)
+			{
+				Flush();
+			}
+		}
+		AppendCompactUint64(mBuffer, indexOffset);
+		AppendCompactUint64(mBuffer, mIndex.size());
+		AppendCompactUint64(mBuffer, mNumRecords);
+		AppendCompactUint32(mBuffer, BOX_COMPACT_IDMAP_MAGIC);
+		Flush();
+	}
+
+private:
+	void Flush()
+	{
+		mrFile.Write(mBuffer.c_str(), mBuffer.size());
+		mOffset += mBuffer.size();
+		mBuffer.clear();
+	}
+
+	FileStream &mrFile;
+	std::string mBuffer;
+	int64_t mOffset;
+	int64_t mNumRecords;
+	InodeRefType mPreviousInodeRef;
+	std::vector<std::pair<uint64_t, int64_t> > mIndex;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientInodeToIDMap::CompactRunReader
+//		Purpose: Reads back the records of one sorted run from the
+//			 runs file, a buffer at a time, so that they can be
+//			 merged with the others
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientInodeToIDMap::CompactRunReader
+{
+public:
+	CompactRunReader(FileStream &rFile, const CompactRun &rRun,
+		const std::string &rFilename)
+	: mrFile(rFile),
+	  mPosition(rRun.mOffset),
+	  mEnd(rRun.mOffset + rRun.mSize),
+	  mBufferStart(0),
+	  mFilename(rFilename)
+	{ }
+
+	// Read the next record into mRecord, returning false at the end
+	bool Next()
+	{
+		while(true)
+		{
+			const uint8_t *pStart = (const uint8_t *)mBuffer.c_str() +
+				mBufferStart;
+			const uint8_t *pEnd = (const uint8_t *)mBuffer.c_str() +
+				mBuffer.size();
+			if(pStart == pEnd && mPosition == mEnd)
+			{
+				return false;
+			}
+
+			const uint8_t *pPos = pStart;
+			uint64_t inodeValue;
+			const uint8_t *pLocalPath;
+			size_t localPathSize;
+			if(DecodeCompactRecord(pPos, pEnd, inodeValue,
+				mRecord.mObjectID, mRecord.mInDirectory,
+				pLocalPath, localPathSize))
+			{
+				mRecord.mInodeRef = inodeValue;
+				mRecord.mLocalPath.assign((const char *)pLocalPath,
+					localPathSize);
+				mBufferStart += pPos - pStart;
+				return true;
+			}
+
+			if(mPosition == mEnd)
+			{
+				THROW_FILE_ERROR("Incomplete record at end of "
+					"inode map run", mFilename,
+					BackupStoreException, BerkelyDBFailure);
+			}
+
+			// Keep the start of the incomplete record, and read
+			// the rest after it
+			mBuffer.erase(0, mBufferStart);
+			mBufferStart = 0;
+			int toRead = (int)std::min((int64_t)BOX_COMPACT_IDMAP_BUFFER_SIZE,
+				mEnd - mPosition);
+			size_t oldSize = mBuffer.size();
+			mBuffer.resize(oldSize + toRead);
+			mrFile.Seek(mPosition, IOStream::SeekType_Absolute);
+			if(!mrFile.ReadFullBuffer(&mBuffer[oldSize], toRead, NULL))
+			{
+				THROW_FILE_ERROR("Failed to read inode map run",
+					mFilename, BackupStoreException,
+					BerkelyDBFailure);
+			}
+			mPosition += toRead;
+		}
+	}
+
+	CompactRecord mRecord;
+
+private:
+	FileStream &mrFile;
+	int64_t mPosition, mEnd;
+	std::string mBuffer;
+	size_t mBufferStart;
+	std::string mFilename;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::OpenCompact(bool, bool)
+//		Purpose: Open a compact map. New ones are created with
+//			 just the header; existing ones are mapped into
+//			 memory, and can only be read.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::OpenCompact(bool ReadOnly, bool CreateNew)
+{
+	if(CreateNew)
+	{
+		mapCompactFile.reset(new FileStream(mFilename,
+			O_CREAT | O_TRUNC | O_WRONLY | O_BINARY));
+		std::string header;
+		AppendCompactUint32(header, BOX_COMPACT_IDMAP_MAGIC);
+		AppendCompactUint32(header, BOX_COMPACT_IDMAP_VERSION);
+		mapCompactFile->Write(header.c_str(), header.size());
+		mPendingSize = 0;
+	}
+	else if(!ReadOnly)
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			InodeMapIsReadOnly, "Compact inode maps can only be "
+			"written when they are created: " << mFilename);
+	}
+	else
+	{
+		MapCompactFile();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::CloseCompact()
+//		Purpose: Close a compact map. If it's new, this sorts the
+//			 records and writes them out, which can take a while
+//			 for a big one.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::CloseCompact()
+{
+	if(mapCompactFile.get() == 0)
+	{
+		UnmapCompactFile();
+		return;
+	}
+
+	try
+	{
+		WriteCompactMap();
+		mapCompactFile->Close();
+	}
+	catch(...)
+	{
+		// Leave the incomplete file for the daemon to delete, but
+		// don't try to write it again
+		mapCompactFile.reset();
+		if(mapRunsFile.get())
+		{
+			mapRunsFile.reset();
+			::unlink((mFilename + BOX_COMPACT_IDMAP_RUNS_SUFFIX).c_str());
+		}
+		mRuns.clear();
+		mPendingRecords.clear();
+		throw;
+	}
+
+	mapCompactFile.reset();
+	if(mapRunsFile.get())
+	{
+		mapRunsFile.reset();
+		::unlink((mFilename + BOX_COMPACT_IDMAP_RUNS_SUFFIX).c_str());
+	}
+	mRuns.clear();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::AddToCompactMap(InodeRefType, int64_t, int64_t, const std::string &)
+//		Purpose: Add a record to a new compact map. It's kept in
+//			 memory until there are enough to write out a run.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::AddToCompactMap(InodeRefType InodeRef,
+	int64_t ObjectID, int64_t InDirectory, const std::string& LocalPath)
+{
+	if(mapCompactFile.get() == 0)
+	{
+		THROW_EXCEPTION(BackupStoreException, InodeMapNotOpen);
+	}
+
+	mPendingRecords.push_back(CompactRecord());
+	CompactRecord &rRecord(mPendingRecords.back());
+	rRecord.mInodeRef = InodeRef;
+	rRecord.mObjectID = ObjectID;
+	rRecord.mInDirectory = InDirectory;
+	rRecord.mLocalPath = LocalPath;
+
+	mPendingSize += sizeof(CompactRecord) + LocalPath.size();
+	if(mPendingSize >= BACKUP_CLIENT_COMPACT_IDMAP_RUN_SIZE)
+	{
+		WritePendingRun();
+	}
+}
+
+bool BackupClientInodeToIDMap::CompareInodeRefs(const CompactRecord &rA,
+	const CompactRecord &rB)
+{
+	return rA.mInodeRef < rB.mInodeRef;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::SortPendingRecords()
+//		Purpose: Sort the records in memory by inode number, and
+//			 keep only the last one added for each inode, as it
+//			 overwrites the others.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::SortPendingRecords()
+{
+	std::stable_sort(mPendingRecords.begin(), mPendingRecords.end(),
+		CompareInodeRefs);
+
+	std::vector<CompactRecord>::iterator out = mPendingRecords.begin();
+	for(std::vector<CompactRecord>::iterator i = mPendingRecords.begin();
+		i != mPendingRecords.end(); i++)
+	{
+		std::vector<CompactRecord>::iterator next = i + 1;
+		if(next != mPendingRecords.end() &&
+			next->mInodeRef == i->mInodeRef)
+		{
+			continue;
+		}
+
+		if(out != i)
+		{
+			out->mInodeRef = i->mInodeRef;
+			out->mObjectID = i->mObjectID;
+			out->mInDirectory = i->mInDirectory;
+			out->mLocalPath.swap(i->mLocalPath);
+		}
+		out++;
+	}
+	mPendingRecords.erase(out, mPendingRecords.end());
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::WritePendingRun()
+//		Purpose: Sort the records in memory, and append them to the
+//			 runs file as a new run
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::WritePendingRun()
+{
+	if(mPendingRecords.empty())
+	{
+		return;
+	}
+
+	SortPendingRecords();
+
+	if(mapRunsFile.get() == 0)
+	{
+		mapRunsFile.reset(new FileStream(
+			mFilename + BOX_COMPACT_IDMAP_RUNS_SUFFIX,
+			O_CREAT | O_TRUNC | O_RDWR | O_BINARY));
+	}
+
+	CompactRun run;
+	run.mOffset = mRuns.empty() ? 0 :
+		(mRuns.back().mOffset + mRuns.back().mSize);
+	run.mSize = 0;
+
+	std::string buffer;
+	for(std::vector<CompactRecord>::const_iterator
+		i = mPendingRecords.begin(); i != mPendingRecords.end(); i++)
+	{
+		AppendCompactRecord(buffer, i->mInodeRef, i->mObjectID,
+			i->mInDirectory, i->mLocalPath);
+		if(buffer.size() >= BOX_COMPACT_IDMAP_BUFFER_SIZE)
+		{
+			mapRunsFile->Write(buffer.c_str(), buffer.size());
+			run.mSize += buffer.size();
+			buffer.clear();
+		}
+	}
+	mapRunsFile->Write(buffer.c_str(), buffer.size());
+	run.mSize += buffer.size();
+
+	mRuns.push_back(run);
+	mPendingRecords.clear();
+	mPendingSize = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::WriteCompactMap()
+//		Purpose: Write all the records of a new compact map to its
+//			 file, in order. If any runs were written, the rest
+//			 of the records are written as a run too, and all
+//			 the runs are merged, with the records from later
+//			 runs replacing earlier ones for the same inode.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::WriteCompactMap()
+{
+	CompactMapWriter writer(*mapCompactFile);
+
+	if(mRuns.empty())
+	{
+		SortPendingRecords();
+		for(std::vector<CompactRecord>::const_iterator
+			i = mPendingRecords.begin();
+			i != mPendingRecords.end(); i++)
+		{
+			writer.Add(i->mInodeRef, i->mObjectID, i->mInDirectory,
+				i->mLocalPath);
+		}
+		mPendingRecords.clear();
+		mPendingSize = 0;
+		writer.Finish();
+		return;
+	}
+
+	WritePendingRun();
+
+	// The next record from each run, smallest inode first
+	typedef std::pair<InodeRefType, size_t> queue_entry_t;
+	std::priority_queue<queue_entry_t, std::vector<queue_entry_t>,
+		std::greater<queue_entry_t> > queue;
+
+	std::vector<CompactRunReader *> readers;
+	try
+	{
+		for(size_t r = 0; r < mRuns.size(); r++)
+		{
+			readers.push_back(NULL);
+			readers.back() = new CompactRunReader(*mapRunsFile,
+				mRuns[r], mFilename + BOX_COMPACT_IDMAP_RUNS_SUFFIX);
+			if(readers.back()->Next())
+			{
+				queue.push(queue_entry_t(
+					readers.back()->mRecord.mInodeRef, r));
+			}
+		}
+
+		std::vector<size_t> same;
+		while(!queue.empty())
+		{
+			InodeRefType inodeRef = queue.top().first;
+			same.clear();
+			while(!queue.empty() && queue.top().first == inodeRef)
+			{
+				same.push_back(queue.top().second);
+				queue.pop();
+			}
+
+			// Each run has only one record for each inode, so the
+			// latest run with this one has the latest record
+			const CompactRecord &rLatest(readers[*std::max_element(
+				same.begin(), same.end())]->mRecord);
+			writer.Add(rLatest.mInodeRef, rLatest.mObjectID,
+				rLatest.mInDirectory, rLatest.mLocalPath);
+
+			for(std::vector<size_t>::const_iterator r = same.begin();
+				r != same.end(); r++)
+			{
+				if(readers[*r]->Next())
+				{
+					queue.push(queue_entry_t(
+						readers[*r]->mRecord.mInodeRef, *r));
+				}
+			}
+		}
+
+		writer.Finish();
+	}
+	catch(...)
+	{
+		for(size_t r = 0; r < readers.size(); r++)
+		{
+			delete readers[r];
+		}
+		throw;
+	}
+
+	for(size_t r = 0; r < readers.size(); r++)
+	{
+		delete readers[r];
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::MapCompactFile()
+//		Purpose: Map an existing compact map file into memory, or
+//			 read it all into memory on platforms without mmap(),
+//			 and check its header and trailer.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::MapCompactFile()
+{
+	FileStream file(mFilename);
+	int64_t size = file.BytesLeftToRead();
+	if(size < BOX_COMPACT_IDMAP_HEADER_SIZE + BOX_COMPACT_IDMAP_TRAILER_SIZE)
+	{
+		THROW_FILE_ERROR("Inode map file is too short", mFilename,
+			BackupStoreException, BerkelyDBFailure);
+	}
+
+#ifdef COMPACT_IDMAP_USE_MMAP
+	void *pMapping = ::mmap(NULL, size, PROT_READ, MAP_SHARED,
+		file.GetOSFileHandle(), 0);
+	if(pMapping == MAP_FAILED)
+	{
+		THROW_SYS_FILE_ERROR("Failed to map inode map into memory",
+			mFilename, CommonException, OSFileError);
+	}
+	mpCompactData = (const uint8_t *)pMapping;
+#else
+	uint8_t *pData = (uint8_t *)::malloc(size);
+	if(pData == 0)
+	{
+		throw std::bad_alloc();
+	}
+	mpCompactData = pData;
+	mCompactDataSize = size;
+	if(!file.ReadFullBuffer(pData, size, NULL))
+	{
+		UnmapCompactFile();
+		THROW_FILE_ERROR("Failed to read inode map", mFilename,
+			BackupStoreException, BerkelyDBFailure);
+	}
+#endif
+	mCompactDataSize = size;
+
+	uint32_t magic, version;
+	memcpy(&magic, mpCompactData, sizeof(magic));
+	memcpy(&version, mpCompactData + sizeof(magic), sizeof(version));
+
+	const uint8_t *pTrailer = mpCompactData + size -
+		BOX_COMPACT_IDMAP_TRAILER_SIZE;
+	uint64_t indexOffset = ReadCompactUint64(pTrailer);
+	uint64_t numBlocks = ReadCompactUint64(pTrailer + 8);
+	uint64_t numRecords = ReadCompactUint64(pTrailer + 16);
+	uint32_t trailerMagic;
+	memcpy(&trailerMagic, pTrailer + 24, sizeof(trailerMagic));
+
+	std::string problem;
+	if(ntohl(magic) != BOX_COMPACT_IDMAP_MAGIC ||
+		ntohl(trailerMagic) != BOX_COMPACT_IDMAP_MAGIC)
+	{
+		problem = "bad magic number";
+	}
+	else if(ntohl(version) != BOX_COMPACT_IDMAP_VERSION)
+	{
+		problem = "unknown version";
+	}
+	else if(numBlocks > (uint64_t)size / BOX_COMPACT_IDMAP_INDEX_ENTRY_SIZE ||
+		indexOffset < BOX_COMPACT_IDMAP_HEADER_SIZE ||
+		indexOffset + numBlocks * BOX_COMPACT_IDMAP_INDEX_ENTRY_SIZE +
+		BOX_COMPACT_IDMAP_TRAILER_SIZE != (uint64_t)size ||
+		numBlocks != (numRecords + BACKUP_CLIENT_COMPACT_IDMAP_BLOCK_RECORDS
+			- 1) / BACKUP_CLIENT_COMPACT_IDMAP_BLOCK_RECORDS)
+	{
+		problem = "bad index";
+	}
+
+	if(!problem.empty())
+	{
+		UnmapCompactFile();
+		THROW_FILE_ERROR("Inode map file is corrupt: " << problem,
+			mFilename, BackupStoreException, BerkelyDBFailure);
+	}
+
+	mCompactIndexOffset = indexOffset;
+	mCompactNumBlocks = numBlocks;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::UnmapCompactFile()
+//		Purpose: Release the memory holding a compact map file
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::UnmapCompactFile()
+{
+	if(mpCompactData == 0)
+	{
+		return;
+	}
+
+#ifdef COMPACT_IDMAP_USE_MMAP
+	::munmap((void *)mpCompactData, mCompactDataSize);
+#else
+	::free((void *)mpCompactData);
+#endif
+	mpCompactData = 0;
+	mCompactDataSize = 0;
+	mCompactIndexOffset = 0;
+	mCompactNumBlocks = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::LookupCompact(InodeRefType, int64_t &, int64_t &, std::string *) const
+//		Purpose: Look up an inode in a compact map: find the block
+//			 which it would be in with a binary search of the
+//			 index, and then scan that block.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientInodeToIDMap::LookupCompact(InodeRefType InodeRef,
+	int64_t &rObjectIDOut, int64_t &rInDirectoryOut,
+	std::string* pLocalPathOut) const
+{
+	if(mpCompactData == 0)
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException, InodeMapNotOpen,
+			"Compact inode maps can't be read until they have "
+			"been written: " << mFilename);
+	}
+
+	// Find the first block that starts after this inode. It's in the
+	// block before that, if any.
+	const uint8_t *pIndex = mpCompactData + mCompactIndexOffset;
+	int64_t low = 0, high = mCompactNumBlocks;
+	while(low < high)
+	{
+		int64_t mid = low + (high - low) / 2;
+		if(ReadCompactUint64(pIndex + mid *
+			BOX_COMPACT_IDMAP_INDEX_ENTRY_SIZE) <= (uint64_t)InodeRef)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	if(low == 0)
+	{
+		return false;
+	}
+
+	int64_t block = low - 1;
+	uint64_t blockStart = ReadCompactUint64(pIndex +
+		block * BOX_COMPACT_IDMAP_INDEX_ENTRY_SIZE + 8);
+	uint64_t blockEnd = (block + 1 < mCompactNumBlocks) ?
+		ReadCompactUint64(pIndex +
+			(block + 1) * BOX_COMPACT_IDMAP_INDEX_ENTRY_SIZE + 8) :
+		(uint64_t)mCompactIndexOffset;
+	if(blockStart < BOX_COMPACT_IDMAP_HEADER_SIZE ||
+		blockStart >= blockEnd ||
+		blockEnd > (uint64_t)mCompactIndexOffset)
+	{
+		THROW_FILE_ERROR("Inode map file is corrupt: bad offset for "
+			"block " << block, mFilename, BackupStoreException,
+			BerkelyDBFailure);
+	}
+
+	const uint8_t *pPos = mpCompactData + blockStart;
+	const uint8_t *pEnd = mpCompactData + blockEnd;
+	uint64_t inodeRef = 0;
+	for(int r = 0; pPos < pEnd; r++)
+	{
+		uint64_t inodeValue;
+		int64_t objectID, inDirectory;
+		const uint8_t *pLocalPath;
+		size_t localPathSize;
+		if(!DecodeCompactRecord(pPos, pEnd, inodeValue, objectID,
+			inDirectory, pLocalPath, localPathSize))
+		{
+			THROW_FILE_ERROR("Inode map file is corrupt: bad record "
+				"in block " << block, mFilename,
+				BackupStoreException, BerkelyDBFailure);
+		}
+
+		inodeRef = (r == 0) ? inodeValue : (inodeRef + inodeValue);
+		if(inodeRef == (uint64_t)InodeRef)
+		{
+			rObjectIDOut = objectID;
+			rInDirectoryOut = inDirectory;
+			if(pLocalPathOut)
+			{
+				pLocalPathOut->assign((const char *)pLocalPath,
+					localPathSize);
+			}
+			return true;
+		}
+		else if(inodeRef > (uint64_t)InodeRef)
+		{
+			break;
+		}
+	}
+
+	return false;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientInodeToIDMap::CopyCompactRecordsInDirectories(
+//			 BackupClientInodeToIDMap &,
+//			 const std::set<std::string> &) const
+//		Purpose: CopyRecordsInDirectories() for compact maps: read
+//			 all the blocks in order.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientInodeToIDMap::CopyCompactRecordsInDirectories(
+	BackupClientInodeToIDMap &rDest,
+	const std::set<std::string> &rDirectories) const
+{
+	if(mpCompactData == 0)
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException, InodeMapNotOpen,
+			"Compact inode maps can't be read until they have "
+			"been written: " << mFilename);
+	}
+
+	const uint8_t *pIndex = mpCompactData + mCompactIndexOffset;
+	for(int64_t block = 0; block < mCompactNumBlocks; block++)
+	{
+		uint64_t blockStart = ReadCompactUint64(pIndex +
+			block * BOX_COMPACT_IDMAP_INDEX_ENTRY_SIZE + 8);
+		uint64_t blockEnd = (block + 1 < mCompactNumBlocks) ?
+			ReadCompactUint64(pIndex +
+				(block + 1) * BOX_COMPACT_IDMAP_INDEX_ENTRY_SIZE + 8) :
+			(uint64_t)mCompactIndexOffset;
+		if(blockStart < BOX_COMPACT_IDMAP_HEADER_SIZE ||
+			blockStart >= blockEnd ||
+			blockEnd > (uint64_t)mCompactIndexOffset)
+		{
+			THROW_FILE_ERROR("Inode map file is corrupt: bad offset for "
+				"block " << block, mFilename, BackupStoreException,
+				BerkelyDBFailure);
+		}
+
+		const uint8_t *pPos = mpCompactData + blockStart;
+		const uint8_t *pEnd = mpCompactData + blockEnd;
+		uint64_t inodeRef = 0;
+		for(int r = 0; pPos < pEnd; r++)
+		{
+			uint64_t inodeValue;
+			int64_t objectID, inDirectory;
+			const uint8_t *pLocalPath;
+			size_t localPathSize;
+			if(!DecodeCompactRecord(pPos, pEnd, inodeValue, objectID,
+				inDirectory, pLocalPath, localPathSize))
+			{
+				THROW_FILE_ERROR("Inode map file is corrupt: bad "
+					"record in block " << block, mFilename,
+					BackupStoreException, BerkelyDBFailure);
+			}
+
+			inodeRef = (r == 0) ? inodeValue : (inodeRef + inodeValue);
+			std::string localPath((const char *)pLocalPath,
+				localPathSize);
+			if(IsInDirectories(localPath, rDirectories))
+			{
+				rDest.AddToMap(inodeRef, objectID, inDirectory,
+					localPath);
+			}
+		}
+	}
+}
@@ -13,18 +13,36 @@
 #include <sys/types.h>
 
 #include <map>
+#include <memory>
+#include <set>
+#include <string>
 #include <utility>
+#include <vector>
 
 // avoid having to include the DB files when not necessary
 #ifndef BACKIPCLIENTINODETOIDMAP_IMPLEMENTATION
 	class DEPOT;
 #endif
 
+class FileStream;
+
+// Records of a new compact map are kept in memory until they take up about
+// this many bytes, and then sorted and written to a temporary file as a run
+#define BACKUP_CLIENT_COMPACT_IDMAP_RUN_SIZE	(8*1024*1024)
+
+// Number of records between entries in the sparse index of a compact map
+#define BACKUP_CLIENT_COMPACT_IDMAP_BLOCK_RECORDS	64
+
 // --------------------------------------------------------------------------
 //
 // Class
 //		Name:    BackupClientInodeToIDMap
-//		Purpose: Map of inode numbers to file IDs on the store
+//		Purpose: Map of inode numbers to file IDs on the store.
+//			 Either a qdbm database, or a compact file of
+//			 records sorted by inode number, which is written
+//			 sequentially when a new map is closed, and read
+//			 with mmap(). Existing maps are opened in whichever
+//			 format they were written.
 //		Created: 11/11/03
 //
 // --------------------------------------------------------------------------
@@ -36,22 +54,81 @@ public:
 private:
 	BackupClientInodeToIDMap(const BackupClientInodeToIDMap &rToCopy);	// not allowed
 public:
+	typedef enum
+	{
+		Format_Qdbm,
+		Format_Compact
+	} Format;
 
-	void Open(const char *Filename, bool ReadOnly, bool CreateNew);
+	void Open(const char *Filename, bool ReadOnly, bool CreateNew,
+		Format NewFormat = Format_Qdbm);
 	void OpenEmpty();
+	Format GetFormat() const { return mFormat; }
 
 	void AddToMap(InodeRefType InodeRef, int64_t ObjectID,
 		int64_t InDirectory, const std::string& LocalPath);
 	bool Lookup(InodeRefType InodeRef, int64_t &rObjectIDOut,
 		int64_t &rInDirectoryOut, std::string* pLocalPathOut = NULL) const;
+	void CopyRecordsInDirectories(BackupClientInodeToIDMap &rDest,
+		const std::vector<std::string> &rDirectories) const;
 
 	void Close();
 
 private:
+	bool IsOpen() const;
+
+	// Compact maps
+	typedef struct
+	{
+		InodeRefType mInodeRef;
+		int64_t mObjectID;
+		int64_t mInDirectory;
+		std::string mLocalPath;
+	} CompactRecord;
+
+	typedef struct
+	{
+		int64_t mOffset;
+		int64_t mSize;
+	} CompactRun;
+
+	class CompactRunReader;
+	class CompactMapWriter;
+
+	static bool CompareInodeRefs(const CompactRecord &rA,
+		const CompactRecord &rB);
+	void OpenCompact(bool ReadOnly, bool CreateNew);
+	void CloseCompact();
+	void AddToCompactMap(InodeRefType InodeRef, int64_t ObjectID,
+		int64_t InDirectory, const std::string& LocalPath);
+	bool LookupCompact(InodeRefType InodeRef, int64_t &rObjectIDOut,
+		int64_t &rInDirectoryOut, std::string* pLocalPathOut) const;
+	void CopyCompactRecordsInDirectories(BackupClientInodeToIDMap &rDest,
+		const std::set<std::string> &rDirectories) const;
+	void SortPendingRecords();
+	void WritePendingRun();
+	void WriteCompactMap();
+	void MapCompactFile();
+	void UnmapCompactFile();
+
 	bool mReadOnly;
 	bool mEmpty;
 	std::string mFilename;
 	DEPOT *mpDepot;
+	Format mFormat;
+
+	// Compact maps being written
+	std::auto_ptr<FileStream> mapCompactFile;
+	std::vector<CompactRecord> mPendingRecords;
+	int64_t mPendingSize;
+	std::auto_ptr<FileStream> mapRunsFile;
+	std::vector<CompactRun> mRuns;
+
+	// Compact maps being read
+	const uint8_t *mpCompactData;
+	int64_t mCompactDataSize;
+	int64_t mCompactIndexOffset;
+	int64_t mCompactNumBlocks;
 };
 
 #endif // BACKUPCLIENTINODETOIDMAP_H
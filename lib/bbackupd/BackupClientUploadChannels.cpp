@@ -0,0 +1,487 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientUploadChannels.cpp
+//		Purpose: Upload whole files in parallel on extra connections
+//			 to the store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include "autogen_BackupProtocol.h"
+#include "BackupClientContext.h"
+#include "BackupClientUploadChannels.h"
+#include "BackupStoreConstants.h"
+#include "BackupStoreException.h"
+#include "BackupStoreFile.h"
+#include "BackupStoreFileEncodeStream.h"
+#include "RateLimitingStream.h"
+#include "Socket.h"
+#include "SocketStreamTLS.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    UploadProgressStream
+//		Purpose: Pass on the data read from another stream, counting
+//			 it as it goes, so that another thread can see how
+//			 far an upload has got
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class UploadProgressStream : public IOStream
+{
+public:
+	UploadProgressStream(IOStream &rSource, Mutex &rMutex,
+		int64_t &rBytesRead)
+	: mrSource(rSource),
+	  mrMutex(rMutex),
+	  mrBytesRead(rBytesRead)
+	{ }
+
+	virtual int Read(void *pBuffer, int NBytes,
+		int Timeout = IOStream::TimeOutInfinite)
+	{
+		int bytes = mrSource.Read(pBuffer, NBytes, Timeout);
+		MutexLock lock(mrMutex);
+		mrBytesRead += bytes;
+		return bytes;
+	}
+	virtual pos_type BytesLeftToRead()
+	{
+		return mrSource.BytesLeftToRead();
+	}
+	virtual void Write(const void *pBuffer, int NBytes,
+		int Timeout = IOStream::TimeOutInfinite)
+	{
+		THROW_EXCEPTION(CommonException, NotSupported)
+	}
+	virtual bool StreamDataLeft()
+	{
+		return mrSource.StreamDataLeft();
+	}
+	virtual bool StreamClosed()
+	{
+		return mrSource.StreamClosed();
+	}
+
+private:
+	IOStream &mrSource;
+	Mutex &mrMutex;
+	int64_t &mrBytesRead;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadChannels::BackupClientUploadChannels(
+//			 TLSContext &, const std::string &, int, uint32_t, int)
+//		Purpose: Constructor. Starts the threads, but doesn't
+//			 connect to the store until there's something to
+//			 upload. There are no channels if the platform
+//			 doesn't support threads.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientUploadChannels::BackupClientUploadChannels(
+	TLSContext &rTLSContext, const std::string &rHostname, int Port,
+	uint32_t AccountNumber, int NumberOfChannels)
+: mrTLSContext(rTLSContext),
+  mHostname(rHostname),
+  mPort(Port),
+  mAccountNumber(AccountNumber),
+  mUnfinished(0),
+  mStopping(false),
+  mLastNotified(0)
+{
+	// Files are encrypted as they're uploaded
+	if(!Thread::IsSupported() ||
+		!BackupStoreFileEncodeStream::OwnCipherContextsSupported())
+	{
+		NumberOfChannels = 0;
+	}
+
+	try
+	{
+		for(int i = 0; i < NumberOfChannels; i++)
+		{
+			mChannels.push_back(NULL);
+			mChannels.back() = new Channel(*this, i + 1);
+			mChannels.back()->Start();
+		}
+	}
+	catch(...)
+	{
+		Stop();
+		throw;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadChannels::~BackupClientUploadChannels()
+//		Purpose: Destructor. Waits for any uploads in progress to
+//			 finish, and closes the connections. Uploads which
+//			 haven't been collected are abandoned, and their
+//			 staged files are deleted by the store the next time
+//			 that the client logs in.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientUploadChannels::~BackupClientUploadChannels()
+{
+	Stop();
+}
+
+void BackupClientUploadChannels::Stop()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mUploadAdded.Broadcast();
+	}
+
+	for(size_t i = 0; i < mChannels.size(); i++)
+	{
+		if(mChannels[i])
+		{
+			mChannels[i]->Join();
+			delete mChannels[i];
+		}
+	}
+	mChannels.clear();
+
+	for(size_t i = 0; i < mUploads.size(); i++)
+	{
+		delete mUploads[i];
+	}
+	mUploads.clear();
+	mQueue.clear();
+}
+
+BackupClientUploadChannels::Channel::Channel(
+	BackupClientUploadChannels &rChannels, int Number)
+: mrChannels(rChannels),
+  mNumber(Number)
+{ }
+
+BackupClientUploadChannels::Channel::~Channel()
+{ }
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadChannels::Add(Upload *,
+//			 BackupClientContext &)
+//		Purpose: Queue a file to be uploaded by the next free
+//			 channel, taking ownership of pUpload until it's
+//			 collected. If too many uploads are unfinished
+//			 already, waits for one to finish first, keeping
+//			 the main connection alive meanwhile.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientUploadChannels::Add(Upload *pUpload,
+	BackupClientContext &rContext)
+{
+	std::auto_ptr<Upload> apUpload(pUpload);
+	WaitFor(NULL, rContext);
+
+	MutexLock lock(mMutex);
+	mUploads.push_back(pUpload);
+	apUpload.release();
+	try
+	{
+		mQueue.push_back(pUpload);
+	}
+	catch(...)
+	{
+		mUploads.pop_back();
+		delete pUpload;
+		throw;
+	}
+	mUnfinished++;
+	mUploadAdded.Signal();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadChannels::Collect(Upload *,
+//			 BackupClientContext &)
+//		Purpose: Wait for an upload passed to Add() to finish,
+//			 keeping the main connection alive meanwhile, and
+//			 give it back to the caller.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupClientUploadChannels::Upload>
+BackupClientUploadChannels::Collect(Upload *pUpload,
+	BackupClientContext &rContext)
+{
+	WaitFor(pUpload, rContext);
+
+	MutexLock lock(mMutex);
+	for(std::vector<Upload *>::iterator i = mUploads.begin();
+		i != mUploads.end(); i++)
+	{
+		if(*i == pUpload)
+		{
+			mUploads.erase(i);
+			return std::auto_ptr<Upload>(pUpload);
+		}
+	}
+
+	THROW_EXCEPTION_MESSAGE(CommonException, Internal,
+		"Upload to collect is not known to the upload channels");
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadChannels::WaitFor(Upload *,
+//			 BackupClientContext &)
+//		Purpose: Wait until pUpload has finished, or if it's NULL,
+//			 until another upload can be added. Meanwhile, keeps
+//			 the main connection alive, and reports the progress
+//			 of each channel about once a second.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientUploadChannels::WaitFor(Upload *pUpload,
+	BackupClientContext &rContext)
+{
+	size_t maxUnfinished = mChannels.size() *
+		BACKUP_CLIENT_UPLOADS_QUEUED_PER_CHANNEL;
+
+	typedef struct
+	{
+		const BackupClientDirectoryRecord *mpDirRecord;
+		std::string mNonVssPath;
+		int mChannel;
+		int64_t mBytesSent;
+	} Progress;
+
+	while(true)
+	{
+		std::vector<Progress> inProgress;
+
+		{
+			MutexLock lock(mMutex);
+			if(pUpload ? pUpload->mFinished :
+				(size_t)mUnfinished < maxUnfinished)
+			{
+				return;
+			}
+
+			mUploadFinished.TimedWait(mMutex, MILLI_SEC_IN_SEC);
+
+			box_time_t now = GetCurrentBoxTime();
+			if(now - mLastNotified >= SecondsToBoxTime(1))
+			{
+				mLastNotified = now;
+				for(std::vector<Upload *>::iterator
+					i = mUploads.begin();
+					i != mUploads.end(); i++)
+				{
+					if((*i)->mChannel != -1 &&
+						!(*i)->mFinished)
+					{
+						Progress progress;
+						progress.mpDirRecord = (*i)->mpDirRecord;
+						progress.mNonVssPath = (*i)->mNonVssPath;
+						progress.mChannel = (*i)->mChannel;
+						progress.mBytesSent = (*i)->mBytesSent;
+						inProgress.push_back(progress);
+					}
+				}
+			}
+		}
+
+		// Don't hold the lock while talking to the store
+		rContext.DoKeepAlive();
+
+		for(std::vector<Progress>::iterator i = inProgress.begin();
+			i != inProgress.end(); i++)
+		{
+			rContext.GetProgressNotifier().NotifyUploadChannelProgress(
+				i->mpDirRecord, i->mNonVssPath, i->mChannel,
+				i->mBytesSent);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadChannels::ChannelMain(Channel &)
+//		Purpose: Main loop of each channel's thread: upload the
+//			 oldest queued file, until stopped
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientUploadChannels::ChannelMain(Channel &rChannel)
+{
+	while(true)
+	{
+		Upload *pUpload;
+
+		{
+			MutexLock lock(mMutex);
+			while(!mStopping && mQueue.empty())
+			{
+				mUploadAdded.Wait(mMutex);
+			}
+
+			if(mStopping)
+			{
+				break;
+			}
+
+			pUpload = mQueue.front();
+			mQueue.pop_front();
+			pUpload->mChannel = rChannel.GetNumber();
+		}
+
+		UploadFile(rChannel, *pUpload);
+
+		MutexLock lock(mMutex);
+		pUpload->mFinished = true;
+		mUnfinished--;
+		mUploadFinished.Broadcast();
+	}
+
+	if(rChannel.mapConnection.get())
+	{
+		try
+		{
+			rChannel.mapConnection->QueryFinished();
+		}
+		catch(...)
+		{
+			// Ignore errors here
+		}
+		rChannel.mapConnection.reset();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadChannels::UploadFile(Channel &,
+//			 Upload &)
+//		Purpose: Stage an encoded file on the store, using the
+//			 channel's connection, opening it if necessary.
+//			 Errors are recorded in the upload, not thrown, and
+//			 the connection is dropped unless the store reported
+//			 the error, so that the next upload opens a new one.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientUploadChannels::UploadFile(Channel &rChannel,
+	Upload &rUpload)
+{
+	try
+	{
+		if(!rChannel.mapConnection.get())
+		{
+			rChannel.mapConnection = OpenConnection();
+		}
+
+		IOStream *pSource = rUpload.mapEncoded.get();
+		std::auto_ptr<IOStream> apRateLimited;
+		if(rUpload.mMaxUploadRate > 0)
+		{
+			apRateLimited.reset(new RateLimitingStream(*pSource,
+				rUpload.mMaxUploadRate));
+			pSource = apRateLimited.get();
+		}
+
+		std::auto_ptr<IOStream> apProgress(new UploadProgressStream(
+			*pSource, mMutex, rUpload.mBytesSent));
+		std::auto_ptr<BackupProtocolSuccess> staged(
+			rChannel.mapConnection->QueryStageFile(apProgress));
+		rUpload.mStagedFileID = staged->GetObjectID();
+
+		const CollectInBufferStream *pIndex =
+			rUpload.mapEncoded->GetBlockIndex();
+		if(rUpload.mKeepBlockIndex && pIndex)
+		{
+			rUpload.mapBlockIndex.reset(new CollectInBufferStream);
+			rUpload.mapBlockIndex->Write(pIndex->GetBuffer(),
+				pIndex->GetSize());
+			rUpload.mapBlockIndex->SetForReading();
+		}
+		rUpload.mapEncoded.reset();
+	}
+	catch(ConnectionException &e)
+	{
+		int type, subType;
+		if(rChannel.mapConnection.get() &&
+			e.GetSubType() == ConnectionException::Protocol_UnexpectedReply &&
+			rChannel.mapConnection->GetLastError(type, subType))
+		{
+			rUpload.mStorageLimitExceeded =
+				(type == BackupProtocolError::ErrorType &&
+				subType == BackupProtocolError::Err_StorageLimitExceeded);
+			std::ostringstream error;
+			error << "Store reported error " << type << "/" <<
+				subType << " on upload channel " <<
+				rChannel.GetNumber();
+			rUpload.mError = error.str();
+		}
+		else
+		{
+			rUpload.mError = e.what();
+			rChannel.mapConnection.reset();
+		}
+	}
+	catch(std::exception &e)
+	{
+		rUpload.mError = e.what();
+		rChannel.mapConnection.reset();
+	}
+	catch(...)
+	{
+		rUpload.mError = "Unknown error on upload channel";
+		rChannel.mapConnection.reset();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientUploadChannels::OpenConnection()
+//		Purpose: Connect to the store and log in as a data channel
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolClient>
+BackupClientUploadChannels::OpenConnection()
+{
+	std::auto_ptr<SocketStream> apSocket(new SocketStreamTLS);
+	((SocketStreamTLS *)(apSocket.get()))->Open(mrTLSContext,
+		Socket::TypeINET, mHostname, mPort);
+
+	std::auto_ptr<BackupProtocolClient> apConnection(
+		new BackupProtocolClient(apSocket));
+	apConnection->Handshake();
+
+	std::auto_ptr<BackupProtocolVersion> serverVersion(
+		apConnection->QueryVersion(
+			BACKUP_STORE_SERVER_VERSION_DATA_CHANNELS));
+	if(serverVersion->GetVersion() !=
+		BACKUP_STORE_SERVER_VERSION_DATA_CHANNELS)
+	{
+		THROW_EXCEPTION(BackupStoreException, WrongServerVersion)
+	}
+
+	apConnection->QueryLogin(mAccountNumber,
+		BackupProtocolLogin::Flags_DataChannel);
+	return apConnection;
+}
@@ -0,0 +1,149 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientUploadChannels.h
+//		Purpose: Upload whole files in parallel on extra connections
+//			 to the store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTUPLOADCHANNELS__H
+#define BACKUPCLIENTUPLOADCHANNELS__H
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BackupStoreFileEncodeStream.h"
+#include "BackupStoreFilenameClear.h"
+#include "BoxTime.h"
+#include "Thread.h"
+
+class BackupClientContext;
+class BackupClientDirectoryRecord;
+class BackupProtocolClient;
+class TLSContext;
+
+// How many uploads can wait for a channel, per channel, before the caller
+// has to wait for one of them to finish
+#define BACKUP_CLIENT_UPLOADS_QUEUED_PER_CHANNEL	4
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientUploadChannels
+//		Purpose: A thread for each of a number of data channels:
+//			 extra sessions with the store, which upload whole
+//			 files at the same time as each other and the main
+//			 connection. They only stage the files on the
+//			 server. The caller collects each upload when it's
+//			 finished, and stores it with StoreStagedFile on the
+//			 main connection, so the directories are only changed
+//			 by the main connection, in the order that it
+//			 chooses. The connections are opened as they're
+//			 needed, and closed by the destructor.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientUploadChannels
+{
+public:
+	BackupClientUploadChannels(TLSContext &rTLSContext,
+		const std::string &rHostname, int Port,
+		uint32_t AccountNumber, int NumberOfChannels);
+	~BackupClientUploadChannels();
+private:
+	// no copying
+	BackupClientUploadChannels(const BackupClientUploadChannels &);
+	BackupClientUploadChannels &operator=(
+		const BackupClientUploadChannels &);
+public:
+	// One file to upload
+	class Upload
+	{
+	public:
+		Upload()
+		: mpDirRecord(NULL),
+		  mMaxUploadRate(0),
+		  mKeepBlockIndex(false),
+		  mChannel(-1),
+		  mBytesSent(0),
+		  mStagedFileID(0),
+		  mFinished(false),
+		  mStorageLimitExceeded(false)
+		{ }
+
+		// Filled in by the caller. The file is encoded by the thread
+		// which adds it, as the filename and attributes are encrypted
+		// with shared cipher contexts, but the stream must use its own
+		// contexts for the blocks (see UseOwnCipherContexts()).
+		const BackupClientDirectoryRecord *mpDirRecord;
+		std::string mNonVssPath;
+		BackupStoreFilenameClear mStoreFilename;
+		std::auto_ptr<BackupStoreFileEncodeStream> mapEncoded;
+		int mMaxUploadRate;
+		bool mKeepBlockIndex;
+
+		// Filled in by the channel which uploads it. mStagedFileID is
+		// zero if the upload failed, with the reason in mError. The
+		// encoded stream is freed once it's uploaded, but its block
+		// index is kept in mapBlockIndex if mKeepBlockIndex was set.
+		int mChannel;
+		int64_t mBytesSent;
+		int64_t mStagedFileID;
+		bool mFinished;
+		bool mStorageLimitExceeded;
+		std::string mError;
+		std::auto_ptr<CollectInBufferStream> mapBlockIndex;
+
+	private:
+		// no copying
+		Upload(const Upload &);
+		Upload &operator=(const Upload &);
+	};
+
+	void Add(Upload *pUpload, BackupClientContext &rContext);
+	std::auto_ptr<Upload> Collect(Upload *pUpload,
+		BackupClientContext &rContext);
+	int GetNumberOfChannels() const {return mChannels.size();}
+
+private:
+	class Channel : public Thread
+	{
+	public:
+		Channel(BackupClientUploadChannels &rChannels, int Number);
+		~Channel();
+		int GetNumber() const {return mNumber;}
+		// Only used by the channel's own thread
+		std::auto_ptr<BackupProtocolClient> mapConnection;
+	protected:
+		virtual void Run() { mrChannels.ChannelMain(*this); }
+	private:
+		BackupClientUploadChannels &mrChannels;
+		int mNumber;
+	};
+
+	void ChannelMain(Channel &rChannel);
+	void UploadFile(Channel &rChannel, Upload &rUpload);
+	std::auto_ptr<BackupProtocolClient> OpenConnection();
+	void WaitFor(Upload *pUpload, BackupClientContext &rContext);
+	void Stop();
+
+	TLSContext &mrTLSContext;
+	std::string mHostname;
+	int mPort;
+	uint32_t mAccountNumber;
+
+	Mutex mMutex;
+	ConditionVariable mUploadAdded, mUploadFinished;
+	std::vector<Channel *> mChannels;
+	std::deque<Upload *> mQueue; // not started yet, oldest first
+	std::vector<Upload *> mUploads; // all of them, until collected
+	int mUnfinished;
+	bool mStopping;
+	box_time_t mLastNotified;
+};
+
+#endif // BACKUPCLIENTUPLOADCHANNELS__H
@@ -71,6 +71,7 @@
 #include "BackupStoreFile.h"
 #include "BackupStoreFilenameClear.h"
 #include "BannerText.h"
+#include "CompressCodec.h"
 #include "Conversion.h"
 #include "ExcludeList.h"
 #include "FileStream.h"
@@ -78,6 +79,7 @@
 #include "LocalProcessStream.h"
 #include "Logging.h"
 #include "Random.h"
+#include "Thread.h"
 #include "Timer.h"
 #include "Utils.h"
 
@@ -232,6 +234,7 @@ BackupDaemon::BackupDaemon()
 	  mDoSyncForcedByPreviousSyncError(false),
 	  mNumFilesUploaded(-1),
 	  mNumDirsCreated(-1),
+	  mNumDirsScanned(-1),
 	  mMaxBandwidthFromSyncAllowScript(0),
 	  mLogAllFileAccess(false),
 	  mpProgressNotifier(this),
@@ -1070,6 +1073,7 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 		SecondsToBoxTime(conf.GetKeyValueInt("MaxFileTimeInFuture"));
 	mNumFilesUploaded = 0;
 	mNumDirsCreated = 0;
+	mNumDirsScanned = 0;
 
 	if(conf.KeyExists("MaxUploadRate"))
 	{
@@ -1081,6 +1085,64 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 		params.mMaxUploadRate = mMaxBandwidthFromSyncAllowScript;
 	}
 
+	BackupStoreFile::SetAdaptiveCompression(
+		conf.GetKeyValueBool("AdaptiveCompression"));
+
+	// Compress file data with a faster codec than zlib, if configured
+	// and this build supports it
+	std::string codecName = conf.GetKeyValue("CompressionCodec");
+	int codec = CompressCodec::GetCodecByName(codecName);
+	if(codec == -1 || !CompressCodec::IsAvailable(codec))
+	{
+		BOX_WARNING("Compression codec " << codecName << " is " <<
+			((codec == -1) ? "unknown" : "not supported by this build") <<
+			", using zlib instead");
+		codec = COMPRESS_CODEC_ZLIB;
+	}
+	int compressionLevel = COMPRESS_CODEC_DEFAULT_LEVEL;
+	if(conf.KeyExists("CompressionLevel"))
+	{
+		compressionLevel = conf.GetKeyValueInt("CompressionLevel");
+	}
+	BackupStoreFile::SetCompressionCodec(codec, compressionLevel);
+
+#ifndef HAVE_OLD_SSL
+	BackupStoreFile::SetAuthenticatedEncryption(
+		conf.GetKeyValueBool("AuthenticatedEncryption"));
+#else
+	if(conf.GetKeyValueBool("AuthenticatedEncryption"))
+	{
+		BOX_WARNING("AuthenticatedEncryption is not supported by the "
+			"version of OpenSSL in use");
+	}
+#endif
+
+	// Use all the processors to encode files, unless there's only one
+	int encodingThreads = Thread::GetNumberOfProcessors();
+	if(encodingThreads < 2)
+	{
+		encodingThreads = 0;
+	}
+	if(conf.KeyExists("EncodingThreads"))
+	{
+		encodingThreads = conf.GetKeyValueInt("EncodingThreads");
+	}
+	BackupStoreFile::SetEncodingThreads(encodingThreads);
+
+	BackupStoreFile::SetContentDefinedChunking(
+		conf.GetKeyValueBool("ContentDefinedChunking"));
+
+	// Read directories and stat their entries in the background, ahead
+	// of the sync, because that's mostly waiting for the disk
+	int scannerThreads = 4;
+	if(conf.KeyExists("ScannerThreads"))
+	{
+		scannerThreads = conf.GetKeyValueInt("ScannerThreads");
+	}
+	std::auto_ptr<BackupClientDirectoryScanner> apScanner(
+		new BackupClientDirectoryScanner(scannerThreads));
+	params.mpScanner = apScanner.get();
+
 	mDeleteRedundantLocationsAfter =
 		conf.GetKeyValueInt("DeleteRedundantLocationsAfter");
 	mStorageLimitExceeded = false;
@@ -1103,6 +1165,105 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 	mapClientContext->SetMaximumDiffingTime(maximumDiffingTime);
 	mapClientContext->SetKeepAliveTime(keepAliveTime);
 
+	// Upload whole files on extra connections, if the store accepts them
+	if(conf.KeyExists("UploadConnections"))
+	{
+		mapClientContext->SetUploadConnections(
+			conf.GetKeyValueInt("UploadConnections"));
+	}
+
+	// Look for the blocks of new files in other files on the store
+	mapClientContext->SetDeduplicateBlocks(
+		conf.GetKeyValueBool("DeduplicateBlocks"));
+
+	// Keep the block indexes of the files that we upload, so that we
+	// don't have to download them again to send a patch
+	int64_t blockIndexCacheSize = 0;
+	if(conf.KeyExists("BlockIndexCacheSize"))
+	{
+		blockIndexCacheSize = (int64_t)conf.GetKeyValueInt(
+			"BlockIndexCacheSize") * 1024 * 1024;
+	}
+	if(blockIndexCacheSize > 0)
+	{
+		std::string dir(conf.GetKeyValue("DataDirectory") +
+			DIRECTORY_SEPARATOR + "blockindexcache");
+		uint32_t account = conf.GetKeyValueUint32("AccountNumber");
+		if(!mapBlockIndexCache.get() ||
+			mapBlockIndexCache->GetDirectory() != dir ||
+			mapBlockIndexCache->GetMaxSize() != blockIndexCacheSize ||
+			mapBlockIndexCache->GetAccountNumber() != account)
+		{
+			mapBlockIndexCache.reset();
+			mapBlockIndexCache.reset(new BackupClientBlockIndexCache(
+				dir, blockIndexCacheSize, account));
+		}
+		if(mClientStoreMarker ==
+			BackupClientContext::ClientStoreMarker_NotKnown)
+		{
+			// The store may not be the one that they came from
+			mapBlockIndexCache->Clear();
+		}
+	}
+	else
+	{
+		mapBlockIndexCache.reset();
+	}
+	mapClientContext->SetBlockIndexCache(mapBlockIndexCache.get());
+
+	// Watch the directories for changes, so that only the ones which have
+	// changed need to be scanned next time
+	if(conf.KeyExists("ChangeJournal") &&
+		conf.GetKeyValueBool("ChangeJournal"))
+	{
+		if(!mapChangeJournal.get())
+		{
+			try
+			{
+				mapChangeJournal.reset(
+					new BackupClientChangeJournal);
+			}
+			catch(BoxException &e)
+			{
+				BOX_WARNING("Failed to start change journal, "
+					"will scan all directories: " <<
+					e.what());
+			}
+		}
+	}
+	else
+	{
+		mapChangeJournal.reset();
+	}
+
+	bool fullScan = true;
+	if(mapChangeJournal.get())
+	{
+		box_time_t fullScanInterval = SecondsToBoxTime(
+			(time_t)86400);
+		if(conf.KeyExists("ChangeJournalFullScanInterval"))
+		{
+			fullScanInterval = SecondsToBoxTime(
+				(time_t)conf.GetKeyValueInt(
+					"ChangeJournalFullScanInterval"));
+		}
+		fullScan = mapChangeJournal->StartSync(GetCurrentBoxTime(),
+			fullScanInterval);
+
+		// The directory records may not match the store
+		if(mClientStoreMarker ==
+			BackupClientContext::ClientStoreMarker_NotKnown)
+		{
+			fullScan = true;
+		}
+
+		if(fullScan)
+		{
+			BOX_INFO("Scanning all directories this time");
+		}
+	}
+	params.mpChangeJournal = mapChangeJournal.get();
+
 	// Set store marker
 	mapClientContext->SetClientStoreMarker(mClientStoreMarker);
 
@@ -1155,6 +1316,21 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 		}
 #endif
 
+		// Skip the directories which haven't changed since they
+		// were last synced, and carry over their ID map records
+		BackupClientDirectoryRecord &rRecord(*(*i)->mapDirectoryRecord);
+		rRecord.FindUnchangedSubtrees(
+			fullScan ? NULL : mapChangeJournal.get(), locationPath);
+		if(!fullScan)
+		{
+			std::vector<std::string> unchanged;
+			rRecord.GetUnchangedSubtrees((*i)->mPath, unchanged);
+			mCurrentIDMaps[(*i)->mIDMapIndex]->
+				CopyRecordsInDirectories(
+					*mNewIDMaps[(*i)->mIDMapIndex],
+					unchanged);
+		}
+
 		(*i)->mapDirectoryRecord->SyncDirectory(params,
 			BackupProtocolListDirectory::RootDirectory,
 			locationPath, std::string("/") + (*i)->mName, **i);
@@ -1168,6 +1344,11 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 	// happen neatly.
 	mapClientContext->PerformDeletions();
 
+	if(mapChangeJournal.get())
+	{
+		mapChangeJournal->FinishSync();
+	}
+
 #ifdef ENABLE_VSS
 	CleanupVssBackupComponents();
 #endif
@@ -1765,6 +1946,10 @@ void BackupDaemon::OnBackupStart()
 
 	// Reset statistics on uploads
 	BackupStoreFile::ResetStats();
+	if(mapBlockIndexCache.get())
+	{
+		mapBlockIndexCache->ResetStats();
+	}
 	
 	// Tell anything connected to the command socket
 	SendSyncStartOrFinish(true /* start */);
@@ -1795,9 +1980,34 @@ void BackupDaemon::OnBackupFinish()
 			<< BackupStoreFile::msStats.mBytesAlreadyOnServer
 			<< ", encoded size "
 			<< BackupStoreFile::msStats.mTotalFileStreamSize
+			<< ", not compressed "
+			<< BackupStoreFile::msStats.mBytesNotCompressed
 			<< ", " << mNumFilesUploaded << " files uploaded, "
 			<< mNumDirsCreated << " dirs created");
 
+		if(mapBlockIndexCache.get())
+		{
+			int64_t hits = mapBlockIndexCache->GetHits();
+			int64_t lookups = hits + mapBlockIndexCache->GetMisses();
+			BOX_NOTICE("Block index cache: " << hits << " hits, "
+				<< (lookups - hits) << " misses ("
+				<< (lookups ? (hits * 100 / lookups) : 0)
+				<< "% hit rate), "
+				<< mapBlockIndexCache->GetNumberOfEntries()
+				<< " indexes, " << mapBlockIndexCache->GetSize()
+				<< " bytes");
+		}
+
+		if(mapChangeJournal.get())
+		{
+			BOX_NOTICE("Change journal: " << mNumDirsScanned
+				<< " dirs scanned, "
+				<< mapChangeJournal->GetNumberOfWatches()
+				<< " watched, "
+				<< mapChangeJournal->GetNumberOfChangedDirectories()
+				<< " still to sync");
+		}
+
 		// Reset statistics again
 		BackupStoreFile::ResetStats();
 
@@ -2802,6 +3012,12 @@ void BackupDaemon::FillIDMapVector(std::vector<BackupClientInodeToIDMap *> &rVec
 {
 	ASSERT(rVector.size() == 0);
 	rVector.reserve(mIDMapMounts.size());
+
+	const Configuration &config(GetConfiguration());
+	BackupClientInodeToIDMap::Format newFormat =
+		config.GetKeyValueBool("CompactIDMaps") ?
+		BackupClientInodeToIDMap::Format_Compact :
+		BackupClientInodeToIDMap::Format_Qdbm;
 	
 	for(unsigned int l = 0; l < mIDMapMounts.size(); ++l)
 	{
@@ -2845,7 +3061,8 @@ void BackupDaemon::FillIDMapVector(std::vector<BackupClientInodeToIDMap *> &rVec
 			else
 			{
 				// Open the map
-				pmap->Open(filename.c_str(), !NewMaps /* read only */, NewMaps /* create new */);
+				pmap->Open(filename.c_str(), !NewMaps /* read only */, NewMaps /* create new */,
+					newFormat);
 			}
 			
 			// Store on vector
@@ -2886,6 +3103,10 @@ void BackupDaemon::DeleteCorruptBerkelyDbFiles()
 		// Delete that too
 		BOX_TRACE("Deleting " << filename);
 		::unlink(filename.c_str());
+
+		// And any runs left over from writing a compact map
+		filename += ".runs";
+		::unlink(filename.c_str());
 	}
 }
 
@@ -14,6 +14,8 @@
 #include <string>
 #include <memory>
 
+#include "BackupClientBlockIndexCache.h"
+#include "BackupClientChangeJournal.h"
 #include "BackupClientContext.h"
 #include "BackupClientDirectoryRecord.h"
 #include "BoxTime.h"
@@ -248,10 +250,21 @@ private:
 	TLSContext mTlsContext;
 	bool mDeleteStoreObjectInfoFile;
 	bool mDoSyncForcedByPreviousSyncError;
-	int64_t mNumFilesUploaded, mNumDirsCreated;
+	int64_t mNumFilesUploaded, mNumDirsCreated, mNumDirsScanned;
 	int mMaxBandwidthFromSyncAllowScript;
+	std::auto_ptr<BackupClientBlockIndexCache> mapBlockIndexCache;
+	std::auto_ptr<BackupClientChangeJournal> mapChangeJournal;
 
 public:
+	BackupClientBlockIndexCache* GetBlockIndexCache()
+	{
+		return mapBlockIndexCache.get();
+	}
+	BackupClientChangeJournal* GetChangeJournal()
+	{
+		return mapChangeJournal.get();
+	}
+	int64_t GetNumDirsScanned() { return mNumDirsScanned; }
 	int GetMaxBandwidthFromSyncAllowScript() { return mMaxBandwidthFromSyncAllowScript; }
 	bool StopRun() { return this->Daemon::StopRun(); }
 	bool StorageLimitExceeded() { return mStorageLimitExceeded; }
@@ -287,6 +300,8 @@ public:
 		const BackupClientDirectoryRecord* pDirRecord,
 		const std::string& rLocalPath)
 	{
+		mNumDirsScanned++;
+
 		if (mLogAllFileAccess)
 		{
 			BOX_INFO("Scanning directory: " << rLocalPath);
@@ -441,6 +456,22 @@ public:
 				rLocalPath);
 		}
 	}
+	virtual void NotifyUploadChannelProgress(
+		const BackupClientDirectoryRecord* pDirRecord,
+		const std::string& rLocalPath,
+		int Channel, int64_t BytesSent)
+	{
+		if (mLogAllFileAccess)
+		{
+			BOX_NOTICE("Uploading on channel " << Channel << ": " <<
+				rLocalPath << ", sent " << BytesSent << " bytes");
+		}
+		else
+		{
+			BOX_TRACE("Uploading on channel " << Channel << ": " <<
+				rLocalPath << ", sent " << BytesSent << " bytes");
+		}
+	}
 	virtual void NotifyFileUploaded(
 		const BackupClientDirectoryRecord* pDirRecord,
 		const std::string& rLocalPath,
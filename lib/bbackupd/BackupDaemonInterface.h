@@ -121,6 +121,10 @@ class ProgressNotifier
 	virtual void NotifyFileUploadingAttributes(
  		const BackupClientDirectoryRecord* pDirRecord,
  		const std::string& rLocalPath) = 0;
+	virtual void NotifyUploadChannelProgress(
+		const BackupClientDirectoryRecord* pDirRecord,
+		const std::string& rLocalPath,
+		int Channel, int64_t BytesSent) = 0;
 	virtual void NotifyFileUploaded(
 		const BackupClientDirectoryRecord* pDirRecord,
 		const std::string& rLocalPath,
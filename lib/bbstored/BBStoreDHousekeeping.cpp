@@ -105,76 +105,39 @@ void BackupStoreDaemon::RunHousekeepingIfNeeded()
 	}
 			
 	SetProcessTitle("housekeeping, active");
-			
-	// Check them all
+
+	// Housekeep them all, on several threads if configured
 	for(std::vector<int32_t>::const_iterator i = accounts.begin(); i != accounts.end(); ++i)
 	{
 		try
 		{
+			// Tag log output to identify account
+			std::ostringstream tag;
+			tag << "hk/" << BOX_FORMAT_ACCOUNT(*i);
+			Logging::Tagger tagWithClientID(tag.str());
+
+			// Get the account root
 			std::string rootDir;
 			int discSet = 0;
-
-			{
-				// Tag log output to identify account
-				std::ostringstream tag;
-				tag << "hk/" << BOX_FORMAT_ACCOUNT(*i);
-				Logging::Tagger tagWithClientID(tag.str());
-
-				// Get the account root
-				mpAccounts->GetAccountRoot(*i, rootDir, discSet);
-
-				// Reset tagging as HousekeepStoreAccount will
-				// do that itself, to avoid duplicate tagging.
-				// Happens automatically when tagWithClientID
-				// goes out of scope.
-			}
-			
-			// Do housekeeping on this account
-			HousekeepStoreAccount housekeeping(*i, rootDir,
-				discSet, this);
-			housekeeping.DoHousekeeping();
+			mpAccounts->GetAccountRoot(*i, rootDir, discSet);
+			mHousekeepingScheduler.AddAccount(*i, rootDir, discSet);
 		}
 		catch(BoxException &e)
 		{
-			BOX_ERROR("Housekeeping on account " <<
-				BOX_FORMAT_ACCOUNT(*i) << " threw exception, "
-				"aborting run for this account: " <<
-				e.what() << " (" <<
-				e.GetType() << "/" << e.GetSubType() << ")");
-		}
-		catch(std::exception &e)
-		{
-			BOX_ERROR("Housekeeping on account " <<
-				BOX_FORMAT_ACCOUNT(*i) << " threw exception, "
-				"aborting run for this account: " <<
+			BOX_ERROR("Failed to find account " <<
+				BOX_FORMAT_ACCOUNT(*i) << " for housekeeping: " <<
 				e.what());
 		}
-		catch(...)
-		{
-			BOX_ERROR("Housekeeping on account " <<
-				BOX_FORMAT_ACCOUNT(*i) << " threw exception, "
-				"aborting run for this account: "
-				"unknown exception");
-		}
-	
-		int64_t timeNow = GetCurrentBoxTime();
-		time_t secondsToGo = BoxTimeToSeconds(
-			(mLastHousekeepingRun + housekeepingInterval) - 
-			timeNow);
-		if(secondsToGo < 1) secondsToGo = 1;
-		if(secondsToGo > 60) secondsToGo = 60;
-		int32_t millisecondsToGo = ((int)secondsToGo) * 1000;
+	}
 
-		// Check to see if there's any message pending
-		CheckForInterProcessMsg(0 /* no account */, millisecondsToGo);
+	mHousekeepingScheduler.SetNumWorkers(
+		rconfig.GetKeyValueInt("HousekeepingWorkers"));
+	mHousekeepingScheduler.SetTimeBetweenFullScans(SecondsToBoxTime(
+		rconfig.GetKeyValueInt("TimeBetweenFullHousekeeping")));
+	mHousekeepingScheduler.SetPackObjectsSmallerThan(
+		(int64_t)rconfig.GetKeyValueInt("PackObjectsSmallerThan") * 1024);
+	mHousekeepingScheduler.Run(this);
 
-		// Stop early?
-		if(StopRun())
-		{
-			break;
-		}
-	}
-		
 	BOX_INFO("Finished housekeeping");
 
 	// Placed here for accuracy, if StopRun() is true, for example.
@@ -208,6 +171,40 @@ void BackupStoreDaemon::OnIdle()
 // --------------------------------------------------------------------------
 bool BackupStoreDaemon::CheckForInterProcessMsg(int AccountNum, int MaximumWaitTime)
 {
+	int account = 0;
+	if(ReadInterProcessMsg(MaximumWaitTime, account))
+	{
+		return true;
+	}
+
+	// Main process is trying to lock an account -- are we processing it?
+	if(account != 0 && account == AccountNum)
+	{
+		// Yes! -- need to stop now so when it retries to get the lock, it will succeed
+		BOX_INFO("Housekeeping on account " <<
+			BOX_FORMAT_ACCOUNT(AccountNum) <<
+			"giving way to client connection");
+		return true;
+	}
+
+	return false;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDaemon::ReadInterProcessMsg(int, int &)
+//		Purpose: Wait for a message from the main process, returning
+//			 true if housekeeping should stop, and otherwise
+//			 setting rLockWantedOut to the account which a client
+//			 wants to lock, or zero.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreDaemon::ReadInterProcessMsg(int MaximumWaitTime, int &rLockWantedOut)
+{
+	rLockWantedOut = 0;
+
 	if(!mInterProcessCommsSocket.IsOpened())
 	{
 		return false;
@@ -243,15 +240,8 @@ bool BackupStoreDaemon::CheckForInterProcessMsg(int AccountNum, int MaximumWaitT
 		}
 		else if(sscanf(line.c_str(), "r%x", &account) == 1)
 		{
-			// Main process is trying to lock an account -- are we processing it?
-			if(account == AccountNum)
-			{
-				// Yes! -- need to stop now so when it retries to get the lock, it will succeed
-				BOX_INFO("Housekeeping on account " <<
-					BOX_FORMAT_ACCOUNT(AccountNum) <<
-					"giving way to client connection");
-				return true;
-			}
+			// Main process is trying to lock an account
+			rLockWantedOut = account;
 		}
 	}
 	
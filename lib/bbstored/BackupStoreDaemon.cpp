@@ -20,6 +20,8 @@
 #include "BackupStoreContext.h"
 #include "BackupStoreDaemon.h"
 #include "BackupStoreConfigVerify.h"
+#include "BackupStoreSession.h"
+#include "BackupStoreSharedDirectoryCache.h"
 #include "autogen_BackupProtocol.h"
 #include "RaidFileController.h"
 #include "BackupStoreAccountDatabase.h"
@@ -40,6 +42,9 @@ BackupStoreDaemon::BackupStoreDaemon()
 	: mpAccountDatabase(0),
 	  mpAccounts(0),
 	  mExtendedLogging(false),
+	  mDirectoryCacheMaxSize(-1),
+	  mDeferRaidConversion(false),
+	  mWorkerThreads(0),
 	  mHaveForkedHousekeeping(false),
 	  mIsHousekeepingProcess(false),
 	  mHousekeepingInited(false),
@@ -171,6 +176,29 @@ void BackupStoreDaemon::Run()
 	mExtendedLogging = false;
 	const Configuration &config(GetConfiguration());
 	mExtendedLogging = config.GetKeyValueBool("ExtendedLogging");
+
+	// Get the directory cache size, if it's not the default
+	mDirectoryCacheMaxSize = -1;
+	if(config.KeyExists("DirectoryCacheSize"))
+	{
+		mDirectoryCacheMaxSize =
+			(int64_t)config.GetKeyValueInt("DirectoryCacheSize") * 1024;
+	}
+
+	// Convert uploaded files to RAID storage in the background?
+	mDeferRaidConversion = config.GetKeyValueBool("DeferRaidConversion");
+
+	// Handle connections in threads, sharing directories read from
+	// disc between them, instead of forking for each one?
+	mWorkerThreads = config.GetSubConfiguration("Server").GetKeyValueInt(
+		"WorkerThreads");
+	mapSharedDirectoryCache.reset();
+	if(mWorkerThreads > 0)
+	{
+		mapSharedDirectoryCache.reset(
+			new BackupStoreSharedDirectoryCache((int64_t)config.
+				GetKeyValueInt("SharedDirectoryCacheSize") * 1024));
+	}
 	
 	// Fork off housekeeping daemon -- must only do this the first
 	// time Run() is called.  Housekeeping runs synchronously on Win32
@@ -314,11 +342,9 @@ void BackupStoreDaemon::Connection2(std::auto_ptr<SocketStreamTLS> apStream)
 	
 	// Check it
 	int32_t id;
-	if(::sscanf(clientCommonName.c_str(), "BACKUP-%x", &id) != 1)
+	if(!GetAccountIDFromCommonName(clientCommonName, id))
 	{
 		// Bad! Disconnect immediately
-		BOX_WARNING("Failed login: invalid client common name: " <<
-			clientCommonName);
 		return;
 	}
 
@@ -330,20 +356,7 @@ void BackupStoreDaemon::Connection2(std::auto_ptr<SocketStreamTLS> apStream)
 
 	// Create a context, using this ID
 	BackupStoreContext context(id, this, GetConnectionDetails());
-
-	if (mpTestHook)
-	{
-		context.SetTestHook(*mpTestHook);
-	}
-	
-	// See if the client has an account?
-	if(mpAccounts && mpAccounts->AccountExists(id))
-	{
-		std::string root;
-		int discSet;
-		mpAccounts->GetAccountRoot(id, root, discSet);
-		context.SetClientHasAccount(root, discSet);
-	}
+	SetupContext(context);
 
 	// Handle a connection with the backup protocol
 	std::auto_ptr<SocketStream> apPlainStream(apStream);
@@ -356,22 +369,102 @@ void BackupStoreDaemon::Connection2(std::auto_ptr<SocketStreamTLS> apStream)
 	}
 	catch(...)
 	{
-		LogConnectionStats(id, context.GetAccountName(), server);
+		LogConnectionStats(id, context, server);
 		throw;
 	}
-	LogConnectionStats(id, context.GetAccountName(), server);
+	LogConnectionStats(id, context, server);
 	context.CleanUp();
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDaemon::GetAccountIDFromCommonName(const std::string &, int32_t &)
+//		Purpose: Get the account number from the common name of a
+//			 client's certificate. Returns false, and logs a
+//			 warning, if it isn't valid.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreDaemon::GetAccountIDFromCommonName(
+	const std::string &rCommonName, int32_t &rIDOut)
+{
+	if(::sscanf(rCommonName.c_str(), "BACKUP-%x", &rIDOut) != 1)
+	{
+		BOX_WARNING("Failed login: invalid client common name: " <<
+			rCommonName);
+		return false;
+	}
+
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDaemon::SetupContext(BackupStoreContext &)
+//		Purpose: Apply the configuration to the context for a new
+//			 connection, and tell it where the account is
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDaemon::SetupContext(BackupStoreContext &rContext)
+{
+	if (mpTestHook)
+	{
+		rContext.SetTestHook(*mpTestHook);
+	}
+
+	if(mDirectoryCacheMaxSize >= 0)
+	{
+		rContext.SetDirectoryCacheMaxSize(mDirectoryCacheMaxSize);
+	}
+
+	rContext.SetDeferRaidConversion(mDeferRaidConversion);
+	rContext.SetSharedDirectoryCache(mapSharedDirectoryCache.get());
+	
+	// See if the client has an account?
+	int32_t id = rContext.GetClientID();
+	MutexLock lock(mAccountsMutex);
+	if(mpAccounts && mpAccounts->AccountExists(id))
+	{
+		std::string root;
+		int discSet;
+		mpAccounts->GetAccountRoot(id, root, discSet);
+		rContext.SetClientHasAccount(root, discSet);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDaemon::CreateSession(std::auto_ptr<SocketStreamTLS>)
+//		Purpose: Handle a connection in this process, a command at
+//			 a time, when WorkerThreads is set
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ServerSession *BackupStoreDaemon::CreateSession(
+	std::auto_ptr<SocketStreamTLS> apStream)
+{
+	return new BackupStoreSession(*this, apStream, GetTLSContext(),
+		GetConnectionDetails());
+}
+
 void BackupStoreDaemon::LogConnectionStats(uint32_t accountId,
-	const std::string& accountName, const BackupProtocolServer &server)
+	BackupStoreContext &rContext, const BackupProtocolServer &server)
 {
-	// Log the amount of data transferred
+	// Log the amount of data transferred, how well the directory
+	// cache worked, and how much verification reading was avoided
 	BOX_NOTICE("Connection statistics for " << 
 		BOX_FORMAT_ACCOUNT(accountId) << " "
-		"(name=" << accountName << "):"
+		"(name=" << rContext.GetAccountName() << "):"
 		" IN="  << server.GetBytesRead() <<
 		" OUT=" << server.GetBytesWritten() <<
 		" NET_IN=" << (server.GetBytesRead() - server.GetBytesWritten()) <<
-		" TOTAL=" << (server.GetBytesRead() + server.GetBytesWritten()));
+		" TOTAL=" << (server.GetBytesRead() + server.GetBytesWritten()) <<
+		" DIR_CACHE_HITS=" << rContext.GetDirectoryCacheHits() <<
+		" DIR_CACHE_MISSES=" << rContext.GetDirectoryCacheMisses() <<
+		" DIR_CACHE_EVICTIONS=" << rContext.GetDirectoryCacheEvictions() <<
+		" VERIFY_READ_SAVED=" << rContext.GetVerifyReadBytesSaved());
 }
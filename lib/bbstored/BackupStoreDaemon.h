@@ -15,10 +15,13 @@
 #include "BackupConstants.h"
 #include "BackupStoreContext.h"
 #include "HousekeepStoreAccount.h"
+#include "HousekeepingScheduler.h"
 #include "IOStreamGetLine.h"
+#include "Thread.h"
 
 class BackupStoreAccounts;
 class BackupStoreAccountDatabase;
+class BackupStoreSharedDirectoryCache;
 
 // --------------------------------------------------------------------------
 //
@@ -31,6 +34,7 @@ class BackupStoreAccountDatabase;
 class BackupStoreDaemon : public ServerTLS<BOX_PORT_BBSTORED>,
 	HousekeepingInterface, HousekeepingCallback
 {
+	friend class BackupStoreSession;
 public:
 	BackupStoreDaemon();
 	~BackupStoreDaemon();
@@ -42,6 +46,8 @@ public:
 	void SendMessageToHousekeepingProcess(const void *Msg, int MsgLen)
 	{
 #ifndef WIN32
+		// Connections may be handled by several threads
+		MutexLock lock(mInterProcessCommsMutex);
 		mInterProcessCommsSocket.Write(Msg, MsgLen);
 #endif
 	}
@@ -54,6 +60,13 @@ protected:
 
 	virtual void Connection(std::auto_ptr<SocketStreamTLS> apStream);
 	void Connection2(std::auto_ptr<SocketStreamTLS> apStream);
+
+	virtual int GetNumberOfSessionThreads() {return mWorkerThreads;}
+	virtual ServerSession *CreateSession(
+		std::auto_ptr<SocketStreamTLS> apStream);
+	bool GetAccountIDFromCommonName(const std::string &rCommonName,
+		int32_t &rIDOut);
+	void SetupContext(BackupStoreContext &rContext);
 	
 	virtual const char *DaemonName() const;
 	virtual std::string DaemonBanner() const;
@@ -64,27 +77,36 @@ protected:
 	void HousekeepingProcess();
 
 	void LogConnectionStats(uint32_t accountId,
-		const std::string& accountName, const BackupProtocolServer &server);
+		BackupStoreContext &rContext, const BackupProtocolServer &server);
 
 public:
 	// HousekeepingInterface implementation
 	virtual bool CheckForInterProcessMsg(int AccountNum = 0, int MaximumWaitTime = 0);
+	virtual bool ReadInterProcessMsg(int MaximumWaitTime, int &rLockWantedOut);
 	void RunHousekeepingIfNeeded();
 
 private:
 	BackupStoreAccountDatabase *mpAccountDatabase;
 	BackupStoreAccounts *mpAccounts;
+	Mutex mAccountsMutex; // reloaded when the file changes
 	bool mExtendedLogging;
+	int64_t mDirectoryCacheMaxSize; // bytes, or -1 for the default
+	bool mDeferRaidConversion;
+	int mWorkerThreads; // or 0 to fork for each connection
+	std::auto_ptr<BackupStoreSharedDirectoryCache> mapSharedDirectoryCache;
 	bool mHaveForkedHousekeeping;
 	bool mIsHousekeepingProcess;
 	bool mHousekeepingInited;
 	
 	SocketStream mInterProcessCommsSocket;
 	IOStreamGetLine mInterProcessComms;
+	Mutex mInterProcessCommsMutex;
 
 	virtual void OnIdle();
 	void HousekeepingInit();
 	int64_t mLastHousekeepingRun;
+	// Remembers when each account was last housekept
+	HousekeepingScheduler mHousekeepingScheduler;
 
 public:
 	void SetTestHook(BackupStoreContext::TestHook& rTestHook)
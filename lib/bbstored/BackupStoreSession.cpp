@@ -0,0 +1,167 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreSession.cpp
+//		Purpose: A client connection to bbstored, handled by a worker
+//			 thread a command at a time
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <sstream>
+
+#include "autogen_BackupProtocol.h"
+#include "BackupConstants.h"
+#include "BackupStoreContext.h"
+#include "BackupStoreDaemon.h"
+#include "BackupStoreSession.h"
+#include "Logging.h"
+#include "SocketStreamTLS.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreSession::BackupStoreSession(...)
+//		Purpose: Constructor. Nothing is read from the client until
+//			 the first call to HandleEvent().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreSession::BackupStoreSession(BackupStoreDaemon &rDaemon,
+	std::auto_ptr<SocketStreamTLS> apStream, const TLSContext &rTLSContext,
+	const std::string &rConnectionDetails)
+: mrDaemon(rDaemon),
+  mrTLSContext(rTLSContext),
+  mConnectionDetails(rConnectionDetails),
+  mLogContext(rConnectionDetails),
+  mpStream(apStream.get()),
+  mapStream(apStream),
+  mAccountID(0),
+  mFinished(false)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreSession::~BackupStoreSession()
+//		Purpose: Destructor. Logs the statistics for the connection,
+//			 and cleans up the context if the client logged out.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreSession::~BackupStoreSession()
+{
+	Logging::ThreadContextGuard context(mLogContext);
+
+	try
+	{
+		if(mapServer.get())
+		{
+			mrDaemon.LogConnectionStats(mAccountID, *mapContext,
+				*mapServer);
+		}
+
+		if(mFinished)
+		{
+			mapContext->CleanUp();
+		}
+	}
+	catch(BoxException &e)
+	{
+		BOX_ERROR("Failed to clean up after connection: " <<
+			e.what());
+	}
+
+	// The server owns the stream, and the context may refer to the
+	// server, so delete them in this order.
+	mapContext.reset();
+	mapServer.reset();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreSession::Start()
+//		Purpose: Run the TLS handshake, check the client's certificate
+//			 and start the protocol. Returns false if the client
+//			 should be disconnected.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreSession::Start()
+{
+	mapStream->Handshake(mrTLSContext, true /* is server */);
+
+	std::string clientCommonName(mapStream->GetPeerCommonName());
+	BOX_INFO("Client certificate CN: " << clientCommonName);
+
+	if(!mrDaemon.GetAccountIDFromCommonName(clientCommonName, mAccountID))
+	{
+		return false;
+	}
+
+	std::ostringstream tag;
+	tag << "client=" << BOX_FORMAT_ACCOUNT(mAccountID);
+	mLogContext = tag.str();
+
+	mapContext.reset(new BackupStoreContext(mAccountID, &mrDaemon,
+		mConnectionDetails));
+	mrDaemon.SetupContext(*mapContext);
+
+	std::auto_ptr<SocketStream> apPlainStream(mapStream);
+	mapServer.reset(new BackupProtocolServer(apPlainStream));
+	mapServer->SetLogToSysLog(mrDaemon.mExtendedLogging);
+	mapServer->SetTimeout(BACKUP_STORE_TIMEOUT);
+	mapServer->Handshake();
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreSession::HandleEvent()
+//		Purpose: Start the session, or run the next command that the
+//			 client sent. Returns false when the connection should
+//			 be closed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreSession::HandleEvent()
+{
+	Logging::ThreadContextGuard context(mLogContext);
+
+	if(!mapServer.get())
+	{
+		return Start();
+	}
+
+	if(!mapServer->DoServerCommand(*mapContext))
+	{
+		mFinished = true;
+		return false;
+	}
+
+	return true;
+}
+
+void BackupStoreSession::IdleTimedOut()
+{
+	Logging::ThreadContextGuard context(mLogContext);
+	BOX_WARNING("Client sent nothing for " <<
+		(BACKUP_STORE_TIMEOUT / 1000) << " seconds, disconnecting");
+}
+
+SocketStream &BackupStoreSession::GetSocket()
+{
+	return *mpStream;
+}
+
+int BackupStoreSession::GetIdleTimeout()
+{
+	return BACKUP_STORE_TIMEOUT;
+}
@@ -0,0 +1,65 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreSession.h
+//		Purpose: A client connection to bbstored, handled by a worker
+//			 thread a command at a time
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTORESESSION__H
+#define BACKUPSTORESESSION__H
+
+#include <memory>
+#include <string>
+
+#include "ServerSessionPool.h"
+
+class BackupProtocolServer;
+class BackupStoreContext;
+class BackupStoreDaemon;
+class SocketStreamTLS;
+class TLSContext;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreSession
+//		Purpose: Does what BackupStoreDaemon::Connection() does for a
+//			 forked child, but one command per HandleEvent() call,
+//			 so that many clients can share a few threads.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreSession : public ServerSession
+{
+public:
+	BackupStoreSession(BackupStoreDaemon &rDaemon,
+		std::auto_ptr<SocketStreamTLS> apStream,
+		const TLSContext &rTLSContext,
+		const std::string &rConnectionDetails);
+	virtual ~BackupStoreSession();
+
+	virtual bool HandleEvent();
+	virtual void IdleTimedOut();
+	virtual SocketStream &GetSocket();
+	virtual int GetIdleTimeout();
+
+private:
+	bool Start();
+
+	BackupStoreDaemon &mrDaemon;
+	const TLSContext &mrTLSContext;
+	std::string mConnectionDetails;
+	std::string mLogContext;
+	SocketStreamTLS *mpStream;
+	// owns mpStream until mapServer is created
+	std::auto_ptr<SocketStreamTLS> mapStream;
+	std::auto_ptr<BackupStoreContext> mapContext;
+	std::auto_ptr<BackupProtocolServer> mapServer;
+	int32_t mAccountID;
+	bool mFinished;
+};
+
+#endif // BACKUPSTORESESSION__H
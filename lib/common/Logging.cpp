@@ -31,6 +31,7 @@
 
 #include "BoxTime.h"
 #include "Logging.h"
+#include "Thread.h"
 
 bool Logging::sLogToSyslog  = false;
 bool Logging::sLogToConsole = false;
@@ -38,6 +39,9 @@ bool Logging::sContextSet   = false;
 
 bool HideExceptionMessageGuard::sHiddenState = false;
 
+// Not a member, to keep Thread.h out of Logging.h
+static ThreadSpecificPointer sThreadContext;
+
 std::vector<Logger*> Logging::sLoggers;
 std::string Logging::sContext;
 Console*    Logging::spConsole = NULL;
@@ -147,6 +151,12 @@ void Logging::Log(Log::Level level, const std::string& file, int line,
 	{
 		newMessage += "[" + sContext + "] ";
 	}
+
+	const std::string *pThreadContext = GetThreadContext();
+	if (pThreadContext)
+	{
+		newMessage += "[" + *pThreadContext + "] ";
+	}
 	
 	newMessage += message;
 	
@@ -177,6 +187,12 @@ void Logging::LogToSyslog(Log::Level level, const std::string& rFile, int line,
 	{
 		newMessage += "[" + sContext + "] ";
 	}
+
+	const std::string *pThreadContext = GetThreadContext();
+	if (pThreadContext)
+	{
+		newMessage += "[" + *pThreadContext + "] ";
+	}
 	
 	newMessage += message;
 
@@ -211,6 +227,16 @@ void Logging::ClearContext()
 	sContextSet = false;
 }
 
+void Logging::SetThreadContext(const std::string *pContext)
+{
+	sThreadContext.Set((void *)pContext);
+}
+
+const std::string *Logging::GetThreadContext()
+{
+	return (const std::string *)sThreadContext.Get();
+}
+
 void Logging::SetProgramName(const std::string& rProgramName)
 {
 	sProgramName = rProgramName;
@@ -453,6 +453,8 @@ class Logging
 		const std::string& message);
 	static void SetContext(std::string context);
 	static void ClearContext();
+	static void SetThreadContext(const std::string *pContext);
+	static const std::string *GetThreadContext();
 	static Log::Level GetNamedLevel(const std::string& rName);
 	static void SetProgramName(const std::string& rProgramName);
 	static std::string GetProgramName() { return sProgramName; }
@@ -513,6 +515,28 @@ class Logging
 		}
 	};
 
+	// Adds a context to messages logged by the current thread only,
+	// for servers which handle several clients in one process, where
+	// a Tagger would change the tag of them all.
+	class ThreadContextGuard
+	{
+		private:
+		std::string mContext;
+		const std::string *mpOldContext;
+
+		public:
+		ThreadContextGuard(const std::string& rContext)
+		: mContext(rContext),
+		  mpOldContext(Logging::GetThreadContext())
+		{
+			Logging::SetThreadContext(&mContext);
+		}
+		~ThreadContextGuard()
+		{
+			Logging::SetThreadContext(mpOldContext);
+		}
+	};
+
 	class TempLoggerGuard
 	{
 		private:
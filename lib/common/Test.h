@@ -22,6 +22,7 @@
 #define BBSTORED        "..\\..\\bin\\bbstored\\bbstored.exe"
 #define BBACKUPQUERY    "..\\..\\bin\\bbackupquery\\bbackupquery.exe"
 #define BBSTOREACCOUNTS "..\\..\\bin\\bbstoreaccounts\\bbstoreaccounts.exe"
+#define BBSTORELOAD     "..\\..\\bin\\bbstoreload\\bbstoreload.exe"
 #define TEST_RETURN(actual, expected) TEST_EQUAL(expected, actual);
 #define TEST_RETURN_COMMAND(actual, expected, command) TEST_EQUAL_LINE(expected, actual, command);
 #else
@@ -30,6 +31,7 @@
 #define BBSTORED        "../../bin/bbstored/bbstored"
 #define BBACKUPQUERY    "../../bin/bbackupquery/bbackupquery"
 #define BBSTOREACCOUNTS "../../bin/bbstoreaccounts/bbstoreaccounts"
+#define BBSTORELOAD     "../../bin/bbstoreload/bbstoreload"
 #define TEST_RETURN(actual, expected) TEST_EQUAL((expected << 8), actual);
 #define TEST_RETURN_COMMAND(actual, expected, command) TEST_EQUAL_LINE((expected << 8), actual, command);
 #endif
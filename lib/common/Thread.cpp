@@ -0,0 +1,468 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    Thread.cpp
+//		Purpose: Minimal wrappers for threads, mutexes and condition
+//			 variables
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+	#include <sys/time.h>
+#endif
+
+#include "CommonException.h"
+#include "Thread.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Mutex()
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+Mutex::Mutex()
+{
+#ifdef BOX_HAVE_THREADS
+	if(::pthread_mutex_init(&mMutex, NULL) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::~Mutex()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+Mutex::~Mutex()
+{
+#ifdef BOX_HAVE_THREADS
+	::pthread_mutex_destroy(&mMutex);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Lock()
+//		Purpose: Lock the mutex, waiting for any other thread
+//			 holding it to release it first
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void Mutex::Lock()
+{
+#ifdef BOX_HAVE_THREADS
+	if(::pthread_mutex_lock(&mMutex) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Unlock()
+//		Purpose: Unlock the mutex
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void Mutex::Unlock()
+{
+#ifdef BOX_HAVE_THREADS
+	// Called from destructors, so don't throw
+	::pthread_mutex_unlock(&mMutex);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::ConditionVariable()
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ConditionVariable::ConditionVariable()
+{
+#ifdef BOX_HAVE_THREADS
+	if(::pthread_cond_init(&mCondition, NULL) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::~ConditionVariable()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ConditionVariable::~ConditionVariable()
+{
+#ifdef BOX_HAVE_THREADS
+	::pthread_cond_destroy(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::Wait(Mutex &)
+//		Purpose: Atomically unlock the mutex, which must be held by
+//			 the caller, and sleep until woken. The mutex is
+//			 locked again on return. Wakeups may be spurious, so
+//			 always check the condition being waited for again.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ConditionVariable::Wait(Mutex &rMutex)
+{
+#ifdef BOX_HAVE_THREADS
+	if(::pthread_cond_wait(&mCondition, &rMutex.mMutex) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+#else
+	THROW_EXCEPTION(CommonException, NotSupported)
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::TimedWait(Mutex &, int)
+//		Purpose: Like Wait(), but give up after the given number of
+//			 milliseconds. Returns false if it timed out, true
+//			 otherwise.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool ConditionVariable::TimedWait(Mutex &rMutex, int Milliseconds)
+{
+#ifdef BOX_HAVE_THREADS
+	struct timeval now;
+	if(::gettimeofday(&now, NULL) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+
+	struct timespec until;
+	int64_t nsec = ((int64_t)now.tv_usec * 1000) +
+		((int64_t)(Milliseconds % 1000) * 1000000);
+	until.tv_sec = now.tv_sec + (Milliseconds / 1000) + (nsec / 1000000000);
+	until.tv_nsec = nsec % 1000000000;
+
+	int result = ::pthread_cond_timedwait(&mCondition, &rMutex.mMutex,
+		&until);
+	if(result == ETIMEDOUT)
+	{
+		return false;
+	}
+	else if(result != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+	return true;
+#else
+	THROW_EXCEPTION(CommonException, NotSupported)
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::Signal()
+//		Purpose: Wake one waiting thread
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ConditionVariable::Signal()
+{
+#ifdef BOX_HAVE_THREADS
+	::pthread_cond_signal(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::Broadcast()
+//		Purpose: Wake all waiting threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ConditionVariable::Broadcast()
+{
+#ifdef BOX_HAVE_THREADS
+	::pthread_cond_broadcast(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ThreadSpecificPointer::ThreadSpecificPointer()
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ThreadSpecificPointer::ThreadSpecificPointer()
+#ifdef BOX_HAVE_THREADS
+: mKeyCreated(false)
+#else
+: mpValue(NULL)
+#endif
+{
+#ifdef BOX_HAVE_THREADS
+	if(::pthread_key_create(&mKey, NULL) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+	mKeyCreated = true;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ThreadSpecificPointer::~ThreadSpecificPointer()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ThreadSpecificPointer::~ThreadSpecificPointer()
+{
+#ifdef BOX_HAVE_THREADS
+	mKeyCreated = false;
+	::pthread_key_delete(mKey);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ThreadSpecificPointer::Get()
+//		Purpose: The value set by the calling thread, or NULL if it
+//			 hasn't set one
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void *ThreadSpecificPointer::Get() const
+{
+#ifdef BOX_HAVE_THREADS
+	if(!mKeyCreated)
+	{
+		return NULL;
+	}
+	return ::pthread_getspecific(mKey);
+#else
+	return mpValue;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ThreadSpecificPointer::Set(void *)
+//		Purpose: Set the value seen by the calling thread only
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ThreadSpecificPointer::Set(void *pValue)
+{
+#ifdef BOX_HAVE_THREADS
+	if(!mKeyCreated || ::pthread_setspecific(mKey, pValue) != 0)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+#else
+	mpValue = pValue;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Thread()
+//		Purpose: Constructor. The thread doesn't run until Start()
+//			 is called.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+Thread::Thread()
+: mStarted(false)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::~Thread()
+//		Purpose: Destructor. The thread must have been joined, as
+//			 Run() can't be called once the derived class has
+//			 been destroyed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+Thread::~Thread()
+{
+	ASSERT(!mStarted);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Start()
+//		Purpose: Start a new thread which calls Run()
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void Thread::Start()
+{
+	if(mStarted)
+	{
+		THROW_EXCEPTION(CommonException, Internal)
+	}
+
+#ifdef BOX_HAVE_THREADS
+	// Block all signals while the thread is created, so that it
+	// inherits a mask which leaves them to the main thread
+	sigset_t allSignals, oldSignals;
+	::sigfillset(&allSignals);
+	::pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+
+	int result = ::pthread_create(&mThread, NULL, ThreadMain, this);
+
+	::pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+	if(result != 0)
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, ThreadCreateFailed,
+			"Failed to create thread: " << ::strerror(result));
+	}
+
+	mStarted = true;
+#else
+	THROW_EXCEPTION(CommonException, NotSupported)
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Join()
+//		Purpose: Wait for Run() to return. Does nothing if the
+//			 thread was never started.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void Thread::Join()
+{
+	if(!mStarted)
+	{
+		return;
+	}
+
+#ifdef BOX_HAVE_THREADS
+	::pthread_join(mThread, NULL);
+#endif
+	mStarted = false;
+}
+
+#ifdef BOX_HAVE_THREADS
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::ThreadMain(void *)
+//		Purpose: Static. Entry point of new threads. Exceptions
+//			 mustn't escape from a thread, so any which Run()
+//			 didn't catch are logged and discarded here.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void *Thread::ThreadMain(void *pThread)
+{
+	try
+	{
+		((Thread *)pThread)->Run();
+	}
+	catch(BoxException &e)
+	{
+		BOX_ERROR("Uncaught exception in thread: " << e.what() <<
+			": " << e.GetMessage());
+	}
+	catch(std::exception &e)
+	{
+		BOX_ERROR("Uncaught exception in thread: " << e.what());
+	}
+	catch(...)
+	{
+		BOX_ERROR("Uncaught unknown exception in thread");
+	}
+
+	return NULL;
+}
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::IsSupported()
+//		Purpose: Static. Whether threads can be started on this
+//			 platform.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool Thread::IsSupported()
+{
+#ifdef BOX_HAVE_THREADS
+	return true;
+#else
+	return false;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::GetNumberOfProcessors()
+//		Purpose: Static. The number of processors online, or 1 if
+//			 it can't be found out.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int Thread::GetNumberOfProcessors()
+{
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+	long processors = ::sysconf(_SC_NPROCESSORS_ONLN);
+	if(processors > 0)
+	{
+		return (int)processors;
+	}
+#endif
+	return 1;
+}
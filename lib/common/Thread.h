@@ -0,0 +1,185 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    Thread.h
+//		Purpose: Minimal wrappers for threads, mutexes and condition
+//			 variables, for the few places which do work in
+//			 parallel
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef THREAD__H
+#define THREAD__H
+
+#ifdef HAVE_PTHREAD
+	#include <pthread.h>
+	#define BOX_HAVE_THREADS
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    Mutex
+//		Purpose: A mutual exclusion lock. Does nothing on platforms
+//			 without threads.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class Mutex
+{
+	friend class ConditionVariable;
+public:
+	Mutex();
+	~Mutex();
+private:
+	// no copying
+	Mutex(const Mutex &);
+	Mutex &operator=(const Mutex &);
+public:
+	void Lock();
+	void Unlock();
+
+private:
+#ifdef BOX_HAVE_THREADS
+	pthread_mutex_t mMutex;
+#endif
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    MutexLock
+//		Purpose: Holds a Mutex locked for as long as it's in scope
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class MutexLock
+{
+public:
+	MutexLock(Mutex &rMutex)
+	: mrMutex(rMutex)
+	{
+		mrMutex.Lock();
+	}
+	~MutexLock()
+	{
+		mrMutex.Unlock();
+	}
+private:
+	// no copying
+	MutexLock(const MutexLock &);
+	MutexLock &operator=(const MutexLock &);
+
+	Mutex &mrMutex;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ConditionVariable
+//		Purpose: Lets threads sleep until another thread changes
+//			 some state protected by a Mutex. Waiting throws
+//			 NotSupported on platforms without threads, as
+//			 nothing could ever wake the caller.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class ConditionVariable
+{
+public:
+	ConditionVariable();
+	~ConditionVariable();
+private:
+	// no copying
+	ConditionVariable(const ConditionVariable &);
+	ConditionVariable &operator=(const ConditionVariable &);
+public:
+	void Wait(Mutex &rMutex);
+	bool TimedWait(Mutex &rMutex, int Milliseconds);
+	void Signal();
+	void Broadcast();
+
+private:
+#ifdef BOX_HAVE_THREADS
+	pthread_cond_t mCondition;
+#endif
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ThreadSpecificPointer
+//		Purpose: A pointer which has a separate value in each
+//			 thread, initially NULL. The object it points to
+//			 isn't owned. Just an ordinary pointer on platforms
+//			 without threads.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class ThreadSpecificPointer
+{
+public:
+	ThreadSpecificPointer();
+	~ThreadSpecificPointer();
+private:
+	// no copying
+	ThreadSpecificPointer(const ThreadSpecificPointer &);
+	ThreadSpecificPointer &operator=(const ThreadSpecificPointer &);
+public:
+	void *Get() const;
+	void Set(void *pValue);
+
+private:
+#ifdef BOX_HAVE_THREADS
+	pthread_key_t mKey;
+	// Static instances are zero-initialised before any constructors
+	// run, so this makes them safe to use during static initialisation
+	bool mKeyCreated;
+#else
+	void *mpValue;
+#endif
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    Thread
+//		Purpose: Base class for a thread of execution. Derived
+//			 classes implement Run(), which must catch its own
+//			 exceptions and hand any errors back to the thread
+//			 which calls Join(). Signals are blocked in the new
+//			 thread, so that they're still handled by the main
+//			 thread of the process.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class Thread
+{
+public:
+	Thread();
+	virtual ~Thread();
+private:
+	// no copying
+	Thread(const Thread &);
+	Thread &operator=(const Thread &);
+public:
+	void Start();
+	void Join();
+	bool IsStarted() const {return mStarted;}
+
+	static bool IsSupported();
+	static int GetNumberOfProcessors();
+
+protected:
+	virtual void Run() = 0;
+
+private:
+#ifdef BOX_HAVE_THREADS
+	static void *ThreadMain(void *pThread);
+	pthread_t mThread;
+#endif
+	bool mStarted;
+};
+
+#endif // THREAD__H
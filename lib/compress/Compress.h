@@ -27,7 +27,8 @@ template<bool Compressing>
 class Compress
 {
 public:
-	Compress()
+	// The level is only used when compressing
+	Compress(int Level = Z_DEFAULT_COMPRESSION)
 		: mFinished(false),
 		  mFlush(Z_NO_FLUSH)
 	{	
@@ -37,7 +38,7 @@ public:
 		mStream.opaque = Z_NULL;
 		mStream.data_type = Z_BINARY;
 
-		if((Compressing)?(deflateInit(&mStream, Z_DEFAULT_COMPRESSION))
+		if((Compressing)?(deflateInit(&mStream, Level))
 			:(inflateInit(&mStream)) != Z_OK)
 		{
 			THROW_EXCEPTION(CompressException, InitFailed)
@@ -66,6 +67,28 @@ public:
 		}
 	}
 		
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    Compress<Function>::Reset()
+	//		Purpose: Start again with a new stream. Much cheaper than
+	//				 creating a new object, as zlib keeps its memory.
+	//		Created: 2026/10/18
+	//
+	// --------------------------------------------------------------------------
+	void Reset()
+	{
+		if(((Compressing)?(deflateReset(&mStream))
+			:(inflateReset(&mStream))) != Z_OK)
+		{
+			THROW_EXCEPTION(CompressException, ResetFailed)
+		}
+
+		mStream.avail_in = 0;
+		mFinished = false;
+		mFlush = Z_NO_FLUSH;
+	}
+
 	// --------------------------------------------------------------------------
 	//
 	// Function
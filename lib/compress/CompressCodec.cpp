@@ -0,0 +1,349 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    CompressCodec.cpp
+//		Purpose: Compress and decompress whole buffers with zlib,
+//			 zstd or LZ4
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdlib.h>
+
+#include <new>
+
+#ifdef HAVE_LIBZSTD
+	#include <zstd.h>
+#endif
+
+#ifdef HAVE_LIBLZ4
+	#include <lz4.h>
+#endif
+
+#include "CompressCodec.h"
+#include "autogen_CompressException.h"
+
+#include "MemLeakFindOn.h"
+
+// zstd's default level is a good deal faster than zlib's, and compresses
+// a little better
+#define ZSTD_DEFAULT_LEVEL	3
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::CompressCodec(int, int)
+//		Purpose: Constructor. Throws an exception if the codec isn't
+//			 available in this build.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+CompressCodec::CompressCodec(int Codec, int Level)
+	: mCodec(Codec),
+	  mLevel(Level),
+	  mpZlib(0),
+	  mpState(0)
+{
+	if(!IsAvailable(Codec))
+	{
+		THROW_EXCEPTION_MESSAGE(CompressException, CodecNotAvailable,
+			"Compression codec " << Codec << " is not available");
+	}
+
+	switch(Codec)
+	{
+	case COMPRESS_CODEC_ZLIB:
+		mpZlib = new ::Compress<true>((Level == COMPRESS_CODEC_DEFAULT_LEVEL)
+			? Z_DEFAULT_COMPRESSION : Level);
+		break;
+
+#ifdef HAVE_LIBZSTD
+	case COMPRESS_CODEC_ZSTD:
+		if(mLevel == COMPRESS_CODEC_DEFAULT_LEVEL)
+		{
+			mLevel = ZSTD_DEFAULT_LEVEL;
+		}
+		mpState = ZSTD_createCCtx();
+		if(mpState == 0)
+		{
+			throw std::bad_alloc();
+		}
+		break;
+#endif
+
+#ifdef HAVE_LIBLZ4
+	case COMPRESS_CODEC_LZ4:
+		// LZ4 has no levels, as it's only meant to be fast
+		mpState = ::malloc(LZ4_sizeofState());
+		if(mpState == 0)
+		{
+			throw std::bad_alloc();
+		}
+		break;
+#endif
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::~CompressCodec()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+CompressCodec::~CompressCodec()
+{
+	if(mpZlib != 0)
+	{
+		delete mpZlib;
+		mpZlib = 0;
+	}
+
+	if(mpState != 0)
+	{
+#ifdef HAVE_LIBZSTD
+		if(mCodec == COMPRESS_CODEC_ZSTD)
+		{
+			ZSTD_freeCCtx((ZSTD_CCtx *)mpState);
+		}
+#endif
+		if(mCodec == COMPRESS_CODEC_LZ4)
+		{
+			::free(mpState);
+		}
+		mpState = 0;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::Compress(const void *, int, void *, int)
+//		Purpose: Compress a buffer, returning the compressed size.
+//			 The output buffer must be at least
+//			 MaxCompressedSize(InLength) bytes.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int CompressCodec::Compress(const void *pIn, int InLength, void *pOut,
+	int OutLength)
+{
+	ASSERT(OutLength >= MaxCompressedSize(InLength));
+
+#ifdef HAVE_LIBZSTD
+	if(mCodec == COMPRESS_CODEC_ZSTD)
+	{
+		size_t size = ZSTD_compressCCtx((ZSTD_CCtx *)mpState, pOut,
+			OutLength, pIn, InLength, mLevel);
+		if(ZSTD_isError(size))
+		{
+			THROW_EXCEPTION_MESSAGE(CompressException,
+				TransformFailed, "zstd error: " <<
+				ZSTD_getErrorName(size));
+		}
+		return (int)size;
+	}
+#endif
+
+#ifdef HAVE_LIBLZ4
+	if(mCodec == COMPRESS_CODEC_LZ4)
+	{
+		int size = LZ4_compress_fast_extState(mpState,
+			(const char *)pIn, (char *)pOut, InLength, OutLength,
+			1 /* acceleration */);
+		if(size <= 0)
+		{
+			THROW_EXCEPTION(CompressException, TransformFailed)
+		}
+		return size;
+	}
+#endif
+
+	ASSERT(mpZlib != 0);
+	mpZlib->Reset();
+	mpZlib->Input(pIn, InLength);
+	mpZlib->FinishInput();
+
+	int size = 0;
+	while(!mpZlib->OutputHasFinished())
+	{
+		int s = mpZlib->Output((uint8_t *)pOut + size, OutLength - size);
+		if(s <= 0)
+		{
+			// The buffer is big enough for any output, and all the
+			// input was given in one go, so this is a logic error
+			THROW_EXCEPTION(CompressException, Internal)
+		}
+		size += s;
+	}
+
+	return size;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::Decompress(int, const void *, int, void *, int)
+//		Purpose: Decompress a buffer compressed with Compress(),
+//			 returning the decompressed size
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int CompressCodec::Decompress(int Codec, const void *pIn, int InLength,
+	void *pOut, int OutLength)
+{
+	if(!IsAvailable(Codec))
+	{
+		THROW_EXCEPTION_MESSAGE(CompressException, CodecNotAvailable,
+			"Compression codec " << Codec << " is not available");
+	}
+
+#ifdef HAVE_LIBZSTD
+	if(Codec == COMPRESS_CODEC_ZSTD)
+	{
+		size_t size = ZSTD_decompress(pOut, OutLength, pIn, InLength);
+		if(ZSTD_isError(size))
+		{
+			THROW_EXCEPTION_MESSAGE(CompressException,
+				TransformFailed, "zstd error: " <<
+				ZSTD_getErrorName(size));
+		}
+		return (int)size;
+	}
+#endif
+
+#ifdef HAVE_LIBLZ4
+	if(Codec == COMPRESS_CODEC_LZ4)
+	{
+		int size = LZ4_decompress_safe((const char *)pIn, (char *)pOut,
+			InLength, OutLength);
+		if(size < 0)
+		{
+			THROW_EXCEPTION(CompressException, TransformFailed)
+		}
+		return size;
+	}
+#endif
+
+	::Compress<false> decompress;
+	decompress.Input(pIn, InLength);
+	decompress.FinishInput();
+
+	int size = 0;
+	while(!decompress.OutputHasFinished())
+	{
+		int s = decompress.Output((uint8_t *)pOut + size,
+			OutLength - size);
+		if(s <= 0)
+		{
+			// Out of space, or the data ended early
+			THROW_EXCEPTION(CompressException, TransformFailed)
+		}
+		size += s;
+	}
+
+	return size;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::MaxCompressedSize(int)
+//		Purpose: The largest that InLength bytes could be after
+//			 compressing them with any codec, from the bounds
+//			 each library documents, so that buffers can be sized
+//			 without knowing which will be used
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int CompressCodec::MaxCompressedSize(int InLength)
+{
+	int max = Compress_MaxSizeForCompressedData(InLength);
+
+	// ZSTD_COMPRESSBOUND()
+	int zstd = InLength + (InLength >> 8) + ((InLength < (128 << 10)) ?
+		(((128 << 10) - InLength) >> 11) : 0);
+	if(zstd > max)
+	{
+		max = zstd;
+	}
+
+	// LZ4_COMPRESSBOUND()
+	int lz4 = InLength + (InLength / 255) + 16;
+	if(lz4 > max)
+	{
+		max = lz4;
+	}
+
+	return max;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::IsAvailable(int)
+//		Purpose: Whether a codec can be used in this build
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool CompressCodec::IsAvailable(int Codec)
+{
+	switch(Codec)
+	{
+	case COMPRESS_CODEC_ZLIB:
+		return true;
+#ifdef HAVE_LIBZSTD
+	case COMPRESS_CODEC_ZSTD:
+		return true;
+#endif
+#ifdef HAVE_LIBLZ4
+	case COMPRESS_CODEC_LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::GetName(int)
+//		Purpose: The name of a codec, as used in configuration files
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+const char *CompressCodec::GetName(int Codec)
+{
+	switch(Codec)
+	{
+	case COMPRESS_CODEC_ZLIB: return "zlib";
+	case COMPRESS_CODEC_ZSTD: return "zstd";
+	case COMPRESS_CODEC_LZ4:  return "lz4";
+	default:                  return "unknown";
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::GetCodecByName(const std::string &)
+//		Purpose: The ID of the codec with this name, whether or not
+//			 it's available, or -1 if there isn't one
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int CompressCodec::GetCodecByName(const std::string &rName)
+{
+	for(int c = 0; c <= COMPRESS_CODEC_MAX; ++c)
+	{
+		if(rName == GetName(c))
+		{
+			return c;
+		}
+	}
+	return -1;
+}
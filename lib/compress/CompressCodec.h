@@ -0,0 +1,78 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    CompressCodec.h
+//		Purpose: Compress and decompress whole buffers with zlib,
+//			 zstd or LZ4
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef COMPRESSCODEC__H
+#define COMPRESSCODEC__H
+
+#include <string>
+
+#include "Compress.h"
+
+// Codec IDs. These are stored in the headers of encoded chunks of file
+// data, so they must never change.
+#define COMPRESS_CODEC_ZLIB		0
+#define COMPRESS_CODEC_ZSTD		1
+#define COMPRESS_CODEC_LZ4		2
+#define COMPRESS_CODEC_MAX		2
+
+// Use the codec's own default level
+#define COMPRESS_CODEC_DEFAULT_LEVEL	(-1)
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    CompressCodec
+//		Purpose: Compresses buffers in one go with the chosen codec,
+//			 keeping its state from one buffer to the next so
+//			 that it isn't set up from scratch each time. zstd
+//			 and LZ4 are only available if the libraries were
+//			 found when Box Backup was configured.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class CompressCodec
+{
+public:
+	CompressCodec(int Codec, int Level = COMPRESS_CODEC_DEFAULT_LEVEL);
+	~CompressCodec();
+private:
+	// No copying
+	CompressCodec(const CompressCodec &);
+	CompressCodec &operator=(const CompressCodec &);
+public:
+	int GetCodec() const {return mCodec;}
+	int GetLevel() const {return mLevel;}
+
+	// Returns the compressed size. The output buffer must be at least
+	// MaxCompressedSize(InLength) bytes.
+	int Compress(const void *pIn, int InLength, void *pOut, int OutLength);
+
+	// Returns the decompressed size, or throws an exception if the data
+	// is corrupt or doesn't fit in the output buffer
+	static int Decompress(int Codec, const void *pIn, int InLength,
+		void *pOut, int OutLength);
+
+	// The largest that InLength bytes could be after compressing them
+	// with any codec
+	static int MaxCompressedSize(int InLength);
+
+	static bool IsAvailable(int Codec);
+	static const char *GetName(int Codec);
+	// Returns -1 if there's no codec with that name
+	static int GetCodecByName(const std::string &rName);
+
+private:
+	int mCodec;
+	int mLevel;
+	::Compress<true> *mpZlib;
+	void *mpState;
+};
+
+#endif // COMPRESSCODEC__H
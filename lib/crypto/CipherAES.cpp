@@ -128,6 +128,18 @@ const EVP_CIPHER *CipherAES::GetCipher() const
 			break;
 		}
 		break;
+
+	case CipherDescription::Mode_GCM:
+		switch(mKeyLength)
+		{
+			case (128/8): return EVP_aes_128_gcm(); break;
+			case (192/8): return EVP_aes_192_gcm(); break;
+			case (256/8): return EVP_aes_256_gcm(); break;
+		default:
+			THROW_EXCEPTION(CipherException, EVPBadKeyLength)
+			break;
+		}
+		break;
 	
 	default:
 		break;
@@ -30,6 +30,7 @@ CipherContext::CipherContext()
 : mInitialised(false),
   mWithinTransform(false),
   mPaddingOn(true),
+  mAuthenticated(false),
   mFunction(None)
 #ifdef HAVE_OLD_SSL
 , mpDescription(0)
@@ -107,6 +108,8 @@ void CipherContext::Init(CipherContext::CipherFunction Function, const CipherDes
 	
 	// Store function for later
 	mFunction = Function;
+	mAuthenticated = (rDescription.GetCipherMode() ==
+		CipherDescription::Mode_GCM);
 
 	// Initialise the cipher
 #ifdef HAVE_OLD_SSL
@@ -154,6 +157,61 @@ void CipherContext::Init(CipherContext::CipherFunction Function, const CipherDes
 	mInitialised = true;
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::Init(const CipherContext &)
+//		Purpose: Initialises the context as a copy of another initialised
+//				 context, with the same cipher, key and direction, so
+//				 that each thread can have its own context.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void CipherContext::Init(const CipherContext &rSource)
+{
+	// Check for bad usage
+	if(mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, AlreadyInitialised);
+	}
+	if(!rSource.mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised)
+	}
+	if(rSource.mWithinTransform)
+	{
+		THROW_EXCEPTION(CipherException, AlreadyInTransform)
+	}
+
+#ifdef HAVE_OLD_SSL
+	// There's no way to copy a context with the old library
+	THROW_EXCEPTION_MESSAGE(CipherException, EVPInitFailure,
+		"Copying " << rSource.mCipherName << " contexts is not supported "
+		"by this version of OpenSSL");
+#else
+	BOX_OPENSSL_INIT_CTX(ctx);
+
+	if(EVP_CIPHER_CTX_copy(BOX_OPENSSL_CTX(ctx),
+		BOX_OPENSSL_CTX(rSource.ctx)) != 1)
+	{
+		std::string message = LogError("copying cipher");
+		BOX_OPENSSL_CLEANUP_CTX(ctx);
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPInitFailure,
+			"Failed to copy " << rSource.mCipherName << ": " <<
+			message);
+	}
+
+	mFunction = rSource.mFunction;
+	mPaddingOn = rSource.mPaddingOn;
+	mAuthenticated = rSource.mAuthenticated;
+	mCipherName = rSource.mCipherName;
+	mpDescription = rSource.mpDescription;
+
+	// mark as initialised
+	mInitialised = true;
+#endif
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -309,6 +367,12 @@ int CipherContext::Final(void *pOutBuffer, int OutLength)
 	if(EVP_CipherFinal(BOX_OPENSSL_CTX(ctx), (unsigned char*)pOutBuffer, &outLength) != 1)
 	{
 		mWithinTransform = false;
+		if(mAuthenticated && mFunction == Decrypt)
+		{
+			THROW_EXCEPTION_MESSAGE(CipherException,
+				AuthenticationFailed, "Failed to authenticate " <<
+				mCipherName << " data: " << LogError(GetFunction()));
+		}
 		THROW_EXCEPTION_MESSAGE(CipherException, EVPFinalFailure,
 			"Failed to finalise " << mCipherName << ": " << LogError(GetFunction()));
 	}
@@ -635,4 +699,109 @@ void CipherContext::UsePadding(bool Padding)
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::AddAuthenticatedData(const void *, int)
+//		Purpose: Add data which isn't encrypted, but which the tag of an
+//				 authenticated mode covers. Call after Begin() and
+//				 before Transform().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void CipherContext::AddAuthenticatedData(const void *pData, int Length)
+{
+	if(!mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised)
+	}
+
+	if(!mWithinTransform)
+	{
+		THROW_EXCEPTION(CipherException, BeginNotCalled)
+	}
+
+	if(!mAuthenticated)
+	{
+		THROW_EXCEPTION(CipherException, NotAuthenticatedCipher)
+	}
+
+#ifndef HAVE_OLD_SSL
+	// No output buffer means the data is only authenticated
+	int outLength = 0;
+	if(EVP_CipherUpdate(BOX_OPENSSL_CTX(ctx), NULL, &outLength,
+		(unsigned char*)pData, Length) != 1)
+	{
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPUpdateFailure,
+			"Failed to add authenticated data to " << mCipherName <<
+			": " << LogError(GetFunction()));
+	}
+#endif
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::GetTag(void *)
+//		Purpose: Get the tag of an authenticated mode after Final()
+//				 when encrypting. The buffer must be GetTagLength()
+//				 bytes long.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void CipherContext::GetTag(void *pTagOut)
+{
+	if(!mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised)
+	}
+
+	if(!mAuthenticated || mFunction != Encrypt)
+	{
+		THROW_EXCEPTION(CipherException, NotAuthenticatedCipher)
+	}
+
+#ifndef HAVE_OLD_SSL
+	if(EVP_CIPHER_CTX_ctrl(BOX_OPENSSL_CTX(ctx), EVP_CTRL_GCM_GET_TAG,
+		CIPHERCONTEXT_AEAD_TAG_LENGTH, pTagOut) != 1)
+	{
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPFinalFailure,
+			"Failed to get tag from " << mCipherName << ": " <<
+			LogError(GetFunction()));
+	}
+#endif
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::SetTag(const void *)
+//		Purpose: Set the tag which the data must match when it's
+//				 decrypted with an authenticated mode, before Final()
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void CipherContext::SetTag(const void *pTag)
+{
+	if(!mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised)
+	}
+
+	if(!mAuthenticated || mFunction != Decrypt)
+	{
+		THROW_EXCEPTION(CipherException, NotAuthenticatedCipher)
+	}
 
+#ifndef HAVE_OLD_SSL
+	if(EVP_CIPHER_CTX_ctrl(BOX_OPENSSL_CTX(ctx), EVP_CTRL_GCM_SET_TAG,
+		CIPHERCONTEXT_AEAD_TAG_LENGTH, (void *)pTag) != 1)
+	{
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPInitFailure,
+			"Failed to set tag for " << mCipherName << ": " <<
+			LogError(GetFunction()));
+	}
+#endif
+}
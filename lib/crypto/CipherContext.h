@@ -19,6 +19,9 @@ class CipherDescription;
 
 #define CIPHERCONTEXT_MAX_GENERATED_IV_LENGTH		32
 
+// Length of the tag which authenticated modes such as GCM add
+#define CIPHERCONTEXT_AEAD_TAG_LENGTH			16
+
 // Macros to allow compatibility with OpenSSL 1.0 and 1.1 APIs. See
 // https://github.com/charybdis-ircd/charybdis/blob/release/3.5/libratbox/src/openssl_ratbox.h
 // for the gory details.
@@ -26,6 +29,9 @@ class CipherDescription;
 #	define BOX_OPENSSL_INIT_CTX(ctx) ctx = EVP_CIPHER_CTX_new();
 #	define BOX_OPENSSL_CTX(ctx) ctx
 #	define BOX_OPENSSL_CLEANUP_CTX(ctx) EVP_CIPHER_CTX_free(ctx)
+// OpenSSL 1.1 and later lock their own global state, so cipher contexts
+// and random numbers can be used from more than one thread
+#	define BOX_OPENSSL_THREAD_SAFE
 typedef EVP_CIPHER_CTX* BOX_EVP_CIPHER_CTX;
 #else // OpenSSL < 1.1
 #	define BOX_OPENSSL_INIT_CTX(ctx) EVP_CIPHER_CTX_init(&ctx); // no error return code, even though the docs says it does
@@ -63,6 +69,7 @@ public:
 	} CipherFunction;
 
 	void Init(CipherContext::CipherFunction Function, const CipherDescription &rDescription);
+	void Init(const CipherContext &rSource);
 	void Reset();
 	
 	void Begin();
@@ -80,6 +87,16 @@ public:
 	const void *SetRandomIV(int &rLengthOut);
 	
 	void UsePadding(bool Padding = true);
+
+	// Authenticated modes: additional data must be added after Begin()
+	// and before any Transform(). The tag is read after Final() when
+	// encrypting, and must be set before Final() when decrypting, which
+	// then throws AuthenticationFailed if it doesn't match.
+	bool IsAuthenticated() const {return mAuthenticated;}
+	void AddAuthenticatedData(const void *pData, int Length);
+	int GetTagLength() const {return CIPHERCONTEXT_AEAD_TAG_LENGTH;}
+	void GetTag(void *pTagOut);
+	void SetTag(const void *pTag);
 	const char* GetFunction() const
 	{
 		return (mFunction == Encrypt) ? "encrypt" : "decrypt";
@@ -94,6 +111,7 @@ private:
 	bool mInitialised;
 	bool mWithinTransform;
 	bool mPaddingOn;
+	bool mAuthenticated;
 	uint8_t mGeneratedIV[CIPHERCONTEXT_MAX_GENERATED_IV_LENGTH];
 	CipherFunction mFunction;
 	std::string mCipherName;
@@ -44,7 +44,8 @@ public:
 		Mode_ECB = 0,
 		Mode_CBC = 1,
 		Mode_CFB = 2,
-		Mode_OFB = 3
+		Mode_OFB = 3,
+		Mode_GCM = 4	// authenticated, see CipherContext::GetTag()
 	} CipherMode;
 
 	virtual std::string GetCipherName() const = 0;
@@ -59,6 +60,7 @@ public:
 		case Mode_CBC: out << "CBC"; break;
 		case Mode_CFB: out << "CFB"; break;
 		case Mode_OFB: out << "OFB"; break;
+		case Mode_GCM: out << "GCM"; break;
 		default: out << "unknown";
 		}
 		return out.str();
@@ -0,0 +1,407 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    MultiRollingChecksum.cpp
+//		Purpose: A set of rolling checksums over blocks of different
+//			 lengths which all start at the same point in memory
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include "MultiRollingChecksum.h"
+#include "RollingChecksum.h"
+
+#ifdef MULTIROLLINGCHECKSUM_HAVE_X86_VECTORS
+	#include <immintrin.h>
+#endif
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MultiRollingChecksum::MultiRollingChecksum(const int32_t *, int)
+//		Purpose: Constructor. Takes the block length for each lane, and
+//			 picks the fastest implementation this processor can run.
+//			 Lanes must be set up with Initialise() before use.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+MultiRollingChecksum::MultiRollingChecksum(const int32_t *pLengths, int NumLengths)
+	: mpRollForward(&MultiRollingChecksum::RollForwardScalar),
+	  mNumLengths(NumLengths),
+	  mNumLanes(NumLengths)
+{
+	ASSERT(NumLengths >= 0 && NumLengths <= MULTIROLLINGCHECKSUM_MAX_LENGTHS);
+
+	for(int l = 0; l < MaxLanes; ++l)
+	{
+		mLengths[l] = (l < NumLengths) ? pLengths[l] : 0;
+		mReadOffset[l] = 0;
+		mA[l] = 0;
+		mB[l] = 0;
+		mLength16[l] = (uint16_t)mLengths[l];
+		mIncoming[l] = 0;
+	}
+
+#ifdef MULTIROLLINGCHECKSUM_HAVE_X86_VECTORS
+	if(NumLengths >= MinLengthsForVectors)
+	{
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2"))
+		{
+			mpRollForward = &MultiRollingChecksum::RollForwardAVX2;
+		}
+		else if(__builtin_cpu_supports("sse2"))
+		{
+			mpRollForward = &MultiRollingChecksum::RollForwardSSE2;
+		}
+
+		if(mpRollForward != &MultiRollingChecksum::RollForwardScalar)
+		{
+			mNumLanes = ((NumLengths + LaneGroupSize - 1)
+				/ LaneGroupSize) * LaneGroupSize;
+		}
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MultiRollingChecksum::Initialise(int, const uint8_t *)
+//		Purpose: Calculate the checksum for a lane from scratch, over
+//			 the block starting at pBlockStart, and mark it active.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void MultiRollingChecksum::Initialise(int Lane, const uint8_t *pBlockStart)
+{
+	ASSERT(Lane >= 0 && Lane < mNumLengths);
+
+	RollingChecksum initial(pBlockStart, mLengths[Lane]);
+	mA[Lane] = initial.GetComponent1();
+	mB[Lane] = initial.GetComponent2();
+	mReadOffset[Lane] = mLengths[Lane];
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MultiRollingChecksum::Deactivate(int)
+//		Purpose: Stop a lane reading the byte after its block, used
+//			 when that block reaches the end of the data. The
+//			 lane's checksum is meaningless afterwards.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void MultiRollingChecksum::Deactivate(int Lane)
+{
+	ASSERT(Lane >= 0 && Lane < mNumLengths);
+	mReadOffset[Lane] = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MultiRollingChecksum::GetImplementationName()
+//		Purpose: Returns the name of the implementation in use, for
+//			 logging and benchmarks.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+const char *MultiRollingChecksum::GetImplementationName() const
+{
+#ifdef MULTIROLLINGCHECKSUM_HAVE_X86_VECTORS
+	if(mpRollForward == &MultiRollingChecksum::RollForwardAVX2)
+	{
+		return "AVX2";
+	}
+	if(mpRollForward == &MultiRollingChecksum::RollForwardSSE2)
+	{
+		return "SSE2";
+	}
+#endif
+	return "scalar";
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MultiRollingChecksum::RollForwardScalar(const uint8_t *, int, uint32_t *)
+//		Purpose: Portable implementation of RollForward()
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void MultiRollingChecksum::RollForwardScalar(const uint8_t *pBlockStart,
+	int Count, uint32_t *pChecksums)
+{
+	// Copied to locals, as the compiler must otherwise assume that
+	// storing a checksum might change them
+	const int numLengths = mNumLengths;
+	const int stride = mNumLanes;
+
+	// One lane at a time, so that its state stays in registers. The
+	// arithmetic is done at full width, which gives the same bottom
+	// 16 bits as RollingChecksum::RollForward without the cost of
+	// working with 16 bit registers.
+	for(int l = 0; l < numLengths; ++l)
+	{
+		uint32_t a = mA[l];
+		uint32_t b = mB[l];
+		const uint32_t length = mLength16[l];
+		const uint8_t *pincoming = pBlockStart + mReadOffset[l];
+		uint32_t *pchecksum = pChecksums + l;
+
+		for(int p = 0; p < Count; ++p)
+		{
+			*pchecksum = (a & 0xffff) | (b << 16);
+			pchecksum += stride;
+
+			const uint32_t outgoing = pBlockStart[p];
+			a = a - outgoing + pincoming[p];
+			b = b - (length * outgoing) + a;
+		}
+
+		mA[l] = (uint16_t)a;
+		mB[l] = (uint16_t)b;
+	}
+}
+
+#ifdef MULTIROLLINGCHECKSUM_HAVE_X86_VECTORS
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static TransposeBytes16(const uint8_t *[16], int, __m128i[16])
+//		Purpose: Read the 16 bytes at Offset from each of the 16
+//			 pointers, and rearrange them so that each output
+//			 vector holds one position's byte from every pointer.
+//			 This is how the vector implementations fetch the
+//			 bytes entering each lane's block, which are all at
+//			 different places in memory. Always inlined, so that
+//			 it is compiled with the instruction set of the caller
+//			 and AVX2 code doesn't pay for switching to SSE.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+__attribute__((target("sse2"), always_inline))
+static inline void TransposeBytes16(const uint8_t *pRows[16], int Offset,
+	__m128i Out[16])
+{
+	__m128i s1[16], s2[16], s3[16];
+
+	// Pairs of rows, as 16 bit units, for columns 0-7 then 8-15
+	for(int k = 0; k < 8; ++k)
+	{
+		__m128i r0 = _mm_loadu_si128((const __m128i *)(pRows[2 * k] + Offset));
+		__m128i r1 = _mm_loadu_si128((const __m128i *)(pRows[2 * k + 1] + Offset));
+		s1[k] = _mm_unpacklo_epi8(r0, r1);
+		s1[8 + k] = _mm_unpackhi_epi8(r0, r1);
+	}
+
+	// Quads of rows, as 32 bit units, four columns per vector
+	for(int h = 0; h < 2; ++h)
+	{
+		for(int m = 0; m < 4; ++m)
+		{
+			s2[h * 8 + m * 2] = _mm_unpacklo_epi16(
+				s1[h * 8 + 2 * m], s1[h * 8 + 2 * m + 1]);
+			s2[h * 8 + m * 2 + 1] = _mm_unpackhi_epi16(
+				s1[h * 8 + 2 * m], s1[h * 8 + 2 * m + 1]);
+		}
+	}
+
+	// Eight rows, as 64 bit units, two columns per vector
+	for(int h = 0; h < 2; ++h)
+	{
+		for(int q = 0; q < 2; ++q)
+		{
+			for(int n = 0; n < 2; ++n)
+			{
+				__m128i x = s2[h * 8 + (2 * n) * 2 + q];
+				__m128i y = s2[h * 8 + (2 * n + 1) * 2 + q];
+				s3[h * 8 + q * 4 + n * 2] = _mm_unpacklo_epi32(x, y);
+				s3[h * 8 + q * 4 + n * 2 + 1] = _mm_unpackhi_epi32(x, y);
+			}
+		}
+	}
+
+	// All sixteen rows, one column per vector
+	for(int h = 0; h < 2; ++h)
+	{
+		for(int q = 0; q < 2; ++q)
+		{
+			for(int e = 0; e < 2; ++e)
+			{
+				__m128i x = s3[h * 8 + q * 4 + e];
+				__m128i y = s3[h * 8 + q * 4 + 2 + e];
+				int column = h * 8 + q * 4 + e * 2;
+				Out[column] = _mm_unpacklo_epi64(x, y);
+				Out[column + 1] = _mm_unpackhi_epi64(x, y);
+			}
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MultiRollingChecksum::RollForwardSSE2(const uint8_t *, int, uint32_t *)
+//		Purpose: RollForward() for sixteen lanes at a time, as two
+//			 vectors of eight. The arithmetic is done in 16 bit
+//			 lanes, which wrap exactly like uint16_t, and
+//			 interleaving the two components gives the checksums
+//			 in the same form as GetChecksum().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+__attribute__((target("sse2")))
+void MultiRollingChecksum::RollForwardSSE2(const uint8_t *pBlockStart,
+	int Count, uint32_t *pChecksums)
+{
+	const int stride = mNumLanes;
+	const __m128i zero = _mm_setzero_si128();
+
+	// One group of lanes at a time, so that its state stays in registers
+	for(int l = 0; l < stride; l += 16)
+	{
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(mA + l));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(mA + l + 8));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(mB + l));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(mB + l + 8));
+		const __m128i len0 = _mm_loadu_si128((const __m128i *)(mLength16 + l));
+		const __m128i len1 = _mm_loadu_si128((const __m128i *)(mLength16 + l + 8));
+		const uint8_t *pin[16];
+		for(int g = 0; g < 16; ++g)
+		{
+			pin[g] = pBlockStart + mReadOffset[l + g];
+		}
+		uint32_t *pchecksums = pChecksums + l;
+
+		__m128i incoming[16];
+		for(int p = 0; p < Count; ++p)
+		{
+			// Fetch the incoming bytes sixteen positions at a time
+			// where possible, otherwise one at a time at the end
+			int i = p & 15;
+			if(i == 0)
+			{
+				if(p + 16 <= Count)
+				{
+					TransposeBytes16(pin, p, incoming);
+				}
+				else
+				{
+					for(int q = p; q < Count; ++q)
+					{
+						uint8_t bytes[16];
+						for(int g = 0; g < 16; ++g)
+						{
+							bytes[g] = pin[g][q];
+						}
+						incoming[q - p] = _mm_loadu_si128((const __m128i *)bytes);
+					}
+				}
+			}
+
+			_mm_storeu_si128((__m128i *)pchecksums, _mm_unpacklo_epi16(a0, b0));
+			_mm_storeu_si128((__m128i *)(pchecksums + 4), _mm_unpackhi_epi16(a0, b0));
+			_mm_storeu_si128((__m128i *)(pchecksums + 8), _mm_unpacklo_epi16(a1, b1));
+			_mm_storeu_si128((__m128i *)(pchecksums + 12), _mm_unpackhi_epi16(a1, b1));
+			pchecksums += stride;
+
+			const __m128i outgoing = _mm_set1_epi16(pBlockStart[p]);
+			const __m128i mul = _mm_mullo_epi16(len0, outgoing);
+			const __m128i mul1 = _mm_mullo_epi16(len1, outgoing);
+			a0 = _mm_add_epi16(_mm_sub_epi16(a0, outgoing), _mm_unpacklo_epi8(incoming[i], zero));
+			a1 = _mm_add_epi16(_mm_sub_epi16(a1, outgoing), _mm_unpackhi_epi8(incoming[i], zero));
+			b0 = _mm_add_epi16(_mm_sub_epi16(b0, mul), a0);
+			b1 = _mm_add_epi16(_mm_sub_epi16(b1, mul1), a1);
+		}
+
+		_mm_storeu_si128((__m128i *)(mA + l), a0);
+		_mm_storeu_si128((__m128i *)(mA + l + 8), a1);
+		_mm_storeu_si128((__m128i *)(mB + l), b0);
+		_mm_storeu_si128((__m128i *)(mB + l + 8), b1);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    MultiRollingChecksum::RollForwardAVX2(const uint8_t *, int, uint32_t *)
+//		Purpose: As RollForwardSSE2(), with each group of sixteen
+//			 lanes in a single vector. The AVX2 unpack
+//			 instructions work within each 128 bit half, so the
+//			 checksums are stored a half at a time to keep them in
+//			 lane order.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+__attribute__((target("avx2")))
+void MultiRollingChecksum::RollForwardAVX2(const uint8_t *pBlockStart,
+	int Count, uint32_t *pChecksums)
+{
+	const int stride = mNumLanes;
+
+	for(int l = 0; l < stride; l += 16)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(mA + l));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(mB + l));
+		const __m256i len = _mm256_loadu_si256((const __m256i *)(mLength16 + l));
+		const uint8_t *pin[16];
+		for(int g = 0; g < 16; ++g)
+		{
+			pin[g] = pBlockStart + mReadOffset[l + g];
+		}
+		uint32_t *pchecksums = pChecksums + l;
+
+		__m128i incoming[16];
+		for(int p = 0; p < Count; ++p)
+		{
+			int i = p & 15;
+			if(i == 0)
+			{
+				if(p + 16 <= Count)
+				{
+					TransposeBytes16(pin, p, incoming);
+				}
+				else
+				{
+					for(int q = p; q < Count; ++q)
+					{
+						uint8_t bytes[16];
+						for(int g = 0; g < 16; ++g)
+						{
+							bytes[g] = pin[g][q];
+						}
+						incoming[q - p] = _mm_loadu_si128((const __m128i *)bytes);
+					}
+				}
+			}
+
+			const __m256i lo = _mm256_unpacklo_epi16(a, b);
+			const __m256i hi = _mm256_unpackhi_epi16(a, b);
+			_mm256_storeu_si256((__m256i *)pchecksums,
+				_mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256((__m256i *)(pchecksums + 8),
+				_mm256_permute2x128_si256(lo, hi, 0x31));
+			pchecksums += stride;
+
+			const __m256i outgoing = _mm256_set1_epi16(pBlockStart[p]);
+			const __m256i in = _mm256_cvtepu8_epi16(incoming[i]);
+
+			a = _mm256_add_epi16(_mm256_sub_epi16(a, outgoing), in);
+			b = _mm256_sub_epi16(b, _mm256_mullo_epi16(len, outgoing));
+			b = _mm256_add_epi16(b, a);
+		}
+
+		_mm256_storeu_si256((__m256i *)(mA + l), a);
+		_mm256_storeu_si256((__m256i *)(mB + l), b);
+	}
+}
+
+#endif // MULTIROLLINGCHECKSUM_HAVE_X86_VECTORS
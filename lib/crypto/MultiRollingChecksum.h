@@ -0,0 +1,129 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    MultiRollingChecksum.h
+//		Purpose: A set of rolling checksums over blocks of different
+//			 lengths which all start at the same point in memory
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef MULTIROLLINGCHECKSUM__H
+#define MULTIROLLINGCHECKSUM__H
+
+// Maximum number of block lengths which can be rolled together
+#define MULTIROLLINGCHECKSUM_MAX_LENGTHS	64
+
+// The vector implementations are selected at runtime, so they need a
+// compiler which can build code for instruction sets other than the
+// default one (GCC 4.9 or later, or Clang).
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || \
+	 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+	#define MULTIROLLINGCHECKSUM_HAVE_X86_VECTORS
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    MultiRollingChecksum
+//		Purpose: Maintains one RollingChecksum per block length (a "lane"),
+//			 for windows which all begin at the same byte. Rolling the
+//			 set forward one byte updates every lane at once, so a
+//			 file can be scanned for blocks of many sizes in a single
+//			 pass. Lanes are updated with SSE2 or AVX2 where the
+//			 processor supports it, otherwise with plain C++.
+//
+//			 The checksums are identical to those calculated by
+//			 RollingChecksum for the same data.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class MultiRollingChecksum
+{
+public:
+	MultiRollingChecksum(const int32_t *pLengths, int NumLengths);
+
+private:
+	// no copying
+	MultiRollingChecksum(const MultiRollingChecksum &);
+	MultiRollingChecksum &operator=(const MultiRollingChecksum &);
+
+public:
+	void Initialise(int Lane, const uint8_t *pBlockStart);
+	void Deactivate(int Lane);
+
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    MultiRollingChecksum::RollForward(const uint8_t *, int, uint32_t *)
+	//		Purpose: Store the checksum of every lane at each of the
+	//			 next Count positions, starting with the current
+	//			 one, and roll all active lanes forward past them.
+	//			 pBlockStart points to the first byte of the
+	//			 current blocks. pBlockStart[Count - 1 + Length]
+	//			 must be readable for every active lane.
+	//
+	//			 pChecksums receives Count rows of
+	//			 GetChecksumStride() entries, one row per
+	//			 position and one entry per lane.
+	//		Created: 2026/10/18
+	//
+	// --------------------------------------------------------------------------
+	inline void RollForward(const uint8_t *pBlockStart, int Count,
+		uint32_t *pChecksums)
+	{
+		(this->*mpRollForward)(pBlockStart, Count, pChecksums);
+	}
+
+	inline uint32_t GetChecksum(int Lane) const
+	{
+		return ((uint32_t)mA[Lane]) | (((uint32_t)mB[Lane]) << 16);
+	}
+
+	inline uint16_t GetComponentForHashing(int Lane) const
+	{
+		return mB[Lane];
+	}
+
+	int GetNumLengths() const {return mNumLengths;}
+	int GetChecksumStride() const {return mNumLanes;}
+	int32_t GetLength(int Lane) const {return mLengths[Lane];}
+	const char *GetImplementationName() const;
+
+private:
+	void RollForwardScalar(const uint8_t *pBlockStart, int Count,
+		uint32_t *pChecksums);
+#ifdef MULTIROLLINGCHECKSUM_HAVE_X86_VECTORS
+	void RollForwardSSE2(const uint8_t *pBlockStart, int Count,
+		uint32_t *pChecksums);
+	void RollForwardAVX2(const uint8_t *pBlockStart, int Count,
+		uint32_t *pChecksums);
+#endif
+
+	// The vector implementations work on groups of sixteen lanes, so
+	// the lane count is rounded up to a whole number of groups. With
+	// only a few lengths most of each group would be wasted, so those
+	// are rolled one lane at a time.
+	enum
+	{
+		LaneGroupSize = 16,
+		MaxLanes = ((MULTIROLLINGCHECKSUM_MAX_LENGTHS + LaneGroupSize - 1)
+			/ LaneGroupSize) * LaneGroupSize,
+		MinLengthsForVectors = 4
+	};
+
+	void (MultiRollingChecksum::*mpRollForward)(const uint8_t *, int,
+		uint32_t *);
+	int mNumLengths;
+	int mNumLanes;
+	int32_t mLengths[MaxLanes];
+	int32_t mReadOffset[MaxLanes];
+	// Everything is implicitly mod 2^16, as in RollingChecksum
+	uint16_t mA[MaxLanes];
+	uint16_t mB[MaxLanes];
+	uint16_t mLength16[MaxLanes];
+	uint16_t mIncoming[MaxLanes];
+};
+
+#endif // MULTIROLLINGCHECKSUM__H
@@ -0,0 +1,271 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    RaidFileConverter.cpp
+//		Purpose: Background queue of RaidFiles waiting to be
+//			 converted to RAID storage
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <algorithm>
+
+#include "RaidFileController.h"
+#include "RaidFileConverter.h"
+#include "RaidFileUtil.h"
+#include "RaidFileWrite.h"
+
+#include "MemLeakFindOn.h"
+
+Mutex RaidFileConverter::sActiveMutex;
+std::vector<RaidFileConverter *> RaidFileConverter::sActive;
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::RaidFileConverter()
+//		Purpose: Constructor, starts the thread
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+RaidFileConverter::RaidFileConverter()
+	: mIsConverting(false),
+	  mStopping(false),
+	  mFinished(false),
+	  mNumConverted(0)
+{
+	{
+		MutexLock lock(sActiveMutex);
+		sActive.push_back(this);
+	}
+
+	if(Thread::IsSupported())
+	{
+		Start();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::~RaidFileConverter()
+//		Purpose: Destructor, converts any files still queued
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+RaidFileConverter::~RaidFileConverter()
+{
+	Finish();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::Add(int, const std::string &)
+//		Purpose: Queue a committed RaidFile to be converted
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileConverter::Add(int SetNumber, const std::string &rFilename)
+{
+	Entry entry(SetNumber, rFilename);
+
+	{
+		MutexLock lock(mMutex);
+		if(IsStarted() && !mStopping)
+		{
+			if(std::find(mQueue.begin(), mQueue.end(), entry) ==
+				mQueue.end())
+			{
+				mQueue.push_back(entry);
+				mChanged.Broadcast();
+			}
+			return;
+		}
+	}
+
+	// No thread to do it later
+	Convert(entry);
+	MutexLock lock(mMutex);
+	++mNumConverted;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::Finish()
+//		Purpose: Convert all the files still queued, and stop the
+//			 thread
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileConverter::Finish()
+{
+	if(mFinished)
+	{
+		return;
+	}
+
+	if(IsStarted())
+	{
+		{
+			MutexLock lock(mMutex);
+			mStopping = true;
+			mChanged.Broadcast();
+		}
+		Join();
+	}
+
+	MutexLock lock(sActiveMutex);
+	sActive.erase(std::find(sActive.begin(), sActive.end(), this));
+	mFinished = true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::GetNumConverted()
+//		Purpose: How many files have been converted so far
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t RaidFileConverter::GetNumConverted()
+{
+	MutexLock lock(mMutex);
+	return mNumConverted;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::WaitForFile(int, const std::string &)
+//		Purpose: Static. Make sure that no converter has the file
+//			 queued or is converting it, converting it now if
+//			 it's still queued.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileConverter::WaitForFile(int SetNumber, const std::string &rFilename)
+{
+	MutexLock lock(sActiveMutex);
+	if(sActive.empty())
+	{
+		return;
+	}
+
+	Entry entry(SetNumber, rFilename);
+	for(std::vector<RaidFileConverter *>::iterator
+		i(sActive.begin()); i != sActive.end(); ++i)
+	{
+		(*i)->WaitForQueuedFile(entry);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::WaitForQueuedFile(const Entry &)
+//		Purpose: If the file is queued, take it off the queue and
+//			 convert it now. If the thread is converting it,
+//			 wait until it has finished.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileConverter::WaitForQueuedFile(const Entry &rEntry)
+{
+	{
+		MutexLock lock(mMutex);
+		while(mIsConverting && mConverting == rEntry)
+		{
+			mChanged.Wait(mMutex);
+		}
+
+		std::deque<Entry>::iterator i(std::find(mQueue.begin(),
+			mQueue.end(), rEntry));
+		if(i == mQueue.end())
+		{
+			return;
+		}
+		mQueue.erase(i);
+	}
+
+	Convert(rEntry);
+	MutexLock lock(mMutex);
+	++mNumConverted;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::Run()
+//		Purpose: Thread which converts the queued files in order,
+//			 until asked to stop and the queue is empty
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileConverter::Run()
+{
+	MutexLock lock(mMutex);
+	while(true)
+	{
+		while(mQueue.empty() && !mStopping)
+		{
+			mChanged.Wait(mMutex);
+		}
+		if(mQueue.empty())
+		{
+			return;
+		}
+
+		mConverting = mQueue.front();
+		mQueue.pop_front();
+		mIsConverting = true;
+
+		mMutex.Unlock();
+		Convert(mConverting);
+		mMutex.Lock();
+
+		mIsConverting = false;
+		++mNumConverted;
+		mChanged.Broadcast();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileConverter::Convert(const Entry &)
+//		Purpose: Static. Convert a file to RAID storage, if it
+//			 hasn't been already. Failures are only logged, as
+//			 the file is still perfectly readable as it is.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileConverter::Convert(const Entry &rEntry)
+{
+	try
+	{
+		RaidFileController &rcontroller(RaidFileController::GetController());
+		RaidFileDiscSet rdiscSet(rcontroller.GetDiscSet(rEntry.first));
+		if(RaidFileUtil::RaidFileExists(rdiscSet, rEntry.second) !=
+			RaidFileUtil::NonRaid)
+		{
+			return;
+		}
+
+		RaidFileWrite file(rEntry.first, rEntry.second);
+		file.TransformToRaidStorage();
+	}
+	catch(BoxException &e)
+	{
+		BOX_ERROR("Failed to convert " << rEntry.second << " to RAID "
+			"storage, leaving it as it is: " << e.what());
+	}
+	catch(std::exception &e)
+	{
+		BOX_ERROR("Failed to convert " << rEntry.second << " to RAID "
+			"storage, leaving it as it is: " << e.what());
+	}
+}
@@ -0,0 +1,78 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    RaidFileConverter.h
+//		Purpose: Background queue of RaidFiles waiting to be
+//			 converted to RAID storage
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef RAIDFILECONVERTER__H
+#define RAIDFILECONVERTER__H
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Thread.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    RaidFileConverter
+//		Purpose: Converts committed RaidFiles to RAID storage in a
+//			 thread of its own, so that whoever wrote them
+//			 doesn't have to wait. Until then the files are
+//			 read from the single write file, as usual. Opening
+//			 or deleting a RaidFileWrite for a file which is
+//			 still queued converts it first, so the conversion
+//			 never races with a newer version. Files still
+//			 queued are converted by Finish(), which must be
+//			 called before giving up any lock which stops
+//			 other processes from writing the files. On
+//			 platforms without threads, files are converted
+//			 as soon as they're added.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class RaidFileConverter : public Thread
+{
+public:
+	RaidFileConverter();
+	~RaidFileConverter();
+private:
+	// no copying
+	RaidFileConverter(const RaidFileConverter &);
+	RaidFileConverter &operator=(const RaidFileConverter &);
+public:
+	void Add(int SetNumber, const std::string &rFilename);
+	void Finish();
+	int64_t GetNumConverted();
+
+	static void WaitForFile(int SetNumber, const std::string &rFilename);
+
+protected:
+	virtual void Run();
+
+private:
+	typedef std::pair<int, std::string> Entry;
+
+	void WaitForQueuedFile(const Entry &rEntry);
+	static void Convert(const Entry &rEntry);
+
+	Mutex mMutex;
+	ConditionVariable mChanged;
+	std::deque<Entry> mQueue;
+	Entry mConverting;
+	bool mIsConverting;
+	bool mStopping;
+	bool mFinished;
+	int64_t mNumConverted;
+
+	static Mutex sActiveMutex;
+	static std::vector<RaidFileConverter *> sActive;
+};
+
+#endif // RAIDFILECONVERTER__H
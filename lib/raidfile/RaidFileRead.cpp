@@ -75,6 +75,7 @@ public:
 	virtual void Close();
 	virtual pos_type GetFileSize() const;
 	virtual bool StreamDataLeft();
+	virtual int GetOSFileHandle() const {return mOSFileHandle;}
 
 private:
 	int mOSFileHandle;
@@ -72,6 +72,10 @@ public:
 	pos_type GetDiscUsageInBlocks();
 	std::string ToString() const;
 
+	// OS handle of the whole file, for files which are stored on a
+	// single disc, or -1 for files which are split into stripes
+	virtual int GetOSFileHandle() const {return -1;}
+
 	typedef int64_t FileSizeType;
 
 	static const RaidFileReadCategory OPEN_IN_RECOVERY;
@@ -26,11 +26,17 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
+
 #include "Guards.h"
+#include "RaidFileConverter.h"
 #include "RaidFileWrite.h"
 #include "RaidFileController.h"
 #include "RaidFileException.h"
 #include "RaidFileUtil.h"
+#include "Thread.h"
 #include "Utils.h"
 // For DirectoryExists fn
 #include "RaidFileRead.h"
@@ -38,10 +44,354 @@
 #include "MemLeakFindOn.h"
 
 // should be a multiple of 2
-#define TRANSFORM_BLOCKS_TO_LOAD		4
+#define TRANSFORM_BLOCKS_TO_LOAD		256
 // Must have this number of discs in the set
 #define TRANSFORM_NUMBER_DISCS_REQUIRED	3
 
+bool RaidFileWrite::msParallelTransform = true;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    RaidFileDiscWriter
+//		Purpose: Writes one of the files of a RAID file set, in a
+//			 thread of its own if requested, so that the writes
+//			 to each disc happen at the same time. Up to two
+//			 writes can be queued, so that the next chunk can be
+//			 prepared while the last one is written.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class RaidFileDiscWriter : public Thread
+{
+public:
+	RaidFileDiscWriter(int OSFileHandle, const std::string &rFilename,
+		bool Threaded);
+	~RaidFileDiscWriter();
+private:
+	// no copying
+	RaidFileDiscWriter(const RaidFileDiscWriter &);
+	RaidFileDiscWriter &operator=(const RaidFileDiscWriter &);
+public:
+	void Write(const char *pData, int Length);
+	void WaitForWrites(int64_t NumWrites);
+	void Finish();
+
+protected:
+	virtual void Run();
+
+private:
+	void Stop();
+	static int WriteAll(int OSFileHandle, const char *pData, int Length);
+
+	int mOSFileHandle;
+	std::string mFilename;
+	Mutex mMutex;
+	ConditionVariable mChanged;
+	const char *mpData[2];
+	int mLength[2];
+	int64_t mNumQueued, mNumDone;
+	bool mStopping;
+	int mErrno;
+};
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileDiscWriter::RaidFileDiscWriter(int, const std::string &, bool)
+//		Purpose: Constructor. Starts the thread if Threaded is set
+//			 and threads are supported, otherwise the writes
+//			 are done by the caller.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+RaidFileDiscWriter::RaidFileDiscWriter(int OSFileHandle,
+	const std::string &rFilename, bool Threaded)
+	: mOSFileHandle(OSFileHandle),
+	  mFilename(rFilename),
+	  mNumQueued(0),
+	  mNumDone(0),
+	  mStopping(false),
+	  mErrno(0)
+{
+	if(Threaded && Thread::IsSupported())
+	{
+		Start();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileDiscWriter::~RaidFileDiscWriter()
+//		Purpose: Destructor. Stops the thread without reporting
+//			 errors, for when the transform has already failed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+RaidFileDiscWriter::~RaidFileDiscWriter()
+{
+	Stop();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileDiscWriter::Stop()
+//		Purpose: Ask the thread to stop once it has finished the
+//			 queued writes, and wait for it
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileDiscWriter::Stop()
+{
+	if(!IsStarted())
+	{
+		return;
+	}
+
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mChanged.Broadcast();
+	}
+	Join();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileDiscWriter::WriteAll(int, const char *, int)
+//		Purpose: Static. Write all the data, returning 0 or the
+//			 errno of the failure.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int RaidFileDiscWriter::WriteAll(int OSFileHandle, const char *pData,
+	int Length)
+{
+	while(Length > 0)
+	{
+		int written = ::write(OSFileHandle, pData, Length);
+		if(written == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return errno;
+		}
+		if(written == 0)
+		{
+			return EIO;
+		}
+		pData += written;
+		Length -= written;
+	}
+
+	return 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileDiscWriter::Write(const char *, int)
+//		Purpose: Write data to the file, or queue it to be written
+//			 by the thread. The data must not be changed until
+//			 WaitForWrites() says that this write is done.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileDiscWriter::Write(const char *pData, int Length)
+{
+	if(!IsStarted())
+	{
+		int error = WriteAll(mOSFileHandle, pData, Length);
+		if(error != 0)
+		{
+			THROW_SYS_FILE_ERRNO("Failed to write RaidFile stripe",
+				mFilename, error, RaidFileException, OSError);
+		}
+		++mNumQueued;
+		++mNumDone;
+		return;
+	}
+
+	MutexLock lock(mMutex);
+	ASSERT(mNumQueued - mNumDone < 2);
+	mpData[mNumQueued & 1] = pData;
+	mLength[mNumQueued & 1] = Length;
+	++mNumQueued;
+	mChanged.Broadcast();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileDiscWriter::WaitForWrites(int64_t)
+//		Purpose: Wait until the first NumWrites writes have been
+//			 done, throwing an exception if any failed
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileDiscWriter::WaitForWrites(int64_t NumWrites)
+{
+	MutexLock lock(mMutex);
+	while(mNumDone < NumWrites && mErrno == 0)
+	{
+		mChanged.Wait(mMutex);
+	}
+
+	if(mErrno != 0)
+	{
+		THROW_SYS_FILE_ERRNO("Failed to write RaidFile stripe",
+			mFilename, mErrno, RaidFileException, OSError);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileDiscWriter::Finish()
+//		Purpose: Wait for all the queued writes and stop the
+//			 thread, throwing an exception if any write failed
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileDiscWriter::Finish()
+{
+	Stop();
+
+	if(mErrno != 0)
+	{
+		THROW_SYS_FILE_ERRNO("Failed to write RaidFile stripe",
+			mFilename, mErrno, RaidFileException, OSError);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    RaidFileDiscWriter::Run()
+//		Purpose: Thread which does the queued writes, in order
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void RaidFileDiscWriter::Run()
+{
+	while(true)
+	{
+		const char *pData;
+		int length;
+		{
+			MutexLock lock(mMutex);
+			while(mNumDone == mNumQueued && !mStopping)
+			{
+				mChanged.Wait(mMutex);
+			}
+			if(mNumDone == mNumQueued)
+			{
+				return;
+			}
+			pData = mpData[mNumDone & 1];
+			length = mLength[mNumDone & 1];
+		}
+
+		int error = WriteAll(mOSFileHandle, pData, length);
+
+		MutexLock lock(mMutex);
+		if(error != 0)
+		{
+			mErrno = error;
+			mChanged.Broadcast();
+			return;
+		}
+		++mNumDone;
+		mChanged.Broadcast();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SplitBlocks(const char *, char *, char *, char *, unsigned int)
+//		Purpose: Static. Copy a pair of adjacent blocks from pIn to
+//			 the two stripe buffers, and put the XOR of them in
+//			 the parity buffer, in one pass over the data, using
+//			 SIMD instructions where available.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static void SplitBlocks(const char *pIn, char *pStripe1, char *pStripe2,
+	char *pParity, unsigned int BlockSize)
+{
+	const char *pIn1 = pIn;
+	const char *pIn2 = pIn + BlockSize;
+	unsigned int n = 0;
+
+#ifdef __SSE2__
+	for(; n + sizeof(__m128i) <= BlockSize; n += sizeof(__m128i))
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(pIn1 + n));
+		__m128i b = _mm_loadu_si128((const __m128i *)(pIn2 + n));
+		_mm_storeu_si128((__m128i *)(pStripe1 + n), a);
+		_mm_storeu_si128((__m128i *)(pStripe2 + n), b);
+		_mm_storeu_si128((__m128i *)(pParity + n), _mm_xor_si128(a, b));
+	}
+#endif
+
+	for(; n + sizeof(uint64_t) <= BlockSize; n += sizeof(uint64_t))
+	{
+		uint64_t a, b;
+		::memcpy(&a, pIn1 + n, sizeof(a));
+		::memcpy(&b, pIn2 + n, sizeof(b));
+		::memcpy(pStripe1 + n, &a, sizeof(a));
+		::memcpy(pStripe2 + n, &b, sizeof(b));
+		a ^= b;
+		::memcpy(pParity + n, &a, sizeof(a));
+	}
+
+	for(; n < BlockSize; ++n)
+	{
+		pStripe1[n] = pIn1[n];
+		pStripe2[n] = pIn2[n];
+		pParity[n] = pIn1[n] ^ pIn2[n];
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static ReadFully(int, char *, int)
+//		Purpose: Static. Read until the buffer is full or the end
+//			 of the file is reached, returning the number of
+//			 bytes read, or -1 on error.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int ReadFully(int OSFileHandle, char *pBuffer, int Size)
+{
+	int total = 0;
+	while(total < Size)
+	{
+		int r = ::read(OSFileHandle, pBuffer + total, Size - total);
+		if(r == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		if(r == 0)
+		{
+			break;
+		}
+		total += r;
+	}
+	return total;
+}
+
 // We want to use POSIX fstat() for now, not the emulated one, because it's
 // difficult to rewrite all this code to use HANDLEs instead of ints.
 
@@ -142,6 +492,10 @@ void RaidFileWrite::Open(bool AllowOverwrite)
 	{
 		THROW_EXCEPTION(RaidFileException, AlreadyOpen)
 	}
+
+	// An earlier version mustn't still be waiting to be converted
+	// to RAID storage in the background when it's replaced
+	RaidFileConverter::WaitForFile(mSetNumber, mFilename);
 	
 	// Get disc set
 	RaidFileController &rcontroller(RaidFileController::GetController());
@@ -165,9 +519,10 @@ void RaidFileWrite::Open(bool AllowOverwrite)
 	// Add on a temporary extension
 	mTempFilename += 'X';
 
-	// Attempt to open
+	// Attempt to open. Opened for reading too, so that callers can
+	// rearrange data which they've already written.
 	mOSFileHandle = ::open(mTempFilename.c_str(), 
-		O_WRONLY | O_CREAT | O_BINARY,
+		O_RDWR | O_CREAT | O_BINARY,
 		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 	if(mOSFileHandle == -1)
 	{
@@ -498,14 +853,22 @@ void RaidFileWrite::TransformToRaidStorage()
 	// And how big should the buffer be? (round up to multiple of 2, and no bigger than the preset limit)
 	int bufferSizeBlocks = (writeFileSizeInBlocks + 1) & ~1;
 	if(bufferSizeBlocks > TRANSFORM_BLOCKS_TO_LOAD) bufferSizeBlocks = TRANSFORM_BLOCKS_TO_LOAD;
+	if(bufferSizeBlocks < 2) bufferSizeBlocks = 2;
 	// How big should the buffer be?
-	int bufferSize = (TRANSFORM_BLOCKS_TO_LOAD * blockSize);
+	int bufferSize = (bufferSizeBlocks * blockSize);
 	
 	// Allocate buffer...
 	MemoryBlockGuard<char*> buffer(bufferSize);
 	
-	// Allocate buffer for parity file
-	MemoryBlockGuard<char*> parityBuffer(blockSize);
+	// Allocate buffers for the stripes and parity. There are two sets,
+	// so that one chunk can be prepared while the last is written.
+	int stripeBufferSize = (bufferSizeBlocks / 2) * blockSize;
+	MemoryBlockGuard<char*> stripeBuffers(stripeBufferSize * 3 * 2);
+
+	// Only write to the discs in parallel if there's more than one chunk,
+	// as starting the threads would take longer than writing small files
+	bool parallel = msParallelTransform &&
+		(writeFileSizeInBlocks > bufferSizeBlocks);
 	
 	// Get filenames of eventual files
 	std::string stripe1Filename(RaidFileUtil::MakeRaidComponentName(rdiscSet, mFilename, (startDisc + 0) % TRANSFORM_NUMBER_DISCS_REQUIRED));
@@ -530,12 +893,31 @@ void RaidFileWrite::TransformToRaidStorage()
 		FileHandleGuard<(O_WRONLY | O_CREAT | O_EXCL | O_BINARY)> parity(parityFilenameW.c_str());
 #endif
 
+		// Writers for each disc, stopped before the files are closed
+		RaidFileDiscWriter stripe1Writer(stripe1, stripe1FilenameW, parallel);
+		RaidFileDiscWriter stripe2Writer(stripe2, stripe2FilenameW, parallel);
+		RaidFileDiscWriter parityWriter(parity, parityFilenameW, parallel);
+
 		// Then... read in data...
 		int bytesRead = -1;
 		bool sizeRecordRequired = false;
 		int blocksDone = 0;
-		while((bytesRead = ::read(writeFile, buffer, bufferSize)) > 0)
+		int64_t chunk = 0;
+		while((bytesRead = ReadFully(writeFile, buffer, bufferSize)) > 0)
 		{
+			// The buffers for this chunk were last used two chunks
+			// ago, and must have been written by now
+			if(chunk >= 2)
+			{
+				stripe1Writer.WaitForWrites(chunk - 1);
+				stripe2Writer.WaitForWrites(chunk - 1);
+				parityWriter.WaitForWrites(chunk - 1);
+			}
+			char *pstripe1Out = ((char*)stripeBuffers) +
+				((chunk & 1) * 3 * stripeBufferSize);
+			char *pstripe2Out = pstripe1Out + stripeBufferSize;
+			char *pparityOut = pstripe2Out + stripeBufferSize;
+
 			// Blocks to do...
 			int blocksToDo = (bytesRead + (blockSize - 1)) / blockSize;
 
@@ -548,22 +930,18 @@ void RaidFileWrite::TransformToRaidStorage()
 				::memset(buffer + bytesRead, 0, zerosEnd - bytesRead);
 			}
 
-			// number of int's to XOR
-			unsigned int num = blockSize / sizeof(unsigned int);
-
-			// Then... calculate and write parity data
+			// Then... split the stripes and calculate parity data
+			int parityBytes = 0;
 			for(int b = 0; b < blocksToDo; b += 2)
 			{
+				int offset = (b / 2) * blockSize;
+				SplitBlocks(buffer + (b * blockSize),
+					pstripe1Out + offset, pstripe2Out + offset,
+					pparityOut + offset, blockSize);
+
 				// Calculate int pointers
 				unsigned int *pstripe1 = (unsigned int *)(buffer + (b * blockSize));
-				unsigned int *pstripe2 = (unsigned int *)(buffer + ((b+1) * blockSize));
-				unsigned int *pparity = (unsigned int *)((char*)parityBuffer);
-
-				// Do XOR
-				for(unsigned int n = 0; n < num; ++n)
-				{
-					pparity[n] = pstripe1[n] ^ pstripe2[n];
-				}
+				unsigned int *pparity = (unsigned int *)(pparityOut + offset);
 				
 				// Size of parity to write...
 				int parityWriteSize = blockSize;
@@ -607,38 +985,44 @@ void RaidFileWrite::TransformToRaidStorage()
 					}
 				}
 
-				// Write block
-				if(::write(parity, parityBuffer, parityWriteSize) != parityWriteSize)
-				{
-					THROW_EXCEPTION(RaidFileException, OSError)
-				}
+				// Only the last block can be short
+				parityBytes += parityWriteSize;
 			}
 
-			// Write stripes
-			char *writeFrom = buffer;
-			for(int l = 0; l < blocksToDo; ++l)
+			// Work out how much of each stripe to write. Only the
+			// last block can be short.
+			int lastBlockSize = bytesRead - ((blocksToDo - 1) * blockSize);
+			int stripe1Bytes = ((blocksToDo + 1) / 2) * blockSize;
+			int stripe2Bytes = (blocksToDo / 2) * blockSize;
+			if((blocksToDo & 1) == 1)
 			{
-				// Write the block
-				int toWrite = (l == (blocksToDo - 1))
-								?(bytesRead - ((blocksToDo-1)*blockSize))
-								:blockSize;
-				if(::write(((l&1)==0)?stripe1:stripe2, writeFrom, toWrite) != toWrite)
-				{
-					THROW_EXCEPTION(RaidFileException, OSError)
-				}			
-
-				// Next block
-				writeFrom += blockSize;
+				stripe1Bytes -= blockSize - lastBlockSize;
 			}
+			else
+			{
+				stripe2Bytes -= blockSize - lastBlockSize;
+			}
+
+			// Write to all the discs at once
+			stripe1Writer.Write(pstripe1Out, stripe1Bytes);
+			stripe2Writer.Write(pstripe2Out, stripe2Bytes);
+			parityWriter.Write(pparityOut, parityBytes);
 			
 			// Count of blocks done
 			blocksDone += blocksToDo;
+			++chunk;
 		}
 		// Error on read?
 		if(bytesRead == -1)
 		{
-			THROW_EXCEPTION(RaidFileException, OSError)
+			THROW_SYS_FILE_ERROR("Failed to read RaidFile",
+				writeFilename, RaidFileException, OSError);
 		}
+
+		// Wait for everything to be written
+		stripe1Writer.Finish();
+		stripe2Writer.Finish();
+		parityWriter.Finish();
 		
 		// Special case for zero length files
 		if(writeFileStat.st_size == 0)
@@ -736,6 +1120,9 @@ void RaidFileWrite::Delete()
 			RaidFileException, RequestedDeleteReferencedFile);
 	}
 
+	// Nor when it's deleted
+	RaidFileConverter::WaitForFile(mSetNumber, mFilename);
+
 	// Get disc set
 	RaidFileController &rcontroller(RaidFileController::GetController());
 	RaidFileDiscSet rdiscSet(rcontroller.GetDiscSet(mSetNumber));
@@ -877,13 +1264,27 @@ void RaidFileWrite::CreateDirectory(const RaidFileDiscSet &rSet, const std::stri
 //
 // Function
 //		Name:    RaidFileWrite::Read(void *, int, int)
-//		Purpose: Unsupported, will exception
+//		Purpose: Reads back data which has already been written,
+//			 from the current position
 //		Created: 2003/08/21
 //
 // --------------------------------------------------------------------------
 int RaidFileWrite::Read(void *pBuffer, int NBytes, int Timeout)
 {
-	THROW_EXCEPTION(RaidFileException, UnsupportedReadWriteOrClose)
+	// open?
+	if(mOSFileHandle == -1)
+	{
+		THROW_EXCEPTION(RaidFileException, NotOpen)
+	}
+
+	int r = ::read(mOSFileHandle, pBuffer, NBytes);
+	if(r == -1)
+	{
+		THROW_SYS_FILE_ERROR("Failed to read from RaidFile",
+			mTempFilename, RaidFileException, OSError);
+	}
+
+	return r;
 }
 
 // --------------------------------------------------------------------------
@@ -907,13 +1308,14 @@ void RaidFileWrite::Close()
 //
 // Function
 //		Name:    RaidFileWrite::StreamDataLeft()
-//		Purpose: Never any data left to read!
+//		Purpose: Whether any data which has been written lies
+//			 beyond the current position
 //		Created: 2003/08/21
 //
 // --------------------------------------------------------------------------
 bool RaidFileWrite::StreamDataLeft()
 {
-	return false;
+	return mOSFileHandle != -1 && GetPosition() < GetFileSize();
 }
 
 // --------------------------------------------------------------------------
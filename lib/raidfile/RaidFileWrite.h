@@ -47,7 +47,7 @@ private:
 
 public:
 	// IOStream interface
-	virtual int Read(void *pBuffer, int NBytes, int Timeout = IOStream::TimeOutInfinite);	// will exception
+	virtual int Read(void *pBuffer, int NBytes, int Timeout = IOStream::TimeOutInfinite);
 	virtual void Write(const void *pBuffer, int NBytes,
 		int Timeout = IOStream::TimeOutInfinite);
 	virtual pos_type GetPosition() const;
@@ -64,15 +64,26 @@ public:
 	void Delete();
 	pos_type GetFileSize();
 	pos_type GetDiscUsageInBlocks();
+	// Handle of the temporary file being written, or -1 if not open
+	int GetOSFileHandle() const {return mOSFileHandle;}
 	
 	static void CreateDirectory(int SetNumber, const std::string &rDirName, bool Recursive = false, int mode = 0777);
 	static void CreateDirectory(const RaidFileDiscSet &rSet, const std::string &rDirName, bool Recursive = false, int mode = 0777);
 
+	// Whether TransformToRaidStorage() writes the stripes and parity
+	// of large files to their discs in parallel threads
+	static void SetParallelTransform(bool Parallel)
+	{
+		msParallelTransform = Parallel;
+	}
+
 private:
 	int mSetNumber;
 	std::string mFilename, mTempFilename;
 	int mOSFileHandle;
 	int mRefCount;
+
+	static bool msParallelTransform;
 };
 
 #endif // RAIDFILEWRITE__H
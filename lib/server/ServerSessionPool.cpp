@@ -0,0 +1,569 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    ServerSessionPool.cpp
+//		Purpose: Handle many client sessions in one process, with a
+//			 small pool of worker threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#ifdef HAVE_EPOLL_CREATE1
+	#include <sys/epoll.h>
+#elif !defined WIN32
+	#include <poll.h>
+#endif
+
+#include "autogen_ServerException.h"
+#include "IOStream.h"
+#include "ServerSessionPool.h"
+#include "SocketStream.h"
+
+#include "MemLeakFindOn.h"
+
+// Maximum number of events to collect from each epoll_wait()
+#define SESSION_POOL_MAX_EVENTS	64
+
+// How long the poll thread sleeps for, before checking for sessions
+// which have been idle for too long
+#define SESSION_POOL_POLL_INTERVAL	1000 // ms
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::ServerSessionPool(int)
+//		Purpose: Constructor. Starts the worker threads, and the
+//			 thread which waits for sessions to become readable.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ServerSessionPool::ServerSessionPool(int NumberOfThreads)
+: mPoller(*this),
+  mNumberOfSessions(0),
+  mStopping(false),
+  mLastTimeoutCheck(0),
+  mEpollHandle(-1)
+{
+	mWakeupPipe[0] = -1;
+	mWakeupPipe[1] = -1;
+
+	try
+	{
+#ifndef WIN32
+		if(::pipe(mWakeupPipe) != 0)
+		{
+			THROW_SYS_ERROR("Failed to create session pool wakeup "
+				"pipe", ServerException, SessionPollError);
+		}
+
+		// Neither end may block: if the pipe is full then the poll
+		// thread is going to wake up anyway.
+		for(int i = 0; i < 2; i++)
+		{
+			int flags = ::fcntl(mWakeupPipe[i], F_GETFL);
+			if(flags == -1 || ::fcntl(mWakeupPipe[i], F_SETFL,
+				flags | O_NONBLOCK) == -1)
+			{
+				THROW_EXCEPTION(ServerException,
+					SocketSetNonBlockingFailed)
+			}
+		}
+#endif
+
+#ifdef HAVE_EPOLL_CREATE1
+		mEpollHandle = ::epoll_create1(EPOLL_CLOEXEC);
+		if(mEpollHandle == -1)
+		{
+			THROW_SYS_ERROR("Failed to create epoll handle",
+				ServerException, SessionPollError);
+		}
+
+		struct epoll_event event;
+		::memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = mWakeupPipe[0];
+		if(::epoll_ctl(mEpollHandle, EPOLL_CTL_ADD, mWakeupPipe[0],
+			&event) != 0)
+		{
+			THROW_SYS_ERROR("Failed to add wakeup pipe to epoll "
+				"handle", ServerException, SessionPollError);
+		}
+#endif
+
+#ifndef WIN32
+		mPoller.Start();
+#endif
+
+		for(int i = 0; i < NumberOfThreads; i++)
+		{
+			mWorkers.push_back(NULL);
+			mWorkers.back() = new WorkerThread(*this);
+			mWorkers.back()->Start();
+		}
+	}
+	catch(...)
+	{
+		Stop();
+		throw;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::~ServerSessionPool()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ServerSessionPool::~ServerSessionPool()
+{
+	Stop();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::Add(ServerSession *)
+//		Purpose: Take ownership of a new session, and run it when
+//			 the client sends something
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ServerSessionPool::Add(ServerSession *pSession)
+{
+	{
+		MutexLock lock(mMutex);
+		mNumberOfSessions++;
+	}
+
+	Park(pSession);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::Stop()
+//		Purpose: Wait for the worker threads to finish what they're
+//			 doing, then close all the sessions. Does nothing if
+//			 already stopped.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ServerSessionPool::Stop()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mSessionReady.Broadcast();
+	}
+
+	Wakeup();
+
+	for(size_t i = 0; i < mWorkers.size(); i++)
+	{
+		if(mWorkers[i])
+		{
+			mWorkers[i]->Join();
+			delete mWorkers[i];
+		}
+	}
+	mWorkers.clear();
+	mPoller.Join();
+
+	// No other threads are left, so nothing else can touch these now
+	while(!mReady.empty())
+	{
+		ServerSession *pSession = mReady.front().first;
+		mReady.pop_front();
+		DeleteSession(pSession);
+	}
+
+	while(!mParked.empty())
+	{
+		ServerSession *pSession = mParked.begin()->second.mpSession;
+		mParked.erase(mParked.begin());
+		DeleteSession(pSession);
+	}
+
+	if(mEpollHandle != -1)
+	{
+		::close(mEpollHandle);
+		mEpollHandle = -1;
+	}
+
+	for(int i = 0; i < 2; i++)
+	{
+		if(mWakeupPipe[i] != -1)
+		{
+			::close(mWakeupPipe[i]);
+			mWakeupPipe[i] = -1;
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::GetNumberOfSessions()
+//		Purpose: How many sessions are open, whether they're being
+//			 handled or waiting for the client
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int ServerSessionPool::GetNumberOfSessions()
+{
+	MutexLock lock(mMutex);
+	return mNumberOfSessions;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::WorkerMain()
+//		Purpose: Main loop of the worker threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ServerSessionPool::WorkerMain()
+{
+	while(true)
+	{
+		ReadySession ready;
+
+		{
+			MutexLock lock(mMutex);
+			while(mReady.empty() && !mStopping)
+			{
+				mSessionReady.Wait(mMutex);
+			}
+
+			if(mStopping)
+			{
+				return;
+			}
+
+			ready = mReady.front();
+			mReady.pop_front();
+		}
+
+		RunSession(ready.first, ready.second);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::RunSession(ServerSession *, bool)
+//		Purpose: Let a session handle what the client sent, or its
+//			 timeout, then either close it or wait for more.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ServerSessionPool::RunSession(ServerSession *pSession, bool TimedOut)
+{
+	bool carryOn = false;
+
+	try
+	{
+		if(TimedOut)
+		{
+			pSession->IdleTimedOut();
+		}
+		else
+		{
+			carryOn = pSession->HandleEvent();
+		}
+	}
+	catch(BoxException &e)
+	{
+		BOX_ERROR("Error in session, terminating connection: " <<
+			e.what() << " (" << e.GetType() << "/" <<
+			e.GetSubType() << ")");
+	}
+	catch(std::exception &e)
+	{
+		BOX_ERROR("Error in session, terminating connection: " <<
+			e.what());
+	}
+	catch(...)
+	{
+		BOX_ERROR("Error in session, terminating connection: "
+			"unknown exception");
+	}
+
+	if(!carryOn)
+	{
+		DeleteSession(pSession);
+		return;
+	}
+
+	// If the client's next message has already been read into a
+	// buffer, waiting for the socket to become readable won't work.
+	if(pSession->GetSocket().HasBufferedReadData())
+	{
+		MutexLock lock(mMutex);
+		if(!mStopping)
+		{
+			mReady.push_back(ReadySession(pSession, false));
+			mSessionReady.Signal();
+			return;
+		}
+	}
+
+	Park(pSession);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::Park(ServerSession *)
+//		Purpose: Wait for the client to send something before
+//			 running the session again
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ServerSessionPool::Park(ServerSession *pSession)
+{
+#ifdef WIN32
+	// No poll thread, so a worker thread waits for the client instead
+	MutexLock lock(mMutex);
+	mReady.push_back(ReadySession(pSession, false));
+	mSessionReady.Signal();
+#else
+	int handle = pSession->GetSocket().GetSocketHandle();
+	int timeout = pSession->GetIdleTimeout();
+
+	ParkedSession parked;
+	parked.mpSession = pSession;
+	parked.mDeadline = (timeout == IOStream::TimeOutInfinite) ? 0 :
+		GetCurrentBoxTime() + MilliSecondsToBoxTime(timeout);
+
+	bool parkedOK = false;
+	int error = 0;
+
+	{
+		MutexLock lock(mMutex);
+		if(!mStopping)
+		{
+			mParked[handle] = parked;
+			parkedOK = true;
+
+#ifdef HAVE_EPOLL_CREATE1
+			struct epoll_event event;
+			::memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN | EPOLLONESHOT;
+			event.data.fd = handle;
+			if(::epoll_ctl(mEpollHandle, EPOLL_CTL_ADD, handle,
+				&event) != 0)
+			{
+				error = errno;
+				mParked.erase(handle);
+				parkedOK = false;
+			}
+#endif
+		}
+	}
+
+	if(!parkedOK)
+	{
+		if(error != 0)
+		{
+			BOX_LOG_SYS_ERRNO(error, "Failed to wait for session, "
+				"terminating connection");
+		}
+		DeleteSession(pSession);
+		return;
+	}
+
+#ifndef HAVE_EPOLL_CREATE1
+	// The poll thread has to add this session to its list
+	Wakeup();
+#endif
+#endif // WIN32
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::PollMain()
+//		Purpose: Main loop of the thread which waits for parked
+//			 sessions to become readable, or to time out
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ServerSessionPool::PollMain()
+{
+#ifndef WIN32
+	while(true)
+	{
+		std::vector<int> readyHandles;
+		bool wokenUp = false;
+
+#ifdef HAVE_EPOLL_CREATE1
+		struct epoll_event events[SESSION_POOL_MAX_EVENTS];
+		int count = ::epoll_wait(mEpollHandle, events,
+			SESSION_POOL_MAX_EVENTS, SESSION_POOL_POLL_INTERVAL);
+		int error = errno;
+
+		for(int i = 0; i < count; i++)
+		{
+			if(events[i].data.fd == mWakeupPipe[0])
+			{
+				wokenUp = true;
+			}
+			else
+			{
+				readyHandles.push_back(events[i].data.fd);
+			}
+		}
+#else
+		std::vector<struct pollfd> handles;
+		{
+			MutexLock lock(mMutex);
+			handles.resize(mParked.size() + 1);
+			handles[0].fd = mWakeupPipe[0];
+			handles[0].events = POLLIN;
+			int h = 1;
+			for(std::map<int, ParkedSession>::iterator
+				i = mParked.begin(); i != mParked.end(); i++, h++)
+			{
+				handles[h].fd = i->first;
+				handles[h].events = POLLIN;
+			}
+		}
+
+		int count = ::poll(&handles[0], handles.size(),
+			SESSION_POOL_POLL_INTERVAL);
+		int error = errno;
+
+		if(count > 0)
+		{
+			wokenUp = (handles[0].revents != 0);
+			for(size_t h = 1; h < handles.size(); h++)
+			{
+				if(handles[h].revents != 0)
+				{
+					readyHandles.push_back(handles[h].fd);
+				}
+			}
+		}
+#endif
+
+		if(count < 0 && error != EINTR)
+		{
+			BOX_LOG_SYS_ERRNO(error, "Failed to wait for sessions");
+		}
+
+		if(wokenUp)
+		{
+			char buffer[256];
+			while(::read(mWakeupPipe[0], buffer, sizeof(buffer)) > 0)
+			{
+			}
+		}
+
+		MutexLock lock(mMutex);
+		if(mStopping)
+		{
+			return;
+		}
+
+		for(size_t i = 0; i < readyHandles.size(); i++)
+		{
+			std::map<int, ParkedSession>::iterator
+				parked(mParked.find(readyHandles[i]));
+			if(parked == mParked.end())
+			{
+				continue;
+			}
+
+#ifdef HAVE_EPOLL_CREATE1
+			struct epoll_event unused;
+			::epoll_ctl(mEpollHandle, EPOLL_CTL_DEL, parked->first,
+				&unused);
+#endif
+			mReady.push_back(ReadySession(parked->second.mpSession,
+				false));
+			mParked.erase(parked);
+			mSessionReady.Signal();
+		}
+
+		box_time_t now = GetCurrentBoxTime();
+		if(now - mLastTimeoutCheck < (box_time_t)
+			MilliSecondsToBoxTime(SESSION_POOL_POLL_INTERVAL))
+		{
+			continue;
+		}
+		mLastTimeoutCheck = now;
+
+		for(std::map<int, ParkedSession>::iterator
+			i = mParked.begin(); i != mParked.end();)
+		{
+			if(i->second.mDeadline == 0 || i->second.mDeadline > now)
+			{
+				i++;
+				continue;
+			}
+
+#ifdef HAVE_EPOLL_CREATE1
+			struct epoll_event unused;
+			::epoll_ctl(mEpollHandle, EPOLL_CTL_DEL, i->first,
+				&unused);
+#endif
+			mReady.push_back(ReadySession(i->second.mpSession, true));
+			mParked.erase(i++);
+			mSessionReady.Signal();
+		}
+	}
+#endif // !WIN32
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::Wakeup()
+//		Purpose: Make the poll thread stop waiting, to notice that
+//			 something has changed
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ServerSessionPool::Wakeup()
+{
+#ifndef WIN32
+	if(mWakeupPipe[1] != -1)
+	{
+		char wakeup = 0;
+		if(::write(mWakeupPipe[1], &wakeup, 1) != 1)
+		{
+			// The pipe is full, so it will wake up anyway
+		}
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ServerSessionPool::DeleteSession(ServerSession *)
+//		Purpose: Close a session which is finished, or failed
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ServerSessionPool::DeleteSession(ServerSession *pSession)
+{
+	delete pSession;
+
+	MutexLock lock(mMutex);
+	mNumberOfSessions--;
+}
@@ -0,0 +1,132 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    ServerSessionPool.h
+//		Purpose: Handle many client sessions in one process, with a
+//			 small pool of worker threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef SERVERSESSIONPOOL__H
+#define SERVERSESSIONPOOL__H
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "BoxTime.h"
+#include "Thread.h"
+
+class SocketStream;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ServerSession
+//		Purpose: One client connection, handled by a ServerSessionPool
+//			 a step at a time. Each step runs in a worker thread
+//			 when the client has sent something, so it shouldn't
+//			 wait for more than it needs to finish the step.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class ServerSession
+{
+public:
+	ServerSession() { }
+	virtual ~ServerSession() { }
+private:
+	// no copying
+	ServerSession(const ServerSession &);
+	ServerSession &operator=(const ServerSession &);
+public:
+	// Handle whatever the client has sent. Returns false if the
+	// session is over, and can be deleted.
+	virtual bool HandleEvent() = 0;
+
+	// Called instead of HandleEvent() if the client sent nothing for
+	// GetIdleTimeout() milliseconds. The session is deleted afterwards.
+	virtual void IdleTimedOut() { }
+
+	virtual SocketStream &GetSocket() = 0;
+	virtual int GetIdleTimeout() = 0;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ServerSessionPool
+//		Purpose: Waits for any of a large number of sessions to become
+//			 readable, using epoll() where available and poll()
+//			 elsewhere, and hands them to a fixed number of
+//			 worker threads. Sessions only tie up a thread while
+//			 they're doing something.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class ServerSessionPool
+{
+public:
+	ServerSessionPool(int NumberOfThreads);
+	~ServerSessionPool();
+private:
+	// no copying
+	ServerSessionPool(const ServerSessionPool &);
+	ServerSessionPool &operator=(const ServerSessionPool &);
+public:
+	void Add(ServerSession *pSession);
+	void Stop();
+	int GetNumberOfSessions();
+
+private:
+	class WorkerThread : public Thread
+	{
+	public:
+		WorkerThread(ServerSessionPool &rPool) : mrPool(rPool) { }
+	protected:
+		virtual void Run() { mrPool.WorkerMain(); }
+	private:
+		ServerSessionPool &mrPool;
+	};
+
+	class PollThread : public Thread
+	{
+	public:
+		PollThread(ServerSessionPool &rPool) : mrPool(rPool) { }
+	protected:
+		virtual void Run() { mrPool.PollMain(); }
+	private:
+		ServerSessionPool &mrPool;
+	};
+
+	typedef struct
+	{
+		ServerSession *mpSession;
+		box_time_t mDeadline; // or 0 for no timeout
+	} ParkedSession;
+
+	// a session ready to run, and whether it timed out
+	typedef std::pair<ServerSession *, bool> ReadySession;
+
+	void WorkerMain();
+	void PollMain();
+	void RunSession(ServerSession *pSession, bool TimedOut);
+	void Park(ServerSession *pSession);
+	void Wakeup();
+	void DeleteSession(ServerSession *pSession);
+
+	Mutex mMutex;
+	ConditionVariable mSessionReady;
+	std::deque<ReadySession> mReady;
+	std::map<int, ParkedSession> mParked; // by socket handle
+	std::vector<WorkerThread *> mWorkers;
+	PollThread mPoller;
+	int mNumberOfSessions;
+	bool mStopping;
+	box_time_t mLastTimeoutCheck;
+	int mEpollHandle;
+	int mWakeupPipe[2];
+};
+
+#endif // SERVERSESSIONPOOL__H
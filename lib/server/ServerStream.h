@@ -19,6 +19,7 @@
 
 #include "autogen_ServerException.h"
 #include "Daemon.h"
+#include "ServerSessionPool.h"
 #include "SocketListen.h"
 #include "Utils.h"
 #include "Configuration.h"
@@ -39,6 +40,7 @@ class ServerStream : public Daemon
 {
 public:
 	ServerStream()
+	: mUsingSessionPool(false)
 	{
 	}
 	~ServerStream()
@@ -67,6 +69,15 @@ public:
 
 	virtual void OnIdle() { }
 
+	// Servers which can handle their connections a step at a time
+	// override these to serve many clients from one process, with a
+	// pool of this many threads, instead of forking for each one.
+	virtual int GetNumberOfSessionThreads() { return 0; }
+	virtual ServerSession *CreateSession(std::auto_ptr<StreamType> apStream)
+	{
+		THROW_EXCEPTION(ServerException, Internal)
+	}
+
 	virtual void Run()
 	{
 		// Set process title as appropriate
@@ -239,6 +250,22 @@ public:
 				}
 			}
 			
+			// Handle connections with a pool of threads, instead
+			// of forking a process for each one?
+			std::auto_ptr<ServerSessionPool> apSessionPool;
+			#ifndef WIN32
+			if(ForkToHandleRequests && !IsSingleProcess() &&
+				GetNumberOfSessionThreads() > 0 &&
+				Thread::IsSupported())
+			{
+				BOX_INFO("Handling connections in " <<
+					GetNumberOfSessionThreads() << " threads");
+				apSessionPool.reset(new ServerSessionPool(
+					GetNumberOfSessionThreads()));
+			}
+			#endif
+			mUsingSessionPool = (apSessionPool.get() != NULL);
+
 			NotifyListenerIsReady();
 	
 			while(!StopRun())
@@ -256,7 +283,12 @@ public:
 							&mConnectionDetails));
 
 					// Was there one (there should be...)
-					if(connection.get())
+					if(connection.get() && apSessionPool.get())
+					{
+						LogConnectionDetails(mConnectionDetails);
+						apSessionPool->Add(CreateSession(connection));
+					}
+					else if(connection.get())
 					{
 						// Since this is a template parameter, the if() will be optimised out by the compiler
 						#ifndef WIN32 // no fork on Win32
@@ -333,12 +365,22 @@ public:
 				}
 				#endif // !WIN32
 			}
+
+			// Let sessions finish what they're doing, and close
+			// them, before the listening sockets
+			if(apSessionPool.get())
+			{
+				apSessionPool->Stop();
+			}
 		}
 		catch(...)
 		{
+			mUsingSessionPool = false;
 			DeleteSockets();
 			throw;
 		}
+
+		mUsingSessionPool = false;
 		
 		// Delete the sockets
 		DeleteSockets();
@@ -412,10 +454,18 @@ protected:
 		#ifdef WIN32
 		return false;
 		#else
-		return ForkToHandleRequests && !IsSingleProcess();
+		return ForkToHandleRequests && !IsSingleProcess() &&
+			!mUsingSessionPool;
 		#endif // WIN32
 	}
 
+	// Whether connections are being handled by threads in this process,
+	// so anything shared between them must be locked.
+	bool IsUsingSessionPool()
+	{
+		return mUsingSessionPool;
+	}
+
 private:
 	// --------------------------------------------------------------------------
 	//
@@ -441,6 +491,7 @@ private:
 
 private:
 	std::vector<SocketListen<StreamType, ListenBacklog> *> mSockets;
+	bool mUsingSessionPool;
 };
 
 #define SERVERSTREAM_VERIFY_SERVER_KEYS(DEFAULT_ADDRESSES) \
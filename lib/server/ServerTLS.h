@@ -71,6 +71,13 @@ public:
 		// this-> in next line required to build under some gcc versions
 		this->Connection(apStream);
 	}
+
+protected:
+	// For sessions which do the handshake in a worker thread
+	const TLSContext &GetTLSContext() const
+	{
+		return mContext;
+	}
 	
 private:
 	TLSContext mContext;
@@ -66,6 +66,11 @@ public:
 
 	virtual bool GetPeerCredentials(uid_t &rUidOut, gid_t &rGidOut);
 
+	// Whether data has already been received and buffered in user
+	// space, so that a Read() won't block even if poll() says that
+	// the socket isn't readable.
+	virtual bool HasBufferedReadData() { return false; }
+
 protected:
 	void MarkAsReadClosed() {mReadClosed = true;}
 	void MarkAsWriteClosed() {mWriteClosed = true;}
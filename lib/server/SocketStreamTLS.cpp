@@ -448,6 +448,20 @@ void SocketStreamTLS::Shutdown(bool Read, bool Write)
 	// Don't ask the base class to shutdown -- BIO does this, apparently.
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    SocketStreamTLS::HasBufferedReadData()
+//		Purpose: See base class. OpenSSL may already have decrypted
+//			 more of a record than was asked for.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool SocketStreamTLS::HasBufferedReadData()
+{
+	return mpSSL && ::SSL_pending(mpSSL) > 0;
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -48,6 +48,7 @@ public:
 		int Timeout = IOStream::TimeOutInfinite);
 	virtual void Close();
 	virtual void Shutdown(bool Read = true, bool Write = true);
+	virtual bool HasBufferedReadData();
 
 	std::string GetPeerCommonName();
 
@@ -12,17 +12,29 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include "Test.h"
 #include "BackupClientCryptoKeys.h"
+#include "BackupStoreConstants.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileChunker.h"
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreFilenameClear.h"
 #include "FileStream.h"
+#include "MemBlockStream.h"
 #include "BackupStoreFileWire.h"
 #include "BackupStoreObjectMagic.h"
 #include "BackupStoreFileCryptVar.h"
 #include "BackupStoreException.h"
 #include "CollectInBufferStream.h"
+#include "BoxTime.h"
+#include "MultiRollingChecksum.h"
+#include "Random.h"
+#include "Thread.h"
 
 #include "MemLeakFindOn.h"
 
@@ -103,7 +115,7 @@ bool make_file_of_zeros(const char *filename, size_t size)
 }
 
 
-void check_encoded_file(const char *filename, int64_t OtherFileID, int new_blocks_expected, int old_blocks_expected)
+void check_encoded_file(const char *filename, int64_t OtherFileID, int new_blocks_expected, int old_blocks_expected, bool content_defined = false)
 {
 	FileStream enc(filename);
 	
@@ -118,7 +130,9 @@ void check_encoded_file(const char *filename, int64_t OtherFileID, int new_block
 	// Read in header to check magic value is as expected
 	file_BlockIndexHeader hdr;
 	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
-	TEST_THAT(hdr.mMagicValue == (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1));
+	TEST_THAT(hdr.mMagicValue == (int32_t)htonl(content_defined
+		? OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2
+		: OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1));
 	TEST_THAT((uint64_t)box_ntoh64(hdr.mOtherFileID) == (uint64_t)OtherFileID);
 	// number of blocks
 	int64_t nblocks = box_ntoh64(hdr.mNumBlocks);
@@ -386,6 +400,595 @@ void test_combined_diffs()
 	}
 }
 
+// Append Size bytes of random lower case words and lines to the text
+void append_random_text(std::string &rText, int Size)
+{
+	std::vector<uint8_t> random(Size);
+	Random::Generate(&random[0], Size);
+	for(int i = 0; i < Size; ++i)
+	{
+		uint8_t r = random[i];
+		rText += (r < 4) ? '\n' : (r < 44) ? ' ' : (char)('a' + (r % 26));
+	}
+}
+
+void write_test_file(const char *filename, const std::string &rData)
+{
+	FileStream out(filename, O_WRONLY | O_CREAT | O_TRUNC);
+	out.Write(rData.c_str(), rData.size());
+}
+
+// Diff a file against an encoded one, and write out the result
+void encode_diff(const char *from_encoded, int64_t from_id,
+	const char *to_orig, const char *to_diff, bool &rCompletelyDifferent)
+{
+	FileStream blockindex(from_encoded);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+	BackupStoreFilenameClear name("filename");
+	FileStream out(to_diff, O_WRONLY | O_CREAT | O_TRUNC);
+	std::auto_ptr<IOStream> encoded(
+		BackupStoreFile::EncodeFileDiff(to_orig, 1 /* dir ID */, name,
+			from_id, blockindex, IOStream::TimeOutInfinite,
+			NULL /* DiffTimer */, 0, &rCompletelyDifferent));
+	encoded->CopyStreamTo(out);
+}
+
+// Read the block index of an encoded file, and return how many bytes of it
+// are reused from the file it was diffed from, and whether its blocks are
+// content-defined chunks
+int64_t get_reused_bytes(const char *filename, bool &rContentDefined)
+{
+	FileStream enc(filename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	rContentDefined = (ntohl(hdr.mMagicValue) ==
+		OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2);
+
+	int64_t reused = 0;
+	int64_t nblocks = box_ntoh64(hdr.mNumBlocks);
+	for(int64_t b = 0; b < nblocks; ++b)
+	{
+		file_BlockIndexEntry en;
+		TEST_THAT(enc.ReadFullBuffer(&en, sizeof(en), 0));
+		uint64_t iv = box_ntoh64(hdr.mEntryIVBase);
+		iv += b;
+		iv = box_hton64(iv);
+		sBlowfishDecryptBlockEntry.SetIV(&iv);
+		file_BlockIndexEntryEnc entryEnc;
+		sBlowfishDecryptBlockEntry.TransformBlock(&entryEnc,
+			sizeof(entryEnc), en.mEnEnc, sizeof(en.mEnEnc));
+		if((int64_t)box_ntoh64(en.mEncodedSize) <= 0)
+		{
+			reused += ntohl(entryEnc.mSize);
+		}
+	}
+	return reused;
+}
+
+// Combine a diff with the file it was made from, and check that it
+// decodes to the original
+void check_combined_diff(const char *to_diff, const char *from_encoded,
+	const char *to_encoded, const char *to_orig)
+{
+	{
+		FileStream diff(to_diff);
+		FileStream diff2(to_diff);
+		FileStream from(from_encoded);
+		FileStream out(to_encoded, O_WRONLY | O_CREAT | O_TRUNC);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	{
+		FileStream enc(to_encoded);
+		BackupStoreFile::DecodeFile(enc, "testfiles/combined.dec",
+			IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical(to_orig, "testfiles/combined.dec"));
+		remove("testfiles/combined.dec");
+	}
+	{
+		FileStream index(to_encoded);
+		BackupStoreFile::MoveStreamPositionToBlockIndex(index);
+		TEST_THAT(BackupStoreFile::CompareFileContentsAgainstBlockIndex(
+			to_orig, index, IOStream::TimeOutInfinite));
+	}
+}
+
+void test_content_defined_chunking()
+{
+	// The average chunk size grows with the file, like the block size
+	TEST_EQUAL(4096, BackupStoreFileChunker::AverageChunkSizeForFile(0));
+	TEST_EQUAL(4096, BackupStoreFileChunker::AverageChunkSizeForFile(
+		16*1024*1024));
+	TEST_EQUAL(8192, BackupStoreFileChunker::AverageChunkSizeForFile(
+		32*1024*1024));
+	TEST_EQUAL(BACKUP_FILE_MAX_AVERAGE_CHUNK_SIZE,
+		BackupStoreFileChunker::AverageChunkSizeForFile(
+			(int64_t)1024*1024*1024*1024));
+
+	// A new version is diffed with the size the old one was cut with,
+	// unless it's grown so much that there would be far too many chunks
+	TEST_EQUAL(8192, BackupStoreFileChunker::AverageChunkSizeForDiff(
+		100 * 9000, 100, 100 * 9000));
+	TEST_EQUAL(8192, BackupStoreFileChunker::AverageChunkSizeForDiff(
+		100 * 6000, 100, 100 * 6000));
+	TEST_EQUAL(4096, BackupStoreFileChunker::AverageChunkSizeForDiff(
+		100 * 5000, 100, 100 * 5000));
+	TEST_EQUAL(BACKUP_FILE_MAX_AVERAGE_CHUNK_SIZE,
+		BackupStoreFileChunker::AverageChunkSizeForDiff(100 * 9000, 100,
+			(int64_t)1024*1024*1024*1024));
+
+	// Chunks are within the limits, and about the average size
+	{
+		std::string data;
+		append_random_text(data, 4*1024*1024);
+		BackupStoreFileChunker chunker(4096);
+		std::vector<int32_t> sizes;
+		{
+			MemBlockStream stream(data.c_str(), data.size());
+			chunker.ChunkStream(stream, data.size(), sizes);
+		}
+
+		int64_t total = 0;
+		bool inLimits = true;
+		std::set<int64_t> boundaries;
+		for(size_t c = 0; c < sizes.size(); ++c)
+		{
+			total += sizes[c];
+			boundaries.insert(total);
+			if(sizes[c] > 16384 ||
+				(sizes[c] < 1024 && c != sizes.size() - 1))
+			{
+				inLimits = false;
+			}
+		}
+		TEST_EQUAL((int64_t)data.size(), total);
+		TEST_THAT(inLimits);
+		BOX_TRACE("Chunked 4MB into " << sizes.size() << " chunks");
+		TEST_THAT(total / sizes.size() > 4096 * 2 / 3);
+		TEST_THAT(total / sizes.size() < 4096 * 3 / 2);
+		TEST_EQUAL(4096, BackupStoreFileChunker::AverageChunkSizeForDiff(
+			total, sizes.size(), total));
+
+		// Inserting data changes the chunks around it, but the
+		// rest are cut in the same places
+		data.insert(1024*1024, "inserted data");
+		std::vector<int32_t> newSizes;
+		{
+			MemBlockStream stream(data.c_str(), data.size());
+			chunker.ChunkStream(stream, data.size(), newSizes);
+		}
+		int64_t shifted = 0, moved = 0;
+		total = 0;
+		for(size_t c = 0; c < newSizes.size(); ++c)
+		{
+			total += newSizes[c];
+			if(total > 1024*1024 + 16384)
+			{
+				++shifted;
+				if(boundaries.count(total - 13))
+				{
+					++moved;
+				}
+			}
+		}
+		BOX_TRACE(moved << " of " << shifted << " chunks after the "
+			"insertion were cut in the same places");
+		TEST_THAT(shifted > 0);
+		TEST_THAT(moved * 100 >= shifted * 99);
+	}
+
+	// Encode a file in content-defined chunks, and diff a new version
+	// with insertions and deletions against it
+	{
+		std::string data;
+		append_random_text(data, 1024*1024);
+		write_test_file("testfiles/cdc.0", data);
+		data.insert(300000, "new data in the middle");
+		append_random_text(data, 3000);
+		data.erase(700000, 2000);
+		std::string extra;
+		append_random_text(extra, 5000);
+		data.insert(500000, extra);
+		write_test_file("testfiles/cdc.1", data);
+
+		BackupStoreFile::SetContentDefinedChunking(true);
+		{
+			BackupStoreFilenameClear name("cdc.0");
+			FileStream out("testfiles/cdc.0.encoded",
+				O_WRONLY | O_CREAT | O_EXCL);
+			std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile(
+				"testfiles/cdc.0", 1 /* dir ID */, name));
+			encoded->CopyStreamTo(out);
+		}
+		{
+			FileStream enc("testfiles/cdc.0.encoded");
+			TEST_THAT(BackupStoreFile::VerifyEncodedFileFormat(enc));
+			enc.Seek(0, IOStream::SeekType_Absolute);
+			BackupStoreFile::DecodeFile(enc, "testfiles/cdc.0.dec",
+				IOStream::TimeOutInfinite);
+			TEST_THAT(files_identical("testfiles/cdc.0",
+				"testfiles/cdc.0.dec"));
+		}
+		bool contentDefined = false;
+		TEST_EQUAL(0, get_reused_bytes("testfiles/cdc.0.encoded",
+			contentDefined));
+		TEST_THAT(contentDefined);
+
+		// Files already in chunks are always diffed in chunks
+		BackupStoreFile::SetContentDefinedChunking(false);
+		bool completelyDifferent = true;
+		encode_diff("testfiles/cdc.0.encoded", 3000, "testfiles/cdc.1",
+			"testfiles/cdc.1.diff", completelyDifferent);
+		TEST_THAT(!completelyDifferent);
+		int64_t reused = get_reused_bytes("testfiles/cdc.1.diff",
+			contentDefined);
+		TEST_THAT(contentDefined);
+		BOX_TRACE("Reused " << reused << " of " << data.size() <<
+			" bytes");
+		TEST_THAT(reused > (int64_t)data.size() * 9 / 10);
+		check_combined_diff("testfiles/cdc.1.diff",
+			"testfiles/cdc.0.encoded", "testfiles/cdc.1.encoded",
+			"testfiles/cdc.1");
+
+		// And the new version is cut in the same places again
+		encode_diff("testfiles/cdc.1.encoded", 3001, "testfiles/cdc.1",
+			"testfiles/cdc.2.diff", completelyDifferent);
+		TEST_THAT(!completelyDifferent);
+		TEST_EQUAL((int64_t)data.size(), get_reused_bytes(
+			"testfiles/cdc.2.diff", contentDefined));
+		TEST_THAT(contentDefined);
+	}
+
+	// Files in fixed size blocks stay that way while most of them is
+	// reused, and are converted when most of them has changed
+	BackupStoreFile::SetContentDefinedChunking(true);
+	{
+		bool completelyDifferent = true;
+		encode_diff("testfiles/f1.encoded", 1001, "testfiles/f2",
+			"testfiles/f2.cdcdiff", completelyDifferent);
+		TEST_THAT(!completelyDifferent);
+		bool contentDefined = true;
+		TEST_THAT(get_reused_bytes("testfiles/f2.cdcdiff",
+			contentDefined) > 0);
+		TEST_THAT(!contentDefined);
+		check_combined_diff("testfiles/f2.cdcdiff",
+			"testfiles/f1.encoded", "testfiles/f2.cdcencoded",
+			"testfiles/f2");
+
+		encode_diff("testfiles/f7.encoded", 1007, "testfiles/f8",
+			"testfiles/f8.cdcdiff", completelyDifferent);
+		TEST_THAT(completelyDifferent);
+		TEST_EQUAL(0, get_reused_bytes("testfiles/f8.cdcdiff",
+			contentDefined));
+		TEST_THAT(contentDefined);
+		FileStream enc("testfiles/f8.cdcdiff");
+		BackupStoreFile::DecodeFile(enc, "testfiles/f8.cdcdec",
+			IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/f8", "testfiles/f8.cdcdec"));
+	}
+	BackupStoreFile::SetContentDefinedChunking(false);
+}
+
+#define SCAN_BENCHMARK_FILE_SIZE	(16*1024*1024)
+#define SCAN_BENCHMARK_BLOCKS_PER_SIZE	4
+
+// Build a block index with NumSizes different block sizes, none of which
+// will match anything, so that the diff has to scan the whole file.
+void make_scan_benchmark_index(int NumSizes, CollectInBufferStream &rIndex)
+{
+	int64_t numBlocks = NumSizes * SCAN_BENCHMARK_BLOCKS_PER_SIZE;
+	uint64_t entryIVBase = 0;
+	Random::Generate(&entryIVBase, sizeof(entryIVBase));
+
+	file_BlockIndexHeader hdr;
+	hdr.mMagicValue = htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
+	hdr.mOtherFileID = box_hton64(0);
+	hdr.mEntryIVBase = box_hton64(entryIVBase);
+	hdr.mNumBlocks = box_hton64(numBlocks);
+	rIndex.Write(&hdr, sizeof(hdr));
+
+	for(int64_t b = 0; b < numBlocks; ++b)
+	{
+		file_BlockIndexEntryEnc entryEnc;
+		Random::Generate(&entryEnc, sizeof(entryEnc));
+		entryEnc.mSize = htonl(BACKUP_FILE_MIN_BLOCK_SIZE
+			+ ((b % NumSizes) * 1024));
+
+		file_BlockIndexEntry entry;
+		entry.mEncodedSize = box_hton64(1);
+		uint64_t iv = box_hton64(entryIVBase + b);
+		sBlowfishEncryptBlockEntry.SetIV(&iv);
+		TEST_THAT(sBlowfishEncryptBlockEntry.TransformBlock(entry.mEnEnc,
+			sizeof(entry.mEnEnc), &entryEnc, sizeof(entryEnc))
+			== sizeof(entry.mEnEnc));
+		rIndex.Write(&entry, sizeof(entry));
+	}
+
+	rIndex.SetForReading();
+}
+
+// Measure how quickly a file can be scanned for blocks from an index, as
+// the number of different block sizes in the index increases.
+void benchmark_block_scan()
+{
+	{
+		uint8_t *data = (uint8_t *)::malloc(SCAN_BENCHMARK_FILE_SIZE);
+		TEST_THAT(data != 0);
+		Random::Generate(data, SCAN_BENCHMARK_FILE_SIZE);
+		FileStream out("testfiles/scan.bench", O_WRONLY | O_CREAT | O_EXCL);
+		out.Write(data, SCAN_BENCHMARK_FILE_SIZE);
+		::free(data);
+	}
+
+	{
+		int32_t lengths[MULTIROLLINGCHECKSUM_MAX_LENGTHS] = {0};
+		MultiRollingChecksum checksums(lengths,
+			MULTIROLLINGCHECKSUM_MAX_LENGTHS);
+		printf("Block scan benchmark, %s checksums\n",
+			checksums.GetImplementationName());
+	}
+
+	for(int numSizes = 1; numSizes <= BACKUP_FILE_DIFF_MAX_BLOCK_SIZES;
+		numSizes *= 2)
+	{
+		CollectInBufferStream blockindex;
+		make_scan_benchmark_index(numSizes, blockindex);
+
+		BackupStoreFilenameClear name("scan.bench");
+		bool completelyDifferent = false;
+		box_time_t start = GetCurrentBoxTime();
+		// The search happens before the stream is returned
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFileDiff("testfiles/scan.bench",
+				1 /* dir ID */, name,
+				2000 /* object ID of the file diffing from */,
+				blockindex, IOStream::TimeOutInfinite,
+				NULL /* DiffTimer */, 0, &completelyDifferent));
+		box_time_t taken = GetCurrentBoxTime() - start;
+		TEST_THAT(completelyDifferent);
+
+		if(taken < 1) taken = 1;
+		printf("  %2d block sizes: %8.1f MB/s\n", numSizes,
+			((double)SCAN_BENCHMARK_FILE_SIZE / (1024*1024))
+			/ ((double)taken / 1000000.0));
+	}
+
+	remove("testfiles/scan.bench");
+}
+
+#define ENCODE_BENCHMARK_FILE_SIZE	(32*1024*1024)
+#define ENCODE_BENCHMARK_MAX_THREADS	8
+
+// Measure how quickly a file can be encoded with different numbers of
+// worker threads, including none at all. Half of the file compresses well
+// and half doesn't, so that the workers have plenty to do.
+void benchmark_file_encoding()
+{
+	{
+		uint8_t *data = (uint8_t *)::malloc(ENCODE_BENCHMARK_FILE_SIZE);
+		TEST_THAT(data != 0);
+		Random::Generate(data, ENCODE_BENCHMARK_FILE_SIZE / 2);
+		for(int l = ENCODE_BENCHMARK_FILE_SIZE / 2;
+			l < ENCODE_BENCHMARK_FILE_SIZE; ++l)
+		{
+			data[l] = "Box Backup "[l % 11] + ((l / 4099) % 7);
+		}
+		FileStream out("testfiles/encode.bench", O_WRONLY | O_CREAT | O_EXCL);
+		out.Write(data, ENCODE_BENCHMARK_FILE_SIZE);
+		::free(data);
+	}
+
+	printf("File encoding benchmark, %d processors%s\n",
+		Thread::GetNumberOfProcessors(),
+		Thread::IsSupported() ? "" : ", threads not supported");
+
+	int threads = 0;
+	while(threads <= ENCODE_BENCHMARK_MAX_THREADS)
+	{
+		BackupStoreFile::SetEncodingThreads(threads);
+
+		BackupStoreFilenameClear name("encode.bench");
+		box_time_t start = GetCurrentBoxTime();
+		{
+			FileStream out("testfiles/encode.bench.enc",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			std::auto_ptr<IOStream> encoded(
+				BackupStoreFile::EncodeFile("testfiles/encode.bench",
+					1 /* dir ID */, name));
+			encoded->CopyStreamTo(out);
+		}
+		box_time_t taken = GetCurrentBoxTime() - start;
+
+		// Check that the blocks were put back together in order
+		{
+			FileStream enc("testfiles/encode.bench.enc");
+			BackupStoreFile::DecodeFile(enc, "testfiles/encode.bench.dec",
+				IOStream::TimeOutInfinite);
+			TEST_THAT(files_identical("testfiles/encode.bench",
+				"testfiles/encode.bench.dec"));
+			remove("testfiles/encode.bench.dec");
+		}
+
+		if(taken < 1) taken = 1;
+		printf("  %d worker threads: %8.1f MB/s\n", threads,
+			((double)ENCODE_BENCHMARK_FILE_SIZE / (1024*1024))
+			/ ((double)taken / 1000000.0));
+
+		threads = (threads == 0) ? 1 : (threads * 2);
+	}
+
+	BackupStoreFile::SetEncodingThreads(0);
+	remove("testfiles/encode.bench");
+	remove("testfiles/encode.bench.enc");
+}
+
+#define INSERT_BENCHMARK_FILE_SIZE	(16*1024*1024)
+
+std::string join_strings(const std::vector<std::string> &rStrings)
+{
+	std::string joined;
+	for(size_t i = 0; i < rStrings.size(); ++i)
+	{
+		joined += rStrings[i];
+	}
+	return joined;
+}
+
+// Diff a new version of a file against the old one, stored in fixed size
+// blocks and then in content-defined chunks, and compare how long the diff
+// takes and how much of the old file it reuses
+void benchmark_insert_workload(const char *Name, const std::string &rOld,
+	const std::string &rNew)
+{
+	write_test_file("testfiles/insert.0", rOld);
+	write_test_file("testfiles/insert.1", rNew);
+
+	for(int contentDefined = 0; contentDefined <= 1; ++contentDefined)
+	{
+		BackupStoreFile::SetContentDefinedChunking(contentDefined);
+		{
+			BackupStoreFilenameClear name("insert.0");
+			FileStream out("testfiles/insert.0.encoded",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile(
+				"testfiles/insert.0", 1 /* dir ID */, name));
+			encoded->CopyStreamTo(out);
+		}
+
+		// The search happens before the stream is returned
+		bool completelyDifferent = true;
+		box_time_t taken;
+		{
+			FileStream blockindex("testfiles/insert.0.encoded");
+			BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+			BackupStoreFilenameClear name("insert.1");
+			box_time_t start = GetCurrentBoxTime();
+			std::auto_ptr<IOStream> encoded(
+				BackupStoreFile::EncodeFileDiff("testfiles/insert.1",
+					1 /* dir ID */, name,
+					2000 /* object ID of the file diffing from */,
+					blockindex, IOStream::TimeOutInfinite,
+					NULL /* DiffTimer */, 0, &completelyDifferent));
+			taken = GetCurrentBoxTime() - start;
+			FileStream out("testfiles/insert.1.diff",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			encoded->CopyStreamTo(out);
+		}
+		TEST_THAT(!completelyDifferent);
+
+		bool diffContentDefined = false;
+		int64_t reused = get_reused_bytes("testfiles/insert.1.diff",
+			diffContentDefined);
+		TEST_EQUAL((bool)contentDefined, diffContentDefined);
+		check_combined_diff("testfiles/insert.1.diff",
+			"testfiles/insert.0.encoded", "testfiles/insert.1.encoded",
+			"testfiles/insert.1");
+
+		if(taken < 1) taken = 1;
+		printf("  %-14s %-16s diff %7.1f MB/s, %5.1f%% reused\n", Name,
+			contentDefined ? "content-defined" : "fixed blocks",
+			((double)rNew.size() / (1024*1024)) /
+				((double)taken / 1000000.0),
+			(double)reused * 100.0 / (double)rNew.size());
+	}
+
+	BackupStoreFile::SetContentDefinedChunking(false);
+	remove("testfiles/insert.0");
+	remove("testfiles/insert.1");
+	remove("testfiles/insert.0.encoded");
+	remove("testfiles/insert.1.diff");
+	remove("testfiles/insert.1.encoded");
+}
+
+// Files which change by having data inserted all over them, such as
+// mailboxes and database dumps, are what content-defined chunking is for
+void benchmark_insert_workloads()
+{
+	printf("Insert-heavy workload benchmark\n");
+
+	// A mailbox, which has some messages delivered into the middle of
+	// it (as if it was sorted), some deleted and some appended
+	{
+		std::vector<std::string> messages;
+		int64_t size = 0;
+		while(size < INSERT_BENCHMARK_FILE_SIZE)
+		{
+			std::string message("From someone@example.com\n");
+			append_random_text(message, 2048 + Random::RandomInt(18*1024));
+			size += message.size();
+			messages.push_back(message);
+		}
+		std::string oldMailbox(join_strings(messages));
+
+		for(int m = 0; m < 30; ++m)
+		{
+			std::string message("From someone@example.com\n");
+			append_random_text(message, 2048 + Random::RandomInt(18*1024));
+			messages.insert(messages.begin() +
+				Random::RandomInt(messages.size()), message);
+		}
+		for(int m = 0; m < 10; ++m)
+		{
+			messages.erase(messages.begin() +
+				Random::RandomInt(messages.size()));
+		}
+		for(int m = 0; m < 20; ++m)
+		{
+			std::string message("From someone@example.com\n");
+			append_random_text(message, 2048 + Random::RandomInt(18*1024));
+			messages.push_back(message);
+		}
+
+		benchmark_insert_workload("mailbox", oldMailbox,
+			join_strings(messages));
+	}
+
+	// A database dump, which has rows inserted, updated and deleted
+	// all through the table
+	{
+		std::string text;
+		append_random_text(text, INSERT_BENCHMARK_FILE_SIZE);
+		std::vector<std::string> rows;
+		size_t used = 0;
+		int id = 0;
+		while(used + 200 < text.size())
+		{
+			int length = 40 + Random::RandomInt(80);
+			std::ostringstream row;
+			row << "INSERT INTO messages VALUES (" << id++ << ", '" <<
+				text.substr(used, length) << "');\n";
+			used += length;
+			rows.push_back(row.str());
+		}
+		std::string oldDump(join_strings(rows));
+
+		std::string newText;
+		append_random_text(newText, 1000 * 120);
+		used = 0;
+		for(int r = 0; r < 1000; ++r)
+		{
+			std::ostringstream row;
+			row << "INSERT INTO messages VALUES (" << id++ << ", '" <<
+				newText.substr(used, 100) << "');\n";
+			used += 100;
+			rows.insert(rows.begin() + Random::RandomInt(rows.size()),
+				row.str());
+		}
+		for(int r = 0; r < 500; ++r)
+		{
+			std::string &rRow(rows[Random::RandomInt(rows.size())]);
+			rRow.replace(rRow.size() - 8, 3, "upd");
+		}
+		for(int r = 0; r < 200; ++r)
+		{
+			rows.erase(rows.begin() + Random::RandomInt(rows.size()));
+		}
+
+		benchmark_insert_workload("database dump", oldDump,
+			join_strings(rows));
+	}
+}
+
 int test(int argc, const char *argv[])
 {
 	// Want to trace out all the details
@@ -436,6 +1039,11 @@ int test(int argc, const char *argv[])
 	// Delete some data, but not on block boundaries
 	test_diff(2, 3, 1, 29);
 
+	// Encode the next few diffs in worker threads. The file is read
+	// ahead of the blocks being sent, so this checks that the data of
+	// blocks from the old file is still skipped in the right places.
+	BackupStoreFile::SetEncodingThreads(3);
+
 	// Add a very small amount of data, not on block boundary
 	// delete a little data
 	test_diff(3, 4, 3, 25);
@@ -453,6 +1061,8 @@ int test(int argc, const char *argv[])
 	
 	// a completely different file, with no blocks matching.
 	test_diff(7, 8, 14, 0, true /* completely different expected */);
+
+	BackupStoreFile::SetEncodingThreads(0);
 	
 	// diff to zero sized file
 	test_diff(8, 9, 0, 0, true /* completely different expected */);
@@ -522,6 +1132,12 @@ int test(int argc, const char *argv[])
 			0, 0), BackupStoreException, CannotDiffAnIncompleteStoreFile);
 	}
 
+	test_content_defined_chunking();
+
+	benchmark_block_scan();
+	benchmark_file_encoding();
+	benchmark_insert_workloads();
+
 	// Found a nasty case where files of lots of the same thing 
 	// suck up lots of processor time -- because of lots of matches 
 	// found. Check this out!
@@ -20,24 +20,33 @@
 #include "BackupStoreAccounts.h"
 #include "BackupStoreConfigVerify.h"
 #include "BackupStoreConstants.h"
+#include "BackupStoreDedupIndex.h"
 #include "BackupStoreDirectory.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreFilenameClear.h"
 #include "BackupStoreFileEncodeStream.h"
+#include "BackupStoreFileWire.h"
 #include "BackupStoreInfo.h"
+#include "BackupStoreJournal.h"
 #include "BackupStoreObjectMagic.h"
+#include "BackupStorePackFile.h"
 #include "BackupStoreRefCountDatabase.h"
 #include "BoxPortsAndFiles.h"
+#include "CipherException.h"
 #include "CollectInBufferStream.h"
+#include "CompressCodec.h"
 #include "Configuration.h"
 #include "FileStream.h"
 #include "HousekeepStoreAccount.h"
+#include "HousekeepingScheduler.h"
 #include "MemBlockStream.h"
 #include "RaidFileController.h"
 #include "RaidFileException.h"
 #include "RaidFileRead.h"
+#include "RaidFileUtil.h"
 #include "RaidFileWrite.h"
+#include "Random.h"
 #include "SSLLib.h"
 #include "ServerControl.h"
 #include "Socket.h"
@@ -455,6 +464,163 @@ bool test_backupstore_directory()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+bool test_directory_indexes()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// Enough entries that lookups use the indexes. Every name has an
+	// old and a current version.
+	const int num_entries = BACKUPSTOREDIRECTORY_INDEX_MIN_ENTRIES * 4;
+	BackupStoreDirectory dir(12, 98);
+	for(int e = 0; e < num_entries; e++)
+	{
+		std::ostringstream name;
+		name << "file" << (e / 2);
+		dir.AddEntry(BackupStoreFilenameClear(name.str()), 0, 100 + e,
+			1, BackupStoreDirectory::Entry::Flags_File |
+			((e % 2 == 0) ? BackupStoreDirectory::Entry::Flags_OldVersion : 0),
+			0);
+	}
+
+	BackupStoreFilenameClear name5("file5");
+	TEST_EQUAL(110, dir.FindEntryByID(110)->GetObjectID());
+	TEST_THAT(dir.FindEntryByID(99) == 0);
+	TEST_EQUAL(110, dir.FindEntryByName(name5)->GetObjectID());
+	TEST_EQUAL(111, dir.FindEntryByName(name5,
+		BackupStoreDirectory::Entry::Flags_File,
+		BackupStoreDirectory::Entry::Flags_OldVersion)->GetObjectID());
+	TEST_THAT(dir.NameInUse(name5));
+	TEST_THAT(!dir.NameInUse(BackupStoreFilenameClear("nothing")));
+
+	// Entries with the same name are found in directory order
+	std::vector<BackupStoreDirectory::Entry *> found;
+	dir.FindEntriesByName(name5, found);
+	TEST_EQUAL(2, found.size());
+	TEST_EQUAL(110, found[0]->GetObjectID());
+	TEST_EQUAL(111, found[1]->GetObjectID());
+
+	// The indexes must follow added and deleted entries
+	dir.AddEntry(name5, 0, 5000, 1, BackupStoreDirectory::Entry::Flags_File, 0);
+	dir.DeleteEntry(110);
+	TEST_THAT(dir.FindEntryByID(110) == 0);
+	TEST_EQUAL(5000, dir.FindEntryByID(5000)->GetObjectID());
+	dir.FindEntriesByName(name5, found);
+	TEST_EQUAL(2, found.size());
+	TEST_EQUAL(111, found[0]->GetObjectID());
+	TEST_EQUAL(5000, found[1]->GetObjectID());
+	TEST_CHECK_THROWS(dir.DeleteEntry(110), BackupStoreException,
+		CouldNotFindEntryInDirectory);
+
+	// And renamed entries
+	BackupStoreFilenameClear renamed("renamed");
+	dir.FindEntryByID(5000)->SetName(renamed);
+	dir.FindEntriesByName(name5, found);
+	TEST_EQUAL(1, found.size());
+	TEST_EQUAL(5000, dir.FindEntryByName(renamed)->GetObjectID());
+
+	// And the directory being read again
+	{
+		BackupStoreDirectory small(13, 98);
+		small.AddEntry(name5, 0, 7, 1,
+			BackupStoreDirectory::Entry::Flags_File, 0);
+		CollectInBufferStream stream;
+		small.WriteToStream(stream);
+		stream.SetForReading();
+		dir.ReadFromStream(stream, IOStream::TimeOutInfinite);
+	}
+	TEST_EQUAL(1, dir.GetNumberOfEntries());
+	TEST_THAT(dir.FindEntryByID(111) == 0);
+	TEST_EQUAL(7, dir.FindEntryByName(name5)->GetObjectID());
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+// Measure how long it takes to load, change and save directories of
+// different sizes, the way that bbstored does when files are uploaded
+// to them, and how long lookups take with and without the indexes.
+void benchmark_directory_operations()
+{
+#ifdef BOX_RELEASE_BUILD
+	const int max_entries = 1000000;
+#else
+	// The memory leak finder makes debug builds far too slow for more
+	const int max_entries = 100000;
+#endif
+	const int num_changes = 1000;
+	const int num_scans = 20;
+
+	printf("Directory benchmark\n");
+
+	for(int num_entries = 10000; num_entries <= max_entries;
+		num_entries *= 10)
+	{
+		CollectInBufferStream saved;
+		{
+			BackupStoreDirectory dir(12, 98);
+			for(int e = 0; e < num_entries; e++)
+			{
+				std::ostringstream name;
+				name << "file" << e;
+				dir.AddEntry(BackupStoreFilenameClear(name.str()),
+					0, e + 100, 1,
+					BackupStoreDirectory::Entry::Flags_File, 0);
+			}
+			dir.WriteToStream(saved);
+			saved.SetForReading();
+		}
+
+		// Each change looks up an existing file by name, marks it as
+		// an old version and adds a new one, like AddFile does, then
+		// deletes an entry, like housekeeping does.
+		box_time_t start = GetCurrentBoxTime();
+		BackupStoreDirectory dir(saved);
+		box_time_t loaded = GetCurrentBoxTime();
+		for(int c = 0; c < num_changes; c++)
+		{
+			int e = (int)(((int64_t)c * 7919) % num_entries);
+			std::ostringstream name;
+			name << "file" << e;
+			BackupStoreFilenameClear filename(name.str());
+			BackupStoreDirectory::Entry *en = dir.FindEntryByName(
+				filename, BackupStoreDirectory::Entry::Flags_File,
+				BackupStoreDirectory::Entry::Flags_OldVersion);
+			TEST_THAT_OR(en != 0, break);
+			en->AddFlags(BackupStoreDirectory::Entry::Flags_OldVersion);
+			dir.AddEntry(filename, 0, num_entries + 100 + c, 1,
+				BackupStoreDirectory::Entry::Flags_File, 0);
+			TEST_THAT_OR(dir.FindEntryByID(e + 100) == en, break);
+			dir.DeleteEntry(e + 100);
+		}
+		box_time_t changed = GetCurrentBoxTime();
+		CollectInBufferStream out;
+		dir.WriteToStream(out);
+		box_time_t finished = GetCurrentBoxTime();
+		TEST_EQUAL(num_entries, dir.GetNumberOfEntries());
+
+		// For comparison, look entries up by scanning the whole
+		// directory, which is how it was done before it was indexed.
+		box_time_t scan_start = GetCurrentBoxTime();
+		for(int s = 0; s < num_scans; s++)
+		{
+			int64_t id = num_entries + 100 + s;
+			BackupStoreDirectory::Iterator i(dir);
+			BackupStoreDirectory::Entry *en = 0;
+			while((en = i.Next()) != 0 && en->GetObjectID() != id)
+			{
+			}
+			TEST_THAT(en != 0);
+		}
+		box_time_t scan_taken = GetCurrentBoxTime() - scan_start;
+
+		printf("  %7d entries: load %6.1f ms, %d changes %6.1f ms, "
+			"save %6.1f ms; lookup by scan %8.2f us\n",
+			num_entries, (double)(loaded - start) / 1000.0,
+			num_changes, (double)(changed - loaded) / 1000.0,
+			(double)(finished - changed) / 1000.0,
+			(double)scan_taken / num_scans);
+	}
+}
+
 void write_test_file(int t)
 {
 	std::string filename("testfiles/test");
@@ -846,6 +1012,79 @@ bool test_temporary_refcount_db_is_independent()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+bool test_refcount_db_bulk_updates()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	std::auto_ptr<BackupStoreAccountDatabase> apAccounts(
+		BackupStoreAccountDatabase::Read("testfiles/accounts.txt"));
+	BackupStoreAccountDatabase::Entry account(
+		apAccounts->GetEntry(0x1234567));
+	std::auto_ptr<BackupStoreRefCountDatabase> temp(
+		BackupStoreRefCountDatabase::Create(account));
+
+	// Reserving space doesn't add any objects to the database
+	temp->Reserve(100000);
+	TEST_EQUAL(1, temp->GetLastObjectIDUsed());
+	TEST_CHECK_THROWS(temp->GetRefCount(2),
+		BackupStoreException, UnknownObjectRefCountRequested);
+
+	// Objects can be listed more than once, and beyond the reserved space
+	std::vector<int64_t> ids;
+	ids.push_back(5);
+	ids.push_back(3);
+	ids.push_back(5);
+	ids.push_back(200000);
+	temp->AddReferences(ids);
+	TEST_EQUAL(200000, temp->GetLastObjectIDUsed());
+	TEST_EQUAL(1, temp->GetRefCount(BACKUPSTORE_ROOT_DIRECTORY_ID));
+	TEST_EQUAL(0, temp->GetRefCount(2));
+	TEST_EQUAL(1, temp->GetRefCount(3));
+	TEST_EQUAL(2, temp->GetRefCount(5));
+	TEST_EQUAL(0, temp->GetRefCount(100000));
+	TEST_EQUAL(1, temp->GetRefCount(200000));
+	temp->Commit();
+
+	// The committed file must contain exactly the objects in the
+	// database, as that's how readers know how many there are.
+	int expected_size = 8 + (200000 * 4);
+	TEST_EQUAL(expected_size,
+		TestGetFileSize("testfiles/0_0/backup/01234567/refcount.rdb.rfw"));
+
+	std::auto_ptr<BackupStoreRefCountDatabase> perm(
+		BackupStoreRefCountDatabase::Load(account, true)); // ReadOnly
+	TEST_EQUAL(200000, perm->GetLastObjectIDUsed());
+	TEST_EQUAL(2, perm->GetRefCount(5));
+	TEST_EQUAL(1, perm->GetRefCount(200000));
+
+	// A reader must see objects added by a writer after it was loaded
+	std::auto_ptr<BackupStoreRefCountDatabase> writer(
+		BackupStoreRefCountDatabase::Load(account, false));
+	writer->AddReference(200005);
+	TEST_EQUAL(200005, perm->GetLastObjectIDUsed());
+	TEST_EQUAL(1, perm->GetRefCount(200005));
+	TEST_EQUAL(0, perm->GetRefCount(200004));
+
+	// Only the objects whose reference counts differ are reported
+	TEST_EQUAL(0, writer->ReportChangesTo(*perm));
+	temp = BackupStoreRefCountDatabase::Create(account);
+	temp->AddReferences(ids);
+	temp->AddReference(3);
+	// Objects 3 and 200005 differ
+	TEST_EQUAL(2, temp->ReportChangesTo(*perm));
+	TEST_EQUAL(1, temp->ReportChangesTo(*perm, 3));
+	temp->Discard();
+
+	perm.reset();
+	writer.reset();
+
+	// Put back an empty database, to match the empty store
+	temp = BackupStoreRefCountDatabase::Create(account);
+	temp->Commit();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_server_housekeeping()
 {
 	SETUP_TEST_BACKUPSTORE();
@@ -2232,6 +2471,397 @@ bool test_directory_parent_entry_tracks_directory_size()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+bool test_directory_cache_lru()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// Make a chain of directories, each containing the next one, so that
+	// the last one is the smallest.
+	BackupProtocolLocal2 protocol(0x01234567, "test", "backup/01234567/",
+		0, false);
+	int64_t dirA = create_directory(protocol);
+	int64_t dirB = create_directory(protocol, dirA);
+	int64_t dirC = create_directory(protocol, dirB);
+
+	BackupStoreContext bsContext(0x01234567, (HousekeepingInterface *)NULL,
+		"test");
+	bsContext.SetClientHasAccount("backup/01234567/", 0);
+	bsContext.SetDirectoryCacheMaxSize(1024*1024*1024);
+
+	bsContext.GetDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID);
+	bsContext.GetDirectory(dirA);
+	bsContext.GetDirectory(dirB);
+	TEST_EQUAL(0, bsContext.GetDirectoryCacheHits());
+	TEST_EQUAL(3, bsContext.GetDirectoryCacheMisses());
+	TEST_EQUAL(0, bsContext.GetDirectoryCacheEvictions());
+
+	// Using the root directory again makes dirA the least recently used
+	TEST_EQUAL(1, bsContext.GetDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID).
+		GetNumberOfEntries());
+	TEST_EQUAL(1, bsContext.GetDirectoryCacheHits());
+
+	// Shrink the cache to just fit what's in it. Loading dirC, which is
+	// smaller than dirA, should evict dirA and nothing else.
+	int64_t size = bsContext.GetDirectoryCacheSize();
+	TEST_THAT(size > 0);
+	bsContext.SetDirectoryCacheMaxSize(size);
+	bsContext.GetDirectory(dirC);
+	TEST_EQUAL(4, bsContext.GetDirectoryCacheMisses());
+	TEST_EQUAL(1, bsContext.GetDirectoryCacheEvictions());
+	TEST_THAT(bsContext.GetDirectoryCacheSize() <= size);
+
+	bsContext.GetDirectory(dirB);
+	bsContext.GetDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID);
+	TEST_EQUAL(3, bsContext.GetDirectoryCacheHits());
+	TEST_EQUAL(4, bsContext.GetDirectoryCacheMisses());
+
+	// Loading dirA again should evict dirC, the least recently used, which
+	// brings the size back to exactly the limit.
+	TEST_EQUAL(1, bsContext.GetDirectory(dirA).GetNumberOfEntries());
+	TEST_EQUAL(5, bsContext.GetDirectoryCacheMisses());
+	TEST_EQUAL(2, bsContext.GetDirectoryCacheEvictions());
+	TEST_EQUAL(size, bsContext.GetDirectoryCacheSize());
+
+	bsContext.GetDirectory(dirA);
+	bsContext.GetDirectory(dirB);
+	TEST_EQUAL(5, bsContext.GetDirectoryCacheHits());
+	TEST_EQUAL(0, bsContext.GetDirectory(dirC).GetNumberOfEntries());
+	TEST_EQUAL(6, bsContext.GetDirectoryCacheMisses());
+
+	// A cached directory which changes on disc is reloaded. Sleep to
+	// ensure that the directory file timestamp changes.
+	bsContext.SetDirectoryCacheMaxSize(1024*1024*1024);
+	TEST_EQUAL(1, bsContext.GetDirectory(dirB).GetNumberOfEntries());
+	TEST_EQUAL(6, bsContext.GetDirectoryCacheHits());
+	safe_sleep(1);
+	create_file(protocol, dirB);
+	TEST_EQUAL(2, bsContext.GetDirectory(dirB).GetNumberOfEntries());
+	TEST_EQUAL(6, bsContext.GetDirectoryCacheHits());
+	TEST_EQUAL(7, bsContext.GetDirectoryCacheMisses());
+
+	// A cache size of zero keeps only the directory just loaded
+	bsContext.SetDirectoryCacheMaxSize(0);
+	bsContext.GetDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID);
+	TEST_EQUAL(6, bsContext.GetDirectoryCacheHits());
+	bsContext.GetDirectory(dirA);
+	TEST_EQUAL(6, bsContext.GetDirectoryCacheHits());
+	TEST_EQUAL(9, bsContext.GetDirectoryCacheMisses());
+
+	protocol.QueryFinished();
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+bool test_uploads_verified_while_stored()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	BackupStoreContext bsContext(0x01234567, (HousekeepingInterface *)NULL,
+		"test");
+	bsContext.SetClientHasAccount("backup/01234567/", 0);
+	BackupProtocolLocal protocol(bsContext);
+	protocol.QueryVersion(BACKUP_STORE_SERVER_VERSION);
+	protocol.QueryLogin(0x01234567, 0);
+
+	// A valid file is stored, and never read back to verify it
+	write_test_file(0);
+	std::auto_ptr<IOStream> encoded(
+		BackupStoreFile::EncodeFile("testfiles/test0",
+			BACKUPSTORE_ROOT_DIRECTORY_ID, uploads[0].name));
+	CollectInBufferStream buf;
+	encoded->CopyStreamTo(buf);
+	buf.SetForReading();
+
+	std::auto_ptr<IOStream> upload(new MemBlockStream(buf.GetBuffer(),
+		buf.GetSize()));
+	std::auto_ptr<BackupProtocolSuccess> stored(protocol.QueryStoreFile(
+		BACKUPSTORE_ROOT_DIRECTORY_ID,
+		0,
+		0, /* use for attr hash too */
+		0, /* diff from ID */
+		uploads[0].name,
+		upload));
+	set_refcount(stored->GetObjectID(), 1);
+	TEST_EQUAL(buf.GetSize(), bsContext.GetVerifyReadBytesSaved());
+	TEST_THAT(check_num_files(1, 0, 0, 1));
+
+	// Uploads which aren't valid are rejected as they're received, and
+	// nothing is stored
+	upload.reset(new ZeroStream(1000));
+	TEST_COMMAND_RETURNS_ERROR(protocol, QueryStoreFile(
+			BACKUPSTORE_ROOT_DIRECTORY_ID,
+			0,
+			0, /* use for attr hash too */
+			0, /* diff from ID */
+			uploads[1].name,
+			upload),
+		Err_FileDoesNotVerify);
+
+	// Including ones which are only wrong at the end, in the block index
+	upload.reset(new MemBlockStream(buf.GetBuffer(), buf.GetSize() - 1));
+	TEST_COMMAND_RETURNS_ERROR(protocol, QueryStoreFile(
+			BACKUPSTORE_ROOT_DIRECTORY_ID,
+			0,
+			0, /* use for attr hash too */
+			0, /* diff from ID */
+			uploads[1].name,
+			upload),
+		Err_FileDoesNotVerify);
+
+	TEST_EQUAL(buf.GetSize(), bsContext.GetVerifyReadBytesSaved());
+	TEST_THAT(check_num_files(1, 0, 0, 1));
+
+	protocol.QueryFinished();
+	bsContext.ReleaseWriteLock();
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+bool test_deferred_raid_conversion()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	BackupStoreContext bsContext(0x01234567, (HousekeepingInterface *)NULL,
+		"test");
+	bsContext.SetClientHasAccount("backup/01234567/", 0);
+	bsContext.SetDeferRaidConversion(true);
+	BackupProtocolLocal protocol(bsContext);
+	protocol.QueryVersion(BACKUP_STORE_SERVER_VERSION);
+	protocol.QueryLogin(0x01234567, 0);
+
+	// Upload two files, and then a new version of the first, which
+	// moves the old one to a new object while it may still be queued
+	// for conversion
+	int64_t ids[3];
+	for(int i = 0; i < 3; i++)
+	{
+		write_test_file(i);
+		std::auto_ptr<IOStream> upload(
+			BackupStoreFile::EncodeFile(
+				std::string("testfiles/test") + uploads[i].fnextra,
+				BACKUPSTORE_ROOT_DIRECTORY_ID,
+				uploads[i % 2].name));
+		std::auto_ptr<BackupProtocolSuccess> stored(
+			protocol.QueryStoreFile(
+				BACKUPSTORE_ROOT_DIRECTORY_ID,
+				0,
+				0, /* use for attr hash too */
+				0, /* diff from ID */
+				uploads[i % 2].name,
+				upload));
+		ids[i] = stored->GetObjectID();
+
+		// Files can be read back before they've been converted
+		std::auto_ptr<RaidFileRead> file(get_raid_file(ids[i]));
+		TEST_THAT(file->GetFileSize() > 0);
+	}
+
+	// Finishing the session waits for all the conversions
+	protocol.QueryFinished();
+	bsContext.ReleaseWriteLock();
+
+	RaidFileDiscSet rdiscSet(
+		RaidFileController::GetController().GetDiscSet(0));
+	for(int i = 0; i < 3; i++)
+	{
+		std::string filename;
+		StoreStructure::MakeObjectFilename(ids[i],
+			"backup/01234567/" /* mStoreRoot */, 0 /* mStoreDiscSet */,
+			filename, false /* EnsureDirectoryExists */);
+		TEST_EQUAL_LINE(RaidFileUtil::AsRaid,
+			RaidFileUtil::RaidFileExists(rdiscSet, filename),
+			filename);
+	}
+
+	set_refcount(ids[0], 1);
+	set_refcount(ids[1], 1);
+	set_refcount(ids[2], 1);
+	TEST_THAT(check_num_files(2, 1, 0, 1));
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+bool test_block_dedup()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	BackupStoreContext bsContext(0x01234567, (HousekeepingInterface *)NULL,
+		"test");
+	bsContext.SetClientHasAccount("backup/01234567/", 0);
+	BackupProtocolLocal protocol(bsContext);
+	protocol.QueryVersion(BACKUP_STORE_SERVER_VERSION_BLOCK_DEDUP);
+	protocol.QueryLogin(0x01234567, 0);
+
+	// Upload a file, collecting the hashes of its blocks as it's encoded
+	write_test_file(2);
+	std::auto_ptr<BackupStoreFileEncodeStream> encoded(
+		BackupStoreFile::EncodeFile("testfiles/test2",
+			BACKUPSTORE_ROOT_DIRECTORY_ID, uploads[2].name));
+	encoded->CollectBlockHashes();
+	CollectInBufferStream buf;
+	encoded->CopyStreamTo(buf);
+	buf.SetForReading();
+	std::vector<file_BlockHash> hashes(encoded->GetBlockHashes());
+	TEST_THAT(hashes.size() > 1);
+
+	std::auto_ptr<IOStream> upload(new MemBlockStream(buf.GetBuffer(),
+		buf.GetSize()));
+	int64_t baseID = protocol.QueryStoreFile(
+		BACKUPSTORE_ROOT_DIRECTORY_ID,
+		0,
+		0, /* use for attr hash too */
+		0, /* diff from ID */
+		uploads[2].name,
+		upload)->GetObjectID();
+	set_refcount(baseID, 1);
+
+	// The same hashes are calculated without encoding the file
+	{
+		std::vector<file_BlockHash> calculated;
+		BackupStoreFile::CalculateBlockHashes("testfiles/test2",
+			calculated);
+		TEST_EQUAL(hashes.size(), calculated.size());
+		TEST_THAT(::memcmp(&hashes[0], &calculated[0],
+			hashes.size() * sizeof(file_BlockHash)) == 0);
+	}
+
+	// Nothing has been indexed yet
+	std::auto_ptr<IOStream> hashStream(new MemBlockStream(&hashes[0],
+		hashes.size() * sizeof(file_BlockHash)));
+	TEST_EQUAL(0, protocol.QueryFindBlocks(hashStream)->GetObjectID());
+	protocol.ReceiveStream();
+
+	// The store won't index a file with the wrong number of hashes
+	hashStream.reset(new MemBlockStream(&hashes[0],
+		(hashes.size() - 1) * sizeof(file_BlockHash)));
+	TEST_COMMAND_RETURNS_ERROR(protocol,
+		QueryAddBlockHashes(baseID, hashStream),
+		Err_FileDoesNotVerify);
+
+	hashStream.reset(new MemBlockStream(&hashes[0],
+		hashes.size() * sizeof(file_BlockHash)));
+	protocol.QueryAddBlockHashes(baseID, hashStream);
+
+	// Now all of them are found, in order
+	hashStream.reset(new MemBlockStream(&hashes[0],
+		hashes.size() * sizeof(file_BlockHash)));
+	TEST_EQUAL((int64_t)hashes.size(),
+		protocol.QueryFindBlocks(hashStream)->GetObjectID());
+	{
+		std::auto_ptr<IOStream> locations(protocol.ReceiveStream());
+		for(size_t b = 0; b < hashes.size(); ++b)
+		{
+			file_BlockLocation location;
+			TEST_THAT(locations->ReadFullBuffer(&location,
+				sizeof(location), 0, SHORT_TIMEOUT));
+			TEST_EQUAL(baseID, box_ntoh64(location.mObjectID));
+			TEST_EQUAL((int64_t)b, box_ntoh64(location.mBlockNumber));
+		}
+	}
+
+	// A copy of the file in another directory can be uploaded as a
+	// patch against it, which only refers to its blocks
+	int64_t subdirID = create_directory(protocol,
+		BACKUPSTORE_ROOT_DIRECTORY_ID);
+	protocol.QueryGetBlockIndexByID(baseID);
+	std::auto_ptr<IOStream> blockIndex(protocol.ReceiveStream());
+	bool isCompletelyDifferent = true;
+	std::auto_ptr<BackupStoreFileEncodeStream> patch(
+		BackupStoreFile::EncodeFileDiff("testfiles/test2", subdirID,
+			uploads[2].name, baseID, *blockIndex, SHORT_TIMEOUT,
+			NULL, /* DiffTimer */
+			NULL, /* pModificationTime */
+			&isCompletelyDifferent));
+	TEST_THAT(!isCompletelyDifferent);
+	TEST_THAT(patch->GetBytesToUpload() < buf.GetSize() / 4);
+
+	int64_t copyID = protocol.QueryStoreFile(subdirID,
+		0,
+		0, /* use for attr hash too */
+		baseID, /* diff from ID */
+		uploads[2].name,
+		static_cast< std::auto_ptr<IOStream> >(patch))->GetObjectID();
+	set_refcount(copyID, 1);
+
+	// Both are stored as complete files, and the original wasn't changed
+	TEST_EQUAL(0, bsContext.GetDirectory(subdirID).FindEntryByID(copyID)
+		->GetDependsNewer());
+	TEST_EQUAL(0, bsContext.GetDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID)
+		.FindEntryByID(baseID)->GetDependsNewer());
+	{
+		std::auto_ptr<IOStream> stream(bsContext.OpenObject(copyID));
+		test_test_file(2, *stream);
+		stream = bsContext.OpenObject(baseID);
+		test_test_file(2, *stream);
+	}
+
+	// Patches can't be diffed against, so aren't indexed
+	hashStream.reset(new MemBlockStream(&hashes[0],
+		hashes.size() * sizeof(file_BlockHash)));
+	TEST_COMMAND_RETURNS_ERROR(protocol,
+		QueryAddBlockHashes(BACKUPSTORE_ROOT_DIRECTORY_ID, hashStream),
+		Err_FileDoesNotVerify);
+
+	protocol.QueryFinished();
+	bsContext.ReleaseWriteLock();
+	TEST_THAT(check_num_files(2, 0, 0, 2));
+
+	// The index grows as blocks are added to it, and forgets the blocks
+	// of objects which no longer have any references when it does
+	{
+		BackupStoreAccountDatabase::Entry account(0x01234567, 0);
+		std::auto_ptr<BackupStoreDedupIndex> index(
+			BackupStoreDedupIndex::Load(account));
+		TEST_EQUAL((int64_t)hashes.size(), index->GetNumEntries());
+		int64_t initialSlots = index->GetNumSlots();
+
+		std::auto_ptr<BackupStoreRefCountDatabase> refcount(
+			BackupStoreRefCountDatabase::Load(account, true));
+
+		file_BlockHash hash;
+		::memset(&hash, 0, sizeof(hash));
+		int64_t toAdd = initialSlots * 2;
+		for(int64_t i = 0; i < toAdd; ++i)
+		{
+			::memcpy(hash.mHash, &i, sizeof(i));
+			// Object 1000 doesn't exist
+			index->Add(hash, (i < toAdd / 2) ? 1000 : copyID, i,
+				refcount.get());
+		}
+		TEST_THAT(index->GetNumSlots() > initialSlots);
+
+		int64_t objectID, blockNumber;
+		TEST_THAT(index->Find(hashes[1], objectID, blockNumber));
+		TEST_EQUAL(baseID, objectID);
+		TEST_EQUAL(1, blockNumber);
+		int64_t i = toAdd - 1;
+		::memcpy(hash.mHash, &i, sizeof(i));
+		TEST_THAT(index->Find(hash, objectID, blockNumber));
+		TEST_EQUAL(copyID, objectID);
+		TEST_EQUAL(toAdd - 1, blockNumber);
+		i = 0;
+		::memcpy(hash.mHash, &i, sizeof(i));
+		TEST_THAT(!index->Find(hash, objectID, blockNumber));
+
+		// Entries are only removed for the object they point to
+		TEST_THAT(!index->Remove(hashes[1], copyID));
+		TEST_THAT(index->Remove(hashes[1], baseID));
+		TEST_THAT(!index->Find(hashes[1], objectID, blockNumber));
+	}
+
+	// A corrupt index is replaced with an empty one
+	{
+		std::string filename("testfiles/0_0/backup/01234567/dedup.idx.rfw");
+		FileStream file(filename, O_WRONLY | O_TRUNC);
+		file.Write("corrupt", 7);
+	}
+	{
+		BackupStoreAccountDatabase::Entry account(0x01234567, 0);
+		std::auto_ptr<BackupStoreDedupIndex> index(
+			BackupStoreDedupIndex::Load(account));
+		TEST_EQUAL(0, index->GetNumEntries());
+	}
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_cannot_open_multiple_writable_connections()
 {
 	SETUP_TEST_BACKUPSTORE();
@@ -2276,6 +2906,250 @@ bool test_cannot_open_multiple_writable_connections()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+int get_num_root_entries(BackupProtocolCallable& protocol)
+{
+	protocol.QueryListDirectory(BACKUPSTORE_ROOT_DIRECTORY_ID,
+		BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+		BackupProtocolListDirectory::Flags_EXCLUDE_NOTHING,
+		false /* no attributes */);
+	BackupStoreDirectory dir(protocol.ReceiveStream(), SHORT_TIMEOUT);
+	return dir.GetNumberOfEntries();
+}
+
+std::string get_staged_filename(int64_t staged_id)
+{
+	std::string filename;
+	StoreStructure::MakeStagedFilename(staged_id, "backup/01234567/",
+		0 /* mStoreDiscSet */, filename);
+	return filename;
+}
+
+int64_t stage_test_file(BackupProtocolCallable& protocol, int t)
+{
+	write_test_file(t);
+	std::auto_ptr<IOStream> upload(
+		BackupStoreFile::EncodeFile(
+			std::string("testfiles/test") + uploads[t].fnextra,
+			BACKUPSTORE_ROOT_DIRECTORY_ID, uploads[t].name));
+	std::auto_ptr<BackupProtocolSuccess> staged(
+		protocol.QueryStageFile(upload));
+	return staged->GetObjectID();
+}
+
+bool test_data_channels()
+{
+	SETUP_TEST_BACKUPSTORE();
+	TEST_THAT_OR(StartServer(), FAIL);
+
+	std::auto_ptr<BackupProtocolCallable> apWritable =
+		connect_and_login(context, 0);
+
+	// Data channels don't need the write lock, so they can be opened
+	// alongside the read/write session
+	std::auto_ptr<BackupProtocolCallable> apChannel =
+		connect_to_bbstored(context);
+	apChannel->QueryLogin(0x01234567,
+		BackupProtocolLogin::Flags_DataChannel);
+
+	// A file uploaded on a data channel is staged, not stored
+	int64_t staged_id = stage_test_file(*apChannel, 0);
+	TEST_THAT(staged_id != 0);
+	TEST_THAT(FileExists(get_staged_filename(staged_id)));
+	TEST_EQUAL(0, get_num_root_entries(*apWritable));
+
+	// Until the read/write session stores it, which removes the
+	// staged file
+	std::auto_ptr<BackupProtocolSuccess> stored(
+		apWritable->QueryStoreStagedFile(BACKUPSTORE_ROOT_DIRECTORY_ID,
+			0x123456, 0x7890, staged_id, uploads[0].name));
+	int64_t stored_id = stored->GetObjectID();
+	set_refcount(stored_id, 1);
+	TEST_THAT(!FileExists(get_staged_filename(staged_id)));
+	TEST_EQUAL(1, get_num_root_entries(*apWritable));
+
+	apWritable->QueryGetFile(BACKUPSTORE_ROOT_DIRECTORY_ID, stored_id);
+	{
+		std::auto_ptr<IOStream> filestream(apWritable->ReceiveStream());
+		test_test_file(0, *filestream);
+	}
+
+	// Each staged file can only be stored once
+	TEST_COMMAND_RETURNS_ERROR(*apWritable,
+		QueryStoreStagedFile(BACKUPSTORE_ROOT_DIRECTORY_ID, 0, 0,
+			staged_id, uploads[1].name),
+		Err_DoesNotExist);
+
+	// Only data channels can stage files, and only read/write sessions
+	// can store them
+	{
+		write_test_file(1);
+		std::auto_ptr<IOStream> upload(
+			BackupStoreFile::EncodeFile("testfiles/test1",
+				BACKUPSTORE_ROOT_DIRECTORY_ID, uploads[1].name));
+		TEST_COMMAND_RETURNS_ERROR(*apWritable,
+			QueryStageFile(upload), Err_NotDataChannel);
+	}
+	staged_id = stage_test_file(*apChannel, 1);
+	TEST_COMMAND_RETURNS_ERROR(*apChannel,
+		QueryStoreStagedFile(BACKUPSTORE_ROOT_DIRECTORY_ID, 0, 0,
+			staged_id, uploads[1].name),
+		Err_SessionReadOnly);
+
+	// Files staged but never stored are removed by the next read/write
+	// login
+	apChannel->QueryFinished();
+	apWritable->QueryFinished();
+	TEST_THAT(FileExists(get_staged_filename(staged_id)));
+	::safe_sleep(1);
+	apWritable = connect_and_login(context, 0);
+	TEST_THAT(!FileExists(get_staged_filename(staged_id)));
+	TEST_EQUAL(1, get_num_root_entries(*apWritable));
+	apWritable->QueryFinished();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+bool test_threaded_server()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// This server handles all connections in one process, a command at
+	// a time, instead of forking for each one.
+	TEST_THAT_OR(StartServer("", "testfiles/bbstored_threaded.conf"), FAIL);
+
+	std::auto_ptr<BackupProtocolCallable> apWritable =
+		connect_and_login(context, 0);
+	std::auto_ptr<BackupProtocolCallable> apReadOnly =
+		connect_and_login(context, BackupProtocolLogin::Flags_ReadOnly);
+	TEST_EQUAL(0, get_num_root_entries(*apReadOnly));
+
+	// The read-only session must see the change, even though it read
+	// the root directory before, and it's in the shared cache
+	create_directory(*apWritable, BACKUPSTORE_ROOT_DIRECTORY_ID);
+	TEST_EQUAL(1, get_num_root_entries(*apReadOnly));
+
+	// Only one connection may write to the account at a time, even
+	// though they're all in the same process
+	{
+		std::auto_ptr<BackupProtocolCallable> apWritable2 =
+			connect_to_bbstored(context);
+		TEST_COMMAND_RETURNS_ERROR(*apWritable2,
+			QueryLogin(0x01234567, 0), Err_CannotLockStoreForWriting);
+		apWritable2->QueryFinished();
+	}
+
+	// Once the first has finished, another can write
+	apWritable->QueryFinished();
+	::safe_sleep(1);
+	apWritable = connect_and_login(context, 0);
+	TEST_EQUAL(1, get_num_root_entries(*apWritable));
+	apWritable->QueryFinished();
+	apReadOnly->QueryFinished();
+
+	// Lots of clients at once
+	TEST_RETURN(::system(BBSTORELOAD " -c testfiles/query.conf -Wwarning "
+		"-n 8 -s 3 -d 5"), 0);
+	TestRemoteProcessMemLeaks("bbstoreload.memleaks");
+	TEST_THAT(ServerIsAlive(bbstored_pid));
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+void queue_listing(BackupProtocolCallable& protocol, int64_t dir_id,
+	int64_t tag)
+{
+	protocol.SendQueued(BackupProtocolListDirectory(dir_id,
+		BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+		BackupProtocolListDirectory::Flags_EXCLUDE_NOTHING,
+		false /* no attributes */), tag);
+}
+
+int receive_queued_listing(BackupProtocolCallable& protocol,
+	int64_t expected_tag)
+{
+	int64_t tag;
+	std::auto_ptr<BackupProtocolMessage> apReply(
+		protocol.ReceiveQueued(tag));
+	TEST_EQUAL(expected_tag, tag);
+	TEST_EQUAL_OR(BackupProtocolSuccess::TypeID, apReply->GetType(),
+		return -1);
+	BackupStoreDirectory dir(protocol.ReceiveStream(), SHORT_TIMEOUT);
+	return dir.GetNumberOfEntries();
+}
+
+bool test_pipelined_commands()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// The local protocol always accepts queued commands
+	BackupProtocolLocal2 protocol(0x01234567, "test", "backup/01234567/",
+		0, false);
+	TEST_EQUAL((size_t)BACKUP_STORE_MAX_PIPELINED_COMMANDS,
+		protocol.GetMaxQueuedQueries());
+	int64_t subdirid = create_directory(protocol);
+
+	queue_listing(protocol, BACKUPSTORE_ROOT_DIRECTORY_ID, 10);
+	queue_listing(protocol, 0x7777, 11); // doesn't exist
+	queue_listing(protocol, subdirid, 12);
+	TEST_EQUAL(3, protocol.GetNumberOfQueuedQueries());
+
+	// Nothing else can be sent until the replies have been received
+	TEST_CHECK_THROWS(protocol.QueryGetIsAlive(), CommonException,
+		Internal);
+
+	// The replies come back in order, and an error reply is returned
+	// rather than thrown, so that the rest can still be received
+	TEST_EQUAL(1, receive_queued_listing(protocol, 10));
+	{
+		int64_t tag;
+		std::auto_ptr<BackupProtocolMessage> apReply(
+			protocol.ReceiveQueued(tag));
+		TEST_EQUAL(11, tag);
+		TEST_EQUAL(BackupProtocolError::TypeID, apReply->GetType());
+		int type, subType;
+		TEST_THAT(protocol.GetLastError(type, subType));
+		TEST_EQUAL(BackupProtocolError::Err_DoesNotExist, subType);
+	}
+	TEST_EQUAL(0, receive_queued_listing(protocol, 12));
+	TEST_EQUAL(0, protocol.GetNumberOfQueuedQueries());
+	protocol.QueryGetIsAlive();
+	protocol.QueryFinished();
+
+	// Over the network, pipelining must be agreed with the server first
+	TEST_THAT_OR(StartServer(), FAIL);
+	{
+		std::auto_ptr<BackupProtocolCallable> apClient =
+			connect_to_bbstored(context);
+		TEST_EQUAL(1, apClient->GetMaxQueuedQueries());
+		apClient->QueryFinished();
+	}
+
+	{
+		BackupProtocolClient client(open_conn("localhost", context));
+		TEST_COMMAND_RETURNS_ERROR(client, QueryVersion(0x7f),
+			Err_WrongVersion);
+		std::auto_ptr<BackupProtocolVersion> apVersion(
+			client.QueryVersion(BACKUP_STORE_SERVER_VERSION_PIPELINED));
+		TEST_EQUAL(BACKUP_STORE_SERVER_VERSION_PIPELINED,
+			apVersion->GetVersion());
+		client.QueryLogin(0x01234567, BackupProtocolLogin::Flags_ReadOnly);
+
+		for(int i = 0; i < 5; i++)
+		{
+			queue_listing(client,
+				(i % 2) ? subdirid : BACKUPSTORE_ROOT_DIRECTORY_ID, i);
+		}
+		for(int i = 0; i < 5; i++)
+		{
+			TEST_EQUAL(((i % 2) ? 0 : 1),
+				receive_queued_listing(client, i));
+		}
+		client.QueryFinished();
+	}
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_encoding()
 {
 	// Now test encoded files
@@ -2348,6 +3222,132 @@ bool test_encoding()
 			free(decoded);
 		}
 
+		// Encode and decode a series of chunks with the same compression
+		// context, which should only compress the compressible ones
+		// when adaptive, and all of them when not
+		for(int adaptive = 0; adaptive <= 1; ++adaptive)
+		{
+			#define CONTEXT_CHUNK_SIZE	(16*1024)
+			uint8_t *chunks[3];
+			chunks[0] = (uint8_t *)malloc(CONTEXT_CHUNK_SIZE);
+			chunks[1] = (uint8_t *)malloc(CONTEXT_CHUNK_SIZE);
+			chunks[2] = (uint8_t *)malloc(CONTEXT_CHUNK_SIZE);
+			for(int l = 0; l < CONTEXT_CHUNK_SIZE; ++l)
+			{
+				chunks[0][l] = ((uint8_t *)encfile)[l % sizeof(encfile)];
+			}
+			Random::Generate(chunks[1], CONTEXT_CHUNK_SIZE);
+			::memcpy(chunks[2], chunks[0], CONTEXT_CHUNK_SIZE);
+
+			BackupStoreFile::CompressionContext context(adaptive != 0);
+			BackupStoreFile::EncodingBuffer encoded;
+			encoded.Allocate(BackupStoreFile::MaxBlockSizeForChunkSize(CONTEXT_CHUNK_SIZE));
+			uint8_t *decoded = (uint8_t *)malloc(
+				BackupStoreFile::OutputBufferSizeForKnownOutputSize(CONTEXT_CHUNK_SIZE));
+
+			for(int c = 0; c < 3; ++c)
+			{
+				int encSize = BackupStoreFile::EncodeChunk(chunks[c],
+					CONTEXT_CHUNK_SIZE, encoded, &context);
+				bool compressed = ((encoded.mpBuffer[0] & 1) == 1);
+				bool expectCompressed = (!adaptive || c != 1);
+				TEST_EQUAL(expectCompressed, compressed);
+
+				int decSize = BackupStoreFile::DecodeChunk(encoded.mpBuffer,
+					encSize, decoded,
+					BackupStoreFile::OutputBufferSizeForKnownOutputSize(CONTEXT_CHUNK_SIZE));
+				TEST_EQUAL(CONTEXT_CHUNK_SIZE, decSize);
+				TEST_THAT(::memcmp(chunks[c], decoded, CONTEXT_CHUNK_SIZE) == 0);
+			}
+
+			free(decoded);
+			free(chunks[0]);
+			free(chunks[1]);
+			free(chunks[2]);
+		}
+
+		// Encode and decode a block with each compression codec
+		// which is available, checking that the header records it
+		for(int codec = 0; codec <= COMPRESS_CODEC_MAX; ++codec)
+		{
+			if(!CompressCodec::IsAvailable(codec))
+			{
+				continue;
+			}
+			BackupStoreFile::SetCompressionCodec(codec,
+				COMPRESS_CODEC_DEFAULT_LEVEL);
+
+			BackupStoreFile::EncodingBuffer encoded;
+			encoded.Allocate(BackupStoreFile::MaxBlockSizeForChunkSize(ENCFILE_SIZE));
+			int encSize = BackupStoreFile::EncodeChunk(encfile,
+				ENCFILE_SIZE, encoded);
+			TEST_THAT((encoded.mpBuffer[0] & 1) == 1);
+			TEST_EQUAL(codec, (encoded.mpBuffer[0] >>
+				HEADER_COMPRESSION_SHIFT));
+
+			int decBlockSize = BackupStoreFile::OutputBufferSizeForKnownOutputSize(ENCFILE_SIZE);
+			uint8_t *decoded = (uint8_t*)malloc(decBlockSize);
+			TEST_EQUAL(ENCFILE_SIZE, BackupStoreFile::DecodeChunk(
+				encoded.mpBuffer, encSize, decoded, decBlockSize));
+			TEST_THAT(::memcmp(encfile, decoded, ENCFILE_SIZE) == 0);
+
+			// A codec this build doesn't have is rejected
+			encoded.mpBuffer[0] |= (COMPRESS_CODEC_MAX + 1) <<
+				HEADER_COMPRESSION_SHIFT;
+			TEST_CHECK_THROWS(BackupStoreFile::DecodeChunk(
+				encoded.mpBuffer, encSize, decoded, decBlockSize),
+				BackupStoreException, ChunkHasUnknownCompression);
+
+			free(decoded);
+		}
+		BackupStoreFile::SetCompressionCodec(COMPRESS_CODEC_ZLIB,
+			COMPRESS_CODEC_DEFAULT_LEVEL);
+
+		// Encode and decode compressed and uncompressed blocks with
+		// authenticated encryption, and check that changes to any
+		// part of them are detected
+		BackupStoreFile::SetAuthenticatedEncryption(true);
+		for(int size = SMALL_BLOCK_SIZE; size <= ENCFILE_SIZE;
+			size += ENCFILE_SIZE - SMALL_BLOCK_SIZE)
+		{
+			BackupStoreFile::EncodingBuffer encoded;
+			encoded.Allocate(BackupStoreFile::MaxBlockSizeForChunkSize(size));
+			int encSize = BackupStoreFile::EncodeChunk(encfile, size,
+				encoded);
+			TEST_EQUAL(HEADER_AES_GCM_ENCODING,
+				((encoded.mpBuffer[0] >> HEADER_ENCODING_SHIFT) &
+				HEADER_ENCODING_MASK));
+
+			int decBlockSize = BackupStoreFile::OutputBufferSizeForKnownOutputSize(size);
+			uint8_t *decoded = (uint8_t*)malloc(decBlockSize);
+			TEST_EQUAL(size, BackupStoreFile::DecodeChunk(
+				encoded.mpBuffer, encSize, decoded, decBlockSize));
+			TEST_THAT(::memcmp(encfile, decoded, size) == 0);
+
+			// The header, the IV, the data and the tag
+			int offsets[] = {0, 1, encSize / 2, encSize - 1};
+			for(int o = 0; o < 4; ++o)
+			{
+				// Clearing the compressed flag doesn't stop
+				// the chunk being decrypted
+				uint8_t change = (o == 0) ?
+					HEADER_CHUNK_IS_COMPRESSED : 0x10;
+				if(o == 0 && (encoded.mpBuffer[0] & 1) == 0)
+				{
+					continue;
+				}
+				encoded.mpBuffer[offsets[o]] ^= change;
+				TEST_CHECK_THROWS(BackupStoreFile::DecodeChunk(
+					encoded.mpBuffer, encSize, decoded,
+					decBlockSize), CipherException,
+					AuthenticationFailed);
+				encoded.mpBuffer[offsets[o]] ^= change;
+			}
+
+			free(decoded);
+		}
+		BackupStoreFile::SetAuthenticatedEncryption(false);
+
 		// The test block to a file
 		{
 			FileStream f("testfiles/testenc1", O_WRONLY | O_CREAT);
@@ -2765,6 +3765,341 @@ bool test_housekeeping_deletes_files()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+int64_t run_housekeeping_with_journal(BackupStoreAccountDatabase::Entry&
+	rAccount, bool ExpectFullScan)
+{
+	HousekeepStoreAccount housekeeping(rAccount.GetID(),
+		BackupStoreAccounts::GetAccountRoot(rAccount),
+		rAccount.GetDiscSet(), NULL);
+	housekeeping.SetTimeBetweenFullScans(SecondsToBoxTime(86400));
+	TEST_THAT(housekeeping.DoHousekeeping(true /* keep trying forever */));
+	TEST_EQUAL(ExpectFullScan, housekeeping.WasFullScan());
+	return housekeeping.GetErrorCount();
+}
+
+bool test_housekeeping_with_journal()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	std::auto_ptr<BackupStoreAccountDatabase> apAccounts(
+		BackupStoreAccountDatabase::Read("testfiles/accounts.txt"));
+	BackupStoreAccountDatabase::Entry account =
+		apAccounts->GetEntry(0x1234567);
+
+	// There's no journal yet, so the whole account is scanned, and then
+	// a journal is started
+	TEST_THAT(BackupStoreJournal::Load(account).get() == NULL);
+	TEST_EQUAL(0, run_housekeeping_with_journal(account, true));
+	std::auto_ptr<BackupStoreJournal> apJournal =
+		BackupStoreJournal::Load(account);
+	TEST_THAT_OR(apJournal.get() != NULL, FAIL);
+	TEST_EQUAL(0, apJournal->GetEntries().size());
+
+	// Nothing has changed, so the next run doesn't scan anything
+	TEST_EQUAL(0, run_housekeeping_with_journal(account, false));
+
+	// Create some files and directories, and delete them, which the store
+	// records in the journal
+	{
+		BackupProtocolLocal2 protocolLocal(0x01234567, "test",
+			"backup/01234567/", 0, false); // Not read-only
+		write_test_file(1);
+		int64_t dirtodelete = create_test_data_subdirs(protocolLocal,
+			BACKUPSTORE_ROOT_DIRECTORY_ID, "test_delete",
+			6 /* depth */, NULL /* pRefCount */);
+		TEST_EQUAL(dirtodelete, protocolLocal.QueryDeleteDirectory(
+			dirtodelete)->GetObjectID());
+		protocolLocal.QueryFinished();
+	}
+
+	apJournal = BackupStoreJournal::Load(account);
+	TEST_THAT_OR(apJournal.get() != NULL, FAIL);
+	TEST_THAT(apJournal->GetEntries().size() > 0);
+	{
+		std::auto_ptr<BackupStoreInfo> info = BackupStoreInfo::Load(
+			0x1234567, "backup/01234567/", 0, true /* ReadOnly */);
+		TEST_EQUAL(info->GetBlocksUsed(), apJournal->GetBlocksUsed() +
+			apJournal->GetBlocksUsedDelta());
+	}
+
+	// Under the soft limit, nothing is removed, but housekeeping
+	// remembers where the old and deleted files are
+	TEST_EQUAL(0, run_housekeeping_with_journal(account, false));
+	apJournal = BackupStoreJournal::Load(account);
+	TEST_THAT_OR(apJournal.get() != NULL, FAIL);
+	TEST_THAT(apJournal->GetEntries().size() > 0);
+	for(std::vector<journal_Entry>::const_iterator
+		i = apJournal->GetEntries().begin();
+		i != apJournal->GetEntries().end(); ++i)
+	{
+		TEST_EQUAL(JOURNAL_ENTRY_CANDIDATE, i->mType);
+	}
+
+	recursive_count_objects_results before = {0,0,0};
+	recursive_count_objects(BACKUPSTORE_ROOT_DIRECTORY_ID, before);
+	TEST_THAT(before.deleted != 0);
+	TEST_THAT(before.old != 0);
+
+	// Over the soft limit, they are all found and removed without
+	// scanning the whole account
+	TEST_THAT(change_account_limits("0B", "20000B"));
+	TEST_EQUAL(0, run_housekeeping_with_journal(account, false));
+
+	recursive_count_objects_results after = {0,0,0};
+	recursive_count_objects(BACKUPSTORE_ROOT_DIRECTORY_ID, after);
+	TEST_EQUAL(before.objectsNotDel, after.objectsNotDel);
+	TEST_EQUAL(0, after.deleted);
+	TEST_EQUAL(0, after.old);
+
+	// The account is still consistent, and fixing it removes the journal
+	TEST_THAT(check_account());
+	TEST_THAT(BackupStoreJournal::Load(account).get() == NULL);
+	TEST_EQUAL(0, run_housekeeping_with_journal(account, true));
+
+	// A journal which doesn't account for all the space used isn't
+	// trusted
+	BackupStoreJournal::Create(account, GetCurrentBoxTime(), 0,
+		std::vector<journal_Entry>());
+	TEST_EQUAL(0, run_housekeeping_with_journal(account, true));
+	TEST_EQUAL(0, run_housekeeping_with_journal(account, false));
+
+	// Adjust reference counts on deleted files, so that the final checks in
+	// teardown_test_backupstore() don't fail.
+	ExpectedRefCounts.resize(2);
+	delete_account();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+int64_t run_housekeeping_with_packing(BackupStoreAccountDatabase::Entry&
+	rAccount, int64_t ExpectObjectsPacked)
+{
+	HousekeepStoreAccount housekeeping(rAccount.GetID(),
+		BackupStoreAccounts::GetAccountRoot(rAccount),
+		rAccount.GetDiscSet(), NULL);
+	housekeeping.SetPackObjectsSmallerThan(64 * 1024);
+	TEST_THAT(housekeeping.DoHousekeeping(true /* keep trying forever */));
+	TEST_EQUAL(ExpectObjectsPacked, housekeeping.GetObjectsPacked());
+	return housekeeping.GetErrorCount();
+}
+
+bool test_housekeeping_packs_small_objects()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	std::auto_ptr<BackupStoreAccountDatabase> apAccounts(
+		BackupStoreAccountDatabase::Read("testfiles/accounts.txt"));
+	BackupStoreAccountDatabase::Entry account =
+		apAccounts->GetEntry(0x1234567);
+	std::string root = BackupStoreAccounts::GetAccountRoot(account);
+
+	// Upload some small files, and one which is too big to pack
+	const int num_small_files = 8;
+	std::vector<int64_t> small_ids;
+	int64_t big_id = 0;
+	{
+		BackupProtocolLocal2 protocolLocal(0x01234567, "test",
+			"backup/01234567/", 0, false); // Not read-only
+		write_test_file(0);
+		write_test_file(2);
+
+		for(int i = 0; i <= num_small_files; i++)
+		{
+			std::ostringstream name;
+			name << "small" << i;
+			BackupStoreFilenameClear name_encoded(name.str());
+			std::auto_ptr<IOStream> upload(BackupStoreFile::EncodeFile(
+				(i < num_small_files) ? "testfiles/test0" :
+				"testfiles/test2", BACKUPSTORE_ROOT_DIRECTORY_ID,
+				name_encoded));
+			int64_t id = protocolLocal.QueryStoreFile(
+				BACKUPSTORE_ROOT_DIRECTORY_ID,
+				0x123456789abcdefLL, /* modification time */
+				0x7362383249872dfLL, /* attr hash */
+				0, /* diff from ID */
+				name_encoded, upload)->GetObjectID();
+			set_refcount(id, 1);
+			if(i < num_small_files)
+			{
+				small_ids.push_back(id);
+			}
+			else
+			{
+				big_id = id;
+			}
+		}
+		protocolLocal.QueryFinished();
+	}
+
+	// Housekeeping moves the small ones into the pack, and doesn't need
+	// to do it again
+	TEST_EQUAL(0, run_housekeeping_with_packing(account, num_small_files));
+	TEST_EQUAL(0, run_housekeeping_with_packing(account, 0));
+
+	std::string packFilename;
+	StoreStructure::MakePackFilename(small_ids[0], root, 0, packFilename);
+	TEST_THAT(RaidFileRead::FileExists(0, packFilename));
+	for(int i = 0; i < num_small_files; i++)
+	{
+		std::string fn;
+		StoreStructure::MakeObjectFilename(small_ids[i], root, 0, fn,
+			false /* don't make sure the dir exists */);
+		TEST_THAT(!RaidFileRead::FileExists(0, fn));
+		TEST_THAT(BackupStorePackFile::ObjectExists(0, root,
+			small_ids[i]));
+	}
+	{
+		std::string fn;
+		StoreStructure::MakeObjectFilename(big_id, root, 0, fn,
+			false /* don't make sure the dir exists */);
+		TEST_THAT(RaidFileRead::FileExists(0, fn));
+	}
+
+	// The packed files can still be downloaded, and the account checked
+	{
+		BackupProtocolLocal2 protocolLocal(0x01234567, "test",
+			"backup/01234567/", 0, true); // read-only
+		for(int i = 0; i < num_small_files; i++)
+		{
+			protocolLocal.QueryGetFile(BACKUPSTORE_ROOT_DIRECTORY_ID,
+				small_ids[i]);
+			test_test_file(0, *protocolLocal.ReceiveStream());
+		}
+		protocolLocal.QueryFinished();
+	}
+	TEST_THAT(check_account());
+
+	// Deleting one and removing it drops it from the pack
+	{
+		BackupProtocolLocal2 protocolLocal(0x01234567, "test",
+			"backup/01234567/", 0, false); // Not read-only
+		protocolLocal.QueryDeleteFile(BACKUPSTORE_ROOT_DIRECTORY_ID,
+			BackupStoreFilenameClear("small0"));
+		protocolLocal.QueryFinished();
+	}
+	TEST_THAT(change_account_limits("0B", "20000B"));
+	TEST_EQUAL(0, run_housekeeping_with_packing(account, 0));
+	TEST_THAT(!BackupStorePackFile::ObjectExists(0, root, small_ids[0]));
+	for(int i = 1; i < num_small_files; i++)
+	{
+		TEST_THAT(BackupStorePackFile::ObjectExists(0, root,
+			small_ids[i]));
+	}
+	TEST_THAT(check_account());
+
+	// A corrupt pack is found and removed by the check, along with the
+	// directory entries of the files in it
+	{
+		RaidFileWrite corrupt(0, packFilename);
+		corrupt.Open(true /* allow overwriting */);
+		corrupt.Write("not a pack", 10);
+		corrupt.Commit(true /* convert to RAID now */);
+	}
+	TEST_THAT(check_account_for_errors(Log::NOTHING) > 0);
+	TEST_THAT(!RaidFileRead::FileExists(0, packFilename));
+	TEST_THAT(check_account());
+
+	// Adjust reference counts on deleted files, so that the final checks in
+	// teardown_test_backupstore() don't fail.
+	ExpectedRefCounts.resize(2);
+	delete_account();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+HousekeepingScheduler::Account make_scheduled_account(int32_t AccountID,
+	int64_t BlocksUsed, int64_t BlocksSoftLimit, box_time_t LastRun)
+{
+	HousekeepingScheduler::Account account;
+	account.mAccountID = AccountID;
+	account.mDiscSet = 0;
+	account.mBlocksUsed = BlocksUsed;
+	account.mBlocksSoftLimit = BlocksSoftLimit;
+	account.mLastRun = LastRun;
+	account.mBlockSize = 4096;
+	return account;
+}
+
+bool test_housekeeping_scheduler()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// Accounts furthest over their soft limits go first, then those
+	// housekept longest ago
+	{
+		HousekeepingScheduler::Account under = make_scheduled_account(
+			1, 100, 200, 50);
+		HousekeepingScheduler::Account underOlder =
+			make_scheduled_account(2, 150, 200, 10);
+		HousekeepingScheduler::Account over = make_scheduled_account(
+			3, 300, 200, 100);
+		HousekeepingScheduler::Account furtherOver =
+			make_scheduled_account(4, 400, 200, 100);
+		TEST_THAT(HousekeepingScheduler::IsMoreUrgent(furtherOver, over));
+		TEST_THAT(HousekeepingScheduler::IsMoreUrgent(over, underOlder));
+		TEST_THAT(HousekeepingScheduler::IsMoreUrgent(underOlder, under));
+		TEST_THAT(!HousekeepingScheduler::IsMoreUrgent(under, underOlder));
+		TEST_THAT(!HousekeepingScheduler::IsMoreUrgent(under, under));
+	}
+
+	// Give the test account something to remove, and create another
+	{
+		BackupProtocolLocal2 protocolLocal(0x01234567, "test",
+			"backup/01234567/", 0, false); // Not read-only
+		write_test_file(1);
+		int64_t dirtodelete = create_test_data_subdirs(protocolLocal,
+			BACKUPSTORE_ROOT_DIRECTORY_ID, "test_delete",
+			4 /* depth */, NULL /* pRefCount */);
+		TEST_EQUAL(dirtodelete, protocolLocal.QueryDeleteDirectory(
+			dirtodelete)->GetObjectID());
+		protocolLocal.QueryFinished();
+	}
+	TEST_THAT(change_account_limits("0B", "20000B"));
+	TEST_THAT_OR(::system(BBSTOREACCOUNTS
+		" -c testfiles/bbstored.conf -Wwarning create 01234568 0 "
+		"10000B 20000B") == 0, FAIL);
+	TestRemoteProcessMemLeaks("bbstoreaccounts.memleaks");
+
+	// Housekeep both at once
+	HousekeepingScheduler scheduler;
+	scheduler.SetNumWorkers(4);
+	scheduler.AddAccount(0x01234567, "backup/01234567/", 0);
+	scheduler.AddAccount(0x01234568, "backup/01234568/", 0);
+	TEST_THAT(scheduler.Run(NULL));
+
+	const std::map<int32_t, HousekeepingScheduler::AccountStats>
+		&rstats(scheduler.GetStats());
+	TEST_EQUAL(2, rstats.size());
+	std::map<int32_t, HousekeepingScheduler::AccountStats>::const_iterator
+		i = rstats.find(0x01234567);
+	TEST_THAT_OR(i != rstats.end(), FAIL);
+	TEST_THAT(i->second.mCompleted);
+	TEST_THAT(i->second.mLastRun != 0);
+	TEST_THAT(i->second.mBytesReclaimed > 0);
+	i = rstats.find(0x01234568);
+	TEST_THAT_OR(i != rstats.end(), FAIL);
+	TEST_THAT(i->second.mCompleted);
+	TEST_EQUAL(0, i->second.mBytesReclaimed);
+
+	recursive_count_objects_results after = {0,0,0};
+	recursive_count_objects(BACKUPSTORE_ROOT_DIRECTORY_ID, after);
+	TEST_EQUAL(0, after.deleted);
+	TEST_EQUAL(0, after.old);
+	TEST_THAT(check_account());
+
+	TEST_THAT_OR(::system(BBSTOREACCOUNTS
+		" -c testfiles/bbstored.conf -Wwarning delete 01234568 yes") == 0,
+		FAIL);
+	TestRemoteProcessMemLeaks("bbstoreaccounts.memleaks");
+
+	// Adjust reference counts on deleted files, so that the final checks in
+	// teardown_test_backupstore() don't fail.
+	ExpectedRefCounts.resize(2);
+	delete_account();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_account_limits_respected()
 {
 	SETUP_TEST_BACKUPSTORE();
@@ -3290,11 +4625,21 @@ int test(int argc, const char *argv[])
 
 	TEST_THAT(test_filename_encoding());
 	TEST_THAT(test_temporary_refcount_db_is_independent());
+	TEST_THAT(test_refcount_db_bulk_updates());
 	TEST_THAT(test_bbstoreaccounts_create());
 	TEST_THAT(test_bbstoreaccounts_delete());
 	TEST_THAT(test_backupstore_directory());
+	TEST_THAT(test_directory_indexes());
+	benchmark_directory_operations();
 	TEST_THAT(test_directory_parent_entry_tracks_directory_size());
+	TEST_THAT(test_directory_cache_lru());
+	TEST_THAT(test_uploads_verified_while_stored());
+	TEST_THAT(test_deferred_raid_conversion());
+	TEST_THAT(test_block_dedup());
 	TEST_THAT(test_cannot_open_multiple_writable_connections());
+	TEST_THAT(test_threaded_server());
+	TEST_THAT(test_pipelined_commands());
+	TEST_THAT(test_data_channels());
 	TEST_THAT(test_encoding());
 	TEST_THAT(test_symlinks());
 	TEST_THAT(test_store_info());
@@ -3312,6 +4657,9 @@ int test(int argc, const char *argv[])
 	TEST_THAT(test_account_limits_respected());
 	TEST_THAT(test_multiple_uploads());
 	TEST_THAT(test_housekeeping_deletes_files());
+	TEST_THAT(test_housekeeping_with_journal());
+	TEST_THAT(test_housekeeping_packs_small_objects());
+	TEST_THAT(test_housekeeping_scheduler());
 	TEST_THAT(test_read_write_attr_streamformat());
 
 	return finish_test_suite();
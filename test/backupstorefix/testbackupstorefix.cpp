@@ -15,12 +15,14 @@
 #include <stdio.h>
 #include <string>
 #include <map>
+#include <sstream>
 
 #include "Test.h"
 #include "BackupClientCryptoKeys.h"
 #include "BackupProtocol.h"
 #include "BackupStoreAccounts.h"
 #include "BackupStoreCheck.h"
+#include "BackupStoreConfigVerify.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
 #include "BackupStoreException.h"
@@ -29,6 +31,8 @@
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreInfo.h"
 #include "BufferedWriteStream.h"
+#include "CollectInBufferStream.h"
+#include "Configuration.h"
 #include "FileStream.h"
 #include "IOStreamGetLine.h"
 #include "RaidFileController.h"
@@ -39,6 +43,7 @@
 #include "ServerControl.h"
 #include "StoreStructure.h"
 #include "StoreTestUtils.h"
+#include "Thread.h"
 #include "ZeroStream.h"
 
 #include "MemLeakFindOn.h"
@@ -445,6 +450,166 @@ void check_and_fix_root_dir(dir_en_check after_entries[],
 	check_root_dir_ok(after_entries, after_deps);
 }
 
+// Directories in the synthetic store for the check benchmark, each with one
+// directory of objects on disc. Raise this to benchmark a store of millions
+// of objects.
+#define CHECK_BENCHMARK_DIRS	64
+
+void write_benchmark_object(int64_t ObjectID, const std::string &rRootDir,
+	const void *pData, int Size, int64_t &rSizeInBlocksOut)
+{
+	std::string fn;
+	StoreStructure::MakeObjectFilename(ObjectID, rRootDir, discSetNum, fn,
+		true /* EnsureDirectoryExists */);
+	RaidFileWrite w(discSetNum, fn);
+	w.Open(true /* allow overwrite */);
+	w.Write(pData, Size);
+	rSizeInBlocksOut = w.GetDiscUsageInBlocks();
+	w.Commit(true /* convert now */);
+}
+
+int64_t run_benchmark_check(int32_t AccountID, const std::string &rRootDir,
+	int NumberOfThreads, box_time_t &rTimeOut)
+{
+	box_time_t start = GetCurrentBoxTime();
+	BackupStoreCheck check(rRootDir, discSetNum, AccountID,
+		false /* FixErrors */, true /* Quiet */);
+	check.SetNumberOfThreads(NumberOfThreads);
+	check.Check();
+	rTimeOut = GetCurrentBoxTime() - start;
+	return check.GetNumErrorsFound();
+}
+
+void benchmark_check_objects()
+{
+	int32_t accountID = 0x01234568;
+	std::string rootDir("backup/01234568/");
+	TEST_THAT_OR(::system(BBSTOREACCOUNTS " -c testfiles/bbstored.conf "
+		"-Wwarning create 01234568 0 1000000B 2000000B") == 0, return);
+	TestRemoteProcessMemLeaks("bbstoreaccounts.memleaks");
+
+	// Build the store directly: one directory in the root for each
+	// directory of objects on disc, holding the 255 small files after it
+	{
+		FileStream file("testfiles/check-benchmark",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		file.Write("benchmark", 9);
+	}
+
+	BackupStoreDirectory root;
+	{
+		std::string fn;
+		StoreStructure::MakeObjectFilename(
+			BACKUPSTORE_ROOT_DIRECTORY_ID, rootDir, discSetNum,
+			fn, false);
+		std::auto_ptr<RaidFileRead> r(RaidFileRead::Open(discSetNum,
+			fn));
+		root.ReadFromStream(*r, IOStream::TimeOutInfinite);
+	}
+
+	int numObjects = 1;
+	for(int d = 1; d <= CHECK_BENCHMARK_DIRS; ++d)
+	{
+		int64_t dirID = (int64_t)d << STORE_ID_SEGMENT_LENGTH;
+		BackupStoreDirectory dir(dirID, BACKUPSTORE_ROOT_DIRECTORY_ID);
+
+		CollectInBufferStream encoded;
+		{
+			BackupStoreFilename fn;
+			fn.SetAsClearFilename("file");
+			std::auto_ptr<BackupStoreFileEncodeStream> encode(
+				BackupStoreFile::EncodeFile(
+					"testfiles/check-benchmark", dirID, fn));
+			encode->CopyStreamTo(encoded);
+		}
+		encoded.SetForReading();
+
+		for(int f = 1; f < (1<<STORE_ID_SEGMENT_LENGTH); ++f)
+		{
+			int64_t size = 0;
+			write_benchmark_object(dirID | f, rootDir,
+				encoded.GetBuffer(), encoded.GetSize(), size);
+			std::ostringstream name;
+			name << "f" << f;
+			BackupStoreFilename fn;
+			fn.SetAsClearFilename(name.str().c_str());
+			dir.AddEntry(fn, 0, dirID | f, size,
+				BackupStoreDirectory::Entry::Flags_File, 0);
+		}
+
+		CollectInBufferStream dirData;
+		dir.WriteToStream(dirData);
+		dirData.SetForReading();
+		int64_t size = 0;
+		write_benchmark_object(dirID, rootDir, dirData.GetBuffer(),
+			dirData.GetSize(), size);
+		std::ostringstream name;
+		name << "d" << d;
+		BackupStoreFilename fn;
+		fn.SetAsClearFilename(name.str().c_str());
+		root.AddEntry(fn, 0, dirID, size,
+			BackupStoreDirectory::Entry::Flags_Dir, 0);
+		numObjects += (1<<STORE_ID_SEGMENT_LENGTH);
+	}
+
+	{
+		CollectInBufferStream rootData;
+		root.WriteToStream(rootData);
+		rootData.SetForReading();
+		int64_t size = 0;
+		write_benchmark_object(BACKUPSTORE_ROOT_DIRECTORY_ID, rootDir,
+			rootData.GetBuffer(), rootData.GetSize(), size);
+	}
+
+	// Let the check rebuild the store info and reference counts
+	{
+		std::string errs;
+		std::auto_ptr<Configuration> config(
+			Configuration::LoadAndVerify("testfiles/bbstored.conf",
+				&BackupConfigFileVerify, errs));
+		BackupStoreAccountsControl control(*config);
+		Logger::LevelGuard guard(Logging::GetConsole(), Log::ERROR);
+		control.CheckAccount(accountID, true /* FixErrors */,
+			true /* Quiet */);
+	}
+
+	printf("Store check benchmark, %d objects, %d processors\n",
+		numObjects, Thread::GetNumberOfProcessors());
+	for(int threads = 1; threads <= 8; threads *= 2)
+	{
+		box_time_t time;
+		TEST_EQUAL(0, run_benchmark_check(accountID, rootDir, threads,
+			time));
+		printf("  %d threads: %8.1f ms\n", threads,
+			BoxTimeToMicroSeconds(time) / 1000.0);
+	}
+
+	// Errors must be found the same way on many threads as on one
+	{
+		std::string fn;
+		StoreStructure::MakeObjectFilename(
+			((int64_t)CHECK_BENCHMARK_DIRS << STORE_ID_SEGMENT_LENGTH) |
+			7, rootDir, discSetNum, fn, false);
+		RaidFileWrite w(discSetNum, fn);
+		w.Open(true /* allow overwrite */);
+		w.Write("rubbish", 7);
+		w.Commit(true /* convert now */);
+	}
+	{
+		Logger::LevelGuard guard(Logging::GetConsole(), Log::FATAL);
+		box_time_t time;
+		int64_t errorsOnOne = run_benchmark_check(accountID, rootDir,
+			1, time);
+		TEST_THAT(errorsOnOne > 0);
+		TEST_EQUAL(errorsOnOne, run_benchmark_check(accountID, rootDir,
+			8, time));
+	}
+
+	TEST_THAT(::system(BBSTOREACCOUNTS " -c testfiles/bbstored.conf "
+		"-Wwarning delete 01234568 yes") == 0);
+	TestRemoteProcessMemLeaks("bbstoreaccounts.memleaks");
+}
+
 int test(int argc, const char *argv[])
 {
 	{
@@ -462,6 +627,10 @@ int test(int argc, const char *argv[])
 	rcontroller.Initialise("testfiles/raidfile.conf");
 	BackupClientCryptoKeys_Setup("testfiles/bbackupd.keys");
 
+	// Before the server is started, as its housekeeping would use the
+	// same temporary files as the check
+	benchmark_check_objects();
+
 	// Create an account
 	TEST_THAT_ABORTONFAIL(::system(BBSTOREACCOUNTS 
 		" -c testfiles/bbstored.conf "
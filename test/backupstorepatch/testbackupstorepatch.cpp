@@ -26,8 +26,10 @@
 #include "BackupStoreFilenameClear.h"
 #include "BackupStoreInfo.h"
 #include "BoxPortsAndFiles.h"
+#include "BoxTime.h"
 #include "CollectInBufferStream.h"
 #include "FileStream.h"
+#include "InvisibleTempFileStream.h"
 #include "MemBlockStream.h"
 #include "RaidFileController.h"
 #include "RaidFileException.h"
@@ -288,6 +290,331 @@ void test_depends_in_dirs()
 }
 
 
+#ifdef BOX_RELEASE_BUILD
+	#define COMBINE_BENCHMARK_FILE_SIZE	(64*1024*1024)
+#else
+	#define COMBINE_BENCHMARK_FILE_SIZE	(4*1024*1024)
+#endif
+
+// Copy a whole file, as the server does when it receives a diff
+void copy_file(const char *from, const char *to)
+{
+	FileStream in(from);
+	FileStream out(to, O_RDWR | O_CREAT | O_TRUNC);
+	in.CopyStreamTo(out);
+}
+
+// Measure how long the server takes to rebuild a large file from a small
+// diff and reverse the diff for the old version: the old way, through a
+// temporary copy of the diff, and in place in the file the diff was
+// received into. Both must produce exactly the same objects.
+void benchmark_diff_combine()
+{
+	// An old version of a file, and a new version with a small change
+	// in the middle of it
+	{
+		uint8_t *data = (uint8_t *)::malloc(COMBINE_BENCHMARK_FILE_SIZE
+			+ sizeof(int));
+		TEST_THAT(data != 0);
+		make_random_data(data, COMBINE_BENCHMARK_FILE_SIZE, 12);
+		{
+			FileStream out("testfiles/combine.bench",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			out.Write(data, COMBINE_BENCHMARK_FILE_SIZE);
+		}
+
+		BackupStoreFilenameClear name("combine.bench");
+		{
+			FileStream out("testfiles/combine.old",
+				O_WRONLY | O_CREAT | O_EXCL);
+			std::auto_ptr<IOStream> encoded(
+				BackupStoreFile::EncodeFile(
+					"testfiles/combine.bench",
+					1 /* dir ID */, name));
+			encoded->CopyStreamTo(out);
+		}
+
+		make_random_data(data + (COMBINE_BENCHMARK_FILE_SIZE / 2),
+			16*1024, 13);
+		{
+			FileStream out("testfiles/combine.bench",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			out.Write(data, COMBINE_BENCHMARK_FILE_SIZE);
+		}
+		::free(data);
+
+		FileStream blockindex("testfiles/combine.old");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+		FileStream out("testfiles/combine.diff",
+			O_WRONLY | O_CREAT | O_EXCL);
+		bool completelyDifferent = true;
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFileDiff(
+				"testfiles/combine.bench", 1 /* dir ID */, name,
+				1000 /* object ID of the file diffing from */,
+				blockindex, IOStream::TimeOutInfinite,
+				NULL /* DiffTimer */, 0, &completelyDifferent));
+		encoded->CopyStreamTo(out);
+		TEST_THAT(!completelyDifferent);
+	}
+
+	printf("Diff combine benchmark, %d MB file\n",
+		COMBINE_BENCHMARK_FILE_SIZE / (1024*1024));
+
+	// Through a temporary copy of the diff
+	box_time_t start = GetCurrentBoxTime();
+	bool spooledCompletelyDifferent = true;
+	{
+		copy_file("testfiles/combine.diff", "testfiles/combine.difftemp");
+		FileStream diff("testfiles/combine.difftemp");
+		FileStream diff2("testfiles/combine.difftemp");
+		FileStream from("testfiles/combine.old");
+		FileStream from2("testfiles/combine.old");
+		{
+			FileStream out("testfiles/combine.new.spooled",
+				O_WRONLY | O_CREAT | O_EXCL);
+			BackupStoreFile::CombineFile(diff, diff2, from, out);
+		}
+		FileStream out("testfiles/combine.rev.spooled",
+			O_WRONLY | O_CREAT | O_EXCL);
+		from.Seek(0, IOStream::SeekType_Absolute);
+		diff.Seek(0, IOStream::SeekType_Absolute);
+		BackupStoreFile::ReverseDiffFile(diff, from, from2, out,
+			1000, &spooledCompletelyDifferent);
+	}
+	box_time_t spooled = GetCurrentBoxTime() - start;
+
+	// In place
+	start = GetCurrentBoxTime();
+	bool inPlaceCompletelyDifferent = true;
+	{
+		copy_file("testfiles/combine.diff", "testfiles/combine.new.inplace");
+		FileStream diffAndOut("testfiles/combine.new.inplace", O_RDWR);
+		FileStream from("testfiles/combine.old");
+		FileStream out("testfiles/combine.rev.inplace",
+			O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineDiffInPlace(diffAndOut, from, out,
+			1000, &inPlaceCompletelyDifferent);
+	}
+	box_time_t inPlace = GetCurrentBoxTime() - start;
+
+	TEST_THAT(!spooledCompletelyDifferent);
+	TEST_THAT(!inPlaceCompletelyDifferent);
+	TEST_THAT(files_identical("testfiles/combine.new.spooled",
+		"testfiles/combine.new.inplace"));
+	TEST_THAT(files_identical("testfiles/combine.rev.spooled",
+		"testfiles/combine.rev.inplace"));
+
+	// And the result really is the new version
+	{
+		FileStream enc("testfiles/combine.new.inplace");
+		BackupStoreFile::DecodeFile(enc, "testfiles/combine.decoded",
+			IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/combine.bench",
+			"testfiles/combine.decoded"));
+	}
+
+	printf("  via temporary file: %8.1f ms\n", (double)spooled / 1000.0);
+	printf("  in place:           %8.1f ms\n", (double)inPlace / 1000.0);
+
+	const char *files[] = {"bench", "old", "diff", "difftemp",
+		"new.spooled", "rev.spooled", "new.inplace", "rev.inplace",
+		"decoded", 0};
+	for(int f = 0; files[f] != 0; ++f)
+	{
+		std::string filename("testfiles/combine.");
+		filename += files[f];
+		remove(filename.c_str());
+	}
+}
+
+#ifdef BOX_RELEASE_BUILD
+	#define CHAIN_BENCHMARK_FILE_SIZE	(16*1024*1024)
+#else
+	#define CHAIN_BENCHMARK_FILE_SIZE	(1024*1024)
+#endif
+#define CHAIN_BENCHMARK_VERSIONS	32
+#define CHAIN_BENCHMARK_CHANGE_SIZE	(16*1024)
+
+// Make a version of the file for the patch chain benchmark. Each version
+// has a small change from the one before, somewhere different each time.
+void make_chain_version(uint8_t *data, int version)
+{
+	make_random_data(data, CHAIN_BENCHMARK_FILE_SIZE, 20);
+	for(int v = 1; v <= version; ++v)
+	{
+		int offset = (int)(((int64_t)v * 7919 * 4096) %
+			(CHAIN_BENCHMARK_FILE_SIZE - 2 * CHAIN_BENCHMARK_CHANGE_SIZE));
+		make_random_data(data + offset, CHAIN_BENCHMARK_CHANGE_SIZE,
+			20 + v);
+	}
+}
+
+std::string chain_patch_filename(int version)
+{
+	std::ostringstream fn;
+	fn << "testfiles/chain.patch." << version;
+	return fn.str();
+}
+
+// Measure how long the server takes to send an old version of a
+// file, against the number of patches between it and the current version:
+// the old way, combining each patch in turn into a temporary file, and by
+// resolving the whole chain in one go. Both must send exactly the same
+// stream.
+void benchmark_patch_chain()
+{
+	uint8_t *data = (uint8_t *)::malloc(CHAIN_BENCHMARK_FILE_SIZE
+		+ sizeof(int));
+	TEST_THAT(data != 0);
+	BackupStoreFilenameClear name("chain.bench");
+
+	// Store the versions as the server does: the latest is a complete
+	// file, and each older version is a patch from the one after it.
+	make_chain_version(data, 0);
+	{
+		FileStream out("testfiles/chain.clear", O_WRONLY | O_CREAT | O_TRUNC);
+		out.Write(data, CHAIN_BENCHMARK_FILE_SIZE);
+	}
+	{
+		FileStream out("testfiles/chain.full", O_WRONLY | O_CREAT | O_TRUNC);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile(
+			"testfiles/chain.clear", 1 /* dir ID */, name));
+		encoded->CopyStreamTo(out);
+	}
+
+	for(int v = 1; v <= CHAIN_BENCHMARK_VERSIONS; ++v)
+	{
+		make_chain_version(data, v);
+		{
+			FileStream out("testfiles/chain.clear",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			out.Write(data, CHAIN_BENCHMARK_FILE_SIZE);
+		}
+
+		{
+			FileStream blockindex("testfiles/chain.full");
+			BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+			FileStream out("testfiles/chain.new",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			bool completelyDifferent = true;
+			std::auto_ptr<IOStream> encoded(
+				BackupStoreFile::EncodeFileDiff(
+					"testfiles/chain.clear", 1 /* dir ID */,
+					name, 1000 + v - 1, blockindex,
+					IOStream::TimeOutInfinite,
+					NULL /* DiffTimer */, 0,
+					&completelyDifferent));
+			encoded->CopyStreamTo(out);
+			TEST_THAT(!completelyDifferent);
+		}
+
+		{
+			FileStream diffAndOut("testfiles/chain.new", O_RDWR);
+			FileStream from("testfiles/chain.full");
+			FileStream reversed(chain_patch_filename(v - 1),
+				O_WRONLY | O_CREAT | O_TRUNC);
+			bool completelyDifferent = true;
+			BackupStoreFile::CombineDiffInPlace(diffAndOut, from,
+				reversed, 1000 + v, &completelyDifferent);
+			TEST_THAT(!completelyDifferent);
+		}
+		TEST_THAT(::rename("testfiles/chain.new", "testfiles/chain.full")
+			== 0);
+	}
+
+	printf("Patch chain benchmark, %d MB file\n",
+		CHAIN_BENCHMARK_FILE_SIZE / (1024*1024));
+
+	for(int length = 1; length <= CHAIN_BENCHMARK_VERSIONS; length *= 2)
+	{
+		int wanted = CHAIN_BENCHMARK_VERSIONS - length;
+
+		// Combining each patch in turn, as GetFile used to
+		box_time_t start = GetCurrentBoxTime();
+		{
+			std::auto_ptr<IOStream> from(
+				new FileStream("testfiles/chain.full"));
+			for(int p = CHAIN_BENCHMARK_VERSIONS - 1; p >= wanted; --p)
+			{
+				FileStream diff(chain_patch_filename(p));
+				FileStream diff2(chain_patch_filename(p));
+				std::ostringstream tempFn;
+				tempFn << "testfiles/chain.temp." << p;
+				std::auto_ptr<IOStream> combined(
+					new InvisibleTempFileStream(tempFn.str(),
+						O_RDWR | O_CREAT | O_EXCL | O_TRUNC));
+				BackupStoreFile::CombineFile(diff, diff2, *from,
+					*combined);
+				combined->Seek(0, IOStream::SeekType_Absolute);
+				from = combined;
+			}
+			std::auto_ptr<IOStream> stream(
+				BackupStoreFile::ReorderFileToStreamOrder(
+					from.release(), true));
+			FileStream out("testfiles/chain.out.combined",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			stream->CopyStreamTo(out);
+		}
+		box_time_t combined = GetCurrentBoxTime() - start;
+
+		// Resolving the chain
+		start = GetCurrentBoxTime();
+		{
+			std::vector<IOStream *> chain;
+			for(int p = wanted; p < CHAIN_BENCHMARK_VERSIONS; ++p)
+			{
+				chain.push_back(new FileStream(
+					chain_patch_filename(p)));
+			}
+			chain.push_back(new FileStream("testfiles/chain.full"));
+			std::auto_ptr<IOStream> stream(
+				BackupStoreFile::ResolvePatchChain(chain));
+			FileStream out("testfiles/chain.out.resolved",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			stream->CopyStreamTo(out);
+		}
+		box_time_t resolved = GetCurrentBoxTime() - start;
+
+		TEST_THAT(files_identical("testfiles/chain.out.combined",
+			"testfiles/chain.out.resolved"));
+
+		// And the result really is the version wanted
+		make_chain_version(data, wanted);
+		{
+			FileStream out("testfiles/chain.clear",
+				O_WRONLY | O_CREAT | O_TRUNC);
+			out.Write(data, CHAIN_BENCHMARK_FILE_SIZE);
+		}
+		{
+			FileStream enc("testfiles/chain.out.resolved");
+			::unlink("testfiles/chain.decoded");
+			BackupStoreFile::DecodeFile(enc, "testfiles/chain.decoded",
+				IOStream::TimeOutInfinite);
+			TEST_THAT(files_identical("testfiles/chain.clear",
+				"testfiles/chain.decoded"));
+		}
+
+		printf("  %2d patches: %8.1f ms combining, %8.1f ms resolved\n",
+			length, (double)combined / 1000.0,
+			(double)resolved / 1000.0);
+	}
+
+	::free(data);
+	const char *files[] = {"clear", "full", "out.combined", "out.resolved",
+		"decoded", 0};
+	for(int f = 0; files[f] != 0; ++f)
+	{
+		std::string filename("testfiles/chain.");
+		filename += files[f];
+		remove(filename.c_str());
+	}
+	for(int p = 0; p < CHAIN_BENCHMARK_VERSIONS; ++p)
+	{
+		remove(chain_patch_filename(p).c_str());
+	}
+}
+
 int test(int argc, const char *argv[])
 {
 	// Allocate a buffer
@@ -326,6 +653,10 @@ int test(int argc, const char *argv[])
 	
 	// Check the basic directory stuff works
 	test_depends_in_dirs();
+
+	// Rebuilding files from diffs, and how fast it is
+	benchmark_diff_combine();
+	benchmark_patch_chain();
 	
 	std::string storeRootDir;
 	int discSet = 0;
@@ -49,9 +49,13 @@
 #endif
 
 #include <map>
+#include <sstream>
 
 #include "BackupClientCryptoKeys.h"
+#include "BackupClientBlockIndexCache.h"
+#include "BackupClientChangeJournal.h"
 #include "BackupClientContext.h"
+#include "BackupClientDirectoryScanner.h"
 #include "BackupClientFileAttributes.h"
 #include "BackupClientInodeToIDMap.h"
 #include "BackupClientRestore.h"
@@ -67,6 +71,8 @@
 #include "BackupStoreException.h"
 #include "BackupStoreConfigVerify.h"
 #include "BackupStoreFileEncodeStream.h"
+#include "BackupStoreFileWire.h"
+#include "BackupStoreObjectMagic.h"
 #include "BoxPortsAndFiles.h"
 #include "BoxTime.h"
 #include "BoxTimeToUnix.h"
@@ -1984,6 +1990,43 @@ bool test_bbackupd_uploads_files()
 	TEARDOWN_TEST_BBACKUPD();
 }
 
+bool test_bbackupd_uploads_files_on_data_channels()
+{
+	SETUP_TEST_BBACKUPD();
+
+	// The same configuration, but with extra connections to upload on
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-channels.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string extra = "UploadConnections = 3\n";
+		out.Write(extra.c_str(), extra.size());
+	}
+
+	BackupDaemon bbackupd;
+	TEST_THAT_OR(prepare_test_with_client_daemon(bbackupd, true, true,
+		"testfiles/bbackupd-channels.conf"), FAIL);
+
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+	TEST_THAT(!TestFileExists("testfiles/notifyran.read-error.1"));
+
+	// Change some files, which are small enough to upload whole again
+	TEST_THAT(::unlink("testfiles/TestDir1/f1.dat") == 0);
+	{
+		FileStream out("testfiles/TestDir1/channel-test",
+			O_WRONLY | O_CREAT);
+		std::string data = "uploaded on a data channel";
+		out.Write(data.c_str(), data.size());
+	}
+	wait_for_operation(5, "files to be old enough");
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
 bool test_bbackupd_responds_to_connection_failure()
 {
 	SETUP_TEST_BBACKUPD();
@@ -4003,6 +4046,757 @@ bool test_backup_many_files()
 	TEARDOWN_TEST_BBACKUPD();
 }
 
+bool test_directory_scanner()
+{
+	SETUP_TEST_BBACKUPD();
+
+	std::string base("testfiles/scannertest");
+	TEST_EQUAL_LINE(0, mkdir(base.c_str(), 0755), base);
+	for(int i = 0; i < 3; i++)
+	{
+		std::string dir = base + "/d" + (char)('0' + i);
+		TEST_EQUAL_LINE(0, mkdir(dir.c_str(), 0755), dir);
+		for(int j = 0; j < 10; j++)
+		{
+			FileStream fs(dir + "/f" + (char)('0' + j),
+				O_CREAT | O_WRONLY);
+			fs.Write(dir.c_str(), dir.size());
+		}
+	}
+
+	{
+		// Reading a directory in the calling thread gives the entries
+		// in the same order as readdir(), with the same stat() results
+		std::string dir = base + "/d0";
+		BackupClientDirectoryScanner::Listing listing;
+		BackupClientDirectoryScanner::ReadDirectory(dir, listing);
+		TEST_EQUAL(0, listing.mOpenErrno);
+		TEST_EQUAL(12, listing.mEntries.size());
+
+		DIR *dirHandle = opendir(dir.c_str());
+		TEST_THAT_OR(dirHandle != NULL, FAIL);
+		struct dirent *en;
+		for(size_t i = 0; (en = readdir(dirHandle)) != NULL; i++)
+		{
+			TEST_THAT_OR(i < listing.mEntries.size(), break);
+			const BackupClientDirectoryScanner::Entry &rEntry(
+				listing.mEntries[i]);
+			TEST_EQUAL(en->d_name, rEntry.mName);
+			if(rEntry.mName == "." || rEntry.mName == "..")
+			{
+				TEST_THAT(!rEntry.mStatDone);
+				continue;
+			}
+
+			EMU_STRUCT_STAT st;
+			TEST_EQUAL(0, EMU_LSTAT((dir + "/" + rEntry.mName).c_str(),
+				&st));
+			TEST_THAT(rEntry.mStatDone);
+			TEST_EQUAL(0, rEntry.mStatErrno);
+			TEST_EQUAL(st.st_ino, rEntry.mStat.st_ino);
+			TEST_EQUAL(st.st_size, rEntry.mStat.st_size);
+		}
+		closedir(dirHandle);
+
+		BackupClientDirectoryScanner::Listing missing;
+		BackupClientDirectoryScanner::ReadDirectory(base + "/nonexistent",
+			missing);
+		TEST_EQUAL(ENOENT, missing.mOpenErrno);
+		TEST_EQUAL(0, missing.mEntries.size());
+	}
+
+	if(Thread::IsSupported())
+	{
+		BackupClientDirectoryScanner scanner(2);
+		TEST_EQUAL(2, scanner.GetNumberOfThreads());
+
+		// Not asked for, so the caller must read it
+		TEST_THAT(scanner.Get(base + "/d0").get() == NULL);
+
+		scanner.Prefetch(base + "/d0");
+		scanner.Prefetch(base + "/d1");
+		scanner.Prefetch(base + "/d2");
+		scanner.Prefetch(base + "/nonexistent");
+		scanner.Discard(base + "/d1");
+
+		// Give the threads a chance to read them all
+		::safe_sleep(1);
+
+		std::auto_ptr<BackupClientDirectoryScanner::Listing> apListing =
+			scanner.Get(base + "/d0");
+		TEST_THAT_OR(apListing.get() != NULL, FAIL);
+		TEST_EQUAL(0, apListing->mOpenErrno);
+		TEST_EQUAL(12, apListing->mEntries.size());
+
+		// Only once
+		TEST_THAT(scanner.Get(base + "/d0").get() == NULL);
+
+		// Discarded
+		TEST_THAT(scanner.Get(base + "/d1").get() == NULL);
+
+		apListing = scanner.Get(base + "/nonexistent");
+		TEST_THAT_OR(apListing.get() != NULL, FAIL);
+		TEST_EQUAL(ENOENT, apListing->mOpenErrno);
+
+		// d2 is left for the destructor to clean up
+	}
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+bool test_compact_inode_map()
+{
+	SETUP_TEST_BBACKUPD();
+
+	{
+		// A small map, written and read back in one go
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/compact.map", false, true,
+			BackupClientInodeToIDMap::Format_Compact);
+		TEST_EQUAL(BackupClientInodeToIDMap::Format_Compact,
+			map.GetFormat());
+		map.AddToMap(300, 1003, 2, "/whee/c");
+		map.AddToMap(100, 1001, 2, "/whee/a");
+		map.AddToMap(200, 1002, 2, "/whee/b");
+		// replaces the first entry for 100
+		map.AddToMap(100, 1004, 3, "/whee/d");
+
+		// Can't be read until it's been written
+		int64_t objid, dirid;
+		TEST_CHECK_THROWS(map.Lookup(100, objid, dirid),
+			BackupStoreException, InodeMapNotOpen);
+		map.Close();
+	}
+
+	{
+		// Opened in the format it was written in, by default
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/compact.map", true, false);
+		TEST_EQUAL(BackupClientInodeToIDMap::Format_Compact,
+			map.GetFormat());
+
+		int64_t objid, dirid;
+		std::string path;
+		TEST_THAT(map.Lookup(100, objid, dirid, &path));
+		TEST_EQUAL(1004, objid);
+		TEST_EQUAL(3, dirid);
+		TEST_EQUAL("/whee/d", path);
+		TEST_THAT(map.Lookup(300, objid, dirid, &path));
+		TEST_EQUAL(1003, objid);
+		TEST_EQUAL("/whee/c", path);
+		TEST_THAT(map.Lookup(200, objid, dirid));
+		TEST_EQUAL(1002, objid);
+		TEST_THAT(!map.Lookup(99, objid, dirid));
+		TEST_THAT(!map.Lookup(150, objid, dirid));
+		TEST_THAT(!map.Lookup(301, objid, dirid));
+
+		TEST_CHECK_THROWS(map.AddToMap(400, 1, 2, "x"),
+			BackupStoreException, InodeMapIsReadOnly);
+	}
+
+	{
+		// An empty one
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/compact-empty.map", false, true,
+			BackupClientInodeToIDMap::Format_Compact);
+		map.Close();
+		map.Open("testfiles/compact-empty.map", true, false);
+		int64_t objid, dirid;
+		TEST_THAT(!map.Lookup(0, objid, dirid));
+		TEST_THAT(!map.Lookup(1, objid, dirid));
+	}
+
+	{
+		// Enough records, in a shuffled order, to be written in
+		// several sorted runs and merged, with some replaced by
+		// records in later runs.
+		const int num_records = 250000;
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/compact-runs.map", false, true,
+			BackupClientInodeToIDMap::Format_Compact);
+		for(int i = 0; i < num_records; i++)
+		{
+			int64_t n = ((int64_t)i * 7919) % num_records;
+			map.AddToMap(n * 3 + 1, n + 10, n / 100,
+				std::string("/some/path/to/a/file/number/") +
+				(char)('a' + n % 26));
+		}
+		for(int i = 0; i < num_records; i += 1000)
+		{
+			map.AddToMap(i * 3 + 1, i + 20, 7, "replaced");
+		}
+		map.Close();
+		TEST_THAT(!TestFileExists("testfiles/compact-runs.map.runs"));
+
+		map.Open("testfiles/compact-runs.map", true, false);
+		for(int n = 0; n < num_records; n += 37)
+		{
+			int64_t objid, dirid;
+			std::string path;
+			TEST_THAT_OR(map.Lookup(n * 3 + 1, objid, dirid, &path),
+				break);
+			if(n % 1000 == 0)
+			{
+				TEST_EQUAL(n + 20, objid);
+				TEST_EQUAL(7, dirid);
+				TEST_EQUAL("replaced", path);
+			}
+			else
+			{
+				TEST_EQUAL(n + 10, objid);
+				TEST_EQUAL(n / 100, dirid);
+				TEST_EQUAL((char)('a' + n % 26),
+					path[path.size() - 1]);
+			}
+			TEST_THAT(!map.Lookup(n * 3 + 2, objid, dirid));
+		}
+	}
+
+	{
+		// A truncated map is reported as a database failure, so that
+		// the daemon deletes it and starts again
+		FileStream in("testfiles/compact.map");
+		std::string data(in.BytesLeftToRead(), '\0');
+		TEST_THAT(in.ReadFullBuffer(&data[0], data.size(), NULL));
+		FileStream out("testfiles/compact-truncated.map",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		out.Write(data.c_str(), data.size() - 1);
+		out.Close();
+
+		BackupClientInodeToIDMap map;
+		TEST_CHECK_THROWS(map.Open("testfiles/compact-truncated.map",
+			true, false), BackupStoreException, BerkelyDBFailure);
+	}
+
+	// And bbackupd can use them instead of qdbm
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-compact.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string extra = "CompactIDMaps = yes\n";
+		out.Write(extra.c_str(), extra.size());
+	}
+
+	BackupDaemon bbackupd;
+	TEST_THAT_OR(prepare_test_with_client_daemon(bbackupd, true, true,
+		"testfiles/bbackupd-compact.conf"), FAIL);
+
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	{
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/bbackupd-data/mnt_", true, false);
+		TEST_EQUAL(BackupClientInodeToIDMap::Format_Compact,
+			map.GetFormat());
+
+		EMU_STRUCT_STAT st;
+		TEST_EQUAL(0, EMU_LSTAT("testfiles/TestDir1/f1.dat", &st));
+		int64_t objid, dirid;
+		std::string path;
+		TEST_THAT(map.Lookup(st.st_ino, objid, dirid, &path));
+		TEST_EQUAL("testfiles/TestDir1/f1.dat", path);
+	}
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+// Compare the compact inode maps with the qdbm ones: how long it takes to
+// build a new map of the size made by backing up that many files, how big
+// it is on disk, and how long lookups take.
+void benchmark_inode_maps()
+{
+#ifdef BOX_RELEASE_BUILD
+	const int max_records = 1000000;
+#else
+	const int max_records = 100000;
+#endif
+	const int num_lookups = 100000;
+
+	printf("Inode map benchmark\n");
+
+	for(int num_records = 10000; num_records <= max_records;
+		num_records *= 10)
+	{
+		for(int f = 0; f < 2; f++)
+		{
+			BackupClientInodeToIDMap::Format format = (f == 0) ?
+				BackupClientInodeToIDMap::Format_Qdbm :
+				BackupClientInodeToIDMap::Format_Compact;
+			std::string filename = (f == 0) ?
+				"testfiles/benchmark-qdbm.map" :
+				"testfiles/benchmark-compact.map";
+			::unlink(filename.c_str());
+
+			// Inodes come in directory order, which isn't sorted
+			box_time_t start = GetCurrentBoxTime();
+			{
+				BackupClientInodeToIDMap map;
+				map.Open(filename.c_str(), false, true, format);
+				for(int i = 0; i < num_records; i++)
+				{
+					int64_t n = ((int64_t)i * 7919) % num_records;
+					std::ostringstream path;
+					path << "/home/user/dir" << (n / 100) <<
+						"/file" << n;
+					map.AddToMap(n * 2 + 1000, n + 100,
+						n / 100 + 2, path.str());
+				}
+				map.Close();
+			}
+			box_time_t built = GetCurrentBoxTime();
+
+			int64_t size = 0;
+			TEST_THAT(FileExists(filename, &size));
+
+			BackupClientInodeToIDMap map;
+			map.Open(filename.c_str(), true, false);
+			box_time_t opened = GetCurrentBoxTime();
+			for(int l = 0; l < num_lookups; l++)
+			{
+				int64_t n = ((int64_t)l * 104729) % num_records;
+				int64_t objid, dirid;
+				std::string path;
+				TEST_THAT_OR(map.Lookup(n * 2 + 1000, objid, dirid,
+					&path) && objid == n + 100, break);
+			}
+			box_time_t looked_up = GetCurrentBoxTime();
+			map.Close();
+
+			printf("  %7d records, %-7s: build %8.1f ms, %10lld "
+				"bytes, lookup %6.2f us\n", num_records,
+				(f == 0) ? "qdbm" : "compact",
+				(double)(built - start) / 1000.0,
+				(long long)size,
+				(double)(looked_up - opened) / num_lookups);
+			::unlink(filename.c_str());
+		}
+	}
+}
+
+// Make a block index in the form sent with a file, with entries of the
+// given encoded sizes (or references to blocks of another file, if <= 0)
+static void make_block_index(CollectInBufferStream &rIndex,
+	int64_t OtherFileID, const std::vector<int64_t> &rSizes)
+{
+	file_BlockIndexHeader hdr;
+	hdr.mMagicValue = htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
+	hdr.mOtherFileID = box_hton64(OtherFileID);
+	hdr.mEntryIVBase = box_hton64(1234);
+	hdr.mNumBlocks = box_hton64(rSizes.size());
+	rIndex.Reset();
+	rIndex.Write(&hdr, sizeof(hdr));
+	for(size_t i = 0; i < rSizes.size(); i++)
+	{
+		file_BlockIndexEntry en;
+		en.mEncodedSize = box_hton64(rSizes[i]);
+		memset(en.mEnEnc, i, sizeof(en.mEnEnc));
+		rIndex.Write(&en, sizeof(en));
+	}
+	rIndex.SetForReading();
+}
+
+static int64_t get_block_size(const CollectInBufferStream &rIndex, int Block)
+{
+	file_BlockIndexEntry en;
+	memcpy(&en, (const uint8_t *)rIndex.GetBuffer() +
+		sizeof(file_BlockIndexHeader) + Block * sizeof(en), sizeof(en));
+	return box_ntoh64(en.mEncodedSize);
+}
+
+bool test_block_index_cache()
+{
+	SETUP_TEST_BBACKUPD();
+
+	// Add a line to the config file to enable the cache
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-indexcache.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string extra = "BlockIndexCacheSize = 1\n";
+		out.Write(extra.c_str(), extra.size());
+	}
+
+	BackupDaemon bbackupd;
+	TEST_THAT_OR(prepare_test_with_client_daemon(bbackupd, true, true,
+		"testfiles/bbackupd-indexcache.conf"), FAIL);
+
+	const char *file = "testfiles/TestDir1/x1/dsfdsfs98.fd";
+
+	{
+		// The index sent at the end of an encoded file is kept, and
+		// can be cached as it is
+		std::auto_ptr<BackupStoreFileEncodeStream> encoded =
+			BackupStoreFile::EncodeFile(file, 2,
+				BackupStoreFilenameClear("dsfdsfs98.fd"));
+		TEST_EQUAL((void *)NULL, encoded->GetBlockIndex());
+		CollectInBufferStream upload;
+		encoded->CopyStreamTo(upload);
+		const CollectInBufferStream *pIndex = encoded->GetBlockIndex();
+		TEST_THAT_OR(pIndex != NULL, FAIL);
+		TEST_THAT(pIndex->GetSize() > (int)sizeof(file_BlockIndexHeader));
+		// It's the last thing in the stream
+		TEST_EQUAL(0, memcmp(pIndex->GetBuffer(),
+			(const uint8_t *)upload.GetBuffer() + upload.GetSize() -
+			pIndex->GetSize(), pIndex->GetSize()));
+
+		TEST_THAT(::mkdir("testfiles/indexcache", 0755) == 0);
+		BackupClientBlockIndexCache cache("testfiles/indexcache",
+			1024 * 1024, 0x01234567);
+		cache.Add(100, 2, 3000, *pIndex, NULL);
+		TEST_EQUAL(1, cache.GetNumberOfEntries());
+
+		CollectInBufferStream cached;
+		TEST_THAT(cache.Get(100, 2, 3000, cached));
+		TEST_EQUAL(pIndex->GetSize(), cached.GetSize());
+		TEST_EQUAL(0, memcmp(pIndex->GetBuffer(), cached.GetBuffer(),
+			cached.GetSize()));
+		TEST_THAT(!cache.Get(101, 2, 3000, cached));
+		TEST_EQUAL(1, cache.GetHits());
+		TEST_EQUAL(1, cache.GetMisses());
+
+		// Still there when it's opened again, but not for a
+		// different account
+		cache.Add(200, 2, 3000, *pIndex, NULL);
+		{
+			BackupClientBlockIndexCache cache2(
+				"testfiles/indexcache", 1024 * 1024,
+				0x01234567);
+			TEST_EQUAL(2, cache2.GetNumberOfEntries());
+			TEST_EQUAL(cache.GetSize(), cache2.GetSize());
+			TEST_THAT(cache2.Get(100, 2, 3000, cached));
+		}
+		{
+			BackupClientBlockIndexCache cache2(
+				"testfiles/indexcache", 1024 * 1024, 0x89abcdef);
+			TEST_THAT(!cache2.Get(100, 2, 3000, cached));
+			TEST_EQUAL(1, cache2.GetNumberOfEntries());
+		}
+		// which deleted it
+		TEST_THAT(!cache.Get(100, 2, 3000, cached));
+
+		// A different directory or modification time means that the
+		// object isn't the one that was cached, so it's removed
+		TEST_THAT(!cache.Get(200, 3, 3000, cached));
+		TEST_THAT(!cache.Get(200, 2, 3000, cached));
+		TEST_EQUAL(0, cache.GetNumberOfEntries());
+
+		// The least recently used ones are removed to keep it
+		// within the size limit
+		cache.Clear();
+		TEST_EQUAL(0, cache.GetSize());
+		cache.Add(1, 2, 3000, *pIndex, NULL);
+		int64_t entrySize = cache.GetSize();
+		BackupClientBlockIndexCache small("testfiles/indexcache",
+			entrySize * 3, 0x01234567);
+		small.Add(2, 2, 3000, *pIndex, NULL);
+		small.Add(3, 2, 3000, *pIndex, NULL);
+		TEST_THAT(small.Get(1, 2, 3000, cached));
+		small.Add(4, 2, 3000, *pIndex, NULL);
+		TEST_EQUAL(3, small.GetNumberOfEntries());
+		TEST_EQUAL(entrySize * 3, small.GetSize());
+		TEST_THAT(small.Get(1, 2, 3000, cached));
+		TEST_THAT(!small.Get(2, 2, 3000, cached));
+		TEST_THAT(small.Get(3, 2, 3000, cached));
+		TEST_THAT(small.Get(4, 2, 3000, cached));
+	}
+
+	{
+		// The store replaces references to the blocks of the file
+		// that a patch was made against with their sizes
+		std::vector<int64_t> sizes;
+		sizes.push_back(100);
+		sizes.push_back(200);
+		sizes.push_back(300);
+		CollectInBufferStream from;
+		make_block_index(from, 0, sizes);
+
+		sizes.clear();
+		sizes.push_back(-2);
+		sizes.push_back(50);
+		sizes.push_back(0);
+		CollectInBufferStream patch;
+		make_block_index(patch, 999, sizes);
+
+		CollectInBufferStream stored;
+		TEST_THAT(BackupClientBlockIndexCache::MakeStoredIndex(patch,
+			&from, stored));
+		TEST_EQUAL(patch.GetSize(), stored.GetSize());
+		file_BlockIndexHeader hdr;
+		memcpy(&hdr, stored.GetBuffer(), sizeof(hdr));
+		TEST_EQUAL(0, box_ntoh64(hdr.mOtherFileID));
+		TEST_EQUAL(3, box_ntoh64(hdr.mNumBlocks));
+		TEST_EQUAL(300, get_block_size(stored, 0));
+		TEST_EQUAL(50, get_block_size(stored, 1));
+		TEST_EQUAL(100, get_block_size(stored, 2));
+
+		// Not without the index of the other file, or if it refers
+		// to blocks that aren't in it
+		TEST_THAT(!BackupClientBlockIndexCache::MakeStoredIndex(patch,
+			NULL, stored));
+		sizes[0] = -3;
+		make_block_index(patch, 999, sizes);
+		TEST_THAT(!BackupClientBlockIndexCache::MakeStoredIndex(patch,
+			&from, stored));
+	}
+
+	// bbackupd caches the indexes of the files that it uploads, and
+	// uses them instead of the store's to send patches
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+	BackupClientBlockIndexCache *pCache = bbackupd.GetBlockIndexCache();
+	TEST_THAT_OR(pCache != NULL, FAIL);
+	TEST_THAT(pCache->GetNumberOfEntries() > 0);
+	TEST_EQUAL("testfiles/bbackupd-data" DIRECTORY_SEPARATOR
+		"blockindexcache", pCache->GetDirectory());
+
+	for(int i = 0; i < 2; i++)
+	{
+		{
+			FileStream out(file, O_WRONLY | O_APPEND);
+			char buffer[1000];
+			memset(buffer, 'a' + i, sizeof(buffer));
+			out.Write(buffer, sizeof(buffer));
+		}
+		wait_for_operation(5, "modified file to be old enough");
+
+		pCache->ResetStats();
+		bbackupd.RunSyncNow();
+		TEST_COMPARE(Compare_Same);
+		TEST_EQUAL(1, pCache->GetHits());
+		TEST_EQUAL(0, pCache->GetMisses());
+
+		// The cached index of the patched file is the same as the
+		// one that the store made
+		int64_t objectID, containerID;
+		{
+			BackupClientInodeToIDMap map;
+			map.Open("testfiles/bbackupd-data/mnt_", true, false);
+			EMU_STRUCT_STAT st;
+			TEST_EQUAL(0, EMU_LSTAT(file, &st));
+			TEST_THAT_OR(map.Lookup(st.st_ino, objectID,
+				containerID), FAIL);
+
+			CollectInBufferStream cached;
+			TEST_THAT_OR(pCache->Get(objectID, containerID,
+				FileModificationTime(st), cached), FAIL);
+
+			BackupProtocolLocal2 client(0x01234567, "test",
+				"backup/01234567/", 0, true);
+			client.QueryGetBlockIndexByID(objectID);
+			std::auto_ptr<IOStream> apIndex(client.ReceiveStream());
+			CollectInBufferStream stored;
+			apIndex->CopyStreamTo(stored);
+			client.QueryFinished();
+
+			TEST_EQUAL(stored.GetSize(), cached.GetSize());
+			TEST_EQUAL(0, memcmp(stored.GetBuffer(),
+				cached.GetBuffer(), cached.GetSize()));
+		}
+	}
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+bool test_deduplicate_blocks()
+{
+	SETUP_TEST_BBACKUPD();
+
+	// Add lines to the config file to look for blocks in other files,
+	// and to log whether files are uploaded as patches
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-dedup.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string extra = "DeduplicateBlocks = yes\n"
+			"LogAllFileAccess = yes\n";
+		out.Write(extra.c_str(), extra.size());
+	}
+
+	BackupDaemon bbackupd;
+	TEST_THAT_OR(prepare_test_with_client_daemon(bbackupd, true, true,
+		"testfiles/bbackupd-dedup.conf"), FAIL);
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+
+	// A copy of a file in a new directory is uploaded as a patch
+	// against the original
+	const char *copy = "testfiles/TestDir1/dedup-copy/dsfdsfs98.fd";
+	TEST_THAT(::mkdir("testfiles/TestDir1/dedup-copy", 0755) == 0);
+	{
+		FileStream in("testfiles/TestDir1/x1/dsfdsfs98.fd");
+		FileStream out(copy, O_WRONLY | O_CREAT | O_EXCL);
+		in.CopyStreamTo(out);
+	}
+	wait_for_operation(5, "copied file to be old enough");
+
+	{
+		Capture capture;
+		Logging::TempLoggerGuard guard(&capture);
+		bbackupd.RunSyncNow();
+
+		std::vector<Capture::Message> messages = capture.GetMessages();
+		bool uploadedPatch = false;
+		for(std::vector<Capture::Message>::iterator i = messages.begin();
+			i != messages.end(); i++)
+		{
+			if(StartsWith("Uploading patch to file: " +
+				std::string(copy), i->message))
+			{
+				uploadedPatch = true;
+			}
+		}
+		TEST_THAT(uploadedPatch);
+	}
+	TEST_COMPARE(Compare_Same);
+
+	// The store has indexed the blocks of both files
+	{
+		std::vector<file_BlockHash> hashes;
+		BackupStoreFile::CalculateBlockHashes(copy, hashes);
+		TEST_THAT_OR(!hashes.empty(), FAIL);
+
+		BackupProtocolLocal2 client(0x01234567, "test",
+			"backup/01234567/", 0, false);
+		std::auto_ptr<IOStream> hashStream(new MemBlockStream(
+			&hashes[0], hashes.size() * sizeof(file_BlockHash)));
+		TEST_EQUAL((int64_t)hashes.size(),
+			client.QueryFindBlocks(hashStream)->GetObjectID());
+		client.ReceiveStream();
+		client.QueryFinished();
+	}
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
+bool test_change_journal()
+{
+	SETUP_TEST_BBACKUPD();
+
+	// Add a line to the config file to enable the journal
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-journal.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string extra = "ChangeJournal = yes\n";
+		out.Write(extra.c_str(), extra.size());
+	}
+
+	BackupDaemon bbackupd;
+	TEST_THAT_OR(prepare_test_with_client_daemon(bbackupd, true, true,
+		"testfiles/bbackupd-journal.conf"), FAIL);
+
+	{
+		BackupClientChangeJournal journal;
+		const std::string dir("testfiles/TestDir1/x1");
+
+		// A directory might have changed before it was watched
+		TEST_THAT(!journal.IsChanged(dir));
+		box_time_t beforeWatch = GetCurrentBoxTime();
+		journal.Watch(dir);
+		TEST_EQUAL(1, journal.GetNumberOfWatches());
+		TEST_THAT(journal.IsChanged(dir));
+
+		// But not once a sync which ends after that has seen it
+		journal.MarkClean(dir, beforeWatch);
+		TEST_THAT(journal.IsChanged(dir));
+		journal.MarkClean(dir, GetCurrentBoxTime() + 1);
+		TEST_THAT(!journal.IsChanged(dir));
+
+		// Watching it again doesn't change anything
+		journal.Watch(dir);
+		TEST_EQUAL(1, journal.GetNumberOfWatches());
+		TEST_THAT(!journal.IsChanged(dir));
+
+		// Creating a file in it does
+		{
+			FileStream out(dir + "/journal-test",
+				O_WRONLY | O_CREAT | O_EXCL);
+		}
+		journal.ReadEvents();
+		TEST_THAT(journal.IsChanged(dir));
+		journal.MarkClean(dir, GetCurrentBoxTime() + 1);
+		TEST_THAT(::unlink((dir + "/journal-test").c_str()) == 0);
+		journal.ReadEvents();
+		TEST_THAT(journal.IsChanged(dir));
+
+		// A directory which failed to sync stays changed
+		journal.MarkFailed(dir);
+		journal.MarkClean(dir, GetCurrentBoxTime() + 1);
+		TEST_THAT(!journal.IsChanged(dir));
+
+		// The first sync must scan everything, but not the next one
+		TEST_THAT(journal.StartSync(GetCurrentBoxTime(),
+			SecondsToBoxTime(100)));
+		journal.FinishSync();
+		TEST_THAT(!journal.StartSync(GetCurrentBoxTime(),
+			SecondsToBoxTime(100)));
+		journal.FinishSync();
+		TEST_THAT(journal.StartSync(GetCurrentBoxTime() +
+			SecondsToBoxTime(200), SecondsToBoxTime(100)));
+		journal.FinishSync();
+		TEST_THAT(!journal.StartSync(GetCurrentBoxTime() +
+			SecondsToBoxTime(200), 0));
+		journal.FinishSync();
+	}
+
+	// The first sync scans everything, and watches all the directories
+	bbackupd.RunSyncNow();
+	TEST_COMPARE(Compare_Same);
+	int64_t numDirs = bbackupd.GetNumDirsScanned();
+	TEST_EQUAL(4, numDirs);
+	BackupClientChangeJournal *pJournal = bbackupd.GetChangeJournal();
+	TEST_THAT_OR(pJournal != NULL, FAIL);
+	TEST_EQUAL(numDirs, pJournal->GetNumberOfWatches());
+	TEST_EQUAL(0, pJournal->GetNumberOfChangedDirectories());
+
+	// Nothing has changed since, so nothing is scanned
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(0, bbackupd.GetNumDirsScanned());
+	TEST_COMPARE(Compare_Same);
+
+	// The inode map still has the files which weren't scanned, so that
+	// renames can be tracked
+	const char *file = "testfiles/TestDir1/x1/dsfdsfs98.fd";
+	{
+		BackupClientInodeToIDMap map;
+		map.Open("testfiles/bbackupd-data/mnt_", true, false);
+		EMU_STRUCT_STAT st;
+		TEST_EQUAL(0, EMU_LSTAT(file, &st));
+		int64_t objectID, containerID;
+		TEST_THAT(map.Lookup(st.st_ino, objectID, containerID));
+	}
+
+	// Only the directories above the one which changed are scanned
+	{
+		FileStream out("testfiles/TestDir1/x1/journal-test",
+			O_WRONLY | O_CREAT | O_EXCL);
+		out.Write("hello", 5);
+	}
+	wait_for_operation(5, "new file to be old enough");
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(2, bbackupd.GetNumDirsScanned());
+	TEST_COMPARE(Compare_Same);
+
+	// Moving a directory is noticed in both places, and everything in
+	// it is scanned again in the new one
+	TEST_THAT(::rename("testfiles/TestDir1/x1",
+		"testfiles/TestDir1/dir23/x1") == 0);
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(numDirs, bbackupd.GetNumDirsScanned());
+	TEST_COMPARE(Compare_Same);
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(0, bbackupd.GetNumDirsScanned());
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
 bool test_parse_incomplete_command()
 {
 	SETUP_TEST_BBACKUPD();
@@ -4263,6 +5057,7 @@ int test(int argc, const char *argv[])
 	TEST_THAT(test_backup_pauses_when_store_is_full());
 	TEST_THAT(test_bbackupd_exclusions());
 	TEST_THAT(test_bbackupd_uploads_files());
+	TEST_THAT(test_bbackupd_uploads_files_on_data_channels());
 	TEST_THAT(test_bbackupd_responds_to_connection_failure());
 	TEST_THAT(test_absolute_symlinks_not_followed_during_restore());
 	TEST_THAT(test_initially_missing_locations_are_not_forgotten());
@@ -4289,6 +5084,15 @@ int test(int argc, const char *argv[])
 	TEST_THAT(test_restore_deleted_files());
 	TEST_THAT(test_locked_file_behaviour());
 	TEST_THAT(test_backup_many_files());
+	TEST_THAT(test_directory_scanner());
+	TEST_THAT(test_compact_inode_map());
+	benchmark_inode_maps();
+	TEST_THAT(test_block_index_cache());
+	TEST_THAT(test_deduplicate_blocks());
+	if(BackupClientChangeJournal::IsSupported())
+	{
+		TEST_THAT(test_change_journal());
+	}
 	TEST_THAT(test_parse_incomplete_command());
 	TEST_THAT(test_parse_syncallowscript_output());
 	TEST_THAT(test_bbackupd_config_script());
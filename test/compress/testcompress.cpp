@@ -13,15 +13,20 @@
 #include <string.h>
 
 #include "Test.h"
+#include "BoxTime.h"
 #include "Compress.h"
+#include "CompressCodec.h"
 #include "CompressStream.h"
 #include "CollectInBufferStream.h"
+#include "autogen_CompressException.h"
 
 #include "MemLeakFindOn.h"
 
 #define DATA_SIZE			(1024*128+103)
 #define CHUNK_SIZE			2561
 #define DECOMP_CHUNK_SIZE	3
+#define CODEC_BENCHMARK_SIZE	(16*1024*1024)
+#define CODEC_BENCHMARK_CHUNK	(128*1024)
 
 // Stream for testing
 class CopyInToOutStream : public IOStream
@@ -167,6 +172,230 @@ int test_stream()
 	return 0;
 }
 
+// Test the codecs which compress whole buffers
+void test_codecs()
+{
+	TEST_THAT(CompressCodec::IsAvailable(COMPRESS_CODEC_ZLIB));
+	TEST_THAT(!CompressCodec::IsAvailable(COMPRESS_CODEC_MAX + 1));
+	TEST_EQUAL(COMPRESS_CODEC_ZSTD, CompressCodec::GetCodecByName("zstd"));
+	TEST_EQUAL(COMPRESS_CODEC_LZ4, CompressCodec::GetCodecByName("lz4"));
+	TEST_EQUAL(-1, CompressCodec::GetCodecByName("gzip"));
+	TEST_CHECK_THROWS(CompressCodec unknown(COMPRESS_CODEC_MAX + 1),
+		CompressException, CodecNotAvailable);
+
+	char *data = (char *)malloc(DATA_SIZE);
+	for(int l = 0; l < DATA_SIZE; ++l)
+	{
+		data[l] = (l / 7) * 23;
+	}
+	int maxOutput = CompressCodec::MaxCompressedSize(DATA_SIZE);
+	TEST_THAT(maxOutput >= Compress_MaxSizeForCompressedData(DATA_SIZE));
+	char *compressed = (char *)malloc(maxOutput);
+	char *decompressed = (char *)malloc(DATA_SIZE);
+
+	for(int codec = 0; codec <= COMPRESS_CODEC_MAX; ++codec)
+	{
+		if(!CompressCodec::IsAvailable(codec))
+		{
+			BOX_NOTICE("Codec " << CompressCodec::GetName(codec) <<
+				" is not available in this build");
+			continue;
+		}
+
+		CompressCodec compress(codec);
+
+		// The same context can be used over and over
+		for(int pass = 0; pass < 2; ++pass)
+		{
+			int size = compress.Compress(data, DATA_SIZE, compressed,
+				maxOutput);
+			TEST_THAT(size < DATA_SIZE / 4);
+			TEST_EQUAL(DATA_SIZE, CompressCodec::Decompress(codec,
+				compressed, size, decompressed, DATA_SIZE));
+			TEST_THAT(::memcmp(data, decompressed, DATA_SIZE) == 0);
+
+			// Truncated data, and data which doesn't fit in the
+			// output buffer, are rejected
+			TEST_CHECK_THROWS(CompressCodec::Decompress(codec,
+				compressed, size / 2, decompressed, DATA_SIZE),
+				CompressException, TransformFailed);
+			TEST_CHECK_THROWS(CompressCodec::Decompress(codec,
+				compressed, size, decompressed, DATA_SIZE - 1),
+				CompressException, TransformFailed);
+		}
+
+		// Incompressible data still fits in the output buffer
+		uint32_t state = 1;
+		for(int l = 0; l < DATA_SIZE; ++l)
+		{
+			state = state * 1664525 + 1013904223;
+			decompressed[l] = state >> 24;
+		}
+		int size = compress.Compress(decompressed, DATA_SIZE,
+			compressed, maxOutput);
+		TEST_THAT(size <= maxOutput);
+		TEST_EQUAL(DATA_SIZE, CompressCodec::Decompress(codec,
+			compressed, size, data, DATA_SIZE));
+		TEST_THAT(::memcmp(data, decompressed, DATA_SIZE) == 0);
+
+		// Put the compressible data back for the next codec
+		for(int l = 0; l < DATA_SIZE; ++l)
+		{
+			data[l] = (l / 7) * 23;
+		}
+	}
+
+	::free(data);
+	::free(compressed);
+	::free(decompressed);
+}
+
+// Fill a buffer with data like one of the kinds of files that are backed up
+static void make_benchmark_corpus(int Corpus, char *pData, int Size)
+{
+	static const char *words[] = {"the", "backup", "of", "a", "file",
+		"is", "stored", "encrypted", "on", "server", "and", "can",
+		"be", "restored", "when", "it", "changes", "only", "blocks",
+		"which", "are", "different", "uploaded", "to", "store"};
+	static const char *levels[] = {"INFO", "NOTICE", "WARNING", "TRACE"};
+	const int numWords = sizeof(words) / sizeof(words[0]);
+	uint32_t state = 12345;
+	#define NEXT_RANDOM (state = state * 1664525 + 1013904223, state >> 8)
+
+	int pos = 0;
+	while(pos < Size)
+	{
+		char line[256];
+		int length = 0;
+		switch(Corpus)
+		{
+		case 0: // prose or source code
+			length = ::snprintf(line, sizeof(line), "%s%s",
+				words[NEXT_RANDOM % numWords],
+				(NEXT_RANDOM % 12 == 0) ? ".\n" : " ");
+			break;
+		case 1: // log files
+			length = ::snprintf(line, sizeof(line),
+				"2026-10-18 %02d:%02d:%02d %s bbstored[%d]: "
+				"Connection from 10.0.%d.%d, account 0x%08x, "
+				"%d bytes in %d ms\n", (pos / 100000) % 24,
+				(pos / 1000) % 60, (pos / 20) % 60,
+				levels[NEXT_RANDOM % 4], 4000 + NEXT_RANDOM % 8,
+				NEXT_RANDOM % 4, NEXT_RANDOM % 256,
+				0x1234567 + NEXT_RANDOM % 16, NEXT_RANDOM % 100000,
+				NEXT_RANDOM % 1000);
+			break;
+		case 2: // database pages of fixed size records
+		{
+			int32_t record[8];
+			record[0] = pos / sizeof(record);
+			record[1] = NEXT_RANDOM % 1000;
+			record[2] = 0;
+			record[3] = 1792317667 + (pos / 4096);
+			record[4] = NEXT_RANDOM;
+			record[5] = record[6] = record[7] = 0;
+			length = sizeof(record);
+			::memcpy(line, record, length);
+			break;
+		}
+		default: // already compressed
+			uint32_t random = NEXT_RANDOM ^ (NEXT_RANDOM << 16);
+			length = sizeof(random);
+			::memcpy(line, &random, length);
+		}
+
+		if(length > Size - pos)
+		{
+			length = Size - pos;
+		}
+		::memcpy(pData + pos, line, length);
+		pos += length;
+	}
+
+	#undef NEXT_RANDOM
+}
+
+// Compare the codecs at a few levels, compressing the data in chunks of the
+// largest size that files are cut into
+void benchmark_codecs()
+{
+	static const char *corpora[] = {"text", "logs", "database", "random"};
+	static const struct {int codec; int level;} settings[] =
+	{
+		{COMPRESS_CODEC_ZLIB, 1},
+		{COMPRESS_CODEC_ZLIB, COMPRESS_CODEC_DEFAULT_LEVEL},
+		{COMPRESS_CODEC_ZSTD, 1},
+		{COMPRESS_CODEC_ZSTD, COMPRESS_CODEC_DEFAULT_LEVEL},
+		{COMPRESS_CODEC_ZSTD, 9},
+		{COMPRESS_CODEC_LZ4, COMPRESS_CODEC_DEFAULT_LEVEL}
+	};
+
+	char *data = (char *)malloc(CODEC_BENCHMARK_SIZE);
+	int maxOutput = CompressCodec::MaxCompressedSize(CODEC_BENCHMARK_CHUNK);
+	int numChunks = CODEC_BENCHMARK_SIZE / CODEC_BENCHMARK_CHUNK;
+	char *compressed = (char *)malloc(maxOutput * numChunks);
+	int *compressedSizes = (int *)malloc(numChunks * sizeof(int));
+	char *decompressed = (char *)malloc(CODEC_BENCHMARK_CHUNK);
+
+	printf("Codec benchmark, %d MB of each corpus in %d kB chunks\n",
+		CODEC_BENCHMARK_SIZE / (1024*1024), CODEC_BENCHMARK_CHUNK / 1024);
+	printf("  corpus   codec   level  ratio  compress  decompress\n");
+
+	for(size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); ++c)
+	{
+		make_benchmark_corpus(c, data, CODEC_BENCHMARK_SIZE);
+
+		for(size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); ++s)
+		{
+			if(!CompressCodec::IsAvailable(settings[s].codec))
+			{
+				continue;
+			}
+
+			CompressCodec compress(settings[s].codec, settings[s].level);
+			int64_t total = 0;
+			box_time_t start = GetCurrentBoxTime();
+			for(int n = 0; n < numChunks; ++n)
+			{
+				compressedSizes[n] = compress.Compress(
+					data + (n * CODEC_BENCHMARK_CHUNK),
+					CODEC_BENCHMARK_CHUNK,
+					compressed + (n * maxOutput), maxOutput);
+				total += compressedSizes[n];
+			}
+			box_time_t compressTime = GetCurrentBoxTime() - start;
+
+			start = GetCurrentBoxTime();
+			for(int n = 0; n < numChunks; ++n)
+			{
+				CompressCodec::Decompress(settings[s].codec,
+					compressed + (n * maxOutput),
+					compressedSizes[n], decompressed,
+					CODEC_BENCHMARK_CHUNK);
+			}
+			box_time_t decompressTime = GetCurrentBoxTime() - start;
+			TEST_THAT(::memcmp(decompressed, data + ((numChunks - 1) *
+				CODEC_BENCHMARK_CHUNK), CODEC_BENCHMARK_CHUNK) == 0);
+
+			if(compressTime < 1) compressTime = 1;
+			if(decompressTime < 1) decompressTime = 1;
+			double megabytes = (double)numChunks * CODEC_BENCHMARK_CHUNK /
+				(1024*1024);
+			printf("  %-8s %-6s %6d %5.1f%% %7.1f MB/s %7.1f MB/s\n",
+				corpora[c], CompressCodec::GetName(settings[s].codec),
+				compress.GetLevel(), (double)total * 100 /
+				((double)numChunks * CODEC_BENCHMARK_CHUNK),
+				megabytes * 1000000 / compressTime,
+				megabytes * 1000000 / decompressTime);
+		}
+	}
+
+	::free(data);
+	::free(compressed);
+	::free(compressedSizes);
+	::free(decompressed);
+}
+
 // Test basic interface
 int test(int argc, const char *argv[])
 {
@@ -257,6 +486,9 @@ int test(int argc, const char *argv[])
 	::free(data);
 	::free(compressed);
 	::free(decompressed);
-	
+
+	test_codecs();
+	benchmark_codecs();
+
 	return test_stream();
 }
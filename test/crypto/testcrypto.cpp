@@ -9,6 +9,7 @@
 
 #include "Box.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/rand.h>
 
@@ -16,8 +17,11 @@
 #include "CipherBlowfish.h"
 #include "CipherAES.h"
 #include "CipherException.h"
+#include "BoxTime.h"
 #include "CollectInBufferStream.h"
 #include "Guards.h"
+#include "MD5Digest.h"
+#include "MultiRollingChecksum.h"
 #include "RollingChecksum.h"
 #include "Random.h"
 #include "Test.h"
@@ -35,6 +39,9 @@
 #define CHECKSUM_BLOCK_SIZE_LAST	(CHECKSUM_BLOCK_SIZE_BASE + 64)
 #define CHECKSUM_ROLLS				16
 
+#define CIPHER_BENCHMARK_SIZE		(64*1024*1024)
+#define CIPHER_BENCHMARK_CHUNK		(128*1024)
+
 // Copied from BackupClientCryptoKeys.h
 #define BACKUPCRYPTOKEYS_FILENAME_KEY_START				0
 #define BACKUPCRYPTOKEYS_FILENAME_KEY_LENGTH			56
@@ -156,6 +163,26 @@ void test_cipher()
 		TEST_THAT(buf3_de_used == sizeof(STRING2));
 		TEST_THAT(memcmp(STRING2, buf3_de, sizeof(STRING2)) != 0);		
 	}
+
+	// Test copying a context, which should give the same results
+	{
+		CipherContext encrypt5;
+		encrypt5.Init(CipherContext::Encrypt, CipherType(CipherDescription::Mode_CBC, KEY, sizeof(KEY)));
+		CipherContext copy5;
+		copy5.Init(encrypt5);
+		TEST_CHECK_THROWS(copy5.Init(encrypt5), CipherException, AlreadyInitialised);
+
+		int ivLen;
+		char iv5[BLOCKSIZE];
+		memcpy(iv5, encrypt5.SetRandomIV(ivLen), BLOCKSIZE);
+		copy5.SetIV(iv5);
+
+		char buf5[256], buf5_copy[256];
+		int buf5_used = encrypt5.TransformBlock(buf5, sizeof(buf5), STRING2, sizeof(STRING2));
+		int buf5_copy_used = copy5.TransformBlock(buf5_copy, sizeof(buf5_copy), STRING2, sizeof(STRING2));
+		TEST_EQUAL(buf5_used, buf5_copy_used);
+		TEST_THAT(memcmp(buf5, buf5_copy, buf5_used) == 0);
+	}
 	
 	// Test with padding off.
 	{
@@ -256,6 +283,203 @@ void test_cipher()
 	}
 }
 
+#ifndef HAVE_OLD_SSL
+// Test AES-GCM, which authenticates the data as it encrypts it
+void test_authenticated_cipher()
+{
+	static const char key[32] = "0123456701234567012345670123456";
+	static const uint8_t header = 0x37;
+
+	CipherContext encrypt;
+	encrypt.Init(CipherContext::Encrypt, CipherAES(CipherDescription::Mode_GCM, key, sizeof(key)));
+	TEST_THAT(encrypt.IsAuthenticated());
+	TEST_EQUAL(12, encrypt.GetIVLength());
+
+	// Copies must work too, as each thread which encodes files has one
+	CipherContext copy;
+	copy.Init(encrypt);
+	TEST_THAT(copy.IsAuthenticated());
+
+	int ivLen;
+	char iv[16];
+	const void *randomIV = encrypt.SetRandomIV(ivLen);
+	memcpy(iv, randomIV, ivLen);
+	copy.SetIV(iv);
+
+	char buf[256], tag[CIPHERCONTEXT_AEAD_TAG_LENGTH];
+	encrypt.Begin();
+	encrypt.AddAuthenticatedData(&header, 1);
+	int e = encrypt.Transform(buf, sizeof(buf), STRING2, sizeof(STRING2) - 16);
+	e += encrypt.Transform(buf + e, sizeof(buf) - e, STRING2 + sizeof(STRING2) - 16, 16);
+	e += encrypt.Final(buf + e, sizeof(buf) - e);
+	encrypt.GetTag(tag);
+	// No padding in GCM
+	TEST_EQUAL((int)sizeof(STRING2), e);
+
+	char copyBuf[256], copyTag[CIPHERCONTEXT_AEAD_TAG_LENGTH];
+	copy.Begin();
+	copy.AddAuthenticatedData(&header, 1);
+	int c = copy.Transform(copyBuf, sizeof(copyBuf), STRING2, sizeof(STRING2));
+	c += copy.Final(copyBuf + c, sizeof(copyBuf) - c);
+	copy.GetTag(copyTag);
+	TEST_EQUAL(e, c);
+	TEST_THAT(memcmp(buf, copyBuf, e) == 0);
+	TEST_THAT(memcmp(tag, copyTag, sizeof(tag)) == 0);
+
+	// Tags are only for authenticated modes
+	CipherContext cbc;
+	cbc.Init(CipherContext::Encrypt, CipherAES(CipherDescription::Mode_CBC, key, sizeof(key)));
+	TEST_THAT(!cbc.IsAuthenticated());
+	TEST_CHECK_THROWS(cbc.GetTag(copyTag), CipherException, NotAuthenticatedCipher);
+
+	CipherContext decrypt;
+	decrypt.Init(CipherContext::Decrypt, CipherAES(CipherDescription::Mode_GCM, key, sizeof(key)));
+
+	// Decrypt it as it was, then with the data, the additional data,
+	// the tag and the IV changed in turn, which must all be rejected
+	for(int change = 0; change < 5; ++change)
+	{
+		char encrypted[256], decrypted[256];
+		memcpy(encrypted, buf, e);
+		char badTag[CIPHERCONTEXT_AEAD_TAG_LENGTH];
+		memcpy(badTag, tag, sizeof(tag));
+		char badIV[16];
+		memcpy(badIV, iv, ivLen);
+		uint8_t badHeader = header;
+		switch(change)
+		{
+			case 1: encrypted[e / 2] ^= 1; break;
+			case 2: badHeader ^= 0x20; break;
+			case 3: badTag[0] ^= 0x80; break;
+			case 4: badIV[ivLen - 1] ^= 1; break;
+		}
+
+		decrypt.SetIV(badIV);
+		decrypt.Begin();
+		decrypt.AddAuthenticatedData(&badHeader, 1);
+		decrypt.SetTag(badTag);
+		int d = decrypt.Transform(decrypted, sizeof(decrypted), encrypted, e);
+		if(change == 0)
+		{
+			d += decrypt.Final(decrypted + d, sizeof(decrypted) - d);
+			TEST_EQUAL((int)sizeof(STRING2), d);
+			TEST_THAT(memcmp(STRING2, decrypted, sizeof(STRING2)) == 0);
+		}
+		else
+		{
+			TEST_CHECK_THROWS(decrypt.Final(decrypted + d, sizeof(decrypted) - d),
+				CipherException, AuthenticationFailed);
+		}
+	}
+}
+#endif
+
+// Compare the speed of encrypting and decrypting chunks of file data with
+// each mode. CBC modes are followed by MD5, which file data is also hashed
+// with, as the nearest thing they have to the tag of an authenticated mode.
+void benchmark_ciphers()
+{
+	static const char key[32] = "0123456701234567012345670123456";
+	static const struct
+	{
+		const char *name;
+		bool aes;
+		CipherDescription::CipherMode mode;
+		bool md5;
+	} modes[] =
+	{
+		{"Blowfish-CBC + MD5", false, CipherDescription::Mode_CBC, true},
+#ifndef HAVE_OLD_SSL
+		{"AES256-CBC", true, CipherDescription::Mode_CBC, false},
+		{"AES256-CBC + MD5", true, CipherDescription::Mode_CBC, true},
+		{"AES256-GCM", true, CipherDescription::Mode_GCM, false},
+#endif
+	};
+
+	uint8_t *data = (uint8_t *)malloc(CIPHER_BENCHMARK_SIZE);
+	Random::Generate(data, CIPHER_BENCHMARK_SIZE);
+	int encodedSize = CIPHER_BENCHMARK_CHUNK + 64;
+	uint8_t *encoded = (uint8_t *)malloc(encodedSize);
+	uint8_t *decoded = (uint8_t *)malloc(encodedSize);
+	int numChunks = CIPHER_BENCHMARK_SIZE / CIPHER_BENCHMARK_CHUNK;
+	double megabytes = (double)CIPHER_BENCHMARK_SIZE / (1024*1024);
+
+	::printf("Cipher benchmark, %d MB in %d kB chunks\n",
+		CIPHER_BENCHMARK_SIZE / (1024*1024), CIPHER_BENCHMARK_CHUNK / 1024);
+	for(unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+	{
+		CipherContext encrypt, decrypt;
+#ifndef HAVE_OLD_SSL
+		if(modes[m].aes)
+		{
+			encrypt.Init(CipherContext::Encrypt, CipherAES(modes[m].mode, key, sizeof(key)));
+			decrypt.Init(CipherContext::Decrypt, CipherAES(modes[m].mode, key, sizeof(key)));
+		}
+		else
+#endif
+		{
+			encrypt.Init(CipherContext::Encrypt, CipherBlowfish(modes[m].mode, key, sizeof(key)));
+			decrypt.Init(CipherContext::Decrypt, CipherBlowfish(modes[m].mode, key, sizeof(key)));
+		}
+
+		uint8_t tag[CIPHERCONTEXT_AEAD_TAG_LENGTH];
+		box_time_t encryptTime = 0, decryptTime = 0;
+		for(int c = 0; c < numChunks; ++c)
+		{
+			const uint8_t *chunk = data + (c * CIPHER_BENCHMARK_CHUNK);
+
+			box_time_t start = GetCurrentBoxTime();
+			int ivLen;
+			decrypt.SetIV(encrypt.SetRandomIV(ivLen));
+			encrypt.Begin();
+			int e = encrypt.Transform(encoded, encodedSize, chunk, CIPHER_BENCHMARK_CHUNK);
+			e += encrypt.Final(encoded + e, encodedSize - e);
+			if(encrypt.IsAuthenticated())
+			{
+				encrypt.GetTag(tag);
+			}
+			if(modes[m].md5)
+			{
+				MD5Digest digest;
+				digest.Add(chunk, CIPHER_BENCHMARK_CHUNK);
+				digest.Finish();
+			}
+			box_time_t middle = GetCurrentBoxTime();
+
+			decrypt.Begin();
+			if(decrypt.IsAuthenticated())
+			{
+				decrypt.SetTag(tag);
+			}
+			int d = decrypt.Transform(decoded, encodedSize, encoded, e);
+			d += decrypt.Final(decoded + d, encodedSize - d);
+			if(modes[m].md5)
+			{
+				MD5Digest digest;
+				digest.Add(decoded, d);
+				digest.Finish();
+			}
+			box_time_t end = GetCurrentBoxTime();
+
+			TEST_EQUAL(CIPHER_BENCHMARK_CHUNK, d);
+			encryptTime += middle - start;
+			decryptTime += end - middle;
+		}
+		TEST_THAT(memcmp(decoded, data + ((numChunks - 1) * CIPHER_BENCHMARK_CHUNK),
+			CIPHER_BENCHMARK_CHUNK) == 0);
+
+		if(encryptTime < 1) encryptTime = 1;
+		if(decryptTime < 1) decryptTime = 1;
+		::printf("  %-20s encrypt %7.1f MB/s, decrypt %7.1f MB/s\n",
+			modes[m].name, megabytes * 1000000 / encryptTime,
+			megabytes * 1000000 / decryptTime);
+	}
+
+	::free(data);
+	::free(encoded);
+	::free(decoded);
+}
+
 int test(int argc, const char *argv[])
 {
 	Random::Initialise();
@@ -266,9 +490,12 @@ int test(int argc, const char *argv[])
 #ifndef HAVE_OLD_SSL
 	::printf("AES...\n");
 	test_cipher<CipherAES, 16>();
+	::printf("AES-GCM...\n");
+	test_authenticated_cipher();
 #else
 	::printf("Skipping AES -- not supported by version of OpenSSL in use.\n");
 #endif
+	benchmark_ciphers();
 	
 	// Test with known plaintext and ciphertext (correct algorithm used, etc)
 	{
@@ -371,6 +598,52 @@ int test(int argc, const char *argv[])
 	}
 	::free(checkdata_blk);
 
+	// Check that the multi-length checksums match the single ones, for
+	// few lengths (rolled one at a time) and many (rolled as vectors)
+	checkdata_blk = (uint8_t *)malloc(CHECKSUM_DATA_SIZE);
+	RAND_bytes(checkdata_blk, CHECKSUM_DATA_SIZE);
+	for(int numLengths = 1; numLengths <= MULTIROLLINGCHECKSUM_MAX_LENGTHS; numLengths *= 4)
+	{
+		int32_t lengths[MULTIROLLINGCHECKSUM_MAX_LENGTHS];
+		for(int l = 0; l < numLengths; ++l)
+		{
+			lengths[l] = CHECKSUM_BLOCK_SIZE_BASE - (l * 997);
+		}
+		MultiRollingChecksum multi(lengths, numLengths);
+		::printf("  %d lengths, %s\n", numLengths, multi.GetImplementationName());
+		for(int l = 0; l < numLengths; ++l)
+		{
+			multi.Initialise(l, checkdata_blk);
+		}
+
+		// Roll in uneven steps, to check partial groups of positions
+		static const int rolls[] = {CHECKSUM_ROLLS, CHECKSUM_ROLLS + 5, 3, 1};
+		int stride = multi.GetChecksumStride();
+		uint32_t *checksums = (uint32_t *)malloc(sizeof(uint32_t) * stride * (CHECKSUM_ROLLS + 5));
+		int start = 0;
+		for(unsigned int r = 0; r < sizeof(rolls) / sizeof(rolls[0]); ++r)
+		{
+			multi.RollForward(checkdata_blk + start, rolls[r], checksums);
+			for(int p = 0; p < rolls[r]; ++p)
+			{
+				for(int l = 0; l < numLengths; ++l)
+				{
+					RollingChecksum calc(checkdata_blk + start + p, lengths[l]);
+					TEST_THAT(calc.GetChecksum() == checksums[(p * stride) + l]);
+				}
+			}
+			start += rolls[r];
+		}
+		for(int l = 0; l < numLengths; ++l)
+		{
+			RollingChecksum calc(checkdata_blk + start, lengths[l]);
+			TEST_THAT(calc.GetChecksum() == multi.GetChecksum(l));
+			TEST_THAT(calc.GetComponentForHashing() == multi.GetComponentForHashing(l));
+		}
+		::free(checksums);
+	}
+	::free(checkdata_blk);
+
 	// Random integers
 	check_random_int(0);
 	check_random_int(1);
@@ -21,9 +21,11 @@
 
 #include "Test.h"
 #include "RaidFileController.h"
+#include "RaidFileConverter.h"
 #include "RaidFileWrite.h"
 #include "RaidFileException.h"
 #include "RaidFileRead.h"
+#include "RaidFileUtil.h"
 #include "Guards.h"
 #include "intercept.h"
 
@@ -575,6 +577,93 @@ void test_overwrites()
 }
 
 
+// Files big enough to be transformed in several chunks, written to the
+// discs one after another and in parallel
+void test_parallel_transform()
+{
+	#define TRANSFORM_CHUNK_SIZE (256 * RAID_BLOCK_SIZE)
+	#define LARGE_BLOCK_SIZE (3 * TRANSFORM_CHUNK_SIZE + 5)
+	MemoryBlockGuard<void*> largeblock(LARGE_BLOCK_SIZE);
+	R250 random(4891);
+	for(unsigned int l = 0; l < LARGE_BLOCK_SIZE; ++l)
+	{
+		((char*)(void*)largeblock)[l] = random.next() & 0xff;
+	}
+
+	static int largesize[] = {TRANSFORM_CHUNK_SIZE + 1,
+		2 * TRANSFORM_CHUNK_SIZE, 2 * TRANSFORM_CHUNK_SIZE + 4,
+		2 * TRANSFORM_CHUNK_SIZE + RAID_BLOCK_SIZE,
+		3 * TRANSFORM_CHUNK_SIZE - 9, LARGE_BLOCK_SIZE};
+	for(int parallel = 0; parallel <= 1; ++parallel)
+	{
+		RaidFileWrite::SetParallelTransform(parallel == 1);
+		for(unsigned int n = 0; n < (sizeof(largesize)/sizeof(largesize[0])); ++n)
+		{
+			char fn[64];
+			sprintf(fn, "testL%d_%d", largesize[n], parallel);
+			testReadWriteFile(n & 1, fn, largeblock, largesize[n]);
+		}
+	}
+	RaidFileWrite::SetParallelTransform(true);
+}
+
+// Conversion to RAID storage in the background
+void test_raidfile_converter()
+{
+	char data[3 * RAID_BLOCK_SIZE + 17];
+	R250 random(2217);
+	for(unsigned int l = 0; l < sizeof(data); ++l)
+	{
+		data[l] = random.next() & 0xff;
+	}
+
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	RaidFileDiscSet rdiscSet(rcontroller.GetDiscSet(0));
+
+	{
+		RaidFileConverter converter;
+
+		RaidFileWrite write1(0, "testConv1");
+		write1.Open();
+		write1.Write(data, sizeof(data));
+		write1.Commit(false);
+		converter.Add(0, "testConv1");
+
+		RaidFileWrite write2(0, "testConv2");
+		write2.Open();
+		write2.Write(data, sizeof(data));
+		write2.Commit(false);
+		converter.Add(0, "testConv2");
+
+		// Replacing a file which may still be queued converts the
+		// old version first, so that it can't overwrite the new one
+		RaidFileWrite write3(0, "testConv2");
+		write3.Open(true /* allow overwrite */);
+		write3.Write(data, sizeof(data) - 100);
+		write3.Commit(false);
+		TEST_THAT(RaidFileUtil::RaidFileExists(rdiscSet, "testConv2") ==
+			RaidFileUtil::NonRaid);
+		converter.Add(0, "testConv2");
+
+		// Until the converter is finished with them, files can still
+		// be read
+		{
+			std::auto_ptr<RaidFileRead> read(RaidFileRead::Open(0, "testConv2"));
+			TEST_THAT(read->GetFileSize() == sizeof(data) - 100);
+		}
+
+		converter.Finish();
+		TEST_THAT(converter.GetNumConverted() == 3);
+	}
+
+	TEST_THAT(RaidFileUtil::RaidFileExists(rdiscSet, "testConv1") ==
+		RaidFileUtil::AsRaid);
+	TEST_THAT(RaidFileUtil::RaidFileExists(rdiscSet, "testConv2") ==
+		RaidFileUtil::AsRaid);
+	testReadingFileContents(0, "testConv1", data, sizeof(data), true);
+	testReadingFileContents(0, "testConv2", data, sizeof(data) - 100, true);
+}
+
 int test(int argc, const char *argv[])
 {
 	#ifndef TRF_CAN_INTERCEPT
@@ -966,6 +1055,9 @@ int test(int argc, const char *argv[])
 		}
 	}
 	
+	test_parallel_transform();
+	test_raidfile_converter();
+
 	// Finally, a mega test (not necessary for every run, I would have thought)
 /*	unsigned int megamax = (1024*128) + 9;
 	MemoryBlockGuard<void*> megablock(megamax);